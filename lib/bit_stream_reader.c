@@ -25,6 +25,12 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 // make a complete decoder.
 //
 
+// Size of the buffer used to hold compressed data read from the
+// input callback. Reading in large blocks means the callback is
+// invoked rarely, rather than for every few bits.
+
+#define BIT_STREAM_BUFFER_SIZE  4096
+
 typedef struct {
 
 	// Callback function to invoke to read more data from the
@@ -34,10 +40,23 @@ typedef struct {
 	void *callback_data;
 
 	// Bits from the input stream that are waiting to be read.
+	// The next bit to be read is the top bit. Bits below the
+	// first 'bits' bits are either zero or a copy of the bits that
+	// will follow them in the stream.
 
-	uint32_t bit_buffer;
+	uint64_t bit_buffer;
 	unsigned int bits;
 
+	// Data read from the input callback that has not yet been
+	// moved into bit_buffer.
+
+	uint8_t input[BIT_STREAM_BUFFER_SIZE];
+	size_t input_pos, input_len;
+
+	// Total number of bytes read from the input callback.
+
+	uint64_t input_total;
+
 } BitStreamReader;
 
 // Initialize bit stream reader structure.
@@ -51,52 +70,99 @@ static void bit_stream_reader_init(BitStreamReader *reader,
 
 	reader->bits = 0;
 	reader->bit_buffer = 0;
+
+	reader->input_pos = 0;
+	reader->input_len = 0;
+	reader->input_total = 0;
 }
 
-// Return the next n bits waiting to be read from the input stream,
-// without removing any.  Returns -1 for failure.
+// Fast path for refilling bit_buffer: when there are at least eight
+// bytes in the input buffer, load all of them at once and top up
+// bit_buffer to between 56 and 63 bits.
 
-static int peek_bits(BitStreamReader *reader,
-                     unsigned int n)
+static void refill_bits_fast(BitStreamReader *reader)
 {
-	uint8_t buf[4];
-	unsigned int fill_bytes;
-	size_t bytes;
+	uint8_t *p;
+	uint64_t word;
 
-	if (n == 0) {
-		return 0;
-	}
+	p = reader->input + reader->input_pos;
 
-	// If there are not enough bits in the buffer to satisfy this
-	// request, we need to fill up the buffer with more bits.
+	word = ((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48)
+	     | ((uint64_t) p[2] << 40) | ((uint64_t) p[3] << 32)
+	     | ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16)
+	     | ((uint64_t) p[6] << 8) | (uint64_t) p[7];
+
+	// Bits beyond those counted in 'bits' are the bits that follow
+	// in the stream, so they are harmless to OR in here: they will be
+	// ORed in again with the same values when they are counted.
+
+	reader->bit_buffer |= word >> reader->bits;
+	reader->input_pos += (63 - reader->bits) >> 3;
+	reader->bits |= 56;
+}
+
+// Fill bit_buffer until it contains at least n bits. Returns zero if
+// the end of the input stream was reached first.
+
+static int refill_bits(BitStreamReader *reader, unsigned int n)
+{
+	size_t bytes;
 
 	while (reader->bits < n) {
 
-		// Maximum number of bytes we can fill?
+		if (reader->input_len - reader->input_pos >= 8) {
+			refill_bits_fast(reader);
+		} else if (reader->input_pos < reader->input_len) {
+
+			// Near the end of the input buffer; add a byte
+			// at a time.
+
+			reader->bit_buffer |=
+			    (uint64_t) reader->input[reader->input_pos]
+			    << (56 - reader->bits);
+			++reader->input_pos;
+			reader->bits += 8;
+		} else {
 
-		fill_bytes = (32 - reader->bits) / 8;
+			// Input buffer is empty; read another block.
 
-		// Read from input and fill bit_buffer.
+			bytes = reader->callback(reader->input,
+			                         sizeof(reader->input),
+			                         reader->callback_data);
 
-		memset(buf, 0, sizeof(buf));
-		bytes = reader->callback(buf, fill_bytes,
-		                         reader->callback_data);
+			// End of file?
 
-		// End of file?
+			if (bytes == 0) {
+				return 0;
+			}
 
-		if (bytes == 0) {
-			return -1;
+			reader->input_pos = 0;
+			reader->input_len = bytes;
+			reader->input_total += bytes;
 		}
+	}
+
+	return 1;
+}
 
-		reader->bit_buffer |= (uint32_t) buf[0] << (24 - reader->bits);
-		reader->bit_buffer |= (uint32_t) buf[1] << (16 - reader->bits);
-		reader->bit_buffer |= (uint32_t) buf[2] << (8 - reader->bits);
-		reader->bit_buffer |= (uint32_t) buf[3];
+// Return the next n bits waiting to be read from the input stream,
+// without removing any.  Returns -1 for failure.
 
-		reader->bits += bytes * 8;
+static int peek_bits(BitStreamReader *reader,
+                     unsigned int n)
+{
+	if (n == 0) {
+		return 0;
+	}
+
+	// If there are not enough bits in the buffer to satisfy this
+	// request, we need to fill up the buffer with more bits.
+
+	if (reader->bits < n && !refill_bits(reader, n)) {
+		return -1;
 	}
 
-	return (signed int) (reader->bit_buffer >> (32 - n));
+	return (signed int) (reader->bit_buffer >> (64 - n));
 }
 
 // Read a bit from the input stream.
@@ -120,9 +186,25 @@ static int read_bits(BitStreamReader *reader,
 
 // Read a bit from the input stream.
 // Returns -1 for failure.
+// Only decoders that define BIT_STREAM_WITH_READ_BIT get this function,
+// so that the others do not get an unused function warning.
 
+#ifdef BIT_STREAM_WITH_READ_BIT
 static int read_bit(BitStreamReader *reader)
 {
 	return read_bits(reader, 1);
 }
+#endif
+
+
+// Get the position of the next bit to be read, counted in bits from the
+// start of the input stream. Bits that have been read from the input
+// callback but not yet used are not counted.
+
+static uint64_t bit_stream_reader_position(BitStreamReader *reader)
+{
+	return reader->input_total * 8
+	     - (uint64_t) (reader->input_len - reader->input_pos) * 8
+	     - reader->bits;
+}
 
@@ -24,7 +24,45 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <inttypes.h>
 #include <stdlib.h>
 
+/**
+ * Update a CRC16 value with the contents of a buffer.
+ *
+ * @param crc        Pointer to the CRC value to update. To calculate
+ *                   the CRC of a new block of data, this is set to zero.
+ * @param buf        Pointer to the data.
+ * @param buf_len    Length of the data, in bytes.
+ */
+
 void lha_crc16_buf(uint16_t *crc, uint8_t *buf, size_t buf_len);
 
+/**
+ * Copy the contents of a buffer, updating a CRC16 value with the data
+ * as it is copied. This gives the same result as memcpy() followed by
+ * @ref lha_crc16_buf, but only reads the data once.
+ *
+ * @param crc        Pointer to the CRC value to update.
+ * @param dst        Pointer to the buffer to copy the data to. This must
+ *                   not overlap with the source buffer.
+ * @param buf        Pointer to the data.
+ * @param buf_len    Length of the data, in bytes.
+ */
+
+void lha_crc16_copy(uint16_t *crc, uint8_t *dst, uint8_t *buf,
+                    size_t buf_len);
+
+/**
+ * Combine the CRCs of two blocks of data, to give the CRC of the two
+ * blocks joined together. This allows the CRC of a stream to be
+ * calculated in independent chunks.
+ *
+ * @param crc_a      CRC of the first block of data.
+ * @param crc_b      CRC of the second block of data, calculated
+ *                   starting from zero.
+ * @param len_b      Length of the second block, in bytes.
+ * @return           CRC of the first block followed by the second.
+ */
+
+uint16_t lha_crc16_combine(uint16_t crc_a, uint16_t crc_b, size_t len_b);
+
 #endif /* #ifndef LHASA_LHA_CRC16_H */
 
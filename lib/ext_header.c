@@ -32,24 +32,6 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 // specific.
 //
 
-// Extended header types:
-
-#define LHA_EXT_HEADER_COMMON              0x00
-#define LHA_EXT_HEADER_FILENAME            0x01
-#define LHA_EXT_HEADER_PATH                0x02
-#define LHA_EXT_HEADER_MULTI_DISC          0x39
-#define LHA_EXT_HEADER_COMMENT             0x3f
-
-#define LHA_EXT_HEADER_WINDOWS_TIMESTAMPS  0x41
-
-#define LHA_EXT_HEADER_UNIX_PERMISSION     0x50
-#define LHA_EXT_HEADER_UNIX_UID_GID        0x51
-#define LHA_EXT_HEADER_UNIX_GROUP          0x52
-#define LHA_EXT_HEADER_UNIX_USER           0x53
-#define LHA_EXT_HEADER_UNIX_TIMESTAMP      0x54
-
-#define LHA_EXT_HEADER_OS9                 0xcc
-
 /**
  * Structure representing an extended header type.
  */
@@ -77,6 +59,13 @@ typedef struct {
 	/** Minimum length for a header of this type. */
 	size_t min_len;
 
+	/**
+	 * If non-zero, the header holds information that isn't needed
+	 * to identify the file, and decoding it can be deferred when
+	 * scanning through headers.
+	 */
+	int lazy;
+
 } LHAExtHeaderType;
 
 // Common header (0x00).
@@ -109,7 +98,8 @@ static int ext_header_common_decoder(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_common = {
 	LHA_EXT_HEADER_COMMON,
 	ext_header_common_decoder,
-	2
+	2,
+	0
 };
 
 // Filename header (0x01).
@@ -125,7 +115,7 @@ static int ext_header_filename_decoder(LHAFileHeader *header,
 	char *new_filename;
 	unsigned int i;
 
-	new_filename = malloc(data_len + 1);
+	new_filename = lha_file_header_alloc(header, data_len + 1);
 
 	if (new_filename == NULL) {
 		return 0;
@@ -144,7 +134,7 @@ static int ext_header_filename_decoder(LHAFileHeader *header,
 		}
 	}
 
-	free(header->filename);
+	lha_file_header_release(header, header->filename);
 	header->filename = new_filename;
 
 	return 1;
@@ -153,7 +143,8 @@ static int ext_header_filename_decoder(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_filename = {
 	LHA_EXT_HEADER_FILENAME,
 	ext_header_filename_decoder,
-	1
+	1,
+	0
 };
 
 // Path header (0x02).
@@ -169,7 +160,7 @@ static int ext_header_path_decoder(LHAFileHeader *header,
 	unsigned int i;
 	uint8_t *new_path;
 
-	new_path = malloc(data_len + 2);
+	new_path = lha_file_header_alloc(header, data_len + 2);
 
 	if (new_path == NULL) {
 		return 0;
@@ -188,7 +179,7 @@ static int ext_header_path_decoder(LHAFileHeader *header,
 		++data_len;
 	}
 
-	free(header->path);
+	lha_file_header_release(header, header->path);
 	header->path = (char *) new_path;
 
 	for (i = 0; i < data_len; ++i) {
@@ -203,7 +194,8 @@ static int ext_header_path_decoder(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_path = {
 	LHA_EXT_HEADER_PATH,
 	ext_header_path_decoder,
-	1
+	1,
+	0
 };
 
 // Windows timestamp header (0x41).
@@ -227,7 +219,8 @@ static int ext_header_windows_timestamps(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_windows_timestamps = {
 	LHA_EXT_HEADER_WINDOWS_TIMESTAMPS,
 	ext_header_windows_timestamps,
-	24
+	24,
+	1
 };
 
 
@@ -246,7 +239,8 @@ static int ext_header_unix_perms_decoder(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_unix_perms = {
 	LHA_EXT_HEADER_UNIX_PERMISSION,
 	ext_header_unix_perms_decoder,
-	2
+	2,
+	0
 };
 
 // Unix UID/GID header (0x51).
@@ -265,7 +259,8 @@ static int ext_header_unix_uid_gid_decoder(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_unix_uid_gid = {
 	LHA_EXT_HEADER_UNIX_UID_GID,
 	ext_header_unix_uid_gid_decoder,
-	4
+	4,
+	0
 };
 
 // Unix username header (0x53).
@@ -279,7 +274,7 @@ static int ext_header_unix_username_decoder(LHAFileHeader *header,
 {
 	char *username;
 
-	username = malloc(data_len + 1);
+	username = lha_file_header_alloc(header, data_len + 1);
 
 	if (username == NULL) {
 		return 0;
@@ -288,7 +283,7 @@ static int ext_header_unix_username_decoder(LHAFileHeader *header,
 	memcpy(username, data, data_len);
 	username[data_len] = '\0';
 
-	free(header->unix_username);
+	lha_file_header_release(header, header->unix_username);
 	header->unix_username = username;
 
 	return 1;
@@ -297,6 +292,7 @@ static int ext_header_unix_username_decoder(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_unix_username = {
 	LHA_EXT_HEADER_UNIX_USER,
 	ext_header_unix_username_decoder,
+	1,
 	1
 };
 
@@ -312,7 +308,7 @@ static int ext_header_unix_group_decoder(LHAFileHeader *header,
 {
 	char *group;
 
-	group = malloc(data_len + 1);
+	group = lha_file_header_alloc(header, data_len + 1);
 
 	if (group == NULL) {
 		return 0;
@@ -321,7 +317,7 @@ static int ext_header_unix_group_decoder(LHAFileHeader *header,
 	memcpy(group, data, data_len);
 	group[data_len] = '\0';
 
-	free(header->unix_group);
+	lha_file_header_release(header, header->unix_group);
 	header->unix_group = group;
 
 	return 1;
@@ -330,6 +326,7 @@ static int ext_header_unix_group_decoder(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_unix_group = {
 	LHA_EXT_HEADER_UNIX_GROUP,
 	ext_header_unix_group_decoder,
+	1,
 	1
 };
 
@@ -350,7 +347,8 @@ static int ext_header_unix_timestamp_decoder(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_unix_timestamp = {
 	LHA_EXT_HEADER_UNIX_TIMESTAMP,
 	ext_header_unix_timestamp_decoder,
-	4
+	4,
+	0
 };
 
 // OS-9 (6809) header (0xcc)
@@ -374,7 +372,8 @@ static int ext_header_os9_decoder(LHAFileHeader *header,
 static LHAExtHeaderType lha_ext_header_os9 = {
 	LHA_EXT_HEADER_OS9,
 	ext_header_os9_decoder,
-	12
+	12,
+	1
 };
 
 // Table of extended headers.
@@ -435,3 +434,12 @@ int lha_ext_header_decode(LHAFileHeader *header,
 	return htype->decoder(header, data, data_len);
 }
 
+int lha_ext_header_is_lazy(uint8_t num)
+{
+	const LHAExtHeaderType *htype;
+
+	htype = ext_header_for_num(num);
+
+	return htype != NULL && htype->lazy;
+}
+
@@ -25,6 +25,24 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #include "lha_file_header.h"
 
+// Extended header types:
+
+#define LHA_EXT_HEADER_COMMON              0x00
+#define LHA_EXT_HEADER_FILENAME            0x01
+#define LHA_EXT_HEADER_PATH                0x02
+#define LHA_EXT_HEADER_MULTI_DISC          0x39
+#define LHA_EXT_HEADER_COMMENT             0x3f
+
+#define LHA_EXT_HEADER_WINDOWS_TIMESTAMPS  0x41
+
+#define LHA_EXT_HEADER_UNIX_PERMISSION     0x50
+#define LHA_EXT_HEADER_UNIX_UID_GID        0x51
+#define LHA_EXT_HEADER_UNIX_GROUP          0x52
+#define LHA_EXT_HEADER_UNIX_USER           0x53
+#define LHA_EXT_HEADER_UNIX_TIMESTAMP      0x54
+
+#define LHA_EXT_HEADER_OS9                 0xcc
+
 /**
  * Decode the specified extended header.
  *
@@ -40,5 +58,15 @@ int lha_ext_header_decode(LHAFileHeader *header,
                           uint8_t *data,
                           size_t data_len);
 
+/**
+ * Check whether decoding of the specified extended header type can be
+ * deferred when scanning through headers.
+ *
+ * @param num       Extended header type.
+ * @return          Non-zero if the header can be decoded later.
+ */
+
+int lha_ext_header_is_lazy(uint8_t num);
+
 #endif /* #ifndef LHASA_EXT_HEADER_H */
 
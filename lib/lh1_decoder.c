@@ -24,7 +24,9 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <inttypes.h>
 
 #include "lha_decoder.h"
+#include "lha_endian.h"
 
+#define BIT_STREAM_WITH_READ_BIT
 #include "bit_stream_reader.c"
 
 // Size of the ring buffer used to hold history:
@@ -55,36 +57,46 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define COPY_THRESHOLD       3 /* bytes */
 
+// Length of the longest copy, from the last copy code.
+
+#define MAX_COPY_LENGTH      (NUM_CODES - 0x100 - 1 + COPY_THRESHOLD)
+
 // Required size of the output buffer.  At most, a single call to read()
 // might result in a copy of the entire ring buffer.
 
 #define OUTPUT_BUFFER_SIZE   RING_BUFFER_SIZE
 
-typedef struct {
+// Upper bit is set in a child[] value to indicate a leaf node.
 
-	// If true, this node is a leaf node.
+#define NODE_LEAF            0x8000
 
-	unsigned int leaf        :1;
+// Value at the end of the group[] array, which does not match any group.
 
-	// If this is a leaf node, child_index is the code represented by
-	// this node. Otherwise, nodes[child_index] and nodes[child_index-1]
-	// are the children of this node.
+#define NO_GROUP             0xffff
 
-	unsigned int child_index :15;
+// Number of bits of input used to index the code lookup table.
 
-	// Index of the parent node of this node.
+#define LOOKUP_BITS          8
 
-	uint16_t parent;
+// Value in depth[] for a node that is deeper in the tree than the
+// levels covered by the lookup table.
 
-	// Frequency count for this node - number of times that it has
-	// received a hit.
+#define DEPTH_UNMAPPED       (LOOKUP_BITS + 1)
 
-	uint16_t freq;
+// Size of a checkpoint: the ring buffer and its 32-bit position, then
+// the 16-bit child[] and freq[] arrays. Everything else about the tree
+// is built again from them when it is restored.
 
-	// Group that this node belongs to.
+#define CHECKPOINT_SIZE      (RING_BUFFER_SIZE + 4 + NUM_TREE_NODES * 4)
 
-	uint16_t group;
-} Node;
+// Entry in the code lookup table: the node reached after reading 'bits'
+// bits of input from the root. This is a leaf for codes shorter than
+// LOOKUP_BITS; otherwise decoding continues from it a bit at a time.
+
+typedef struct {
+	uint16_t node;
+	uint8_t bits;
+} LookupEntry;
 
 typedef struct {
 
@@ -92,15 +104,30 @@ typedef struct {
 
 	BitStreamReader bit_stream_reader;
 
+	// If non-zero, the input ran out part way through a call to
+	// read(); nothing more is returned.
+
+	int input_failed;
+
 	// Ring buffer of past data.  Used for position-based copies.
 
 	uint8_t ringbuf[RING_BUFFER_SIZE];
 	unsigned int ringbuf_pos;
 
-	// Array of tree nodes. nodes[0] is the root node.  The array
-	// is maintained in order by frequency.
-
-	Node nodes[NUM_TREE_NODES];
+	// The tree nodes. Node 0 is the root node, and nodes are kept in
+	// order by frequency. Each field of the nodes is held in its own
+	// array, as most operations only look at one or two of them.
+	//
+	// If NODE_LEAF is set in child[i], node i is a leaf and the lower
+	// bits are the code it represents. Otherwise, nodes child[i] and
+	// child[i] - 1 are its children. freq[i] is the number of times
+	// that the node has received a hit, and group[i] is the group that
+	// the node belongs to; group[NUM_TREE_NODES] is NO_GROUP.
+
+	uint16_t child[NUM_TREE_NODES];
+	uint16_t parent[NUM_TREE_NODES];
+	uint16_t freq[NUM_TREE_NODES];
+	uint16_t group[NUM_TREE_NODES + 1];
 
 	// Indices of leaf nodes of the tree (map from code to leaf
 	// node index)
@@ -121,6 +148,17 @@ typedef struct {
 
 	uint16_t group_leader[NUM_TREE_NODES];
 
+	// Lookup table used to descend the first LOOKUP_BITS levels of the
+	// tree in one step, indexed by the next bits of input. As the tree
+	// changes after every code, depth[] and prefix[] record the depth
+	// of each node within those levels and the bits that lead to it,
+	// so that only the entries for the part of the tree that changed
+	// need to be updated.
+
+	LookupEntry lookup[1 << LOOKUP_BITS];
+	uint8_t depth[NUM_TREE_NODES];
+	uint8_t prefix[NUM_TREE_NODES];
+
 	// Offset lookup table.  Maps from a byte value (sequence of next
 	// 8 bits from input stream) to an offset value.
 
@@ -175,6 +213,86 @@ static void init_groups(LHALH1Decoder *decoder)
 	decoder->num_groups = 0;
 }
 
+// Set the entries of the code lookup table that descend through the
+// specified node, which is at the given depth in the tree and reached
+// by the bits in 'prefix'. The nodes below it are updated as well.
+
+static void map_node(LHALH1Decoder *decoder, unsigned int node_index,
+                     unsigned int depth, unsigned int prefix)
+{
+	unsigned int child, i, start, end;
+
+	child = decoder->child[node_index];
+
+	if (depth > LOOKUP_BITS) {
+
+		// Below the levels covered by the table. The lookup
+		// entries are not affected, but if the node used to be
+		// higher up the tree, it must be marked as no longer being
+		// mapped, and the same goes for the nodes below it.
+
+		if (decoder->depth[node_index] == DEPTH_UNMAPPED) {
+			return;
+		}
+
+		decoder->depth[node_index] = DEPTH_UNMAPPED;
+	} else {
+		decoder->depth[node_index] = (uint8_t) depth;
+		decoder->prefix[node_index] = (uint8_t) prefix;
+
+		// Every index beginning with this node's prefix leads
+		// here if the node is a leaf, or if the bits of the index
+		// are used up.
+
+		if ((child & NODE_LEAF) != 0 || depth == LOOKUP_BITS) {
+			start = prefix << (LOOKUP_BITS - depth);
+			end = (prefix + 1) << (LOOKUP_BITS - depth);
+
+			for (i = start; i < end; ++i) {
+				decoder->lookup[i].node = (uint16_t) node_index;
+				decoder->lookup[i].bits = (uint8_t) depth;
+			}
+		}
+	}
+
+	if ((child & NODE_LEAF) == 0) {
+		map_node(decoder, child, depth + 1, prefix << 1);
+		map_node(decoder, child - 1, depth + 1, (prefix << 1) | 1);
+	}
+}
+
+// Update the code lookup table after the contents of the specified node
+// have changed.
+
+static void remap_node(LHALH1Decoder *decoder, unsigned int node_index)
+{
+	unsigned int child;
+
+	if (decoder->depth[node_index] != DEPTH_UNMAPPED) {
+		map_node(decoder, node_index, decoder->depth[node_index],
+		         decoder->prefix[node_index]);
+		return;
+	}
+
+	// The node itself is too deep to be in the table, but the nodes
+	// that are now its children might have been mapped before.
+
+	child = decoder->child[node_index];
+
+	if ((child & NODE_LEAF) == 0) {
+		map_node(decoder, child, DEPTH_UNMAPPED, 0);
+		map_node(decoder, child - 1, DEPTH_UNMAPPED, 0);
+	}
+}
+
+// Build the whole code lookup table from scratch.
+
+static void build_lookup(LHALH1Decoder *decoder)
+{
+	memset(decoder->depth, DEPTH_UNMAPPED, sizeof(decoder->depth));
+	map_node(decoder, 0, 0, 0);
+}
+
 // Initialize the tree with its basic initial configuration.
 
 static void init_tree(LHALH1Decoder *decoder)
@@ -182,20 +300,18 @@ static void init_tree(LHALH1Decoder *decoder)
 	unsigned int i, child;
 	int node_index;
 	uint16_t leaf_group;
-	Node *node;
 
 	// Leaf nodes are placed at the end of the table.  Start by
 	// initializing these, and working backwards.
 
 	node_index = NUM_TREE_NODES - 1;
 	leaf_group = alloc_group(decoder);
+	decoder->group[NUM_TREE_NODES] = NO_GROUP;
 
 	for (i = 0; i < NUM_CODES; ++i) {
-		node = &decoder->nodes[node_index];
-		node->leaf = 1;
-		node->child_index = (unsigned short) i;
-		node->freq = 1;
-		node->group = leaf_group;
+		decoder->child[node_index] = (uint16_t) (i | NODE_LEAF);
+		decoder->freq[node_index] = 1;
+		decoder->group[node_index] = leaf_group;
 
 		decoder->group_leader[leaf_group] = (uint16_t) node_index;
 		decoder->leaf_nodes[i] = (uint16_t) node_index;
@@ -209,40 +325,41 @@ static void init_tree(LHALH1Decoder *decoder)
 	child = NUM_TREE_NODES - 1;
 
 	while (node_index >= 0) {
-		node = &decoder->nodes[node_index];
-		node->leaf = 0;
 
 		// Set child pointer and update the parent pointers of the
 		// children.
 
-		node->child_index = child;
-		decoder->nodes[child].parent = (uint16_t) node_index;
-		decoder->nodes[child - 1].parent = (uint16_t) node_index;
+		decoder->child[node_index] = (uint16_t) child;
+		decoder->parent[child] = (uint16_t) node_index;
+		decoder->parent[child - 1] = (uint16_t) node_index;
 
 		// The node's frequency is equal to the sum of the frequencies
 		// of its children.
 
-		node->freq = (uint16_t) (decoder->nodes[child].freq
-		                       + decoder->nodes[child - 1].freq);
+		decoder->freq[node_index] = (uint16_t) (decoder->freq[child]
+		                                      + decoder->freq[child - 1]);
 
 		// Is the frequency the same as the last node we processed?
 		// if so, we are in the same group. If not, we must
 		// allocate a new group.  Either way, this node is now the
 		// leader of its group.
 
-		if (node->freq == decoder->nodes[node_index + 1].freq) {
-			node->group = decoder->nodes[node_index + 1].group;
+		if (decoder->freq[node_index] == decoder->freq[node_index + 1]) {
+			decoder->group[node_index] = decoder->group[node_index + 1];
 		} else {
-			node->group = alloc_group(decoder);
+			decoder->group[node_index] = alloc_group(decoder);
 		}
 
-		decoder->group_leader[node->group] = (uint16_t) node_index;
+		decoder->group_leader[decoder->group[node_index]]
+		    = (uint16_t) node_index;
 
 		// Process next node.
 
 		--node_index;
 		child -= 2;
 	}
+
+	build_lookup(decoder);
 }
 
 // Fill in a range of values in the offset_lookup table, which have
@@ -324,6 +441,7 @@ static int lha_lh1_init(void *data, LHADecoderCallback callback,
 
 	bit_stream_reader_init(&decoder->bit_stream_reader,
 	                       callback, callback_data);
+	decoder->input_failed = 0;
 
 	// Initialize data structures.
 
@@ -335,97 +453,52 @@ static int lha_lh1_init(void *data, LHADecoderCallback callback,
 	return 1;
 }
 
-// Make the given node the leader of its group: swap it with the current
-// leader so that it is in the left-most position.  Returns the new index
-// of the node.
+// Update the links that point back to a node from its children, or
+// from leaf_nodes[] for a leaf, after the node's contents have changed.
 
-static uint16_t make_group_leader(LHALH1Decoder *decoder,
-                                  uint16_t node_index)
+static void link_node(LHALH1Decoder *decoder, uint16_t node_index)
 {
-	Node *node, *leader;
-	uint16_t group;
-	uint16_t leader_index;
-	unsigned int tmp;
-
-	group = decoder->nodes[node_index].group;
-	leader_index = decoder->group_leader[group];
-
-	// Already the leader?  If so, there is nothing to do.
-
-	if (leader_index == node_index) {
-		return node_index;
-	}
-
-	node = &decoder->nodes[node_index];
-	leader = &decoder->nodes[leader_index];
-
-	// Swap leaf and child indices in the two nodes:
-
-	tmp = leader->leaf;
-	leader->leaf = node->leaf;
-	node->leaf = tmp;
-
-	tmp = leader->child_index;
-	leader->child_index = node->child_index;
-	node->child_index = tmp;
+	unsigned int child;
 
-	if (node->leaf) {
-		decoder->leaf_nodes[node->child_index] = node_index;
-	} else {
-		decoder->nodes[node->child_index].parent = node_index;
-		decoder->nodes[node->child_index - 1].parent = node_index;
-	}
+	child = decoder->child[node_index];
 
-	if (leader->leaf) {
-		decoder->leaf_nodes[leader->child_index] = leader_index;
+	if ((child & NODE_LEAF) != 0) {
+		decoder->leaf_nodes[child & ~NODE_LEAF] = node_index;
 	} else {
-		decoder->nodes[leader->child_index].parent = leader_index;
-		decoder->nodes[leader->child_index - 1].parent = leader_index;
+		decoder->parent[child] = node_index;
+		decoder->parent[child - 1] = node_index;
 	}
-
-	return leader_index;
 }
 
-// Increase the frequency count for a node, rearranging groups as
-// appropriate.
+// Reconstruct the group data from the frequencies of the nodes.
 
-static void increment_node_freq(LHALH1Decoder *decoder, uint16_t node_index)
+static void assign_groups(LHALH1Decoder *decoder)
 {
-	Node *node, *other;
+	unsigned int i, group;
 
-	node = &decoder->nodes[node_index];
-	other = &decoder->nodes[node_index - 1];
+	// Start by resetting group data.
 
-	++node->freq;
-
-	// If the node is part of a group containing other nodes, it
-	// must leave the group.
-
-	if (node_index < NUM_TREE_NODES - 1
-	 && node->group == decoder->nodes[node_index + 1].group) {
+	init_groups(decoder);
 
-		// Next node in the group now becomes the leader.
+	// Assign a group to the first node.
 
-		++decoder->group_leader[node->group];
+	group = alloc_group(decoder);
+	decoder->group[0] = (uint16_t) group;
+	decoder->group_leader[group] = 0;
 
-		// The node must now either join the group to its
-		// left, or start a new group.
+	// Assign a group number to each node, nodes having the same
+	// group if the have the same frequency, and allocating new
+	// groups when a new frequency is found.
 
-		if (node->freq == other->freq) {
-			node->group = other->group;
+	for (i = 1; i < NUM_TREE_NODES; ++i) {
+		if (decoder->freq[i] == decoder->freq[i - 1]) {
+			decoder->group[i] = decoder->group[i - 1];
 		} else {
-			node->group = alloc_group(decoder);
-			decoder->group_leader[node->group] = node_index;
-		}
-
-	} else {
-		// The node is in a group of its own (single-node
-		// group).  It might need to join the group of the
-		// node on its left if it has the same frequency.
+			group = alloc_group(decoder);
+			decoder->group[i] = (uint16_t) group;
 
-		if (node->freq == other->freq) {
-			free_group(decoder, node->group);
-			node->group = other->group;
+			// First node with a particular frequency is leader.
+			decoder->group_leader[group] = (uint16_t) i;
 		}
 	}
 }
@@ -435,26 +508,23 @@ static void increment_node_freq(LHALH1Decoder *decoder, uint16_t node_index)
 
 static void reconstruct_tree(LHALH1Decoder *decoder)
 {
-	Node *leaf;
 	unsigned int child;
 	unsigned int freq;
-	unsigned int group;
-	int i;
+	int i, leaf;
 
 	// Gather all leaf nodes at the start of the table.
 
-	leaf = decoder->nodes;
+	leaf = 0;
 
 	for (i = 0; i < NUM_TREE_NODES; ++i) {
-		if (decoder->nodes[i].leaf) {
-			leaf->leaf = 1;
-			leaf->child_index = decoder->nodes[i].child_index;
+		if ((decoder->child[i] & NODE_LEAF) != 0) {
+			decoder->child[leaf] = decoder->child[i];
 
 			// Frequency of the nodes in the new tree is halved,
 			// this acts as a running average each time the
 			// tree is reconstructed.
 
-			leaf->freq = (uint16_t) (decoder->nodes[i].freq + 1) / 2;
+			decoder->freq[leaf] = (uint16_t) (decoder->freq[i] + 1) / 2;
 
 			++leaf;
 		}
@@ -467,7 +537,7 @@ static void reconstruct_tree(LHALH1Decoder *decoder)
 	// of its children, and must be placed to maintain the ordering
 	// within the table by decreasing frequency.
 
-	leaf = &decoder->nodes[NUM_CODES - 1];
+	leaf = NUM_CODES - 1;
 	child = NUM_TREE_NODES - 1;
 	i = NUM_TREE_NODES - 1;
 
@@ -478,8 +548,10 @@ static void reconstruct_tree(LHALH1Decoder *decoder)
 		// then we need to copy some from the leaves.
 
 		while ((int) child - i < 2) {
-			decoder->nodes[i] = *leaf;
-			decoder->leaf_nodes[leaf->child_index] = (uint16_t) i;
+			decoder->child[i] = decoder->child[leaf];
+			decoder->freq[i] = decoder->freq[leaf];
+			decoder->leaf_nodes[decoder->child[i] & ~NODE_LEAF]
+			    = (uint16_t) i;
 
 			--i;
 			--leaf;
@@ -489,15 +561,17 @@ static void reconstruct_tree(LHALH1Decoder *decoder)
 		// of the new branch node, we can calculate the branch
 		// node's frequency.
 
-		freq = (unsigned int) (decoder->nodes[child].freq
-		                     + decoder->nodes[child - 1].freq);
+		freq = (unsigned int) (decoder->freq[child]
+		                     + decoder->freq[child - 1]);
 
 		// Now copy more leaf nodes until the correct place to
 		// insert the new branch node presents itself.
 
-		while (leaf >= decoder->nodes && freq >= leaf->freq) {
-			decoder->nodes[i] = *leaf;
-			decoder->leaf_nodes[leaf->child_index] = (uint16_t) i;
+		while (leaf >= 0 && freq >= decoder->freq[leaf]) {
+			decoder->child[i] = decoder->child[leaf];
+			decoder->freq[i] = decoder->freq[leaf];
+			decoder->leaf_nodes[decoder->child[i] & ~NODE_LEAF]
+			    = (uint16_t) i;
 
 			--i;
 			--leaf;
@@ -505,12 +579,11 @@ static void reconstruct_tree(LHALH1Decoder *decoder)
 
 		// The new branch node can now be inserted.
 
-		decoder->nodes[i].leaf = 0;
-		decoder->nodes[i].freq = (uint16_t) freq;
-		decoder->nodes[i].child_index = (uint16_t) child;
+		decoder->child[i] = (uint16_t) child;
+		decoder->freq[i] = (uint16_t) freq;
 
-		decoder->nodes[child].parent = (uint16_t) i;
-		decoder->nodes[child - 1].parent = (uint16_t) i;
+		decoder->parent[child] = (uint16_t) i;
+		decoder->parent[child - 1] = (uint16_t) i;
 
 		--i;
 
@@ -519,31 +592,11 @@ static void reconstruct_tree(LHALH1Decoder *decoder)
 		child -= 2;
 	}
 
-	// Reconstruct the group data.  Start by resetting group data.
-
-	init_groups(decoder);
-
-	// Assign a group to the first node.
-
-	group = alloc_group(decoder);
-	decoder->nodes[0].group = (uint16_t) group;
-	decoder->group_leader[group] = 0;
-
-	// Assign a group number to each node, nodes having the same
-	// group if the have the same frequency, and allocating new
-	// groups when a new frequency is found.
+	// The whole tree has changed, so the group data and lookup table
+	// are rebuilt.
 
-	for (i = 1; i < NUM_TREE_NODES; ++i) {
-		if (decoder->nodes[i].freq == decoder->nodes[i - 1].freq) {
-			decoder->nodes[i].group = decoder->nodes[i - 1].group;
-		} else {
-			group = alloc_group(decoder);
-			decoder->nodes[i].group = (uint16_t) group;
-
-			// First node with a particular frequency is leader.
-			decoder->group_leader[group] = (uint16_t) i;
-		}
-	}
+	assign_groups(decoder);
+	build_lookup(decoder);
 }
 
 // Increment the counter for the specific code, reordering the tree as
@@ -551,16 +604,22 @@ static void reconstruct_tree(LHALH1Decoder *decoder)
 
 static void increment_for_code(LHALH1Decoder *decoder, uint16_t code)
 {
-	uint16_t node_index;
+	uint16_t *group = decoder->group;
+	uint16_t *freq = decoder->freq;
+	unsigned int node_index, leader_index;
+	uint16_t tmp;
 
 	// When the limit is reached, we must reorder the code tree
 	// to better match the code frequencies:
 
-	if (decoder->nodes[0].freq >= TREE_REORDER_LIMIT) {
+	if (freq[0] >= TREE_REORDER_LIMIT) {
+		LHA_STATS_TREE(decoder);
+		LHA_STATS_BEGIN(decoder, LHA_DECODER_STAGE_TREES);
 		reconstruct_tree(decoder);
+		LHA_STATS_END(decoder);
 	}
 
-	++decoder->nodes[0].freq;
+	++freq[0];
 
 	// Dynamically adjust the tree.  Start from the leaf node of
 	// the tree and walk back up, rearranging nodes to the root.
@@ -569,16 +628,55 @@ static void increment_for_code(LHALH1Decoder *decoder, uint16_t code)
 
 	while (node_index != 0) {
 
-		// Shift the node to the left side of its group,
-		// and bump the frequency count.
+		// Shift the node to the left side of its group, by
+		// swapping it with the group leader. Both nodes have the
+		// same frequency, so only their contents are swapped.
+
+		leader_index = decoder->group_leader[group[node_index]];
+
+		if (leader_index != node_index) {
+			tmp = decoder->child[leader_index];
+			decoder->child[leader_index] = decoder->child[node_index];
+			decoder->child[node_index] = tmp;
+
+			link_node(decoder, node_index);
+			link_node(decoder, leader_index);
 
-		node_index = make_group_leader(decoder, node_index);
+			remap_node(decoder, node_index);
+			remap_node(decoder, leader_index);
 
-		increment_node_freq(decoder, node_index);
+			node_index = leader_index;
+		}
+
+		// Bump the frequency count. If the node is part of a group
+		// containing other nodes, it must leave the group, and the
+		// next node in the group becomes the leader. The node must
+		// then either join the group to its left, or start a new
+		// group. A node in a group of its own might need to join
+		// the group to its left if it now has the same frequency.
+		// (group[] has an extra entry at the end so that the last
+		// node never appears to share its group.)
+
+		++freq[node_index];
+
+		if (group[node_index] == group[node_index + 1]) {
+			++decoder->group_leader[group[node_index]];
+
+			if (freq[node_index] == freq[node_index - 1]) {
+				group[node_index] = group[node_index - 1];
+			} else {
+				group[node_index] = alloc_group(decoder);
+				decoder->group_leader[group[node_index]]
+				    = (uint16_t) node_index;
+			}
+		} else if (freq[node_index] == freq[node_index - 1]) {
+			free_group(decoder, group[node_index]);
+			group[node_index] = group[node_index - 1];
+		}
 
 		// Iterate up to the parent node.
 
-		node_index = decoder->nodes[node_index].parent;
+		node_index = decoder->parent[node_index];
 	}
 }
 
@@ -586,33 +684,39 @@ static void increment_for_code(LHALH1Decoder *decoder, uint16_t code)
 
 static int read_code(LHALH1Decoder *decoder, uint16_t *result)
 {
+	LookupEntry *entry;
 	unsigned int node_index;
-	int bit;
+	int bit, index;
 
 	// Start from the root node, and traverse down until a leaf is
-	// reached.
+	// reached. The lookup table is used to skip over the first levels
+	// of the tree in a single step. Near the end of the stream there
+	// may not be enough bits left to do this, in which case the tree
+	// is walked from the root a bit at a time.
 
 	node_index = 0;
+	index = peek_bits(&decoder->bit_stream_reader, LOOKUP_BITS);
 
-	//printf("<root ");
-	while (!decoder->nodes[node_index].leaf) {
+	if (index >= 0) {
+		entry = &decoder->lookup[index];
+		read_bits(&decoder->bit_stream_reader, entry->bits);
+		node_index = entry->node;
+	}
+
+	while ((decoder->child[node_index] & NODE_LEAF) == 0) {
 		bit = read_bit(&decoder->bit_stream_reader);
 
 		if (bit < 0) {
 			return 0;
 		}
 
-		//printf("<%i>", bit);
-
 		// Choose one of the two children depending on the
 		// bit that was read.
 
-		node_index = decoder->nodes[node_index].child_index
-		           - (unsigned int) bit;
+		node_index = decoder->child[node_index] - (unsigned int) bit;
 	}
 
-	*result = decoder->nodes[node_index].child_index;
-	//printf(" -> %i!>\n", *result);
+	*result = (uint16_t) (decoder->child[node_index] & ~NODE_LEAF);
 
 	increment_for_code(decoder, *result);
 
@@ -665,14 +769,14 @@ static void output_byte(LHALH1Decoder *decoder, uint8_t *buf,
 	decoder->ringbuf_pos = (decoder->ringbuf_pos + 1) % RING_BUFFER_SIZE;
 }
 
-static size_t lha_lh1_read(void *data, uint8_t *buf)
+// Decode the next command from the input stream, adding the bytes that
+// it produces to the output buffer. Returns zero if the input ran out.
+
+static int decode_command(LHALH1Decoder *decoder, uint8_t *buf,
+                          size_t *result)
 {
-	LHALH1Decoder *decoder = data;
-	size_t result;
 	uint16_t code;
 
-	result = 0;
-
 	// Read the next code from the input stream.
 
 	if (!read_code(decoder, &code)) {
@@ -685,7 +789,8 @@ static size_t lha_lh1_read(void *data, uint8_t *buf)
 	// stream.
 
 	if (code < 0x100) {
-		output_byte(decoder, buf, &result, (uint8_t) code);
+		LHA_STATS_LITERAL(decoder);
+		output_byte(decoder, buf, result, (uint8_t) code);
 	} else {
 		unsigned int count, start, i, pos, offset;
 
@@ -701,24 +806,193 @@ static size_t lha_lh1_read(void *data, uint8_t *buf)
 
 		// Copy from history into output buffer:
 
+		LHA_STATS_COPY(decoder, count);
+		LHA_STATS_BEGIN(decoder, LHA_DECODER_STAGE_COPY);
+
 		for (i = 0; i < count; ++i) {
 			pos = (start + i) % RING_BUFFER_SIZE;
 
-			output_byte(decoder, buf, &result,
+			output_byte(decoder, buf, result,
 			            decoder->ringbuf[pos]);
 		}
+
+		LHA_STATS_END(decoder);
+	}
+
+	return 1;
+}
+
+static size_t lha_lh1_read(void *data, uint8_t *buf)
+{
+	LHALH1Decoder *decoder = data;
+	size_t result;
+
+	// Decode as many commands as will fit in the output buffer,
+	// stopping when there might not be room for the longest copy.
+	// If the input runs out, the data decoded so far is returned, the
+	// same as if the commands had been decoded one at a time.
+
+	result = 0;
+
+	while (!decoder->input_failed
+	    && result + MAX_COPY_LENGTH <= OUTPUT_BUFFER_SIZE) {
+		if (!decode_command(decoder, buf, &result)) {
+			decoder->input_failed = 1;
+		}
 	}
 
 	return result;
 }
 
+// Store an array of 16-bit values in a checkpoint.
+
+static uint8_t *save_uint16s(uint8_t *buf, uint16_t *values, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		lha_encode_uint16(buf + i * 2, values[i]);
+	}
+
+	return buf + n * 2;
+}
+
+// Load an array of 16-bit values from a checkpoint.
+
+static uint8_t *load_uint16s(uint8_t *buf, uint16_t *values, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		values[i] = lha_decode_uint16(buf + i * 2);
+	}
+
+	return buf + n * 2;
+}
+
+// Save a checkpoint. Each call to read() decodes whole commands, so
+// this is possible at any point until the input runs out.
+
+static int lha_lh1_checkpoint(void *data, uint8_t *buf,
+                              uint64_t *input_bits)
+{
+	LHALH1Decoder *decoder = data;
+
+	if (decoder->input_failed) {
+		return 0;
+	}
+
+	memcpy(buf, decoder->ringbuf, RING_BUFFER_SIZE);
+	buf += RING_BUFFER_SIZE;
+	lha_encode_uint32(buf, decoder->ringbuf_pos);
+	buf += 4;
+
+	buf = save_uint16s(buf, decoder->child, NUM_TREE_NODES);
+	save_uint16s(buf, decoder->freq, NUM_TREE_NODES);
+
+	*input_bits = bit_stream_reader_position(&decoder->bit_stream_reader);
+
+	return 1;
+}
+
+// Check that the tree loaded from a checkpoint is one that could have
+// been built while decoding: every code is in exactly one leaf, every
+// other node is the child of exactly one node before it, and the nodes
+// are in order of decreasing frequency, each branch node's frequency
+// being the sum of its children's.
+
+static int valid_tree(LHALH1Decoder *decoder)
+{
+	uint8_t node_seen[NUM_TREE_NODES];
+	uint8_t code_seen[NUM_CODES];
+	unsigned int i, child, freq;
+
+	memset(node_seen, 0, sizeof(node_seen));
+	memset(code_seen, 0, sizeof(code_seen));
+
+	for (i = 0; i < NUM_TREE_NODES; ++i) {
+		child = decoder->child[i];
+
+		if ((child & NODE_LEAF) != 0) {
+			child &= ~NODE_LEAF;
+
+			if (child >= NUM_CODES || code_seen[child]) {
+				return 0;
+			}
+
+			code_seen[child] = 1;
+
+			if (decoder->freq[i] == 0) {
+				return 0;
+			}
+		} else {
+			if (child < i + 2 || child >= NUM_TREE_NODES
+			 || node_seen[child] || node_seen[child - 1]) {
+				return 0;
+			}
+
+			node_seen[child] = 1;
+			node_seen[child - 1] = 1;
+			freq = (unsigned int) decoder->freq[child]
+			     + decoder->freq[child - 1];
+
+			if (freq != decoder->freq[i]) {
+				return 0;
+			}
+		}
+
+		if (i > 0 && decoder->freq[i] > decoder->freq[i - 1]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int lha_lh1_restore(void *data, LHADecoderCallback callback,
+                           void *callback_data, uint8_t *buf,
+                           unsigned int skip_bits)
+{
+	LHALH1Decoder *decoder = data;
+	unsigned int i;
+
+	lha_lh1_init(decoder, callback, callback_data);
+
+	memcpy(decoder->ringbuf, buf, RING_BUFFER_SIZE);
+	buf += RING_BUFFER_SIZE;
+	decoder->ringbuf_pos = lha_decode_uint32(buf);
+	buf += 4;
+
+	buf = load_uint16s(buf, decoder->child, NUM_TREE_NODES);
+	load_uint16s(buf, decoder->freq, NUM_TREE_NODES);
+
+	if (decoder->ringbuf_pos >= RING_BUFFER_SIZE || !valid_tree(decoder)) {
+		return 0;
+	}
+
+	for (i = 0; i < NUM_TREE_NODES; ++i) {
+		link_node(decoder, (uint16_t) i);
+	}
+
+	assign_groups(decoder);
+	build_lookup(decoder);
+
+	return skip_bits == 0
+	    || read_bits(&decoder->bit_stream_reader, skip_bits) >= 0;
+}
+
 LHADecoderType lha_lh1_decoder = {
 	lha_lh1_init,
 	NULL,
 	lha_lh1_read,
 	sizeof(LHALH1Decoder),
 	OUTPUT_BUFFER_SIZE,
-	RING_BUFFER_SIZE
+	RING_BUFFER_SIZE,
+	NULL,
+	NULL,
+	CHECKPOINT_SIZE,
+	lha_lh1_checkpoint,
+	lha_lh1_restore
 };
 
 
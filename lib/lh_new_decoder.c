@@ -30,12 +30,31 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <inttypes.h>
 
 #include "lha_decoder.h"
+#include "lha_endian.h"
+
+// When LHA_DECODER_BMI2 is defined, the decoder is compiled to use the
+// BMI1 and BMI2 instructions, which shift by a variable number of bits
+// without the restrictions of the older shift instructions; this speeds
+// up reading from the bit stream. The decoder's name is given a "_bmi2"
+// suffix.
+
+#ifdef LHA_DECODER_BMI2
+#pragma GCC target("bmi,bmi2")
+#define DECODER_VARIANT(name) DECODER_VARIANT_BMI2(name)
+#define DECODER_VARIANT_BMI2(name) name ## _bmi2
+#else
+#define DECODER_VARIANT(name) name
+#endif
 
+#define BIT_STREAM_WITH_READ_BIT
 #include "bit_stream_reader.c"
+#include "window_copy.c"
 
 // Include tree decoder.
 
 typedef uint16_t TreeElement;
+#define TREE_LOOKUP_BITS 10
+#define TREE_MULTI_BITS  12
 #include "tree_decode.c"
 
 // Threshold for copying. The first copy code starts from here.
@@ -47,8 +66,8 @@ typedef uint16_t TreeElement;
 
 #define RING_BUFFER_SIZE     (1 << HISTORY_BITS)
 
-// Required size of the output buffer.  At most, a single call to read()
-// might result in a copy of the entire ring buffer.
+// Maximum amount of data returned by a single call to read(). Each call
+// decodes commands until this limit is nearly reached.
 
 #define OUTPUT_BUFFER_SIZE   RING_BUFFER_SIZE
 
@@ -57,34 +76,85 @@ typedef uint16_t TreeElement;
 
 #define NUM_CODES            510
 
+// Largest number of bytes that a single command can output: the
+// length of the longest copy from history.
+
+#define MAX_COPY_LENGTH      (NUM_CODES - 1 - 256 + COPY_THRESHOLD)
+
 // Number of possible codes in the "temporary table" used to encode the
 // codes table.
 
 #define MAX_TEMP_CODES       20
 
+// Blocks with fewer commands than this are decoded a code at a time.
+// Building the multi-literal table for the code tree costs about as
+// much as decoding a thousand or two commands, so it only pays off for
+// longer blocks.
+
+#define MULTI_LITERAL_MIN_BLOCK  4096
+
+// Size of a checkpoint: the contents of the ring buffer, followed by
+// the 32-bit ring buffer position and a flag indicating whether it
+// has wrapped around.
+
+#define CHECKPOINT_SIZE      (RING_BUFFER_SIZE + 5)
+
 typedef struct {
 	// Input bit stream.
 
 	BitStreamReader bit_stream_reader;
 
 	// Ring buffer of past data.  Used for position-based copies.
-
-	uint8_t ringbuf[RING_BUFFER_SIZE];
+	// Commands are decoded directly into the ring buffer. The extra
+	// space at the end lets a command run past the end of the ring
+	// without wrapping around; anything written there is moved back
+	// to the start of the ring at the start of the next read. It
+	// starts on a cache line, so that it doesn't share lines with the
+	// tree tables.
+
+	LHA_DECODER_ALIGNED
+	uint8_t ringbuf[RING_BUFFER_SIZE + MAX_COPY_LENGTH];
 	unsigned int ringbuf_pos;
 
+	// Set once ringbuf_pos has wrapped around to the start of the
+	// ring buffer: all of the ring buffer has been written to.
+
+	int ringbuf_wrapped;
+
 	// Number of commands remaining before we start a new block.
 
 	unsigned int block_remaining;
 
+	// If set, read stops at the start of the next block, so that a
+	// checkpoint can be saved.
+
+	int stop_at_block;
+
+	// State of the first stage of two-stage decoding (see
+	// lha_lh_new_read_tokens): where ringbuf_pos will be once the
+	// tokens decoded so far have been applied, and where it was at
+	// the start of the read that they belong to.
+
+	int tokens_started, tokens_ended;
+	unsigned int token_pos, token_start;
+
 	// Table used for the code tree.
 
 	TreeElement code_tree[NUM_CODES * 2];
+	TreeLookupEntry code_lookup[TREE_LOOKUP_SIZE];
+
+	// Multi-literal table for the code tree, used to decode several
+	// literals at once; only valid if code_multi_valid is set.
+
+	TreeMultiEntry code_multi[TREE_MULTI_SIZE];
+	int code_multi_valid;
 
 	// Table used to encode the offset tree, used to read offsets
 	// into the history buffer. This same table is also used to
 	// encode the temp-table, which is bigger; hence the size.
 
 	TreeElement offset_tree[MAX_TEMP_CODES * 2];
+	TreeLookupEntry offset_lookup[TREE_LOOKUP_SIZE];
 } LHANewDecoder;
 
 // Initialize the history ring buffer.
@@ -93,30 +163,63 @@ static void init_ring_buffer(LHANewDecoder *decoder)
 {
 	memset(decoder->ringbuf, ' ', RING_BUFFER_SIZE);
 	decoder->ringbuf_pos = 0;
+	decoder->ringbuf_wrapped = 0;
 }
 
-static int lha_lh_new_init(void *data, LHADecoderCallback callback,
-                           void *callback_data)
-{
-	LHANewDecoder *decoder = data;
+// Initialize the rest of the decoder state, apart from the ring buffer.
 
+static void init_decoder(LHANewDecoder *decoder,
+                         LHADecoderCallback callback,
+                         void *callback_data)
+{
 	// Initialize input stream reader.
 
 	bit_stream_reader_init(&decoder->bit_stream_reader,
 	                       callback, callback_data);
 
-	// Initialize data structures.
-
-	init_ring_buffer(decoder);
-
 	// First read starts the first block.
 
 	decoder->block_remaining = 0;
+	decoder->stop_at_block = 0;
+	decoder->tokens_started = 0;
+	decoder->tokens_ended = 0;
+	decoder->code_multi_valid = 0;
 
 	// Initialize tree tables to a known state.
 
-	init_tree(decoder->code_tree, NUM_CODES * 2);
-	init_tree(decoder->offset_tree, MAX_TEMP_CODES * 2);
+	init_tree(decoder->code_tree, NUM_CODES * 2, decoder->code_lookup);
+	init_tree(decoder->offset_tree, MAX_TEMP_CODES * 2,
+	          decoder->offset_lookup);
+}
+
+static int lha_lh_new_init(void *data, LHADecoderCallback callback,
+                           void *callback_data)
+{
+	LHANewDecoder *decoder = data;
+
+	init_ring_buffer(decoder);
+	init_decoder(decoder, callback, callback_data);
+
+	return 1;
+}
+
+static int lha_lh_new_reset(void *data, LHADecoderCallback callback,
+                            void *callback_data)
+{
+	LHANewDecoder *decoder = data;
+
+	// If the previous stream was short, only the start of the ring
+	// buffer has been written to, and only that needs to be cleared.
+
+	if (decoder->ringbuf_wrapped
+	 || decoder->ringbuf_pos >= RING_BUFFER_SIZE) {
+		init_ring_buffer(decoder);
+	} else {
+		memset(decoder->ringbuf, ' ', decoder->ringbuf_pos);
+		decoder->ringbuf_pos = 0;
+	}
+
+	init_decoder(decoder, callback, callback_data);
 
 	return 1;
 }
@@ -179,7 +282,8 @@ static int read_temp_table(LHANewDecoder *decoder)
 			return 0;
 		}
 
-		set_tree_single(decoder->offset_tree, code);
+		set_tree_single(decoder->offset_tree,
+		                decoder->offset_lookup, code);
 		return 1;
 	}
 
@@ -218,7 +322,8 @@ static int read_temp_table(LHANewDecoder *decoder)
 		}
 	}
 
-	build_tree(decoder->offset_tree, MAX_TEMP_CODES * 2, code_lengths, n);
+	build_tree(decoder->offset_tree, MAX_TEMP_CODES * 2,
+	           decoder->offset_lookup, code_lengths, n);
 
 	return 1;
 }
@@ -287,7 +392,7 @@ static int read_code_table(LHANewDecoder *decoder)
 			return 0;
 		}
 
-		set_tree_single(decoder->code_tree, code);
+		set_tree_single(decoder->code_tree, decoder->code_lookup, code);
 
 		return 1;
 	}
@@ -304,7 +409,8 @@ static int read_code_table(LHANewDecoder *decoder)
 
 	while (i < n) {
 		code = read_from_tree(&decoder->bit_stream_reader,
-		                      decoder->offset_tree);
+		                      decoder->offset_tree,
+		                      decoder->offset_lookup);
 
 		if (code < 0) {
 			return 0;
@@ -332,7 +438,8 @@ static int read_code_table(LHANewDecoder *decoder)
 		}
 	}
 
-	build_tree(decoder->code_tree, NUM_CODES * 2, code_lengths, n);
+	build_tree(decoder->code_tree, NUM_CODES * 2,
+	           decoder->code_lookup, code_lengths, n);
 
 	return 1;
 }
@@ -360,7 +467,8 @@ static int read_offset_table(LHANewDecoder *decoder)
 			return 0;
 		}
 
-		set_tree_single(decoder->offset_tree, code);
+		set_tree_single(decoder->offset_tree,
+		                decoder->offset_lookup, code);
 		return 1;
 	}
 
@@ -382,27 +490,16 @@ static int read_offset_table(LHANewDecoder *decoder)
 		code_lengths[i] = len;
 	}
 
-	build_tree(decoder->offset_tree, MAX_TEMP_CODES * 2, code_lengths, n);
+	build_tree(decoder->offset_tree, MAX_TEMP_CODES * 2,
+	           decoder->offset_lookup, code_lengths, n);
 
 	return 1;
 }
 
-// Start reading a new block from the input stream.
+// Read the tables at the start of a block.
 
-static int start_new_block(LHANewDecoder *decoder)
+static int read_tables(LHANewDecoder *decoder)
 {
-	int len;
-
-	// Read length of new block (in commands).
-
-	len = read_bits(&decoder->bit_stream_reader, 16);
-
-	if (len < 0) {
-		return 0;
-	}
-
-	decoder->block_remaining = (size_t) len;
-
 	// Read the temporary decode table, used to encode the codes table.
 	// The position table data structure is reused for this.
 
@@ -410,27 +507,77 @@ static int start_new_block(LHANewDecoder *decoder)
 		return 0;
 	}
 
+	LHA_STATS_TREE(decoder);
+
 	// Read the code table; this is encoded *using* the temp table.
 
 	if (!read_code_table(decoder)) {
 		return 0;
 	}
 
+	LHA_STATS_TREE(decoder);
+
 	// Read the offset table.
 
 	if (!read_offset_table(decoder)) {
 		return 0;
 	}
 
+	LHA_STATS_TREE(decoder);
+
 	return 1;
 }
 
+// Start reading a new block from the input stream.
+
+static int start_new_block(LHANewDecoder *decoder)
+{
+	int len, result;
+
+	// Read length of new block (in commands).
+
+	len = read_bits(&decoder->bit_stream_reader, 16);
+
+	if (len < 0) {
+		return 0;
+	}
+
+	decoder->block_remaining = (size_t) len;
+	LHA_STATS_BLOCK(decoder);
+
+	LHA_STATS_BEGIN(decoder, LHA_DECODER_STAGE_TREES);
+	result = read_tables(decoder);
+
+	decoder->code_multi_valid = result && len >= MULTI_LITERAL_MIN_BLOCK
+	    && build_multi_lookup(decoder->code_multi, decoder->code_tree,
+	                          decoder->code_lookup, 256);
+	LHA_STATS_END(decoder);
+
+	return result;
+}
+
 // Read the next code from the input stream. Returns the code, or -1 if
 // an error occurred.
 
 static int read_code(LHANewDecoder *decoder)
 {
-	return read_from_tree(&decoder->bit_stream_reader, decoder->code_tree);
+	return read_from_tree(&decoder->bit_stream_reader,
+	                      decoder->code_tree, decoder->code_lookup);
+}
+
+// As read_code, but using the multi-literal table, so that the next
+// codes may instead be read as a run of literals: these are stored in
+// buf (which must have room for four bytes), and TREE_MULTI_RUN plus the
+// number of them is returned.
+
+static int read_code_multi(LHANewDecoder *decoder, uint8_t *buf)
+{
+	// The literals must all belong to the current block.
+
+	return read_from_multi(&decoder->bit_stream_reader,
+	                       decoder->code_tree, decoder->code_lookup,
+	                       decoder->code_multi, buf,
+	                       decoder->block_remaining);
 }
 
 // Read an offset distance from the input stream.
@@ -441,7 +588,7 @@ static int read_offset_code(LHANewDecoder *decoder)
 	int bits, result;
 
 	bits = read_from_tree(&decoder->bit_stream_reader,
-	                      decoder->offset_tree);
+	                      decoder->offset_tree, decoder->offset_lookup);
 
 	if (bits < 0) {
 		return -1;
@@ -468,29 +615,63 @@ static int read_offset_code(LHANewDecoder *decoder)
 			return -1;
 		}
 
-		return result + (1 << (bits - 1));
+		// A corrupt stream can give a longer offset than the
+		// ring buffer; it wraps around, as in the ring itself.
+
+		return (result + (1 << (bits - 1))) & (RING_BUFFER_SIZE - 1);
 	}
 }
 
 // Add a byte value to the output stream.
 
-static void output_byte(LHANewDecoder *decoder, uint8_t *buf,
-                        size_t *buf_len, uint8_t b)
+static void output_byte(LHANewDecoder *decoder, uint8_t b)
 {
-	buf[*buf_len] = b;
-	++*buf_len;
-
 	decoder->ringbuf[decoder->ringbuf_pos] = b;
-	decoder->ringbuf_pos = (decoder->ringbuf_pos + 1) % RING_BUFFER_SIZE;
+	++decoder->ringbuf_pos;
+}
+
+// Copy count bytes from distance bytes back in the history buffer.
+
+static void copy_window(LHANewDecoder *decoder, size_t count,
+                        unsigned int distance)
+{
+	uint8_t *dst;
+	unsigned int start;
+	size_t n;
+
+	dst = decoder->ringbuf + decoder->ringbuf_pos;
+
+	if (distance <= decoder->ringbuf_pos) {
+		window_copy(dst, dst - distance, count);
+	} else {
+		// The source is before the start of the buffer and so
+		// wraps around to the end of the ring. The source is
+		// always ahead of the destination here, so the first part
+		// can be moved in one go; if it reaches the end of the
+		// ring, the rest continues from the start.
+
+		start = decoder->ringbuf_pos + RING_BUFFER_SIZE - distance;
+		n = RING_BUFFER_SIZE - start;
+
+		if (n > count) {
+			n = count;
+		}
+
+		memmove(dst, decoder->ringbuf + start, n);
+
+		if (n < count) {
+			window_copy(dst + n, decoder->ringbuf, count - n);
+		}
+	}
+
+	decoder->ringbuf_pos += (unsigned int) count;
 }
 
-// Copy a block from the history buffer.
+// Read the offset of a copy command, and copy from the history buffer.
 
-static void copy_from_history(LHANewDecoder *decoder, uint8_t *buf,
-                              size_t *buf_len, size_t count)
+static void copy_from_history(LHANewDecoder *decoder, size_t count)
 {
 	int offset;
-	unsigned int i, start;
 
 	offset = read_offset_code(decoder);
 
@@ -498,72 +679,357 @@ static void copy_from_history(LHANewDecoder *decoder, uint8_t *buf,
 		return;
 	}
 
-	start = decoder->ringbuf_pos + RING_BUFFER_SIZE
-	      - (unsigned int) offset - 1;
+	LHA_STATS_COPY(decoder, count);
+	LHA_STATS_BEGIN(decoder, LHA_DECODER_STAGE_COPY);
+
+	copy_window(decoder, count, (unsigned int) offset + 1);
+
+	LHA_STATS_END(decoder);
+}
+
+// If the last command ran past the end of the ring buffer, move the
+// overrun back to the start.
+
+static void move_overrun(LHANewDecoder *decoder)
+{
+	if (decoder->ringbuf_pos >= RING_BUFFER_SIZE) {
+		decoder->ringbuf_wrapped = 1;
+		decoder->ringbuf_pos -= RING_BUFFER_SIZE;
+		memcpy(decoder->ringbuf, decoder->ringbuf + RING_BUFFER_SIZE,
+		       decoder->ringbuf_pos);
+	}
+}
+
+// Decode data. The decoded data is returned as a pointer into the
+// ring buffer, avoiding the need for a separate output buffer.
+
+static size_t lha_lh_new_read_direct(void *data, uint8_t **buf)
+{
+	LHANewDecoder *decoder = data;
+	unsigned int start, count;
+	int code;
+
+	move_overrun(decoder);
+
+	start = decoder->ringbuf_pos;
+
+	// Decode as many commands as will fit in the output buffer.
+	// Stop when there might not be room for the longest copy, or at
+	// the end of the ring buffer.
 
-	for (i = 0; i < count; ++i) {
-		output_byte(decoder, buf, buf_len,
-		            decoder->ringbuf[(start + i) % RING_BUFFER_SIZE]);
+	while (decoder->ringbuf_pos < RING_BUFFER_SIZE
+	    && decoder->ringbuf_pos - start + MAX_COPY_LENGTH
+	       <= OUTPUT_BUFFER_SIZE) {
+
+		// Start of new block?
+
+		while (decoder->block_remaining == 0) {
+			if ((decoder->stop_at_block
+			     && decoder->ringbuf_pos != start)
+			 || !start_new_block(decoder)) {
+				goto done;
+			}
+		}
+
+		// Read next command from input stream. This may be several
+		// literals at once; there is always room for them, as for
+		// the longest copy.
+
+		if (!decoder->code_multi_valid) {
+			code = read_code(decoder);
+		} else {
+			code = read_code_multi(decoder, decoder->ringbuf
+			                              + decoder->ringbuf_pos);
+
+			if (code >= TREE_MULTI_RUN) {
+				count = (unsigned int) code - TREE_MULTI_RUN;
+				LHA_STATS_LITERALS(decoder, count);
+				decoder->block_remaining -= count;
+				decoder->ringbuf_pos += count;
+				continue;
+			}
+		}
+
+		--decoder->block_remaining;
+
+		if (code < 0) {
+			break;
+		}
+
+		// The code may be either a literal byte value or a copy
+		// command.
+
+		if (code < 256) {
+			LHA_STATS_LITERAL(decoder);
+			output_byte(decoder, (uint8_t) code);
+		} else {
+			copy_from_history(decoder, code - 256 + COPY_THRESHOLD);
+		}
 	}
+
+done:
+	*buf = decoder->ringbuf + start;
+
+	return decoder->ringbuf_pos - start;
 }
 
 static size_t lha_lh_new_read(void *data, uint8_t *buf)
 {
-	LHANewDecoder *decoder = data;
+	uint8_t *decoded;
 	size_t result;
-	int code;
 
-	// Start of new block?
+	result = lha_lh_new_read_direct(data, &decoded);
+	memcpy(buf, decoded, result);
 
-	while (decoder->block_remaining == 0) {
-		if (!start_new_block(decoder)) {
-			return 0;
+	return result;
+}
+
+// Start the first stage of two-stage decoding on a new read (as if
+// read_direct had been called again).
+
+static void next_token_read(LHANewDecoder *decoder)
+{
+	if (decoder->token_pos >= RING_BUFFER_SIZE) {
+		decoder->token_pos -= RING_BUFFER_SIZE;
+	}
+
+	decoder->token_start = decoder->token_pos;
+}
+
+// Two-stage decoding, first stage: decode commands into tokens. The
+// ring buffer belongs to the second stage, which runs on another
+// thread, so it is not touched here. Instead, the position that
+// read_direct would have reached is followed, so that the commands
+// are divided into reads in exactly the same way; a corrupt stream
+// then ends at the same point as it would with read_direct.
+
+static size_t lha_lh_new_read_tokens(void *data, uint32_t *tokens,
+                                     size_t max_tokens, size_t max_output)
+{
+	LHANewDecoder *decoder = data;
+	size_t num_tokens, output;
+	unsigned int count;
+	uint8_t literals[4];
+	int code, offset;
+
+	if (!decoder->tokens_started) {
+		decoder->tokens_started = 1;
+		decoder->token_pos = decoder->ringbuf_pos;
+		next_token_read(decoder);
+	}
+
+	num_tokens = 0;
+	output = 0;
+	memset(literals, 0, sizeof(literals));
+
+	while (!decoder->tokens_ended
+	    && num_tokens + TREE_MULTI_MAX <= max_tokens
+	    && output + MAX_COPY_LENGTH <= max_output) {
+
+		// Would read_direct have stopped here?
+
+		if (decoder->token_pos >= RING_BUFFER_SIZE
+		 || decoder->token_pos - decoder->token_start
+		    + MAX_COPY_LENGTH > OUTPUT_BUFFER_SIZE) {
+			next_token_read(decoder);
+		}
+
+		while (decoder->block_remaining == 0) {
+			if (!start_new_block(decoder)) {
+				goto failed;
+			}
+		}
+
+		// Literals are decoded in runs exactly as by read_direct.
+		// There is always room for the longest run, so all of the
+		// token slots that it could need are filled, to avoid a
+		// loop.
+
+		if (!decoder->code_multi_valid) {
+			code = read_code(decoder);
+		} else {
+			code = read_code_multi(decoder, literals);
+
+			if (code >= TREE_MULTI_RUN) {
+				count = (unsigned int) code - TREE_MULTI_RUN;
+				LHA_STATS_LITERALS(decoder, count);
+				tokens[num_tokens] = literals[0];
+				tokens[num_tokens + 1] = literals[1];
+				tokens[num_tokens + 2] = literals[2];
+				decoder->block_remaining -= count;
+				num_tokens += count;
+				output += count;
+				decoder->token_pos += count;
+				continue;
+			}
+		}
+
+		--decoder->block_remaining;
+
+		if (code < 0) {
+			goto failed;
+		}
+
+		if (code < 256) {
+			LHA_STATS_LITERAL(decoder);
+			tokens[num_tokens] = (uint32_t) code;
+			count = 1;
+		} else {
+			count = (unsigned int) code - 256 + COPY_THRESHOLD;
+			offset = read_offset_code(decoder);
+
+			if (offset < 0) {
+				continue;
+			}
+
+			LHA_STATS_COPY(decoder, count);
+			tokens[num_tokens] = LHA_TOKEN_COPY(count, offset + 1);
+		}
+
+		++num_tokens;
+		output += count;
+		decoder->token_pos += count;
+		continue;
+
+failed:
+		// read_direct would have returned the data decoded so far
+		// and been called again; if there was none, the stream
+		// has ended.
+
+		if (decoder->token_pos == decoder->token_start) {
+			decoder->tokens_ended = 1;
+		} else {
+			next_token_read(decoder);
 		}
 	}
 
-	--decoder->block_remaining;
+	return num_tokens;
+}
 
-	// Read next command from input stream.
+// Two-stage decoding, second stage: apply tokens to the ring buffer,
+// and copy the output to buf.
 
-	result = 0;
+static size_t lha_lh_new_decode_tokens(void *data, const uint32_t *tokens,
+                                       size_t num_tokens, uint8_t *buf)
+{
+	LHANewDecoder *decoder = data;
+	unsigned int start;
+	uint8_t *out;
+	uint32_t token;
+	size_t i;
+
+	out = buf;
+	i = 0;
+
+	while (i < num_tokens) {
+		move_overrun(decoder);
+		start = decoder->ringbuf_pos;
 
-	code = read_code(decoder);
+		while (i < num_tokens
+		    && decoder->ringbuf_pos < RING_BUFFER_SIZE) {
+			token = tokens[i];
+			++i;
 
-	if (code < 0) {
+			if (token < 256) {
+				output_byte(decoder, (uint8_t) token);
+			} else {
+				copy_window(decoder, LHA_TOKEN_LENGTH(token),
+				            LHA_TOKEN_DISTANCE(token));
+			}
+		}
+
+		memcpy(out, decoder->ringbuf + start,
+		       decoder->ringbuf_pos - start);
+		out += decoder->ringbuf_pos - start;
+	}
+
+	return (size_t) (out - buf);
+}
+
+// Save a checkpoint. This is only possible at the start of a block,
+// because the trees used for the previous block are not saved.
+
+static int lha_lh_new_checkpoint(void *data, uint8_t *buf,
+                                 uint64_t *input_bits)
+{
+	LHANewDecoder *decoder = data;
+
+	if (decoder->block_remaining != 0) {
+		decoder->stop_at_block = 1;
 		return 0;
 	}
 
-	// The code may be either a literal byte value or a copy command.
+	decoder->stop_at_block = 0;
 
-	if (code < 256) {
-		output_byte(decoder, buf, &result, (uint8_t) code);
-	} else {
-		copy_from_history(decoder, buf, &result,
-		                  code - 256 + COPY_THRESHOLD);
+	move_overrun(decoder);
+
+	memcpy(buf, decoder->ringbuf, RING_BUFFER_SIZE);
+	lha_encode_uint32(buf + RING_BUFFER_SIZE, decoder->ringbuf_pos);
+	buf[RING_BUFFER_SIZE + 4] = (uint8_t) decoder->ringbuf_wrapped;
+
+	*input_bits = bit_stream_reader_position(&decoder->bit_stream_reader);
+
+	return 1;
+}
+
+static int lha_lh_new_restore(void *data, LHADecoderCallback callback,
+                              void *callback_data, uint8_t *buf,
+                              unsigned int skip_bits)
+{
+	LHANewDecoder *decoder = data;
+
+	init_decoder(decoder, callback, callback_data);
+
+	memcpy(decoder->ringbuf, buf, RING_BUFFER_SIZE);
+	decoder->ringbuf_pos = lha_decode_uint32(buf + RING_BUFFER_SIZE);
+	decoder->ringbuf_wrapped = buf[RING_BUFFER_SIZE + 4] != 0;
+
+	if (decoder->ringbuf_pos >= RING_BUFFER_SIZE) {
+		return 0;
 	}
 
-	return result;
+	// The callback starts from the byte containing the first bit of
+	// the block; skip over the bits before it.
+
+	return skip_bits == 0
+	    || read_bits(&decoder->bit_stream_reader, skip_bits) >= 0;
 }
 
-LHADecoderType DECODER_NAME = {
+LHADecoderType DECODER_VARIANT(DECODER_NAME) = {
 	lha_lh_new_init,
 	NULL,
 	lha_lh_new_read,
 	sizeof(LHANewDecoder),
 	OUTPUT_BUFFER_SIZE,
-	RING_BUFFER_SIZE / 2
+	RING_BUFFER_SIZE / 2,
+	lha_lh_new_read_direct,
+	lha_lh_new_reset,
+	CHECKPOINT_SIZE,
+	lha_lh_new_checkpoint,
+	lha_lh_new_restore,
+	0,
+	lha_lh_new_read_tokens,
+	lha_lh_new_decode_tokens
 };
 
 // This is a hack for -lh4-:
 
 #ifdef DECODER2_NAME
-LHADecoderType DECODER2_NAME = {
+LHADecoderType DECODER_VARIANT(DECODER2_NAME) = {
 	lha_lh_new_init,
 	NULL,
 	lha_lh_new_read,
 	sizeof(LHANewDecoder),
 	OUTPUT_BUFFER_SIZE,
-	RING_BUFFER_SIZE / 4
+	RING_BUFFER_SIZE / 4,
+	lha_lh_new_read_direct,
+	lha_lh_new_reset,
+	CHECKPOINT_SIZE,
+	lha_lh_new_checkpoint,
+	lha_lh_new_restore,
+	0,
+	lha_lh_new_read_tokens,
+	lha_lh_new_decode_tokens
 };
 #endif
 
@@ -61,6 +61,25 @@ int lha_arch_vasprintf(char **result, char *fmt, va_list args);
 
 void lha_arch_set_binary(FILE *handle);
 
+/**
+ * Check whether the specified FILE handle is connected to a terminal.
+ *
+ * @param handle      The FILE handle.
+ * @return            Non-zero if the handle is a terminal.
+ */
+
+int lha_arch_is_terminal(FILE *handle);
+
+/**
+ * Get the value of a clock that counts in milliseconds, for measuring
+ * elapsed time. The clock has no particular starting point, and may
+ * wrap around.
+ *
+ * @return            Current value of the clock.
+ */
+
+unsigned int lha_arch_clock_ms(void);
+
 /**
  * Create a directory.
  *
@@ -120,6 +139,17 @@ int lha_arch_set_windows_timestamps(char *filename,
                                     uint64_t creation_time,
                                     uint64_t modification_time,
                                     uint64_t access_time);
+/**
+ * Open an existing file for reading, with a hint to the system that it
+ * will be read from start to end, so that it reads ahead further.
+ *
+ * @param filename    Path to the file.
+ * @return            Standard C file handle, or NULL if the file could
+ *                    not be opened.
+ */
+
+FILE *lha_arch_fopen_read(char *filename);
+
 /**
  * Open a new file for writing.
  *
@@ -134,6 +164,109 @@ int lha_arch_set_windows_timestamps(char *filename,
 FILE *lha_arch_fopen(char *filename, int unix_uid,
                      int unix_gid, int unix_perms);
 
+/**
+ * Set the modification and access times of a file opened with
+ * @ref lha_arch_fopen, through its handle. This must only be done after
+ * all data has been written to the file; any data buffered in the
+ * handle is written out first.
+ *
+ * @param handle      Handle of the file.
+ * @param timestamp   The Unix timestamp to set.
+ * @return            Non-zero for success, or zero for failure.
+ */
+
+int lha_arch_futime(FILE *handle, unsigned int timestamp);
+
+/**
+ * Set the creation, modification and access times of a file opened
+ * with @ref lha_arch_fopen, through its handle, using 64-bit Windows
+ * timestamps. As with @ref lha_arch_futime, this must only be done
+ * after all data has been written.
+ *
+ * @param handle             Handle of the file.
+ * @param creation_time      64-bit Windows FILETIME value for the
+ *                           creation time of the file.
+ * @param modification_time  Modification time of the file.
+ * @param access_time        Last access time of the file.
+ * @return                   Non-zero if set successfully.
+ */
+
+int lha_arch_fset_windows_timestamps(FILE *handle,
+                                     uint64_t creation_time,
+                                     uint64_t modification_time,
+                                     uint64_t access_time);
+
+/**
+ * Set the owner, permissions and timestamp of a directory, once its
+ * contents have been extracted. Where possible, the directory is
+ * opened once and everything is set through the handle, rather than
+ * looking up the path again for each change. Symbolic links are not
+ * followed.
+ *
+ * @param path        Path to the directory.
+ * @param unix_uid    Unix UID to set, or -1 to not set.
+ * @param unix_gid    Unix GID to set, or -1 to not set.
+ * @param unix_perms  Unix permissions to set, or -1 to not set.
+ * @param timestamp   Unix timestamp to set, or zero to not set.
+ * @return            Non-zero for success, or zero if the permissions
+ *                    could not be set. Failing to change the owner is
+ *                    not treated as an error.
+ */
+
+int lha_arch_set_dir_metadata(char *path, int unix_uid, int unix_gid,
+                              int unix_perms, unsigned int timestamp);
+
+/**
+ * Reserve disk space for a file that is about to be written, so that
+ * the filesystem can place it contiguously. The size of the file as
+ * seen by readers is not changed.
+ *
+ * @param handle      Handle of a file opened with @ref lha_arch_fopen.
+ * @param length      Number of bytes that will be written to the file.
+ * @return            Non-zero if the space was reserved. Failure is not
+ *                    an error; the file can still be written.
+ */
+
+int lha_arch_preallocate(FILE *handle, uint64_t length);
+
+/**
+ * Write data to a file, bypassing the stdio buffer. The handle must
+ * not also be written with stdio functions, as the data would be
+ * written out of order.
+ *
+ * @param handle      Handle of a file opened with @ref lha_arch_fopen.
+ * @param buf         Pointer to the data to write.
+ * @param buf_len     Length of the data, in bytes.
+ * @return            Non-zero if all the data was written.
+ */
+
+int lha_arch_write(FILE *handle, const void *buf, size_t buf_len);
+
+/**
+ * Move forward through a file being written by @ref lha_arch_write,
+ * without writing anything. Where the filesystem supports it, the
+ * skipped range is left as a hole that takes no disk space; it reads
+ * back as zeroes.
+ *
+ * @param handle      Handle of a file opened with @ref lha_arch_fopen.
+ * @param length      Number of bytes to skip.
+ * @return            Non-zero for success, or zero for failure.
+ */
+
+int lha_arch_skip(FILE *handle, uint64_t length);
+
+/**
+ * Set the length of a file, truncating or extending it. This is needed
+ * after @ref lha_arch_skip to give a file that ends with a hole its
+ * full length.
+ *
+ * @param handle      Handle of a file opened with @ref lha_arch_fopen.
+ * @param length      New length of the file, in bytes.
+ * @return            Non-zero for success, or zero for failure.
+ */
+
+int lha_arch_set_length(FILE *handle, uint64_t length);
+
 /**
  * Query whether the specified file exists.
  *
@@ -156,5 +289,260 @@ LHAFileType lha_arch_exists(char *filename);
 
 int lha_arch_symlink(char *path, char *target);
 
+/**
+ * Create a hard link to an existing file.
+ *
+ * If a file already exists at the location of the link to be created, it is
+ * overwritten.
+ *
+ * @param path        Path to the link to create.
+ * @param target      Path to the existing file.
+ * @return            Non-zero for success.
+ */
+
+int lha_arch_hardlink(char *path, char *target);
+
+/**
+ * Make a file share the contents of another file without copying the
+ * data (a "reflink"), if the filesystem supports it.
+ *
+ * @param handle      The FILE handle of the file to replace the
+ *                    contents of.
+ * @param source      The FILE handle of the file to share contents with.
+ * @return            Non-zero for success, or zero if the contents
+ *                    could not be shared.
+ */
+
+int lha_arch_reflink(FILE *handle, FILE *source);
+
+/**
+ * Copy data from one open file to the current position of another,
+ * within the kernel where the platform supports it, so that the data
+ * does not need to be copied through a user-space buffer. The position
+ * of the source file is not used or changed. The destination must not
+ * also be written with stdio functions, as for @ref lha_arch_write.
+ *
+ * @param handle      The FILE handle of the file to write to.
+ * @param source      The FILE handle of the file to copy from.
+ * @param offset      Offset within the source file to copy from.
+ * @param length      Number of bytes to copy.
+ * @return            Number of bytes copied. This is less than the
+ *                    length requested if the copy is not supported or
+ *                    an error occurred, in which case the rest of the
+ *                    data must be written in the usual way.
+ */
+
+uint64_t lha_arch_copy_file(FILE *handle, FILE *source,
+                            uint64_t offset, uint64_t length);
+
+/**
+ * Get the size and modification time of an open file.
+ *
+ * @param handle      The FILE handle.
+ * @param size        Pointer to a variable in which to store the size
+ *                    of the file, in bytes.
+ * @param mtime       Pointer to a variable in which to store the
+ *                    modification time of the file. The units depend
+ *                    on the platform; the value is only useful for
+ *                    comparing against another value from this function.
+ * @return            Non-zero for success, or zero for failure.
+ */
+
+int lha_arch_file_stamp(FILE *handle, uint64_t *size, uint64_t *mtime);
+
+/**
+ * Map the contents of an open file into memory for reading.
+ *
+ * Only regular files can be mapped; for pipes and other special files,
+ * NULL is returned and the file must be read in the usual way.
+ *
+ * @param handle      The FILE handle.
+ * @param len         Pointer to a variable in which to store the length
+ *                    of the mapped data, in bytes.
+ * @return            Pointer to the mapped data, or NULL if the file
+ *                    could not be mapped.
+ */
+
+void *lha_arch_map_file(FILE *handle, size_t *len);
+
+/**
+ * Read data from the specified offset within an open file, without
+ * using or changing the current position of the FILE handle.
+ *
+ * @param handle      The FILE handle.
+ * @param buf         Pointer to buffer in which to store read data.
+ * @param buf_len     Size of buffer, in bytes.
+ * @param offset      Offset within the file to read from.
+ * @return            Number of bytes read, zero for end of file, or -1
+ *                    if an error occurred.
+ */
+
+int lha_arch_pread(FILE *handle, void *buf, size_t buf_len, size_t offset);
+
+/**
+ * Unmap memory previously mapped by @ref lha_arch_map_file.
+ *
+ * @param data        Pointer to the mapped data.
+ * @param len         Length of the mapped data, in bytes.
+ */
+
+void lha_arch_unmap_file(void *data, size_t len);
+
+/**
+ * If a file handle is a pipe, try to make the pipe's buffer larger, so
+ * that more data can be written before the reader catches up.
+ *
+ * @param handle      The file handle.
+ * @param size        Size of buffer wanted, in bytes.
+ * @return            Non-zero if the buffer was made larger.
+ */
+
+int lha_arch_grow_pipe(FILE *handle, size_t size);
+
+/**
+ * Allocate memory aligned to the specified boundary.
+ *
+ * @param size        Size of the memory to allocate, in bytes.
+ * @param alignment   Required alignment, in bytes. This must be a power
+ *                    of two, and a multiple of sizeof(void *).
+ * @return            Pointer to the memory, or NULL if it could not be
+ *                    allocated. It must be freed with
+ *                    @ref lha_arch_free_aligned.
+ */
+
+void *lha_arch_alloc_aligned(size_t size, size_t alignment);
+
+/**
+ * Free memory allocated by @ref lha_arch_alloc_aligned.
+ *
+ * @param ptr         Pointer to the memory, or NULL.
+ */
+
+void lha_arch_free_aligned(void *ptr);
+
+/**
+ * Allocate a large block of memory, using huge pages where the system
+ * allows, to reduce TLB misses when it is accessed randomly. The memory
+ * is page aligned and filled with zeroes.
+ *
+ * @param size        Size of the memory to allocate, in bytes.
+ * @return            Pointer to the memory, or NULL if it could not be
+ *                    allocated. It must be freed with
+ *                    @ref lha_arch_free_huge.
+ */
+
+void *lha_arch_alloc_huge(size_t size);
+
+/**
+ * Free memory allocated by @ref lha_arch_alloc_huge.
+ *
+ * @param ptr         Pointer to the memory.
+ * @param size        Size that was allocated, in bytes.
+ */
+
+void lha_arch_free_huge(void *ptr, size_t size);
+
+/**
+ * Opaque types for threads and synchronization primitives.
+ */
+
+typedef struct _LHAArchThread LHAArchThread;
+typedef struct _LHAArchMutex LHAArchMutex;
+typedef struct _LHAArchCond LHAArchCond;
+
+/**
+ * Get the number of processors available to run threads on.
+ *
+ * @return            Number of processors (at least one).
+ */
+
+unsigned int lha_arch_num_cpus(void);
+
+/**
+ * Start a new thread.
+ *
+ * @param func        Function to run in the new thread.
+ * @param data        Pointer to pass to the function.
+ * @return            Pointer to a structure representing the thread, or
+ *                    NULL if the thread could not be started.
+ */
+
+LHAArchThread *lha_arch_thread_new(void (*func)(void *data), void *data);
+
+/**
+ * Wait for a thread to finish, and free the thread structure.
+ *
+ * @param thread      The thread.
+ */
+
+void lha_arch_thread_join(LHAArchThread *thread);
+
+/**
+ * Create a new mutex.
+ *
+ * @return            Pointer to the new mutex, or NULL for failure.
+ */
+
+LHAArchMutex *lha_arch_mutex_new(void);
+
+/**
+ * Free a mutex. The mutex must not be locked.
+ *
+ * @param mutex       The mutex.
+ */
+
+void lha_arch_mutex_free(LHAArchMutex *mutex);
+
+/**
+ * Lock a mutex, waiting until it is available.
+ *
+ * @param mutex       The mutex.
+ */
+
+void lha_arch_mutex_lock(LHAArchMutex *mutex);
+
+/**
+ * Unlock a mutex.
+ *
+ * @param mutex       The mutex.
+ */
+
+void lha_arch_mutex_unlock(LHAArchMutex *mutex);
+
+/**
+ * Create a new condition variable.
+ *
+ * @return            Pointer to the new condition variable, or NULL for
+ *                    failure.
+ */
+
+LHAArchCond *lha_arch_cond_new(void);
+
+/**
+ * Free a condition variable. No threads may be waiting on it.
+ *
+ * @param cond        The condition variable.
+ */
+
+void lha_arch_cond_free(LHAArchCond *cond);
+
+/**
+ * Wait on a condition variable. The mutex must be locked; it is
+ * unlocked while waiting, and locked again before returning.
+ *
+ * @param cond        The condition variable.
+ * @param mutex       The mutex.
+ */
+
+void lha_arch_cond_wait(LHAArchCond *cond, LHAArchMutex *mutex);
+
+/**
+ * Wake up all threads waiting on a condition variable.
+ *
+ * @param cond        The condition variable.
+ */
+
+void lha_arch_cond_broadcast(LHAArchCond *cond);
+
 #endif /* ifndef LHASA_LHA_ARCH_H */
 
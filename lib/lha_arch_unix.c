@@ -28,13 +28,29 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #if LHA_ARCH == LHA_ARCH_UNIX
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <utime.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+// Largest amount of data copied by each call to copy_file_range() or
+// sendfile(), which can't copy more than 2GB at a time.
+
+#define COPY_CHUNK_SIZE (1024 * 1024 * 1024)
+
 // TODO: This file depends on vasprintf(), which is a non-standard
 // function (_GNU_SOURCE above). Most modern Unix systems have an
 // implementation of it, but develop a compatible workaround for
@@ -51,6 +67,21 @@ void lha_arch_set_binary(FILE *handle)
 	// "text" and "binary" files.
 }
 
+int lha_arch_is_terminal(FILE *handle)
+{
+	return isatty(fileno(handle));
+}
+
+unsigned int lha_arch_clock_ms(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (unsigned int) now.tv_sec * 1000
+	     + (unsigned int) (now.tv_usec / 1000);
+}
+
 int lha_arch_mkdir(char *path, unsigned int unix_perms)
 {
 	return mkdir(path, unix_perms) == 0;
@@ -76,6 +107,87 @@ int lha_arch_utime(char *filename, unsigned int timestamp)
 	return utime(filename, &times) == 0;
 }
 
+int lha_arch_futime(FILE *handle, unsigned int timestamp)
+{
+	struct timespec times[2];
+
+	if (fflush(handle) != 0) {
+		return 0;
+	}
+
+	times[0].tv_sec = (time_t) timestamp;
+	times[0].tv_nsec = 0;
+	times[1] = times[0];
+
+	return futimens(fileno(handle), times) == 0;
+}
+
+int lha_arch_fset_windows_timestamps(FILE *handle,
+                                     uint64_t creation_time,
+                                     uint64_t modification_time,
+                                     uint64_t access_time)
+{
+	// Windows-specific timestamps are only used on Windows.
+
+	return 0;
+}
+
+int lha_arch_set_dir_metadata(char *path, int unix_uid, int unix_gid,
+                              int unix_perms, unsigned int timestamp)
+{
+	struct timespec times[2];
+	int result;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+	if (fd < 0) {
+		return 0;
+	}
+
+	result = 1;
+
+	if (timestamp != 0) {
+		times[0].tv_sec = (time_t) timestamp;
+		times[0].tv_nsec = 0;
+		times[1] = times[0];
+		futimens(fd, times);
+	}
+
+	// As when creating files, failing to change the owner is not
+	// treated as a fatal error. Permissions are set afterwards, so
+	// as not to briefly grant permissions to the wrong group.
+
+	if (unix_uid >= 0) {
+		if (fchown(fd, unix_uid, unix_gid) != 0) {
+			// Ignore.
+		}
+	}
+
+	if (unix_perms >= 0 && fchmod(fd, unix_perms) != 0) {
+		result = 0;
+	}
+
+	close(fd);
+
+	return result;
+}
+
+FILE *lha_arch_fopen_read(char *filename)
+{
+	FILE *fstream;
+
+	fstream = fopen(filename, "rb");
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (fstream != NULL) {
+		posix_fadvise(fileno(fstream), 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+#endif
+
+	return fstream;
+}
+
 FILE *lha_arch_fopen(char *filename, int unix_uid, int unix_gid, int unix_perms)
 {
 	FILE *fstream;
@@ -144,6 +256,56 @@ FILE *lha_arch_fopen(char *filename, int unix_uid, int unix_gid, int unix_perms)
 	return fstream;
 }
 
+int lha_arch_preallocate(FILE *handle, uint64_t length)
+{
+	// posix_fallocate() also extends the file to the new length,
+	// which would leave a truncated file padded with zeroes if the
+	// decompression failed. Only preallocate where space can be
+	// reserved without changing the file size.
+
+#ifdef FALLOC_FL_KEEP_SIZE
+	return fallocate(fileno(handle), FALLOC_FL_KEEP_SIZE,
+	                 0, (off_t) length) == 0;
+#else
+	return 0;
+#endif
+}
+
+int lha_arch_write(FILE *handle, const void *buf, size_t buf_len)
+{
+	const uint8_t *p = buf;
+	ssize_t result;
+
+	while (buf_len > 0) {
+		result = write(fileno(handle), p, buf_len);
+
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+
+		p += result;
+		buf_len -= (size_t) result;
+	}
+
+	return 1;
+}
+
+int lha_arch_skip(FILE *handle, uint64_t length)
+{
+	// Seeking past the end of a file leaves a hole, on filesystems
+	// that support them.
+
+	return lseek(fileno(handle), (off_t) length, SEEK_CUR) != (off_t) -1;
+}
+
+int lha_arch_set_length(FILE *handle, uint64_t length)
+{
+	return ftruncate(fileno(handle), (off_t) length) == 0;
+}
+
 LHAFileType lha_arch_exists(char *filename)
 {
 	struct stat statbuf;
@@ -169,5 +331,322 @@ int lha_arch_symlink(char *path, char *target)
 	return symlink(target, path) == 0;
 }
 
+int lha_arch_hardlink(char *path, char *target)
+{
+	unlink(path);
+	return link(target, path) == 0;
+}
+
+int lha_arch_reflink(FILE *handle, FILE *source)
+{
+#ifdef FICLONE
+	return ioctl(fileno(handle), FICLONE, fileno(source)) == 0;
+#else
+	return 0;
+#endif
+}
+
+uint64_t lha_arch_copy_file(FILE *handle, FILE *source,
+                            uint64_t offset, uint64_t length)
+{
+#ifdef __linux__
+	loff_t in_offset;
+	off_t sendfile_offset;
+	uint64_t copied;
+	ssize_t result;
+	size_t n;
+	int use_sendfile;
+
+	// copy_file_range() only works between files on the same
+	// filesystem (and is missing from older kernels), so if it fails
+	// before anything is copied, try sendfile() instead.
+
+	in_offset = (loff_t) offset;
+	copied = 0;
+	use_sendfile = 0;
+
+	while (copied < length) {
+		n = length - copied > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE
+		                                      : (size_t) (length - copied);
+
+#ifdef __NR_copy_file_range
+		if (!use_sendfile) {
+			result = (ssize_t) syscall(__NR_copy_file_range,
+			                           fileno(source), &in_offset,
+			                           fileno(handle), NULL, n, 0);
+
+			if (result < 0 && copied == 0 && errno != EINTR) {
+				use_sendfile = 1;
+				continue;
+			}
+		} else
+#endif
+		{
+			sendfile_offset = (off_t) in_offset;
+			result = sendfile(fileno(handle), fileno(source),
+			                  &sendfile_offset, n);
+			in_offset = (loff_t) sendfile_offset;
+		}
+
+		if (result < 0 && errno == EINTR) {
+			continue;
+		} else if (result <= 0) {
+			break;
+		}
+
+		copied += (uint64_t) result;
+	}
+
+	return copied;
+#else
+	return 0;
+#endif
+}
+
+int lha_arch_file_stamp(FILE *handle, uint64_t *size, uint64_t *mtime)
+{
+	struct stat statbuf;
+
+	if (fstat(fileno(handle), &statbuf) != 0) {
+		return 0;
+	}
+
+	*size = (uint64_t) statbuf.st_size;
+	*mtime = (uint64_t) statbuf.st_mtime;
+
+	return 1;
+}
+
+void *lha_arch_map_file(FILE *handle, size_t *len)
+{
+	struct stat statbuf;
+	void *result;
+
+	// Only regular files can be mapped. An empty file can't be
+	// mapped either, but there is nothing to read from it anyway.
+
+	if (fstat(fileno(handle), &statbuf) != 0
+	 || !S_ISREG(statbuf.st_mode) || statbuf.st_size <= 0
+	 || (uint64_t) statbuf.st_size > (size_t) -1) {
+		return NULL;
+	}
+
+	result = mmap(NULL, (size_t) statbuf.st_size, PROT_READ, MAP_PRIVATE,
+	              fileno(handle), 0);
+
+	if (result == MAP_FAILED) {
+		return NULL;
+	}
+
+	// Archives are almost always read from start to end, so hint
+	// that the kernel should read ahead aggressively.
+
+#ifdef MADV_SEQUENTIAL
+	madvise(result, (size_t) statbuf.st_size, MADV_SEQUENTIAL);
+#endif
+
+	*len = (size_t) statbuf.st_size;
+
+	return result;
+}
+
+int lha_arch_pread(FILE *handle, void *buf, size_t buf_len, size_t offset)
+{
+	return (int) pread(fileno(handle), buf, buf_len, (off_t) offset);
+}
+
+void lha_arch_unmap_file(void *data, size_t len)
+{
+	munmap(data, len);
+}
+
+int lha_arch_grow_pipe(FILE *handle, size_t size)
+{
+#ifdef F_SETPIPE_SZ
+	// This fails if the handle is not a pipe, or if the size is over
+	// the limit for unprivileged processes; either way, the pipe is
+	// used as it is.
+
+	return fcntl(fileno(handle), F_SETPIPE_SZ, (int) size) >= 0;
+#else
+	return 0;
+#endif
+}
+
+void *lha_arch_alloc_aligned(size_t size, size_t alignment)
+{
+	void *result;
+
+	if (posix_memalign(&result, alignment, size) != 0) {
+		return NULL;
+	}
+
+	return result;
+}
+
+void lha_arch_free_aligned(void *ptr)
+{
+	free(ptr);
+}
+
+void *lha_arch_alloc_huge(size_t size)
+{
+	void *result;
+
+	result = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (result == MAP_FAILED) {
+		return NULL;
+	}
+
+	// Ask for transparent huge pages. This is only a hint; if they
+	// are not available, normal pages are used.
+
+#ifdef MADV_HUGEPAGE
+	madvise(result, size, MADV_HUGEPAGE);
+#endif
+
+	return result;
+}
+
+void lha_arch_free_huge(void *ptr, size_t size)
+{
+	munmap(ptr, size);
+}
+
+struct _LHAArchThread {
+	pthread_t thread;
+	void (*func)(void *data);
+	void *data;
+};
+
+struct _LHAArchMutex {
+	pthread_mutex_t mutex;
+};
+
+struct _LHAArchCond {
+	pthread_cond_t cond;
+};
+
+unsigned int lha_arch_num_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long result;
+
+	result = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (result > 0) {
+		return (unsigned int) result;
+	}
+#endif
+
+	return 1;
+}
+
+static void *thread_main(void *data)
+{
+	LHAArchThread *thread = data;
+
+	thread->func(thread->data);
+
+	return NULL;
+}
+
+LHAArchThread *lha_arch_thread_new(void (*func)(void *data), void *data)
+{
+	LHAArchThread *thread;
+
+	thread = malloc(sizeof(LHAArchThread));
+
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->func = func;
+	thread->data = data;
+
+	if (pthread_create(&thread->thread, NULL, thread_main, thread) != 0) {
+		free(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+void lha_arch_thread_join(LHAArchThread *thread)
+{
+	pthread_join(thread->thread, NULL);
+	free(thread);
+}
+
+LHAArchMutex *lha_arch_mutex_new(void)
+{
+	LHAArchMutex *mutex;
+
+	mutex = malloc(sizeof(LHAArchMutex));
+
+	if (mutex == NULL) {
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&mutex->mutex, NULL) != 0) {
+		free(mutex);
+		return NULL;
+	}
+
+	return mutex;
+}
+
+void lha_arch_mutex_free(LHAArchMutex *mutex)
+{
+	pthread_mutex_destroy(&mutex->mutex);
+	free(mutex);
+}
+
+void lha_arch_mutex_lock(LHAArchMutex *mutex)
+{
+	pthread_mutex_lock(&mutex->mutex);
+}
+
+void lha_arch_mutex_unlock(LHAArchMutex *mutex)
+{
+	pthread_mutex_unlock(&mutex->mutex);
+}
+
+LHAArchCond *lha_arch_cond_new(void)
+{
+	LHAArchCond *cond;
+
+	cond = malloc(sizeof(LHAArchCond));
+
+	if (cond == NULL) {
+		return NULL;
+	}
+
+	if (pthread_cond_init(&cond->cond, NULL) != 0) {
+		free(cond);
+		return NULL;
+	}
+
+	return cond;
+}
+
+void lha_arch_cond_free(LHAArchCond *cond)
+{
+	pthread_cond_destroy(&cond->cond);
+	free(cond);
+}
+
+void lha_arch_cond_wait(LHAArchCond *cond, LHAArchMutex *mutex)
+{
+	pthread_cond_wait(&cond->cond, &mutex->mutex);
+}
+
+void lha_arch_cond_broadcast(LHAArchCond *cond)
+{
+	pthread_cond_broadcast(&cond->cond);
+}
+
 #endif /* LHA_ARCH_UNIX */
 
@@ -29,11 +29,13 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <winioctl.h>
 #include <fcntl.h>
 #include <io.h>
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 static uint64_t unix_epoch_offset = 0;
 
@@ -58,6 +60,16 @@ void lha_arch_set_binary(FILE *handle)
 	_setmode(_fileno(handle), _O_BINARY);
 }
 
+int lha_arch_is_terminal(FILE *handle)
+{
+	return _isatty(_fileno(handle));
+}
+
+unsigned int lha_arch_clock_ms(void)
+{
+	return (unsigned int) GetTickCount();
+}
+
 int lha_arch_mkdir(char *path, unsigned int unix_mode)
 {
 	return CreateDirectoryA(path, NULL) != 0;
@@ -134,10 +146,11 @@ int lha_arch_set_windows_timestamps(char *filename,
 	                      &_modification_time, &_access_time);
 }
 
-int lha_arch_utime(char *filename, unsigned int timestamp)
+// Convert a Unix timestamp to a Windows FILETIME.
+
+static void unix_to_filetime(unsigned int timestamp, FILETIME *filetime)
 {
 	SYSTEMTIME unix_epoch;
-	FILETIME filetime;
 	uint64_t ts_scaled;
 
 	// Calculate offset between Windows FILETIME Jan 1, 1601 epoch
@@ -153,25 +166,229 @@ int lha_arch_utime(char *filename, unsigned int timestamp)
 		unix_epoch.wSecond = 0;
 		unix_epoch.wMilliseconds = 0;
 
-		SystemTimeToFileTime(&unix_epoch, &filetime);
-		unix_epoch_offset = ((uint64_t) filetime.dwHighDateTime << 32)
-		                  + filetime.dwLowDateTime;
+		SystemTimeToFileTime(&unix_epoch, filetime);
+		unix_epoch_offset = ((uint64_t) filetime->dwHighDateTime << 32)
+		                  + filetime->dwLowDateTime;
 	}
 
 	// Convert to Unix FILETIME.
 
 	ts_scaled = (uint64_t) timestamp * 10000000 + unix_epoch_offset;
-	filetime.dwHighDateTime = (uint32_t) ((ts_scaled >> 32) & 0xffffffff);
-	filetime.dwLowDateTime = (uint32_t) (ts_scaled & 0xffffffff);
+	filetime->dwHighDateTime = (uint32_t) ((ts_scaled >> 32) & 0xffffffff);
+	filetime->dwLowDateTime = (uint32_t) (ts_scaled & 0xffffffff);
+}
+
+int lha_arch_utime(char *filename, unsigned int timestamp)
+{
+	FILETIME filetime;
+
+	unix_to_filetime(timestamp, &filetime);
 
 	// Set all timestamps to the same value:
 
 	return set_timestamps(filename, &filetime, &filetime, &filetime);
 }
 
+// Set the timestamps of a file through the handle it was opened with.
+
+static int fset_timestamps(FILE *handle,
+                           FILETIME *creation_time,
+                           FILETIME *modification_time,
+                           FILETIME *access_time)
+{
+	HANDLE file;
+
+	if (fflush(handle) != 0) {
+		return 0;
+	}
+
+	file = (HANDLE) _get_osfhandle(_fileno(handle));
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+
+	return SetFileTime(file, creation_time,
+	                   access_time, modification_time) != 0;
+}
+
+int lha_arch_futime(FILE *handle, unsigned int timestamp)
+{
+	FILETIME filetime;
+
+	unix_to_filetime(timestamp, &filetime);
+
+	return fset_timestamps(handle, &filetime, &filetime, &filetime);
+}
+
+int lha_arch_fset_windows_timestamps(FILE *handle,
+                                     uint64_t creation_time,
+                                     uint64_t modification_time,
+                                     uint64_t access_time)
+{
+	FILETIME _creation_time;
+	FILETIME _modification_time;
+	FILETIME _access_time;
+
+	_creation_time.dwHighDateTime
+	    = (uint32_t) ((creation_time >> 32) & 0xffffffff);
+	_creation_time.dwLowDateTime
+	    = (uint32_t) (creation_time & 0xffffffff);
+
+	_modification_time.dwHighDateTime
+	    = (uint32_t) ((modification_time >> 32) & 0xffffffff);
+	_modification_time.dwLowDateTime
+	    = (uint32_t) (modification_time & 0xffffffff);
+
+	_access_time.dwHighDateTime
+	    = (uint32_t) ((access_time >> 32) & 0xffffffff);
+	_access_time.dwLowDateTime
+	    = (uint32_t) (access_time & 0xffffffff);
+
+	return fset_timestamps(handle, &_creation_time,
+	                       &_modification_time, &_access_time);
+}
+
+int lha_arch_set_dir_metadata(char *path, int unix_uid, int unix_gid,
+                              int unix_perms, unsigned int timestamp)
+{
+	// There are no Unix owners or permissions to set on Windows.
+
+	if (timestamp != 0) {
+		lha_arch_utime(path, timestamp);
+	}
+
+	return 1;
+}
+
+// Wrap a handle opened with CreateFileA in a C file handle, which
+// takes ownership of it.
+
+static FILE *fdopen_handle(HANDLE file, int flags, char *mode)
+{
+	FILE *fstream;
+	int fd;
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+
+	fd = _open_osfhandle((intptr_t) file, flags | _O_BINARY);
+
+	if (fd < 0) {
+		CloseHandle(file);
+		return NULL;
+	}
+
+	fstream = _fdopen(fd, mode);
+
+	if (fstream == NULL) {
+		_close(fd);
+	}
+
+	return fstream;
+}
+
+FILE *lha_arch_fopen_read(char *filename)
+{
+	HANDLE file;
+
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+	                   OPEN_EXISTING,
+	                   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+	                   NULL);
+
+	return fdopen_handle(file, _O_RDONLY, "rb");
+}
+
 FILE *lha_arch_fopen(char *filename, int unix_uid, int unix_gid, int unix_perms)
 {
-	return fopen(filename, "wb");
+	HANDLE file;
+
+	// The file is opened natively rather than with fopen(), so that
+	// Windows can be told that it will be written sequentially.
+	// Attributes can be read as well as written, for
+	// lha_arch_file_stamp.
+
+	file = CreateFileA(filename, GENERIC_WRITE | FILE_READ_ATTRIBUTES,
+	                   FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+	                   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+	                   NULL);
+
+	return fdopen_handle(file, _O_WRONLY, "wb");
+}
+
+int lha_arch_preallocate(FILE *handle, uint64_t length)
+{
+	FILE_ALLOCATION_INFO info;
+	HANDLE file;
+
+	file = (HANDLE) _get_osfhandle(_fileno(handle));
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+
+	info.AllocationSize.QuadPart = (LONGLONG) length;
+
+	return SetFileInformationByHandle(file, FileAllocationInfo,
+	                                  &info, sizeof(info)) != 0;
+}
+
+int lha_arch_write(FILE *handle, const void *buf, size_t buf_len)
+{
+	const uint8_t *p = buf;
+	HANDLE file;
+	DWORD chunk, written;
+
+	// Data is written straight to the file handle, skipping the
+	// locking and text mode handling in the C library's _write().
+	// WriteFile() takes a 32-bit length, so very large buffers are
+	// written in pieces.
+
+	file = (HANDLE) _get_osfhandle(_fileno(handle));
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+
+	while (buf_len > 0) {
+		chunk = buf_len > 0x40000000 ? 0x40000000 : (DWORD) buf_len;
+
+		if (!WriteFile(file, p, chunk, &written, NULL)
+		 || written == 0) {
+			return 0;
+		}
+
+		p += written;
+		buf_len -= written;
+	}
+
+	return 1;
+}
+
+int lha_arch_skip(FILE *handle, uint64_t length)
+{
+	HANDLE file;
+	DWORD bytes;
+
+	// Files are only left with holes on NTFS if they are marked as
+	// sparse; otherwise the skipped range is filled with zeroes.
+	// Failure to mark the file is not an error.
+
+	file = (HANDLE) _get_osfhandle(_fileno(handle));
+
+	if (file != INVALID_HANDLE_VALUE) {
+		DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0,
+		                &bytes, NULL);
+	}
+
+	return _lseeki64(_fileno(handle), (__int64) length, SEEK_CUR) != -1;
+}
+
+int lha_arch_set_length(FILE *handle, uint64_t length)
+{
+	return _chsize_s(_fileno(handle), (__int64) length) == 0;
 }
 
 LHAFileType lha_arch_exists(char *filename)
@@ -200,5 +417,302 @@ int lha_arch_symlink(char *path, char *target)
 	return 1;
 }
 
+int lha_arch_hardlink(char *path, char *target)
+{
+	DeleteFileA(path);
+	return CreateHardLinkA(path, target, NULL) != 0;
+}
+
+int lha_arch_reflink(FILE *handle, FILE *source)
+{
+	// Not supported.
+	return 0;
+}
+
+uint64_t lha_arch_copy_file(FILE *handle, FILE *source,
+                            uint64_t offset, uint64_t length)
+{
+	// Not supported.
+	return 0;
+}
+
+int lha_arch_file_stamp(FILE *handle, uint64_t *size, uint64_t *mtime)
+{
+	HANDLE file;
+	LARGE_INTEGER file_size;
+	FILETIME modification_time;
+
+	file = (HANDLE) _get_osfhandle(_fileno(handle));
+
+	if (file == INVALID_HANDLE_VALUE
+	 || !GetFileSizeEx(file, &file_size)
+	 || !GetFileTime(file, NULL, NULL, &modification_time)) {
+		return 0;
+	}
+
+	*size = (uint64_t) file_size.QuadPart;
+	*mtime = ((uint64_t) modification_time.dwHighDateTime << 32)
+	       | modification_time.dwLowDateTime;
+
+	return 1;
+}
+
+void *lha_arch_map_file(FILE *handle, size_t *len)
+{
+	HANDLE file, mapping;
+	LARGE_INTEGER size;
+	void *result;
+
+	file = (HANDLE) _get_osfhandle(_fileno(handle));
+
+	// Only regular files on disk can be mapped.
+
+	if (file == INVALID_HANDLE_VALUE
+	 || GetFileType(file) != FILE_TYPE_DISK
+	 || !GetFileSizeEx(file, &size) || size.QuadPart <= 0
+	 || (uint64_t) size.QuadPart > (size_t) -1) {
+		return NULL;
+	}
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+	if (mapping == NULL) {
+		return NULL;
+	}
+
+	// The view keeps a reference to the mapping object, so the
+	// handle can be closed immediately.
+
+	result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+
+	if (result == NULL) {
+		return NULL;
+	}
+
+	*len = (size_t) size.QuadPart;
+
+	return result;
+}
+
+int lha_arch_pread(FILE *handle, void *buf, size_t buf_len, size_t offset)
+{
+	OVERLAPPED overlapped;
+	HANDLE file;
+	DWORD bytes_read;
+	int result;
+
+	// ReadFile() reads from the offset given in the OVERLAPPED
+	// structure, but on a synchronous handle like the one behind a
+	// FILE, it still moves the file pointer to the end of the data
+	// read. That would disturb the position of the FILE, so the read
+	// is done through a new handle to the same file, which has its
+	// own file pointer.
+
+	file = ReOpenFile((HANDLE) _get_osfhandle(_fileno(handle)),
+	                  GENERIC_READ,
+	                  FILE_SHARE_READ | FILE_SHARE_WRITE
+	                | FILE_SHARE_DELETE, 0);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD) offset;
+	overlapped.OffsetHigh = (DWORD) ((uint64_t) offset >> 32);
+
+	if (ReadFile(file, buf, (DWORD) buf_len, &bytes_read, &overlapped)) {
+		result = (int) bytes_read;
+	} else if (GetLastError() == ERROR_HANDLE_EOF) {
+		result = 0;
+	} else {
+		result = -1;
+	}
+
+	CloseHandle(file);
+
+	return result;
+}
+
+void lha_arch_unmap_file(void *data, size_t len)
+{
+	UnmapViewOfFile(data);
+}
+
+int lha_arch_grow_pipe(FILE *handle, size_t size)
+{
+	// The buffer size of a pipe is fixed when it is created.
+	return 0;
+}
+
+void *lha_arch_alloc_aligned(size_t size, size_t alignment)
+{
+	return _aligned_malloc(size, alignment);
+}
+
+void lha_arch_free_aligned(void *ptr)
+{
+	_aligned_free(ptr);
+}
+
+void *lha_arch_alloc_huge(size_t size)
+{
+	SIZE_T large_page;
+	void *result;
+
+	// Large pages can only be used by processes that hold the "lock
+	// pages in memory" privilege, and the size must be a multiple of
+	// the large page size. Otherwise, normal pages are used.
+
+	large_page = GetLargePageMinimum();
+
+	if (large_page > 0 && size % large_page == 0) {
+		result = VirtualAlloc(NULL, size,
+		                      MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+		                      PAGE_READWRITE);
+
+		if (result != NULL) {
+			return result;
+		}
+	}
+
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE,
+	                    PAGE_READWRITE);
+}
+
+void lha_arch_free_huge(void *ptr, size_t size)
+{
+	VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+// Condition variables require Windows Vista or later.
+
+struct _LHAArchThread {
+	HANDLE handle;
+	void (*func)(void *data);
+	void *data;
+};
+
+struct _LHAArchMutex {
+	CRITICAL_SECTION section;
+};
+
+struct _LHAArchCond {
+	CONDITION_VARIABLE cond;
+};
+
+unsigned int lha_arch_num_cpus(void)
+{
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+
+	if (info.dwNumberOfProcessors > 0) {
+		return (unsigned int) info.dwNumberOfProcessors;
+	}
+
+	return 1;
+}
+
+static DWORD WINAPI thread_main(LPVOID data)
+{
+	LHAArchThread *thread = data;
+
+	thread->func(thread->data);
+
+	return 0;
+}
+
+LHAArchThread *lha_arch_thread_new(void (*func)(void *data), void *data)
+{
+	LHAArchThread *thread;
+
+	thread = malloc(sizeof(LHAArchThread));
+
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->func = func;
+	thread->data = data;
+	thread->handle = CreateThread(NULL, 0, thread_main, thread, 0, NULL);
+
+	if (thread->handle == NULL) {
+		free(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+void lha_arch_thread_join(LHAArchThread *thread)
+{
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+	free(thread);
+}
+
+LHAArchMutex *lha_arch_mutex_new(void)
+{
+	LHAArchMutex *mutex;
+
+	mutex = malloc(sizeof(LHAArchMutex));
+
+	if (mutex == NULL) {
+		return NULL;
+	}
+
+	InitializeCriticalSection(&mutex->section);
+
+	return mutex;
+}
+
+void lha_arch_mutex_free(LHAArchMutex *mutex)
+{
+	DeleteCriticalSection(&mutex->section);
+	free(mutex);
+}
+
+void lha_arch_mutex_lock(LHAArchMutex *mutex)
+{
+	EnterCriticalSection(&mutex->section);
+}
+
+void lha_arch_mutex_unlock(LHAArchMutex *mutex)
+{
+	LeaveCriticalSection(&mutex->section);
+}
+
+LHAArchCond *lha_arch_cond_new(void)
+{
+	LHAArchCond *cond;
+
+	cond = malloc(sizeof(LHAArchCond));
+
+	if (cond == NULL) {
+		return NULL;
+	}
+
+	InitializeConditionVariable(&cond->cond);
+
+	return cond;
+}
+
+void lha_arch_cond_free(LHAArchCond *cond)
+{
+	free(cond);
+}
+
+void lha_arch_cond_wait(LHAArchCond *cond, LHAArchMutex *mutex)
+{
+	SleepConditionVariableCS(&cond->cond, &mutex->section, INFINITE);
+}
+
+void lha_arch_cond_broadcast(LHAArchCond *cond)
+{
+	WakeAllConditionVariable(&cond->cond);
+}
+
 #endif /* LHA_ARCH_WINDOWS */
 
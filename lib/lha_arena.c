@@ -0,0 +1,157 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "lha_arena.h"
+
+// Size of each chunk of memory allocated by an arena.
+
+#define CHUNK_SIZE (64 * 1024)
+
+// Allocations larger than this are not made from an arena, so that a
+// single large object doesn't waste most of a chunk.
+
+#define MAX_ALLOC_SIZE (CHUNK_SIZE / 8)
+
+// Allocations are rounded up to a multiple of this, to keep them
+// aligned.
+
+#define ALLOC_ALIGN 8
+
+struct _LHAArenaChunk {
+
+	// Number of references to the chunk: one for each object
+	// allocated from it, and one from the arena if it is the arena's
+	// current chunk.
+
+	unsigned int refcount;
+
+	// Number of bytes of the chunk used so far.
+
+	size_t used;
+
+	// Chunk data follows, aligned to ALLOC_ALIGN.
+};
+
+struct _LHAArena {
+
+	// Chunk that new objects are allocated from.
+
+	LHAArenaChunk *chunk;
+};
+
+// Offset of the data area within a chunk.
+
+#define CHUNK_DATA_OFFSET \
+	((sizeof(LHAArenaChunk) + ALLOC_ALIGN - 1) & ~(size_t) (ALLOC_ALIGN - 1))
+
+#define CHUNK_DATA(chunk) ((uint8_t *) (chunk) + CHUNK_DATA_OFFSET)
+
+LHAArena *lha_arena_new(void)
+{
+	return calloc(1, sizeof(LHAArena));
+}
+
+void lha_arena_free(LHAArena *arena)
+{
+	if (arena->chunk != NULL) {
+		lha_arena_chunk_release(arena->chunk);
+	}
+
+	free(arena);
+}
+
+// Start a new chunk for the arena to allocate from.
+
+static int new_chunk(LHAArena *arena)
+{
+	LHAArenaChunk *chunk;
+
+	chunk = malloc(CHUNK_DATA_OFFSET + CHUNK_SIZE);
+
+	if (chunk == NULL) {
+		return 0;
+	}
+
+	chunk->refcount = 1;
+	chunk->used = 0;
+
+	if (arena->chunk != NULL) {
+		lha_arena_chunk_release(arena->chunk);
+	}
+
+	arena->chunk = chunk;
+
+	return 1;
+}
+
+void *lha_arena_alloc(LHAArena *arena, LHAArenaChunk **chunk, size_t size)
+{
+	void *result;
+
+	size = (size + ALLOC_ALIGN - 1) & ~(size_t) (ALLOC_ALIGN - 1);
+
+	if (size > MAX_ALLOC_SIZE) {
+		return NULL;
+	}
+
+	// Memory for an existing object can only come from the chunk the
+	// object is already in, and only while that chunk is still being
+	// allocated from.
+
+	if (*chunk != NULL) {
+		if (*chunk != arena->chunk
+		 || (*chunk)->used + size > CHUNK_SIZE) {
+			return NULL;
+		}
+	} else {
+		if ((arena->chunk == NULL
+		     || arena->chunk->used + size > CHUNK_SIZE)
+		 && !new_chunk(arena)) {
+			return NULL;
+		}
+
+		*chunk = arena->chunk;
+		++(*chunk)->refcount;
+	}
+
+	result = CHUNK_DATA(*chunk) + (*chunk)->used;
+	(*chunk)->used += size;
+
+	return result;
+}
+
+int lha_arena_chunk_contains(LHAArenaChunk *chunk, void *ptr)
+{
+	uint8_t *p = ptr;
+
+	return p >= CHUNK_DATA(chunk) && p < CHUNK_DATA(chunk) + CHUNK_SIZE;
+}
+
+void lha_arena_chunk_release(LHAArenaChunk *chunk)
+{
+	--chunk->refcount;
+
+	if (chunk->refcount == 0) {
+		free(chunk);
+	}
+}
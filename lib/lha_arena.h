@@ -0,0 +1,102 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LHASA_LHA_ARENA_H
+#define LHASA_LHA_ARENA_H
+
+#include <stdlib.h>
+
+/**
+ * Arena allocator.
+ *
+ * An arena hands out memory from large chunks, so that many small
+ * objects (such as file headers and their strings) can be allocated
+ * without a call to malloc() for each one. Each object holds a
+ * reference to the chunk its memory came from, and a chunk is freed as
+ * a whole once all the objects in it, and the arena itself, have
+ * released it. Objects can therefore outlive the arena.
+ */
+
+typedef struct _LHAArena LHAArena;
+
+/**
+ * A chunk of memory from which an arena allocates objects.
+ */
+
+typedef struct _LHAArenaChunk LHAArenaChunk;
+
+/**
+ * Create a new arena.
+ *
+ * @return             Pointer to the new arena, or NULL for failure.
+ */
+
+LHAArena *lha_arena_new(void);
+
+/**
+ * Free an arena. Chunks that still contain objects are freed once
+ * those objects are released.
+ *
+ * @param arena        The arena.
+ */
+
+void lha_arena_free(LHAArena *arena);
+
+/**
+ * Allocate memory for an object from an arena.
+ *
+ * An object may be made up of several allocations, which must all come
+ * from the same chunk. For the first allocation, *chunk should be NULL;
+ * it is set to the chunk that was used, and the object holds a
+ * reference to it that must be released with
+ * @ref lha_arena_chunk_release. Later allocations for the same object
+ * pass the same pointer.
+ *
+ * @param arena        The arena.
+ * @param chunk        Pointer to the variable holding the chunk used by
+ *                     the object.
+ * @param size         Number of bytes to allocate.
+ * @return             Pointer to the memory, or NULL if it cannot be
+ *                     allocated from the object's chunk (for example,
+ *                     if it is large, or the chunk is full). The
+ *                     caller should then use malloc() instead.
+ */
+
+void *lha_arena_alloc(LHAArena *arena, LHAArenaChunk **chunk, size_t size);
+
+/**
+ * Check whether memory was allocated from the specified chunk.
+ *
+ * @param chunk        The chunk.
+ * @param ptr          Pointer to the memory.
+ * @return             Non-zero if the memory is part of the chunk.
+ */
+
+int lha_arena_chunk_contains(LHAArenaChunk *chunk, void *ptr);
+
+/**
+ * Release an object's reference to a chunk.
+ *
+ * @param chunk        The chunk.
+ */
+
+void lha_arena_chunk_release(LHAArenaChunk *chunk);
+
+#endif /* #ifndef LHASA_LHA_ARENA_H */
@@ -29,7 +29,11 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 struct _LHABasicReader {
 	LHAInputStream *stream;
+	LHAArena *arena;
+	int scan;
 	LHAFileHeader *curr_file;
+	size_t curr_file_offset;
+	size_t curr_data_offset;
 	size_t curr_file_remaining;
 	int eof;
 };
@@ -52,12 +56,55 @@ LHABasicReader *lha_basic_reader_new(LHAInputStream *stream)
 	return reader;
 }
 
+LHABasicReader *lha_basic_reader_new_for_file(LHAInputStream *stream,
+                                              LHAFileHeader *header)
+{
+	LHABasicReader *reader;
+
+	reader = lha_basic_reader_new(stream);
+
+	if (reader == NULL) {
+		return NULL;
+	}
+
+	// The stream is already positioned at the compressed data, so
+	// the header offset isn't known.
+
+	lha_file_header_add_ref(header);
+	reader->curr_file = header;
+	reader->curr_file_offset = 0;
+	reader->curr_data_offset = lha_input_stream_tell(stream);
+	reader->curr_file_remaining = header->compressed_length;
+
+	return reader;
+}
+
+int lha_basic_reader_use_arena(LHABasicReader *reader)
+{
+	if (reader->arena == NULL) {
+		reader->arena = lha_arena_new();
+	}
+
+	return reader->arena != NULL;
+}
+
+void lha_basic_reader_set_scan(LHABasicReader *reader, int scan)
+{
+	reader->scan = scan;
+}
+
 void lha_basic_reader_free(LHABasicReader *reader)
 {
 	if (reader->curr_file != NULL) {
 		lha_file_header_free(reader->curr_file);
 	}
 
+	// Headers that are still referenced keep their arena chunks.
+
+	if (reader->arena != NULL) {
+		lha_arena_free(reader->arena);
+	}
+
 	free(reader);
 }
 
@@ -87,18 +134,70 @@ LHAFileHeader *lha_basic_reader_next_file(LHABasicReader *reader)
 
 	// Read the header for the next file.
 
-	reader->curr_file = lha_file_header_read(reader->stream);
+	reader->curr_file_offset = lha_input_stream_tell(reader->stream);
+	reader->curr_file = lha_file_header_read(reader->stream,
+	                                         reader->arena, reader->scan);
 
 	if (reader->curr_file == NULL) {
 		reader->eof = 1;
 		return NULL;
 	}
 
+	reader->curr_data_offset = lha_input_stream_tell(reader->stream);
+
 	reader->curr_file_remaining = reader->curr_file->compressed_length;
 
 	return reader->curr_file;
 }
 
+LHAFileHeader *lha_basic_reader_next_file_at(LHABasicReader *reader,
+                                             LHAFileHeader *header,
+                                             size_t header_offset,
+                                             size_t data_offset)
+{
+	size_t pos;
+
+	if (reader->curr_file != NULL) {
+		lha_file_header_free(reader->curr_file);
+		reader->curr_file = NULL;
+	}
+
+	if (reader->eof || header == NULL) {
+		reader->eof = 1;
+		return NULL;
+	}
+
+	// Skip straight to the compressed data; there is no need to read
+	// the header, or anything in between. Only forward skips are
+	// possible.
+
+	pos = lha_input_stream_tell(reader->stream);
+
+	if (data_offset < pos
+	 || !lha_input_stream_skip(reader->stream, data_offset - pos)) {
+		reader->eof = 1;
+		return NULL;
+	}
+
+	lha_file_header_add_ref(header);
+	reader->curr_file = header;
+	reader->curr_file_offset = header_offset;
+	reader->curr_data_offset = data_offset;
+	reader->curr_file_remaining = header->compressed_length;
+
+	return header;
+}
+
+size_t lha_basic_reader_curr_file_offset(LHABasicReader *reader)
+{
+	return reader->curr_file_offset;
+}
+
+size_t lha_basic_reader_curr_data_offset(LHABasicReader *reader)
+{
+	return reader->curr_data_offset;
+}
+
 size_t lha_basic_reader_read_compressed(LHABasicReader *reader, void *buf,
                                         size_t buf_len)
 {
@@ -116,9 +215,14 @@ size_t lha_basic_reader_read_compressed(LHABasicReader *reader, void *buf,
 		bytes = buf_len;
 	}
 
-	if (!lha_input_stream_read(reader->stream, buf, bytes)) {
+	// A short read means that the archive has been truncated. Return
+	// whatever data was read, so that the decoder can decompress as
+	// much as possible, but don't try to read any more.
+
+	bytes = lha_input_stream_read_partial(reader->stream, buf, bytes);
+
+	if (bytes < buf_len && bytes < reader->curr_file_remaining) {
 		reader->eof = 1;
-		return 0;
 	}
 
 	// Update counter and return success.
@@ -128,16 +232,48 @@ size_t lha_basic_reader_read_compressed(LHABasicReader *reader, void *buf,
 	return bytes;
 }
 
+size_t lha_basic_reader_read_compressed_direct(LHABasicReader *reader,
+                                               uint8_t **buf,
+                                               size_t buf_len)
+{
+	size_t bytes;
+
+	if (reader->eof || reader->curr_file_remaining == 0) {
+		return 0;
+	}
+
+	if (buf_len > reader->curr_file_remaining) {
+		buf_len = reader->curr_file_remaining;
+	}
+
+	bytes = lha_input_stream_read_direct(reader->stream, buf, buf_len);
+
+	// Nothing available directly is not an error: the data may still
+	// be read through lha_basic_reader_read_compressed.
+
+	reader->curr_file_remaining -= bytes;
+
+	return bytes;
+}
+
 static size_t decoder_callback(void *buf, size_t buf_len, void *user_data)
 {
 	return lha_basic_reader_read_compressed(user_data, buf, buf_len);
 }
 
+static size_t decoder_direct_callback(uint8_t **buf, size_t buf_len,
+                                      void *user_data)
+{
+	return lha_basic_reader_read_compressed_direct(user_data,
+	                                               buf, buf_len);
+}
+
 // Create the decoder structure to decode the current file.
 
 LHADecoder *lha_basic_reader_decode(LHABasicReader *reader)
 {
 	LHADecoderType *dtype;
+	LHADecoder *decoder;
 
 	if (reader->curr_file == NULL) {
 		return NULL;
@@ -151,9 +287,58 @@ LHADecoder *lha_basic_reader_decode(LHABasicReader *reader)
 		return NULL;
 	}
 
-	// Create decoder.
+	// Create decoder. Stored files can then be read in place if
+	// the input stream is memory-mapped.
+
+	decoder = lha_decoder_new(dtype, decoder_callback, reader,
+	                          reader->curr_file->length);
+
+	if (decoder != NULL) {
+		lha_decoder_set_direct_input(decoder, decoder_direct_callback,
+		                             reader);
+	}
+
+	return decoder;
+}
+
+// Create a decoder to resume decoding the current file from a checkpoint.
+// The reader must be positioned at the byte containing the checkpoint.
+
+LHADecoder *lha_basic_reader_decode_at(LHABasicReader *reader,
+                                       LHADecoderCheckpoint *checkpoint)
+{
+	LHADecoderType *dtype;
+
+	if (reader->curr_file == NULL) {
+		return NULL;
+	}
+
+	dtype = lha_decoder_for_name(reader->curr_file->compress_method);
+
+	if (dtype == NULL) {
+		return NULL;
+	}
 
-	return lha_decoder_new(dtype, decoder_callback, reader,
-	                       reader->curr_file->length);
+	return lha_decoder_new_at(dtype, decoder_callback, reader,
+	                          reader->curr_file->length, checkpoint);
 }
 
+// Reset a previously-used decoder to decode the current file.
+
+int lha_basic_reader_reset_decoder(LHABasicReader *reader,
+                                   LHADecoder *decoder)
+{
+	if (reader->curr_file == NULL) {
+		return 0;
+	}
+
+	if (!lha_decoder_reset(decoder, decoder_callback, reader,
+	                       reader->curr_file->length)) {
+		return 0;
+	}
+
+	lha_decoder_set_direct_input(decoder, decoder_direct_callback,
+	                             reader);
+
+	return 1;
+}
@@ -44,6 +44,46 @@ typedef struct _LHABasicReader LHABasicReader;
 
 LHABasicReader *lha_basic_reader_new(LHAInputStream *stream);
 
+/**
+ * Create a new LHA reader to read the compressed data of a file whose
+ * header has already been read.
+ *
+ * @param stream     The input stream to read from, positioned at the
+ *                   start of the compressed data for the file (see
+ *                   @ref lha_input_stream_new_range).
+ * @param header     Header of the file. The reader adds a reference
+ *                   to the header, and it becomes the current file.
+ * @return           Pointer to an LHABasicReader structure, or NULL for
+ *                   error.
+ */
+
+LHABasicReader *lha_basic_reader_new_for_file(LHAInputStream *stream,
+                                              LHAFileHeader *header);
+
+/**
+ * Allocate the headers read by the reader from an arena, rather than
+ * with a separate set of allocations for each header. This is cheaper
+ * when reading many headers; memory is released a chunk at a time once
+ * all the headers in the chunk have been freed.
+ *
+ * @param reader         The reader.
+ * @return               Non-zero for success, or zero if the arena
+ *                       could not be allocated.
+ */
+
+int lha_basic_reader_use_arena(LHABasicReader *reader);
+
+/**
+ * Set whether the reader is scanning through the archive's headers.
+ * In scan mode, headers are only partly decoded as they are read; see
+ * @ref lha_file_header_decode_lazy.
+ *
+ * @param reader         The reader.
+ * @param scan           Non-zero to enable scan mode.
+ */
+
+void lha_basic_reader_set_scan(LHABasicReader *reader, int scan);
+
 /**
  * Free an LHA reader.
  *
@@ -73,6 +113,47 @@ LHAFileHeader *lha_basic_reader_curr_file(LHABasicReader *reader);
 
 LHAFileHeader *lha_basic_reader_next_file(LHABasicReader *reader);
 
+/**
+ * Advance to a file whose header has already been read, for example
+ * from a catalog of the archive, skipping over everything in between.
+ *
+ * @param reader         The LHABasicReader structure.
+ * @param header         Header of the file, or NULL to skip to the end
+ *                       of the input.
+ * @param header_offset  Offset within the input file of the header.
+ * @param data_offset    Offset within the input file of the compressed
+ *                       data. This must not be before the current
+ *                       position in the file.
+ * @return               The header, or NULL for end of input or if the
+ *                       input could not be advanced.
+ */
+
+LHAFileHeader *lha_basic_reader_next_file_at(LHABasicReader *reader,
+                                             LHAFileHeader *header,
+                                             size_t header_offset,
+                                             size_t data_offset);
+
+/**
+ * Get the offset within the input file of the header of the current file.
+ *
+ * @param reader     The LHABasicReader structure.
+ * @return           Offset of the header of the last file returned by
+ *                   @ref lha_basic_reader_next_file, in bytes.
+ */
+
+size_t lha_basic_reader_curr_file_offset(LHABasicReader *reader);
+
+/**
+ * Get the offset within the input file of the compressed data for the
+ * current file.
+ *
+ * @param reader     The LHABasicReader structure.
+ * @return           Offset of the compressed data of the current file,
+ *                   in bytes.
+ */
+
+size_t lha_basic_reader_curr_data_offset(LHABasicReader *reader);
+
 /**
  * Read some of the compressed data for the current archived file.
  *
@@ -84,6 +165,26 @@ LHAFileHeader *lha_basic_reader_next_file(LHABasicReader *reader);
 size_t lha_basic_reader_read_compressed(LHABasicReader *reader, void *buf,
                                        size_t buf_len);
 
+/**
+ * Read some of the compressed data for the current archived file,
+ * without copying it. This is only possible if the input stream is
+ * memory-mapped (see @ref lha_input_stream_read_direct).
+ *
+ * @param reader     The LHABasicReader structure.
+ * @param buf        Pointer to a variable in which to store a pointer
+ *                   to the data.
+ * @param buf_len    Maximum number of bytes to read.
+ * @return           Number of bytes available at the returned pointer,
+ *                   or zero if the data can not be accessed directly
+ *                   or there is no more compressed data. In the former
+ *                   case, @ref lha_basic_reader_read_compressed can
+ *                   still be used to read it.
+ */
+
+size_t lha_basic_reader_read_compressed_direct(LHABasicReader *reader,
+                                               uint8_t **buf,
+                                               size_t buf_len);
+
 /**
  * Create a decoder object to decompress the compressed data in the
  * current file.
@@ -95,5 +196,35 @@ size_t lha_basic_reader_read_compressed(LHABasicReader *reader, void *buf,
 
 LHADecoder *lha_basic_reader_decode(LHABasicReader *reader);
 
+/**
+ * Create a decoder object to resume decompressing the current file from
+ * a checkpoint.
+ *
+ * @param reader     The LHABasicReader structure. The input stream must
+ *                   be positioned at the byte of the compressed data
+ *                   that contains the checkpoint position (see
+ *                   @ref lha_basic_reader_new_for_file).
+ * @param checkpoint The checkpoint to resume from.
+ * @return           Pointer to a @ref LHADecoder structure, or NULL for
+ *                   failure.
+ */
+
+LHADecoder *lha_basic_reader_decode_at(LHABasicReader *reader,
+                                       LHADecoderCheckpoint *checkpoint);
+
+/**
+ * Reuse an existing decoder object to decompress the compressed data in
+ * the current file, instead of creating a new one.
+ *
+ * @param reader     The LHABasicReader structure.
+ * @param decoder    The decoder to reuse. This must be of the type
+ *                   needed to decompress the current file.
+ * @return           Non-zero if the decoder was reset to decompress the
+ *                   current file, or zero for failure.
+ */
+
+int lha_basic_reader_reset_decoder(LHABasicReader *reader,
+                                   LHADecoder *decoder);
+
 #endif /* #ifndef LHASA_LHA_BASIC_READER_H */
 
@@ -0,0 +1,893 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc16.h"
+#include "lha_arch.h"
+#include "lha_endian.h"
+#include "lha_basic_reader.h"
+#include "public/lha_catalog.h"
+
+// Initial number of entries to allocate space for.
+
+#define INITIAL_ENTRIES 16
+
+// Index file format. The index begins with a preamble:
+//
+//   0   8  Magic string (INDEX_MAGIC)
+//   8   8  Size of the archive file
+//   16  8  Modification time of the archive file
+//   24  4  Number of entries
+//
+// This is followed by a table containing an INDEX_ENTRY_LEN-byte
+// record for each entry:
+//
+//   0   8  Offset of the file header within the archive
+//   8   4  Length of the file header
+//   12  2  CRC of the file header, calculated with the CRC field of
+//          the common extended header (if present) set to zero
+//
+// The raw file headers follow, one after another, exactly as they
+// appear in the archive. After the headers, the decoder checkpoints
+// for each entry are stored: a 4-byte count, followed by a record for
+// each checkpoint:
+//
+//   0   8  Offset of the checkpoint within the decompressed data
+//   8   8  Offset of the checkpoint within the compressed data, in bits
+//   16  4  Length of the decoder state
+//   20     Decoder state
+//
+// All values are little-endian.
+
+#define INDEX_MAGIC        "LHAIDX02"
+#define INDEX_PREAMBLE_LEN 28
+#define INDEX_ENTRY_LEN    14
+#define CHECKPOINT_LEN     20
+
+// Limit on the length of decoder state in a checkpoint, used to detect
+// a corrupt index.
+
+#define MAX_STATE_LEN      (1 << 21)
+
+struct _LHACatalog {
+	LHACatalogEntry *entries;
+	unsigned int num_entries;
+
+	// Hash table used to look up entries by path. Each slot is either
+	// an index into entries[] plus one, or zero if empty. The table
+	// size is a power of two, at least twice the number of entries.
+
+	unsigned int *hash_table;
+	unsigned int hash_table_size;
+};
+
+// Hash function for paths (FNV-1a).
+
+static unsigned int hash_path(char *path)
+{
+	unsigned int result;
+	unsigned char *p;
+
+	result = 2166136261U;
+
+	for (p = (unsigned char *) path; *p != '\0'; ++p) {
+		result = (result ^ *p) * 16777619U;
+	}
+
+	return result;
+}
+
+// Find the slot in the hash table for the specified path: either the
+// slot containing the entry for that path, or the empty slot where it
+// should be inserted.
+
+static unsigned int *find_slot(LHACatalog *catalog, char *path)
+{
+	unsigned int mask, i;
+	unsigned int *slot;
+
+	mask = catalog->hash_table_size - 1;
+	i = hash_path(path) & mask;
+
+	for (;;) {
+		slot = &catalog->hash_table[i];
+
+		if (*slot == 0
+		 || !strcmp(catalog->entries[*slot - 1].path, path)) {
+			return slot;
+		}
+
+		i = (i + 1) & mask;
+	}
+}
+
+// Build the hash table once all entries have been read.
+
+static int build_hash_table(LHACatalog *catalog)
+{
+	unsigned int i;
+
+	catalog->hash_table_size = 1;
+
+	while (catalog->hash_table_size < catalog->num_entries * 2) {
+		catalog->hash_table_size <<= 1;
+	}
+
+	catalog->hash_table = calloc(catalog->hash_table_size,
+	                             sizeof(unsigned int));
+
+	if (catalog->hash_table == NULL) {
+		return 0;
+	}
+
+	// Later entries replace earlier ones with the same path.
+
+	for (i = 0; i < catalog->num_entries; ++i) {
+		*find_slot(catalog, catalog->entries[i].path) = i + 1;
+	}
+
+	return 1;
+}
+
+// Add an entry for a file to the catalog.
+
+static int add_entry(LHACatalog *catalog, unsigned int *entries_size,
+                     LHAFileHeader *header, size_t header_offset,
+                     size_t data_offset)
+{
+	LHACatalogEntry *entry;
+	LHACatalogEntry *new_entries;
+	unsigned int new_size;
+
+	if (catalog->num_entries >= *entries_size) {
+		new_size = *entries_size * 2;
+		new_entries = realloc(catalog->entries,
+		                      new_size * sizeof(LHACatalogEntry));
+
+		if (new_entries == NULL) {
+			return 0;
+		}
+
+		catalog->entries = new_entries;
+		*entries_size = new_size;
+	}
+
+	entry = &catalog->entries[catalog->num_entries];
+
+	entry->path = lha_file_header_full_path(header);
+
+	if (entry->path == NULL) {
+		return 0;
+	}
+
+	lha_file_header_add_ref(header);
+	entry->header = header;
+	entry->header_offset = header_offset;
+	entry->data_offset = data_offset;
+	entry->checkpoints = NULL;
+	entry->num_checkpoints = 0;
+	entry->duplicate_of = catalog->num_entries;
+
+	++catalog->num_entries;
+
+	return 1;
+}
+
+LHACatalog *lha_catalog_new(LHAInputStream *stream)
+{
+	LHACatalog *catalog;
+	LHABasicReader *reader;
+	LHAFileHeader *header;
+	unsigned int entries_size;
+
+	catalog = calloc(1, sizeof(LHACatalog));
+
+	if (catalog == NULL) {
+		return NULL;
+	}
+
+	entries_size = INITIAL_ENTRIES;
+	catalog->entries = malloc(entries_size * sizeof(LHACatalogEntry));
+	reader = lha_basic_reader_new(stream);
+
+	if (catalog->entries == NULL || reader == NULL) {
+		goto fail;
+	}
+
+	// Read all headers in the archive. The compressed data is skipped
+	// over without being read. As the catalog keeps every header, they
+	// are allocated from an arena. Headers are only partly decoded
+	// until an entry is looked up.
+
+	lha_basic_reader_use_arena(reader);
+	lha_basic_reader_set_scan(reader, 1);
+
+	for (;;) {
+		header = lha_basic_reader_next_file(reader);
+
+		if (header == NULL) {
+			break;
+		}
+
+		if (!add_entry(catalog, &entries_size, header,
+		               lha_basic_reader_curr_file_offset(reader),
+		               lha_basic_reader_curr_data_offset(reader))) {
+			goto fail;
+		}
+	}
+
+	if (!build_hash_table(catalog)) {
+		goto fail;
+	}
+
+	lha_basic_reader_free(reader);
+
+	return catalog;
+
+fail:
+	if (reader != NULL) {
+		lha_basic_reader_free(reader);
+	}
+	lha_catalog_free(catalog);
+	return NULL;
+}
+
+void lha_catalog_free(LHACatalog *catalog)
+{
+	unsigned int i;
+
+	for (i = 0; i < catalog->num_entries; ++i) {
+		lha_file_header_free(catalog->entries[i].header);
+		free(catalog->entries[i].path);
+		lha_decoder_free_checkpoints(catalog->entries[i].checkpoints,
+		                             catalog->entries[i].num_checkpoints);
+	}
+
+	free(catalog->entries);
+	free(catalog->hash_table);
+	free(catalog);
+}
+
+unsigned int lha_catalog_num_entries(LHACatalog *catalog)
+{
+	return catalog->num_entries;
+}
+
+LHACatalogEntry *lha_catalog_get(LHACatalog *catalog, unsigned int index)
+{
+	if (index >= catalog->num_entries) {
+		return NULL;
+	}
+
+	lha_file_header_decode_lazy(catalog->entries[index].header);
+
+	return &catalog->entries[index];
+}
+
+LHACatalogEntry *lha_catalog_find(LHACatalog *catalog, char *path)
+{
+	unsigned int *slot;
+
+	slot = find_slot(catalog, path);
+
+	if (*slot == 0) {
+		return NULL;
+	}
+
+	lha_file_header_decode_lazy(catalog->entries[*slot - 1].header);
+
+	return &catalog->entries[*slot - 1];
+}
+
+int lha_catalog_add_checkpoints(LHACatalog *catalog, LHAInputStream *stream,
+                                unsigned int index, size_t interval)
+{
+	LHACatalogEntry *entry;
+	LHAInputStream *range;
+	LHABasicReader *reader;
+	LHADecoder *decoder;
+	LHADecoderCheckpoint *checkpoints;
+	unsigned int num_checkpoints;
+	int success;
+
+	entry = lha_catalog_get(catalog, index);
+
+	if (entry == NULL) {
+		return 0;
+	}
+
+	range = lha_input_stream_new_range(stream, entry->data_offset,
+	                                   entry->header->compressed_length);
+
+	if (range == NULL) {
+		return 0;
+	}
+
+	reader = lha_basic_reader_new_for_file(range, entry->header);
+	decoder = NULL;
+	success = 0;
+
+	if (reader != NULL) {
+		decoder = lha_basic_reader_decode(reader);
+	}
+
+	// Decode the whole file to record the checkpoints. They are only
+	// kept if the file decoded correctly.
+
+	if (decoder != NULL
+	 && lha_decoder_record_checkpoints(decoder, interval)) {
+		lha_decoder_decode_to(decoder, NULL, NULL);
+
+		checkpoints = lha_decoder_take_checkpoints(decoder,
+		                                           &num_checkpoints);
+
+		if (lha_decoder_get_length(decoder) == entry->header->length
+		 && lha_decoder_get_crc(decoder) == entry->header->crc) {
+			lha_decoder_free_checkpoints(entry->checkpoints,
+			                             entry->num_checkpoints);
+			entry->checkpoints = checkpoints;
+			entry->num_checkpoints = num_checkpoints;
+			success = 1;
+		} else {
+			lha_decoder_free_checkpoints(checkpoints,
+			                             num_checkpoints);
+		}
+	}
+
+	if (decoder != NULL) {
+		lha_decoder_free(decoder);
+	}
+	if (reader != NULL) {
+		lha_basic_reader_free(reader);
+	}
+	lha_input_stream_free(range);
+
+	return success;
+}
+
+// Determine whether an entry is for an ordinary file, that could have
+// the same contents as another.
+
+static int is_ordinary_file(LHACatalogEntry *entry)
+{
+	return strcmp(entry->header->compress_method,
+	              LHA_COMPRESS_TYPE_DIR) != 0
+	    && entry->header->symlink_target == NULL
+	    && entry->header->length > 0;
+}
+
+// Hash function for the details of a file that must match for it to be
+// a copy of another file.
+
+static unsigned int hash_details(LHAFileHeader *header)
+{
+	unsigned int result;
+
+	result = hash_path(header->compress_method);
+	result = (result ^ header->crc) * 16777619U;
+	result = (result ^ (unsigned int) header->length) * 16777619U;
+	result = (result ^ (unsigned int) header->compressed_length)
+	       * 16777619U;
+
+	return result;
+}
+
+// Determine whether two files match in every respect apart from their
+// compressed data.
+
+static int same_details(LHAFileHeader *a, LHAFileHeader *b)
+{
+	return a->crc == b->crc
+	    && a->length == b->length
+	    && a->compressed_length == b->compressed_length
+	    && !strcmp(a->compress_method, b->compress_method);
+}
+
+// Calculate a hash of the compressed data for an entry (64-bit FNV-1a).
+
+static int hash_data(LHACatalogEntry *entry, LHAInputStream *stream,
+                     uint64_t *result)
+{
+	LHAInputStream *range;
+	uint8_t buf[4096];
+	size_t remaining, nbytes, i;
+	uint64_t hash;
+
+	range = lha_input_stream_new_range(stream, entry->data_offset,
+	                                   entry->header->compressed_length);
+
+	if (range == NULL) {
+		return 0;
+	}
+
+	hash = 14695981039346656037ULL;
+	remaining = entry->header->compressed_length;
+
+	while (remaining > 0) {
+		nbytes = remaining < sizeof(buf) ? remaining : sizeof(buf);
+
+		if (!lha_input_stream_read(range, buf, nbytes)) {
+			break;
+		}
+
+		for (i = 0; i < nbytes; ++i) {
+			hash = (hash ^ buf[i]) * 1099511628211ULL;
+		}
+
+		remaining -= nbytes;
+	}
+
+	lha_input_stream_free(range);
+
+	*result = hash;
+
+	return remaining == 0;
+}
+
+int lha_catalog_find_duplicates(LHACatalog *catalog, LHAInputStream *stream)
+{
+	LHACatalogEntry *entry, *other;
+	unsigned int *table;
+	unsigned int table_size, mask;
+	uint64_t *hashes;
+	uint8_t *hashed;
+	unsigned int i, j;
+
+	// Hash table of the first copy of each file, keyed on the file
+	// details. Each slot is an index into entries[] plus one, or zero
+	// if empty. Several files can have the same details but different
+	// compressed data, so there may be several entries with the same
+	// details in the table.
+
+	table_size = 1;
+
+	while (table_size < catalog->num_entries * 2) {
+		table_size <<= 1;
+	}
+
+	mask = table_size - 1;
+	table = calloc(table_size, sizeof(unsigned int));
+	hashes = calloc(catalog->num_entries + 1, sizeof(uint64_t));
+	hashed = calloc(catalog->num_entries + 1, 1);
+
+	if (table == NULL || hashes == NULL || hashed == NULL) {
+		free(table);
+		free(hashes);
+		free(hashed);
+		return 0;
+	}
+
+	for (i = 0; i < catalog->num_entries; ++i) {
+		entry = lha_catalog_get(catalog, i);
+		entry->duplicate_of = i;
+
+		if (!is_ordinary_file(entry)) {
+			continue;
+		}
+
+		j = hash_details(entry->header) & mask;
+
+		while (table[j] != 0) {
+			other = &catalog->entries[table[j] - 1];
+
+			// The compressed data is only hashed once it is
+			// needed to tell files apart. If it can't be read,
+			// the file is treated as different to every other.
+
+			if (same_details(entry->header, other->header)) {
+				if (!hashed[i]) {
+					hashed[i] = hash_data(entry, stream,
+					                      &hashes[i]) ? 1 : 2;
+				}
+				if (!hashed[table[j] - 1]) {
+					hashed[table[j] - 1] =
+					    hash_data(other, stream,
+					              &hashes[table[j] - 1])
+					    ? 1 : 2;
+				}
+				if (hashed[i] == 1 && hashed[table[j] - 1] == 1
+				 && hashes[i] == hashes[table[j] - 1]) {
+					entry->duplicate_of = table[j] - 1;
+					break;
+				}
+			}
+
+			j = (j + 1) & mask;
+		}
+
+		if (table[j] == 0) {
+			table[j] = i + 1;
+		}
+	}
+
+	free(table);
+	free(hashes);
+	free(hashed);
+
+	return 1;
+}
+
+int lha_catalog_prefetch(LHACatalog *catalog, LHAInputStream *stream,
+                         const unsigned int *entries,
+                         unsigned int num_entries)
+{
+	LHACatalogEntry *entry;
+	size_t *offsets, *lengths;
+	unsigned int i;
+	int result;
+
+	offsets = malloc(sizeof(size_t) * (num_entries + 1));
+	lengths = malloc(sizeof(size_t) * (num_entries + 1));
+
+	if (offsets == NULL || lengths == NULL) {
+		free(offsets);
+		free(lengths);
+		return 0;
+	}
+
+	result = 1;
+
+	for (i = 0; i < num_entries; ++i) {
+		entry = lha_catalog_get(catalog, entries[i]);
+
+		if (entry == NULL || (i > 0 && entries[i] <= entries[i - 1])) {
+			result = 0;
+			break;
+		}
+
+		offsets[i] = entry->data_offset;
+		lengths[i] = entry->header->compressed_length;
+	}
+
+	if (result) {
+		result = lha_input_stream_plan(stream, offsets, lengths,
+		                               num_entries);
+	}
+
+	free(offsets);
+	free(lengths);
+
+	return result;
+}
+
+// Write the contents of a buffer to a file.
+
+static int write_data(FILE *fstream, uint8_t *buf, size_t buf_len)
+{
+	return fwrite(buf, 1, buf_len, fstream) == buf_len;
+}
+
+// Copy the raw header for a catalog entry from the archive to the index.
+// The header is read from the archive again because the copy in
+// raw_data is not identical: the parsing code clears the CRC field of
+// the common extended header.
+
+static int copy_header(LHACatalogEntry *entry, FILE *index, FILE *archive)
+{
+	uint8_t *buf;
+	size_t buf_len;
+	int success;
+
+	buf_len = entry->data_offset - entry->header_offset;
+	buf = malloc(buf_len);
+
+	if (buf == NULL) {
+		return 0;
+	}
+
+	success = lha_arch_pread(archive, buf, buf_len,
+	                         entry->header_offset) == (int) buf_len
+	       && write_data(index, buf, buf_len);
+
+	free(buf);
+
+	return success;
+}
+
+// Write the checkpoints for a catalog entry to the index.
+
+static int write_checkpoints(LHACatalogEntry *entry, FILE *index)
+{
+	uint8_t buf[CHECKPOINT_LEN];
+	LHADecoderCheckpoint *checkpoint;
+	unsigned int i;
+
+	lha_encode_uint32(buf, entry->num_checkpoints);
+
+	if (!write_data(index, buf, 4)) {
+		return 0;
+	}
+
+	for (i = 0; i < entry->num_checkpoints; ++i) {
+		checkpoint = &entry->checkpoints[i];
+
+		lha_encode_uint64(buf, checkpoint->output_offset);
+		lha_encode_uint64(buf + 8, checkpoint->input_bits);
+		lha_encode_uint32(buf + 16, (uint32_t) checkpoint->state_len);
+
+		if (!write_data(index, buf, CHECKPOINT_LEN)
+		 || !write_data(index, checkpoint->state,
+		                checkpoint->state_len)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int lha_catalog_save(LHACatalog *catalog, FILE *index, FILE *archive)
+{
+	uint8_t buf[INDEX_PREAMBLE_LEN];
+	LHAFileHeader *header;
+	uint64_t size, mtime;
+	uint16_t crc;
+	unsigned int i;
+
+	if (!lha_arch_file_stamp(archive, &size, &mtime)) {
+		return 0;
+	}
+
+	memcpy(buf, INDEX_MAGIC, 8);
+	lha_encode_uint64(buf + 8, size);
+	lha_encode_uint64(buf + 16, mtime);
+	lha_encode_uint32(buf + 24, catalog->num_entries);
+
+	if (!write_data(index, buf, INDEX_PREAMBLE_LEN)) {
+		return 0;
+	}
+
+	for (i = 0; i < catalog->num_entries; ++i) {
+		header = catalog->entries[i].header;
+
+		crc = 0;
+		lha_crc16_buf(&crc, header->raw_data, header->raw_data_len);
+
+		lha_encode_uint64(buf, catalog->entries[i].header_offset);
+		lha_encode_uint32(buf + 8, (uint32_t) header->raw_data_len);
+		lha_encode_uint16(buf + 12, crc);
+
+		if (!write_data(index, buf, INDEX_ENTRY_LEN)) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < catalog->num_entries; ++i) {
+		if (!copy_header(&catalog->entries[i], index, archive)) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < catalog->num_entries; ++i) {
+		if (!write_checkpoints(&catalog->entries[i], index)) {
+			return 0;
+		}
+	}
+
+	return fflush(index) == 0;
+}
+
+// Read the checkpoints for a catalog entry from the index stream.
+
+static int read_checkpoints(LHACatalogEntry *entry, LHAInputStream *stream)
+{
+	uint8_t buf[CHECKPOINT_LEN];
+	LHADecoderCheckpoint *checkpoint;
+	unsigned int num_checkpoints;
+	uint64_t output_offset;
+
+	if (!lha_input_stream_read(stream, buf, 4)) {
+		return 0;
+	}
+
+	num_checkpoints = lha_decode_uint32(buf);
+
+	if (num_checkpoints == 0) {
+		return 1;
+	}
+
+	// There can be at most one checkpoint per byte of output.
+
+	if (num_checkpoints > entry->header->length) {
+		return 0;
+	}
+
+	entry->checkpoints = calloc(num_checkpoints,
+	                            sizeof(LHADecoderCheckpoint));
+
+	if (entry->checkpoints == NULL) {
+		return 0;
+	}
+
+	while (entry->num_checkpoints < num_checkpoints) {
+		checkpoint = &entry->checkpoints[entry->num_checkpoints];
+
+		if (!lha_input_stream_read(stream, buf, CHECKPOINT_LEN)) {
+			return 0;
+		}
+
+		output_offset = lha_decode_uint64(buf);
+		checkpoint->input_bits = lha_decode_uint64(buf + 8);
+		checkpoint->state_len = lha_decode_uint32(buf + 16);
+
+		if (output_offset > entry->header->length
+		 || checkpoint->input_bits / 8
+		      > entry->header->compressed_length
+		 || checkpoint->state_len > MAX_STATE_LEN) {
+			return 0;
+		}
+
+		checkpoint->output_offset = (size_t) output_offset;
+		checkpoint->state = malloc(checkpoint->state_len + 1);
+
+		// Count the checkpoint now so that the state is freed
+		// along with the catalog if reading it fails.
+
+		++entry->num_checkpoints;
+
+		if (checkpoint->state == NULL
+		 || !lha_input_stream_read(stream, checkpoint->state,
+		                           checkpoint->state_len)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Read the headers and checkpoints from an index file. 'table' points
+// to the table of entries that has already been read from the index.
+
+static int load_headers(LHACatalog *catalog, FILE *index, uint8_t *table,
+                        unsigned int num_entries, uint64_t archive_size)
+{
+	LHAInputStream *stream;
+	LHAArena *arena;
+	LHAFileHeader *header;
+	unsigned int entries_size;
+	uint64_t header_offset;
+	uint16_t crc;
+	unsigned int i;
+	int success;
+	uint8_t *p;
+
+	// The headers are read using the ordinary header parsing code,
+	// so that they are decoded exactly as if read from the archive.
+	// The raw headers are stored contiguously, so they can be read
+	// from a single mapped stream.
+
+	stream = lha_input_stream_from_FILE(index);
+
+	if (stream == NULL) {
+		return 0;
+	}
+
+	// Allocation failure here isn't fatal; the headers are just
+	// allocated individually instead.
+
+	arena = lha_arena_new();
+
+	success = 1;
+
+	for (i = 0; i < num_entries; ++i) {
+		p = table + i * INDEX_ENTRY_LEN;
+
+		header = lha_file_header_read(stream, arena, 1);
+
+		if (header == NULL) {
+			success = 0;
+			break;
+		}
+
+		// Check the header matches what was saved.
+
+		crc = 0;
+		lha_crc16_buf(&crc, header->raw_data, header->raw_data_len);
+
+		header_offset = lha_decode_uint64(p);
+		entries_size = num_entries;
+
+		if (header->raw_data_len != lha_decode_uint32(p + 8)
+		 || crc != lha_decode_uint16(p + 12)
+		 || header_offset + header->raw_data_len
+		  + header->compressed_length > archive_size
+		 || !add_entry(catalog, &entries_size, header,
+		               (size_t) header_offset,
+		               (size_t) header_offset + header->raw_data_len)) {
+			lha_file_header_free(header);
+			success = 0;
+			break;
+		}
+
+		// add_entry() added its own reference.
+
+		lha_file_header_free(header);
+	}
+
+	// The checkpoints are stored after the headers.
+
+	for (i = 0; success && i < num_entries; ++i) {
+		success = read_checkpoints(&catalog->entries[i], stream);
+	}
+
+	if (arena != NULL) {
+		lha_arena_free(arena);
+	}
+
+	lha_input_stream_free(stream);
+
+	return success;
+}
+
+LHACatalog *lha_catalog_load(FILE *index, FILE *archive)
+{
+	uint8_t preamble[INDEX_PREAMBLE_LEN];
+	uint8_t *table;
+	LHACatalog *catalog;
+	uint64_t size, mtime;
+	unsigned int num_entries;
+	size_t table_len;
+
+	// Check the index matches the archive.
+
+	if (fread(preamble, 1, INDEX_PREAMBLE_LEN, index) != INDEX_PREAMBLE_LEN
+	 || memcmp(preamble, INDEX_MAGIC, 8) != 0
+	 || !lha_arch_file_stamp(archive, &size, &mtime)
+	 || lha_decode_uint64(preamble + 8) != size
+	 || lha_decode_uint64(preamble + 16) != mtime) {
+		return NULL;
+	}
+
+	num_entries = lha_decode_uint32(preamble + 24);
+
+	// Every file header in the archive is longer than a table entry,
+	// so a huge number of entries indicates a corrupt index.
+
+	if (num_entries > size / INDEX_ENTRY_LEN) {
+		return NULL;
+	}
+
+	catalog = calloc(1, sizeof(LHACatalog));
+
+	if (catalog == NULL) {
+		return NULL;
+	}
+
+	table_len = (size_t) num_entries * INDEX_ENTRY_LEN;
+	table = malloc(table_len + 1);
+	catalog->entries = malloc((num_entries + 1)
+	                          * sizeof(LHACatalogEntry));
+
+	if (table == NULL || catalog->entries == NULL
+	 || fread(table, 1, table_len, index) != table_len
+	 || (num_entries > 0
+	  && !load_headers(catalog, index, table, num_entries, size))
+	 || !build_hash_table(catalog)) {
+		free(table);
+		lha_catalog_free(catalog);
+		return NULL;
+	}
+
+	free(table);
+
+	return catalog;
+}
+
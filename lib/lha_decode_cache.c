@@ -0,0 +1,435 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lha_arch.h"
+#include "lha_decode_cache.h"
+
+// Number of chains in the hash table of entries.
+
+#define CACHE_HASH_SIZE 1024
+
+struct _LHADecodeCache {
+	size_t max_size, size;
+	char *directory;
+	LHAArchMutex *lock;
+
+	// Hash table of entries, and list of entries in order of use,
+	// most recent first.
+
+	LHADecodeCacheEntry *table[CACHE_HASH_SIZE];
+	LHADecodeCacheEntry *lru_head, *lru_tail;
+};
+
+LHADecodeCache *lha_decode_cache_new(size_t max_size, const char *directory)
+{
+	LHADecodeCache *cache;
+
+	cache = calloc(1, sizeof(LHADecodeCache));
+
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	cache->max_size = max_size;
+	cache->lock = lha_arch_mutex_new();
+
+	if (directory != NULL) {
+		cache->directory = strdup(directory);
+	}
+
+	if (cache->lock == NULL
+	 || (directory != NULL && cache->directory == NULL)) {
+		lha_decode_cache_free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+static void free_entry(LHADecodeCacheEntry *entry)
+{
+	if (entry->mapped) {
+		lha_arch_unmap_file(entry->data, entry->length);
+	} else {
+		free(entry->data);
+	}
+
+	free(entry);
+}
+
+void lha_decode_cache_free(LHADecodeCache *cache)
+{
+	LHADecodeCacheEntry *entry, *next;
+
+	for (entry = cache->lru_head; entry != NULL; entry = next) {
+		next = entry->lru_next;
+		free_entry(entry);
+	}
+
+	if (cache->lock != NULL) {
+		lha_arch_mutex_free(cache->lock);
+	}
+
+	free(cache->directory);
+	free(cache);
+}
+
+static unsigned int hash_key(uint64_t archive_id, uint64_t offset,
+                             uint16_t crc)
+{
+	uint64_t hash;
+
+	hash = (archive_id ^ (offset * 0x9e3779b97f4a7c15ULL) ^ crc)
+	     * 0xff51afd7ed558ccdULL;
+
+	return (unsigned int) (hash >> 32) % CACHE_HASH_SIZE;
+}
+
+// Find an entry in the cache. Must be called with the lock held.
+
+static LHADecodeCacheEntry *find_entry(LHADecodeCache *cache,
+                                       uint64_t archive_id,
+                                       uint64_t offset, uint16_t crc,
+                                       size_t length)
+{
+	LHADecodeCacheEntry *entry;
+
+	entry = cache->table[hash_key(archive_id, offset, crc)];
+
+	while (entry != NULL) {
+		if (entry->archive_id == archive_id && entry->offset == offset
+		 && entry->crc == crc && entry->length == length) {
+			return entry;
+		}
+
+		entry = entry->hash_next;
+	}
+
+	return NULL;
+}
+
+static void unlink_lru(LHADecodeCache *cache, LHADecodeCacheEntry *entry)
+{
+	if (entry->lru_prev != NULL) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		cache->lru_head = entry->lru_next;
+	}
+
+	if (entry->lru_next != NULL) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		cache->lru_tail = entry->lru_prev;
+	}
+}
+
+static void link_lru(LHADecodeCache *cache, LHADecodeCacheEntry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+
+	if (cache->lru_head != NULL) {
+		cache->lru_head->lru_prev = entry;
+	} else {
+		cache->lru_tail = entry;
+	}
+
+	cache->lru_head = entry;
+}
+
+// Remove an entry from the cache. Must be called with the lock held.
+
+static void remove_entry(LHADecodeCache *cache, LHADecodeCacheEntry *entry)
+{
+	LHADecodeCacheEntry **chain;
+
+	chain = &cache->table[hash_key(entry->archive_id, entry->offset,
+	                               entry->crc)];
+
+	while (*chain != entry) {
+		chain = &(*chain)->hash_next;
+	}
+
+	*chain = entry->hash_next;
+	unlink_lru(cache, entry);
+	cache->size -= entry->length;
+
+	if (entry->refcount > 0) {
+		entry->removed = 1;
+	} else {
+		free_entry(entry);
+	}
+}
+
+// Add an entry to the cache, removing the least recently used entries
+// to make space. Must be called with the lock held.
+
+static void add_entry(LHADecodeCache *cache, LHADecodeCacheEntry *entry)
+{
+	unsigned int hash;
+
+	while (cache->lru_tail != NULL
+	    && cache->size + entry->length > cache->max_size) {
+		remove_entry(cache, cache->lru_tail);
+	}
+
+	hash = hash_key(entry->archive_id, entry->offset, entry->crc);
+	entry->hash_next = cache->table[hash];
+	cache->table[hash] = entry;
+	link_lru(cache, entry);
+	cache->size += entry->length;
+}
+
+static LHADecodeCacheEntry *new_entry(uint64_t archive_id, uint64_t offset,
+                                      uint16_t crc, uint8_t *data,
+                                      size_t length)
+{
+	LHADecodeCacheEntry *entry;
+
+	entry = calloc(1, sizeof(LHADecodeCacheEntry));
+
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	entry->archive_id = archive_id;
+	entry->offset = offset;
+	entry->crc = crc;
+	entry->length = length;
+	entry->data = data;
+
+	return entry;
+}
+
+// Get the path of the file in the cache directory for an entry.
+// Returns a newly allocated string that must be free()d.
+
+static char *entry_path(LHADecodeCache *cache, uint64_t archive_id,
+                        uint64_t offset, uint16_t crc)
+{
+	char *result;
+	size_t len;
+
+	len = strlen(cache->directory) + 48;
+	result = malloc(len);
+
+	if (result != NULL) {
+		snprintf(result, len, "%s/%016" PRIx64 "-%" PRIx64 "-%04x.bin",
+		         cache->directory, archive_id, offset, crc);
+	}
+
+	return result;
+}
+
+// Load a file from the cache directory, by mapping it into memory.
+
+static LHADecodeCacheEntry *load_entry(LHADecodeCache *cache,
+                                       uint64_t archive_id,
+                                       uint64_t offset, uint16_t crc,
+                                       size_t length)
+{
+	LHADecodeCacheEntry *entry;
+	FILE *fstream;
+	uint8_t *data;
+	size_t data_len;
+	char *path;
+
+	path = entry_path(cache, archive_id, offset, crc);
+
+	if (path == NULL) {
+		return NULL;
+	}
+
+	fstream = fopen(path, "rb");
+	free(path);
+
+	if (fstream == NULL) {
+		return NULL;
+	}
+
+	// The mapping stays valid after the file has been closed.
+
+	data = lha_arch_map_file(fstream, &data_len);
+	fclose(fstream);
+
+	if (data == NULL) {
+		return NULL;
+	} else if (data_len != length) {
+		lha_arch_unmap_file(data, data_len);
+		return NULL;
+	}
+
+	entry = new_entry(archive_id, offset, crc, data, length);
+
+	if (entry == NULL) {
+		lha_arch_unmap_file(data, data_len);
+		return NULL;
+	}
+
+	entry->mapped = 1;
+
+	return entry;
+}
+
+// Save a file to the cache directory. It is written to a temporary file
+// first and then renamed, so that a partly written file is never used.
+
+static void save_entry(LHADecodeCache *cache, LHADecodeCacheEntry *entry)
+{
+	FILE *fstream;
+	char *path, *tmp_path;
+	size_t len;
+	int success;
+
+	path = entry_path(cache, entry->archive_id, entry->offset,
+	                  entry->crc);
+	len = path != NULL ? strlen(path) + 32 : 0;
+	tmp_path = path != NULL ? malloc(len) : NULL;
+
+	if (tmp_path == NULL) {
+		free(path);
+		return;
+	}
+
+	snprintf(tmp_path, len, "%s.%p.tmp", path, (void *) entry);
+	fstream = fopen(tmp_path, "wb");
+
+	if (fstream != NULL) {
+		success = fwrite(entry->data, 1, entry->length, fstream)
+		          == entry->length;
+		success = fclose(fstream) == 0 && success;
+
+		if (!success || rename(tmp_path, path) != 0) {
+			remove(tmp_path);
+		}
+	}
+
+	free(tmp_path);
+	free(path);
+}
+
+LHADecodeCacheEntry *lha_decode_cache_lookup(LHADecodeCache *cache,
+                                             uint64_t archive_id,
+                                             uint64_t offset, uint16_t crc,
+                                             size_t length)
+{
+	LHADecodeCacheEntry *entry, *loaded;
+
+	lha_arch_mutex_lock(cache->lock);
+	entry = find_entry(cache, archive_id, offset, crc, length);
+
+	if (entry != NULL) {
+		unlink_lru(cache, entry);
+		link_lru(cache, entry);
+		++entry->refcount;
+	}
+
+	lha_arch_mutex_unlock(cache->lock);
+
+	if (entry != NULL || cache->directory == NULL
+	 || !lha_decode_cache_accepts(cache, length)) {
+		return entry;
+	}
+
+	// Not in memory; try the cache directory. The file is loaded
+	// without holding the lock, so another thread may have added the
+	// same file in the meantime.
+
+	loaded = load_entry(cache, archive_id, offset, crc, length);
+
+	if (loaded == NULL) {
+		return NULL;
+	}
+
+	lha_arch_mutex_lock(cache->lock);
+	entry = find_entry(cache, archive_id, offset, crc, length);
+
+	if (entry == NULL) {
+		entry = loaded;
+		add_entry(cache, entry);
+	} else {
+		free_entry(loaded);
+	}
+
+	++entry->refcount;
+	lha_arch_mutex_unlock(cache->lock);
+
+	return entry;
+}
+
+void lha_decode_cache_release(LHADecodeCache *cache,
+                              LHADecodeCacheEntry *entry)
+{
+	lha_arch_mutex_lock(cache->lock);
+
+	--entry->refcount;
+
+	if (entry->refcount == 0 && entry->removed) {
+		free_entry(entry);
+	}
+
+	lha_arch_mutex_unlock(cache->lock);
+}
+
+int lha_decode_cache_accepts(LHADecodeCache *cache, size_t length)
+{
+	// Empty files are not worth caching, and can't be mapped from
+	// the cache directory.
+
+	return length > 0 && length <= cache->max_size;
+}
+
+void lha_decode_cache_insert(LHADecodeCache *cache, uint64_t archive_id,
+                             uint64_t offset, uint16_t crc,
+                             uint8_t *data, size_t length)
+{
+	LHADecodeCacheEntry *entry;
+
+	if (!lha_decode_cache_accepts(cache, length)) {
+		free(data);
+		return;
+	}
+
+	entry = new_entry(archive_id, offset, crc, data, length);
+
+	if (entry == NULL) {
+		free(data);
+		return;
+	}
+
+	if (cache->directory != NULL) {
+		save_entry(cache, entry);
+	}
+
+	lha_arch_mutex_lock(cache->lock);
+
+	if (find_entry(cache, archive_id, offset, crc, length) == NULL) {
+		add_entry(cache, entry);
+	} else {
+		free_entry(entry);
+	}
+
+	lha_arch_mutex_unlock(cache->lock);
+}
+
@@ -0,0 +1,122 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LHASA_LHA_DECODE_CACHE_H
+#define LHASA_LHA_DECODE_CACHE_H
+
+#include <inttypes.h>
+
+#include "public/lha_decode_cache.h"
+
+/**
+ * A file held in a @ref LHADecodeCache.
+ */
+
+typedef struct _LHADecodeCacheEntry LHADecodeCacheEntry;
+
+struct _LHADecodeCacheEntry {
+
+	// Identity of the file: the archive it is in, the offset of its
+	// header within the archive, and its CRC and length.
+
+	uint64_t archive_id;
+	uint64_t offset;
+	uint16_t crc;
+	size_t length;
+
+	// Decompressed data. If 'mapped' is set, the data is mapped from
+	// a file in the cache directory.
+
+	uint8_t *data;
+	int mapped;
+
+	// Number of readers using the entry. An entry that is removed
+	// from the cache while it is in use is freed when it is released.
+
+	unsigned int refcount;
+	int removed;
+
+	// Next entry in the same hash table chain, and the previous and
+	// next entries in order of use, most recent first.
+
+	LHADecodeCacheEntry *hash_next;
+	LHADecodeCacheEntry *lru_prev, *lru_next;
+};
+
+/**
+ * Look up a file in a cache. If the file is not in memory but is in the
+ * cache directory, it is loaded from there.
+ *
+ * @param cache          The cache.
+ * @param archive_id     Identity of the archive.
+ * @param offset         Offset of the file header within the archive.
+ * @param crc            CRC of the file.
+ * @param length         Length of the file.
+ * @return               Pointer to the entry, which must be released
+ *                       with @ref lha_decode_cache_release, or NULL if
+ *                       the file is not in the cache.
+ */
+
+LHADecodeCacheEntry *lha_decode_cache_lookup(LHADecodeCache *cache,
+                                             uint64_t archive_id,
+                                             uint64_t offset, uint16_t crc,
+                                             size_t length);
+
+/**
+ * Release an entry returned by @ref lha_decode_cache_lookup.
+ *
+ * @param cache          The cache.
+ * @param entry          The entry.
+ */
+
+void lha_decode_cache_release(LHADecodeCache *cache,
+                              LHADecodeCacheEntry *entry);
+
+/**
+ * Check whether a file of the specified length can be added to a cache.
+ *
+ * @param cache          The cache.
+ * @param length         Length of the file.
+ * @return               Non-zero if the file is small enough.
+ */
+
+int lha_decode_cache_accepts(LHADecodeCache *cache, size_t length);
+
+/**
+ * Add a decompressed file to a cache, and to the cache directory if
+ * there is one. The files that were used least recently are removed to
+ * make space.
+ *
+ * @param cache          The cache.
+ * @param archive_id     Identity of the archive.
+ * @param offset         Offset of the file header within the archive.
+ * @param crc            CRC of the file.
+ * @param data           The decompressed data, allocated with malloc().
+ *                       The cache takes ownership of it, and frees it if
+ *                       it can not be added.
+ * @param length         Length of the data, in bytes.
+ */
+
+void lha_decode_cache_insert(LHADecodeCache *cache, uint64_t archive_id,
+                             uint64_t offset, uint16_t crc,
+                             uint8_t *data, size_t length);
+
+#endif /* #ifndef LHASA_LHA_DECODE_CACHE_H */
+
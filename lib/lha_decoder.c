@@ -21,9 +21,37 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "crc16.h"
+#include "lha_arch.h"
 #include "lha_decoder.h"
+#include "lha_endian.h"
+#include "lha_two_stage.h"
+
+#ifdef LHA_DECODER_BMI2_VARIANTS
+#include <cpuid.h>
+#endif
+
+#ifdef LHA_DECODER_STATS
+
+// Cycle counter used to time the stages of decoding.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define read_cycles() __rdtsc()
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define read_cycles() __rdtsc()
+#else
+#define read_cycles() 0
+#endif
+
+#define STATS_STAGE(decoder, stage) lha_decoder_stats_stage(decoder, stage)
+
+#else
+#define STATS_STAGE(decoder, stage) ((void) 0)
+#endif
 
 // Null decoder, used for -lz4-, -lh0-, -pm0-:
 extern LHADecoderType lha_null_decoder;
@@ -44,6 +72,44 @@ extern LHADecoderType lha_lhx_decoder;
 extern LHADecoderType lha_pm1_decoder;
 extern LHADecoderType lha_pm2_decoder;
 
+#ifdef LHA_DECODER_BMI2_VARIANTS
+
+// LHarc decoders specialized for processors with BMI2:
+extern LHADecoderType lha_lh4_decoder_bmi2;
+extern LHADecoderType lha_lh5_decoder_bmi2;
+extern LHADecoderType lha_lh6_decoder_bmi2;
+extern LHADecoderType lha_lh7_decoder_bmi2;
+extern LHADecoderType lha_lhx_decoder_bmi2;
+
+static struct {
+	LHADecoderType *dtype;
+	LHADecoderType *bmi2_dtype;
+} bmi2_variants[] = {
+	{ &lha_lh4_decoder, &lha_lh4_decoder_bmi2 },
+	{ &lha_lh5_decoder, &lha_lh5_decoder_bmi2 },
+	{ &lha_lh6_decoder, &lha_lh6_decoder_bmi2 },
+	{ &lha_lh7_decoder, &lha_lh7_decoder_bmi2 },
+	{ &lha_lhx_decoder, &lha_lhx_decoder_bmi2 },
+};
+
+#endif
+
+// Maximum number of bytes of stored data to read in place at once.
+
+#define DIRECT_READ_SIZE (1024 * 1024)
+
+// The ratio and time budgets (see lha_decoder_set_limits) are checked
+// after each run of the decoder that takes the output past another
+// multiple of this many bytes.
+
+#define LIMIT_CHECK_INTERVAL (16 * 1024)
+
+// Decoders at least this large are put on huge pages by the allocator
+// returned by lha_decoder_huge_page_allocator. Only the -lhx- decoder,
+// with its 1 MiB history, is this large.
+
+#define HUGE_PAGE_THRESHOLD (1024 * 1024)
+
 static struct {
 	char *name;
 	LHADecoderType *dtype;
@@ -63,194 +129,1432 @@ static struct {
 	{ "-pm2-", &lha_pm2_decoder },
 };
 
-LHADecoder *lha_decoder_new(LHADecoderType *dtype,
-                            LHADecoderCallback callback,
-                            void *callback_data,
-                            size_t stream_length)
-{
-	LHADecoder *decoder;
-	void *extra_data;
-
-	// Space is allocated together: the LHADecoder structure,
-	// then the private data area used by the algorithm,
-	// followed by the output buffer,
-
-	decoder = calloc(1, sizeof(LHADecoder) + dtype->extra_size
-	                        + dtype->max_read);
-
-	if (decoder == NULL) {
-		return NULL;
-	}
+// Initialize the state of a decoder to the start of a new stream.
 
-	decoder->dtype = dtype;
+static void init_decoder_state(LHADecoder *decoder, size_t stream_length)
+{
 	decoder->progress_callback = NULL;
+	decoder->byte_progress_callback = NULL;
 	decoder->last_block = UINT_MAX;
+	decoder->progress_pos = 0;
 	decoder->outbuf_pos = 0;
 	decoder->outbuf_len = 0;
 	decoder->stream_pos = 0;
 	decoder->stream_length = stream_length;
 	decoder->decoder_failed = 0;
 	decoder->crc = 0;
+	decoder->decoded_pos = 0;
+	decoder->input_pos = 0;
+	decoder->input_length = 0;
+	decoder->direct_callback = NULL;
+	decoder->direct_callback_data = NULL;
+	memset(&decoder->limits, 0, sizeof(LHADecoderLimits));
+	decoder->limit_exceeded = LHA_DECODER_LIMIT_NONE;
+	decoder->limit_check_pos = SIZE_MAX;
 
-	// Private data area follows the structure.
+#ifdef LHA_DECODER_STATS
+	memset(&decoder->stats, 0, sizeof(LHADecoderStats));
+	decoder->stats_stage = LHA_DECODER_NUM_STAGES;
+	decoder->stats_depth = 0;
+#endif
+}
 
-	extra_data = decoder + 1;
-	decoder->outbuf = ((uint8_t *) extra_data) + dtype->extra_size;
+#ifdef LHA_DECODER_STATS
 
-	if (dtype->init != NULL
-	 && !dtype->init(extra_data, callback, callback_data)) {
-		free(decoder);
-		return NULL;
+unsigned int lha_decoder_stats_stage(LHADecoder *decoder, unsigned int stage)
+{
+	unsigned int result;
+	uint64_t now;
+
+	now = read_cycles();
+	result = decoder->stats_stage;
+
+	if (result < LHA_DECODER_NUM_STAGES) {
+		decoder->stats.cycles[result] += now - decoder->stats_clock;
 	}
 
-	return decoder;
+	decoder->stats_stage = stage;
+	decoder->stats_clock = now;
+
+	return result;
 }
 
-LHADecoderType *lha_decoder_for_name(char *name)
+void lha_decoder_stats_begin(LHADecoder *decoder, unsigned int stage)
 {
-	unsigned int i;
+	unsigned int prev;
 
-	for (i = 0; i < sizeof(decoders) / sizeof(*decoders); ++i) {
-		if (!strcmp(name, decoders[i].name)) {
-			return decoders[i].dtype;
+	prev = lha_decoder_stats_stage(decoder, stage);
+
+	if (decoder->stats_depth < LHA_DECODER_NUM_STAGES) {
+		decoder->stats_stack[decoder->stats_depth] = prev;
+	}
+
+	++decoder->stats_depth;
+}
+
+void lha_decoder_stats_end(LHADecoder *decoder)
+{
+	if (decoder->stats_depth > 0) {
+		--decoder->stats_depth;
+
+		if (decoder->stats_depth < LHA_DECODER_NUM_STAGES) {
+			lha_decoder_stats_stage(decoder,
+			    decoder->stats_stack[decoder->stats_depth]);
 		}
 	}
+}
 
-	// Unknown?
+void lha_decoder_stats_copy(LHADecoder *decoder, size_t len)
+{
+	++decoder->stats.copies;
 
-	return NULL;
+	if (len > LHA_DECODER_STATS_MAX_COPY) {
+		len = LHA_DECODER_STATS_MAX_COPY;
+	}
+
+	++decoder->stats.copy_lengths[len];
 }
 
-void lha_decoder_free(LHADecoder *decoder)
+#endif
+
+// Callback passed to the algorithm in place of the real input callback,
+// to count the compressed data read.
+
+static size_t read_input(void *buf, size_t buf_len, void *user_data)
 {
-	if (decoder->dtype->free != NULL) {
-		decoder->dtype->free(decoder + 1);
+	LHADecoder *decoder = user_data;
+	size_t result;
+#ifdef LHA_DECODER_STATS
+	unsigned int stage;
+
+	stage = lha_decoder_stats_stage(decoder, LHA_DECODER_STAGE_INPUT);
+#endif
+
+	result = decoder->input_callback(buf, buf_len,
+	                                 decoder->input_callback_data);
+	decoder->input_pos += result;
+
+#ifdef LHA_DECODER_STATS
+	lha_decoder_stats_stage(decoder, stage);
+#endif
+
+	return result;
+}
+
+// Get the input callback to pass to the algorithm.
+
+static LHADecoderCallback input_callback(LHADecoder *decoder,
+                                         LHADecoderCallback callback,
+                                         void **callback_data)
+{
+	decoder->input_callback = callback;
+	decoder->input_callback_data = *callback_data;
+	*callback_data = decoder;
+
+	return read_input;
+}
+
+static void *alloc_aligned(size_t size, size_t alignment, void *user_data)
+{
+	return lha_arch_alloc_aligned(size, alignment);
+}
+
+static void free_aligned(void *ptr, size_t size, void *user_data)
+{
+	lha_arch_free_aligned(ptr);
+}
+
+static void *alloc_huge(size_t size, size_t alignment, void *user_data)
+{
+	if (size < HUGE_PAGE_THRESHOLD) {
+		return lha_arch_alloc_aligned(size, alignment);
 	}
 
-	free(decoder);
+	return lha_arch_alloc_huge(size);
 }
 
-// Check if the stream has progressed far enough that the progress callback
-// should be invoked again.
+static void free_huge(void *ptr, size_t size, void *user_data)
+{
+	if (size < HUGE_PAGE_THRESHOLD) {
+		lha_arch_free_aligned(ptr);
+	} else {
+		lha_arch_free_huge(ptr, size);
+	}
+}
 
-static void check_progress_callback(LHADecoder *decoder)
+static const LHADecoderAllocator default_allocator = {
+	alloc_aligned, free_aligned, NULL
+};
+
+static const LHADecoderAllocator huge_page_allocator = {
+	alloc_huge, free_huge, NULL
+};
+
+// Allocator used for new decoders (see lha_decoder_set_allocator).
+
+static LHADecoderAllocator allocator = {
+	alloc_aligned, free_aligned, NULL
+};
+
+void lha_decoder_set_allocator(const LHADecoderAllocator *new_allocator)
 {
-	unsigned int block;
+	if (new_allocator != NULL) {
+		allocator = *new_allocator;
+	} else {
+		allocator = default_allocator;
+	}
+}
 
-	block = (decoder->stream_pos + decoder->dtype->block_size - 1)
-	      / decoder->dtype->block_size;
+const LHADecoderAllocator *lha_decoder_huge_page_allocator(void)
+{
+	return &huge_page_allocator;
+}
 
-	// If the stream has advanced by another block, invoke the callback
-	// function. Invoke it multiple times if it has advanced by
-	// more than one block.
+// Offset of the output buffer from the start of a decoder's private
+// data area.
 
-	while (decoder->last_block != block) {
-		++decoder->last_block;
-		decoder->progress_callback(decoder->last_block,
-		                           decoder->total_blocks,
-		                           decoder->progress_callback_data);
+static size_t outbuf_offset(LHADecoderType *dtype)
+{
+	return (dtype->extra_size + LHA_DECODER_ALIGNMENT - 1)
+	     & ~((size_t) LHA_DECODER_ALIGNMENT - 1);
+}
+
+// Allocate a new decoder structure. The decoder's private data area
+// is cleared, but not otherwise initialized.
+
+static LHADecoder *alloc_decoder(LHADecoderType *dtype, size_t stream_length)
+{
+	LHADecoder *decoder;
+	size_t outbuf_size, size;
+
+	// Space is allocated together: the LHADecoder structure,
+	// then the private data area used by the algorithm,
+	// followed by the output buffer. Decoders that can return
+	// data directly from their own buffers don't need an output
+	// buffer. Each part is aligned to LHA_DECODER_ALIGNMENT;
+	// the structure's size is already a multiple of it.
+
+	if (dtype->read_direct != NULL) {
+		outbuf_size = 0;
+	} else {
+		outbuf_size = dtype->max_read;
+	}
+
+	size = sizeof(LHADecoder) + outbuf_offset(dtype) + outbuf_size;
+	decoder = allocator.alloc(size, LHA_DECODER_ALIGNMENT,
+	                          allocator.user_data);
+
+	if (decoder == NULL) {
+		return NULL;
 	}
+
+	// The output buffer is left as it is, as it may be large and
+	// is always written before being read.
+
+	memset(decoder, 0, sizeof(LHADecoder) + dtype->extra_size);
+
+	decoder->allocator = allocator;
+	decoder->alloc_size = size;
+	decoder->dtype = dtype;
+	init_decoder_state(decoder, stream_length);
+
+	// Private data area follows the structure.
+
+	decoder->outbuf = ((uint8_t *) (decoder + 1)) + outbuf_offset(dtype);
+
+	return decoder;
 }
 
-void lha_decoder_monitor(LHADecoder *decoder,
-                         LHADecoderProgressCallback callback,
-                         void *callback_data)
+// Free the memory for a decoder structure.
+
+static void free_decoder(LHADecoder *decoder)
 {
-	decoder->progress_callback = callback;
-	decoder->progress_callback_data = callback_data;
+	decoder->allocator.free(decoder, decoder->alloc_size,
+	                        decoder->allocator.user_data);
+}
 
-	decoder->total_blocks
-	  = (decoder->stream_length + decoder->dtype->block_size - 1)
-	  / decoder->dtype->block_size;
+LHADecoder *lha_decoder_new(LHADecoderType *dtype,
+                            LHADecoderCallback callback,
+                            void *callback_data,
+                            size_t stream_length)
+{
+	LHADecoder *decoder;
+	void *extra_data;
+
+	decoder = alloc_decoder(dtype, stream_length);
+
+	if (decoder == NULL) {
+		return NULL;
+	}
+
+	extra_data = decoder + 1;
+	callback = input_callback(decoder, callback, &callback_data);
+
+	if (dtype->init != NULL
+	 && !dtype->init(extra_data, callback, callback_data)) {
+		free_decoder(decoder);
+		return NULL;
+	}
 
-	check_progress_callback(decoder);
+	return decoder;
 }
 
-size_t lha_decoder_read(LHADecoder *decoder, uint8_t *buf, size_t buf_len)
+LHADecoder *lha_decoder_new_at(LHADecoderType *dtype,
+                               LHADecoderCallback callback,
+                               void *callback_data,
+                               size_t stream_length,
+                               LHADecoderCheckpoint *checkpoint)
 {
-	size_t filled, bytes;
+	LHADecoder *decoder;
 
-	// When we reach the end of the stream, we must truncate the
-	// decompressed data at exactly the right point (stream_length),
-	// or we may read a few extra false byte(s) by mistake.
-	// Reduce buf_len when we get to the end to limit it to the
-	// real number of remaining characters.
+	if (dtype->restore == NULL
+	 || checkpoint->state_len != dtype->checkpoint_size
+	 || checkpoint->output_offset > stream_length) {
+		return NULL;
+	}
 
-	if (decoder->stream_pos + buf_len > decoder->stream_length) {
-		buf_len = decoder->stream_length - decoder->stream_pos;
+	decoder = alloc_decoder(dtype, stream_length);
+
+	if (decoder == NULL) {
+		return NULL;
 	}
 
-	// Try to fill up the buffer that has been passed with as much
-	// data as possible. Each call to read() will fill up outbuf
-	// with some data; this is then copied into buf, with some
-	// data left at the end for the next call.
+	callback = input_callback(decoder, callback, &callback_data);
 
-	filled = 0;
+	if (!dtype->restore(decoder + 1, callback, callback_data,
+	                    checkpoint->state,
+	                    (unsigned int) (checkpoint->input_bits & 7))) {
+		free_decoder(decoder);
+		return NULL;
+	}
 
-	while (filled < buf_len) {
+	decoder->stream_pos = checkpoint->output_offset;
+	decoder->decoded_pos = checkpoint->output_offset;
 
-		// Try to empty out some of the output buffer first.
+	return decoder;
+}
 
-		bytes = decoder->outbuf_len - decoder->outbuf_pos;
+#ifdef LHA_DECODER_BMI2_VARIANTS
 
-		if (buf_len - filled < bytes) {
-			bytes = buf_len - filled;
-		}
+// Check whether the processor supports the BMI1 and BMI2 instructions.
+// Decoders may be created from several threads at once. The result is
+// worked out in a local variable and published with a single atomic
+// store, so another thread never sees a value before the check has
+// finished.
 
-		memcpy(buf + filled, decoder->outbuf + decoder->outbuf_pos,
-		       bytes);
-		decoder->outbuf_pos += bytes;
-		filled += bytes;
+static int have_bmi2(void)
+{
+	static int cached = -1;
+	unsigned int eax, ebx, ecx, edx;
+	int result;
 
-		// If we previously encountered a failure reading from
-		// the decoder, don't try to call the read function again.
+	result = __atomic_load_n(&cached, __ATOMIC_RELAXED);
 
-		if (decoder->decoder_failed) {
-			break;
+	if (result < 0) {
+		result = 0;
+
+		if (__get_cpuid_max(0, NULL) >= 7) {
+			__cpuid_count(7, 0, eax, ebx, ecx, edx);
+			result = (ebx & bit_BMI) != 0 && (ebx & bit_BMI2) != 0;
 		}
 
-		// If outbuf is now empty, we can process another run to
-		// re-fill it.
+		__atomic_store_n(&cached, result, __ATOMIC_RELAXED);
+	}
 
-		if (decoder->outbuf_pos >= decoder->outbuf_len) {
-			decoder->outbuf_len
-			    = decoder->dtype->read(decoder + 1,
-			                           decoder->outbuf);
-			decoder->outbuf_pos = 0;
+	return result;
+}
+
+#endif
+
+// Get the fastest version of a decoder type for the running processor.
+
+static LHADecoderType *best_variant(LHADecoderType *dtype)
+{
+#ifdef LHA_DECODER_BMI2_VARIANTS
+	unsigned int i;
+
+	if (have_bmi2()) {
+		for (i = 0; i < sizeof(bmi2_variants) / sizeof(*bmi2_variants);
+		     ++i) {
+			if (bmi2_variants[i].dtype == dtype) {
+				return bmi2_variants[i].bmi2_dtype;
+			}
 		}
+	}
+#endif
 
-		// No more data to be read?
+	return dtype;
+}
 
-		if (decoder->outbuf_len == 0) {
-			decoder->decoder_failed = 1;
-			break;
+LHADecoderType *lha_decoder_generic_type(LHADecoderType *dtype)
+{
+#ifdef LHA_DECODER_BMI2_VARIANTS
+	unsigned int i;
+
+	for (i = 0; i < sizeof(bmi2_variants) / sizeof(*bmi2_variants); ++i) {
+		if (bmi2_variants[i].bmi2_dtype == dtype) {
+			return bmi2_variants[i].dtype;
 		}
 	}
+#endif
+
+	return dtype;
+}
 
-	// Update CRC.
+LHADecoderType *lha_decoder_for_name(char *name)
+{
+	unsigned int i;
 
-	lha_crc16_buf(&decoder->crc, buf, filled);
+	for (i = 0; i < sizeof(decoders) / sizeof(*decoders); ++i) {
+		if (!strcmp(name, decoders[i].name)) {
+			return best_variant(decoders[i].dtype);
+		}
+	}
 
-	// Track stream position.
+	// Unknown?
 
-	decoder->stream_pos += filled;
+	return NULL;
+}
 
-	// Check progress callback, if one is set:
+void lha_decoder_free_checkpoints(LHADecoderCheckpoint *checkpoints,
+                                  unsigned int num)
+{
+	unsigned int i;
 
-	if (decoder->progress_callback != NULL) {
-		check_progress_callback(decoder);
+	for (i = 0; i < num; ++i) {
+		free(checkpoints[i].state);
 	}
 
-	return filled;
+	free(checkpoints);
 }
 
-uint16_t lha_decoder_get_crc(LHADecoder *decoder)
+// Free any checkpoints recorded by the decoder, and stop recording.
+
+static void free_recorded_checkpoints(LHADecoder *decoder)
 {
-	return decoder->crc;
+	lha_decoder_free_checkpoints(decoder->checkpoints,
+	                             decoder->num_checkpoints);
+	free(decoder->checkpoint_buf);
+
+	decoder->checkpoints = NULL;
+	decoder->num_checkpoints = 0;
+	decoder->checkpoints_size = 0;
+	decoder->checkpoint_buf = NULL;
+	decoder->checkpoint_interval = 0;
 }
 
-size_t lha_decoder_get_length(LHADecoder *decoder)
+int lha_decoder_record_checkpoints(LHADecoder *decoder, size_t interval)
 {
-	return decoder->stream_pos;
+	// A push decoder may decode the same data more than once if it
+	// runs out of input, which would save checkpoints twice.
+
+	if (decoder->dtype->checkpoint == NULL || interval == 0
+	 || decoder->push != NULL || decoder->two_stage != NULL) {
+		return 0;
+	}
+
+	decoder->checkpoint_interval = interval;
+	decoder->next_checkpoint = decoder->decoded_pos + interval;
+
+	return 1;
+}
+
+LHADecoderCheckpoint *lha_decoder_take_checkpoints(LHADecoder *decoder,
+                                                   unsigned int *num)
+{
+	LHADecoderCheckpoint *result;
+
+	result = decoder->checkpoints;
+	*num = decoder->num_checkpoints;
+
+	decoder->checkpoints = NULL;
+	decoder->num_checkpoints = 0;
+	decoder->checkpoints_size = 0;
+
+	return result;
+}
+
+// Try to save a checkpoint at the current position. If the decoder
+// isn't at a point where that is possible, it will stop at the next
+// one, and the checkpoint is saved on the next call.
+
+static void save_checkpoint(LHADecoder *decoder)
+{
+	LHADecoderCheckpoint *checkpoint;
+	LHADecoderCheckpoint *new_checkpoints;
+	unsigned int new_size;
+	uint64_t input_bits;
+
+	if (decoder->num_checkpoints >= decoder->checkpoints_size) {
+		new_size = decoder->checkpoints_size * 2 + 8;
+		new_checkpoints = realloc(decoder->checkpoints,
+		                          new_size * sizeof(*new_checkpoints));
+
+		if (new_checkpoints == NULL) {
+			return;
+		}
+
+		decoder->checkpoints = new_checkpoints;
+		decoder->checkpoints_size = new_size;
+	}
+
+	// The state of some decoder types is empty; allocate at least a
+	// byte so that this does not look like a failure.
+
+	if (decoder->checkpoint_buf == NULL) {
+		decoder->checkpoint_buf
+		    = malloc(decoder->dtype->checkpoint_size + 1);
+
+		if (decoder->checkpoint_buf == NULL) {
+			return;
+		}
+	}
+
+	if (!decoder->dtype->checkpoint(decoder + 1, decoder->checkpoint_buf,
+	                                &input_bits)) {
+		return;
+	}
+
+	checkpoint = &decoder->checkpoints[decoder->num_checkpoints];
+	checkpoint->output_offset = decoder->decoded_pos;
+	checkpoint->input_bits = input_bits;
+	checkpoint->state = decoder->checkpoint_buf;
+	checkpoint->state_len = decoder->dtype->checkpoint_size;
+	++decoder->num_checkpoints;
+
+	decoder->checkpoint_buf = NULL;
+	decoder->next_checkpoint = decoder->decoded_pos
+	                         + decoder->checkpoint_interval;
+}
+
+// Saved decoder state (see lha_decoder_save_state) has the following
+// format. All values are little-endian.
+//
+//   0   4  Magic number, "LHDS"
+//   4   8  Number of bytes of decompressed data returned so far
+//   12  8  Position in the compressed data, in bits
+//   20  2  CRC of the decompressed data returned so far
+//   22  4  Length of the decoder type's checkpoint
+//   26  4  Length of the data decoded but not yet returned
+//   30     Checkpoint saved by the decoder type
+//          Data decoded but not yet returned
+//          CRC-16 of everything before it
+
+#define STATE_MAGIC      "LHDS"
+#define STATE_HEADER_LEN 30
+
+uint8_t *lha_decoder_save_state(LHADecoder *decoder, size_t *state_len)
+{
+	LHADecoderType *dtype;
+	uint8_t *result, *p;
+	uint64_t input_bits;
+	size_t pending, len;
+	uint16_t crc;
+
+	dtype = decoder->dtype;
+
+	// The position in the compressed data isn't known for a push
+	// decoder, or for stored data read in place; a two-stage decoder
+	// has decoded further ahead than its output.
+
+	if (dtype->checkpoint == NULL || decoder->decoder_failed
+	 || decoder->push != NULL || decoder->two_stage != NULL
+	 || decoder->direct_callback != NULL) {
+		return NULL;
+	}
+
+	// Data that the decoder type has returned but that has not yet
+	// been read is saved along with its state.
+
+	pending = decoder->outbuf_len - decoder->outbuf_pos;
+	len = STATE_HEADER_LEN + dtype->checkpoint_size + pending + 2;
+	result = malloc(len);
+
+	if (result == NULL) {
+		return NULL;
+	}
+
+	p = result + STATE_HEADER_LEN;
+	memcpy(p + dtype->checkpoint_size,
+	       decoder->outbuf + decoder->outbuf_pos, pending);
+
+	if (!dtype->checkpoint(decoder + 1, p, &input_bits)) {
+		free(result);
+		return NULL;
+	}
+
+	memcpy(result, STATE_MAGIC, 4);
+	lha_encode_uint64(result + 4, decoder->stream_pos);
+	lha_encode_uint64(result + 12, input_bits);
+	lha_encode_uint16(result + 20, decoder->crc);
+	lha_encode_uint32(result + 22, (uint32_t) dtype->checkpoint_size);
+	lha_encode_uint32(result + 26, (uint32_t) pending);
+
+	crc = 0;
+	lha_crc16_buf(&crc, result, len - 2);
+	lha_encode_uint16(result + len - 2, crc);
+
+	*state_len = len;
+
+	return result;
+}
+
+// Check that saved decoder state is complete and undamaged.
+
+static int check_state(uint8_t *state, size_t state_len)
+{
+	uint64_t body_len;
+	uint16_t crc;
+
+	if (state_len < STATE_HEADER_LEN + 2
+	 || memcmp(state, STATE_MAGIC, 4) != 0) {
+		return 0;
+	}
+
+	body_len = (uint64_t) lha_decode_uint32(state + 22)
+	         + lha_decode_uint32(state + 26);
+
+	if (body_len != state_len - STATE_HEADER_LEN - 2) {
+		return 0;
+	}
+
+	crc = 0;
+	lha_crc16_buf(&crc, state, state_len - 2);
+
+	return crc == lha_decode_uint16(state + state_len - 2);
+}
+
+int lha_decoder_state_position(uint8_t *state, size_t state_len,
+                               uint64_t *output_offset,
+                               uint64_t *input_offset)
+{
+	if (!check_state(state, state_len)) {
+		return 0;
+	}
+
+	*output_offset = lha_decode_uint64(state + 4);
+	*input_offset = lha_decode_uint64(state + 12) / 8;
+
+	return 1;
+}
+
+LHADecoder *lha_decoder_restore_state(LHADecoderType *dtype,
+                                      LHADecoderCallback callback,
+                                      void *callback_data,
+                                      size_t stream_length,
+                                      uint8_t *state, size_t state_len)
+{
+	LHADecoderCheckpoint checkpoint;
+	LHADecoder *decoder;
+	uint64_t stream_pos;
+	size_t pending;
+
+	if (!check_state(state, state_len)) {
+		return NULL;
+	}
+
+	stream_pos = lha_decode_uint64(state + 4);
+	pending = lha_decode_uint32(state + 26);
+
+	if (stream_pos > stream_length || pending > dtype->max_read) {
+		return NULL;
+	}
+
+	// The decoder type resumes from after the pending data, which
+	// may run past the end of the stream.
+
+	checkpoint.output_offset = (size_t) stream_pos + pending;
+	checkpoint.input_bits = lha_decode_uint64(state + 12);
+	checkpoint.state = state + STATE_HEADER_LEN;
+	checkpoint.state_len = lha_decode_uint32(state + 22);
+
+	decoder = lha_decoder_new_at(dtype, callback, callback_data,
+	                             SIZE_MAX, &checkpoint);
+
+	if (decoder == NULL) {
+		return NULL;
+	}
+
+	decoder->stream_length = stream_length;
+	decoder->stream_pos = (size_t) stream_pos;
+	decoder->crc = lha_decode_uint16(state + 20);
+
+	if (pending > 0) {
+		decoder->resume_buf = malloc(pending);
+
+		if (decoder->resume_buf == NULL) {
+			lha_decoder_free(decoder);
+			return NULL;
+		}
+
+		memcpy(decoder->resume_buf,
+		       checkpoint.state + checkpoint.state_len, pending);
+		decoder->outbuf = decoder->resume_buf;
+		decoder->outbuf_len = (unsigned int) pending;
+	}
+
+	return decoder;
+}
+
+int lha_decoder_enable_two_stage(LHADecoder *decoder)
+{
+	// Any output already buffered may point into the history
+	// window, which the second stage is about to take over.
+
+	if (decoder->two_stage != NULL || decoder->push != NULL
+	 || decoder->checkpoint_interval > 0
+	 || decoder->outbuf_pos < decoder->outbuf_len
+	 || decoder->decoder_failed) {
+		return 0;
+	}
+
+	decoder->two_stage = lha_two_stage_new(decoder->dtype, decoder + 1);
+
+	return decoder->two_stage != NULL;
+}
+
+static void stop_two_stage(LHADecoder *decoder)
+{
+	if (decoder->two_stage != NULL) {
+		lha_two_stage_free(decoder->two_stage);
+		decoder->two_stage = NULL;
+	}
+}
+
+int lha_decoder_reset(LHADecoder *decoder,
+                      LHADecoderCallback callback,
+                      void *callback_data,
+                      size_t stream_length)
+{
+	LHADecoderType *dtype;
+	void *extra_data;
+
+	dtype = decoder->dtype;
+	extra_data = decoder + 1;
+
+	// Decoders with a free function hold resources of their own,
+	// so it isn't safe to simply initialize them again. Push
+	// decoders always read from the data fed to them.
+
+	if (dtype->free != NULL || decoder->push != NULL) {
+		return 0;
+	}
+
+	stop_two_stage(decoder);
+	init_decoder_state(decoder, stream_length);
+	free_recorded_checkpoints(decoder);
+	free(decoder->resume_buf);
+	decoder->resume_buf = NULL;
+	callback = input_callback(decoder, callback, &callback_data);
+
+	if (dtype->reset != NULL) {
+		return dtype->reset(extra_data, callback, callback_data);
+	}
+
+	// No special reset function, so return the data area to the
+	// same state as when it was first allocated, and start again.
+
+	memset(extra_data, 0, dtype->extra_size);
+
+	return dtype->init == NULL
+	    || dtype->init(extra_data, callback, callback_data);
+}
+
+void lha_decoder_free(LHADecoder *decoder)
+{
+	stop_two_stage(decoder);
+
+	if (decoder->dtype->free != NULL) {
+		decoder->dtype->free(decoder + 1);
+	}
+
+	free_recorded_checkpoints(decoder);
+	free(decoder->resume_buf);
+
+	if (decoder->push != NULL) {
+		free(decoder->push->data);
+		free(decoder->push);
+	}
+
+	free_decoder(decoder);
+}
+
+// Check if the stream has progressed far enough that the progress callbacks
+// should be invoked again.
+
+static void check_progress_callback(LHADecoder *decoder)
+{
+	LHADecoderProgress progress;
+	unsigned int block;
+
+	block = (decoder->stream_pos + decoder->dtype->block_size - 1)
+	      / decoder->dtype->block_size;
+
+	// The byte position is reported first, so that it is up to date
+	// if it is looked at from the block callback.
+
+	if (decoder->byte_progress_callback != NULL
+	 && decoder->last_block != block) {
+		progress.input_pos = decoder->input_pos;
+		progress.input_length = decoder->input_length;
+		progress.output_pos = decoder->stream_pos;
+		progress.output_length = decoder->stream_length;
+
+		decoder->byte_progress_callback(&progress,
+		    decoder->byte_progress_callback_data);
+	}
+
+	// If the stream has advanced by another block, invoke the callback
+	// function. Invoke it multiple times if it has advanced by
+	// more than one block.
+
+	while (decoder->last_block != block) {
+		++decoder->last_block;
+
+		if (decoder->progress_callback != NULL) {
+			decoder->progress_callback(decoder->last_block,
+			    decoder->total_blocks,
+			    decoder->progress_callback_data);
+		}
+	}
+
+	// The next block is reached once the stream goes past this point.
+
+	decoder->progress_pos = (size_t) decoder->last_block
+	                      * decoder->dtype->block_size;
+}
+
+// Restart progress reporting after a callback has been set, announcing
+// the blocks decoded so far.
+
+static void restart_progress(LHADecoder *decoder)
+{
+	decoder->total_blocks
+	  = (decoder->stream_length + decoder->dtype->block_size - 1)
+	  / decoder->dtype->block_size;
+
+	if (decoder->progress_callback != NULL
+	 || decoder->byte_progress_callback != NULL) {
+		check_progress_callback(decoder);
+	}
+}
+
+void lha_decoder_monitor(LHADecoder *decoder,
+                         LHADecoderProgressCallback callback,
+                         void *callback_data)
+{
+	decoder->progress_callback = callback;
+	decoder->progress_callback_data = callback_data;
+
+	restart_progress(decoder);
+}
+
+void lha_decoder_monitor_bytes(LHADecoder *decoder,
+                               LHADecoderByteProgressCallback callback,
+                               void *callback_data,
+                               size_t input_length)
+{
+	decoder->byte_progress_callback = callback;
+	decoder->byte_progress_callback_data = callback_data;
+	decoder->input_length = input_length;
+
+	restart_progress(decoder);
+}
+
+size_t lha_decoder_get_compressed_length(LHADecoder *decoder)
+{
+	return decoder->input_pos;
+}
+
+LHADecoderLimit lha_decoder_check_sizes(const LHADecoderLimits *limits,
+                                        uint64_t output, uint64_t input)
+{
+	if (limits->max_output > 0 && output > limits->max_output) {
+		return LHA_DECODER_LIMIT_OUTPUT;
+	}
+
+	if (limits->max_ratio > 0 && output > LHA_DECODER_RATIO_SLACK
+	 && output - LHA_DECODER_RATIO_SLACK
+	      > input * (uint64_t) limits->max_ratio) {
+		return LHA_DECODER_LIMIT_RATIO;
+	}
+
+	return LHA_DECODER_LIMIT_NONE;
+}
+
+void lha_decoder_set_limits(LHADecoder *decoder,
+                            const LHADecoderLimits *limits)
+{
+	if (limits != NULL) {
+		decoder->limits = *limits;
+	} else {
+		memset(&decoder->limits, 0, sizeof(LHADecoderLimits));
+	}
+
+	decoder->limit_exceeded = LHA_DECODER_LIMIT_NONE;
+	decoder->limit_start_ms = lha_arch_clock_ms();
+
+	// Check at the end of the next run.
+
+	if (decoder->limits.max_output > 0 || decoder->limits.max_ratio > 0
+	 || decoder->limits.max_time_ms > 0) {
+		decoder->limit_check_pos = 0;
+	} else {
+		decoder->limit_check_pos = SIZE_MAX;
+	}
+}
+
+LHADecoderLimit lha_decoder_limit_exceeded(LHADecoder *decoder)
+{
+	return decoder->limit_exceeded;
+}
+
+// Check the budgets set with lha_decoder_set_limits, once decoded_pos
+// has reached limit_check_pos. Returns zero if a budget has been
+// exceeded, in which case decoding must stop.
+
+static int check_limits(LHADecoder *decoder)
+{
+	LHADecoderLimits *limits = &decoder->limits;
+	size_t output;
+
+	// The last run may decode past the end of the stream; that data
+	// is never returned, so it doesn't count.
+
+	output = decoder->decoded_pos;
+
+	if (output > decoder->stream_length) {
+		output = decoder->stream_length;
+	}
+
+	decoder->limit_exceeded = lha_decoder_check_sizes(
+	    limits, output, decoder->input_pos);
+
+	if (decoder->limit_exceeded == LHA_DECODER_LIMIT_NONE
+	 && limits->max_time_ms > 0
+	 && lha_arch_clock_ms() - decoder->limit_start_ms
+	      >= limits->max_time_ms) {
+		decoder->limit_exceeded = LHA_DECODER_LIMIT_TIME;
+	}
+
+	if (decoder->limit_exceeded != LHA_DECODER_LIMIT_NONE) {
+		return 0;
+	}
+
+	// The output budget is checked exactly; the others only every
+	// so often.
+
+	decoder->limit_check_pos = decoder->decoded_pos
+	                         - decoder->decoded_pos % LIMIT_CHECK_INTERVAL
+	                         + LIMIT_CHECK_INTERVAL;
+
+	if (limits->max_output > 0
+	 && limits->max_output < decoder->limit_check_pos) {
+		decoder->limit_check_pos = (size_t) limits->max_output + 1;
+	}
+
+	return 1;
+}
+
+// Invoke the decoder to fill the output buffer once it is empty.
+// Returns the number of bytes in the output buffer, or zero if the
+// decoder failed.
+
+static size_t fill_outbuf(LHADecoder *decoder)
+{
+	if (decoder->checkpoint_interval > 0
+	 && decoder->decoded_pos >= decoder->next_checkpoint) {
+		save_checkpoint(decoder);
+	}
+
+	decoder->outbuf_len = 0;
+
+	// Stored data can be passed on straight from the input, if it
+	// can be read in place.
+
+	if (decoder->direct_callback != NULL) {
+		STATS_STAGE(decoder, LHA_DECODER_STAGE_INPUT);
+		decoder->outbuf_len
+		    = decoder->direct_callback(&decoder->outbuf,
+		                               DIRECT_READ_SIZE,
+		                               decoder->direct_callback_data);
+		decoder->input_pos += decoder->outbuf_len;
+	}
+
+	STATS_STAGE(decoder, LHA_DECODER_STAGE_DECODE);
+
+	if (decoder->outbuf_len == 0) {
+		if (decoder->two_stage != NULL) {
+			decoder->outbuf_len
+			    = lha_two_stage_read(decoder->two_stage,
+			                         &decoder->outbuf);
+		} else if (decoder->dtype->read_direct != NULL) {
+			decoder->outbuf_len
+			    = decoder->dtype->read_direct(decoder + 1,
+			                                  &decoder->outbuf);
+		} else {
+			decoder->outbuf = ((uint8_t *) (decoder + 1))
+			                + outbuf_offset(decoder->dtype);
+			decoder->outbuf_len
+			    = decoder->dtype->read(decoder + 1,
+			                           decoder->outbuf);
+		}
+	}
+
+	STATS_STAGE(decoder, LHA_DECODER_NUM_STAGES);
+
+	decoder->outbuf_pos = 0;
+	decoder->decoded_pos += decoder->outbuf_len;
+
+	// Output from a run that exceeds a budget is discarded.
+
+	if (decoder->decoded_pos >= decoder->limit_check_pos
+	 && !check_limits(decoder)) {
+		decoder->outbuf_len = 0;
+	}
+
+	if (decoder->outbuf_len == 0) {
+		decoder->decoder_failed = 1;
+	}
+
+	return decoder->outbuf_len;
+}
+
+// Refill the output buffer once it is empty. For a push decoder, if
+// the decoder runs out of input before all the data has been fed in,
+// its state is rolled back to before the attempt, so that it can be
+// tried again once more data has arrived. Returns the number of bytes
+// in the output buffer, or zero if the decoder failed or (for a push
+// decoder) needs more input.
+
+static size_t refill_outbuf(LHADecoder *decoder)
+{
+	LHADecoderPush *push = decoder->push;
+	size_t input_pos;
+#ifdef LHA_DECODER_STATS
+	LHADecoderStats stats;
+#endif
+
+	if (push == NULL || push->finished) {
+		return fill_outbuf(decoder);
+	}
+
+	// Don't try again until at least as much input is available as
+	// the last attempt needed.
+
+	if (push->len - push->pos < push->needed) {
+		return 0;
+	}
+
+	// All decoder state is held in the private data area, so a copy
+	// of it is enough to restore the decoder later.
+
+	memcpy(push->snapshot, decoder + 1, decoder->dtype->extra_size);
+	push->start = push->pos;
+	push->underrun = 0;
+	push->needed = 0;
+	input_pos = decoder->input_pos;
+
+#ifdef LHA_DECODER_STATS
+	stats = decoder->stats;
+#endif
+
+	fill_outbuf(decoder);
+
+	if (push->underrun) {
+		memcpy(decoder + 1, push->snapshot, decoder->dtype->extra_size);
+
+#ifdef LHA_DECODER_STATS
+		// The time was really spent, but the work is done again
+		// next time.
+
+		memcpy(stats.cycles, decoder->stats.cycles,
+		       sizeof(stats.cycles));
+		decoder->stats = stats;
+#endif
+
+		push->pos = push->start;
+		decoder->input_pos = input_pos;
+		decoder->decoded_pos -= decoder->outbuf_len;
+		decoder->outbuf_len = 0;
+		decoder->decoder_failed =
+		    decoder->limit_exceeded != LHA_DECODER_LIMIT_NONE;
+	}
+
+	return decoder->outbuf_len;
+}
+
+// Callback used by a push decoder to read compressed data that has been
+// fed in.
+
+static size_t push_callback(void *buf, size_t buf_len, void *user_data)
+{
+	LHADecoderPush *push = user_data;
+	size_t n;
+
+	n = push->len - push->pos;
+
+	if (n > buf_len) {
+		n = buf_len;
+	} else if (n < buf_len && !push->finished && !push->underrun) {
+
+		// Remember how much data is needed for the attempt to
+		// get this far.
+
+		push->underrun = 1;
+		push->needed = push->pos - push->start + buf_len;
+	}
+
+	if (n > 0) {
+		memcpy(buf, push->data + push->pos, n);
+		push->pos += n;
+	}
+
+	return n;
+}
+
+LHADecoder *lha_decoder_new_push(LHADecoderType *dtype, size_t stream_length)
+{
+	LHADecoderPush *push;
+	LHADecoder *decoder;
+
+	push = calloc(1, sizeof(LHADecoderPush) + dtype->extra_size);
+
+	if (push == NULL) {
+		return NULL;
+	}
+
+	push->snapshot = (uint8_t *) (push + 1);
+
+	decoder = lha_decoder_new(dtype, push_callback, push, stream_length);
+
+	if (decoder == NULL) {
+		free(push);
+		return NULL;
+	}
+
+	decoder->push = push;
+
+	return decoder;
+}
+
+int lha_decoder_feed(LHADecoder *decoder, const uint8_t *buf, size_t buf_len)
+{
+	LHADecoderPush *push = decoder->push;
+	uint8_t *new_data;
+	size_t new_size;
+
+	if (push == NULL || push->finished) {
+		return 0;
+	}
+
+	// Discard data that has already been read by the decoder.
+
+	if (push->pos > 0) {
+		memmove(push->data, push->data + push->pos,
+		        push->len - push->pos);
+		push->len -= push->pos;
+		push->pos = 0;
+	}
+
+	if (push->len + buf_len > push->size) {
+		new_size = push->size * 2;
+
+		if (new_size < push->len + buf_len) {
+			new_size = push->len + buf_len;
+		}
+
+		new_data = realloc(push->data, new_size);
+
+		if (new_data == NULL) {
+			return 0;
+		}
+
+		push->data = new_data;
+		push->size = new_size;
+	}
+
+	if (buf_len > 0) {
+		memcpy(push->data + push->len, buf, buf_len);
+		push->len += buf_len;
+	}
+
+	return 1;
+}
+
+void lha_decoder_feed_end(LHADecoder *decoder)
+{
+	if (decoder->push != NULL) {
+		decoder->push->finished = 1;
+	}
+}
+
+int lha_decoder_drain(LHADecoder *decoder, LHADecoderSink sink,
+                      void *sink_data)
+{
+	return lha_decoder_decode_to(decoder, sink, sink_data)
+	    && !decoder->decoder_failed;
+}
+
+void lha_decoder_set_direct_input(LHADecoder *decoder,
+                                  LHADecoderDirectCallback callback,
+                                  void *callback_data)
+{
+	if (decoder->dtype->stored) {
+		decoder->direct_callback = callback;
+		decoder->direct_callback_data = callback_data;
+	}
+}
+
+// Determine whether the decoder can decompress straight into the
+// caller's buffer, rather than into the output buffer. This is only
+// possible for decoders that decompress into a buffer (rather than
+// returning a pointer into their history), and not while checkpoints
+// are being recorded or data is being pushed in, as both of those
+// need the output buffer.
+
+static int can_read_in_place(LHADecoder *decoder)
+{
+	return decoder->dtype->read_direct == NULL
+	    && decoder->direct_callback == NULL
+	    && decoder->push == NULL
+	    && decoder->checkpoint_interval == 0;
+}
+
+// Decompress a run of data straight into the specified buffer, which
+// must have space for at least max_read bytes. Returns the number of
+// bytes decompressed, or zero if the decoder failed.
+
+static size_t read_in_place(LHADecoder *decoder, uint8_t *buf)
+{
+	size_t bytes;
+
+	STATS_STAGE(decoder, LHA_DECODER_STAGE_DECODE);
+	bytes = decoder->dtype->read(decoder + 1, buf);
+
+	decoder->decoded_pos += bytes;
+
+	if (decoder->decoded_pos >= decoder->limit_check_pos
+	 && !check_limits(decoder)) {
+		bytes = 0;
+	}
+
+	if (bytes == 0) {
+		decoder->decoder_failed = 1;
+	}
+
+	STATS_STAGE(decoder, LHA_DECODER_STAGE_CRC);
+	lha_crc16_buf(&decoder->crc, buf, bytes);
+	STATS_STAGE(decoder, LHA_DECODER_NUM_STAGES);
+
+	return bytes;
+}
+
+size_t lha_decoder_read(LHADecoder *decoder, uint8_t *buf, size_t buf_len)
+{
+	size_t filled, bytes;
+
+	// When we reach the end of the stream, we must truncate the
+	// decompressed data at exactly the right point (stream_length),
+	// or we may read a few extra false byte(s) by mistake.
+	// Reduce buf_len when we get to the end to limit it to the
+	// real number of remaining characters.
+
+	if (decoder->stream_pos + buf_len > decoder->stream_length) {
+		buf_len = decoder->stream_length - decoder->stream_pos;
+	}
+
+	// Try to fill up the buffer that has been passed with as much
+	// data as possible. Each call to read() will fill up outbuf
+	// with some data; this is then copied into buf, with some
+	// data left at the end for the next call.
+
+	filled = 0;
+
+	while (filled < buf_len) {
+
+		// Once the output buffer is empty, if there is space for a
+		// whole run of the decoder, decompress straight into the
+		// caller's buffer to save copying the data.
+
+		if (decoder->outbuf_pos >= decoder->outbuf_len
+		 && buf_len - filled >= decoder->dtype->max_read
+		 && can_read_in_place(decoder)) {
+			if (decoder->decoder_failed) {
+				break;
+			}
+
+			bytes = read_in_place(decoder, buf + filled);
+
+			if (bytes == 0) {
+				break;
+			}
+
+			filled += bytes;
+			continue;
+		}
+
+		// Try to empty out some of the output buffer first.
+
+		bytes = decoder->outbuf_len - decoder->outbuf_pos;
+
+		if (buf_len - filled < bytes) {
+			bytes = buf_len - filled;
+		}
+
+		// The CRC is updated at the same time as the data is
+		// copied, so that the data is only read once.
+
+		STATS_STAGE(decoder, LHA_DECODER_STAGE_CRC);
+		lha_crc16_copy(&decoder->crc, buf + filled,
+		               decoder->outbuf + decoder->outbuf_pos, bytes);
+		STATS_STAGE(decoder, LHA_DECODER_NUM_STAGES);
+		decoder->outbuf_pos += bytes;
+		filled += bytes;
+
+		// If we previously encountered a failure reading from
+		// the decoder, don't try to call the read function again.
+
+		if (decoder->decoder_failed) {
+			break;
+		}
+
+		// If outbuf is now empty, we can process another run to
+		// re-fill it.
+
+		if (decoder->outbuf_pos >= decoder->outbuf_len
+		 && refill_outbuf(decoder) == 0) {
+			break;
+		}
+	}
+
+	// Track stream position.
+
+	decoder->stream_pos += filled;
+
+	// Check progress callback, if one is set:
+
+	if ((decoder->progress_callback != NULL
+	  || decoder->byte_progress_callback != NULL)
+	 && decoder->stream_pos > decoder->progress_pos) {
+		check_progress_callback(decoder);
+	}
+
+	return filled;
+}
+
+int lha_decoder_decode_to(LHADecoder *decoder, LHADecoderSink sink,
+                          void *sink_data)
+{
+	uint8_t *data;
+	size_t bytes;
+
+	while (decoder->stream_pos < decoder->stream_length) {
+
+		// Refill the output buffer once it has been emptied.
+
+		if (decoder->outbuf_pos >= decoder->outbuf_len) {
+			if (decoder->decoder_failed
+			 || refill_outbuf(decoder) == 0) {
+				break;
+			}
+		}
+
+		// Pass as much of the output buffer as possible to the
+		// sink, truncating at the end of the stream.
+
+		data = decoder->outbuf + decoder->outbuf_pos;
+		bytes = decoder->outbuf_len - decoder->outbuf_pos;
+
+		if (bytes > decoder->stream_length - decoder->stream_pos) {
+			bytes = decoder->stream_length - decoder->stream_pos;
+		}
+
+		STATS_STAGE(decoder, LHA_DECODER_STAGE_CRC);
+		lha_crc16_buf(&decoder->crc, data, bytes);
+		STATS_STAGE(decoder, LHA_DECODER_NUM_STAGES);
+		decoder->outbuf_pos += bytes;
+		decoder->stream_pos += bytes;
+
+		if ((decoder->progress_callback != NULL
+		  || decoder->byte_progress_callback != NULL)
+		 && decoder->stream_pos > decoder->progress_pos) {
+			check_progress_callback(decoder);
+		}
+
+		if (sink != NULL && !sink(data, bytes, sink_data)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+size_t lha_decoder_skip(LHADecoder *decoder, size_t bytes)
+{
+	size_t skipped, n;
+
+	if (bytes > decoder->stream_length - decoder->stream_pos) {
+		bytes = decoder->stream_length - decoder->stream_pos;
+	}
+
+	skipped = 0;
+
+	while (skipped < bytes) {
+		if (decoder->outbuf_pos >= decoder->outbuf_len) {
+			if (decoder->decoder_failed
+			 || refill_outbuf(decoder) == 0) {
+				break;
+			}
+		}
+
+		n = decoder->outbuf_len - decoder->outbuf_pos;
+
+		if (n > bytes - skipped) {
+			n = bytes - skipped;
+		}
+
+		STATS_STAGE(decoder, LHA_DECODER_STAGE_CRC);
+		lha_crc16_buf(&decoder->crc,
+		              decoder->outbuf + decoder->outbuf_pos, n);
+		STATS_STAGE(decoder, LHA_DECODER_NUM_STAGES);
+		decoder->outbuf_pos += n;
+		skipped += n;
+	}
+
+	decoder->stream_pos += skipped;
+
+	if ((decoder->progress_callback != NULL
+	  || decoder->byte_progress_callback != NULL)
+	 && decoder->stream_pos > decoder->progress_pos) {
+		check_progress_callback(decoder);
+	}
+
+	return skipped;
+}
+
+uint16_t lha_decoder_get_crc(LHADecoder *decoder)
+{
+	return decoder->crc;
+}
+
+size_t lha_decoder_get_length(LHADecoder *decoder)
+{
+	return decoder->stream_pos;
+}
+
+int lha_decoder_get_stats(LHADecoder *decoder, LHADecoderStats *stats)
+{
+#ifdef LHA_DECODER_STATS
+	*stats = decoder->stats;
+	stats->input_bytes = decoder->input_pos;
+	stats->output_bytes = decoder->decoded_pos;
+
+	return 1;
+#else
+	memset(stats, 0, sizeof(LHADecoderStats));
+
+	return 0;
+#endif
 }
 
@@ -23,6 +23,92 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #include "public/lha_decoder.h"
 
+// With GCC on x86-64, the -lhN- decoders are compiled a second time,
+// specialized for processors with the BMI1 and BMI2 instructions (see
+// lh5_decoder_bmi2.c). lha_decoder_for_name() returns the specialized
+// decoders if the processor supports them.
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 5 \
+ && defined(__x86_64__)
+#define LHA_DECODER_BMI2_VARIANTS
+#endif
+
+// Tokens passed between the stages of two-stage decoding (see the
+// read_tokens field of LHADecoderType). A token below 256 is a literal
+// byte value; anything else is a copy of 1-256 bytes from history, at
+// a distance of up to 2^23 bytes back.
+
+#define LHA_TOKEN_COPY(length, distance) \
+	((((uint32_t) (distance)) << 9) | 0x100 | ((uint32_t) (length) - 1))
+#define LHA_TOKEN_LENGTH(token)   (((token) & 0xff) + 1)
+#define LHA_TOKEN_DISTANCE(token) ((token) >> 9)
+
+typedef struct _LHATwoStage LHATwoStage;
+
+/**
+ * Callback function used to read compressed data in place, without
+ * copying it.
+ *
+ * @param buf            Pointer to a variable in which to store a pointer
+ *                       to the data.
+ * @param buf_len        Maximum number of bytes to read.
+ * @param user_data      Extra pointer passed to
+ *                       @ref lha_decoder_set_direct_input.
+ * @return               Number of bytes available at the returned
+ *                       pointer, or zero if the data must be read
+ *                       using the normal callback instead.
+ */
+
+typedef size_t (*LHADecoderDirectCallback)(uint8_t **buf, size_t buf_len,
+                                           void *user_data);
+
+/**
+ * Compressed data fed to a decoder created with
+ * @ref lha_decoder_new_push.
+ */
+
+typedef struct {
+
+	/** Data fed in, and the position of the next byte to read. */
+
+	uint8_t *data;
+	size_t len, size, pos;
+
+	/** Non-zero once all the data has been fed in. */
+
+	int finished;
+
+	/** Set if the decoder tried to read more data than was available,
+	    and the number of bytes from 'start' (the position before the
+	    last call to the decoder) that it would need to get further. */
+
+	int underrun;
+	size_t start, needed;
+
+	/** Copy of the decoder's private data, from before the last call
+	    to the decoder, used to roll it back after an underrun. */
+
+	uint8_t *snapshot;
+} LHADecoderPush;
+
+/**
+ * Decoders are allocated so that the decoder structure, the private data
+ * area that follows it, and the output buffer after that each start on
+ * a boundary of this many bytes: a cache line on most processors.
+ * Algorithms can use LHA_DECODER_ALIGNED on large arrays in their
+ * private data, such as history windows, to align them in the same way.
+ */
+
+#define LHA_DECODER_ALIGNMENT 64
+
+#if defined(__GNUC__)
+#define LHA_DECODER_ALIGNED __attribute__((aligned(LHA_DECODER_ALIGNMENT)))
+#elif defined(_MSC_VER)
+#define LHA_DECODER_ALIGNED __declspec(align(64))
+#else
+#define LHA_DECODER_ALIGNED
+#endif
+
 struct _LHADecoderType {
 
 	/**
@@ -75,14 +161,144 @@ struct _LHADecoderType {
 	    progress bar. */
 
 	size_t block_size;
+
+	/**
+	 * Optional callback function to read (ie. decompress) data
+	 * without copying it into a separate output buffer. If this is
+	 * provided, it is used instead of read(), and no output buffer
+	 * is allocated for the decoder.
+	 *
+	 * @param extra_data     Pointer to the decoder's custom data.
+	 * @param buf            Pointer to a variable in which to store
+	 *                       a pointer to the decompressed data. The
+	 *                       data is held by the decoder (typically in
+	 *                       its history buffer) and remains valid
+	 *                       until the next call to the decoder.
+	 * @return               Number of bytes decompressed.
+	 */
+
+	size_t (*read_direct)(void *extra_data, uint8_t **buf);
+
+	/**
+	 * Optional callback function to reset the decoder to its
+	 * initial state so that a new stream can be decoded. If this
+	 * is not provided, the extra data area is cleared and init()
+	 * is called again.
+	 *
+	 * @param extra_data     Pointer to the extra data area allocated for
+	 *                       the decoder.
+	 * @param callback       Callback function to invoke to read more
+	 *                       compressed data.
+	 * @param callback_data  Extra pointer to pass to the callback.
+	 * @return               Non-zero for success.
+	 */
+
+	int (*reset)(void *extra_data,
+	             LHADecoderCallback callback,
+	             void *callback_data);
+
+	/** Size of a checkpoint saved by checkpoint(), in bytes. */
+
+	size_t checkpoint_size;
+
+	/**
+	 * Optional callback function to save a checkpoint, from which
+	 * decoding can later be resumed using restore(). Checkpoints
+	 * can only be saved at certain points in the stream (eg. the
+	 * start of a block); if the decoder is not at one, the next
+	 * call to read() stops at the next such point.
+	 *
+	 * @param extra_data     Pointer to the decoder's custom data.
+	 * @param buf            Buffer in which to save the checkpoint;
+	 *                       it is 'checkpoint_size' bytes in size.
+	 * @param input_bits     Pointer to a variable in which to store
+	 *                       the position in the compressed data, in
+	 *                       bits, from which decoding resumes.
+	 * @return               Non-zero if a checkpoint was saved.
+	 */
+
+	int (*checkpoint)(void *extra_data, uint8_t *buf,
+	                  uint64_t *input_bits);
+
+	/**
+	 * Callback function to initialize the decoder to resume decoding
+	 * from a checkpoint saved by checkpoint(). Required if
+	 * checkpoint() is provided.
+	 *
+	 * @param extra_data     Pointer to the extra data area allocated for
+	 *                       the decoder.
+	 * @param callback       Callback function to invoke to read more
+	 *                       compressed data. The data starts from the
+	 *                       byte containing the checkpoint position.
+	 * @param callback_data  Extra pointer to pass to the callback.
+	 * @param buf            The saved checkpoint.
+	 * @param skip_bits      Number of bits to skip at the start of the
+	 *                       compressed data (0-7).
+	 * @return               Non-zero for success.
+	 */
+
+	int (*restore)(void *extra_data,
+	               LHADecoderCallback callback,
+	               void *callback_data,
+	               uint8_t *buf,
+	               unsigned int skip_bits);
+
+	/** Non-zero if the decoder's output is simply its input (ie. the
+	    data is stored uncompressed). The output of such a decoder can
+	    be read in place from a direct input source; see
+	    @ref lha_decoder_set_direct_input. */
+
+	int stored;
+
+	/**
+	 * Callback function for the first stage of two-stage decoding
+	 * (see @ref lha_decoder_enable_two_stage), or NULL if it is not
+	 * supported. Reads compressed data and decodes it into tokens
+	 * (see LHA_TOKEN_COPY), which describe the output without
+	 * producing it. This is called on a different thread from
+	 * decode_tokens, at the same time, so the two must not use the
+	 * same parts of the decoder's data.
+	 *
+	 * @param extra_data     Pointer to the decoder's custom data.
+	 * @param tokens         Buffer in which to store the tokens.
+	 * @param max_tokens     Maximum number of tokens to decode.
+	 * @param max_output     Maximum amount of output that the tokens
+	 *                       may describe, in bytes.
+	 * @return               Number of tokens decoded, or zero for end
+	 *                       of stream or error.
+	 */
+
+	size_t (*read_tokens)(void *extra_data, uint32_t *tokens,
+	                      size_t max_tokens, size_t max_output);
+
+	/**
+	 * Callback function for the second stage of two-stage decoding,
+	 * which produces the output described by tokens from
+	 * read_tokens.
+	 *
+	 * @param extra_data     Pointer to the decoder's custom data.
+	 * @param tokens         The tokens.
+	 * @param num_tokens     Number of tokens.
+	 * @param buf            Buffer in which to store the output.
+	 * @return               Number of bytes of output.
+	 */
+
+	size_t (*decode_tokens)(void *extra_data, const uint32_t *tokens,
+	                        size_t num_tokens, uint8_t *buf);
 };
 
-struct _LHADecoder {
+struct LHA_DECODER_ALIGNED _LHADecoder {
 
 	/** Type of decoder (algorithm) */
 
 	LHADecoderType *dtype;
 
+	/** Functions that allocated the decoder, to free it with, and the
+	    size allocated. */
+
+	LHADecoderAllocator allocator;
+	size_t alloc_size;
+
 	/** Callback function to monitor decoder progress. */
 
 	LHADecoderProgressCallback progress_callback;
@@ -92,11 +308,25 @@ struct _LHADecoder {
 
 	unsigned int last_block, total_blocks;
 
+	/** Callback function to monitor progress in bytes, and the
+	    length of the compressed data reported to it. */
+
+	LHADecoderByteProgressCallback byte_progress_callback;
+	void *byte_progress_callback_data;
+	size_t input_length;
+
+	/** Stream position after which the next block is reached; the
+	    progress callback is not checked until then. */
+
+	size_t progress_pos;
+
 	/** Current position in the decode stream, and total length. */
 
 	size_t stream_pos, stream_length;
 
-	/** Output buffer, containing decoded data not yet returned. */
+	/** Output buffer, containing decoded data not yet returned.
+	    If the decoder type has a read_direct() function, this
+	    points into the decoder's own data. */
 
 	unsigned int outbuf_pos, outbuf_len;
 	uint8_t *outbuf;
@@ -108,7 +338,208 @@ struct _LHADecoder {
 	/** Current CRC of the output stream. */
 
 	uint16_t crc;
+
+	/** Total number of bytes returned by the decoder's read function. */
+
+	size_t decoded_pos;
+
+	/** Interval between checkpoints, or zero if checkpoints are not
+	    being recorded, and the position at which to save the next. */
+
+	size_t checkpoint_interval, next_checkpoint;
+
+	/** Checkpoints recorded so far. */
+
+	LHADecoderCheckpoint *checkpoints;
+	unsigned int num_checkpoints, checkpoints_size;
+
+	/** Buffer for the next checkpoint to be saved. */
+
+	uint8_t *checkpoint_buf;
+
+	/** Data decoded before the state was saved but not yet returned,
+	    for a decoder created by @ref lha_decoder_restore_state. The
+	    output buffer points to it until it has been returned. */
+
+	uint8_t *resume_buf;
+
+	/** For a push decoder, the data fed in; otherwise NULL. */
+
+	LHADecoderPush *push;
+
+	/** Callback to read stored data in place, or NULL. */
+
+	LHADecoderDirectCallback direct_callback;
+	void *direct_callback_data;
+
+	/** Input callback, which is wrapped to count the compressed data
+	    read, and the number of bytes read so far. */
+
+	LHADecoderCallback input_callback;
+	void *input_callback_data;
+	size_t input_pos;
+
+	/** Two-stage decoding state, or NULL if not enabled. */
+
+	LHATwoStage *two_stage;
+
+	/** Budgets set with @ref lha_decoder_set_limits, the budget that
+	    was exceeded, if any, and the value of decoded_pos at which the
+	    budgets are next checked (SIZE_MAX if there are none). */
+
+	LHADecoderLimits limits;
+	LHADecoderLimit limit_exceeded;
+	size_t limit_check_pos;
+
+	/** Time at which the budgets were set, for the time budget. */
+
+	unsigned int limit_start_ms;
+
+#ifdef LHA_DECODER_STATS
+	/** Statistics collected so far (see @ref lha_decoder_get_stats). */
+
+	LHADecoderStats stats;
+
+	/** Stage currently being timed, or LHA_DECODER_NUM_STAGES when
+	    outside the decoder, and the time at which it started. */
+
+	unsigned int stats_stage;
+	uint64_t stats_clock;
+
+	/** Stages to return to at the end of the stages started by the
+	    algorithm (see LHA_STATS_BEGIN). */
+
+	unsigned int stats_stack[LHA_DECODER_NUM_STAGES];
+	unsigned int stats_depth;
+#endif
 };
 
+#ifdef LHA_DECODER_STATS
+
+/**
+ * Switch the stage of decoding that is timed, for
+ * @ref lha_decoder_get_stats.
+ *
+ * @param decoder        The decoder.
+ * @param stage          The stage now starting.
+ * @return               The stage that has ended.
+ */
+
+unsigned int lha_decoder_stats_stage(LHADecoder *decoder, unsigned int stage);
+
+/**
+ * Count a copy command, for @ref lha_decoder_get_stats.
+ *
+ * @param decoder        The decoder.
+ * @param len            Length of the copy.
+ */
+
+void lha_decoder_stats_copy(LHADecoder *decoder, size_t len);
+
+/**
+ * Start timing a stage of decoding within the decoder's algorithm, for
+ * @ref lha_decoder_get_stats. Stages can be nested.
+ *
+ * @param decoder        The decoder.
+ * @param stage          The stage starting.
+ */
+
+void lha_decoder_stats_begin(LHADecoder *decoder, unsigned int stage);
+
+/**
+ * Finish timing the last stage started with
+ * @ref lha_decoder_stats_begin.
+ *
+ * @param decoder        The decoder.
+ */
+
+void lha_decoder_stats_end(LHADecoder *decoder);
+
+// Macros used by the algorithms to collect statistics. These are given
+// the algorithm's private data area, which follows the LHADecoder
+// structure.
+
+#define LHA_STATS_DECODER(data) (((LHADecoder *) (data)) - 1)
+
+#define LHA_STATS_LITERAL(data) (++LHA_STATS_DECODER(data)->stats.literals)
+#define LHA_STATS_LITERALS(data, n) \
+	(LHA_STATS_DECODER(data)->stats.literals += (n))
+#define LHA_STATS_COPY(data, len) \
+	lha_decoder_stats_copy(LHA_STATS_DECODER(data), (len))
+#define LHA_STATS_BLOCK(data) (++LHA_STATS_DECODER(data)->stats.blocks)
+#define LHA_STATS_TREE(data) (++LHA_STATS_DECODER(data)->stats.tree_builds)
+
+#define LHA_STATS_BEGIN(data, stage) \
+	lha_decoder_stats_begin(LHA_STATS_DECODER(data), (stage))
+#define LHA_STATS_END(data) lha_decoder_stats_end(LHA_STATS_DECODER(data))
+
+#else
+
+#define LHA_STATS_LITERAL(data) ((void) 0)
+#define LHA_STATS_LITERALS(data, n) ((void) 0)
+#define LHA_STATS_COPY(data, len) ((void) 0)
+#define LHA_STATS_BLOCK(data) ((void) 0)
+#define LHA_STATS_TREE(data) ((void) 0)
+#define LHA_STATS_BEGIN(data, stage) ((void) 0)
+#define LHA_STATS_END(data) ((void) 0)
+
+#endif
+
+/**
+ * Set a callback with which a decoder can read its input in place.
+ * This only has an effect for decoders of stored data (see the
+ * 'stored' field of @ref LHADecoderType), which then return the
+ * data without copying it. The callback should read from the same
+ * source as the normal decoder callback; it is cleared when the
+ * decoder is reset.
+ *
+ * @param decoder        The decoder.
+ * @param callback       Callback function to read data in place.
+ * @param callback_data  Extra pointer to pass to the callback.
+ */
+
+void lha_decoder_set_direct_input(LHADecoder *decoder,
+                                  LHADecoderDirectCallback callback,
+                                  void *callback_data);
+
+/**
+ * Skip over decompressed data from the decoder, without returning it.
+ *
+ * @param decoder        The decoder.
+ * @param bytes          Number of bytes to skip.
+ * @return               Number of bytes skipped; this is less than
+ *                       requested if the end of the stream was reached
+ *                       or an error occurred.
+ */
+
+size_t lha_decoder_skip(LHADecoder *decoder, size_t bytes);
+
+/**
+ * Get the portable version of a decoder type. The type returned by
+ * @ref lha_decoder_for_name may be a version specialized for the
+ * running processor; this returns the version that it replaces, which
+ * gives the same results.
+ *
+ * @param dtype          The decoder type.
+ * @return               The portable version of the decoder type.
+ */
+
+LHADecoderType *lha_decoder_generic_type(LHADecoderType *dtype);
+
+/**
+ * Check amounts of compressed and decompressed data against the output
+ * and ratio budgets of @ref LHADecoderLimits. This can be used to reject
+ * a file from its header before decoding it at all.
+ *
+ * @param limits         The budgets.
+ * @param output         Amount of decompressed data.
+ * @param input          Amount of compressed data.
+ * @return               The budget that is exceeded, or
+ *                       @ref LHA_DECODER_LIMIT_NONE.
+ */
+
+LHADecoderLimit lha_decoder_check_sizes(const LHADecoderLimits *limits,
+                                        uint64_t output, uint64_t input);
+
 #endif /* #ifndef LHASA_LHA_DECODER_H */
 
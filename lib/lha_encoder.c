@@ -0,0 +1,791 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lha_encoder.h"
+
+// Number of commands in each block. Each block has its own Huffman
+// tables, so shorter blocks adapt more quickly to changes in the data,
+// at the cost of writing the tables more often.
+
+#define BLOCK_COMMANDS       16384
+
+// Code table sizes, which are the same for all of the -lh?- methods.
+
+#define NUM_CODES            510
+#define NUM_TEMP_CODES       19
+#define MAX_OFFSET_CODES     17
+#define MAX_CODE_LEN         16
+
+// Range of copy lengths.
+
+#define COPY_THRESHOLD       3
+#define MAX_COPY             256
+
+// Size of the hash table used to find matches, which is indexed by a
+// hash of the next three bytes.
+
+#define HASH_BITS            15
+#define HASH_SIZE            (1 << HASH_BITS)
+
+// Limits on the search for matches: the number of earlier positions
+// with the same hash that are checked, and the length of a match that
+// is good enough to use without checking whether a longer one starts
+// at the next byte.
+
+#define MAX_CHAIN            32
+#define LAZY_LENGTH          32
+
+typedef struct {
+	char *name;
+
+	// Number of bits in the decoder's history buffer, and the number
+	// of bits used for the size of the offset table. Only half of
+	// the history buffer is used for copies, as other
+	// implementations only allocate that much.
+
+	unsigned int history_bits;
+	unsigned int offset_bits;
+} EncoderMethod;
+
+static const EncoderMethod methods[] = {
+	{ "-lh5-", 14, 4 },
+	{ "-lh6-", 16, 5 },
+	{ "-lh7-", 17, 5 },
+};
+
+typedef struct {
+	const EncoderMethod *method;
+	unsigned int window_size;
+
+	// Output buffer, and the pending bits.
+
+	uint8_t *out;
+	size_t out_len, out_size;
+	uint32_t bit_buffer;
+	unsigned int bits;
+
+	// Commands for the current block. Offsets are stored as the copy
+	// distance minus one, as they are encoded.
+
+	uint16_t codes[BLOCK_COMMANDS];
+	uint16_t offsets[BLOCK_COMMANDS];
+	unsigned int num_commands;
+	unsigned int num_offsets;
+
+	// Hash chains: the most recent position with each hash, and for
+	// each position in the window, the previous one with the same
+	// hash. Positions are stored plus one, so that zero is empty.
+
+	uint32_t head[HASH_SIZE];
+	uint32_t *prev;
+} LHAEncoder;
+
+typedef struct {
+	unsigned int symbol;
+	unsigned int freq;
+} SymbolFreq;
+
+static const EncoderMethod *method_for_name(char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(methods) / sizeof(*methods); ++i) {
+		if (!strcmp(methods[i].name, name)) {
+			return &methods[i];
+		}
+	}
+
+	return NULL;
+}
+
+int lha_encoder_supported(char *method)
+{
+	return method_for_name(method) != NULL;
+}
+
+// Make sure there is room for at least the specified number of bytes
+// in the output buffer.
+
+static int reserve_output(LHAEncoder *encoder, size_t len)
+{
+	uint8_t *new_out;
+	size_t new_size;
+
+	if (encoder->out_size - encoder->out_len >= len) {
+		return 1;
+	}
+
+	new_size = encoder->out_size * 2;
+
+	if (new_size < encoder->out_len + len) {
+		new_size = encoder->out_len + len;
+	}
+
+	new_out = realloc(encoder->out, new_size);
+
+	if (new_out == NULL) {
+		return 0;
+	}
+
+	encoder->out = new_out;
+	encoder->out_size = new_size;
+
+	return 1;
+}
+
+// Write up to 16 bits to the output. There must already be room for
+// them in the output buffer.
+
+static void write_bits(LHAEncoder *encoder, unsigned int value,
+                       unsigned int bits)
+{
+	encoder->bit_buffer = (encoder->bit_buffer << bits)
+	                    | (value & ((1U << bits) - 1));
+	encoder->bits += bits;
+
+	while (encoder->bits >= 8) {
+		encoder->bits -= 8;
+		encoder->out[encoder->out_len++]
+		    = (uint8_t) (encoder->bit_buffer >> encoder->bits);
+	}
+}
+
+static int compare_freqs(const void *a, const void *b)
+{
+	const SymbolFreq *fa = a, *fb = b;
+
+	if (fa->freq != fb->freq) {
+		return fa->freq < fb->freq ? -1 : 1;
+	}
+
+	return fa->symbol < fb->symbol ? -1 : 1;
+}
+
+// Calculate Huffman code lengths for the given frequencies, limited to
+// MAX_CODE_LEN bits. Returns the number of symbols that are used; if
+// this is less than two, no lengths are set.
+
+static unsigned int make_lengths(const unsigned int *freqs, unsigned int n,
+                                 uint8_t *lengths)
+{
+	SymbolFreq leaves[NUM_CODES];
+	unsigned int weights[NUM_CODES * 2];
+	unsigned int parents[NUM_CODES * 2];
+	unsigned int depths[NUM_CODES * 2];
+	unsigned int len_count[MAX_CODE_LEN + 1];
+	unsigned int num_leaves, num_nodes, next_leaf, next_node;
+	unsigned int i, j, k, pick, cum;
+
+	memset(lengths, 0, n);
+	num_leaves = 0;
+
+	for (i = 0; i < n; ++i) {
+		if (freqs[i] > 0) {
+			leaves[num_leaves].symbol = i;
+			leaves[num_leaves].freq = freqs[i];
+			++num_leaves;
+		}
+	}
+
+	if (num_leaves < 2) {
+		return num_leaves;
+	}
+
+	qsort(leaves, num_leaves, sizeof(SymbolFreq), compare_freqs);
+
+	// Build the tree with the two-queue method: leaves are taken in
+	// sorted order, and new nodes are created in increasing weight.
+	// Nodes 0..num_leaves-1 are the leaves.
+
+	for (i = 0; i < num_leaves; ++i) {
+		weights[i] = leaves[i].freq;
+	}
+
+	num_nodes = num_leaves;
+	next_leaf = 0;
+	next_node = num_leaves;
+
+	while (num_nodes < num_leaves * 2 - 1) {
+		weights[num_nodes] = 0;
+
+		for (j = 0; j < 2; ++j) {
+			if (next_leaf < num_leaves
+			 && (next_node >= num_nodes
+			  || weights[next_leaf] <= weights[next_node])) {
+				pick = next_leaf++;
+			} else {
+				pick = next_node++;
+			}
+
+			parents[pick] = num_nodes;
+			weights[num_nodes] += weights[pick];
+		}
+
+		++num_nodes;
+	}
+
+	depths[num_nodes - 1] = 0;
+
+	for (i = num_nodes - 1; i > 0; --i) {
+		depths[i - 1] = depths[parents[i - 1]] + 1;
+	}
+
+	// Count the codes of each length, and if any are too long, adjust
+	// the counts until the code is complete again.
+
+	memset(len_count, 0, sizeof(len_count));
+
+	for (i = 0; i < num_leaves; ++i) {
+		k = depths[i];
+		++len_count[k > MAX_CODE_LEN ? MAX_CODE_LEN : k];
+	}
+
+	cum = 0;
+
+	for (i = 1; i <= MAX_CODE_LEN; ++i) {
+		cum += len_count[i] << (MAX_CODE_LEN - i);
+	}
+
+	while (cum != (1U << MAX_CODE_LEN)) {
+		--len_count[MAX_CODE_LEN];
+
+		for (i = MAX_CODE_LEN - 1; i > 0; --i) {
+			if (len_count[i] != 0) {
+				--len_count[i];
+				len_count[i + 1] += 2;
+				break;
+			}
+		}
+
+		--cum;
+	}
+
+	// The least frequent symbols get the longest codes.
+
+	k = 0;
+
+	for (i = MAX_CODE_LEN; i > 0; --i) {
+		for (j = 0; j < len_count[i]; ++j) {
+			lengths[leaves[k].symbol] = (uint8_t) i;
+			++k;
+		}
+	}
+
+	return num_leaves;
+}
+
+// Assign canonical codes for the given lengths: shorter codes come
+// first, and codes of the same length are in symbol order. This is the
+// order in which the decoder builds its trees.
+
+static void make_codes(const uint8_t *lengths, unsigned int n,
+                       uint16_t *codes)
+{
+	unsigned int len, i, code;
+
+	code = 0;
+
+	for (len = 1; len <= MAX_CODE_LEN; ++len) {
+		for (i = 0; i < n; ++i) {
+			if (lengths[i] == len) {
+				codes[i] = (uint16_t) code;
+				++code;
+			}
+		}
+
+		code <<= 1;
+	}
+}
+
+static unsigned int last_used(const uint8_t *lengths, unsigned int n)
+{
+	while (n > 0 && lengths[n - 1] == 0) {
+		--n;
+	}
+
+	return n;
+}
+
+static unsigned int first_used(const unsigned int *freqs)
+{
+	unsigned int i;
+
+	for (i = 0; freqs[i] == 0; ++i);
+
+	return i;
+}
+
+static void write_length_value(LHAEncoder *encoder, unsigned int len)
+{
+	if (len < 7) {
+		write_bits(encoder, len, 3);
+	} else {
+		write_bits(encoder, 7, 3);
+
+		for (; len > 7; --len) {
+			write_bits(encoder, 1, 1);
+		}
+
+		write_bits(encoder, 0, 1);
+	}
+}
+
+// Go through the code table lengths in the form in which they are
+// written, calling the callback for each temp code and its extra bits.
+
+static void code_table_codes(const uint8_t *lengths, unsigned int n,
+                             void (*callback)(void *data, unsigned int code,
+                                              unsigned int extra,
+                                              unsigned int extra_bits),
+                             void *data)
+{
+	unsigned int i, run;
+
+	i = 0;
+
+	while (i < n) {
+		if (lengths[i] != 0) {
+			callback(data, lengths[i] + 2U, 0, 0);
+			++i;
+			continue;
+		}
+
+		for (run = 0; i < n && lengths[i] == 0; ++i) {
+			++run;
+		}
+
+		if (run <= 2) {
+			for (; run > 0; --run) {
+				callback(data, 0, 0, 0);
+			}
+		} else if (run <= 18) {
+			callback(data, 1, run - 3, 4);
+		} else if (run == 19) {
+			callback(data, 0, 0, 0);
+			callback(data, 1, 15, 4);
+		} else {
+			callback(data, 2, run - 20, 9);
+		}
+	}
+}
+
+static void count_temp_code(void *data, unsigned int code,
+                            unsigned int extra, unsigned int extra_bits)
+{
+	unsigned int *freqs = data;
+
+	++freqs[code];
+}
+
+typedef struct {
+	LHAEncoder *encoder;
+	uint8_t *lengths;
+	uint16_t *codes;
+} TempTable;
+
+static void write_temp_code(void *data, unsigned int code,
+                            unsigned int extra, unsigned int extra_bits)
+{
+	TempTable *table = data;
+
+	write_bits(table->encoder, table->codes[code], table->lengths[code]);
+	write_bits(table->encoder, extra, extra_bits);
+}
+
+static void write_temp_table(LHAEncoder *encoder, const uint8_t *lengths,
+                             unsigned int n)
+{
+	unsigned int i, skip;
+
+	write_bits(encoder, n, 5);
+
+	for (i = 0; i < n; ++i) {
+		write_length_value(encoder, lengths[i]);
+
+		// After the third length, a 2-bit count of following
+		// zero lengths.
+
+		if (i == 2) {
+			for (skip = 0; skip < 3 && i + 1 < n
+			            && lengths[i + 1] == 0; ++skip) {
+				++i;
+			}
+
+			write_bits(encoder, skip, 2);
+		}
+	}
+}
+
+// Write the code table, preceded by the temp table used to encode it.
+// When only one code is used, both are written as a single code.
+
+static void write_code_table(LHAEncoder *encoder,
+                             const unsigned int *code_freqs,
+                             uint8_t *code_lengths, uint16_t *code_codes)
+{
+	unsigned int temp_freqs[NUM_TEMP_CODES];
+	uint8_t temp_lengths[NUM_TEMP_CODES];
+	uint16_t temp_codes[NUM_TEMP_CODES];
+	TempTable table;
+	unsigned int n;
+
+	if (make_lengths(code_freqs, NUM_CODES, code_lengths) < 2) {
+		write_bits(encoder, 0, 5);
+		write_bits(encoder, 0, 5);
+		write_bits(encoder, 0, 9);
+		write_bits(encoder, first_used(code_freqs), 9);
+		memset(code_lengths, 0, NUM_CODES);
+		memset(code_codes, 0, NUM_CODES * sizeof(uint16_t));
+		return;
+	}
+
+	n = last_used(code_lengths, NUM_CODES);
+	make_codes(code_lengths, NUM_CODES, code_codes);
+
+	memset(temp_freqs, 0, sizeof(temp_freqs));
+	code_table_codes(code_lengths, n, count_temp_code, temp_freqs);
+
+	if (make_lengths(temp_freqs, NUM_TEMP_CODES, temp_lengths) < 2) {
+		write_bits(encoder, 0, 5);
+		write_bits(encoder, first_used(temp_freqs), 5);
+		memset(temp_lengths, 0, sizeof(temp_lengths));
+		memset(temp_codes, 0, sizeof(temp_codes));
+	} else {
+		write_temp_table(encoder, temp_lengths,
+		                 last_used(temp_lengths, NUM_TEMP_CODES));
+		make_codes(temp_lengths, NUM_TEMP_CODES, temp_codes);
+	}
+
+	write_bits(encoder, n, 9);
+	table.encoder = encoder;
+	table.lengths = temp_lengths;
+	table.codes = temp_codes;
+	code_table_codes(code_lengths, n, write_temp_code, &table);
+}
+
+static void write_offset_table(LHAEncoder *encoder,
+                               const unsigned int *offset_freqs,
+                               uint8_t *offset_lengths,
+                               uint16_t *offset_codes)
+{
+	const EncoderMethod *method = encoder->method;
+	unsigned int i, n;
+
+	if (make_lengths(offset_freqs, method->history_bits,
+	                 offset_lengths) < 2) {
+		write_bits(encoder, 0, method->offset_bits);
+		write_bits(encoder, encoder->num_offsets == 0 ? 0
+		                  : first_used(offset_freqs),
+		           method->offset_bits);
+		memset(offset_codes, 0, MAX_OFFSET_CODES * sizeof(uint16_t));
+		return;
+	}
+
+	n = last_used(offset_lengths, method->history_bits);
+	write_bits(encoder, n, method->offset_bits);
+
+	for (i = 0; i < n; ++i) {
+		write_length_value(encoder, offset_lengths[i]);
+	}
+
+	make_codes(offset_lengths, method->history_bits, offset_codes);
+}
+
+// Write out the commands for the current block.
+
+static int write_block(LHAEncoder *encoder)
+{
+	unsigned int code_freqs[NUM_CODES];
+	unsigned int offset_freqs[MAX_OFFSET_CODES];
+	uint8_t code_lengths[NUM_CODES];
+	uint8_t offset_lengths[MAX_OFFSET_CODES];
+	uint16_t code_codes[NUM_CODES];
+	uint16_t offset_codes[MAX_OFFSET_CODES];
+	uint8_t offset_bits[BLOCK_COMMANDS];
+	unsigned int i, j, code, bits, offset;
+
+	if (encoder->num_commands == 0) {
+		return 1;
+	}
+
+	// Each command takes at most 16 bits for its code, 16 for the
+	// offset code and 16 for the offset itself, and the tables are
+	// much smaller than 1KB.
+
+	if (!reserve_output(encoder, encoder->num_commands * 6 + 1024)) {
+		return 0;
+	}
+
+	memset(code_freqs, 0, sizeof(code_freqs));
+	memset(offset_freqs, 0, sizeof(offset_freqs));
+
+	for (i = 0; i < encoder->num_commands; ++i) {
+		++code_freqs[encoder->codes[i]];
+	}
+
+	// Offsets are coded as their length in bits, followed by all but
+	// the top bit.
+
+	for (i = 0; i < encoder->num_offsets; ++i) {
+		for (bits = 0, offset = encoder->offsets[i]; offset != 0;
+		     offset >>= 1) {
+			++bits;
+		}
+
+		offset_bits[i] = (uint8_t) bits;
+		++offset_freqs[bits];
+	}
+
+	write_bits(encoder, encoder->num_commands, 16);
+	write_code_table(encoder, code_freqs, code_lengths, code_codes);
+	write_offset_table(encoder, offset_freqs, offset_lengths,
+	                   offset_codes);
+
+	for (i = 0, j = 0; i < encoder->num_commands; ++i) {
+		code = encoder->codes[i];
+		write_bits(encoder, code_codes[code], code_lengths[code]);
+
+		if (code < 256) {
+			continue;
+		}
+
+		bits = offset_bits[j];
+		write_bits(encoder, offset_codes[bits], offset_lengths[bits]);
+
+		if (bits > 1) {
+			write_bits(encoder, encoder->offsets[j], bits - 1);
+		}
+
+		++j;
+	}
+
+	encoder->num_commands = 0;
+	encoder->num_offsets = 0;
+
+	return 1;
+}
+
+static int add_literal(LHAEncoder *encoder, uint8_t b)
+{
+	encoder->codes[encoder->num_commands++] = b;
+
+	return encoder->num_commands < BLOCK_COMMANDS || write_block(encoder);
+}
+
+static int add_copy(LHAEncoder *encoder, unsigned int len,
+                    unsigned int distance)
+{
+	encoder->codes[encoder->num_commands++]
+	    = (uint16_t) (256 + len - COPY_THRESHOLD);
+	encoder->offsets[encoder->num_offsets++] = (uint16_t) (distance - 1);
+
+	return encoder->num_commands < BLOCK_COMMANDS || write_block(encoder);
+}
+
+static unsigned int hash_at(const uint8_t *data)
+{
+	uint32_t value;
+
+	value = ((uint32_t) data[0] << 16) | ((uint32_t) data[1] << 8)
+	      | data[2];
+
+	return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Add the specified position to the hash chains. There must be at least
+// three bytes of data from the position.
+
+static void insert_position(LHAEncoder *encoder, const uint8_t *data,
+                            uint32_t pos)
+{
+	unsigned int hash = hash_at(data + pos);
+
+	encoder->prev[pos & (encoder->window_size - 1)] = encoder->head[hash];
+	encoder->head[hash] = pos + 1;
+}
+
+// Find the longest match for the data at the specified position,
+// searching back through the positions with the same hash. Returns the
+// length of the match, which is less than COPY_THRESHOLD if no match
+// was found.
+
+static unsigned int find_match(LHAEncoder *encoder, const uint8_t *data,
+                               size_t data_len, uint32_t pos,
+                               unsigned int *distance)
+{
+	const uint8_t *cur = data + pos;
+	const uint8_t *match;
+	unsigned int chain, len, best_len, max_len;
+	uint32_t candidate;
+
+	max_len = data_len - pos < MAX_COPY ? (unsigned int) (data_len - pos)
+	                                    : MAX_COPY;
+	best_len = COPY_THRESHOLD - 1;
+	candidate = encoder->head[hash_at(cur)];
+
+	for (chain = 0; chain < MAX_CHAIN && candidate != 0; ++chain) {
+		--candidate;
+
+		if (pos - candidate > encoder->window_size) {
+			break;
+		}
+
+		match = data + candidate;
+
+		// Check the byte that would make the match longer than the
+		// best so far before comparing the rest.
+
+		if (match[best_len] == cur[best_len] && match[0] == cur[0]) {
+			for (len = 1; len < max_len && match[len] == cur[len];
+			     ++len);
+
+			if (len > best_len) {
+				best_len = len;
+				*distance = pos - candidate;
+
+				if (len == max_len) {
+					break;
+				}
+			}
+		}
+
+		candidate = encoder->prev[candidate
+		                          & (encoder->window_size - 1)];
+	}
+
+	return best_len;
+}
+
+// Compress the data. Lazy matching is used: when a match is found, it
+// is only used if there is not a longer one starting at the next byte.
+
+static int encode_data(LHAEncoder *encoder, const uint8_t *data,
+                       size_t data_len)
+{
+	unsigned int prev_len, prev_distance, len, distance;
+	uint32_t pos, end;
+	int have_prev;
+
+	have_prev = 0;
+	prev_len = 0;
+	prev_distance = 0;
+	distance = 0;
+
+	for (pos = 0; pos < data_len; ++pos) {
+		len = 0;
+
+		if (data_len - pos >= COPY_THRESHOLD) {
+			if (!have_prev || prev_len < LAZY_LENGTH) {
+				len = find_match(encoder, data, data_len,
+				                 pos, &distance);
+			}
+
+			insert_position(encoder, data, pos);
+		}
+
+		if (!have_prev) {
+			have_prev = 1;
+		} else if (prev_len >= COPY_THRESHOLD && len <= prev_len) {
+
+			// The match at the previous byte is the better one.
+			// Add the positions that it covers to the hash
+			// chains, and continue after it.
+
+			if (!add_copy(encoder, prev_len, prev_distance)) {
+				return 0;
+			}
+
+			end = pos - 1 + prev_len;
+
+			for (++pos; pos < end; ++pos) {
+				if (data_len - pos >= COPY_THRESHOLD) {
+					insert_position(encoder, data, pos);
+				}
+			}
+
+			have_prev = 0;
+			--pos;
+			continue;
+		} else if (!add_literal(encoder, data[pos - 1])) {
+			return 0;
+		}
+
+		prev_len = len;
+		prev_distance = distance;
+	}
+
+	if (have_prev && !add_literal(encoder, data[data_len - 1])) {
+		return 0;
+	}
+
+	return write_block(encoder);
+}
+
+uint8_t *lha_encode(char *method, const uint8_t *data, size_t data_len,
+                    size_t *result_len)
+{
+	LHAEncoder *encoder;
+	uint8_t *result;
+
+	// Positions are stored in 32 bits.
+
+	if (data_len > UINT32_MAX - MAX_COPY) {
+		return NULL;
+	}
+
+	encoder = calloc(1, sizeof(LHAEncoder));
+
+	if (encoder == NULL) {
+		return NULL;
+	}
+
+	encoder->method = method_for_name(method);
+
+	if (encoder->method == NULL) {
+		free(encoder);
+		return NULL;
+	}
+
+	encoder->window_size = 1U << (encoder->method->history_bits - 1);
+	encoder->prev = malloc(encoder->window_size * sizeof(uint32_t));
+	encoder->out_size = data_len / 2 + 1024;
+	encoder->out = malloc(encoder->out_size);
+
+	if (encoder->prev == NULL || encoder->out == NULL
+	 || !encode_data(encoder, data, data_len)
+	 || !reserve_output(encoder, 1)) {
+		free(encoder->out);
+		result = NULL;
+	} else {
+		// Write the last bits, padded out to a whole byte.
+
+		write_bits(encoder, 0, 7);
+		result = encoder->out;
+		*result_len = encoder->out_len;
+	}
+
+	free(encoder->prev);
+	free(encoder);
+
+	return result;
+}
@@ -0,0 +1,63 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LHASA_LHA_ENCODER_H
+#define LHASA_LHA_ENCODER_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+/**
+ * Encoder for the -lh5-, -lh6- and -lh7- compression methods.
+ *
+ * Matches are found using hash chains, with one step of lazy matching,
+ * and the resulting commands are written in blocks in the format read
+ * by the -lh?- decoders, each with its own Huffman tables. A buffer is
+ * compressed in a single call, so that separate files can be
+ * compressed on separate threads.
+ */
+
+/**
+ * Check whether a compression method is supported by the encoder.
+ *
+ * @param method         Name of the compression method, eg. "-lh5-".
+ * @return               Non-zero if the method is supported.
+ */
+
+int lha_encoder_supported(char *method);
+
+/**
+ * Compress a buffer of data.
+ *
+ * @param method         Name of the compression method, eg. "-lh5-".
+ * @param data           Pointer to the data to compress.
+ * @param data_len       Length of the data, in bytes.
+ * @param result_len     Pointer to a variable in which to store the
+ *                       length of the compressed data.
+ * @return               Pointer to the compressed data, allocated with
+ *                       malloc(), or NULL if the method is not
+ *                       supported or memory could not be allocated.
+ */
+
+uint8_t *lha_encode(char *method, const uint8_t *data, size_t data_len,
+                    size_t *result_len);
+
+#endif /* #ifndef LHASA_LHA_ENCODER_H */
+
@@ -58,3 +58,21 @@ uint32_t lha_decode_be_uint32(uint8_t *buf)
 	     | ((uint32_t) buf[3]);
 }
 
+void lha_encode_uint16(uint8_t *buf, uint16_t value)
+{
+	buf[0] = (uint8_t) (value & 0xff);
+	buf[1] = (uint8_t) ((value >> 8) & 0xff);
+}
+
+void lha_encode_uint32(uint8_t *buf, uint32_t value)
+{
+	lha_encode_uint16(buf, (uint16_t) (value & 0xffff));
+	lha_encode_uint16(buf + 2, (uint16_t) (value >> 16));
+}
+
+void lha_encode_uint64(uint8_t *buf, uint64_t value)
+{
+	lha_encode_uint32(buf, (uint32_t) (value & 0xffffffff));
+	lha_encode_uint32(buf + 4, (uint32_t) (value >> 32));
+}
+
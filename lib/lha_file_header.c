@@ -51,6 +51,14 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 // Length of a level 0 OS-9 extended area.
 #define LEVEL_0_OS9_EXTENDED_LEN 22 /* bytes */
 
+// Which extended headers decode_extended_headers() should decode:
+// all of them; all except those whose decoding can be deferred (when
+// scanning); or only those that were deferred.
+
+#define EXT_HEADERS_ALL   0
+#define EXT_HEADERS_SCAN  1
+#define EXT_HEADERS_LAZY  2
+
 #define RAW_DATA(hdr_ptr, off)  ((*hdr_ptr)->raw_data[off])
 #define RAW_DATA_LEN(hdr_ptr)   ((*hdr_ptr)->raw_data_len)
 
@@ -102,12 +110,14 @@ static int split_header_filename(LHAFileHeader *header)
 	sep = strrchr(header->filename, '/');
 
 	if (sep != NULL) {
-		new_filename = strdup(sep + 1);
+		new_filename = lha_file_header_alloc(header, strlen(sep + 1) + 1);
 
 		if (new_filename == NULL) {
 			return 0;
 		}
 
+		strcpy(new_filename, sep + 1);
+
 		*(sep + 1) = '\0';
 		header->path = header->filename;
 		header->filename = new_filename;
@@ -280,20 +290,22 @@ static int parse_symlink(LHAFileHeader *header)
 		return 0;
 	}
 
-	header->symlink_target = strdup(p + 1);
+	header->symlink_target = lha_file_header_alloc(header, strlen(p + 1) + 1);
 
 	if (header->symlink_target == NULL) {
 		free(fullpath);
 		return 0;
 	}
 
+	strcpy(header->symlink_target, p + 1);
+
 	// Cut the string in half at the separator. Keep the left side
 	// as the value for filename.
 
 	*p = '\0';
 
-	free(header->path);
-	free(header->filename);
+	lha_file_header_release(header, header->path);
+	lha_file_header_release(header, header->filename);
 	header->path = NULL;
 	header->filename = fullpath;
 
@@ -320,7 +332,7 @@ static int process_level0_path(LHAFileHeader *header, uint8_t *data,
 		return 1;
 	}
 
-	header->filename = malloc(data_len + 1);
+	header->filename = lha_file_header_alloc(header, data_len + 1);
 
 	if (header->filename == NULL) {
 		return 0;
@@ -340,6 +352,31 @@ static int process_level0_path(LHAFileHeader *header, uint8_t *data,
 	return split_header_filename(header);
 }
 
+// Move the raw_data array of a header allocated from an arena into a
+// larger, separately allocated buffer. The header itself cannot be
+// reallocated as it lives inside an arena chunk.
+
+static int move_raw_data(LHAFileHeader *header, size_t new_raw_len)
+{
+	uint8_t *new_raw_data;
+
+	new_raw_data = lha_file_header_alloc(header, new_raw_len);
+
+	if (new_raw_data == NULL) {
+		return 0;
+	}
+
+	memcpy(new_raw_data, header->raw_data, header->raw_data_len);
+
+	if (header->raw_data != (uint8_t *) (header + 1)) {
+		lha_file_header_release(header, header->raw_data);
+	}
+
+	header->raw_data = new_raw_data;
+
+	return 1;
+}
+
 // Read some more data from the input stream, extending the raw_data
 // array (and the size of the header).
 
@@ -355,19 +392,31 @@ static uint8_t *extend_raw_data(LHAFileHeader **header,
 		return NULL;
 	}
 
-	// Reallocate the header and raw_data area to be larger.
-
 	new_raw_len = RAW_DATA_LEN(header) + nbytes;
-	new_header = realloc(*header, sizeof(LHAFileHeader) + new_raw_len);
 
-	if (new_header == NULL) {
-		return NULL;
-	}
+	if ((*header)->_arena != NULL) {
+		if (!move_raw_data(*header, new_raw_len)) {
+			return NULL;
+		}
+
+		new_header = *header;
+	} else {
+
+		// Reallocate the header and raw_data area to be larger.
 
-	// Update the header pointer to point to the new area.
+		new_header = realloc(*header,
+		                     sizeof(LHAFileHeader) + new_raw_len);
+
+		if (new_header == NULL) {
+			return NULL;
+		}
+
+		// Update the header pointer to point to the new area.
+
+		*header = new_header;
+		new_header->raw_data = (uint8_t *) (new_header + 1);
+	}
 
-	*header = new_header;
-	new_header->raw_data = (uint8_t *) (new_header + 1);
 	result = new_header->raw_data + new_header->raw_data_len;
 
 	// Read data from stream into new area.
@@ -382,12 +431,16 @@ static uint8_t *extend_raw_data(LHAFileHeader **header,
 }
 
 // Starting at the specified offset in the raw_data array, walk
-// through the list of extended headers and parse them.
+// through the list of extended headers and parse them. If any headers
+// are left for later, the offset is saved so that they can be decoded
+// by lha_file_header_decode_lazy().
 
 static int decode_extended_headers(LHAFileHeader **header,
-                                   unsigned int offset)
+                                   unsigned int offset, int which)
 {
+	unsigned int start;
 	unsigned int field_size;
+	int lazy;
 	uint8_t *ext_header;
 	size_t ext_header_len;
 	size_t available_length;
@@ -402,6 +455,7 @@ static int decode_extended_headers(LHAFileHeader **header,
 	}
 
 	available_length = RAW_DATA_LEN(header) - offset - field_size;
+	start = offset;
 
 	while (offset <= RAW_DATA_LEN(header) - field_size) {
 		ext_header = &RAW_DATA(header, offset + field_size);
@@ -426,8 +480,15 @@ static int decode_extended_headers(LHAFileHeader **header,
 
 		// Process header:
 
-		lha_ext_header_decode(*header, ext_header[0], ext_header + 1,
-		                      ext_header_len - field_size - 1);
+		lazy = lha_ext_header_is_lazy(ext_header[0]);
+
+		if (which == EXT_HEADERS_SCAN && lazy) {
+			(*header)->_lazy_offset = start;
+		} else if (which != EXT_HEADERS_LAZY || lazy) {
+			lha_ext_header_decode(*header, ext_header[0],
+			                      ext_header + 1,
+			                      ext_header_len - field_size - 1);
+		}
 
 		// Advance to next header.
 
@@ -695,7 +756,8 @@ static int decode_level0_header(LHAFileHeader **header, LHAInputStream *stream)
 	return 1;
 }
 
-static int decode_level1_header(LHAFileHeader **header, LHAInputStream *stream)
+static int decode_level1_header(LHAFileHeader **header,
+                                LHAInputStream *stream, int which)
 {
 	unsigned int ext_header_start;
 
@@ -708,14 +770,15 @@ static int decode_level1_header(LHAFileHeader **header, LHAInputStream *stream)
 	ext_header_start = RAW_DATA_LEN(header) - 2;
 
 	if (!read_l1_extended_headers(header, stream)
-	 || !decode_extended_headers(header, ext_header_start)) {
+	 || !decode_extended_headers(header, ext_header_start, which)) {
 		return 0;
 	}
 
 	return 1;
 }
 
-static int decode_level2_header(LHAFileHeader **header, LHAInputStream *stream)
+static int decode_level2_header(LHAFileHeader **header,
+                                LHAInputStream *stream, int which)
 {
 	unsigned int header_len;
 
@@ -766,14 +829,15 @@ static int decode_level2_header(LHAFileHeader **header, LHAInputStream *stream)
 		}
 	}
 
-	if (!decode_extended_headers(header, 24)) {
+	if (!decode_extended_headers(header, 24, which)) {
 		return 0;
 	}
 
 	return 1;
 }
 
-static int decode_level3_header(LHAFileHeader **header, LHAInputStream *stream)
+static int decode_level3_header(LHAFileHeader **header,
+                                LHAInputStream *stream, int which)
 {
 	unsigned int header_len;
 
@@ -833,7 +897,7 @@ static int decode_level3_header(LHAFileHeader **header, LHAInputStream *stream)
 
 	(*header)->os_type = RAW_DATA(header, 23);
 
-	if (!decode_extended_headers(header, 28)) {
+	if (!decode_extended_headers(header, 28, which)) {
 		return 0;
 	}
 
@@ -915,9 +979,12 @@ static void collapse_path(char *filename)
 	*w = '\0';
 }
 
-LHAFileHeader *lha_file_header_read(LHAInputStream *stream)
+LHAFileHeader *lha_file_header_read(LHAInputStream *stream,
+                                    LHAArena *arena, int scan)
 {
+	LHAArenaChunk *chunk;
 	LHAFileHeader *header;
+	int which;
 	int success;
 
 	// We cannot decode the file header until we identify the
@@ -928,17 +995,31 @@ LHAFileHeader *lha_file_header_read(LHAInputStream *stream)
 	// reads one byte more, so that we get the filename length
 	// byte for level 1 headers as well).
 
-	// Allocate result structure.
+	// Allocate result structure. If there is an arena, the header and
+	// its strings are allocated from it until the header has been
+	// read; the header then holds a reference to the arena chunk.
 
-	header = calloc(1, sizeof(LHAFileHeader) + COMMON_HEADER_LEN);
+	chunk = NULL;
+	header = NULL;
+
+	if (arena != NULL) {
+		header = lha_arena_alloc(arena, &chunk,
+		                         sizeof(LHAFileHeader) + COMMON_HEADER_LEN);
+	}
 
 	if (header == NULL) {
-		return NULL;
+		header = malloc(sizeof(LHAFileHeader) + COMMON_HEADER_LEN);
+
+		if (header == NULL) {
+			return NULL;
+		}
 	}
 
 	memset(header, 0, sizeof(LHAFileHeader));
 
 	header->_refcount = 1;
+	header->_arena = arena;
+	header->_chunk = chunk;
 
 	// Read first chunk of header.
 
@@ -955,21 +1036,27 @@ LHAFileHeader *lha_file_header_read(LHAInputStream *stream)
 
 	header->header_level = header->raw_data[20];
 
+	if (scan) {
+		which = EXT_HEADERS_SCAN;
+	} else {
+		which = EXT_HEADERS_ALL;
+	}
+
 	switch (header->header_level) {
 		case 0:
 			success = decode_level0_header(&header, stream);
 			break;
 
 		case 1:
-			success = decode_level1_header(&header, stream);
+			success = decode_level1_header(&header, stream, which);
 			break;
 
 		case 2:
-			success = decode_level2_header(&header, stream);
+			success = decode_level2_header(&header, stream, which);
 			break;
 
 		case 3:
-			success = decode_level3_header(&header, stream);
+			success = decode_level3_header(&header, stream, which);
 			break;
 
 		default:
@@ -1044,14 +1131,216 @@ LHAFileHeader *lha_file_header_read(LHAInputStream *stream)
 		goto fail;
 	}
 
+	header->_arena = NULL;
+
 	return header;
 fail:
 	lha_file_header_free(header);
 	return NULL;
 }
 
+// Add an extended header to a level 2 header that is being written.
+// The length of each extended header is stored in the two bytes before
+// it, which are the last two bytes of the previous header.
+
+static uint8_t *write_ext_header(uint8_t *p, uint8_t num,
+                                 const void *data, size_t data_len)
+{
+	lha_encode_uint16(p, (uint16_t) (data_len + 3));
+	p[2] = num;
+	memcpy(p + 3, data, data_len);
+
+	return p + 3 + data_len;
+}
+
+uint8_t *lha_file_header_write(LHAFileHeader *header, size_t *header_len)
+{
+	uint8_t ext_data[24];
+	uint8_t *result, *p;
+	char *fullpath, *new_path, *filename;
+	size_t len, path_len, filename_len;
+	uint16_t crc;
+	unsigned int unix_perms;
+	unsigned int i;
+
+	if ((uint64_t) header->length > UINT32_MAX
+	 || (uint64_t) header->compressed_length > UINT32_MAX) {
+		return NULL;
+	}
+
+	// Symbolic links are stored as "path/name|target", and the whole
+	// string is split at the last path separator, as LHA does.
+
+	fullpath = lha_file_header_full_path(header);
+
+	if (fullpath != NULL && header->symlink_target != NULL) {
+		new_path = realloc(fullpath, strlen(fullpath)
+		                   + strlen(header->symlink_target) + 2);
+
+		if (new_path == NULL) {
+			free(fullpath);
+			return NULL;
+		}
+
+		fullpath = new_path;
+		strcat(fullpath, "|");
+		strcat(fullpath, header->symlink_target);
+	}
+
+	if (fullpath == NULL) {
+		return NULL;
+	}
+
+	filename = strrchr(fullpath, '/');
+	filename = filename != NULL ? filename + 1 : fullpath;
+	path_len = (size_t) (filename - fullpath);
+	filename_len = strlen(filename);
+
+	// Work out the length of the header: the base header, the common
+	// header and any others that are needed, and the terminating
+	// zero length.
+
+	len = LEVEL_2_HEADER_LEN + 5;
+
+	if (filename_len > 0) {
+		len += filename_len + 3;
+	}
+	if (path_len > 0) {
+		len += path_len + 3;
+	}
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_WINDOWS_TIMESTAMPS)) {
+		len += 24 + 3;
+	}
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_PERMS)
+	 || header->symlink_target != NULL) {
+		len += 2 + 3;
+	}
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_UID_GID)) {
+		len += 4 + 3;
+	}
+	if (header->unix_group != NULL) {
+		len += strlen(header->unix_group) + 3;
+	}
+	if (header->unix_username != NULL) {
+		len += strlen(header->unix_username) + 3;
+	}
+
+	// A header can't start with a zero byte, as that marks the end of
+	// the archive, so pad the header if the low byte of the length
+	// would be zero.
+
+	if ((len & 0xff) == 0) {
+		++len;
+	}
+
+	if (len > 0xffff) {
+		free(fullpath);
+		return NULL;
+	}
+
+	result = calloc(1, len);
+
+	if (result == NULL) {
+		free(fullpath);
+		return NULL;
+	}
+
+	lha_encode_uint16(result, (uint16_t) len);
+	memcpy(result + 2, header->compress_method, 5);
+	lha_encode_uint32(result + 7, (uint32_t) header->compressed_length);
+	lha_encode_uint32(result + 11, (uint32_t) header->length);
+	lha_encode_uint32(result + 15, header->timestamp);
+	result[19] = 0x20;
+	result[20] = 2;
+	lha_encode_uint16(result + 21, header->crc);
+	result[23] = header->os_type;
+
+	// The common header holds the CRC of the whole header, which is
+	// filled in last.
+
+	p = write_ext_header(result + 24, LHA_EXT_HEADER_COMMON, "\0\0", 2);
+
+	if (filename_len > 0) {
+		p = write_ext_header(p, LHA_EXT_HEADER_FILENAME,
+		                     filename, filename_len);
+	}
+
+	if (path_len > 0) {
+		for (i = 0; i < path_len; ++i) {
+			if (fullpath[i] == '/') {
+				fullpath[i] = (char) 0xff;
+			}
+		}
+
+		p = write_ext_header(p, LHA_EXT_HEADER_PATH,
+		                     fullpath, path_len);
+	}
+
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_WINDOWS_TIMESTAMPS)) {
+		lha_encode_uint64(ext_data, header->win_creation_time);
+		lha_encode_uint64(ext_data + 8, header->win_modification_time);
+		lha_encode_uint64(ext_data + 16, header->win_access_time);
+		p = write_ext_header(p, LHA_EXT_HEADER_WINDOWS_TIMESTAMPS,
+		                     ext_data, 24);
+	}
+
+	// Symbolic links are only recognised by their Unix permissions,
+	// so these are always written for them.
+
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_PERMS)
+	 || header->symlink_target != NULL) {
+		unix_perms = header->unix_perms;
+
+		if (header->symlink_target != NULL) {
+			if (!LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_PERMS)) {
+				unix_perms = 0777;
+			}
+
+			unix_perms = (unix_perms & 07777) | 0120000;
+		}
+
+		lha_encode_uint16(ext_data, (uint16_t) unix_perms);
+		p = write_ext_header(p, LHA_EXT_HEADER_UNIX_PERMISSION,
+		                     ext_data, 2);
+	}
+
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_UID_GID)) {
+		lha_encode_uint16(ext_data, (uint16_t) header->unix_gid);
+		lha_encode_uint16(ext_data + 2, (uint16_t) header->unix_uid);
+		p = write_ext_header(p, LHA_EXT_HEADER_UNIX_UID_GID,
+		                     ext_data, 4);
+	}
+
+	if (header->unix_group != NULL) {
+		p = write_ext_header(p, LHA_EXT_HEADER_UNIX_GROUP,
+		                     header->unix_group,
+		                     strlen(header->unix_group));
+	}
+
+	if (header->unix_username != NULL) {
+		p = write_ext_header(p, LHA_EXT_HEADER_UNIX_USER,
+		                     header->unix_username,
+		                     strlen(header->unix_username));
+	}
+
+	free(fullpath);
+
+	// The rest of the header (the terminating zero length, and any
+	// padding) is already zero.
+
+	crc = 0;
+	lha_crc16_buf(&crc, result, len);
+	lha_encode_uint16(result + 27, crc);
+
+	*header_len = len;
+
+	return result;
+}
+
 void lha_file_header_free(LHAFileHeader *header)
 {
+	LHAArenaChunk *chunk;
+
 	// Sanity check:
 
 	if (header->_refcount == 0) {
@@ -1066,12 +1355,84 @@ void lha_file_header_free(LHAFileHeader *header)
 		return;
 	}
 
-	free(header->filename);
-	free(header->path);
-	free(header->symlink_target);
-	free(header->unix_username);
-	free(header->unix_group);
-	free(header);
+	lha_file_header_release(header, header->filename);
+	lha_file_header_release(header, header->path);
+	lha_file_header_release(header, header->symlink_target);
+	lha_file_header_release(header, header->unix_username);
+	lha_file_header_release(header, header->unix_group);
+
+	if (header->raw_data != (uint8_t *) (header + 1)) {
+		lha_file_header_release(header, header->raw_data);
+	}
+
+	// The header may itself be in the arena chunk, so drop the
+	// reference to the chunk last.
+
+	chunk = header->_chunk;
+	lha_file_header_release(header, header);
+
+	if (chunk != NULL) {
+		lha_arena_chunk_release(chunk);
+	}
+}
+
+int lha_file_header_decode_lazy(LHAFileHeader *header)
+{
+	unsigned int offset;
+	unsigned int os9_perms;
+	int have_os9_perms;
+
+	if (header->_lazy_offset == 0) {
+		return 1;
+	}
+
+	offset = header->_lazy_offset;
+	header->_lazy_offset = 0;
+
+	// OS-9 permissions that were already found take priority over an
+	// OS-9 extended header, as they do when all headers are decoded
+	// together (see lha_file_header_read).
+
+	have_os9_perms = LHA_FILE_HAVE_EXTRA(header, LHA_FILE_OS9_PERMS);
+	os9_perms = header->os9_perms;
+
+	if (!decode_extended_headers(&header, offset, EXT_HEADERS_LAZY)) {
+		return 0;
+	}
+
+	if (have_os9_perms) {
+		header->os9_perms = os9_perms;
+	} else if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_OS9_PERMS)) {
+		os9_to_unix_permissions(header);
+	}
+
+	return 1;
+}
+
+void *lha_file_header_alloc(LHAFileHeader *header, size_t size)
+{
+	LHAArenaChunk *chunk;
+	void *result;
+
+	if (header->_arena != NULL) {
+		chunk = header->_chunk;
+		result = lha_arena_alloc(header->_arena, &chunk, size);
+		header->_chunk = chunk;
+
+		if (result != NULL) {
+			return result;
+		}
+	}
+
+	return malloc(size);
+}
+
+void lha_file_header_release(LHAFileHeader *header, void *ptr)
+{
+	if (header->_chunk == NULL
+	 || !lha_arena_chunk_contains(header->_chunk, ptr)) {
+		free(ptr);
+	}
 }
 
 void lha_file_header_add_ref(LHAFileHeader *header)
@@ -24,17 +24,57 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #include "public/lha_file_header.h"
 #include "lha_input_stream.h"
+#include "lha_arena.h"
 
 /**
  * Read a file header from the input stream.
  *
  * @param stream         The input stream to read from.
+ * @param arena          Arena to allocate the header and its strings
+ *                       from, or NULL to allocate them with malloc().
+ * @param scan           If non-zero, only decode the information needed
+ *                       to identify the file and skip over it; see
+ *                       @ref lha_file_header_decode_lazy.
  * @return               Pointer to a new LHAFileHeader structure, or NULL
  *                       if an error occurred or a valid header could not
  *                       be read.
  */
 
-LHAFileHeader *lha_file_header_read(LHAInputStream *stream);
+LHAFileHeader *lha_file_header_read(LHAInputStream *stream,
+                                    LHAArena *arena, int scan);
+
+/**
+ * Finish decoding a file header that was read in scan mode. Extended
+ * headers that aren't needed to identify the file (user and group
+ * names, Windows timestamps and OS-9 permissions) are only decoded
+ * when this is called. It does nothing if the header is already fully
+ * decoded.
+ *
+ * @param header         The file header.
+ * @return               Non-zero for success, or zero for failure.
+ */
+
+int lha_file_header_decode_lazy(LHAFileHeader *header);
+
+/**
+ * Encode a file header as a level 2 header, in the form read by
+ * @ref lha_file_header_read. The compression method, lengths, CRC,
+ * timestamp and OS type are written, along with the path, filename and
+ * symbolic link target, and any of the Unix and Windows extra data
+ * that is present. Symbolic links are always given Unix permissions,
+ * as that is how they are recognised when the header is read. The
+ * header_level and raw_data fields of the header are not used.
+ *
+ * @param header         The file header.
+ * @param header_len     Pointer to a variable in which to store the
+ *                       length of the encoded header.
+ * @return               Pointer to the encoded header, allocated with
+ *                       malloc(), or NULL if the header could not be
+ *                       represented as a level 2 header or memory
+ *                       could not be allocated.
+ */
+
+uint8_t *lha_file_header_write(LHAFileHeader *header, size_t *header_len);
 
 /**
  * Free a file header structure.
@@ -53,6 +93,28 @@ void lha_file_header_free(LHAFileHeader *header);
 
 void lha_file_header_add_ref(LHAFileHeader *header);
 
+/**
+ * Allocate memory for a string or other data belonging to a file
+ * header that is being read. The memory comes from the header's arena
+ * if it has one.
+ *
+ * @param header         The file header.
+ * @param size           Number of bytes to allocate.
+ * @return               Pointer to the memory, or NULL for failure.
+ */
+
+void *lha_file_header_alloc(LHAFileHeader *header, size_t size);
+
+/**
+ * Release memory allocated with @ref lha_file_header_alloc (or with
+ * malloc()) that belongs to a file header.
+ *
+ * @param header         The file header.
+ * @param ptr            Pointer to the memory, may be NULL.
+ */
+
+void lha_file_header_release(LHAFileHeader *header, void *ptr);
+
 /**
  * Get the full path for the given file header.
  *
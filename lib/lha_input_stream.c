@@ -26,15 +26,28 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #include "lha_arch.h"
 #include "lha_input_stream.h"
+#include "lha_work_queue.h"
 
 // Maximum length of the self-extractor header.
 // If we don't find an LHA file header after this many bytes, give up.
 
 #define MAX_SFX_HEADER_LEN 65536
 
-// Size of the lead-in buffer used to skip the self-extractor.
+// Size of the lead-in buffer used to skip the self-extractor. The
+// stream is read into the buffer in large blocks, which are then
+// searched for a file header.
 
-#define LEADIN_BUFFER_LEN 24
+#define LEADIN_BUFFER_LEN 4096
+
+// Number of bytes that must be in the lead-in buffer after a possible
+// start of a file header (or Amiga self-extractor ID) for it to be
+// checked.
+
+#define LEADIN_MATCH_LEN 13
+
+// Largest buffer used to skip over data in a stream that can't seek.
+
+#define SKIP_BUFFER_LEN (64 * 1024)
 
 // Magic string to detect an Amiga LhASFX self-extracting file.
 // This type of self-extractor is special because the program itself
@@ -54,7 +67,12 @@ struct _LHAInputStream {
 	void *handle;
 	LHAInputStreamState state;
 	uint8_t leadin[LEADIN_BUFFER_LEN];
-	size_t leadin_len;
+	size_t leadin_start, leadin_len;
+
+	// Offset within the underlying file of the next byte to be read
+	// from the source (ie. after the contents of the lead-in buffer).
+
+	size_t position;
 };
 
 LHAInputStream *lha_input_stream_new(const LHAInputStreamType *type,
@@ -123,16 +141,51 @@ static int file_header_match(uint8_t *buf)
 
 static void empty_leadin(LHAInputStream *stream, size_t bytes)
 {
-	memmove(stream->leadin, stream->leadin + bytes,
-	        stream->leadin_len - bytes);
+	stream->leadin_start += bytes;
 	stream->leadin_len -= bytes;
+
+	if (stream->leadin_len == 0) {
+		stream->leadin_start = 0;
+	}
 }
 
 // Read bytes from the input stream into the specified buffer.
 
 static int do_read(LHAInputStream *stream, void *buf, size_t buf_len)
 {
-	return stream->type->read(stream->handle, buf, buf_len);
+	int result;
+
+	result = stream->type->read(stream->handle, buf, buf_len);
+
+	if (result > 0) {
+		stream->position += (size_t) result;
+	}
+
+	return result;
+}
+
+// Look for an Amiga self-extractor ID in the lead-in buffer, in the
+// range of offsets from 'start' up to (but not including) 'end'.
+
+static int find_amiga_sfx(uint8_t *buf, size_t start, size_t end)
+{
+	uint8_t *p;
+
+	while (start < end) {
+		p = memchr(buf + start, AMIGA_LHASFX_ID[0], end - start);
+
+		if (p == NULL) {
+			break;
+		}
+
+		if (!memcmp(p, AMIGA_LHASFX_ID, strlen(AMIGA_LHASFX_ID))) {
+			return 1;
+		}
+
+		start = (size_t) (p - buf) + 1;
+	}
+
+	return 0;
 }
 
 // Skip the self-extractor header at the start of the file.
@@ -140,19 +193,21 @@ static int do_read(LHAInputStream *stream, void *buf, size_t buf_len)
 
 static int skip_sfx(LHAInputStream *stream)
 {
+	uint8_t *buf, *dash;
 	size_t filepos;
-	unsigned int i;
+	size_t i, limit, candidate;
 	int skip_files;
 	int read;
 
 	filepos = 0;
 	skip_files = 0;
+	buf = stream->leadin;
 
 	while (filepos < MAX_SFX_HEADER_LEN) {
 
 		// Add some more bytes to the lead-in buffer:
 
-		read = do_read(stream, stream->leadin + stream->leadin_len,
+		read = do_read(stream, buf + stream->leadin_len,
 		               LEADIN_BUFFER_LEN - stream->leadin_len);
 
 		if (read <= 0) {
@@ -161,40 +216,69 @@ static int skip_sfx(LHAInputStream *stream)
 
 		stream->leadin_len += (unsigned int) read;
 
-		// Check the lead-in buffer for a file header.
+		if (stream->leadin_len < LEADIN_MATCH_LEN) {
+			continue;
+		}
 
-		for (i = 0; i + 12 < stream->leadin_len; ++i) {
-			if (file_header_match(stream->leadin + i)) {
-				if (skip_files == 0) {
-					empty_leadin(stream, i);
-					return 1;
-				} else {
-					--skip_files;
-				}
+		// Check the lead-in buffer for a file header. Rather than
+		// checking every offset, search for the '-' that begins the
+		// compression method at offset 2 of a header.
+
+		limit = stream->leadin_len - LEADIN_MATCH_LEN + 1;
+
+		if (limit > MAX_SFX_HEADER_LEN - filepos) {
+			limit = MAX_SFX_HEADER_LEN - filepos;
+		}
+
+		for (i = 0; i < limit; i = candidate + 1) {
+			dash = memchr(buf + i + 2, '-', limit - i);
+
+			if (dash != NULL) {
+				candidate = (size_t) (dash - buf) - 2;
+			} else {
+				candidate = limit;
 			}
 
 			// Detect Amiga self-extractor.
 
-			if (!memcmp(stream->leadin + i, AMIGA_LHASFX_ID,
-			            strlen(AMIGA_LHASFX_ID))) {
+			if (find_amiga_sfx(buf, i, candidate)) {
 				skip_files = 1;
 			}
+
+			if (candidate >= limit) {
+				break;
+			}
+
+			if (file_header_match(buf + candidate)) {
+				if (skip_files == 0) {
+					stream->leadin_start = candidate;
+					stream->leadin_len -= candidate;
+					return 1;
+				} else {
+					--skip_files;
+				}
+			}
 		}
 
-		empty_leadin(stream, i);
-		filepos += i;
+		// Discard the bytes that have been checked, keeping the rest
+		// at the start of the buffer.
+
+		stream->leadin_len -= limit;
+		memmove(buf, buf + limit, stream->leadin_len);
+		filepos += limit;
 	}
 
+	stream->leadin_len = 0;
+
 	return 0;
 }
 
-int lha_input_stream_read(LHAInputStream *stream, void *buf, size_t buf_len)
-{
-	size_t total_bytes, n;
-	int result;
-
-	// Start of the stream?  Skip self-extract header, if there is one.
+// Prepare the stream for reading. At the start of the stream, the
+// self-extract header is skipped, if there is one. Returns non-zero
+// if data can be read from the stream.
 
+static int start_stream(LHAInputStream *stream)
+{
 	if (stream->state == LHA_INPUT_STREAM_INIT) {
 		if (skip_sfx(stream)) {
 			stream->state = LHA_INPUT_STREAM_READING;
@@ -203,7 +287,16 @@ int lha_input_stream_read(LHAInputStream *stream, void *buf, size_t buf_len)
 		}
 	}
 
-	if (stream->state == LHA_INPUT_STREAM_FAIL) {
+	return stream->state != LHA_INPUT_STREAM_FAIL;
+}
+
+size_t lha_input_stream_read_partial(LHAInputStream *stream,
+                                     void *buf, size_t buf_len)
+{
+	size_t total_bytes, n;
+	int result;
+
+	if (!start_stream(stream)) {
 		return 0;
 	}
 
@@ -218,61 +311,105 @@ int lha_input_stream_read(LHAInputStream *stream, void *buf, size_t buf_len)
 			n = stream->leadin_len;
 		}
 
-		memcpy(buf, stream->leadin, n);
+		memcpy(buf, stream->leadin + stream->leadin_start, n);
 		empty_leadin(stream, n);
 		total_bytes += n;
 	}
 
-	// Read from the input stream.
+	// Read from the input stream. The read function may return less
+	// than was asked for, so keep reading until the buffer is full or
+	// no more data is available.
 
-	if (total_bytes < buf_len) {
+	while (total_bytes < buf_len) {
 		result = do_read(stream, (uint8_t *) buf + total_bytes,
 		                 buf_len - total_bytes);
 
-		if (result > 0) {
-			total_bytes += (unsigned int) result;
+		if (result <= 0) {
+			break;
 		}
+
+		total_bytes += (unsigned int) result;
 	}
 
+	return total_bytes;
+}
+
+int lha_input_stream_read(LHAInputStream *stream, void *buf, size_t buf_len)
+{
 	// Only successful if the complete buffer is filled.
 
-	return total_bytes == buf_len;
+	return lha_input_stream_read_partial(stream, buf, buf_len) == buf_len;
 }
 
-int lha_input_stream_skip(LHAInputStream *stream, size_t bytes)
+// Skip over data from a source that can't seek, by reading it into a
+// buffer and throwing it away. A large buffer is used, to keep the
+// number of reads down when skipping over large files.
+
+static int discard_bytes(int (*read)(void *handle, void *buf, size_t buf_len),
+                         void *handle, size_t bytes)
 {
-	// If we have a dedicated skip function, use it; otherwise,
-	// the read function can be used to perform a skip.
+	uint8_t small_buf[64];
+	uint8_t *buf;
+	size_t buf_len, len;
+	int result;
 
-	if (stream->type->skip != NULL) {
-		return stream->type->skip(stream->handle, bytes);
-	} else {
-		uint8_t data[32];
-		unsigned int len;
-		int result;
+	buf_len = bytes < SKIP_BUFFER_LEN ? bytes : SKIP_BUFFER_LEN;
+	buf = malloc(buf_len);
 
-		while (bytes > 0) {
+	// Still work if the buffer can't be allocated, just more slowly.
 
-			// Read as many bytes left as possible to fit in
-			// the buffer:
+	if (buf == NULL) {
+		buf = small_buf;
+		buf_len = sizeof(small_buf);
+	}
 
-			if (bytes > sizeof(data)) {
-				len = sizeof(data);
-			} else {
-				len = bytes;
-			}
+	while (bytes > 0) {
+		len = bytes < buf_len ? bytes : buf_len;
+		result = read(handle, buf, len);
 
-			result = do_read(stream, data, len);
+		if (result <= 0) {
+			break;
+		}
 
-			if (result < 0) {
-				return 0;
-			}
+		bytes -= (size_t) result;
+	}
 
-			bytes -= (unsigned int) result;
-		}
+	if (buf != small_buf) {
+		free(buf);
+	}
 
-		return 1;
+	return bytes == 0;
+}
+
+int lha_input_stream_skip(LHAInputStream *stream, size_t bytes)
+{
+	size_t n;
+	int result;
+
+	// Any bytes in the lead-in buffer come first.
+
+	if (stream->leadin_len > 0) {
+		n = bytes < stream->leadin_len ? bytes : stream->leadin_len;
+		empty_leadin(stream, n);
+		bytes -= n;
+	}
+
+	// If we have a dedicated skip function, use it; otherwise,
+	// the read function can be used to perform a skip.
+
+	if (stream->type->skip != NULL) {
+		result = stream->type->skip(stream->handle, bytes);
+	} else {
+		result = discard_bytes(stream->type->read, stream->handle, bytes);
 	}
+
+	if (!result) {
+		return 0;
+	}
+
+	stream->position += bytes;
+
+	return 1;
 }
 
 // Read data from a FILE * source.
@@ -299,27 +436,7 @@ static int file_source_read(void *handle, void *buf, size_t buf_len)
 
 static int file_source_skip_fallback(FILE *handle, size_t bytes)
 {
-	uint8_t data[32];
-	unsigned int len;
-	int result;
-
-	while (bytes > 0) {
-		if (bytes > sizeof(data)) {
-			len = sizeof(data);
-		} else {
-			len = bytes;
-		}
-
-		result = fread(data, 1, len, handle);
-
-		if (result != (int) len) {
-			return 0;
-		}
-
-		bytes -= len;
-	}
-
-	return 1;
+	return discard_bytes(file_source_read, handle, bytes);
 }
 
 // Seek forward in a FILE * input stream.
@@ -375,18 +492,160 @@ static const LHAInputStreamType file_source_unowned = {
 	NULL
 };
 
+// Create a new stdio input stream, starting from the current position
+// of the specified FILE.
+
+static LHAInputStream *file_stream_new(FILE *fstream,
+                                       const LHAInputStreamType *type)
+{
+	LHAInputStream *result;
+	long pos;
+
+	result = lha_input_stream_new(type, fstream);
+
+	if (result != NULL) {
+		pos = ftell(fstream);
+		result->position = pos > 0 ? (size_t) pos : 0;
+	}
+
+	return result;
+}
+
+// Memory-mapped file source. Regular files are mapped into memory
+// where possible, so that data can be read directly from the page
+// cache rather than being copied through stdio buffers.
+
+typedef struct {
+	uint8_t *data;
+	size_t data_len;
+	size_t pos;
+	FILE *fh;
+	int owned;
+} MappedFile;
+
+static int mapped_source_read(void *handle, void *buf, size_t buf_len)
+{
+	MappedFile *mapped = handle;
+	size_t n;
+
+	n = mapped->data_len - mapped->pos;
+
+	if (buf_len < n) {
+		n = buf_len;
+	}
+
+	memcpy(buf, mapped->data + mapped->pos, n);
+	mapped->pos += n;
+
+	return (int) n;
+}
+
+static int mapped_source_skip(void *handle, size_t bytes)
+{
+	MappedFile *mapped = handle;
+
+	if (bytes > mapped->data_len - mapped->pos) {
+		mapped->pos = mapped->data_len;
+		return 0;
+	}
+
+	mapped->pos += bytes;
+
+	return 1;
+}
+
+static void mapped_source_close(void *handle)
+{
+	MappedFile *mapped = handle;
+
+	lha_arch_unmap_file(mapped->data, mapped->data_len);
+
+	// If the FILE belongs to the calling code, leave it positioned
+	// after the data that was read, as though it had been read using
+	// stdio.
+
+	if (mapped->owned) {
+		fclose(mapped->fh);
+	} else {
+		fseek(mapped->fh, (long) mapped->pos, SEEK_SET);
+	}
+
+	free(mapped);
+}
+
+static const LHAInputStreamType mapped_source = {
+	mapped_source_read,
+	mapped_source_skip,
+	mapped_source_close
+};
+
+// Try to create a memory-mapped input stream for the specified FILE.
+// Returns NULL if the file cannot be mapped (for example, if it is a
+// pipe), in which case a stdio stream should be used instead.
+
+static LHAInputStream *mapped_stream_new(FILE *fstream, int owned)
+{
+	LHAInputStream *result;
+	MappedFile *mapped;
+	long pos;
+
+	// Reading starts from the current position in the file.
+
+	pos = ftell(fstream);
+
+	if (pos < 0) {
+		return NULL;
+	}
+
+	mapped = malloc(sizeof(MappedFile));
+
+	if (mapped == NULL) {
+		return NULL;
+	}
+
+	mapped->data = lha_arch_map_file(fstream, &mapped->data_len);
+
+	if (mapped->data == NULL || (size_t) pos > mapped->data_len) {
+		if (mapped->data != NULL) {
+			lha_arch_unmap_file(mapped->data, mapped->data_len);
+		}
+		free(mapped);
+		return NULL;
+	}
+
+	mapped->pos = (size_t) pos;
+	mapped->fh = fstream;
+	mapped->owned = owned;
+
+	result = lha_input_stream_new(&mapped_source, mapped);
+
+	if (result == NULL) {
+		lha_arch_unmap_file(mapped->data, mapped->data_len);
+		free(mapped);
+		return NULL;
+	}
+
+	result->position = (size_t) pos;
+
+	return result;
+}
+
 LHAInputStream *lha_input_stream_from(char *filename)
 {
 	LHAInputStream *result;
 	FILE *fstream;
 
-	fstream = fopen(filename, "rb");
+	fstream = lha_arch_fopen_read(filename);
 
 	if (fstream == NULL) {
 		return NULL;
 	}
 
-	result = lha_input_stream_new(&file_source_owned, fstream);
+	result = mapped_stream_new(fstream, 1);
+
+	if (result == NULL) {
+		result = file_stream_new(fstream, &file_source_owned);
+	}
 
 	if (result == NULL) {
 		fclose(fstream);
@@ -397,7 +656,1036 @@ LHAInputStream *lha_input_stream_from(char *filename)
 
 LHAInputStream *lha_input_stream_from_FILE(FILE *stream)
 {
+	LHAInputStream *result;
+
 	lha_arch_set_binary(stream);
-	return lha_input_stream_new(&file_source_unowned, stream);
+
+	result = mapped_stream_new(stream, 0);
+
+	if (result == NULL) {
+		result = file_stream_new(stream, &file_source_unowned);
+	}
+
+	return result;
+}
+
+// Range source, used to read part of the same underlying file as
+// another stream. Data is read either from the memory mapping of the
+// original stream, or using positional reads on its FILE, so that
+// reading doesn't disturb the original stream or other range streams.
+
+typedef struct {
+	uint8_t *data;
+	FILE *fh;
+	size_t pos;
+	size_t end;
+} RangeSource;
+
+static int range_source_read(void *handle, void *buf, size_t buf_len)
+{
+	RangeSource *range = handle;
+	size_t n;
+	int result;
+
+	n = range->end - range->pos;
+
+	if (buf_len < n) {
+		n = buf_len;
+	}
+
+	if (range->data != NULL) {
+		memcpy(buf, range->data + range->pos, n);
+		result = (int) n;
+	} else {
+		result = lha_arch_pread(range->fh, buf, n, range->pos);
+	}
+
+	if (result > 0) {
+		range->pos += (size_t) result;
+	}
+
+	return result;
+}
+
+static int range_source_skip(void *handle, size_t bytes)
+{
+	RangeSource *range = handle;
+
+	if (bytes > range->end - range->pos) {
+		range->pos = range->end;
+		return 0;
+	}
+
+	range->pos += bytes;
+
+	return 1;
+}
+
+static void range_source_close(void *handle)
+{
+	free(handle);
 }
 
+static const LHAInputStreamType range_source = {
+	range_source_read,
+	range_source_skip,
+	range_source_close
+};
+
+// Prefetch source. This wraps another source, and reads ahead from it
+// on a background thread into a ring of large blocks, so that waiting
+// for the input overlaps with decompressing the data already read.
+
+#define PREFETCH_BLOCK_SIZE (256 * 1024)
+#define PREFETCH_BLOCKS 4
+
+typedef struct {
+	const LHAInputStreamType *type;
+	void *handle;
+
+	LHAArchThread *thread;
+	LHAArchMutex *lock;
+	LHAArchCond *cond;
+
+	// Ring of blocks. 'count' blocks starting from 'head' hold data
+	// read ahead; 'pos' is the position within the head block.
+
+	uint8_t *blocks[PREFETCH_BLOCKS];
+	size_t block_len[PREFETCH_BLOCKS];
+	unsigned int head, count;
+	size_t pos;
+
+	// Set by the thread when it stops reading, either because the end
+	// of the underlying stream was reached or an error occurred.
+
+	int eof, error;
+
+	// Set to tell the thread to stop.
+
+	int stop;
+} PrefetchSource;
+
+// Fill a block from the underlying source. Returns the number of bytes
+// read; a full block is not read only at the end of the stream, or if
+// an error occurs.
+
+static size_t prefetch_fill(PrefetchSource *prefetch, uint8_t *buf,
+                            int *error)
+{
+	size_t filled;
+	int result;
+
+	filled = 0;
+
+	while (filled < PREFETCH_BLOCK_SIZE) {
+		result = prefetch->type->read(prefetch->handle, buf + filled,
+		                              PREFETCH_BLOCK_SIZE - filled);
+
+		if (result <= 0) {
+			*error = result < 0;
+			break;
+		}
+
+		filled += (size_t) result;
+	}
+
+	return filled;
+}
+
+// Background thread that reads ahead from the underlying source.
+
+static void prefetch_thread(void *data)
+{
+	PrefetchSource *prefetch = data;
+	unsigned int index;
+	size_t len;
+	int error;
+
+	lha_arch_mutex_lock(prefetch->lock);
+
+	for (;;) {
+		while (!prefetch->stop && prefetch->count == PREFETCH_BLOCKS) {
+			lha_arch_cond_wait(prefetch->cond, prefetch->lock);
+		}
+
+		if (prefetch->stop) {
+			break;
+		}
+
+		// The next free block is not touched by the reader until
+		// it has been added to the ring, so it can be filled without
+		// holding the lock.
+
+		index = (prefetch->head + prefetch->count) % PREFETCH_BLOCKS;
+		lha_arch_mutex_unlock(prefetch->lock);
+
+		error = 0;
+		len = prefetch_fill(prefetch, prefetch->blocks[index], &error);
+
+		lha_arch_mutex_lock(prefetch->lock);
+
+		if (len > 0) {
+			prefetch->block_len[index] = len;
+			++prefetch->count;
+		}
+
+		if (len < PREFETCH_BLOCK_SIZE) {
+			prefetch->eof = 1;
+			prefetch->error = error;
+		}
+
+		lha_arch_cond_broadcast(prefetch->cond);
+
+		if (prefetch->eof) {
+			break;
+		}
+	}
+
+	lha_arch_mutex_unlock(prefetch->lock);
+}
+
+// Wait until the head block holds data. Returns zero if the end of the
+// stream has been reached. Must be called with the lock held.
+
+static int prefetch_wait(PrefetchSource *prefetch)
+{
+	while (prefetch->count == 0 && !prefetch->eof) {
+		lha_arch_cond_wait(prefetch->cond, prefetch->lock);
+	}
+
+	return prefetch->count > 0;
+}
+
+// Consume bytes from the head block, releasing it to the thread once
+// it has been emptied. Must be called with the lock held.
+
+static void prefetch_consume(PrefetchSource *prefetch, size_t bytes)
+{
+	prefetch->pos += bytes;
+
+	if (prefetch->pos >= prefetch->block_len[prefetch->head]) {
+		prefetch->head = (prefetch->head + 1) % PREFETCH_BLOCKS;
+		--prefetch->count;
+		prefetch->pos = 0;
+		lha_arch_cond_broadcast(prefetch->cond);
+	}
+}
+
+static int prefetch_source_read(void *handle, void *buf, size_t buf_len)
+{
+	PrefetchSource *prefetch = handle;
+	uint8_t *block;
+	size_t n;
+
+	lha_arch_mutex_lock(prefetch->lock);
+
+	if (!prefetch_wait(prefetch)) {
+		lha_arch_mutex_unlock(prefetch->lock);
+		return prefetch->error ? -1 : 0;
+	}
+
+	block = prefetch->blocks[prefetch->head] + prefetch->pos;
+	n = prefetch->block_len[prefetch->head] - prefetch->pos;
+	lha_arch_mutex_unlock(prefetch->lock);
+
+	// The head block is not reused by the thread until it has been
+	// consumed, so it is safe to copy from it without the lock.
+
+	if (buf_len < n) {
+		n = buf_len;
+	}
+
+	memcpy(buf, block, n);
+
+	lha_arch_mutex_lock(prefetch->lock);
+	prefetch_consume(prefetch, n);
+	lha_arch_mutex_unlock(prefetch->lock);
+
+	return (int) n;
+}
+
+static int prefetch_source_skip(void *handle, size_t bytes)
+{
+	PrefetchSource *prefetch = handle;
+	size_t n;
+
+	lha_arch_mutex_lock(prefetch->lock);
+
+	while (bytes > 0) {
+		if (!prefetch_wait(prefetch)) {
+			break;
+		}
+
+		n = prefetch->block_len[prefetch->head] - prefetch->pos;
+
+		if (bytes < n) {
+			n = bytes;
+		}
+
+		prefetch_consume(prefetch, n);
+		bytes -= n;
+	}
+
+	lha_arch_mutex_unlock(prefetch->lock);
+
+	return bytes == 0;
+}
+
+// Stop the prefetch thread and free the prefetch source, returning the
+// underlying source to its original state (other than for the data
+// that was read ahead).
+
+static void prefetch_free(PrefetchSource *prefetch)
+{
+	unsigned int i;
+
+	if (prefetch->thread != NULL) {
+		lha_arch_mutex_lock(prefetch->lock);
+		prefetch->stop = 1;
+		lha_arch_cond_broadcast(prefetch->cond);
+		lha_arch_mutex_unlock(prefetch->lock);
+
+		lha_arch_thread_join(prefetch->thread);
+	}
+
+	if (prefetch->cond != NULL) {
+		lha_arch_cond_free(prefetch->cond);
+	}
+	if (prefetch->lock != NULL) {
+		lha_arch_mutex_free(prefetch->lock);
+	}
+
+	for (i = 0; i < PREFETCH_BLOCKS; ++i) {
+		free(prefetch->blocks[i]);
+	}
+
+	free(prefetch);
+}
+
+static void prefetch_source_close(void *handle)
+{
+	PrefetchSource *prefetch = handle;
+	const LHAInputStreamType *type;
+	void *inner;
+
+	type = prefetch->type;
+	inner = prefetch->handle;
+
+	prefetch_free(prefetch);
+
+	if (type->close != NULL) {
+		type->close(inner);
+	}
+}
+
+static const LHAInputStreamType prefetch_source = {
+	prefetch_source_read,
+	prefetch_source_skip,
+	prefetch_source_close
+};
+
+int lha_input_stream_prefetch(LHAInputStream *stream)
+{
+	PrefetchSource *prefetch;
+	unsigned int i;
+
+	// Memory-mapped and range streams don't need a thread to read
+	// ahead: reads are served from the page cache, and the range
+	// streams used for decompressing in parallel are each read by a
+	// worker thread of their own.
+
+	if (stream->type == &prefetch_source) {
+		return 1;
+	} else if (stream->type == &mapped_source
+	        || stream->type == &range_source) {
+		return 0;
+	}
+
+	prefetch = calloc(1, sizeof(PrefetchSource));
+
+	if (prefetch == NULL) {
+		return 0;
+	}
+
+	prefetch->type = stream->type;
+	prefetch->handle = stream->handle;
+
+	for (i = 0; i < PREFETCH_BLOCKS; ++i) {
+		prefetch->blocks[i] = malloc(PREFETCH_BLOCK_SIZE);
+
+		if (prefetch->blocks[i] == NULL) {
+			prefetch_free(prefetch);
+			return 0;
+		}
+	}
+
+	prefetch->lock = lha_arch_mutex_new();
+	prefetch->cond = lha_arch_cond_new();
+
+	if (prefetch->lock == NULL || prefetch->cond == NULL) {
+		prefetch_free(prefetch);
+		return 0;
+	}
+
+	prefetch->thread = lha_arch_thread_new(prefetch_thread, prefetch);
+
+	if (prefetch->thread == NULL) {
+		prefetch_free(prefetch);
+		return 0;
+	}
+
+	stream->type = &prefetch_source;
+	stream->handle = prefetch;
+
+	return 1;
+}
+
+LHAInputStream *lha_input_stream_new_range(LHAInputStream *stream,
+                                           size_t offset, size_t length)
+{
+	LHAInputStream *result;
+	const LHAInputStreamType *type;
+	PrefetchSource *prefetch;
+	RangeSource *range, *parent;
+	MappedFile *mapped;
+	void *handle;
+	size_t limit;
+
+	range = malloc(sizeof(RangeSource));
+
+	if (range == NULL) {
+		return NULL;
+	}
+
+	// Work out where to read the data from. Positional reads from a
+	// file can be made even while it is being read ahead.
+
+	type = stream->type;
+	handle = stream->handle;
+
+	if (type == &prefetch_source) {
+		prefetch = handle;
+		type = prefetch->type;
+		handle = prefetch->handle;
+	}
+
+	if (type == &mapped_source) {
+		mapped = handle;
+		range->data = mapped->data;
+		range->fh = NULL;
+		limit = mapped->data_len;
+	} else if (type == &range_source) {
+		parent = handle;
+		range->data = parent->data;
+		range->fh = parent->fh;
+		limit = parent->end;
+	} else if ((type == &file_source_owned
+	         || type == &file_source_unowned)
+	        && ftell(handle) >= 0) {
+		range->data = NULL;
+		range->fh = handle;
+		limit = (size_t) -1;
+	} else {
+		// Not possible for pipes or user-supplied stream types.
+		free(range);
+		return NULL;
+	}
+
+	if (offset > limit) {
+		offset = limit;
+	}
+
+	if (length > limit - offset) {
+		length = limit - offset;
+	}
+
+	range->pos = offset;
+	range->end = offset + length;
+
+	result = lha_input_stream_new(&range_source, range);
+
+	if (result == NULL) {
+		free(range);
+		return NULL;
+	}
+
+	// The range is read exactly as given: there is no self-extractor
+	// header to skip.
+
+	result->state = LHA_INPUT_STREAM_READING;
+	result->position = offset;
+
+	return result;
+}
+
+size_t lha_input_stream_tell(LHAInputStream *stream)
+{
+	// At the start of the stream, skip any self-extractor header
+	// first, so that the position is that of the first file header.
+
+	start_stream(stream);
+
+	return stream->position - stream->leadin_len;
+}
+
+size_t lha_input_stream_read_direct(LHAInputStream *stream, uint8_t **buf,
+                                    size_t buf_len)
+{
+	MappedFile *mapped;
+	RangeSource *range;
+	uint8_t *data;
+	size_t *pos, end, n;
+
+	// Direct access is only possible for memory-mapped streams.
+
+	if (!start_stream(stream)) {
+		return 0;
+	}
+
+	// Anything left in the lead-in buffer is a copy of data from the
+	// mapping, so it can be dropped by stepping back to where it was
+	// read from.
+
+	if (stream->leadin_len > 0) {
+		if (stream->type != &mapped_source) {
+			return 0;
+		}
+
+		mapped = stream->handle;
+		mapped->pos -= stream->leadin_len;
+		stream->position -= stream->leadin_len;
+		stream->leadin_start = 0;
+		stream->leadin_len = 0;
+	}
+
+	if (stream->type == &mapped_source) {
+		mapped = stream->handle;
+		data = mapped->data;
+		pos = &mapped->pos;
+		end = mapped->data_len;
+	} else if (stream->type == &range_source
+	        && ((RangeSource *) stream->handle)->data != NULL) {
+		range = stream->handle;
+		data = range->data;
+		pos = &range->pos;
+		end = range->end;
+	} else {
+		return 0;
+	}
+
+	n = end - *pos;
+
+	if (buf_len < n) {
+		n = buf_len;
+	}
+
+	*buf = data + *pos;
+	*pos += n;
+	stream->position += n;
+
+	return n;
+}
+
+
+// Remote source. Data is fetched from a remote file in ranges, into a
+// buffer that is then read from. Without a plan of what is to be read,
+// the amount fetched ahead of what was asked for starts small, and is
+// doubled each time reading continues from (or shortly after) the end
+// of the buffer, so that scanning the headers of an archive takes a
+// few large fetches; skipping further ahead starts again from the
+// smallest amount. Planned ranges (see lha_input_stream_plan) are
+// fetched whole, and large ones are split into chunks that are fetched
+// on a pool of threads, several at once.
+
+#define REMOTE_MIN_READAHEAD (16 * 1024)
+#define REMOTE_MAX_READAHEAD (1024 * 1024)
+
+// Planned ranges separated by a gap of up to this many bytes are
+// fetched together.
+
+#define REMOTE_COALESCE_GAP (64 * 1024)
+
+// Size of the chunks that large ranges are fetched in, and the size of
+// range above which chunks are fetched in parallel.
+
+#define REMOTE_CHUNK_SIZE (1024 * 1024)
+#define REMOTE_PARALLEL_LENGTH (4 * REMOTE_CHUNK_SIZE)
+
+// Number of threads used to fetch chunks, and the number of chunks that
+// may be fetched ahead of the read position per thread.
+
+#define REMOTE_FETCH_WORKERS 4
+#define REMOTE_CHUNKS_PER_WORKER 2
+
+typedef struct {
+	size_t offset, length;
+} RemoteRange;
+
+typedef struct {
+	const LHARemoteFileType *type;
+	void *handle;
+	size_t pos, length;
+
+	// Buffer holding 'buf_len' bytes of the file from 'buf_offset'.
+
+	uint8_t *buf;
+	size_t buf_offset, buf_len, buf_size;
+
+	// Number of bytes to fetch when reading without a plan.
+
+	size_t readahead;
+
+	// Planned ranges, in order; ranges before 'next_range' have
+	// already been read past.
+
+	RemoteRange *ranges;
+	unsigned int num_ranges, next_range;
+
+	// Threads used to fetch chunks of large ranges. Chunks have been
+	// queued from 'collect_offset' up to 'queue_offset', and are still
+	// to be queued up to 'queue_end'.
+
+	LHAWorkQueue *queue;
+	size_t collect_offset, queue_offset, queue_end;
+} RemoteSource;
+
+typedef struct {
+	RemoteSource *remote;
+	uint8_t *buf;
+	size_t offset, length;
+	int result;
+} RemoteChunk;
+
+// Fetch a range of the file, calling the fetch function repeatedly if
+// it returns less than was asked for. Returns the number of bytes
+// fetched, which is less than asked for only at the end of the file,
+// or -1 for error.
+
+static int remote_fetch(RemoteSource *remote, uint8_t *buf,
+                        size_t offset, size_t length)
+{
+	size_t fetched;
+	int result;
+
+	fetched = 0;
+
+	while (fetched < length) {
+		result = remote->type->fetch(remote->handle, buf + fetched,
+		                             offset + fetched,
+		                             length - fetched);
+
+		if (result < 0) {
+			return -1;
+		} else if (result == 0) {
+			break;
+		}
+
+		fetched += (size_t) result;
+	}
+
+	return (int) fetched;
+}
+
+// Work queue function to fetch a chunk.
+
+static void remote_fetch_chunk(void *data)
+{
+	RemoteChunk *chunk = data;
+
+	chunk->result = remote_fetch(chunk->remote, chunk->buf,
+	                             chunk->offset, chunk->length);
+}
+
+// Queue more chunks to be fetched, up to the limit on the number
+// fetched ahead.
+
+static void remote_queue_chunks(RemoteSource *remote)
+{
+	RemoteChunk *chunk;
+	size_t n;
+
+	while (remote->queue_offset < remote->queue_end
+	    && lha_work_queue_pending(remote->queue)
+	       < REMOTE_FETCH_WORKERS * REMOTE_CHUNKS_PER_WORKER) {
+		n = remote->queue_end - remote->queue_offset;
+
+		if (n > REMOTE_CHUNK_SIZE) {
+			n = REMOTE_CHUNK_SIZE;
+		}
+
+		chunk = malloc(sizeof(RemoteChunk));
+
+		if (chunk != NULL) {
+			chunk->buf = malloc(n);
+		}
+
+		if (chunk == NULL || chunk->buf == NULL) {
+			free(chunk);
+			break;
+		}
+
+		chunk->remote = remote;
+		chunk->offset = remote->queue_offset;
+		chunk->length = n;
+		chunk->result = -1;
+
+		if (!lha_work_queue_add(remote->queue, chunk, 1)) {
+			free(chunk->buf);
+			free(chunk);
+			break;
+		}
+
+		remote->queue_offset += n;
+	}
+
+	// If no more could be queued, the rest of the range is fetched
+	// without the threads.
+
+	if (lha_work_queue_pending(remote->queue) == 0) {
+		remote->queue_end = remote->queue_offset;
+	}
+}
+
+// Collect the next chunk fetched by the threads, and make it the
+// buffer. Returns zero if the chunk could not be fetched.
+
+static int remote_collect_chunk(RemoteSource *remote)
+{
+	RemoteChunk *chunk;
+	int result;
+
+	chunk = lha_work_queue_collect(remote->queue, 1);
+	result = chunk->result;
+
+	free(remote->buf);
+	remote->buf = chunk->buf;
+	remote->buf_size = chunk->length;
+	remote->buf_offset = chunk->offset;
+	remote->buf_len = result > 0 ? (size_t) result : 0;
+	remote->collect_offset = chunk->offset + chunk->length;
+	free(chunk);
+
+	remote_queue_chunks(remote);
+
+	return result > 0;
+}
+
+// Throw away any chunks still being fetched, after reading has skipped
+// past them.
+
+static void remote_drain_chunks(RemoteSource *remote)
+{
+	RemoteChunk *chunk;
+
+	if (remote->queue == NULL) {
+		return;
+	}
+
+	while (lha_work_queue_pending(remote->queue) > 0) {
+		chunk = lha_work_queue_collect(remote->queue, 1);
+		free(chunk->buf);
+		free(chunk);
+	}
+
+	remote->collect_offset = 0;
+	remote->queue_offset = 0;
+	remote->queue_end = 0;
+}
+
+// Find the planned range containing the current position, if any.
+
+static RemoteRange *remote_find_range(RemoteSource *remote)
+{
+	RemoteRange *range;
+
+	while (remote->next_range < remote->num_ranges) {
+		range = &remote->ranges[remote->next_range];
+
+		if (remote->pos < range->offset) {
+			break;
+		} else if (remote->pos < range->offset + range->length) {
+			return range;
+		}
+
+		++remote->next_range;
+	}
+
+	return NULL;
+}
+
+// Start fetching the rest of a large planned range in chunks on the
+// pool of threads. Returns zero if the threads could not be started.
+
+static int remote_start_chunks(RemoteSource *remote, size_t end)
+{
+	if (remote->queue == NULL) {
+		remote->queue = lha_work_queue_new(remote_fetch_chunk,
+		                                   REMOTE_FETCH_WORKERS);
+
+		if (remote->queue == NULL) {
+			return 0;
+		}
+	}
+
+	remote->collect_offset = remote->pos;
+	remote->queue_offset = remote->pos;
+	remote->queue_end = end;
+
+	remote_queue_chunks(remote);
+
+	return lha_work_queue_pending(remote->queue) > 0;
+}
+
+// Work out how much to fetch from the current position, when it is not
+// already in the buffer.
+
+static size_t remote_fetch_length(RemoteSource *remote)
+{
+	RemoteRange *range;
+	size_t buf_end, n;
+
+	range = remote_find_range(remote);
+
+	if (range != NULL) {
+		n = range->offset + range->length - remote->pos;
+		return n < REMOTE_CHUNK_SIZE ? n : REMOTE_CHUNK_SIZE;
+	}
+
+	buf_end = remote->buf_offset + remote->buf_len;
+
+	if (remote->buf_len > 0 && remote->pos >= buf_end
+	 && remote->pos - buf_end < remote->readahead) {
+		if (remote->readahead < REMOTE_MAX_READAHEAD) {
+			remote->readahead *= 2;
+		}
+	} else {
+		remote->readahead = REMOTE_MIN_READAHEAD;
+	}
+
+	n = remote->readahead;
+
+	// Stop at the start of the next planned range, so that it is not
+	// fetched twice.
+
+	if (remote->next_range < remote->num_ranges) {
+		range = &remote->ranges[remote->next_range];
+
+		if (range->offset - remote->pos < n) {
+			n = range->offset - remote->pos;
+		}
+	}
+
+	return n;
+}
+
+// Fill the buffer with data from the current position. Returns zero
+// for error.
+
+static int remote_fill(RemoteSource *remote)
+{
+	RemoteRange *range;
+	uint8_t *new_buf;
+	size_t n;
+	int result;
+
+	// Data fetched by the threads? Chunks that have been skipped over
+	// are still collected, as they are already being fetched.
+
+	while (remote->queue != NULL
+	    && lha_work_queue_pending(remote->queue) > 0
+	    && remote->pos >= remote->collect_offset) {
+		if (!remote_collect_chunk(remote)) {
+			return 0;
+		} else if (remote->pos < remote->buf_offset + remote->buf_len) {
+			return 1;
+		}
+	}
+
+	remote_drain_chunks(remote);
+
+	// Is this the start of the part of a planned range not yet
+	// fetched, and a large one?
+
+	range = remote_find_range(remote);
+
+	if (range != NULL
+	 && range->offset + range->length - remote->pos
+	    > REMOTE_PARALLEL_LENGTH
+	 && remote_start_chunks(remote, range->offset + range->length)) {
+		return remote_collect_chunk(remote);
+	}
+
+	n = remote_fetch_length(remote);
+
+	if (n > remote->length - remote->pos) {
+		n = remote->length - remote->pos;
+	}
+
+	if (n > remote->buf_size) {
+		new_buf = realloc(remote->buf, n);
+
+		if (new_buf == NULL) {
+			return 0;
+		}
+
+		remote->buf = new_buf;
+		remote->buf_size = n;
+	}
+
+	result = remote_fetch(remote, remote->buf, remote->pos, n);
+
+	remote->buf_offset = remote->pos;
+	remote->buf_len = result > 0 ? (size_t) result : 0;
+
+	return result > 0;
+}
+
+static int remote_source_read(void *handle, void *buf, size_t buf_len)
+{
+	RemoteSource *remote = handle;
+	size_t n;
+
+	if (remote->pos >= remote->length) {
+		return 0;
+	}
+
+	if (remote->pos < remote->buf_offset
+	 || remote->pos >= remote->buf_offset + remote->buf_len) {
+		if (!remote_fill(remote)) {
+			return -1;
+		}
+	}
+
+	n = remote->buf_offset + remote->buf_len - remote->pos;
+
+	if (buf_len < n) {
+		n = buf_len;
+	}
+
+	memcpy(buf, remote->buf + remote->pos - remote->buf_offset, n);
+	remote->pos += n;
+
+	return (int) n;
+}
+
+static int remote_source_skip(void *handle, size_t bytes)
+{
+	RemoteSource *remote = handle;
+
+	if (bytes > remote->length - remote->pos) {
+		remote->pos = remote->length;
+		return 0;
+	}
+
+	remote->pos += bytes;
+
+	return 1;
+}
+
+static void remote_source_close(void *handle)
+{
+	RemoteSource *remote = handle;
+
+	if (remote->queue != NULL) {
+		remote_drain_chunks(remote);
+		lha_work_queue_free(remote->queue);
+	}
+
+	if (remote->type->close != NULL) {
+		remote->type->close(remote->handle);
+	}
+
+	free(remote->ranges);
+	free(remote->buf);
+	free(remote);
+}
+
+static const LHAInputStreamType remote_source = {
+	remote_source_read,
+	remote_source_skip,
+	remote_source_close
+};
+
+LHAInputStream *lha_input_stream_new_remote(const LHARemoteFileType *type,
+                                            void *handle, size_t length)
+{
+	LHAInputStream *result;
+	RemoteSource *remote;
+
+	remote = calloc(1, sizeof(RemoteSource));
+
+	if (remote == NULL) {
+		return NULL;
+	}
+
+	remote->type = type;
+	remote->handle = handle;
+	remote->length = length;
+	remote->readahead = REMOTE_MIN_READAHEAD;
+
+	result = lha_input_stream_new(&remote_source, remote);
+
+	if (result == NULL) {
+		free(remote);
+	}
+
+	return result;
+}
+
+int lha_input_stream_plan(LHAInputStream *stream, const size_t *offsets,
+                          const size_t *lengths, unsigned int num_ranges)
+{
+	RemoteSource *remote;
+	RemoteRange *ranges, *last;
+	unsigned int i, n;
+
+	if (stream->type != &remote_source) {
+		return 0;
+	}
+
+	remote = stream->handle;
+
+	ranges = malloc(sizeof(RemoteRange) * (num_ranges + 1));
+
+	if (ranges == NULL) {
+		return 0;
+	}
+
+	// Merge ranges that are close together. Empty ranges are left
+	// out, as there is nothing to fetch for them.
+
+	n = 0;
+
+	for (i = 0; i < num_ranges; ++i) {
+		if (lengths[i] == 0) {
+			continue;
+		}
+
+		last = n > 0 ? &ranges[n - 1] : NULL;
+
+		if (last != NULL && offsets[i] < last->offset) {
+			free(ranges);
+			return 0;
+		}
+
+		if (last != NULL && offsets[i] <= last->offset + last->length
+		                                  + REMOTE_COALESCE_GAP) {
+			if (offsets[i] + lengths[i]
+			    > last->offset + last->length) {
+				last->length = offsets[i] + lengths[i]
+				             - last->offset;
+			}
+		} else {
+			ranges[n].offset = offsets[i];
+			ranges[n].length = lengths[i];
+			++n;
+		}
+	}
+
+	free(remote->ranges);
+	remote->ranges = ranges;
+	remote->num_ranges = n;
+	remote->next_range = 0;
+
+	return 1;
+}
@@ -37,6 +37,85 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 int lha_input_stream_read(LHAInputStream *stream, void *buf, size_t buf_len);
 
+/**
+ * Read a block of data from the LHA stream, of up to the specified
+ * number of bytes. Unlike @ref lha_input_stream_read, a short read
+ * is not treated as an error.
+ *
+ * @param stream       The input stream.
+ * @param buf          Pointer to buffer in which to store read data.
+ * @param buf_len      Size of buffer, in bytes.
+ * @return             Number of bytes read; this is less than buf_len
+ *                     only if an error occurred or the end of file
+ *                     was reached.
+ */
+
+size_t lha_input_stream_read_partial(LHAInputStream *stream,
+                                     void *buf, size_t buf_len);
+
+/**
+ * Read a block of data from the LHA stream without copying it, by
+ * returning a pointer to the data in place. This is only possible
+ * for memory-mapped streams; if zero is returned, the data must be
+ * read using @ref lha_input_stream_read_partial instead.
+ *
+ * @param stream       The input stream.
+ * @param buf          Pointer to a variable in which to store a pointer
+ *                     to the data. The data remains valid until the
+ *                     stream is freed.
+ * @param buf_len      Maximum number of bytes to read.
+ * @return             Number of bytes available at the returned
+ *                     pointer, or zero if direct access is not
+ *                     possible or the end of file was reached.
+ */
+
+size_t lha_input_stream_read_direct(LHAInputStream *stream, uint8_t **buf,
+                                    size_t buf_len);
+
+/**
+ * Get the current position within the input stream.
+ *
+ * @param stream       The input stream.
+ * @return             Offset within the underlying file of the next
+ *                     byte to be read. This is suitable for passing to
+ *                     @ref lha_input_stream_new_range.
+ */
+
+size_t lha_input_stream_tell(LHAInputStream *stream);
+
+/**
+ * Start reading ahead from an input stream on a background thread, so
+ * that waiting for input overlaps with processing the data already
+ * read. Once started, reading ahead continues until the stream is
+ * freed. It is not needed for memory-mapped streams, and is not
+ * started for them.
+ *
+ * @param stream       The input stream.
+ * @return             Non-zero if the stream is being read ahead.
+ */
+
+int lha_input_stream_prefetch(LHAInputStream *stream);
+
+/**
+ * Tell a remote input stream (see @ref lha_input_stream_new_remote)
+ * which ranges of the file are going to be read, so that each range
+ * can be fetched whole when it is reached, and the gaps between them
+ * not fetched at all. Ranges that are close together are fetched
+ * together.
+ *
+ * @param stream       The input stream.
+ * @param offsets      Offsets within the file of the start of each
+ *                     range, in increasing order.
+ * @param lengths      Lengths of the ranges, in bytes.
+ * @param num_ranges   Number of ranges.
+ * @return             Non-zero for success, or zero if the stream is
+ *                     not a remote stream, the ranges are out of
+ *                     order, or memory could not be allocated.
+ */
+
+int lha_input_stream_plan(LHAInputStream *stream, const size_t *offsets,
+                          const size_t *lengths, unsigned int num_ranges);
+
 /**
  * Skip over the specified number of bytes.
  *
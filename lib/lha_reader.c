@@ -25,9 +25,22 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include "lha_arch.h"
 #include "lha_decoder.h"
 #include "lha_basic_reader.h"
+#include "lha_decode_cache.h"
+#include "lha_work_queue.h"
+#include "lha_uring.h"
 #include "public/lha_reader.h"
+#include "public/lha_catalog.h"
 #include "macbinary.h"
 
+// Maximum number of decoders that are kept for reuse by later files.
+
+#define DECODER_POOL_SIZE 4
+
+// Maximum number of files waiting to be extracted in the background, for
+// each worker thread. Each file holds a decoder and an open output file.
+
+#define JOBS_PER_WORKER 4
+
 typedef enum {
 
 	// Initial state at start of stream:
@@ -54,7 +67,113 @@ typedef enum {
 	CURR_FILE_EOF,
 } CurrFileType;
 
+// Decompressed data is collected into a buffer of this size before
+// being written to the output file, so that writes are done in large
+// chunks at offsets that are a multiple of the buffer size.
+
+#define WRITE_BUFFER_SIZE (256 * 1024)
+
+// Disk space is reserved for output files at least this large.
+
+#define PREALLOCATE_THRESHOLD (64 * 1024)
+
+// Size of the buffer used to copy a file that has already been
+// extracted (see lha_reader_set_dedup).
+
+#define COPY_BUFFER_SIZE (16 * 1024)
+
+// When writing sparse files (see lha_reader_set_sparse), blocks of
+// zeroes of this size, aligned within the file, are left as holes.
+
+#define SPARSE_BLOCK_SIZE 4096
+
+// Maximum number of blocks of data waiting to be written to an output
+// file by the writer thread (see lha_reader_enable_pipeline).
+
+#define WRITE_BEHIND_BLOCKS 4
+
+// Files up to this size are written through io_uring, if enabled (see
+// lha_reader_enable_io_uring), and this many may be in flight at once.
+
+#define URING_MAX_FILE_SIZE (64 * 1024)
+#define URING_MAX_FILES 32
+
+// Writes through io_uring are submitted to the kernel in batches of
+// this many files.
+
+#define URING_SUBMIT_BATCH 8
+
+// A block of data to be written to an output file. The data follows
+// the structure.
+
+typedef struct {
+	FILE *fstream;
+	size_t len;
+	int sparse;
+	int success;
+} WriteBlock;
+
+// A file being decompressed to disk. Data is written with
+// lha_arch_write(), bypassing stdio. If there is a writer thread,
+// full blocks are passed to it to be written in the background.
+// If 'sparse' is set, blocks of zeroes are skipped over rather than
+// written, and 'length' is the total length of the data so far.
+
+typedef struct {
+	FILE *fstream;
+	LHAWorkQueue *writer;
+	WriteBlock *block;
+	size_t buf_size;
+	int sparse;
+	uint64_t length;
+	int failed;
+} OutputFile;
+
+// A file passed to lha_reader_extract_async or lha_reader_check_async.
+
+typedef struct _ExtractJob ExtractJob;
+
+struct _ExtractJob {
+	LHAFileHeader *header;
+	LHAReaderExtractCallback callback;
+	void *callback_data;
+	int success;
+
+	// For a file decompressed by a worker thread: the filename, the
+	// stream and reader for the compressed data, the decoder and the
+	// output file. These are all NULL for a file that was processed
+	// immediately. When only checking a file, the filename and output
+	// file are NULL.
+
+	char *filename;
+	LHAInputStream *stream;
+	LHABasicReader *reader;
+	LHADecoder *decoder;
+	OutputFile *output;
+
+	// Budgets for decoding the file, set on the decoder once the
+	// worker thread starts on it (see lha_reader_set_limits).
+
+	LHADecoderLimits limits;
+
+	// For a file being written through io_uring: non-zero once the
+	// write has completed, and the result of the write.
+
+	int written;
+	int write_result;
+
+	// Index of the catalog entry for the file, or -1 (see
+	// lha_reader_set_dedup).
+
+	int entry;
+
+	// Next job in the list of jobs not yet finished.
+
+	ExtractJob *next;
+};
+
 struct _LHAReader {
+	LHAInputStream *stream;
 	LHABasicReader *reader;
 
 	// The current file that we are processing (last file returned
@@ -68,12 +187,59 @@ struct _LHAReader {
 
 	LHADecoder *decoder;
 
-	// Pointer to "inner" decoder. Most of the time,
-	// decoder == inner_decoder, but when decoding an archive
-	// generated by MacLHA, inner_decoder points to the actual
-	// decompressor.
-
-	LHADecoder *inner_decoder;
+	// Some archives generated by MacLHA have a MacBinary header
+	// attached to the start of each file (see macbinary.c). For
+	// these files, 'windowed' is set, and only the next
+	// 'window_remaining' bytes of decoded data are returned; anything
+	// after that is decoded to check the CRC, then discarded. The
+	// first bytes of the data are read into 'mb_header' to check for
+	// a header. If there isn't one, they are returned before any
+	// more is read from the decoder.
+
+	int windowed;
+	size_t window_remaining;
+	uint8_t mb_header[LHA_MACBINARY_HEADER_SIZE];
+	size_t mb_header_pos, mb_header_len;
+
+	// Decoders left over from previous files, kept so that they can
+	// be reused for later files that use the same compression
+	// method, rather than allocating a new decoder for every file.
+	// At most one decoder of each type is kept.
+
+	LHADecoder *decoder_pool[DECODER_POOL_SIZE];
+
+	// After a seek, the decoder reads from a separate stream and
+	// basic reader, positioned within the compressed data of the
+	// current file.
+
+	LHAInputStream *seek_stream;
+	LHABasicReader *seek_reader;
+
+	// If only some files are to be read (see lha_reader_select), the
+	// catalog of the archive and the indices of the selected entries.
+	// 'next_selected' is the next entry to go to.
+
+	LHACatalog *catalog;
+	unsigned int *selected;
+	unsigned int num_selected;
+	unsigned int next_selected;
+
+	// Index within the catalog of the current file, or -1 if the
+	// catalog is not being used.
+
+	int curr_entry;
+
+	// Policy for files that are copies of earlier files (see
+	// lha_reader_set_dedup). Only the paths of files that have later
+	// copies are recorded: 'dedup_slots' gives, for each catalog
+	// entry, the index plus one of its slot in 'dedup_paths', or zero
+	// if it has no copies. The path in each slot is NULL until the
+	// file has been extracted successfully.
+
+	LHAReaderDedupPolicy dedup_policy;
+	unsigned int *dedup_slots;
+	char **dedup_paths;
+	unsigned int num_dedup_paths;
 
 	// Policy used to extract directories.
 
@@ -93,13 +259,200 @@ struct _LHAReader {
 	// of extraction.
 
 	LHAFileHeader *deferred_symlinks;
+
+	// Worker threads used by lha_reader_extract_async, or NULL to
+	// extract files immediately. Jobs that have not yet finished are
+	// kept in a list, oldest first; this is the same order in which
+	// they are collected from the work queue.
+
+	LHAWorkQueue *workers;
+	unsigned int max_jobs;
+	ExtractJob *jobs;
+	ExtractJob **jobs_end;
+
+	// Number of files passed to lha_reader_extract_async or
+	// lha_reader_check_async that failed.
+
+	unsigned int failures;
+
+	// Writer thread used to write output files in the background, or
+	// NULL (see lha_reader_enable_pipeline).
+
+	LHAWorkQueue *writer;
+
+	// If non-zero, output files are written as sparse files (see
+	// lha_reader_set_sparse).
+
+	int sparse;
+
+	// Files at least this long are decoded with two-stage decoding,
+	// or zero for none (see lha_reader_set_two_stage).
+
+	size_t two_stage_length;
+
+	// Callback to monitor progress in bytes while decoding files, or
+	// NULL (see lha_reader_monitor_bytes).
+
+	LHADecoderByteProgressCallback byte_progress_callback;
+	void *byte_progress_callback_data;
+
+	// Ring used to write small files, or NULL (see
+	// lha_reader_enable_io_uring). Files being written are kept in a
+	// list, oldest first, so that they can be finished in order.
+
+	LHAUring *uring;
+	ExtractJob *uring_jobs;
+	ExtractJob **uring_jobs_end;
+	unsigned int uring_pending;
+
+	// Cache of decompressed files, or NULL (see lha_reader_set_cache).
+	// If the current file was found in the cache, 'cache_entry' is
+	// its entry, and 'cache_pos' the position of the next byte to be
+	// read from it. While the current file is being read from the
+	// decoder, the data is copied to 'cache_fill', to be added to the
+	// cache once the whole file has been read.
+
+	LHADecodeCache *cache;
+	uint64_t cache_id;
+	LHADecodeCacheEntry *cache_entry;
+	size_t cache_pos;
+	uint8_t *cache_fill;
+	size_t cache_fill_len;
+
+	// Budgets for decoding each file (see lha_reader_set_limits), and
+	// the budget exceeded by the last file that was stopped by one.
+
+	LHADecoderLimits limits;
+	LHADecoderLimit limit_exceeded;
+
+	// Whether fast scanning is enabled (see lha_reader_set_fast_scan);
+	// lha_reader_next_batch always scans. If the name of a file did
+	// not fit in a batch, 'batch_pending' is set, and the current file
+	// is returned again by the next call to lha_reader_next_file.
+
+	int fast_scan;
+	int batch_pending;
 };
 
+/**
+ * Return a decoder that is no longer needed to the decoder pool.
+ *
+ * The decoder is kept for reuse if there is not already a decoder of the
+ * same type in the pool. If the pool is full, the least recently used
+ * decoder is freed to make space.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param decoder        The decoder.
+ */
+
+static void release_decoder(LHAReader *reader, LHADecoder *decoder)
+{
+	unsigned int i;
+
+	for (i = 0; i < DECODER_POOL_SIZE; ++i) {
+		if (reader->decoder_pool[i] != NULL
+		 && reader->decoder_pool[i]->dtype == decoder->dtype) {
+			lha_decoder_free(decoder);
+			return;
+		}
+	}
+
+	// The pool is ordered from least to most recently used.
+
+	if (reader->decoder_pool[0] != NULL) {
+		lha_decoder_free(reader->decoder_pool[0]);
+	}
+
+	for (i = 0; i + 1 < DECODER_POOL_SIZE; ++i) {
+		reader->decoder_pool[i] = reader->decoder_pool[i + 1];
+	}
+
+	reader->decoder_pool[DECODER_POOL_SIZE - 1] = decoder;
+}
+
+/**
+ * Get a decoder to decompress the current file, reusing a decoder from
+ * the pool if one of the right type is available.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @return               Pointer to the decoder, or NULL for failure.
+ */
+
+static LHADecoder *acquire_decoder(LHAReader *reader)
+{
+	LHADecoderType *dtype;
+	LHADecoder *decoder;
+	unsigned int i;
+
+	dtype = lha_decoder_for_name(reader->curr_file->compress_method);
+
+	for (i = 0; dtype != NULL && i < DECODER_POOL_SIZE; ++i) {
+		decoder = reader->decoder_pool[i];
+
+		if (decoder != NULL && decoder->dtype == dtype) {
+			reader->decoder_pool[i] = NULL;
+
+			if (lha_basic_reader_reset_decoder(reader->reader,
+			                                   decoder)) {
+				return decoder;
+			}
+
+			lha_decoder_free(decoder);
+			break;
+		}
+	}
+
+	return lha_basic_reader_decode(reader->reader);
+}
+
+/**
+ * Check the current file's header against the budgets set with
+ * @ref lha_reader_set_limits, so that a file that would exceed them is
+ * rejected without decoding any of it.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @return               Non-zero if the file is within the budgets.
+ */
+
+static int header_within_limits(LHAReader *reader)
+{
+	LHADecoderLimit limit;
+
+	limit = lha_decoder_check_sizes(&reader->limits,
+	                                reader->curr_file->length,
+	                                reader->curr_file->compressed_length);
+
+	if (limit != LHA_DECODER_LIMIT_NONE) {
+		reader->limit_exceeded = limit;
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Record the budget exceeded by a decoder, if it was stopped by one.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param decoder        The decoder.
+ */
+
+static void note_limit_exceeded(LHAReader *reader, LHADecoder *decoder)
+{
+	LHADecoderLimit limit;
+
+	limit = lha_decoder_limit_exceeded(decoder);
+
+	if (limit != LHA_DECODER_LIMIT_NONE) {
+		reader->limit_exceeded = limit;
+	}
+}
+
 /**
  * Free the current decoder structure.
  *
  * If the reader has an allocated decoder being used to decompress the
- * current file, the decoder is freed and the decoder pointer reset
+ * current file, the decoder is released and the decoder pointer reset
  * to NULL.
  *
  * @param reader         Pointer to the LHA reader structure.
@@ -107,19 +460,82 @@ struct _LHAReader {
 
 static void close_decoder(LHAReader *reader)
 {
+	// The decoder is kept for reuse.
+
 	if (reader->decoder != NULL) {
-		if (reader->inner_decoder == reader->decoder) {
-			reader->inner_decoder = NULL;
+		note_limit_exceeded(reader, reader->decoder);
+		release_decoder(reader, reader->decoder);
+		reader->decoder = NULL;
+	}
+
+	reader->windowed = 0;
+
+	if (reader->cache_entry != NULL) {
+		lha_decode_cache_release(reader->cache, reader->cache_entry);
+		reader->cache_entry = NULL;
+	}
+
+	free(reader->cache_fill);
+	reader->cache_fill = NULL;
+
+	if (reader->seek_reader != NULL) {
+		lha_basic_reader_free(reader->seek_reader);
+		reader->seek_reader = NULL;
+	}
+
+	if (reader->seek_stream != NULL) {
+		lha_input_stream_free(reader->seek_stream);
+		reader->seek_stream = NULL;
+	}
+}
+
+/**
+ * Check whether the current file begins with a MacBinary header, and
+ * set up the window on the decoded data to strip it off if so.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @return               Non-zero for success, or zero if the data
+ *                       could not be read.
+ */
+
+static int open_window(LHAReader *reader)
+{
+	size_t n, bytes;
+
+	reader->windowed = 1;
+	reader->window_remaining = (size_t) reader->curr_file->length;
+	reader->mb_header_pos = 0;
+	reader->mb_header_len = 0;
+
+	if (reader->curr_file->length < LHA_MACBINARY_HEADER_SIZE) {
+		return 1;
+	}
+
+	bytes = 0;
+
+	while (bytes < LHA_MACBINARY_HEADER_SIZE) {
+		n = lha_decoder_read(reader->decoder,
+		                     reader->mb_header + bytes,
+		                     LHA_MACBINARY_HEADER_SIZE - bytes);
+
+		// Unexpected EOF?
+
+		if (n == 0) {
+			return 0;
 		}
 
-		lha_decoder_free(reader->decoder);
-		reader->decoder = NULL;
+		bytes += n;
 	}
 
-	if (reader->inner_decoder != NULL) {
-		lha_decoder_free(reader->inner_decoder);
-		reader->inner_decoder = NULL;
+	// If this is not a MacBinary header, the data must be returned
+	// as normal.
+
+	if (!lha_macbinary_header(reader->mb_header, reader->curr_file,
+	                          &reader->window_remaining)) {
+		reader->mb_header_len = bytes;
 	}
+
+	return 1;
 }
 
 /**
@@ -138,37 +554,50 @@ static int open_decoder(LHAReader *reader,
 {
 	// Can only read from a normal file.
 
-	if (reader->curr_file_type != CURR_FILE_NORMAL) {
+	if (reader->curr_file_type != CURR_FILE_NORMAL
+	 || !header_within_limits(reader)) {
 		return 0;
 	}
 
-	reader->inner_decoder = lha_basic_reader_decode(reader->reader);
+	reader->decoder = acquire_decoder(reader);
 
-	if (reader->inner_decoder == NULL) {
+	if (reader->decoder == NULL) {
 		return 0;
 	}
 
+	lha_decoder_set_limits(reader->decoder, &reader->limits);
+
+	// Large files are decoded on two threads, where possible.
+
+	if (reader->two_stage_length > 0
+	 && reader->curr_file->length >= reader->two_stage_length) {
+		lha_decoder_enable_two_stage(reader->decoder);
+	}
+
 	// Set progress callback for decoder.
 
 	if (callback != NULL) {
-		lha_decoder_monitor(reader->inner_decoder,
-		                    callback, callback_data);
+		lha_decoder_monitor(reader->decoder, callback, callback_data);
+	}
+
+	if (reader->byte_progress_callback != NULL) {
+		lha_decoder_monitor_bytes(reader->decoder,
+		                          reader->byte_progress_callback,
+		                          reader->byte_progress_callback_data,
+		                          reader->curr_file->compressed_length);
 	}
 
 	// Some archives generated by MacLHA have a MacBinary header
 	// attached to the start, which contains MacOS-specific
 	// metadata about the compressed file. These are identified
-	// and stripped off, using a "passthrough" decoder.
-
-	if (reader->curr_file->os_type == LHA_OS_TYPE_MACOS) {
-		reader->decoder = lha_macbinary_passthrough(
-		    reader->inner_decoder, reader->curr_file);
+	// and stripped off. If the header can't be read, the decoder is
+	// released and the window closed again, so that a failed call
+	// leaves nothing half-open for a later attempt.
 
-		if (reader->decoder == NULL) {
-			return 0;
-		}
-	} else {
-		reader->decoder = reader->inner_decoder;
+	if (reader->curr_file->os_type == LHA_OS_TYPE_MACOS
+	 && !open_window(reader)) {
+		close_decoder(reader);
+		return 0;
 	}
 
 	return 1;
@@ -192,14 +621,26 @@ LHAReader *lha_reader_new(LHAInputStream *stream)
 		return NULL;
 	}
 
+	reader->stream = stream;
 	reader->reader = basic_reader;
 	reader->curr_file = NULL;
 	reader->curr_file_type = CURR_FILE_START;
 	reader->decoder = NULL;
-	reader->inner_decoder = NULL;
+	reader->windowed = 0;
 	reader->dir_stack = NULL;
 	reader->dir_policy = LHA_READER_DIR_END_OF_DIR;
 	reader->deferred_symlinks = NULL;
+	reader->workers = NULL;
+	reader->jobs = NULL;
+	reader->jobs_end = &reader->jobs;
+	reader->uring = NULL;
+	reader->uring_jobs = NULL;
+	reader->uring_jobs_end = &reader->uring_jobs;
+	reader->uring_pending = 0;
+	reader->sparse = 0;
+	reader->two_stage_length = 0;
+	reader->curr_entry = -1;
+	reader->dedup_policy = LHA_READER_DEDUP_NONE;
 
 	return reader;
 }
@@ -207,11 +648,31 @@ LHAReader *lha_reader_new(LHAInputStream *stream)
 void lha_reader_free(LHAReader *reader)
 {
 	LHAFileHeader *header;
+	unsigned int i;
+
+	// Finish any files still being extracted in the background.
+
+	lha_reader_set_workers(reader, 1);
 
-	// Shut down the current decoder, if there is one.
+	// Shut down the current decoder, if there is one, and free
+	// any decoders kept for reuse.
 
 	close_decoder(reader);
 
+	for (i = 0; i < DECODER_POOL_SIZE; ++i) {
+		if (reader->decoder_pool[i] != NULL) {
+			lha_decoder_free(reader->decoder_pool[i]);
+		}
+	}
+
+	if (reader->writer != NULL) {
+		lha_work_queue_free(reader->writer);
+	}
+
+	if (reader->uring != NULL) {
+		lha_uring_free(reader->uring);
+	}
+
 	// Free any file headers in the stack.
 
 	while (reader->dir_stack != NULL) {
@@ -220,7 +681,14 @@ void lha_reader_free(LHAReader *reader)
 		lha_file_header_free(header);
 	}
 
+	for (i = 0; i < reader->num_dedup_paths; ++i) {
+		free(reader->dedup_paths[i]);
+	}
+
 	lha_basic_reader_free(reader->reader);
+	free(reader->selected);
+	free(reader->dedup_slots);
+	free(reader->dedup_paths);
 	free(reader);
 }
 
@@ -287,600 +755,2606 @@ static int end_of_top_dir(LHAReader *reader)
 	}
 }
 
-// Read the next file from the input stream.
-
-LHAFileHeader *lha_reader_next_file(LHAReader *reader)
+int lha_reader_select(LHAReader *reader, LHACatalog *catalog,
+                      const unsigned int *entries, unsigned int num_entries)
 {
-	// Free the current decoder if there is one.
+	unsigned int i;
 
-	close_decoder(reader);
+	// The selection must be made before reading starts.
 
-	// No point continuing once the end of the input stream has
-	// been reached.
+	if (reader->curr_file_type != CURR_FILE_START
+	 || reader->selected != NULL) {
+		return 0;
+	}
 
-	if (reader->curr_file_type == CURR_FILE_EOF) {
-		return NULL;
+	for (i = 0; i < num_entries; ++i) {
+		if (entries[i] >= lha_catalog_num_entries(catalog)
+		 || (i > 0 && entries[i] <= entries[i - 1])) {
+			return 0;
+		}
 	}
 
-	// Advance to the next file from the input stream?
-	// Don't advance until we've done the fake directories first.
+	// Allocate at least one entry, so that an empty selection can
+	// be told apart from no selection.
 
-	if (reader->curr_file_type == CURR_FILE_START
-	 || reader->curr_file_type == CURR_FILE_NORMAL) {
-		lha_basic_reader_next_file(reader->reader);
+	reader->selected = malloc(sizeof(unsigned int) * (num_entries + 1));
+
+	if (reader->selected == NULL) {
+		return 0;
 	}
 
-	// If the last file we returned was a 'fake' directory, we must
-	// now unreference it.
+	memcpy(reader->selected, entries, sizeof(unsigned int) * num_entries);
+	reader->catalog = catalog;
+	reader->num_selected = num_entries;
+	reader->next_selected = 0;
 
-	if (reader->curr_file_type == CURR_FILE_FAKE_DIR) {
-		lha_file_header_free(reader->curr_file);
-	}
+	return 1;
+}
 
-	// Pop off all appropriate directories from the stack first.
+int lha_reader_set_dedup(LHAReader *reader, LHAReaderDedupPolicy policy)
+{
+	LHACatalogEntry *entry;
+	unsigned int num_entries, i;
 
-	if (end_of_top_dir(reader)) {
-		reader->curr_file = reader->dir_stack;
-		reader->dir_stack = reader->dir_stack->_next;
-		reader->curr_file_type = CURR_FILE_FAKE_DIR;
-	} else {
-		reader->curr_file = lha_basic_reader_curr_file(reader->reader);
-		reader->curr_file_type = CURR_FILE_NORMAL;
+	if (reader->catalog == NULL || reader->dedup_slots != NULL) {
+		return 0;
 	}
 
-	// Once we reach the end of the file, there may be deferred
-	// symbolic links still to extract, so process those before
-	// giving up and declaring end of file.
+	// Find the files that have later copies.
 
-	if (reader->curr_file == NULL) {
-		if (reader->deferred_symlinks != NULL) {
-			reader->curr_file = reader->deferred_symlinks;
-			reader->curr_file_type = CURR_FILE_DEFERRED_SYMLINK;
+	num_entries = lha_catalog_num_entries(reader->catalog);
+	reader->dedup_slots = calloc(num_entries + 1, sizeof(unsigned int));
 
-			reader->deferred_symlinks =
-			    reader->deferred_symlinks->_next;
-			reader->curr_file->_next = NULL;
-		} else {
-			reader->curr_file_type = CURR_FILE_EOF;
-		}
+	if (reader->dedup_slots == NULL) {
+		return 0;
 	}
 
-	return reader->curr_file;
-}
+	reader->num_dedup_paths = 0;
 
-size_t lha_reader_read(LHAReader *reader, void *buf, size_t buf_len)
-{
-	// The first time that we try to read the current file, we
-	// must create the decoder to decompress it.
+	for (i = 0; i < num_entries; ++i) {
+		entry = lha_catalog_get(reader->catalog, i);
 
-	if (reader->decoder == NULL) {
-		if (!open_decoder(reader, NULL, NULL)) {
-			return 0;
+		if (entry->duplicate_of != i
+		 && reader->dedup_slots[entry->duplicate_of] == 0) {
+			++reader->num_dedup_paths;
+			reader->dedup_slots[entry->duplicate_of] =
+			    reader->num_dedup_paths;
 		}
 	}
 
-	// Read from decoder and return the result.
+	reader->dedup_paths = calloc(reader->num_dedup_paths + 1,
+	                             sizeof(char *));
+
+	if (reader->dedup_paths == NULL) {
+		free(reader->dedup_slots);
+		reader->dedup_slots = NULL;
+		reader->num_dedup_paths = 0;
+		return 0;
+	}
+
+	reader->dedup_policy = policy;
 
-	return lha_decoder_read(reader->decoder, buf, buf_len);
+	return 1;
 }
 
 /**
- * Decompress the current file.
- *
- * Assumes that @param open_decoder has already been called to
- * start the decode process.
+ * Find whether the current file is a copy of an earlier file.
  *
  * @param reader         Pointer to the LHA reader structure.
- * @param output         FILE handle to write decompressed data, or NULL
- *                       if the decompressed data should be discarded.
- * @return               Non-zero if the file decompressed successfully.
+ * @return               Index of the catalog entry for the earlier file,
+ *                       or -1 if the current file is not a copy.
  */
 
-static int do_decode(LHAReader *reader, FILE *output)
+static int copy_source(LHAReader *reader)
 {
-	uint8_t buf[64];
-	unsigned int bytes;
+	LHACatalogEntry *entry;
 
-	// Decompress the current file.
+	if (reader->dedup_policy == LHA_READER_DEDUP_NONE
+	 || reader->curr_file_type != CURR_FILE_NORMAL
+	 || reader->curr_entry < 0) {
+		return -1;
+	}
 
-	do {
-		bytes = lha_reader_read(reader, buf, sizeof(buf));
+	entry = lha_catalog_get(reader->catalog,
+	                        (unsigned int) reader->curr_entry);
 
-		if (output != NULL) {
-			if (fwrite(buf, 1, bytes, output) < bytes) {
-				return 0;
-			}
-		}
+	if (entry->duplicate_of == (unsigned int) reader->curr_entry) {
+		return -1;
+	}
 
-	} while (bytes > 0);
+	return (int) entry->duplicate_of;
+}
 
-	// Decoder stores output position and performs running CRC.
+/**
+ * Record that a file has been written, so that later copies of it can be
+ * made from it. Any earlier file recorded at the same path has been
+ * replaced, so is forgotten.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param entry          Index of the catalog entry for the file, or -1.
+ * @param filename       Path that the file was written to.
+ * @param success        Non-zero if the file was extracted successfully.
+ */
+
+static void record_output(LHAReader *reader, int entry, char *filename,
+                          int success)
+{
+	unsigned int i, slot;
+
+	for (i = 0; i < reader->num_dedup_paths; ++i) {
+		if (reader->dedup_paths[i] != NULL
+		 && !strcmp(reader->dedup_paths[i], filename)) {
+			free(reader->dedup_paths[i]);
+			reader->dedup_paths[i] = NULL;
+		}
+	}
+
+	if (!success || entry < 0 || reader->dedup_slots == NULL) {
+		return;
+	}
+
+	slot = reader->dedup_slots[entry];
+
+	if (slot != 0) {
+		reader->dedup_paths[slot - 1] = strdup(filename);
+	}
+}
+
+// Advance the basic reader to the next file from the input stream,
+// or the next selected file if only some files are being read.
+
+static void next_input_file(LHAReader *reader)
+{
+	LHACatalogEntry *entry;
+
+	if (reader->selected == NULL) {
+		lha_basic_reader_next_file(reader->reader);
+		return;
+	}
+
+	entry = NULL;
+	reader->curr_entry = -1;
+
+	if (reader->next_selected < reader->num_selected) {
+		reader->curr_entry =
+		    (int) reader->selected[reader->next_selected];
+		entry = lha_catalog_get(reader->catalog,
+		                        reader->selected[reader->next_selected]);
+		++reader->next_selected;
+	}
+
+	if (entry != NULL) {
+		lha_basic_reader_next_file_at(reader->reader, entry->header,
+		                              entry->header_offset,
+		                              entry->data_offset);
+	} else {
+		lha_basic_reader_next_file_at(reader->reader, NULL, 0, 0);
+	}
+}
+
+// Read the next file from the input stream.
+
+LHAFileHeader *lha_reader_next_file(LHAReader *reader)
+{
+	if (reader->batch_pending) {
+		reader->batch_pending = 0;
+
+		if (!reader->fast_scan) {
+			lha_file_header_decode_lazy(reader->curr_file);
+		}
+
+		return reader->curr_file;
+	}
+
+	// Free the current decoder if there is one.
+
+	close_decoder(reader);
+
+	// No point continuing once the end of the input stream has
+	// been reached.
+
+	if (reader->curr_file_type == CURR_FILE_EOF) {
+		return NULL;
+	}
+
+	// Advance to the next file from the input stream?
+	// Don't advance until we've done the fake directories first.
+
+	if (reader->curr_file_type == CURR_FILE_START
+	 || reader->curr_file_type == CURR_FILE_NORMAL) {
+		next_input_file(reader);
+	}
+
+	// If the last file we returned was a 'fake' directory, we must
+	// now unreference it.
+
+	if (reader->curr_file_type == CURR_FILE_FAKE_DIR) {
+		lha_file_header_free(reader->curr_file);
+	}
+
+	// Pop off all appropriate directories from the stack first.
+
+	if (end_of_top_dir(reader)) {
+		reader->curr_file = reader->dir_stack;
+		reader->dir_stack = reader->dir_stack->_next;
+		reader->curr_file_type = CURR_FILE_FAKE_DIR;
+	} else {
+		reader->curr_file = lha_basic_reader_curr_file(reader->reader);
+		reader->curr_file_type = CURR_FILE_NORMAL;
+	}
+
+	// Once we reach the end of the file, there may be deferred
+	// symbolic links still to extract, so process those before
+	// giving up and declaring end of file.
+
+	if (reader->curr_file == NULL) {
+		if (reader->deferred_symlinks != NULL) {
+			reader->curr_file = reader->deferred_symlinks;
+			reader->curr_file_type = CURR_FILE_DEFERRED_SYMLINK;
+
+			reader->deferred_symlinks =
+			    reader->deferred_symlinks->_next;
+			reader->curr_file->_next = NULL;
+		} else {
+			reader->curr_file_type = CURR_FILE_EOF;
+		}
+	}
+
+	return reader->curr_file;
+}
+
+/**
+ * Read decoded data for the current file, through the window set up
+ * for files with a MacBinary header (see open_window).
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param buf            Buffer in which to store the data.
+ * @param buf_len        Size of the buffer, in bytes.
+ * @return               Number of bytes read.
+ */
+
+static size_t read_window(LHAReader *reader, uint8_t *buf, size_t buf_len)
+{
+	size_t result;
+
+	if (!reader->windowed) {
+		return lha_decoder_read(reader->decoder, buf, buf_len);
+	}
+
+	if (buf_len > reader->window_remaining) {
+		buf_len = reader->window_remaining;
+	}
+
+	result = reader->mb_header_len - reader->mb_header_pos;
+
+	if (result > buf_len) {
+		result = buf_len;
+	}
+
+	memcpy(buf, reader->mb_header + reader->mb_header_pos, result);
+	reader->mb_header_pos += result;
+
+	result += lha_decoder_read(reader->decoder, buf + result,
+	                           buf_len - result);
+	reader->window_remaining -= result;
+
+	// Once the end of the window is reached, there may still be
+	// data to decompress. Run the decoder until the end, so that
+	// the CRC can be checked.
+
+	if (reader->window_remaining == 0) {
+		lha_decoder_decode_to(reader->decoder, NULL, NULL);
+	}
+
+	return result;
+}
+
+/**
+ * Check whether the current file can be kept in the cache of
+ * decompressed files. Files with a MacBinary header are not cached, as
+ * the length of the data differs from the length in the header.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @return               Non-zero if the file can be cached.
+ */
+
+static int cacheable(LHAReader *reader)
+{
+	return reader->cache != NULL
+	    && reader->curr_file_type == CURR_FILE_NORMAL
+	    && strcmp(reader->curr_file->compress_method,
+	              LHA_COMPRESS_TYPE_DIR) != 0
+	    && reader->curr_file->os_type != LHA_OS_TYPE_MACOS
+	    && lha_decode_cache_accepts(reader->cache,
+	                                (size_t) reader->curr_file->length);
+}
+
+/**
+ * Look for the current file in the cache of decompressed files.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @return               Non-zero if the file was found.
+ */
+
+static int cache_lookup(LHAReader *reader)
+{
+	if (!cacheable(reader)) {
+		return 0;
+	}
+
+	reader->cache_entry = lha_decode_cache_lookup(
+	    reader->cache, reader->cache_id,
+	    lha_basic_reader_curr_file_offset(reader->reader),
+	    reader->curr_file->crc, (size_t) reader->curr_file->length);
+	reader->cache_pos = 0;
+
+	return reader->cache_entry != NULL;
+}
+
+/**
+ * Add the current file to the cache of decompressed files, if it has
+ * been decompressed successfully.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param data           The decompressed data, allocated with malloc().
+ *                       Ownership passes to the cache.
+ * @param length         Length of the data, in bytes.
+ */
+
+static void cache_insert(LHAReader *reader, uint8_t *data, size_t length)
+{
+	if (length != reader->curr_file->length
+	 || lha_decoder_get_length(reader->decoder) != length
+	 || lha_decoder_get_crc(reader->decoder) != reader->curr_file->crc) {
+		free(data);
+		return;
+	}
+
+	lha_decode_cache_insert(reader->cache, reader->cache_id,
+	                        lha_basic_reader_curr_file_offset(
+	                            reader->reader),
+	                        reader->curr_file->crc, data, length);
+}
+
+/**
+ * Read data for the current file from the cache of decompressed files.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param buf            Buffer in which to store the data.
+ * @param buf_len        Size of the buffer, in bytes.
+ * @return               Number of bytes read.
+ */
+
+static size_t read_cached(LHAReader *reader, uint8_t *buf, size_t buf_len)
+{
+	size_t n;
+
+	n = reader->cache_entry->length - reader->cache_pos;
+
+	if (buf_len < n) {
+		n = buf_len;
+	}
+
+	memcpy(buf, reader->cache_entry->data + reader->cache_pos, n);
+	reader->cache_pos += n;
+
+	return n;
+}
+
+size_t lha_reader_read(LHAReader *reader, void *buf, size_t buf_len)
+{
+	size_t result;
+
+	if (reader->cache_entry != NULL) {
+		return read_cached(reader, buf, buf_len);
+	}
+
+	// The first time that we try to read the current file, we
+	// must create the decoder to decompress it - unless it is in the
+	// cache. The data is saved as it is read, to add the file to the
+	// cache once it has all been read.
+
+	if (reader->decoder == NULL) {
+		if (cache_lookup(reader)) {
+			return read_cached(reader, buf, buf_len);
+		}
+
+		if (!open_decoder(reader, NULL, NULL)) {
+			return 0;
+		}
+
+		if (cacheable(reader)) {
+			reader->cache_fill =
+			    malloc((size_t) reader->curr_file->length);
+			reader->cache_fill_len = 0;
+		}
+	}
+
+	// Read from decoder and return the result.
+
+	result = read_window(reader, buf, buf_len);
+
+	if (reader->cache_fill != NULL) {
+		memcpy(reader->cache_fill + reader->cache_fill_len,
+		       buf, result);
+		reader->cache_fill_len += result;
+
+		if (result == 0 || reader->cache_fill_len
+		                   == reader->curr_file->length) {
+			cache_insert(reader, reader->cache_fill,
+			             reader->cache_fill_len);
+			reader->cache_fill = NULL;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Restart decoding the current file from a checkpoint, or from the start
+ * of the file if checkpoint is NULL. The compressed data is read through
+ * a new stream, as the main input stream has already moved past it.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param checkpoint     Checkpoint to restart from, or NULL.
+ * @return               Non-zero for success, zero for failure.
+ */
+
+static int restart_decoder(LHAReader *reader,
+                           LHADecoderCheckpoint *checkpoint)
+{
+	size_t data_offset, skip;
+
+	close_decoder(reader);
+
+	data_offset = lha_basic_reader_curr_data_offset(reader->reader);
+	skip = checkpoint != NULL ? (size_t) (checkpoint->input_bits / 8) : 0;
+
+	if (skip > reader->curr_file->compressed_length) {
+		return 0;
+	}
+
+	reader->seek_stream = lha_input_stream_new_range(
+	    reader->stream, data_offset + skip,
+	    reader->curr_file->compressed_length - skip);
+
+	if (reader->seek_stream == NULL) {
+		return 0;
+	}
+
+	reader->seek_reader = lha_basic_reader_new_for_file(
+	    reader->seek_stream, reader->curr_file);
+
+	if (reader->seek_reader == NULL) {
+		return 0;
+	}
+
+	if (checkpoint != NULL) {
+		reader->decoder = lha_basic_reader_decode_at(
+		    reader->seek_reader, checkpoint);
+	} else {
+		reader->decoder = lha_basic_reader_decode(
+		    reader->seek_reader);
+	}
+
+	if (reader->decoder == NULL) {
+		return 0;
+	}
+
+	lha_decoder_set_limits(reader->decoder, &reader->limits);
+
+	return 1;
+}
+
+int lha_reader_seek(LHAReader *reader, size_t offset,
+                    LHADecoderCheckpoint *checkpoints,
+                    unsigned int num_checkpoints)
+{
+	LHADecoderCheckpoint *checkpoint;
+	size_t pos;
+	unsigned int i;
+
+	// MacBinary headers are stripped from the data, so offsets into
+	// the decoded data don't match; seeking isn't supported.
+
+	if (reader->curr_file_type != CURR_FILE_NORMAL
+	 || reader->curr_file->os_type == LHA_OS_TYPE_MACOS
+	 || offset > reader->curr_file->length) {
+		return 0;
+	}
+
+	// A file in the cache can be read from any position. Otherwise,
+	// the file is not being read in order any more, so it can't be
+	// added to the cache.
+
+	if (reader->cache_entry != NULL
+	 || (reader->decoder == NULL && cache_lookup(reader))) {
+		reader->cache_pos = offset;
+		return 1;
+	}
+
+	free(reader->cache_fill);
+	reader->cache_fill = NULL;
+
+	// Find the last checkpoint before the offset.
+
+	checkpoint = NULL;
+
+	for (i = 0; i < num_checkpoints; ++i) {
+		if (checkpoints[i].output_offset <= offset
+		 && (checkpoint == NULL || checkpoints[i].output_offset
+		                            > checkpoint->output_offset)) {
+			checkpoint = &checkpoints[i];
+		}
+	}
+
+	// Decoding can continue from the current position if the offset
+	// is ahead of it and no checkpoint is closer. If decoding hasn't
+	// started yet, start from the beginning in the normal way.
+
+	if (reader->decoder != NULL) {
+		pos = lha_decoder_get_length(reader->decoder);
+	} else {
+		pos = 0;
+	}
+
+	if (pos > offset || (checkpoint != NULL
+	                     && checkpoint->output_offset > pos)) {
+		if (!restart_decoder(reader, checkpoint)) {
+			close_decoder(reader);
+			return 0;
+		}
+	} else if (reader->decoder == NULL
+	        && !open_decoder(reader, NULL, NULL)) {
+		return 0;
+	}
+
+	// Decode up to the offset.
+
+	pos = lha_decoder_get_length(reader->decoder);
+
+	return lha_decoder_skip(reader->decoder, offset - pos) == offset - pos;
+}
+
+/**
+ * Decompress a file using the specified decoder.
+ *
+ * @param decoder        The decoder.
+ * @param header         Header of the file being decompressed.
+ * @param sink           Callback function to invoke with the decompressed
+ *                       data, or NULL if the data should be discarded.
+ * @param sink_data      Extra data to pass to the callback function.
+ * @return               Non-zero if the file decompressed successfully.
+ */
+
+static int decode_file(LHADecoder *decoder, LHAFileHeader *header,
+                       LHADecoderSink sink, void *sink_data)
+{
+	if (!lha_decoder_decode_to(decoder, sink, sink_data)) {
+		return 0;
+	}
+
+	// Decoder stores output position and performs running CRC.
 	// At the end of the stream these should match the header values.
 
-	return lha_decoder_get_length(reader->inner_decoder)
-	         == reader->curr_file->length
-	    && lha_decoder_get_crc(reader->inner_decoder)
-	         == reader->curr_file->crc;
+	return lha_decoder_get_length(decoder) == header->length
+	    && lha_decoder_get_crc(decoder) == header->crc;
+}
+
+// State passed to window_sink.
+
+typedef struct {
+	LHAReader *reader;
+	LHADecoderSink sink;
+	void *sink_data;
+} WindowSink;
+
+/**
+ * Sink callback that passes on decoded data within the window on the
+ * current file (see open_window), and discards anything after it.
+ *
+ * @param buf            Pointer to the decompressed data.
+ * @param buf_len        Length of the data, in bytes.
+ * @param user_data      Pointer to the @ref WindowSink.
+ * @return               Zero if the sink that the data was passed to
+ *                       failed.
+ */
+
+static int window_sink(uint8_t *buf, size_t buf_len, void *user_data)
+{
+	WindowSink *window = user_data;
+	LHAReader *reader = window->reader;
+
+	if (buf_len > reader->window_remaining) {
+		buf_len = reader->window_remaining;
+	}
+
+	reader->window_remaining -= buf_len;
+
+	if (buf_len == 0 || window->sink == NULL) {
+		return 1;
+	}
+
+	return window->sink(buf, buf_len, window->sink_data);
+}
+
+/**
+ * Decompress the current file.
+ *
+ * Assumes that @param open_decoder has already been called to
+ * start the decode process.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param sink           Callback function to invoke with the decompressed
+ *                       data, or NULL if the data should be discarded.
+ * @param sink_data      Extra data to pass to the callback function.
+ * @return               Non-zero if the file decompressed successfully.
+ */
+
+static int do_decode(LHAReader *reader, LHADecoderSink sink, void *sink_data)
+{
+	WindowSink window;
+	size_t bytes;
+
+	if (!reader->windowed) {
+		return decode_file(reader->decoder, reader->curr_file,
+		                   sink, sink_data);
+	}
+
+	window.reader = reader;
+	window.sink = sink;
+	window.sink_data = sink_data;
+
+	// Any data read to check for a MacBinary header comes first.
+
+	bytes = reader->mb_header_len - reader->mb_header_pos;
+
+	if (bytes > 0) {
+		reader->mb_header_pos += bytes;
+
+		if (!window_sink(reader->mb_header + reader->mb_header_pos
+		                   - bytes, bytes, &window)) {
+			return 0;
+		}
+	}
+
+	return decode_file(reader->decoder, reader->curr_file,
+	                   window_sink, &window);
+}
+
+int lha_reader_decode_to(LHAReader *reader, LHADecoderSink sink,
+                         void *sink_data)
+{
+	// The first time that we try to read the current file, we
+	// must create the decoder to decompress it.
+
+	if (reader->decoder == NULL) {
+		if (!open_decoder(reader, NULL, NULL)) {
+			return 0;
+		}
+	}
+
+	return do_decode(reader, sink, sink_data);
+}
+
+int lha_reader_extract_into(LHAReader *reader, void *buf, size_t buf_len,
+                            size_t *length)
+{
+	uint8_t *copy;
+	int success;
+
+	if (reader->curr_file_type != CURR_FILE_NORMAL
+	 || !strcmp(reader->curr_file->compress_method,
+	            LHA_COMPRESS_TYPE_DIR)
+	 || reader->decoder != NULL || reader->cache_entry != NULL
+	 || buf_len < reader->curr_file->length) {
+		return 0;
+	}
+
+	if (cache_lookup(reader)) {
+		memcpy(buf, reader->cache_entry->data,
+		       reader->cache_entry->length);
+		*length = reader->cache_entry->length;
+		return 1;
+	}
+
+	if (!open_decoder(reader, NULL, NULL)) {
+		return 0;
+	}
+
+	// The length in the header is the most that the decoder can
+	// produce, so one call is enough to decompress the whole file.
+
+	*length = read_window(reader, buf, (size_t) reader->curr_file->length);
+
+	success = lha_decoder_get_length(reader->decoder)
+	              == reader->curr_file->length
+	       && lha_decoder_get_crc(reader->decoder)
+	              == reader->curr_file->crc;
+
+	if (success && cacheable(reader)) {
+		copy = malloc(*length);
+
+		if (copy != NULL) {
+			memcpy(copy, buf, *length);
+			cache_insert(reader, copy, *length);
+		}
+	}
+
+	return success;
+}
+
+void *lha_reader_extract_to_buffer(LHAReader *reader, size_t *length)
+{
+	uint8_t *result, *smaller;
+	size_t buf_len;
+
+	if (reader->curr_file == NULL) {
+		return NULL;
+	}
+
+	// Allocate at least one byte, so that an empty file can be told
+	// apart from failure.
+
+	buf_len = (size_t) reader->curr_file->length;
+	result = malloc(buf_len > 0 ? buf_len : 1);
+
+	if (result == NULL) {
+		return NULL;
+	}
+
+	if (!lha_reader_extract_into(reader, result, buf_len, length)) {
+		free(result);
+		return NULL;
+	}
+
+	// The data is only shorter than the buffer if a MacBinary header
+	// was stripped off.
+
+	if (*length < buf_len && *length > 0) {
+		smaller = realloc(result, *length);
+
+		if (smaller != NULL) {
+			result = smaller;
+		}
+	}
+
+	return result;
+}
+
+int lha_reader_check(LHAReader *reader,
+                     LHADecoderProgressCallback callback,
+                     void *callback_data)
+{
+	if (reader->curr_file_type != CURR_FILE_NORMAL) {
+		return 0;
+	}
+
+	// CRC checking of directories is not necessary.
+
+	if (!strcmp(reader->curr_file->compress_method,
+	            LHA_COMPRESS_TYPE_DIR)) {
+		return 1;
+	}
+
+	// Decode file.
+
+	return open_decoder(reader, callback, callback_data)
+	    && do_decode(reader, NULL, NULL);
+}
+
+/**
+ * Allocate a block to hold data for an output file.
+ *
+ * @param output         The output file.
+ * @return               Pointer to the new block, or NULL for failure.
+ */
+
+static WriteBlock *new_block(OutputFile *output)
+{
+	WriteBlock *block;
+
+	block = malloc(sizeof(WriteBlock) + output->buf_size);
+
+	if (block != NULL) {
+		block->fstream = output->fstream;
+		block->len = 0;
+		block->sparse = output->sparse;
+		block->success = 1;
+	}
+
+	return block;
+}
+
+/**
+ * Check whether data at the start of a buffer can be left as a hole
+ * in a sparse file.
+ *
+ * @param buf            Pointer to the data.
+ * @param buf_len        Length of the data, in bytes.
+ * @return               Non-zero if the first SPARSE_BLOCK_SIZE bytes
+ *                       are all zero.
+ */
+
+static int is_hole(const uint8_t *buf, size_t buf_len)
+{
+	return buf_len >= SPARSE_BLOCK_SIZE && buf[0] == 0
+	    && !memcmp(buf, buf + 1, SPARSE_BLOCK_SIZE - 1);
+}
+
+/**
+ * Write data to an output file.
+ *
+ * For a sparse file, runs of blocks of zeroes are skipped over
+ * instead. Blocks are aligned relative to the start of the data,
+ * which must be at an offset in the file that is a multiple of
+ * SPARSE_BLOCK_SIZE (see write_to_file).
+ *
+ * @param fstream        The output file.
+ * @param buf            Pointer to the data.
+ * @param buf_len        Length of the data, in bytes.
+ * @param sparse         Non-zero to skip blocks of zeroes.
+ * @return               Non-zero if the data was written successfully.
+ */
+
+static int write_data(FILE *fstream, const uint8_t *buf, size_t buf_len,
+                      int sparse)
+{
+	size_t nbytes;
+	int hole, result;
+
+	if (!sparse) {
+		return lha_arch_write(fstream, buf, buf_len);
+	}
+
+	while (buf_len > 0) {
+
+		// Find the run of blocks that are all holes, or all data.
+
+		hole = is_hole(buf, buf_len);
+		nbytes = 0;
+
+		do {
+			nbytes += SPARSE_BLOCK_SIZE;
+		} while (nbytes < buf_len
+		      && is_hole(buf + nbytes, buf_len - nbytes) == hole);
+
+		if (nbytes > buf_len) {
+			nbytes = buf_len;
+		}
+
+		if (hole) {
+			result = lha_arch_skip(fstream, nbytes);
+		} else {
+			result = lha_arch_write(fstream, buf, nbytes);
+		}
+
+		if (!result) {
+			return 0;
+		}
+
+		buf += nbytes;
+		buf_len -= nbytes;
+	}
+
+	return 1;
+}
+
+/**
+ * Write a block of data to its output file. This runs on the writer
+ * thread.
+ *
+ * @param data           Pointer to the @ref WriteBlock.
+ */
+
+static void run_write(void *data)
+{
+	WriteBlock *block = data;
+
+	block->success = write_data(block->fstream, (uint8_t *) (block + 1),
+	                            block->len, block->sparse);
+}
+
+/**
+ * Collect the oldest block passed to the writer thread, once it has
+ * been written.
+ *
+ * @param output         The output file.
+ * @return               Pointer to the block.
+ */
+
+static WriteBlock *collect_block(OutputFile *output)
+{
+	WriteBlock *block;
+
+	block = lha_work_queue_collect(output->writer, 1);
+
+	if (!block->success) {
+		output->failed = 1;
+	}
+
+	block->len = 0;
+
+	return block;
+}
+
+/**
+ * Wait for all blocks passed to the writer thread to be written.
+ *
+ * @param output         The output file.
+ */
+
+static void drain_output(OutputFile *output)
+{
+	if (output->writer == NULL) {
+		return;
+	}
+
+	while (lha_work_queue_pending(output->writer) > 0) {
+		free(collect_block(output));
+	}
+}
+
+/**
+ * Write out a block of data.
+ *
+ * @param output         The output file.
+ * @param block          The block.
+ * @return               Non-zero if the block was passed to the writer
+ *                       thread, in which case it must not be used until
+ *                       it has been collected again; zero if it was
+ *                       written immediately.
+ */
+
+static int write_block(OutputFile *output, WriteBlock *block)
+{
+	if (output->writer != NULL
+	 && lha_work_queue_add(output->writer, block, 1)) {
+		return 1;
+	}
+
+	// Earlier blocks must be written first, to keep the data in order.
+
+	drain_output(output);
+
+	if (!write_data(output->fstream, (uint8_t *) (block + 1),
+	                block->len, output->sparse)) {
+		output->failed = 1;
+	}
+
+	block->len = 0;
+
+	return 0;
+}
+
+/**
+ * Write out the block being filled, and start filling a new one.
+ *
+ * @param output         The output file.
+ * @return               Non-zero if all data has been written
+ *                       successfully so far.
+ */
+
+static int flush_output(OutputFile *output)
+{
+	WriteBlock *block;
+
+	if (!write_block(output, output->block)) {
+		return !output->failed;
+	}
+
+	// Once enough blocks are waiting to be written, wait for the oldest
+	// and reuse it.
+
+	block = NULL;
+
+	if (lha_work_queue_pending(output->writer) < WRITE_BEHIND_BLOCKS) {
+		block = new_block(output);
+	}
+
+	if (block == NULL) {
+		block = collect_block(output);
+	}
+
+	output->block = block;
+
+	return !output->failed;
+}
+
+/**
+ * Open an output file into which to decompress the current file.
+ *
+ * Space for the whole file is reserved up front, and a buffer is
+ * allocated to collect the decompressed data so that it can be
+ * written in large chunks. If the reader writes sparse files, no
+ * space is reserved, as it would be taken up by the holes too.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param filename       Name of the file to open.
+ * @param writer         Work queue of the writer thread with which to
+ *                       write the file in the background, or NULL to
+ *                       write it directly.
+ * @param hold           If non-zero, all of the data is kept in the
+ *                       buffer until it is written by the caller.
+ * @return               Pointer to the new output file, or NULL in
+ *                       case of failure.
+ */
+
+static OutputFile *open_output_file(LHAReader *reader, char *filename,
+                                    LHAWorkQueue *writer, int hold)
+{
+	OutputFile *output;
+	int unix_uid = -1, unix_gid = -1, unix_perms = -1;
+
+	if (LHA_FILE_HAVE_EXTRA(reader->curr_file, LHA_FILE_UNIX_UID_GID)) {
+		unix_uid = reader->curr_file->unix_uid;
+		unix_gid = reader->curr_file->unix_gid;
+	}
+
+	if (LHA_FILE_HAVE_EXTRA(reader->curr_file, LHA_FILE_UNIX_PERMS)) {
+		unix_perms = reader->curr_file->unix_perms;
+	}
+
+	output = malloc(sizeof(OutputFile));
+
+	if (output == NULL) {
+		return NULL;
+	}
+
+	output->fstream = lha_arch_fopen(filename, unix_uid,
+	                                 unix_gid, unix_perms);
+
+	if (output->fstream == NULL) {
+		free(output);
+		return NULL;
+	}
+
+	// There is no point allocating a buffer larger than the file.
+
+	output->buf_size = WRITE_BUFFER_SIZE;
+
+	if (reader->curr_file->length < output->buf_size) {
+		output->buf_size = (size_t) reader->curr_file->length;
+	}
+
+	if (output->buf_size == 0) {
+		output->buf_size = 1;
+	}
+
+	// To hold the whole file, the buffer is made one byte larger than
+	// the file, so that it never fills up and is written.
+
+	if (hold) {
+		output->buf_size = (size_t) reader->curr_file->length + 1;
+	}
+
+	output->writer = writer;
+	output->sparse = reader->sparse && !hold;
+	output->length = 0;
+	output->failed = 0;
+	output->block = new_block(output);
+
+	if (output->block == NULL) {
+		fclose(output->fstream);
+		free(output);
+		return NULL;
+	}
+
+	if (reader->curr_file->length >= PREALLOCATE_THRESHOLD
+	 && !output->sparse) {
+		lha_arch_preallocate(output->fstream,
+		                     reader->curr_file->length);
+	}
+
+	return output;
+}
+
+/**
+ * Sink callback used to write decompressed data to an output file.
+ *
+ * Data is always written at offsets in the file that are a multiple
+ * of the buffer size; the buffer is either WRITE_BUFFER_SIZE, or large
+ * enough for the whole file.
+ *
+ * @param buf            Pointer to the decompressed data.
+ * @param buf_len        Length of the data, in bytes.
+ * @param user_data      Pointer to the @ref OutputFile.
+ * @return               Non-zero if the data was written successfully.
+ */
+
+static int write_to_file(uint8_t *buf, size_t buf_len, void *user_data)
+{
+	OutputFile *output = user_data;
+	WriteBlock *block;
+	size_t nbytes;
+
+	output->length += buf_len;
+
+	while (buf_len > 0) {
+		block = output->block;
+
+		// If nothing is waiting in the buffer, whole chunks can be
+		// written straight from the decoder's buffer. This is not
+		// possible with a writer thread, as the decoder reuses its
+		// buffer.
+
+		if (output->writer == NULL && block->len == 0
+		 && buf_len >= output->buf_size) {
+			nbytes = buf_len - buf_len % output->buf_size;
+
+			if (!write_data(output->fstream, buf, nbytes,
+			                output->sparse)) {
+				return 0;
+			}
+		} else {
+			nbytes = output->buf_size - block->len;
+
+			if (nbytes > buf_len) {
+				nbytes = buf_len;
+			}
+
+			memcpy((uint8_t *) (block + 1) + block->len,
+			       buf, nbytes);
+			block->len += nbytes;
+
+			if (block->len == output->buf_size
+			 && !flush_output(output)) {
+				return 0;
+			}
+		}
+
+		buf += nbytes;
+		buf_len -= nbytes;
+	}
+
+	return 1;
+}
+
+/**
+ * Set file timestamps for the specified output file, through its handle.
+ *
+ * If possible, the more accurate Windows timestamp values are used;
+ * otherwise normal Unix timestamps are used.
+ *
+ * @param fstream  Handle of the file to set, which must be completely
+ *                 written.
+ * @param header   Pointer to file header structure containing the
+ *                 timestamps to set.
+ * @return         Non-zero if the timestamps were set successfully,
+ *                 or zero for failure.
+ */
+
+static int set_timestamps_from_header(FILE *fstream, LHAFileHeader *header)
+{
+#if LHA_ARCH == LHA_ARCH_WINDOWS
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_WINDOWS_TIMESTAMPS)) {
+		return lha_arch_fset_windows_timestamps(
+		    fstream,
+		    header->win_creation_time,
+		    header->win_modification_time,
+		    header->win_access_time
+		);
+	} else // ....
+#endif
+	if (header->timestamp != 0) {
+		return lha_arch_futime(fstream, header->timestamp);
+	} else {
+		return 1;
+	}
+}
+
+/**
+ * Close an output file, writing out any data still in its buffer.
+ *
+ * @param output         The output file.
+ * @param header         Header of the file, to set the timestamp of the
+ *                       file from, or NULL to not set it.
+ * @return               Non-zero if all data was written successfully.
+ */
+
+static int close_output_file(OutputFile *output, LHAFileHeader *header)
+{
+	int result;
+
+	if (output->block->len > 0 && write_block(output, output->block)) {
+		output->block = NULL;
+	}
+
+	drain_output(output);
+	free(output->block);
+
+	// If the file ends with a hole, it has not yet been extended to
+	// its full length.
+
+	if (output->sparse
+	 && !lha_arch_set_length(output->fstream, output->length)) {
+		output->failed = 1;
+	}
+
+	result = !output->failed;
+
+	// Set the timestamp through the handle now that everything has
+	// been written, rather than looking up the path again later.
+
+	if (result && header != NULL) {
+		set_timestamps_from_header(output->fstream, header);
+	}
+
+	if (fclose(output->fstream) != 0) {
+		result = 0;
+	}
+
+	free(output);
+
+	return result;
+}
+
+/**
+ * Set directory metadata.
+ *
+ * This is the second stage of directory extraction. Metadata (timestamps
+ * and permissions) should be set on a directory after the contents of
+ * the directory has been extracted.
+ *
+ * @param header     Pointer to file header structure containing the
+ *                   metadata to set.
+ * @param path       Path to the directory on which to set the metadata.
+ * @return           Non-zero for success, or zero for failure.
+ */
+
+static int set_directory_metadata(LHAFileHeader *header, char *path)
+{
+	int unix_uid = -1, unix_gid = -1, unix_perms = -1;
+	unsigned int timestamp;
+
+	timestamp = header->timestamp;
+
+#if LHA_ARCH == LHA_ARCH_WINDOWS
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_WINDOWS_TIMESTAMPS)) {
+		lha_arch_set_windows_timestamps(path,
+		                                header->win_creation_time,
+		                                header->win_modification_time,
+		                                header->win_access_time);
+		timestamp = 0;
+	}
+#endif
+
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_UID_GID)) {
+		unix_uid = header->unix_uid;
+		unix_gid = header->unix_gid;
+	}
+
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_PERMS)) {
+		unix_perms = header->unix_perms;
+	}
+
+	return lha_arch_set_dir_metadata(path, unix_uid, unix_gid,
+	                                 unix_perms, timestamp);
+}
+
+/**
+ * "Extract" (create) a directory.
+ *
+ * The current file is assumed to be a directory. This is the first
+ * stage in extracting a directory; after the directory is created,
+ * it is added to the directory stack so that the metadata apply stage
+ * runs later. (If the LHA_READER_DIR_PLAIN policy is used, metadata
+ * is just applied now).
+ *
+ * @param reader    Pointer to the LHA reader structure.
+ * @param path      Path to the directory, or NULL to use the path from
+ *                  the file header.
+ * @return          Non-zero for success, or zero for failure.
+ */
+
+static int extract_directory(LHAReader *reader, char *path)
+{
+	LHAFileHeader *header;
+	unsigned int mode;
+
+	header = reader->curr_file;
+
+	// If path is not specified, use the path from the file header.
+
+	if (path == NULL) {
+		path = header->path;
+	}
+
+	// Create directory. If there are permissions to be set, create
+	// the directory with minimal permissions limited to the running
+	// user. Otherwise use the default umask.
+
+	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_PERMS)) {
+		mode = 0700;
+	} else {
+		mode = 0777;
+	}
+
+	if (!lha_arch_mkdir(path, mode)) {
+
+		// If the attempt to create the directory failed, it may
+		// be because the directory already exists. Return success
+		// if this is the case; it isn't really an error.
+
+		return lha_arch_exists(path) == LHA_FILE_DIRECTORY;
+	}
+
+	// The directory has been created, but the metadata has not yet
+	// been applied. It depends on the directory policy how this
+	// is handled. If we are using LHA_READER_DIR_PLAIN, set
+	// metadata now. Otherwise, save the directory for later.
+
+	if (reader->dir_policy == LHA_READER_DIR_PLAIN) {
+		set_directory_metadata(header, path);
+	} else {
+		lha_file_header_add_ref(header);
+		header->_next = reader->dir_stack;
+		reader->dir_stack = header;
+	}
+
+	return 1;
+}
+
+/**
+ * Extract the current file by making it from an earlier copy that has
+ * already been extracted (see lha_reader_set_dedup).
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param filename       Filename into which to extract the file.
+ * @return               Non-zero if the file was successfully extracted,
+ *                       or zero if it must be decompressed instead.
+ */
+
+static int extract_copy(LHAReader *reader, char *filename)
+{
+	OutputFile *output;
+	FILE *input;
+	uint8_t buf[COPY_BUFFER_SIZE];
+	char *source;
+	size_t nbytes, total;
+	int entry;
+
+	entry = copy_source(reader);
+
+	if (entry < 0) {
+		return 0;
+	}
+
+	source = reader->dedup_paths[reader->dedup_slots[entry] - 1];
+
+	if (source == NULL || !strcmp(source, filename)) {
+		return 0;
+	}
+
+	if (reader->dedup_policy == LHA_READER_DEDUP_HARDLINK) {
+		return lha_arch_hardlink(filename, source);
+	}
+
+	input = lha_arch_fopen_read(source);
+
+	if (input == NULL) {
+		return 0;
+	}
+
+	output = open_output_file(reader, filename, NULL, 0);
+
+	if (output == NULL) {
+		fclose(input);
+		return 0;
+	}
+
+	if (reader->dedup_policy != LHA_READER_DEDUP_REFLINK
+	 || !lha_arch_reflink(output->fstream, input)) {
+		total = 0;
+
+		do {
+			nbytes = fread(buf, 1, sizeof(buf), input);
+
+			if (!write_to_file(buf, nbytes, output)) {
+				output->failed = 1;
+				break;
+			}
+
+			total += nbytes;
+		} while (nbytes > 0);
+
+		// The earlier file may have been changed since it was
+		// extracted.
+
+		if (total != reader->curr_file->length) {
+			output->failed = 1;
+		}
+	}
+
+	fclose(input);
+
+	return close_output_file(output, reader->curr_file);
+}
+
+/**
+ * Extract the current file.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param filename       Filename into which to extract the file, or NULL
+ *                       to use the filename from the file header.
+ * @param callback       Callback function to invoke to track progress.
+ * @param callback_data  Extra pointer to pass to the callback function.
+ * @return               Non-zero if the file was successfully extracted,
+ *                       or zero for failure.
+ */
+
+static int extract_file(LHAReader *reader, char *filename,
+                        LHADecoderProgressCallback callback,
+                        void *callback_data)
+{
+	OutputFile *output;
+	char *tmp_filename = NULL;
+	int result;
+
+	// Construct filename?
+
+	if (filename == NULL) {
+		tmp_filename = lha_file_header_full_path(reader->curr_file);
+
+		if (tmp_filename == NULL) {
+			return 0;
+		}
+
+		filename = tmp_filename;
+	}
+
+	// Create decoder. If the file cannot be created, there is no
+	// need to even create an output file. If successful, open the
+	// output file and decode.
+
+	result = 0;
+
+	// For a copy of an earlier file, progress is reported as a
+	// single block.
+
+	if (extract_copy(reader, filename)) {
+		if (callback != NULL) {
+			callback(0, 1, callback_data);
+			callback(1, 1, callback_data);
+		}
+
+		result = 1;
+	} else if (open_decoder(reader, callback, callback_data)) {
+
+		output = open_output_file(reader, filename, reader->writer, 0);
+
+		if (output != NULL) {
+			result = do_decode(reader, write_to_file, output);
+
+			// The timestamp is only set if the file decoded
+			// successfully.
+
+			if (!close_output_file(output, result ?
+			                       reader->curr_file : NULL)) {
+				result = 0;
+			}
+		}
+	}
+
+	record_output(reader, reader->curr_entry, filename, result);
+
+	free(tmp_filename);
+
+	return result;
+}
+
+/**
+ * Determine whether a header contains a "dangerous" symbolic link.
+ *
+ * Symbolic links that begin with '/' or contain '..' as a path are
+ * Potentially dangerous and could potentially be used to overwrite
+ * arbitrary files on the filesystem. They therefore need to be
+ * treated specially.
+ *
+ * @param header         Pointer to a header structure defining a symbolic
+ *                       link.
+ * @return               Non-zero if the symbolic link is potentially
+ *                       dangerous.
+ */
+
+static int is_dangerous_symlink(LHAFileHeader *header)
+{
+	char *path_start;
+	char *p;
+
+	if (header->symlink_target == NULL) {
+		return 0;
+	}
+
+	// Absolute path symlinks could be used to point to arbitrary
+	// filesystem locations.
+
+	if (header->symlink_target[0] == '/') {
+		return 1;
+	}
+
+	// Check for paths containing '..'.
+
+	path_start = header->symlink_target;
+
+	for (p = header->symlink_target; *p != '\0'; ++p) {
+		if (*p == '/') {
+			if ((p - path_start) == 2
+			 && path_start[0] == '.' && path_start[1] == '.') {
+				return 1;
+			}
+
+			path_start = p + 1;
+		}
+	}
+
+	// The path might also end with '..' (no terminating /)
+
+	if ((p - path_start) == 2
+	 && path_start[0] == '.' && path_start[1] == '.') {
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the length of a path defined by a file header.
+ *
+ * @param header         The file header structure.
+ * @return               Length of the header in bytes.
+ */
+
+static size_t file_header_path_len(LHAFileHeader *header)
+{
+	size_t result;
+
+	result = 0;
+
+	if (header->path != NULL) {
+		result += strlen(header->path);
+	}
+	if (header->filename != NULL) {
+		result += strlen(header->filename);
+	}
+
+	return result;
+}
+
+/**
+ * Create a "placeholder" symbolic link.
+ *
+ * When a "dangerous" symbolic link is extracted, instead of creating it
+ * immediately, create a "placeholder" empty file to go in its place, and
+ * place it into the deferred_symlinks list to be created later.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param filename       Filename into which to extract the symlink.
+ * @return               Non-zero if the symlink was extracted successfully,
+ *                       or zero for failure.
+ */
+
+static int extract_placeholder_symlink(LHAReader *reader, char *filename)
+{
+	LHAFileHeader **rover;
+	FILE *f;
+
+	f = lha_arch_fopen(filename, -1, -1, 0600);
+
+	if (f == NULL) {
+		return 0;
+	}
+
+	fclose(f);
+
+	// Insert this header into the list of deferred symbolic links.
+	// The list must be maintained in order of decreasing path length,
+	// so that one symbolic link cannot depend on another. For example:
+	//
+	//    etc  ->  /etc
+	//    etc/passwd  -> /malicious_path/passwd
+
+	rover = &reader->deferred_symlinks;
+
+	while (*rover != NULL
+	    && file_header_path_len(*rover)
+	     > file_header_path_len(reader->curr_file)) {
+		rover = &(*rover)->_next;
+	}
+
+	reader->curr_file->_next = *rover;
+	*rover = reader->curr_file;
+
+	// Save reference to the header so it won't be freed.
+
+	lha_file_header_add_ref(reader->curr_file);
+
+	return 1;
+}
+
+/**
+ * Extract a Unix symbolic link.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param filename       Filename into which to extract the symlink, or NULL
+ *                       to use the filename from the file header.
+ * @return               Non-zero if the symlink was extracted successfully,
+ *                       or zero for failure.
+ */
+
+static int extract_symlink(LHAReader *reader, char *filename)
+{
+	char *tmp_filename = NULL;
+	int result;
+
+	// Construct filename?
+
+	if (filename == NULL) {
+		tmp_filename = lha_file_header_full_path(reader->curr_file);
+
+		if (tmp_filename == NULL) {
+			return 0;
+		}
+
+		filename = tmp_filename;
+	}
+
+	if (reader->curr_file_type == CURR_FILE_NORMAL
+	 && is_dangerous_symlink(reader->curr_file)) {
+		return extract_placeholder_symlink(reader, filename);
+	}
+
+	result = lha_arch_symlink(filename, reader->curr_file->symlink_target);
+	record_output(reader, -1, filename, 0);
+
+	// TODO: Set symlink timestamp.
+
+	free(tmp_filename);
+
+	return result;
+}
+
+/**
+ * Extract a "normal" file.
+ *
+ * This just extracts the file header most recently read by the
+ * BasicReader.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param filename       Filename into which to extract the file, or NULL
+ *                       to use the filename from the file header.
+ * @param callback       Callback function to invoke to track progress.
+ * @param callback_data  Extra pointer to pass to the callback function.
+ * @return               Non-zero if the file was successfully extracted,
+ *                       or zero for failure.
+ */
+
+static int extract_normal(LHAReader *reader,
+                          char *filename,
+                          LHADecoderProgressCallback callback,
+                          void *callback_data)
+{
+	if (strcmp(reader->curr_file->compress_method,
+	           LHA_COMPRESS_TYPE_DIR) != 0) {
+		return extract_file(reader, filename, callback, callback_data);
+	} else if (reader->curr_file->symlink_target != NULL) {
+		return extract_symlink(reader, filename);
+	} else {
+		return extract_directory(reader, filename);
+	}
+}
+
+int lha_reader_extract(LHAReader *reader,
+                       char *filename,
+                       LHADecoderProgressCallback callback,
+                       void *callback_data)
+{
+	// All of the header is needed to set the file's metadata.
+
+	if (reader->curr_file != NULL
+	 && !lha_file_header_decode_lazy(reader->curr_file)) {
+		return 0;
+	}
+
+	switch (reader->curr_file_type) {
+
+		case CURR_FILE_NORMAL:
+			return extract_normal(reader, filename, callback,
+			                      callback_data);
+
+		case CURR_FILE_FAKE_DIR:
+			if (filename == NULL) {
+				filename = reader->curr_file->path;
+			}
+			set_directory_metadata(reader->curr_file, filename);
+			return 1;
+
+		case CURR_FILE_DEFERRED_SYMLINK:
+			return extract_symlink(reader, filename);
+
+		case CURR_FILE_START:
+		case CURR_FILE_EOF:
+			break;
+	}
+
+	return 0;
+}
+
+int lha_reader_current_is_fake(LHAReader *reader)
+{
+	return reader->curr_file_type == CURR_FILE_FAKE_DIR
+	    || reader->curr_file_type == CURR_FILE_DEFERRED_SYMLINK;
+}
+
+
+/**
+ * Decompress a file in the background. This runs on a worker thread.
+ *
+ * @param data           Pointer to the @ref ExtractJob.
+ */
+
+static void run_job(void *data)
+{
+	ExtractJob *job = data;
+
+	lha_decoder_set_limits(job->decoder, &job->limits);
+
+	if (job->output == NULL) {
+		job->success = decode_file(job->decoder, job->header,
+		                           NULL, NULL);
+		return;
+	}
+
+	job->success = decode_file(job->decoder, job->header,
+	                           write_to_file, job->output);
+
+	if (!close_output_file(job->output,
+	                       job->success ? job->header : NULL)) {
+		job->success = 0;
+	}
+
+	job->output = NULL;
+}
+
+/**
+ * Free the resources used to decompress a file in the background.
+ *
+ * @param job            The job.
+ */
+
+static void free_job_resources(ExtractJob *job)
+{
+	if (job->output != NULL) {
+		close_output_file(job->output, NULL);
+		job->output = NULL;
+	}
+	if (job->decoder != NULL) {
+		lha_decoder_free(job->decoder);
+		job->decoder = NULL;
+	}
+	if (job->reader != NULL) {
+		lha_basic_reader_free(job->reader);
+		job->reader = NULL;
+	}
+	if (job->stream != NULL) {
+		lha_input_stream_free(job->stream);
+		job->stream = NULL;
+	}
+
+	free(job->filename);
+	job->filename = NULL;
+}
+
+/**
+ * Finish a job once the file has been extracted, invoking the callback
+ * function and freeing the job.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param job            The job.
+ */
+
+static void finish_job(LHAReader *reader, ExtractJob *job)
+{
+	if (job->decoder != NULL) {
+		note_limit_exceeded(reader, job->decoder);
+	}
+
+	if (job->filename != NULL) {
+		record_output(reader, job->entry, job->filename,
+		              job->success);
+	}
+
+	free_job_resources(job);
+
+	if (!job->success) {
+		++reader->failures;
+	}
+
+	if (job->callback != NULL) {
+		job->callback(job->header, job->success, job->callback_data);
+	}
+
+	lha_file_header_free(job->header);
+	free(job);
+}
+
+/**
+ * Add a job to the list of jobs that have not yet finished.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param job            The job.
+ * @param run            If non-zero, run the job on a worker thread;
+ *                       otherwise, the job has already finished.
+ * @return               Non-zero for success, or zero for failure.
+ */
+
+static int add_job(LHAReader *reader, ExtractJob *job, int run)
+{
+	if (!lha_work_queue_add(reader->workers, job, run)) {
+		return 0;
+	}
+
+	job->next = NULL;
+	*reader->jobs_end = job;
+	reader->jobs_end = &job->next;
+
+	return 1;
 }
 
-int lha_reader_check(LHAReader *reader,
-                     LHADecoderProgressCallback callback,
-                     void *callback_data)
+/**
+ * Finish all jobs that have been completed, in order, waiting if
+ * necessary until no more than the specified number remain.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param max_jobs       Maximum number of jobs to leave unfinished.
+ */
+
+static void collect_jobs(LHAReader *reader, unsigned int max_jobs)
 {
-	if (reader->curr_file_type != CURR_FILE_NORMAL) {
+	ExtractJob *job;
+
+	while (reader->jobs != NULL) {
+		job = lha_work_queue_collect(
+		    reader->workers,
+		    lha_work_queue_pending(reader->workers) > max_jobs);
+
+		if (job == NULL) {
+			break;
+		}
+
+		// Jobs are collected in the order they were added.
+
+		reader->jobs = job->next;
+
+		if (reader->jobs == NULL) {
+			reader->jobs_end = &reader->jobs;
+		}
+
+		finish_job(reader, job);
+	}
+}
+
+/**
+ * Set the filename for a job that extracts the current file.
+ *
+ * @param reader         Pointer to the LHA reader structure.
+ * @param job            The job for the file.
+ * @param filename       Filename to extract to, or NULL to use the
+ *                       path from the file header.
+ * @return               Non-zero for success, or zero for failure.
+ */
+
+static int choose_filename(LHAReader *reader, ExtractJob *job,
+                           char *filename)
+{
+	ExtractJob *other;
+
+	if (filename != NULL) {
+		job->filename = strdup(filename);
+	} else {
+		job->filename = lha_file_header_full_path(reader->curr_file);
+	}
+
+	if (job->filename == NULL) {
 		return 0;
 	}
 
-	// CRC checking of directories is not necessary.
+	// If an earlier file with the same name is still being written,
+	// wait for it to finish, so that the later file replaces it.
 
-	if (!strcmp(reader->curr_file->compress_method,
-	            LHA_COMPRESS_TYPE_DIR)) {
-		return 1;
+	for (other = reader->jobs; other != NULL; other = other->next) {
+		if (other->filename != NULL
+		 && !strcmp(other->filename, job->filename)) {
+			lha_reader_flush(reader);
+			return 1;
+		}
 	}
 
-	// Decode file.
+	for (other = reader->uring_jobs; other != NULL; other = other->next) {
+		if (!strcmp(other->filename, job->filename)) {
+			lha_reader_flush(reader);
+			return 1;
+		}
+	}
 
-	return open_decoder(reader, callback, callback_data)
-	    && do_decode(reader, NULL);
+	return 1;
 }
 
 /**
- * Open an output stream into which to decompress the current file.
+ * Try to start decompressing the current file in the background.
  *
  * @param reader         Pointer to the LHA reader structure.
- * @param filename       Name of the file to open.
- * @return               FILE handle of the opened file, or NULL in
- *                       case of failure.
+ * @param job            The job for the file.
+ * @param extract        If non-zero, extract the file; otherwise, just
+ *                       check it.
+ * @param filename       Filename to extract to, or NULL to use the
+ *                       path from the file header.
+ * @return               Non-zero if the job was started, or zero if the
+ *                       file must be processed immediately instead.
  */
 
-static FILE *open_output_file(LHAReader *reader, char *filename)
+static int start_job(LHAReader *reader, ExtractJob *job, int extract,
+                     char *filename)
 {
-	int unix_uid = -1, unix_gid = -1, unix_perms = -1;
+	LHAFileHeader *header;
 
-	if (LHA_FILE_HAVE_EXTRA(reader->curr_file, LHA_FILE_UNIX_UID_GID)) {
-		unix_uid = reader->curr_file->unix_uid;
-		unix_gid = reader->curr_file->unix_gid;
+	header = reader->curr_file;
+
+	// Only plain compressed files can be extracted in the background.
+	// Stripping MacBinary headers (see open_window) is left to the
+	// normal extract path.
+
+	if (reader->curr_file_type != CURR_FILE_NORMAL
+	 || reader->decoder != NULL
+	 || !strcmp(header->compress_method, LHA_COMPRESS_TYPE_DIR)
+	 || header->os_type == LHA_OS_TYPE_MACOS
+	 || !header_within_limits(reader)) {
+		return 0;
 	}
 
-	if (LHA_FILE_HAVE_EXTRA(reader->curr_file, LHA_FILE_UNIX_PERMS)) {
-		unix_perms = reader->curr_file->unix_perms;
+	if (extract && !choose_filename(reader, job, filename)) {
+		return 0;
+	}
+
+	// The compressed data is read through a separate stream, so that
+	// the main stream can continue on to the next file.
+
+	job->stream = lha_input_stream_new_range(
+	    reader->stream, lha_basic_reader_curr_data_offset(reader->reader),
+	    header->compressed_length);
+
+	if (job->stream == NULL) {
+		return 0;
+	}
+
+	job->reader = lha_basic_reader_new_for_file(job->stream, header);
+
+	if (job->reader == NULL) {
+		return 0;
+	}
+
+	job->decoder = lha_basic_reader_decode(job->reader);
+
+	if (job->decoder == NULL) {
+		return 0;
+	}
+
+	job->limits = reader->limits;
+
+	// The output file is opened here rather than on the worker
+	// thread, so that files are created in archive order.
+
+	if (extract) {
+		job->output = open_output_file(reader, job->filename, NULL, 0);
+
+		if (job->output == NULL) {
+			return 0;
+		}
 	}
 
-	return lha_arch_fopen(filename, unix_uid, unix_gid, unix_perms);
+	return add_job(reader, job, 1);
 }
 
 /**
- * Set file timestamps for the specified file.
+ * Create a job for the current file.
  *
- * If possible, the more accurate Windows timestamp values are used;
- * otherwise normal Unix timestamps are used.
+ * @param reader         Pointer to the LHA reader structure.
+ * @param callback       Callback function to invoke when the job is
+ *                       finished.
+ * @param callback_data  Extra data to pass to the callback function.
+ * @return               Pointer to the new job, or NULL for failure.
+ */
+
+static ExtractJob *new_job(LHAReader *reader,
+                           LHAReaderExtractCallback callback,
+                           void *callback_data)
+{
+	ExtractJob *job;
+
+	job = calloc(1, sizeof(ExtractJob));
+
+	if (job == NULL) {
+		return NULL;
+	}
+
+	lha_file_header_add_ref(reader->curr_file);
+	job->header = reader->curr_file;
+	job->callback = callback;
+	job->callback_data = callback_data;
+	job->entry = reader->curr_entry;
+
+	return job;
+}
+
+/**
+ * Finish a job for a file that has been processed immediately. If
+ * earlier files are still being processed in the background, the job
+ * waits for them so that callbacks are still invoked in order.
  *
- * @param path     Path to the file or directory to set.
- * @param header   Pointer to file header structure containing the
- *                 timestamps to set.
- * @return         Non-zero if the timestamps were set successfully,
- *                 or zero for failure.
+ * @param reader         Pointer to the LHA reader structure.
+ * @param job            The job.
+ * @return               Non-zero if the file was processed
+ *                       successfully.
  */
 
-static int set_timestamps_from_header(char *path, LHAFileHeader *header)
+static int complete_job(LHAReader *reader, ExtractJob *job)
 {
-#if LHA_ARCH == LHA_ARCH_WINDOWS
-	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_WINDOWS_TIMESTAMPS)) {
-		return lha_arch_set_windows_timestamps(
-		    path,
-		    header->win_creation_time,
-		    header->win_modification_time,
-		    header->win_access_time
-		);
-	} else // ....
-#endif
-	if (header->timestamp != 0) {
-		return lha_arch_utime(path, header->timestamp);
+	int result;
+
+	result = job->success;
+
+	if (reader->jobs != NULL && add_job(reader, job, 0)) {
+		collect_jobs(reader, reader->max_jobs);
 	} else {
-		return 1;
+		lha_reader_flush(reader);
+		finish_job(reader, job);
 	}
+
+	return result;
 }
 
 /**
- * Set directory metadata.
- *
- * This is the second stage of directory extraction. Metadata (timestamps
- * and permissions) should be set on a directory after the contents of
- * the directory has been extracted.
+ * Finish the oldest file being written through io_uring, once its
+ * write has completed: set its timestamp, close it and finish its job.
  *
- * @param header     Pointer to file header structure containing the
- *                   metadata to set.
- * @param path       Path to the directory on which to set the metadata.
- * @return           Non-zero for success, or zero for failure.
+ * @param reader         Pointer to the LHA reader structure.
  */
 
-static int set_directory_metadata(LHAFileHeader *header, char *path)
+static void finish_uring_job(LHAReader *reader)
 {
-	// Set timestamp:
+	ExtractJob *job;
+	OutputFile *output;
 
-	set_timestamps_from_header(path, header);
+	job = reader->uring_jobs;
+	reader->uring_jobs = job->next;
 
-	// Set owner and group:
+	if (reader->uring_jobs == NULL) {
+		reader->uring_jobs_end = &reader->uring_jobs;
+	}
 
-	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_UID_GID)) {
-		if (!lha_arch_chown(path, header->unix_uid,
-		                    header->unix_gid)) {
-			// On most Unix systems, only root can change
-			// ownership. But if we can't change ownership,
-			// it isn't a fatal error. Ignore the failure
-			// and continue.
+	--reader->uring_pending;
 
-			// TODO: Implement some kind of alternate handling
-			// here?
-			/* return 0; */
-		}
-	}
+	// A short write is treated as a failure, as it only happens if
+	// the disk is full.
 
-	// Set permissions on directory:
+	output = job->output;
 
-	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_PERMS)) {
-		if (!lha_arch_chmod(path, header->unix_perms)) {
-			return 0;
-		}
+	if (job->write_result < 0
+	 || (size_t) job->write_result != output->block->len) {
+		output->failed = 1;
 	}
 
-	return 1;
+	output->block->len = 0;
+	job->success = close_output_file(output, job->header);
+	job->output = NULL;
+
+	finish_job(reader, job);
 }
 
 /**
- * "Extract" (create) a directory.
+ * Finish the files being written through io_uring whose writes have
+ * completed, in order, waiting if necessary until no more than the
+ * specified number remain.
  *
- * The current file is assumed to be a directory. This is the first
- * stage in extracting a directory; after the directory is created,
- * it is added to the directory stack so that the metadata apply stage
- * runs later. (If the LHA_READER_DIR_PLAIN policy is used, metadata
- * is just applied now).
+ * @param reader         Pointer to the LHA reader structure.
+ * @param max_pending    Maximum number of files to leave unfinished.
+ */
+
+static void collect_uring_jobs(LHAReader *reader, unsigned int max_pending)
+{
+	ExtractJob *job;
+	void *data;
+	int result;
+
+	for (;;) {
+		while (lha_uring_complete(reader->uring, 0, &data, &result)) {
+			job = data;
+			job->written = 1;
+			job->write_result = result;
+		}
+
+		while (reader->uring_jobs != NULL
+		    && reader->uring_jobs->written) {
+			finish_uring_job(reader);
+		}
+
+		if (reader->uring_pending <= max_pending) {
+			break;
+		}
+
+		// Wait for another write to complete. This only fails if
+		// the kernel refuses the request, in which case the
+		// oldest write is treated as having failed.
+
+		if (lha_uring_complete(reader->uring, 1, &data, &result)) {
+			job = data;
+			job->written = 1;
+			job->write_result = result;
+		} else {
+			reader->uring_jobs->written = 1;
+			reader->uring_jobs->write_result = -1;
+		}
+	}
+}
+
+/**
+ * Try to extract the current file, writing it through io_uring. The
+ * file is decompressed immediately into a buffer that holds all of it;
+ * the write is then queued and the file is finished once it completes.
  *
- * @param reader    Pointer to the LHA reader structure.
- * @param path      Path to the directory, or NULL to use the path from
- *                  the file header.
- * @return          Non-zero for success, or zero for failure.
+ * @param reader         Pointer to the LHA reader structure.
+ * @param job            The job for the file.
+ * @param filename       Filename to extract to, or NULL to use the
+ *                       path from the file header.
+ * @return               Non-zero if the file was queued, or zero if the
+ *                       file must be extracted normally instead.
  */
 
-static int extract_directory(LHAReader *reader, char *path)
+static int start_uring_job(LHAReader *reader, ExtractJob *job,
+                           char *filename)
 {
 	LHAFileHeader *header;
-	unsigned int mode;
+	WriteBlock *block;
 
 	header = reader->curr_file;
 
-	// If path is not specified, use the path from the file header.
+	if (reader->uring == NULL
+	 || reader->curr_file_type != CURR_FILE_NORMAL
+	 || reader->decoder != NULL
+	 || !strcmp(header->compress_method, LHA_COMPRESS_TYPE_DIR)
+	 || header->length > URING_MAX_FILE_SIZE) {
+		return 0;
+	}
 
-	if (path == NULL) {
-		path = header->path;
+	if (!choose_filename(reader, job, filename)) {
+		return 0;
 	}
 
-	// Create directory. If there are permissions to be set, create
-	// the directory with minimal permissions limited to the running
-	// user. Otherwise use the default umask.
+	// The caller falls back to extracting the file normally, which
+	// opens its own decoder, so the decoder must not be left open if
+	// anything fails here.
 
-	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_PERMS)) {
-		mode = 0700;
-	} else {
-		mode = 0777;
+	if (!open_decoder(reader, NULL, NULL)) {
+		close_decoder(reader);
+		return 0;
 	}
 
-	if (!lha_arch_mkdir(path, mode)) {
+	job->output = open_output_file(reader, job->filename, NULL, 1);
 
-		// If the attempt to create the directory failed, it may
-		// be because the directory already exists. Return success
-		// if this is the case; it isn't really an error.
+	if (job->output == NULL) {
+		close_decoder(reader);
+		return 0;
+	}
 
-		return lha_arch_exists(path) == LHA_FILE_DIRECTORY;
+	// If the file fails to decompress, whatever was decoded is still
+	// written, as it would be when extracting normally.
+
+	block = job->output->block;
+
+	if (!do_decode(reader, write_to_file, job->output)) {
+		job->output->failed = 1;
 	}
 
-	// The directory has been created, but the metadata has not yet
-	// been applied. It depends on the directory policy how this
-	// is handled. If we are using LHA_READER_DIR_PLAIN, set
-	// metadata now. Otherwise, save the directory for later.
+	// Make space for the file if too many are already in flight.
 
-	if (reader->dir_policy == LHA_READER_DIR_PLAIN) {
-		set_directory_metadata(header, path);
+	collect_uring_jobs(reader, URING_MAX_FILES - 1);
+
+	// If the write cannot be queued, write the file directly instead.
+
+	job->written = 0;
+
+	if (block->len == 0
+	 || !lha_uring_write(reader->uring, job->output->fstream,
+	                     block + 1, block->len, 0, job)) {
+		job->written = 1;
+		job->write_result = (int) fwrite(block + 1, 1, block->len,
+		                                 job->output->fstream);
+	}
+
+	// Writes are submitted to the kernel in batches. Nothing is
+	// waiting for them until more files are in flight than this, or
+	// the reader is flushed.
+
+	job->next = NULL;
+	*reader->uring_jobs_end = job;
+	reader->uring_jobs_end = &job->next;
+	++reader->uring_pending;
+
+	if ((reader->uring_pending % URING_SUBMIT_BATCH) == 0) {
+		lha_uring_submit(reader->uring);
+	}
+
+	return 1;
+}
+
+int lha_reader_set_workers(LHAReader *reader, unsigned int num_workers)
+{
+	lha_reader_flush(reader);
+
+	if (reader->workers != NULL) {
+		lha_work_queue_free(reader->workers);
+		reader->workers = NULL;
+	}
+
+	if (num_workers == 0) {
+		num_workers = lha_arch_num_cpus();
+	}
+
+	if (num_workers <= 1) {
+		return 1;
+	}
+
+	reader->workers = lha_work_queue_new(run_job, num_workers);
+	reader->max_jobs = num_workers * JOBS_PER_WORKER;
+
+	return reader->workers != NULL;
+}
+
+void lha_reader_set_sparse(LHAReader *reader, int enable)
+{
+	reader->sparse = enable;
+}
+
+void lha_reader_set_two_stage(LHAReader *reader, size_t min_length)
+{
+	reader->two_stage_length = min_length;
+}
+
+void lha_reader_monitor_bytes(LHAReader *reader,
+                              LHADecoderByteProgressCallback callback,
+                              void *callback_data)
+{
+	reader->byte_progress_callback = callback;
+	reader->byte_progress_callback_data = callback_data;
+}
+
+int lha_reader_set_cache(LHAReader *reader, LHADecodeCache *cache,
+                         uint64_t archive_id)
+{
+	if (reader->curr_file_type != CURR_FILE_START) {
+		return 0;
+	}
+
+	reader->cache = cache;
+	reader->cache_id = archive_id;
+
+	return 1;
+}
+
+void lha_reader_set_limits(LHAReader *reader,
+                           const LHADecoderLimits *limits)
+{
+	if (limits != NULL) {
+		reader->limits = *limits;
 	} else {
-		lha_file_header_add_ref(header);
-		header->_next = reader->dir_stack;
-		reader->dir_stack = header;
+		memset(&reader->limits, 0, sizeof(LHADecoderLimits));
+	}
+
+	reader->limit_exceeded = LHA_DECODER_LIMIT_NONE;
+}
+
+LHADecoderLimit lha_reader_limit_exceeded(LHAReader *reader)
+{
+	if (reader->decoder != NULL) {
+		note_limit_exceeded(reader, reader->decoder);
+	}
+
+	return reader->limit_exceeded;
+}
+
+void lha_reader_set_fast_scan(LHAReader *reader, int enable)
+{
+	reader->fast_scan = enable;
+	lha_basic_reader_set_scan(reader->reader, enable);
+}
+
+int lha_reader_decode_header(LHAReader *reader)
+{
+	if (reader->curr_file == NULL) {
+		return 0;
 	}
 
-	return 1;
+	return lha_file_header_decode_lazy(reader->curr_file);
 }
 
-/**
- * Extract the current file.
- *
- * @param reader         Pointer to the LHA reader structure.
- * @param filename       Filename into which to extract the file, or NULL
- *                       to use the filename from the file header.
- * @param callback       Callback function to invoke to track progress.
- * @param callback_data  Extra pointer to pass to the callback function.
- * @return               Non-zero if the file was successfully extracted,
- *                       or zero for failure.
- */
-
-static int extract_file(LHAReader *reader, char *filename,
-                        LHADecoderProgressCallback callback,
-                        void *callback_data)
+int lha_reader_use_header_arena(LHAReader *reader)
 {
-	FILE *fstream;
-	char *tmp_filename = NULL;
-	int result;
+	return lha_basic_reader_use_arena(reader->reader);
+}
 
-	// Construct filename?
+// Add the details of a file to a batch. Returns zero if its name does
+// not fit in the batch's name buffer.
 
-	if (filename == NULL) {
-		tmp_filename = lha_file_header_full_path(reader->curr_file);
+static int add_to_batch(LHAReader *reader, LHAHeaderBatch *batch,
+                        unsigned int index, LHAFileHeader *header)
+{
+	size_t path_len, filename_len;
+	char *name;
 
-		if (tmp_filename == NULL) {
+	if (batch->names != NULL) {
+		path_len = header->path != NULL ? strlen(header->path) : 0;
+		filename_len = header->filename != NULL
+		             ? strlen(header->filename) : 0;
+
+		if (batch->names_size - batch->names_used
+		      < path_len + filename_len + 1) {
 			return 0;
 		}
 
-		filename = tmp_filename;
-	}
-
-	// Create decoder. If the file cannot be created, there is no
-	// need to even create an output file. If successful, open the
-	// output file and decode.
+		name = batch->names + batch->names_used;
 
-	result = 0;
+		if (path_len > 0) {
+			memcpy(name, header->path, path_len);
+		}
 
-	if (open_decoder(reader, callback, callback_data)) {
+		if (filename_len > 0) {
+			memcpy(name + path_len, header->filename, filename_len);
+		}
 
-		fstream = open_output_file(reader, filename);
+		name[path_len + filename_len] = '\0';
 
-		if (fstream != NULL) {
-			result = do_decode(reader, fstream);
-			fclose(fstream);
+		if (batch->name_offsets != NULL) {
+			batch->name_offsets[index] = batch->names_used;
 		}
+
+		batch->names_used += path_len + filename_len + 1;
 	}
 
-	// Set timestamp on file:
+	if (batch->lengths != NULL) {
+		batch->lengths[index] = header->length;
+	}
 
-	if (result) {
-		set_timestamps_from_header(filename, reader->curr_file);
+	if (batch->compressed_lengths != NULL) {
+		batch->compressed_lengths[index] = header->compressed_length;
 	}
 
-	free(tmp_filename);
+	if (batch->crcs != NULL) {
+		batch->crcs[index] = header->crc;
+	}
 
-	return result;
-}
+	if (batch->methods != NULL) {
+		memcpy(batch->methods[index], header->compress_method,
+		       sizeof(header->compress_method));
+	}
 
-/**
- * Determine whether a header contains a "dangerous" symbolic link.
- *
- * Symbolic links that begin with '/' or contain '..' as a path are
- * Potentially dangerous and could potentially be used to overwrite
- * arbitrary files on the filesystem. They therefore need to be
- * treated specially.
- *
- * @param header         Pointer to a header structure defining a symbolic
- *                       link.
- * @return               Non-zero if the symbolic link is potentially
- *                       dangerous.
- */
+	if (batch->timestamps != NULL) {
+		batch->timestamps[index] = header->timestamp;
+	}
 
-static int is_dangerous_symlink(LHAFileHeader *header)
-{
-	char *path_start;
-	char *p;
+	// Fake directories (see LHA_READER_DIR_END_OF_DIR) aren't at
+	// any position in the archive.
 
-	if (header->symlink_target == NULL) {
-		return 0;
+	if (batch->header_offsets != NULL) {
+		batch->header_offsets[index] =
+		    reader->curr_file_type == CURR_FILE_NORMAL
+		  ? lha_basic_reader_curr_file_offset(reader->reader) : 0;
 	}
 
-	// Absolute path symlinks could be used to point to arbitrary
-	// filesystem locations.
-
-	if (header->symlink_target[0] == '/') {
-		return 1;
+	if (batch->data_offsets != NULL) {
+		batch->data_offsets[index] =
+		    reader->curr_file_type == CURR_FILE_NORMAL
+		  ? lha_basic_reader_curr_data_offset(reader->reader) : 0;
 	}
 
-	// Check for paths containing '..'.
+	return 1;
+}
 
-	path_start = header->symlink_target;
+int lha_reader_next_batch(LHAReader *reader, LHAHeaderBatch *batch)
+{
+	LHAFileHeader *header;
+	unsigned int n;
 
-	for (p = header->symlink_target; *p != '\0'; ++p) {
-		if (*p == '/') {
-			if ((p - path_start) == 2
-			 && path_start[0] == '.' && path_start[1] == '.') {
-				return 1;
-			}
+	batch->names_used = 0;
 
-			path_start = p + 1;
+	// Only the fields that go in the batch are needed, and each
+	// header is freed as soon as the next is read, so headers are
+	// scanned and allocated from an arena.
+
+	lha_basic_reader_use_arena(reader->reader);
+	lha_basic_reader_set_scan(reader->reader, 1);
+
+	for (n = 0; n < batch->capacity; ++n) {
+		if (reader->batch_pending) {
+			reader->batch_pending = 0;
+			header = reader->curr_file;
+		} else {
+			header = lha_reader_next_file(reader);
+		}
+
+		if (header == NULL) {
+			break;
+		}
+
+		if (!add_to_batch(reader, batch, n, header)) {
+			reader->batch_pending = 1;
+			break;
 		}
 	}
 
-	// The path might also end with '..' (no terminating /)
+	lha_basic_reader_set_scan(reader->reader, reader->fast_scan);
 
-	if ((p - path_start) == 2
-	 && path_start[0] == '.' && path_start[1] == '.') {
-		return 1;
+	if (n == 0 && reader->batch_pending) {
+		return -1;
 	}
 
-	return 0;
+	return (int) n;
 }
 
-/**
- * Get the length of a path defined by a file header.
- *
- * @param header         The file header structure.
- * @return               Length of the header in bytes.
- */
-
-static size_t file_header_path_len(LHAFileHeader *header)
+int lha_reader_enable_pipeline(LHAReader *reader)
 {
-	size_t result;
+	// The input is read ahead where this helps; output files are
+	// written by a writer thread.
 
-	result = 0;
+	lha_input_stream_prefetch(reader->stream);
 
-	if (header->path != NULL) {
-		result += strlen(header->path);
-	}
-	if (header->filename != NULL) {
-		result += strlen(header->filename);
+	if (reader->writer == NULL) {
+		reader->writer = lha_work_queue_new(run_write, 1);
 	}
 
-	return result;
+	return reader->writer != NULL;
 }
 
-/**
- * Create a "placeholder" symbolic link.
- *
- * When a "dangerous" symbolic link is extracted, instead of creating it
- * immediately, create a "placeholder" empty file to go in its place, and
- * place it into the deferred_symlinks list to be created later.
- *
- * @param reader         Pointer to the LHA reader structure.
- * @param filename       Filename into which to extract the symlink.
- * @return               Non-zero if the symlink was extracted successfully,
- *                       or zero for failure.
- */
+int lha_reader_enable_io_uring(LHAReader *reader)
+{
+	if (reader->uring == NULL) {
+		reader->uring = lha_uring_new(URING_MAX_FILES);
+	}
 
-static int extract_placeholder_symlink(LHAReader *reader, char *filename)
+	return reader->uring != NULL;
+}
+
+int lha_reader_extract_async(LHAReader *reader,
+                             char *filename,
+                             LHAReaderExtractCallback callback,
+                             void *callback_data)
 {
-	LHAFileHeader **rover;
-	FILE *f;
+	ExtractJob *job;
 
-	f = lha_arch_fopen(filename, -1, -1, 0600);
+	if (reader->curr_file == NULL
+	 || !lha_file_header_decode_lazy(reader->curr_file)) {
+		return 0;
+	}
 
-	if (f == NULL) {
+	job = new_job(reader, callback, callback_data);
+
+	if (job == NULL) {
 		return 0;
 	}
 
-	fclose(f);
+	// A copy of an earlier file is made from the earlier file once it
+	// has been written.
 
-	// Insert this header into the list of deferred symbolic links.
-	// The list must be maintained in order of decreasing path length,
-	// so that one symbolic link cannot depend on another. For example:
-	//
-	//    etc  ->  /etc
-	//    etc/passwd  -> /malicious_path/passwd
+	if (copy_source(reader) >= 0) {
+		lha_reader_flush(reader);
+	} else if (reader->workers == NULL) {
+		if (start_uring_job(reader, job, filename)) {
+			return 1;
+		}
 
-	rover = &reader->deferred_symlinks;
+		free_job_resources(job);
 
-	while (*rover != NULL
-	    && file_header_path_len(*rover)
-	     > file_header_path_len(reader->curr_file)) {
-		rover = &(*rover)->_next;
-	}
+		// As below, files still being written through io_uring are
+		// finished before anything else is extracted.
 
-	reader->curr_file->_next = *rover;
-	*rover = reader->curr_file;
+		lha_reader_flush(reader);
+	} else {
+		if (start_job(reader, job, 1, filename)) {
+			collect_jobs(reader, reader->max_jobs);
+			return 1;
+		}
 
-	// Save reference to the header so it won't be freed.
+		free_job_resources(job);
 
-	lha_file_header_add_ref(reader->curr_file);
+		// Everything else is extracted immediately. Apart from
+		// creating new directories, this may depend on earlier files
+		// having been written: directory metadata must be set after
+		// the directory's contents, and symbolic links may replace
+		// files or directories. Wait for earlier files first.
 
-	return 1;
-}
+		if (reader->curr_file_type != CURR_FILE_NORMAL
+		 || strcmp(job->header->compress_method,
+		           LHA_COMPRESS_TYPE_DIR) != 0
+		 || job->header->symlink_target != NULL) {
+			lha_reader_flush(reader);
+		}
+	}
 
-/**
- * Extract a Unix symbolic link.
- *
- * @param reader         Pointer to the LHA reader structure.
- * @param filename       Filename into which to extract the symlink, or NULL
- *                       to use the filename from the file header.
- * @return               Non-zero if the symlink was extracted successfully,
- *                       or zero for failure.
- */
+	job->success = lha_reader_extract(reader, filename, NULL, NULL);
 
-static int extract_symlink(LHAReader *reader, char *filename)
-{
-	char *tmp_filename = NULL;
-	int result;
+	return complete_job(reader, job);
+}
 
-	// Construct filename?
+int lha_reader_check_async(LHAReader *reader,
+                           LHAReaderExtractCallback callback,
+                           void *callback_data)
+{
+	ExtractJob *job;
 
-	if (filename == NULL) {
-		tmp_filename = lha_file_header_full_path(reader->curr_file);
+	if (reader->curr_file == NULL) {
+		return 0;
+	}
 
-		if (tmp_filename == NULL) {
-			return 0;
-		}
+	job = new_job(reader, callback, callback_data);
 
-		filename = tmp_filename;
+	if (job == NULL) {
+		return 0;
 	}
 
-	if (reader->curr_file_type == CURR_FILE_NORMAL
-	 && is_dangerous_symlink(reader->curr_file)) {
-		return extract_placeholder_symlink(reader, filename);
+	if (reader->workers != NULL && start_job(reader, job, 0, NULL)) {
+		collect_jobs(reader, reader->max_jobs);
+		return 1;
 	}
 
-	result = lha_arch_symlink(filename, reader->curr_file->symlink_target);
+	free_job_resources(job);
 
-	// TODO: Set symlink timestamp.
+	// Checking a file doesn't change anything, so there is no need
+	// to wait for earlier files.
 
-	free(tmp_filename);
+	job->success = lha_reader_check(reader, NULL, NULL);
 
-	return result;
+	return complete_job(reader, job);
 }
 
-/**
- * Extract a "normal" file.
- *
- * This just extracts the file header most recently read by the
- * BasicReader.
- *
- * @param reader         Pointer to the LHA reader structure.
- * @param filename       Filename into which to extract the file, or NULL
- *                       to use the filename from the file header.
- * @param callback       Callback function to invoke to track progress.
- * @param callback_data  Extra pointer to pass to the callback function.
- * @return               Non-zero if the file was successfully extracted,
- *                       or zero for failure.
- */
-
-static int extract_normal(LHAReader *reader,
-                          char *filename,
-                          LHADecoderProgressCallback callback,
-                          void *callback_data)
+void lha_reader_flush(LHAReader *reader)
 {
-	if (strcmp(reader->curr_file->compress_method,
-	           LHA_COMPRESS_TYPE_DIR) != 0) {
-		return extract_file(reader, filename, callback, callback_data);
-	} else if (reader->curr_file->symlink_target != NULL) {
-		return extract_symlink(reader, filename);
-	} else {
-		return extract_directory(reader, filename);
+	if (reader->workers != NULL) {
+		collect_jobs(reader, 0);
+	}
+
+	if (reader->uring != NULL) {
+		collect_uring_jobs(reader, 0);
 	}
 }
 
-int lha_reader_extract(LHAReader *reader,
-                       char *filename,
-                       LHADecoderProgressCallback callback,
-                       void *callback_data)
+int lha_reader_extract_all(LHAReader *reader,
+                           LHAReaderExtractCallback callback,
+                           void *callback_data)
 {
-	switch (reader->curr_file_type) {
+	lha_reader_flush(reader);
+	reader->failures = 0;
 
-		case CURR_FILE_NORMAL:
-			return extract_normal(reader, filename, callback,
-			                      callback_data);
+	while (lha_reader_next_file(reader) != NULL) {
+		lha_reader_extract_async(reader, NULL, callback,
+		                         callback_data);
+	}
 
-		case CURR_FILE_FAKE_DIR:
-			if (filename == NULL) {
-				filename = reader->curr_file->path;
-			}
-			set_directory_metadata(reader->curr_file, filename);
-			return 1;
+	lha_reader_flush(reader);
 
-		case CURR_FILE_DEFERRED_SYMLINK:
-			return extract_symlink(reader, filename);
+	return reader->failures == 0;
+}
 
-		case CURR_FILE_START:
-		case CURR_FILE_EOF:
-			break;
+int lha_reader_check_all(LHAReader *reader,
+                         LHAReaderExtractCallback callback,
+                         void *callback_data)
+{
+	lha_reader_flush(reader);
+	reader->failures = 0;
+
+	while (lha_reader_next_file(reader) != NULL) {
+		lha_reader_check_async(reader, callback, callback_data);
 	}
 
-	return 0;
-}
+	lha_reader_flush(reader);
 
-int lha_reader_current_is_fake(LHAReader *reader)
-{
-	return reader->curr_file_type == CURR_FILE_FAKE_DIR
-	    || reader->curr_file_type == CURR_FILE_DEFERRED_SYMLINK;
+	return reader->failures == 0;
 }
-
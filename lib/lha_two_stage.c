@@ -0,0 +1,168 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+
+#include "lha_two_stage.h"
+#include "lha_work_queue.h"
+
+// Number of blocks of tokens, and the size of each. One block is being
+// returned to the caller, while the rest are queued for the second
+// stage. The block sizes are big enough for the cost of passing each
+// one to the worker thread to be small.
+
+#define NUM_BLOCKS     4
+#define BLOCK_TOKENS   16384
+#define BLOCK_OUTPUT   (64 * 1024)
+
+typedef struct {
+	LHATwoStage *two_stage;
+	uint32_t tokens[BLOCK_TOKENS];
+	size_t num_tokens;
+	uint8_t output[BLOCK_OUTPUT];
+	size_t output_len;
+} TokenBlock;
+
+struct _LHATwoStage {
+	LHADecoderType *dtype;
+	void *extra_data;
+
+	// Worker thread running the second stage.
+
+	LHAWorkQueue *queue;
+
+	// The blocks, the ones that are free to decode tokens into, and
+	// the one returned by the last read.
+
+	TokenBlock blocks[NUM_BLOCKS];
+	TokenBlock *free_blocks[NUM_BLOCKS];
+	unsigned int num_free;
+	TokenBlock *current;
+
+	// Set once the first stage has reached the end of the stream.
+
+	int finished;
+};
+
+// Run the second stage for a block, on the worker thread.
+
+static void decode_block(void *job)
+{
+	TokenBlock *block = job;
+	LHATwoStage *two_stage = block->two_stage;
+
+	block->output_len = two_stage->dtype->decode_tokens(
+		two_stage->extra_data, block->tokens, block->num_tokens,
+		block->output);
+}
+
+LHATwoStage *lha_two_stage_new(LHADecoderType *dtype, void *extra_data)
+{
+	LHATwoStage *two_stage;
+	unsigned int i;
+
+	if (dtype->read_tokens == NULL || dtype->decode_tokens == NULL) {
+		return NULL;
+	}
+
+	two_stage = malloc(sizeof(LHATwoStage));
+
+	if (two_stage == NULL) {
+		return NULL;
+	}
+
+	// A single worker thread runs the jobs in the order they are
+	// added, as the second stage must.
+
+	two_stage->queue = lha_work_queue_new(decode_block, 1);
+
+	if (two_stage->queue == NULL) {
+		free(two_stage);
+		return NULL;
+	}
+
+	two_stage->dtype = dtype;
+	two_stage->extra_data = extra_data;
+
+	for (i = 0; i < NUM_BLOCKS; ++i) {
+		two_stage->blocks[i].two_stage = two_stage;
+		two_stage->free_blocks[i] = &two_stage->blocks[i];
+	}
+
+	two_stage->num_free = NUM_BLOCKS;
+	two_stage->current = NULL;
+	two_stage->finished = 0;
+
+	return two_stage;
+}
+
+void lha_two_stage_free(LHATwoStage *two_stage)
+{
+	// The worker thread may still be using the decoder's data, so
+	// wait for anything queued to finish.
+
+	while (lha_work_queue_collect(two_stage->queue, 1) != NULL);
+
+	lha_work_queue_free(two_stage->queue);
+	free(two_stage);
+}
+
+size_t lha_two_stage_read(LHATwoStage *two_stage, uint8_t **buf)
+{
+	TokenBlock *block;
+
+	// The output returned by the last call has been used now.
+
+	if (two_stage->current != NULL) {
+		two_stage->free_blocks[two_stage->num_free] = two_stage->current;
+		++two_stage->num_free;
+		two_stage->current = NULL;
+	}
+
+	// Keep the second stage supplied with as many blocks as there
+	// are free, so that it has work to do while the caller is
+	// handling the output.
+
+	while (!two_stage->finished && two_stage->num_free > 0) {
+		block = two_stage->free_blocks[two_stage->num_free - 1];
+		block->num_tokens = two_stage->dtype->read_tokens(
+			two_stage->extra_data, block->tokens,
+			BLOCK_TOKENS, BLOCK_OUTPUT);
+
+		if (block->num_tokens == 0
+		 || !lha_work_queue_add(two_stage->queue, block, 1)) {
+			two_stage->finished = 1;
+			break;
+		}
+
+		--two_stage->num_free;
+	}
+
+	block = lha_work_queue_collect(two_stage->queue, 1);
+
+	if (block == NULL) {
+		return 0;
+	}
+
+	two_stage->current = block;
+	*buf = block->output;
+
+	return block->output_len;
+}
@@ -0,0 +1,72 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LHASA_LHA_TWO_STAGE_H
+#define LHASA_LHA_TWO_STAGE_H
+
+#include "lha_decoder.h"
+
+/**
+ * Two-stage decoding.
+ *
+ * Decoder types with read_tokens and decode_tokens functions can split
+ * decoding into two stages that run at the same time: the calling
+ * thread reads the compressed data and decodes it into tokens, while a
+ * worker thread applies the tokens to the history window to produce
+ * the output. The tokens are passed over in large blocks, so that the
+ * threads rarely need to wait on each other.
+ */
+
+/**
+ * Start two-stage decoding for a decoder, and the worker thread that
+ * runs the second stage.
+ *
+ * @param dtype          The decoder type.
+ * @param extra_data     The decoder's custom data.
+ * @return               Pointer to the new state, or NULL if the
+ *                       decoder type does not support two-stage
+ *                       decoding or the thread could not be started.
+ */
+
+LHATwoStage *lha_two_stage_new(LHADecoderType *dtype, void *extra_data);
+
+/**
+ * Stop two-stage decoding, waiting for the worker thread to finish.
+ *
+ * @param two_stage      The two-stage decoding state.
+ */
+
+void lha_two_stage_free(LHATwoStage *two_stage);
+
+/**
+ * Read the next part of the output; this replaces the decoder type's
+ * read function.
+ *
+ * @param two_stage      The two-stage decoding state.
+ * @param buf            Pointer to a variable in which to store a
+ *                       pointer to the output, which is valid until
+ *                       the next call.
+ * @return               Number of bytes of output, or zero for end
+ *                       of stream or error.
+ */
+
+size_t lha_two_stage_read(LHATwoStage *two_stage, uint8_t **buf);
+
+#endif /* #ifndef LHASA_LHA_TWO_STAGE_H */
@@ -0,0 +1,287 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+//
+// Batched writes using io_uring.
+//
+// The ring is set up using the system calls directly, rather than
+// depending on liburing. Only the write operation is used. If the
+// kernel headers are too old to have io_uring, or the system call
+// fails (eg. because it is disabled), lha_uring_new() returns NULL.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lha_uring.h"
+
+#ifdef __linux__
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+struct _LHAUring {
+	int fd;
+
+	// Submission queue: the ring of indices into the array of
+	// submission queue entries.
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	// Completion queue.
+
+	void *cq_ring;
+	size_t cq_ring_len;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// Number of writes queued but not yet submitted, and number
+	// submitted but not yet completed.
+
+	unsigned int queued;
+	unsigned int in_flight;
+};
+
+static void unmap_rings(LHAUring *ring)
+{
+	if (ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	}
+	if (ring->cq_ring != MAP_FAILED) {
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	}
+	if (ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+}
+
+LHAUring *lha_uring_new(unsigned int entries)
+{
+	struct io_uring_params params;
+	LHAUring *ring;
+	uint8_t *sq, *cq;
+
+	ring = malloc(sizeof(LHAUring));
+
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_ring_len = params.sq_off.array
+	                  + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_len = params.cq_off.cqes
+	                  + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd,
+	                     IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd,
+	                     IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd,
+	                  IORING_OFF_SQES);
+
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+	 || ring->sqes == MAP_FAILED) {
+		unmap_rings(ring);
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	ring->queued = 0;
+	ring->in_flight = 0;
+
+	return ring;
+}
+
+void lha_uring_free(LHAUring *ring)
+{
+	unmap_rings(ring);
+	close(ring->fd);
+	free(ring);
+}
+
+int lha_uring_write(LHAUring *ring, FILE *handle, const void *buf,
+                    size_t buf_len, uint64_t offset, void *data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, index;
+
+	// Only one thread adds to the submission queue, so the tail can
+	// be read directly; the kernel updates the head.
+
+	tail = *ring->sq_tail;
+
+	if (ring->queued + ring->in_flight >= ring->sq_entries
+	 || tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+	    >= ring->sq_entries) {
+		return 0;
+	}
+
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fileno(handle);
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = (uint32_t) buf_len;
+	sqe->off = offset;
+	sqe->user_data = (uint64_t) (uintptr_t) data;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	++ring->queued;
+
+	return 1;
+}
+
+// Invoke io_uring_enter, submitting all queued writes and optionally
+// waiting for one to complete.
+
+static int enter(LHAUring *ring, int wait)
+{
+	int result;
+
+	do {
+		result = (int) syscall(__NR_io_uring_enter, ring->fd,
+		                       ring->queued, wait ? 1 : 0,
+		                       wait ? IORING_ENTER_GETEVENTS : 0,
+		                       NULL, 0);
+	} while (result < 0 && errno == EINTR);
+
+	if (result < 0) {
+		return 0;
+	}
+
+	ring->queued -= (unsigned int) result;
+	ring->in_flight += (unsigned int) result;
+
+	return 1;
+}
+
+int lha_uring_submit(LHAUring *ring)
+{
+	if (ring->queued == 0) {
+		return 1;
+	}
+
+	return enter(ring, 0);
+}
+
+int lha_uring_complete(LHAUring *ring, int wait, void **data, int *result)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	head = *ring->cq_head;
+
+	// Nothing completed yet? Submit anything still queued and wait.
+
+	while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (!wait || ring->queued + ring->in_flight == 0
+		 || !enter(ring, ring->in_flight > 0)) {
+			return 0;
+		}
+	}
+
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*data = (void *) (uintptr_t) cqe->user_data;
+	*result = cqe->res;
+
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	--ring->in_flight;
+
+	return 1;
+}
+
+#else /* #ifndef HAVE_IO_URING */
+
+LHAUring *lha_uring_new(unsigned int entries)
+{
+	return NULL;
+}
+
+void lha_uring_free(LHAUring *ring)
+{
+}
+
+int lha_uring_write(LHAUring *ring, FILE *handle, const void *buf,
+                    size_t buf_len, uint64_t offset, void *data)
+{
+	return 0;
+}
+
+int lha_uring_submit(LHAUring *ring)
+{
+	return 0;
+}
+
+int lha_uring_complete(LHAUring *ring, int wait, void **data, int *result)
+{
+	return 0;
+}
+
+#endif /* #ifdef HAVE_IO_URING */
+
@@ -0,0 +1,104 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LHASA_LHA_URING_H
+#define LHASA_LHA_URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+/**
+ * Batched asynchronous writes.
+ *
+ * On Linux, writes can be queued and submitted to the kernel together
+ * using io_uring, so that many small files can be written with few
+ * system calls while the next files are being decompressed. On other
+ * systems, or if io_uring is not available, @ref lha_uring_new fails
+ * and files are written normally.
+ */
+
+typedef struct _LHAUring LHAUring;
+
+/**
+ * Create a new ring.
+ *
+ * @param entries      Maximum number of writes in flight at once.
+ * @return             Pointer to the new ring, or NULL if io_uring is
+ *                     not available.
+ */
+
+LHAUring *lha_uring_new(unsigned int entries);
+
+/**
+ * Free a ring. All writes must have completed first.
+ *
+ * @param ring         The ring.
+ */
+
+void lha_uring_free(LHAUring *ring);
+
+/**
+ * Queue a write. The write is not started until
+ * @ref lha_uring_submit is called; the buffer must remain valid until
+ * the write has completed.
+ *
+ * @param ring         The ring.
+ * @param handle       File to write to.
+ * @param buf          Data to write.
+ * @param buf_len      Length of the data, in bytes.
+ * @param offset       Offset within the file at which to write.
+ * @param data         Pointer to identify the write when it completes.
+ * @return             Non-zero for success, or zero if the maximum
+ *                     number of writes are already in flight.
+ */
+
+int lha_uring_write(LHAUring *ring, FILE *handle, const void *buf,
+                    size_t buf_len, uint64_t offset, void *data);
+
+/**
+ * Submit all queued writes to the kernel.
+ *
+ * @param ring         The ring.
+ * @return             Non-zero for success, or zero for failure.
+ */
+
+int lha_uring_submit(LHAUring *ring);
+
+/**
+ * Get the result of a completed write. Writes may complete in any
+ * order.
+ *
+ * @param ring         The ring.
+ * @param wait         If non-zero, wait for a write to complete if
+ *                     none has yet.
+ * @param data         Pointer to a variable in which to store the
+ *                     pointer passed to @ref lha_uring_write.
+ * @param result       Pointer to a variable in which to store the
+ *                     number of bytes written, or a negative value if
+ *                     the write failed.
+ * @return             Non-zero if a completed write was returned, or
+ *                     zero if none has completed (or none are in
+ *                     flight, when waiting).
+ */
+
+int lha_uring_complete(LHAUring *ring, int wait, void **data, int *result);
+
+#endif /* #ifndef LHASA_LHA_URING_H */
@@ -0,0 +1,257 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+
+#include "lha_arch.h"
+#include "lha_work_queue.h"
+
+typedef struct _WorkItem WorkItem;
+
+struct _WorkItem {
+	void *job;
+	int done;
+
+	// Next item to collect, and next item to run.
+
+	WorkItem *next;
+	WorkItem *next_run;
+};
+
+struct _LHAWorkQueue {
+	LHAWorkFunc func;
+
+	LHAArchThread **threads;
+	unsigned int num_threads;
+
+	// The mutex protects everything below. work_cond is signalled
+	// when a job is added (or the queue is shutting down), and
+	// done_cond when a job finishes.
+
+	LHAArchMutex *mutex;
+	LHAArchCond *work_cond;
+	LHAArchCond *done_cond;
+	int shutdown;
+
+	// Items waiting to be collected, oldest first.
+
+	WorkItem *head, *tail;
+	unsigned int num_items;
+
+	// Items waiting for a worker thread to run them.
+
+	WorkItem *run_head, *run_tail;
+};
+
+static void worker_main(void *data)
+{
+	LHAWorkQueue *queue = data;
+	WorkItem *item;
+
+	lha_arch_mutex_lock(queue->mutex);
+
+	for (;;) {
+		while (queue->run_head == NULL && !queue->shutdown) {
+			lha_arch_cond_wait(queue->work_cond, queue->mutex);
+		}
+
+		item = queue->run_head;
+
+		if (item == NULL) {
+			break;
+		}
+
+		queue->run_head = item->next_run;
+
+		if (queue->run_head == NULL) {
+			queue->run_tail = NULL;
+		}
+
+		// Run the job without holding the lock.
+
+		lha_arch_mutex_unlock(queue->mutex);
+		queue->func(item->job);
+		lha_arch_mutex_lock(queue->mutex);
+
+		item->done = 1;
+		lha_arch_cond_broadcast(queue->done_cond);
+	}
+
+	lha_arch_mutex_unlock(queue->mutex);
+}
+
+LHAWorkQueue *lha_work_queue_new(LHAWorkFunc func, unsigned int num_workers)
+{
+	LHAWorkQueue *queue;
+	LHAArchThread *thread;
+	unsigned int i;
+
+	queue = calloc(1, sizeof(LHAWorkQueue));
+
+	if (queue == NULL) {
+		return NULL;
+	}
+
+	queue->func = func;
+	queue->threads = calloc(num_workers, sizeof(LHAArchThread *));
+	queue->mutex = lha_arch_mutex_new();
+	queue->work_cond = lha_arch_cond_new();
+	queue->done_cond = lha_arch_cond_new();
+
+	if (queue->threads == NULL || queue->mutex == NULL
+	 || queue->work_cond == NULL || queue->done_cond == NULL) {
+		lha_work_queue_free(queue);
+		return NULL;
+	}
+
+	// Run with as many of the threads as can be started.
+
+	for (i = 0; i < num_workers; ++i) {
+		thread = lha_arch_thread_new(worker_main, queue);
+
+		if (thread == NULL) {
+			break;
+		}
+
+		queue->threads[queue->num_threads] = thread;
+		++queue->num_threads;
+	}
+
+	if (queue->num_threads == 0) {
+		lha_work_queue_free(queue);
+		return NULL;
+	}
+
+	return queue;
+}
+
+void lha_work_queue_free(LHAWorkQueue *queue)
+{
+	unsigned int i;
+
+	if (queue->num_threads > 0) {
+		lha_arch_mutex_lock(queue->mutex);
+		queue->shutdown = 1;
+		lha_arch_cond_broadcast(queue->work_cond);
+		lha_arch_mutex_unlock(queue->mutex);
+
+		for (i = 0; i < queue->num_threads; ++i) {
+			lha_arch_thread_join(queue->threads[i]);
+		}
+	}
+
+	if (queue->done_cond != NULL) {
+		lha_arch_cond_free(queue->done_cond);
+	}
+	if (queue->work_cond != NULL) {
+		lha_arch_cond_free(queue->work_cond);
+	}
+	if (queue->mutex != NULL) {
+		lha_arch_mutex_free(queue->mutex);
+	}
+
+	free(queue->threads);
+	free(queue);
+}
+
+int lha_work_queue_add(LHAWorkQueue *queue, void *job, int run)
+{
+	WorkItem *item;
+
+	item = malloc(sizeof(WorkItem));
+
+	if (item == NULL) {
+		return 0;
+	}
+
+	item->job = job;
+	item->done = !run;
+	item->next = NULL;
+	item->next_run = NULL;
+
+	lha_arch_mutex_lock(queue->mutex);
+
+	if (queue->tail != NULL) {
+		queue->tail->next = item;
+	} else {
+		queue->head = item;
+	}
+
+	queue->tail = item;
+	++queue->num_items;
+
+	if (run) {
+		if (queue->run_tail != NULL) {
+			queue->run_tail->next_run = item;
+		} else {
+			queue->run_head = item;
+		}
+
+		queue->run_tail = item;
+		lha_arch_cond_broadcast(queue->work_cond);
+	}
+
+	lha_arch_mutex_unlock(queue->mutex);
+
+	return 1;
+}
+
+unsigned int lha_work_queue_pending(LHAWorkQueue *queue)
+{
+	// Items are only removed by the thread that added them, so
+	// this is only used from that thread.
+
+	return queue->num_items;
+}
+
+void *lha_work_queue_collect(LHAWorkQueue *queue, int wait)
+{
+	WorkItem *item;
+	void *result;
+
+	lha_arch_mutex_lock(queue->mutex);
+
+	item = queue->head;
+
+	while (item != NULL && !item->done && wait) {
+		lha_arch_cond_wait(queue->done_cond, queue->mutex);
+	}
+
+	if (item == NULL || !item->done) {
+		lha_arch_mutex_unlock(queue->mutex);
+		return NULL;
+	}
+
+	queue->head = item->next;
+
+	if (queue->head == NULL) {
+		queue->tail = NULL;
+	}
+
+	--queue->num_items;
+
+	lha_arch_mutex_unlock(queue->mutex);
+
+	result = item->job;
+	free(item);
+
+	return result;
+}
+
@@ -0,0 +1,101 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LHASA_LHA_WORK_QUEUE_H
+#define LHASA_LHA_WORK_QUEUE_H
+
+/**
+ * Work queue.
+ *
+ * A work queue runs jobs on a pool of worker threads. Jobs are
+ * collected again by the thread that added them, in the same order that
+ * they were added, so that the results can be handled in a predictable
+ * order even though the jobs themselves may finish in any order.
+ */
+
+typedef struct _LHAWorkQueue LHAWorkQueue;
+
+/**
+ * Function invoked on a worker thread to run a job.
+ *
+ * @param job          Pointer to the job passed to
+ *                     @ref lha_work_queue_add.
+ */
+
+typedef void (*LHAWorkFunc)(void *job);
+
+/**
+ * Create a new work queue and start its worker threads.
+ *
+ * @param func         Function to invoke to run each job.
+ * @param num_workers  Number of worker threads to start.
+ * @return             Pointer to the new work queue, or NULL if no
+ *                     worker threads could be started.
+ */
+
+LHAWorkQueue *lha_work_queue_new(LHAWorkFunc func, unsigned int num_workers);
+
+/**
+ * Stop the worker threads and free a work queue. All jobs must have
+ * been collected first.
+ *
+ * @param queue        The work queue.
+ */
+
+void lha_work_queue_free(LHAWorkQueue *queue);
+
+/**
+ * Add a job to a work queue.
+ *
+ * @param queue        The work queue.
+ * @param job          Pointer to the job.
+ * @param run          If non-zero, the job is run by a worker thread.
+ *                     If zero, the job is treated as already finished;
+ *                     this allows results that did not need a worker to
+ *                     be collected in order with the others.
+ * @return             Non-zero for success, or zero for failure.
+ */
+
+int lha_work_queue_add(LHAWorkQueue *queue, void *job, int run);
+
+/**
+ * Get the number of jobs in a work queue that have not yet been
+ * collected.
+ *
+ * @param queue        The work queue.
+ * @return             Number of jobs.
+ */
+
+unsigned int lha_work_queue_pending(LHAWorkQueue *queue);
+
+/**
+ * Collect the oldest job from a work queue.
+ *
+ * @param queue        The work queue.
+ * @param wait         If non-zero, wait for the job to finish if it is
+ *                     still running. If zero, return NULL instead.
+ * @return             Pointer to the job, or NULL if there are no jobs
+ *                     waiting to be collected.
+ */
+
+void *lha_work_queue_collect(LHAWorkQueue *queue, int wait);
+
+#endif /* #ifndef LHASA_LHA_WORK_QUEUE_H */
+
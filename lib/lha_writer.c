@@ -0,0 +1,499 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lha_arch.h"
+#include "lha_encoder.h"
+#include "lha_file_header.h"
+#include "lha_work_queue.h"
+#include "crc16.h"
+#include "public/lha_writer.h"
+
+// Maximum number of files waiting to be written, for each worker
+// thread. Each file holds a copy of its data until it is written.
+
+#define JOBS_PER_WORKER 2
+
+typedef struct {
+
+	// Copy of the header passed to lha_writer_add, with its own copies
+	// of the strings. The lengths and CRC are filled in when the file
+	// is compressed.
+
+	LHAFileHeader header;
+
+	// Data to write, and the compressed data, or NULL if the data is
+	// stored uncompressed. If the data is mapped from a file, the
+	// length of the mapping is saved, and the file is saved too if it
+	// can be copied from directly.
+
+	uint8_t *data;
+	size_t data_len;
+	size_t mapped_len;
+	FILE *input;
+	uint8_t *compressed;
+
+	int success;
+} WriteJob;
+
+struct _LHAWriter {
+	FILE *stream;
+
+	// Worker threads compressing files, if any, and the maximum number
+	// of files to have waiting to be written.
+
+	LHAWorkQueue *workers;
+	unsigned int max_jobs;
+
+	// Set if a file could not be compressed or written.
+
+	int failed;
+	int finished;
+};
+
+LHAWriter *lha_writer_new(FILE *stream)
+{
+	LHAWriter *writer;
+
+	writer = calloc(1, sizeof(LHAWriter));
+
+	if (writer == NULL) {
+		return NULL;
+	}
+
+	// Anything already written to the stream with stdio functions
+	// (such as a self-extractor) must come first, as the archive is
+	// written without going through the stdio buffer.
+
+	if (fflush(stream) != 0) {
+		free(writer);
+		return NULL;
+	}
+
+	writer->stream = stream;
+
+	return writer;
+}
+
+static void free_job(WriteJob *job)
+{
+	free(job->header.path);
+	free(job->header.filename);
+	free(job->header.symlink_target);
+	free(job->header.unix_username);
+	free(job->header.unix_group);
+
+	if (job->mapped_len > 0) {
+		lha_arch_unmap_file(job->data, job->mapped_len);
+	} else {
+		free(job->data);
+	}
+
+	free(job->compressed);
+	free(job);
+}
+
+// Compress the data for a file, on a worker thread if there are any.
+
+static void run_job(void *data)
+{
+	WriteJob *job = data;
+	LHAFileHeader *header = &job->header;
+	size_t compressed_len;
+
+	header->length = job->data_len;
+	header->compressed_length = job->data_len;
+	header->crc = 0;
+	lha_crc16_buf(&header->crc, job->data, job->data_len);
+	job->success = 1;
+
+	if (!lha_encoder_supported(header->compress_method)) {
+		return;
+	}
+
+	job->compressed = lha_encode(header->compress_method, job->data,
+	                             job->data_len, &compressed_len);
+
+	if (job->compressed == NULL) {
+		job->success = 0;
+	} else if (compressed_len >= job->data_len) {
+		free(job->compressed);
+		job->compressed = NULL;
+		memcpy(header->compress_method, "-lh0-", 6);
+	} else {
+		header->compressed_length = compressed_len;
+	}
+}
+
+// Write the data for a file that is stored uncompressed. If it is
+// mapped from a file, as much as possible is copied straight from the
+// file, without passing through the mapping.
+
+static int write_stored(LHAWriter *writer, WriteJob *job)
+{
+	uint64_t copied;
+
+	copied = 0;
+
+	if (job->input != NULL) {
+		copied = lha_arch_copy_file(writer->stream, job->input,
+		                            0, job->data_len);
+	}
+
+	return lha_arch_write(writer->stream, job->data + copied,
+	                      job->data_len - (size_t) copied);
+}
+
+// Write out a file that has been compressed.
+
+static void finish_job(LHAWriter *writer, WriteJob *job)
+{
+	uint8_t *raw_header;
+	size_t header_len;
+
+	if (!job->success || writer->failed) {
+		writer->failed = 1;
+		free_job(job);
+		return;
+	}
+
+	raw_header = lha_file_header_write(&job->header, &header_len);
+
+	if (raw_header == NULL
+	 || !lha_arch_write(writer->stream, raw_header, header_len)) {
+		writer->failed = 1;
+	} else if (job->compressed != NULL) {
+		writer->failed = !lha_arch_write(writer->stream,
+		                                 job->compressed,
+		                                 job->header.compressed_length);
+	} else {
+		writer->failed = !write_stored(writer, job);
+	}
+
+	free(raw_header);
+	free_job(job);
+}
+
+// Write out the files that have been compressed, in order, waiting if
+// necessary until no more than the specified number remain.
+
+static void collect_jobs(LHAWriter *writer, unsigned int max_jobs)
+{
+	WriteJob *job;
+
+	if (writer->workers == NULL) {
+		return;
+	}
+
+	while (lha_work_queue_pending(writer->workers) > 0) {
+		job = lha_work_queue_collect(
+		    writer->workers,
+		    lha_work_queue_pending(writer->workers) > max_jobs);
+
+		if (job == NULL) {
+			break;
+		}
+
+		finish_job(writer, job);
+	}
+}
+
+void lha_writer_free(LHAWriter *writer)
+{
+	// Jobs are collected to free them, but nothing more is written.
+
+	writer->failed = 1;
+	collect_jobs(writer, 0);
+
+	if (writer->workers != NULL) {
+		lha_work_queue_free(writer->workers);
+	}
+
+	free(writer);
+}
+
+int lha_writer_set_workers(LHAWriter *writer, unsigned int num_workers)
+{
+	collect_jobs(writer, 0);
+
+	if (writer->workers != NULL) {
+		lha_work_queue_free(writer->workers);
+		writer->workers = NULL;
+	}
+
+	if (num_workers == 0) {
+		num_workers = lha_arch_num_cpus();
+	}
+
+	if (num_workers <= 1) {
+		return 1;
+	}
+
+	writer->workers = lha_work_queue_new(run_job, num_workers);
+	writer->max_jobs = num_workers * JOBS_PER_WORKER;
+
+	return writer->workers != NULL;
+}
+
+// Copy a string belonging to a header, which may be NULL.
+
+static int copy_string(char **dest, char *src)
+{
+	if (src == NULL) {
+		*dest = NULL;
+		return 1;
+	}
+
+	*dest = strdup(src);
+
+	return *dest != NULL;
+}
+
+static WriteJob *new_job(LHAFileHeader *header)
+{
+	WriteJob *job;
+	LHAFileHeader *copy;
+
+	job = calloc(1, sizeof(WriteJob));
+
+	if (job == NULL) {
+		return NULL;
+	}
+
+	copy = &job->header;
+	*copy = *header;
+	copy->_refcount = 0;
+	copy->_next = NULL;
+	copy->_arena = NULL;
+	copy->_chunk = NULL;
+	copy->raw_data = NULL;
+	copy->raw_data_len = 0;
+	copy->header_level = 2;
+
+	if (!copy_string(&copy->path, header->path)
+	  | !copy_string(&copy->filename, header->filename)
+	  | !copy_string(&copy->symlink_target, header->symlink_target)
+	  | !copy_string(&copy->unix_username, header->unix_username)
+	  | !copy_string(&copy->unix_group, header->unix_group)) {
+		free_job(job);
+		return NULL;
+	}
+
+	return job;
+}
+
+// Check whether a file can be added to the archive.
+
+static int can_add(LHAWriter *writer, LHAFileHeader *header, int has_data)
+{
+	if (writer->failed || writer->finished) {
+		return 0;
+	}
+
+	// Directories and symbolic links have no data.
+
+	if (!strcmp(header->compress_method, LHA_COMPRESS_TYPE_DIR)) {
+		return !has_data;
+	}
+
+	return !strcmp(header->compress_method, "-lh0-")
+	    || lha_encoder_supported(header->compress_method);
+}
+
+// Compress and write out a new file, on a worker thread if there are
+// any.
+
+static int add_job(LHAWriter *writer, WriteJob *job)
+{
+	int run;
+
+	// Files that are stored uncompressed are not worth passing to a
+	// worker thread, but still go through the queue so that they are
+	// written in order.
+
+	run = lha_encoder_supported(job->header.compress_method);
+
+	if (writer->workers == NULL) {
+		run_job(job);
+		finish_job(writer, job);
+	} else {
+		if (!run) {
+			run_job(job);
+		}
+
+		if (!lha_work_queue_add(writer->workers, job, run)) {
+			free_job(job);
+			writer->failed = 1;
+			return 0;
+		}
+
+		collect_jobs(writer, writer->max_jobs);
+	}
+
+	return !writer->failed;
+}
+
+int lha_writer_add(LHAWriter *writer, LHAFileHeader *header,
+                   const void *data, size_t data_len)
+{
+	WriteJob *job;
+
+	if (!can_add(writer, header, data_len > 0)) {
+		return 0;
+	}
+
+	job = new_job(header);
+
+	if (job == NULL) {
+		writer->failed = 1;
+		return 0;
+	}
+
+	// Allocate at least one byte, so that an empty file is not
+	// mistaken for a failure.
+
+	job->data = malloc(data_len > 0 ? data_len : 1);
+
+	if (job->data == NULL) {
+		free_job(job);
+		writer->failed = 1;
+		return 0;
+	}
+
+	// Directories and symlinks have no data, and may be added with a
+	// NULL pointer.
+
+	if (data_len > 0) {
+		memcpy(job->data, data, data_len);
+	}
+
+	job->data_len = data_len;
+
+	return add_job(writer, job);
+}
+
+// Read the whole of a file that can't be mapped, such as a pipe.
+
+static uint8_t *read_file(FILE *input, size_t *len)
+{
+	uint8_t *data, *new_data;
+	size_t data_size, n;
+
+	data_size = 65536;
+	data = malloc(data_size);
+	*len = 0;
+
+	while (data != NULL) {
+		n = fread(data + *len, 1, data_size - *len, input);
+		*len += n;
+
+		if (*len < data_size) {
+			if (ferror(input)) {
+				free(data);
+				data = NULL;
+			}
+			break;
+		}
+
+		new_data = realloc(data, data_size * 2);
+
+		if (new_data == NULL) {
+			free(data);
+		}
+
+		data = new_data;
+		data_size *= 2;
+	}
+
+	return data;
+}
+
+int lha_writer_add_file(LHAWriter *writer, LHAFileHeader *header,
+                        FILE *input)
+{
+	WriteJob *job;
+
+	if (!can_add(writer, header, 1)) {
+		return 0;
+	}
+
+	job = new_job(header);
+
+	if (job == NULL) {
+		writer->failed = 1;
+		return 0;
+	}
+
+	job->data = lha_arch_map_file(input, &job->mapped_len);
+
+	if (job->data != NULL) {
+		job->data_len = job->mapped_len;
+	} else {
+		job->mapped_len = 0;
+		job->data = read_file(input, &job->data_len);
+	}
+
+	if (job->data == NULL) {
+		free_job(job);
+		writer->failed = 1;
+		return 0;
+	}
+
+	// A mapped file that is stored uncompressed is written
+	// immediately, copying from the file, so that the file does not
+	// need to stay open. The earlier files must be written first.
+	// Compressed files are read through the mapping, which stays
+	// valid after the file is closed.
+
+	if (job->mapped_len > 0
+	 && !strcmp(job->header.compress_method, "-lh0-")) {
+		collect_jobs(writer, 0);
+		job->input = input;
+		run_job(job);
+		finish_job(writer, job);
+
+		return !writer->failed;
+	}
+
+	return add_job(writer, job);
+}
+
+int lha_writer_finish(LHAWriter *writer)
+{
+	if (writer->finished) {
+		return !writer->failed;
+	}
+
+	collect_jobs(writer, 0);
+	writer->finished = 1;
+
+	// The archive ends with a zero byte where the next header would
+	// start.
+
+	if (!writer->failed && !lha_arch_write(writer->stream, "", 1)) {
+		writer->failed = 1;
+	}
+
+	return !writer->failed;
+}
+
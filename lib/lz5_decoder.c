@@ -23,6 +23,9 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <inttypes.h>
 
 #include "lha_decoder.h"
+#include "lha_endian.h"
+
+#include "window_copy.c"
 
 // Parameters for ring buffer, used for storing history.  This acts
 // as the dictionary for copy operations.
@@ -36,22 +39,48 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define THRESHOLD 3
 
-// Size of output buffer.  Must be large enough to hold the results of
-// a complete "run" (see below).
+// Maximum number of bytes output by a complete "run" (see below).
+
+#define MAX_RUN_LEN ((15 + THRESHOLD) * 8)
+
+// Maximum amount of data returned by a single call to read(). Each call
+// decodes runs until this limit is nearly reached.
+
+#define OUTPUT_BUFFER_SIZE 2048
+
+// Size of the buffer used to hold compressed data read from the input
+// callback.
 
-#define OUTPUT_BUFFER_SIZE (15 + THRESHOLD) * 8
+#define INPUT_BUFFER_SIZE 4096
+
+// Size of a checkpoint: the contents of the ring buffer, followed by
+// the 32-bit ring buffer position.
+
+#define CHECKPOINT_SIZE (RING_BUFFER_SIZE + 4)
 
 // Decoder for the -lz5- compression method used by LArc.
 //
 // This processes "runs" of eight commands, each of which is either
-// "output a character" or "copy block".  The result of that run
-// is written into the output buffer.
+// "output a character" or "copy block".  The decoded data is written
+// straight into the ring buffer and returned from there; the last run
+// decoded by a call to read() can run past the end of the ring buffer,
+// and this overrun is moved back to the start on the next call.
 
 typedef struct {
-	uint8_t ringbuf[RING_BUFFER_SIZE];
+	uint8_t ringbuf[RING_BUFFER_SIZE + MAX_RUN_LEN];
 	unsigned int ringbuf_pos;
 	LHADecoderCallback callback;
 	void *callback_data;
+
+	// Compressed data read from the callback that has not yet been
+	// decoded.
+
+	uint8_t input[INPUT_BUFFER_SIZE];
+	size_t input_pos, input_len;
+
+	// Total number of bytes read from the callback.
+
+	uint64_t input_total;
 } LHALZ5Decoder;
 
 static void fill_initial(LHALZ5Decoder *decoder)
@@ -103,55 +132,92 @@ static int lha_lz5_init(void *data, LHADecoderCallback callback,
 	decoder->ringbuf_pos = RING_BUFFER_SIZE - START_OFFSET;
 	decoder->callback = callback;
 	decoder->callback_data = callback_data;
+	decoder->input_pos = 0;
+	decoder->input_len = 0;
+	decoder->input_total = 0;
 
 	return 1;
 }
 
-// Add a single byte to the output buffer.
+// Read the next byte of compressed data. Returns -1 at the end of the
+// input stream.
 
-static void output_byte(LHALZ5Decoder *decoder, uint8_t *buf,
-                        size_t *buf_len, uint8_t b)
+static int read_byte(LHALZ5Decoder *decoder)
 {
-	buf[*buf_len] = b;
-	++*buf_len;
+	if (decoder->input_pos >= decoder->input_len) {
+		decoder->input_len = decoder->callback(decoder->input,
+		                                       INPUT_BUFFER_SIZE,
+		                                       decoder->callback_data);
+		decoder->input_pos = 0;
+		decoder->input_total += decoder->input_len;
+
+		if (decoder->input_len == 0) {
+			return -1;
+		}
+	}
 
-	decoder->ringbuf[decoder->ringbuf_pos] = b;
-	decoder->ringbuf_pos = (decoder->ringbuf_pos + 1) % RING_BUFFER_SIZE;
+	return decoder->input[decoder->input_pos++];
 }
 
-// Output a "block" of data from the specified range in the ring buffer.
+// Output a "block" of data from the specified position in the ring
+// buffer.
 
 static void output_block(LHALZ5Decoder *decoder,
-                         uint8_t *buf,
-                         size_t *buf_len,
                          unsigned int start,
                          unsigned int len)
 {
-	unsigned int i;
+	uint8_t *dst;
+	unsigned int distance, n;
+
+	// The position is an offset into the ring buffer; convert it
+	// into a distance back from the current position. The current
+	// position may be past the end of the ring buffer, in the
+	// overrun area. A distance of a whole ring buffer is a copy from
+	// the position about to be overwritten.
+
+	distance = (decoder->ringbuf_pos + 2 * RING_BUFFER_SIZE - start - 1)
+	         % RING_BUFFER_SIZE + 1;
+	dst = decoder->ringbuf + decoder->ringbuf_pos;
+
+	if (distance <= decoder->ringbuf_pos) {
+		window_copy(dst, dst - distance, len);
+	} else {
+		// The source wraps around from the end of the ring buffer.
+		// It is ahead of the destination, so the part up to the
+		// end can be moved in one go, and the remainder continues
+		// from the start.
+
+		n = RING_BUFFER_SIZE - start;
+
+		if (n > len) {
+			n = len;
+		}
+
+		memmove(dst, decoder->ringbuf + start, n);
 
-	for (i = 0; i < len; ++i) {
-		output_byte(decoder, buf, buf_len,
-		            decoder->ringbuf[(start + i) % RING_BUFFER_SIZE]);
+		if (n < len) {
+			window_copy(dst + n, decoder->ringbuf, len - n);
+		}
 	}
+
+	decoder->ringbuf_pos += len;
 }
 
 // Process a "run" of LZ5-compressed data (a control byte followed by
-// eight "commands").
+// eight "commands"). Returns zero if the end of the input stream is
+// reached; some of the commands may have been decoded anyway.
 
-static size_t lha_lz5_read(void *data, uint8_t *buf)
+static int read_run(LHALZ5Decoder *decoder)
 {
-	LHALZ5Decoder *decoder = data;
-	uint8_t bitmap;
+	int bitmap, b, cmd0, cmd1;
 	unsigned int bit;
-	size_t result;
-
-	// Start from an empty buffer.
-
-	result = 0;
+	unsigned int seqstart, seqlen;
 
 	// Read the bitmap byte first.
 
-	if (!decoder->callback(&bitmap, 1, decoder->callback_data)) {
+	bitmap = read_byte(decoder);
+
+	if (bitmap < 0) {
 		return 0;
 	}
 
@@ -161,38 +227,134 @@ static size_t lha_lz5_read(void *data, uint8_t *buf)
 
 	for (bit = 0; bit < 8; ++bit) {
 		if ((bitmap & (1 << bit)) != 0) {
-			uint8_t b;
+			b = read_byte(decoder);
 
-			if (!decoder->callback(&b, 1, decoder->callback_data)) {
-				break;
+			if (b < 0) {
+				return 0;
 			}
 
-			output_byte(decoder, buf, &result, b);
+			LHA_STATS_LITERAL(decoder);
+			decoder->ringbuf[decoder->ringbuf_pos] = (uint8_t) b;
+			++decoder->ringbuf_pos;
 		} else {
-			uint8_t cmd[2];
-			unsigned int seqstart, seqlen;
+			cmd0 = read_byte(decoder);
+			cmd1 = read_byte(decoder);
 
-			if (!decoder->callback(cmd, 2, decoder->callback_data)) {
-				break;
+			if (cmd0 < 0 || cmd1 < 0) {
+				return 0;
 			}
 
-			seqstart = (((unsigned int) cmd[1] & 0xf0) << 4)
-			         | cmd[0];
-			seqlen = ((unsigned int) cmd[1] & 0x0f) + THRESHOLD;
+			seqstart = (((unsigned int) cmd1 & 0xf0) << 4)
+			         | (unsigned int) cmd0;
+			seqlen = ((unsigned int) cmd1 & 0x0f) + THRESHOLD;
+
+			LHA_STATS_COPY(decoder, seqlen);
+			LHA_STATS_BEGIN(decoder, LHA_DECODER_STAGE_COPY);
+			output_block(decoder, seqstart, seqlen);
+			LHA_STATS_END(decoder);
+		}
+	}
+
+	return 1;
+}
+
+// Move any data that was written past the end of the ring buffer by the
+// last call to read() back to the start of the ring buffer.
+
+static void move_overrun(LHALZ5Decoder *decoder)
+{
+	if (decoder->ringbuf_pos >= RING_BUFFER_SIZE) {
+		decoder->ringbuf_pos -= RING_BUFFER_SIZE;
+		memcpy(decoder->ringbuf, decoder->ringbuf + RING_BUFFER_SIZE,
+		       decoder->ringbuf_pos);
+	}
+}
+
+// Decode data. The decoded data is returned as a pointer into the
+// ring buffer, avoiding the need for a separate output buffer.
+
+static size_t lha_lz5_read_direct(void *data, uint8_t **buf)
+{
+	LHALZ5Decoder *decoder = data;
+	unsigned int start;
+
+	move_overrun(decoder);
 
-			output_block(decoder, buf, &result, seqstart, seqlen);
+	start = decoder->ringbuf_pos;
+
+	// Decode as many runs as will fit in the output buffer. Stop
+	// when there might not be room for another run, or at the end of
+	// the ring buffer.
+
+	while (decoder->ringbuf_pos < RING_BUFFER_SIZE
+	    && decoder->ringbuf_pos - start + MAX_RUN_LEN
+	       <= OUTPUT_BUFFER_SIZE) {
+
+		if (!read_run(decoder)) {
+			break;
 		}
 	}
 
+	*buf = decoder->ringbuf + start;
+
+	return decoder->ringbuf_pos - start;
+}
+
+static size_t lha_lz5_read(void *data, uint8_t *buf)
+{
+	uint8_t *decoded;
+	size_t result;
+
+	result = lha_lz5_read_direct(data, &decoded);
+	memcpy(buf, decoded, result);
+
 	return result;
 }
 
+// Save a checkpoint. Each call to read() decodes whole runs, so the
+// ring buffer holds everything needed to continue.
+
+static int lha_lz5_checkpoint(void *data, uint8_t *buf,
+                              uint64_t *input_bits)
+{
+	LHALZ5Decoder *decoder = data;
+
+	move_overrun(decoder);
+
+	memcpy(buf, decoder->ringbuf, RING_BUFFER_SIZE);
+	lha_encode_uint32(buf + RING_BUFFER_SIZE, decoder->ringbuf_pos);
+
+	*input_bits = (decoder->input_total
+	               - (decoder->input_len - decoder->input_pos)) * 8;
+
+	return 1;
+}
+
+static int lha_lz5_restore(void *data, LHADecoderCallback callback,
+                           void *callback_data, uint8_t *buf,
+                           unsigned int skip_bits)
+{
+	LHALZ5Decoder *decoder = data;
+
+	lha_lz5_init(decoder, callback, callback_data);
+
+	memcpy(decoder->ringbuf, buf, RING_BUFFER_SIZE);
+	decoder->ringbuf_pos = lha_decode_uint32(buf + RING_BUFFER_SIZE);
+
+	return skip_bits == 0 && decoder->ringbuf_pos < RING_BUFFER_SIZE;
+}
+
 LHADecoderType lha_lz5_decoder = {
 	lha_lz5_init,
 	NULL,
 	lha_lz5_read,
 	sizeof(LHALZ5Decoder),
 	OUTPUT_BUFFER_SIZE,
-	RING_BUFFER_SIZE
+	RING_BUFFER_SIZE,
+	lha_lz5_read_direct,
+	NULL,
+	CHECKPOINT_SIZE,
+	lha_lz5_checkpoint,
+	lha_lz5_restore
 };
 
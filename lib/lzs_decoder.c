@@ -23,8 +23,10 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <inttypes.h>
 
 #include "lha_decoder.h"
+#include "lha_endian.h"
 
 #include "bit_stream_reader.c"
+#include "window_copy.c"
 
 // Parameters for ring buffer, used for storing history.  This acts
 // as the dictionary for copy operations.
@@ -38,20 +40,34 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define THRESHOLD 2
 
-// Size of output buffer.  Must be large enough to hold the results of
-// the maximum copy operation.
+// Maximum number of bytes output by a single command.
 
-#define OUTPUT_BUFFER_SIZE (15 + THRESHOLD)
+#define MAX_COMMAND_LEN (15 + THRESHOLD)
+
+// Maximum amount of data returned by a single call to read(). Each call
+// decodes commands until this limit is nearly reached.
+
+#define OUTPUT_BUFFER_SIZE 1024
+
+// Size of a checkpoint: the contents of the ring buffer, followed by
+// the 32-bit ring buffer position.
+
+#define CHECKPOINT_SIZE (RING_BUFFER_SIZE + 4)
 
 // Decoder for the -lzs- compression method used by old versions of LArc.
 //
 // The input stream consists of commands, each of which is either "output
 // a literal byte value" or "copy block". A bit at the start of each
 // command signals which command it is.
+//
+// The decoded data is written straight into the ring buffer and
+// returned from there; the last command decoded by a call to read()
+// can run past the end of the ring buffer, and this overrun is moved
+// back to the start on the next call.
 
 typedef struct {
 	BitStreamReader bit_stream_reader;
-	uint8_t ringbuf[RING_BUFFER_SIZE];
+	uint8_t ringbuf[RING_BUFFER_SIZE + MAX_COMMAND_LEN];
 	unsigned int ringbuf_pos;
 } LHALZSDecoder;
 
@@ -68,89 +84,195 @@ static int lha_lzs_init(void *data, LHADecoderCallback callback,
 	return 1;
 }
 
-// Add a single byte to the output buffer.
-
-static void output_byte(LHALZSDecoder *decoder, uint8_t *buf,
-                        size_t *buf_len, uint8_t b)
-{
-	buf[*buf_len] = b;
-	++*buf_len;
-
-	decoder->ringbuf[decoder->ringbuf_pos] = b;
-	decoder->ringbuf_pos = (decoder->ringbuf_pos + 1) % RING_BUFFER_SIZE;
-}
-
-// Output a "block" of data from the specified range in the ring buffer.
+// Output a "block" of data from the specified position in the ring
+// buffer.
 
 static void output_block(LHALZSDecoder *decoder,
-                         uint8_t *buf,
-                         size_t *buf_len,
                          unsigned int start,
                          unsigned int len)
 {
-	unsigned int i;
+	uint8_t *dst;
+	unsigned int distance, n;
 
-	for (i = 0; i < len; ++i) {
-		output_byte(decoder, buf, buf_len,
-		            decoder->ringbuf[(start + i) % RING_BUFFER_SIZE]);
+	// The position is an offset into the ring buffer; convert it
+	// into a distance back from the current position. A distance of
+	// a whole ring buffer is a copy from the position about to be
+	// overwritten.
+
+	distance = (decoder->ringbuf_pos + RING_BUFFER_SIZE - start - 1)
+	         % RING_BUFFER_SIZE + 1;
+	dst = decoder->ringbuf + decoder->ringbuf_pos;
+
+	if (distance <= decoder->ringbuf_pos) {
+		window_copy(dst, dst - distance, len);
+	} else {
+		// The source wraps around from the end of the ring buffer.
+		// It is ahead of the destination, so the part up to the
+		// end can be moved in one go, and the remainder continues
+		// from the start.
+
+		n = RING_BUFFER_SIZE - start;
+
+		if (n > len) {
+			n = len;
+		}
+
+		memmove(dst, decoder->ringbuf + start, n);
+
+		if (n < len) {
+			window_copy(dst + n, decoder->ringbuf, len - n);
+		}
 	}
+
+	decoder->ringbuf_pos += len;
 }
 
-// Process a single command from the LZS input stream.
+// Process a single command from the LZS input stream. Returns zero for
+// failure.
 
-static size_t lha_lzs_read(void *data, uint8_t *buf)
+static int read_command(LHALZSDecoder *decoder)
 {
-	LHALZSDecoder *decoder = data;
-	int bit;
-	size_t result;
-
-	// Start from an empty buffer.
+	int x, y;
+	unsigned int pos, len;
 
-	result = 0;
+	// Each command starts with a bit that signals the type. Read it
+	// together with the next eight bits, which are either a literal
+	// byte value or the top of a copy position.
 
-	// Each command starts with a bit that signals the type:
+	x = read_bits(&decoder->bit_stream_reader, 9);
 
-	bit = read_bit(&decoder->bit_stream_reader);
-
-	if (bit < 0) {
+	if (x < 0) {
 		return 0;
 	}
 
 	// What type of command is this?
 
-	if (bit) {
-		int b;
+	if ((x & 0x100) != 0) {
+		LHA_STATS_LITERAL(decoder);
+		decoder->ringbuf[decoder->ringbuf_pos] = (uint8_t) x;
+		++decoder->ringbuf_pos;
+	} else {
+		// The rest of the 11-bit position, then the 4-bit length.
 
-		b = read_bits(&decoder->bit_stream_reader, 8);
+		y = read_bits(&decoder->bit_stream_reader, 7);
 
-		if (b < 0) {
+		if (y < 0) {
 			return 0;
 		}
 
-		output_byte(decoder, buf, &result, (uint8_t) b);
-	} else {
-		int pos, len;
+		pos = ((unsigned int) x << 3) | ((unsigned int) y >> 4);
+		len = ((unsigned int) y & 0x0f) + THRESHOLD;
 
-		pos = read_bits(&decoder->bit_stream_reader, 11);
-		len = read_bits(&decoder->bit_stream_reader, 4);
+		LHA_STATS_COPY(decoder, len);
+		LHA_STATS_BEGIN(decoder, LHA_DECODER_STAGE_COPY);
+		output_block(decoder, pos, len);
+		LHA_STATS_END(decoder);
+	}
 
-		if (pos < 0 || len < 0) {
-			return 0;
-		}
+	return 1;
+}
 
-		output_block(decoder, buf, &result, (unsigned int) pos,
-		             (unsigned int) len + THRESHOLD);
+// Move any data that was written past the end of the ring buffer by the
+// last call to read() back to the start of the ring buffer.
+
+static void move_overrun(LHALZSDecoder *decoder)
+{
+	if (decoder->ringbuf_pos >= RING_BUFFER_SIZE) {
+		decoder->ringbuf_pos -= RING_BUFFER_SIZE;
+		memcpy(decoder->ringbuf, decoder->ringbuf + RING_BUFFER_SIZE,
+		       decoder->ringbuf_pos);
 	}
+}
+
+// Decode data. The decoded data is returned as a pointer into the
+// ring buffer, avoiding the need for a separate output buffer.
+
+static size_t lha_lzs_read_direct(void *data, uint8_t **buf)
+{
+	LHALZSDecoder *decoder = data;
+	unsigned int start;
+
+	move_overrun(decoder);
+
+	start = decoder->ringbuf_pos;
+
+	// Decode as many commands as will fit in the output buffer. Stop
+	// when there might not be room for another command, or at the
+	// end of the ring buffer.
+
+	while (decoder->ringbuf_pos < RING_BUFFER_SIZE
+	    && decoder->ringbuf_pos - start + MAX_COMMAND_LEN
+	       <= OUTPUT_BUFFER_SIZE) {
+
+		if (!read_command(decoder)) {
+			break;
+		}
+	}
+
+	*buf = decoder->ringbuf + start;
+
+	return decoder->ringbuf_pos - start;
+}
+
+static size_t lha_lzs_read(void *data, uint8_t *buf)
+{
+	uint8_t *decoded;
+	size_t result;
+
+	result = lha_lzs_read_direct(data, &decoded);
+	memcpy(buf, decoded, result);
 
 	return result;
 }
 
+// Save a checkpoint. Each call to read() decodes whole commands, so
+// the ring buffer holds everything needed to continue.
+
+static int lha_lzs_checkpoint(void *data, uint8_t *buf,
+                              uint64_t *input_bits)
+{
+	LHALZSDecoder *decoder = data;
+
+	move_overrun(decoder);
+
+	memcpy(buf, decoder->ringbuf, RING_BUFFER_SIZE);
+	lha_encode_uint32(buf + RING_BUFFER_SIZE, decoder->ringbuf_pos);
+
+	*input_bits = bit_stream_reader_position(&decoder->bit_stream_reader);
+
+	return 1;
+}
+
+static int lha_lzs_restore(void *data, LHADecoderCallback callback,
+                           void *callback_data, uint8_t *buf,
+                           unsigned int skip_bits)
+{
+	LHALZSDecoder *decoder = data;
+
+	lha_lzs_init(decoder, callback, callback_data);
+
+	memcpy(decoder->ringbuf, buf, RING_BUFFER_SIZE);
+	decoder->ringbuf_pos = lha_decode_uint32(buf + RING_BUFFER_SIZE);
+
+	if (decoder->ringbuf_pos >= RING_BUFFER_SIZE) {
+		return 0;
+	}
+
+	return skip_bits == 0
+	    || read_bits(&decoder->bit_stream_reader, skip_bits) >= 0;
+}
+
 LHADecoderType lha_lzs_decoder = {
 	lha_lzs_init,
 	NULL,
 	lha_lzs_read,
 	sizeof(LHALZSDecoder),
 	OUTPUT_BUFFER_SIZE,
-	RING_BUFFER_SIZE
+	RING_BUFFER_SIZE,
+	lha_lzs_read_direct,
+	NULL,
+	CHECKPOINT_SIZE,
+	lha_lzs_checkpoint,
+	lha_lzs_restore
 };
 
@@ -115,11 +115,8 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 
-#include "lha_decoder.h"
 #include "lha_endian.h"
-#include "lha_file_header.h"
-
-#define OUTPUT_BUFFER_SIZE 4096 /* bytes */
+#include "macbinary.h"
 
 // Classic Mac OS represents time in seconds since 1904, instead of
 // Unix time's 1970 epoch. This is the difference between the two.
@@ -128,7 +125,7 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 // Size of the MacBinary header.
 
-#define MBHDR_SIZE 128 /* bytes */
+#define MBHDR_SIZE LHA_MACBINARY_HEADER_SIZE
 
 // Offsets of fields in MacBinary header (and their sizes):
 
@@ -270,182 +267,30 @@ static int is_macbinary_header(uint8_t *data, LHAFileHeader *header)
 	return 1;
 }
 
-//
-// MacBinary "decoder". This reuses the LHADecoder framework to provide
-// a "pass-through" decoder that detects and strips the MacBinary header.
-//
-
-typedef struct {
-
-	// When the decoder is initialized, the first 128 bytes of
-	// data are read into this buffer and analysed. If it is
-	// not a MacBinary header, the data must be kept so that it
-	// can be returned in the first call to .read().
-	// mb_header_bytes contains the number of bytes still to read.
-
-	uint8_t mb_header[MBHDR_SIZE];
-	size_t mb_header_bytes;
-
-	// The "inner" decoder used to read the compressed data.
-
-	LHADecoder *decoder;
-
-	// Number of bytes still to read before decode should be
-	// terminated.
-
-	size_t stream_remaining;
-} MacBinaryDecoder;
-
-// Structure used when initializing a MacBinaryDecoder.
-
-typedef struct {
-	LHADecoder *decoder;
-	LHAFileHeader *header;
-} MacBinaryDecoderClosure;
-
-static int read_macbinary_header(MacBinaryDecoder *decoder,
-                                 LHAFileHeader *header)
+int lha_macbinary_header(uint8_t *data, LHAFileHeader *header,
+                         size_t *length)
 {
 	unsigned int data_fork_len, res_fork_len;
-	size_t n, bytes;
-
-	bytes = 0;
 
-	while (bytes < MBHDR_SIZE) {
-		n = lha_decoder_read(decoder->decoder,
-		                     decoder->mb_header + bytes,
-		                     MBHDR_SIZE - bytes);
+	// Check if the data corresponds to a MacBinary header that
+	// matches the .lzh header. If not, it is just a normal file.
 
-		// Unexpected EOF?
-
-		if (n == 0) {
-			return 0;
-		}
-
-		bytes += n;
-	}
-
-	// Check if the data that was read corresponds to a MacBinary
-	// header that matches the .lzh header. If not, just decode it
-	// as a normal stream.
-
-	if (!is_macbinary_header(decoder->mb_header, header)) {
-		decoder->mb_header_bytes = bytes;
-		return 1;
+	if (header->length < MBHDR_SIZE
+	 || !is_macbinary_header(data, header)) {
+		return 0;
 	}
 
-	// We have a MacBinary header, so skip over it. Decide how
-	// long the data stream is (see policy in comment at start
-	// of file).
+	// Decide how long the data stream is (see policy in comment at
+	// start of file).
 
-	decoder->mb_header_bytes = 0;
-
-	data_fork_len = lha_decode_be_uint32(
-	                   &decoder->mb_header[MBHDR_OFF_DATA_FORK_LEN]);
-	res_fork_len = lha_decode_be_uint32(
-	                   &decoder->mb_header[MBHDR_OFF_RES_FORK_LEN]);
+	data_fork_len = lha_decode_be_uint32(&data[MBHDR_OFF_DATA_FORK_LEN]);
+	res_fork_len = lha_decode_be_uint32(&data[MBHDR_OFF_RES_FORK_LEN]);
 
 	if (data_fork_len > 0) {
-		decoder->stream_remaining = data_fork_len;
+		*length = data_fork_len;
 	} else {
-		decoder->stream_remaining = res_fork_len;
-	}
-
-	return 1;
-}
-
-static int macbinary_decoder_init(void *_decoder,
-                                  LHADecoderCallback callback,
-                                  void *_closure)
-{
-	MacBinaryDecoder *decoder = _decoder;
-	MacBinaryDecoderClosure *closure = _closure;
-
-	decoder->decoder = closure->decoder;
-	decoder->mb_header_bytes = 0;
-	decoder->stream_remaining = closure->header->length;
-
-	if (closure->header->length >= MBHDR_SIZE
-	 && !read_macbinary_header(decoder, closure->header)) {
-		return 0;
+		*length = res_fork_len;
 	}
 
 	return 1;
 }
-
-static void decode_to_end(LHADecoder *decoder)
-{
-	uint8_t buf[128];
-	size_t n;
-
-	do {
-		n = lha_decoder_read(decoder, buf, sizeof(buf));
-	} while (n > 0);
-}
-
-static size_t macbinary_decoder_read(void *_decoder, uint8_t *buf)
-{
-	MacBinaryDecoder *decoder = _decoder;
-	size_t result;
-	size_t to_read;
-	size_t n;
-
-	result = 0;
-
-	// If there is data from the mb_header buffer waiting to be
-	// read, add it first.
-
-	if (decoder->mb_header_bytes > 0) {
-		memcpy(buf, decoder->mb_header, decoder->mb_header_bytes);
-		result = decoder->mb_header_bytes;
-		decoder->mb_header_bytes = 0;
-	}
-
-	// Read further data, if there is some in the stream still to read.
-
-	to_read = OUTPUT_BUFFER_SIZE - result;
-
-	if (to_read > decoder->stream_remaining) {
-		to_read = decoder->stream_remaining;
-	}
-
-	n = lha_decoder_read(decoder->decoder, buf + result, to_read);
-
-	decoder->stream_remaining -= n;
-	result += n;
-
-	// Once the end of the stream is reached, there may still be
-	// data from the inner decoder to decompress. When this happens,
-	// run the decoder until the end.
-
-	if (decoder->stream_remaining == 0) {
-		decode_to_end(decoder->decoder);
-	}
-
-	return result;
-}
-
-static LHADecoderType macbinary_decoder_type = {
-	macbinary_decoder_init,
-	NULL,
-	macbinary_decoder_read,
-	sizeof(MacBinaryDecoder),
-	OUTPUT_BUFFER_SIZE,
-	0,
-};
-
-LHADecoder *lha_macbinary_passthrough(LHADecoder *decoder,
-                                      LHAFileHeader *header)
-{
-	MacBinaryDecoderClosure closure;
-	LHADecoder *result;
-
-	closure.decoder = decoder;
-	closure.header = header;
-
-	result = lha_decoder_new(&macbinary_decoder_type, NULL,
-	                         &closure, header->length);
-
-	return result;
-}
-
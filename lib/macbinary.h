@@ -21,29 +21,37 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #ifndef LHASA_MACBINARY_H
 #define LHASA_MACBINARY_H
 
-#include "lha_decoder.h"
+#include <stddef.h>
+#include <inttypes.h>
+
 #include "lha_file_header.h"
 
 /**
- * Create a passthrough decoder to handle MacBinary headers added
- * by MacLHA.
- *
- * The new decoder reads from the specified decoder and filters
- * out the header. The contents of the MacBinary header must match
- * the details from the specified file header.
+ * Size of a MacBinary header, in bytes.
+ */
+
+#define LHA_MACBINARY_HEADER_SIZE 128
+
+/**
+ * Check whether a file begins with a MacBinary header added by MacLHA.
+ * If it does, the header should be stripped off, and only the file
+ * contents that follow it extracted; any data after the contents
+ * should be discarded.
  *
- * @param decoder      The "inner" decoder from which to read data.
+ * @param data         Pointer to the first
+ *                     @ref LHA_MACBINARY_HEADER_SIZE bytes of the
+ *                     decompressed data.
  * @param header       The file header, that the contents of the
  *                     MacBinary header must match.
- * @return             A new decoder, which passes through the
- *                     contents of the inner decoder, stripping
- *                     off the MacBinary header and truncating
- *                     as appropriate. Both decoders must be freed
- *                     by the caller.
+ * @param length       Pointer to a variable in which to store the
+ *                     length of the file contents following the
+ *                     MacBinary header.
+ * @return             Non-zero if the data begins with a MacBinary
+ *                     header.
  */
 
-LHADecoder *lha_macbinary_passthrough(LHADecoder *decoder,
-                                      LHAFileHeader *header);
+int lha_macbinary_header(uint8_t *data, LHAFileHeader *header,
+                         size_t *length);
 
 #endif /* #ifndef LHASA_MACBINARY_H */
 
@@ -30,6 +30,10 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 typedef struct {
 	LHADecoderCallback callback;
 	void *callback_data;
+
+	// Total number of bytes read from the callback.
+
+	uint64_t input_total;
 } LHANullDecoder;
 
 static int lha_null_init(void *data, LHADecoderCallback callback,
@@ -39,6 +43,7 @@ static int lha_null_init(void *data, LHADecoderCallback callback,
 
 	decoder->callback = callback;
 	decoder->callback_data = callback_data;
+	decoder->input_total = 0;
 
 	return 1;
 }
@@ -46,8 +51,31 @@ static int lha_null_init(void *data, LHADecoderCallback callback,
 static size_t lha_null_read(void *data, uint8_t *buf)
 {
 	LHANullDecoder *decoder = data;
+	size_t result;
+
+	result = decoder->callback(buf, BLOCK_READ_SIZE, decoder->callback_data);
+	decoder->input_total += result;
+
+	return result;
+}
+
+// The data is its own state: a checkpoint is just the position in it.
+
+static int lha_null_checkpoint(void *data, uint8_t *buf,
+                               uint64_t *input_bits)
+{
+	LHANullDecoder *decoder = data;
+
+	*input_bits = decoder->input_total * 8;
+
+	return 1;
+}
 
-	return decoder->callback(buf, BLOCK_READ_SIZE, decoder->callback_data);
+static int lha_null_restore(void *data, LHADecoderCallback callback,
+                            void *callback_data, uint8_t *buf,
+                            unsigned int skip_bits)
+{
+	return skip_bits == 0 && lha_null_init(data, callback, callback_data);
 }
 
 LHADecoderType lha_null_decoder = {
@@ -56,6 +84,12 @@ LHADecoderType lha_null_decoder = {
 	lha_null_read,
 	sizeof(LHANullDecoder),
 	BLOCK_READ_SIZE,
-	2048
+	2048,
+	NULL,
+	NULL,
+	0,
+	lha_null_checkpoint,
+	lha_null_restore,
+	1
 };
 
@@ -33,8 +33,11 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <inttypes.h>
 
 #include "lha_decoder.h"
+#include "lha_endian.h"
+#define BIT_STREAM_WITH_READ_BIT
 #include "bit_stream_reader.c"
 #include "pma_common.c"
+#include "window_copy.c"
 
 // Size of the ring buffer used to hold the history.
 
@@ -48,10 +51,26 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define MAX_COPY_BLOCK_LEN 244
 
-// Output buffer length. A single call to lha_pm1_read can perform one
-// byte block output followed by a copy command.
+// Maximum number of bytes output by a single command: a byte block
+// followed by a copy command.
 
-#define OUTPUT_BUFFER_SIZE (MAX_BYTE_BLOCK_LEN + MAX_COPY_BLOCK_LEN)
+#define MAX_COMMAND_LEN (MAX_BYTE_BLOCK_LEN + MAX_COPY_BLOCK_LEN)
+
+// Maximum amount of data returned by a single call to read(). Each call
+// decodes commands until this limit is nearly reached.
+
+#define OUTPUT_BUFFER_SIZE 4096
+
+// Size of a checkpoint: the 32-bit output stream position, index of
+// the byte decode tree (0xff if it has not been read yet) and 32-bit
+// ring buffer position, then the ring buffer and the history list.
+
+#define CHECKPOINT_SIZE (RING_BUFFER_SIZE + 9 + HISTORY_LIST_SAVE_SIZE)
+
+// Value saved in a checkpoint for the byte decode tree if the start
+// header has not been read yet.
+
+#define NO_DECODE_TREE 0xff
 
 typedef struct {
 	BitStreamReader bit_stream_reader;
@@ -65,11 +84,19 @@ typedef struct {
 
 	const uint8_t *byte_decode_tree;
 
-	// History ring buffer.
+	// History ring buffer. Decoded data is written straight into the
+	// ring buffer and returned from there; the last command decoded
+	// by a call to read() can run past the end, and this overrun is
+	// moved back to the start on the next call.
 
-	uint8_t ringbuf[RING_BUFFER_SIZE];
+	uint8_t ringbuf[RING_BUFFER_SIZE + MAX_COMMAND_LEN];
 	unsigned int ringbuf_pos;
 
+	// If non-zero, a command failed to decode; nothing more is
+	// returned.
+
+	int failed;
+
 	// History linked list, for adaptively encoding byte values.
 
 	HistoryLinkedList history_list;
@@ -212,6 +239,7 @@ static int lha_pm1_init(void *data, LHADecoderCallback callback,
 	decoder->output_stream_pos = 0;
 	decoder->byte_decode_tree = NULL;
 	decoder->ringbuf_pos = 0;
+	decoder->failed = 0;
 
 	init_history_list(&decoder->history_list);
 
@@ -244,8 +272,7 @@ static void outputted_byte(LHAPM1Decoder *decoder, uint8_t b)
 	// Add to history ring buffer.
 
 	decoder->ringbuf[decoder->ringbuf_pos] = b;
-	decoder->ringbuf_pos
-	    = (decoder->ringbuf_pos + 1) % RING_BUFFER_SIZE;
+	++decoder->ringbuf_pos;
 
 	// Other updates: history linked list, output stream position:
 
@@ -413,12 +440,14 @@ static int read_copy_type_range(LHAPM1Decoder *decoder)
 // Read a copy command from the input stream and copy from history.
 // Returns 0 for failure.
 
-static size_t read_copy_command(LHAPM1Decoder *decoder, uint8_t *buf)
+static size_t read_copy_command(LHAPM1Decoder *decoder)
 {
 	int range_index;
 	int history_distance;
-	int copy_index, i;
-	int count;
+	unsigned int distance, start, i;
+	size_t count, n;
+	uint8_t *dst;
+	int x;
 
 	range_index = read_copy_type_range(decoder);
 
@@ -433,11 +462,13 @@ static size_t read_copy_command(LHAPM1Decoder *decoder, uint8_t *buf)
 	if (range_index < 2) {
 		count = 2;
 	} else {
-		count = read_copy_byte_count(decoder);
+		x = read_copy_byte_count(decoder);
 
-		if (count < 0) {
+		if (x < 0) {
 			return 0;
 		}
+
+		count = (size_t) x;
 	}
 
 	// The 'range_index' variable is an index into the copy_ranges
@@ -484,15 +515,46 @@ static size_t read_copy_command(LHAPM1Decoder *decoder, uint8_t *buf)
 
 	// Copy from the ring buffer.
 
-	copy_index = (decoder->ringbuf_pos + RING_BUFFER_SIZE
-	              - history_distance - 1) % RING_BUFFER_SIZE;
+	LHA_STATS_COPY(decoder, count);
+	LHA_STATS_BEGIN(decoder, LHA_DECODER_STAGE_COPY);
+
+	distance = (unsigned int) history_distance + 1;
+	dst = decoder->ringbuf + decoder->ringbuf_pos;
+
+	if (distance <= decoder->ringbuf_pos) {
+		window_copy(dst, dst - distance, count);
+	} else {
+		// The source is before the start of the buffer and so
+		// wraps around to the end of the ring. The source is
+		// always ahead of the destination here, so the first part
+		// can be moved in one go; if it reaches the end of the
+		// ring, the rest continues from the start.
+
+		start = decoder->ringbuf_pos + RING_BUFFER_SIZE - distance;
+		n = RING_BUFFER_SIZE - start;
+
+		if (n > count) {
+			n = count;
+		}
+
+		memmove(dst, decoder->ringbuf + start, n);
+
+		if (n < count) {
+			window_copy(dst + n, decoder->ringbuf, count - n);
+		}
+	}
+
+	// Every byte copied is moved to the front of the history list.
 
 	for (i = 0; i < count; ++i) {
-		buf[i] = decoder->ringbuf[copy_index];
-		outputted_byte(decoder, decoder->ringbuf[copy_index]);
-		copy_index = (copy_index + 1) % RING_BUFFER_SIZE;
+		update_history_list(&decoder->history_list, dst[i]);
 	}
 
+	decoder->ringbuf_pos += (unsigned int) count;
+	decoder->output_stream_pos += (unsigned int) count;
+
+	LHA_STATS_END(decoder);
+
 	return count;
 }
 
@@ -632,7 +694,7 @@ static int read_byte_block_count(BitStreamReader *reader)
 // Read a block of bytes from the input stream.
 // Returns 0 for failure.
 
-static size_t read_byte_block(LHAPM1Decoder *decoder, uint8_t *buf)
+static size_t read_byte_block(LHAPM1Decoder *decoder)
 {
 	size_t result, result2;
 	int byteval;
@@ -656,8 +718,8 @@ static size_t read_byte_block(LHAPM1Decoder *decoder, uint8_t *buf)
 			return 0;
 		}
 
-		buf[i] = byteval;
-		outputted_byte(decoder, byteval);
+		LHA_STATS_LITERAL(decoder);
+		outputted_byte(decoder, (uint8_t) byteval);
 	}
 
 	result = (size_t) block_len;
@@ -671,7 +733,7 @@ static size_t read_byte_block(LHAPM1Decoder *decoder, uint8_t *buf)
 		return result;
 	}
 
-	result2 = read_copy_command(decoder, buf + result);
+	result2 = read_copy_command(decoder);
 
 	if (result2 == 0) {
 		return 0;
@@ -680,27 +742,154 @@ static size_t read_byte_block(LHAPM1Decoder *decoder, uint8_t *buf)
 	return result + result2;
 }
 
-static size_t lha_pm1_read(void *data, uint8_t *buf)
+// Decode a single command. Returns the number of bytes output, or 0 for
+// failure.
+
+static size_t read_command(LHAPM1Decoder *decoder)
 {
-	LHAPM1Decoder *decoder = data;
 	int command_type;
 
+	// Read what type of commmand this is.
+
+	command_type = read_bit(&decoder->bit_stream_reader);
+
+	if (command_type == 0) {
+		return read_copy_command(decoder);
+	} else {
+		return read_byte_block(decoder);
+	}
+}
+
+// Move any data that was written past the end of the ring buffer by the
+// last call to read() back to the start of the ring buffer.
+
+static void move_overrun(LHAPM1Decoder *decoder)
+{
+	if (decoder->ringbuf_pos >= RING_BUFFER_SIZE) {
+		decoder->ringbuf_pos -= RING_BUFFER_SIZE;
+		memcpy(decoder->ringbuf, decoder->ringbuf + RING_BUFFER_SIZE,
+		       decoder->ringbuf_pos);
+	}
+}
+
+// Decode data. The decoded data is returned as a pointer into the
+// ring buffer, avoiding the need for a separate output buffer.
+
+static size_t lha_pm1_read_direct(void *data, uint8_t **buf)
+{
+	LHAPM1Decoder *decoder = data;
+	unsigned int start, end;
+
 	// Start of input stream? Read the header.
 
-	if (decoder->byte_decode_tree == NULL
-	 && !read_start_header(decoder)) {
+	if (decoder->failed
+	 || (decoder->byte_decode_tree == NULL
+	     && !read_start_header(decoder))) {
 		return 0;
 	}
 
-	// Read what type of commmand this is.
+	move_overrun(decoder);
 
-	command_type = read_bit(&decoder->bit_stream_reader);
+	start = decoder->ringbuf_pos;
+	end = start;
 
-	if (command_type == 0) {
-		return read_copy_command(decoder, buf);
+	// Decode as many commands as will fit in the output buffer.
+	// Stop when there might not be room for the longest command, or
+	// at the end of the ring buffer. If a command fails, the data
+	// decoded by the commands before it is still returned, the same
+	// as if they had been decoded one at a time.
+
+	while (decoder->ringbuf_pos < RING_BUFFER_SIZE
+	    && decoder->ringbuf_pos - start + MAX_COMMAND_LEN
+	       <= OUTPUT_BUFFER_SIZE) {
+
+		if (read_command(decoder) == 0) {
+			decoder->failed = 1;
+			break;
+		}
+
+		end = decoder->ringbuf_pos;
+	}
+
+	*buf = decoder->ringbuf + start;
+
+	return end - start;
+}
+
+static size_t lha_pm1_read(void *data, uint8_t *buf)
+{
+	uint8_t *decoded;
+	size_t result;
+
+	result = lha_pm1_read_direct(data, &decoded);
+	memcpy(buf, decoded, result);
+
+	return result;
+}
+
+// Save a checkpoint. Each call to read() decodes whole commands, so
+// this is possible at any point until a command fails.
+
+static int lha_pm1_checkpoint(void *data, uint8_t *buf,
+                              uint64_t *input_bits)
+{
+	LHAPM1Decoder *decoder = data;
+	unsigned int index;
+
+	if (decoder->failed) {
+		return 0;
+	}
+
+	move_overrun(decoder);
+
+	if (decoder->byte_decode_tree == NULL) {
+		index = NO_DECODE_TREE;
 	} else {
-		return read_byte_block(decoder, buf);
+		index = (unsigned int) (decoder->byte_decode_tree
+		                        - byte_decode_trees[0])
+		      / sizeof(byte_decode_trees[0]);
 	}
+
+	lha_encode_uint32(buf, decoder->output_stream_pos);
+	buf[4] = (uint8_t) index;
+	lha_encode_uint32(buf + 5, decoder->ringbuf_pos);
+	memcpy(buf + 9, decoder->ringbuf, RING_BUFFER_SIZE);
+	save_history_list(&decoder->history_list,
+	                  buf + 9 + RING_BUFFER_SIZE);
+
+	*input_bits = bit_stream_reader_position(&decoder->bit_stream_reader);
+
+	return 1;
+}
+
+static int lha_pm1_restore(void *data, LHADecoderCallback callback,
+                           void *callback_data, uint8_t *buf,
+                           unsigned int skip_bits)
+{
+	LHAPM1Decoder *decoder = data;
+	unsigned int index;
+
+	lha_pm1_init(decoder, callback, callback_data);
+
+	decoder->output_stream_pos = lha_decode_uint32(buf);
+	index = buf[4];
+	decoder->ringbuf_pos = lha_decode_uint32(buf + 5);
+	memcpy(decoder->ringbuf, buf + 9, RING_BUFFER_SIZE);
+	load_history_list(&decoder->history_list,
+	                  buf + 9 + RING_BUFFER_SIZE);
+
+	if (index < sizeof(byte_decode_trees) / sizeof(byte_decode_trees[0])) {
+		decoder->byte_decode_tree = byte_decode_trees[index];
+	} else if (index != NO_DECODE_TREE) {
+		return 0;
+	}
+
+	if (decoder->ringbuf_pos >= RING_BUFFER_SIZE) {
+		return 0;
+	}
+
+	return skip_bits == 0
+	    || read_bits(&decoder->bit_stream_reader, skip_bits) >= 0;
 }
 
 LHADecoderType lha_pm1_decoder = {
@@ -709,6 +898,11 @@ LHADecoderType lha_pm1_decoder = {
 	lha_pm1_read,
 	sizeof(LHAPM1Decoder),
 	OUTPUT_BUFFER_SIZE,
-	2048
+	2048,
+	lha_pm1_read_direct,
+	NULL,
+	CHECKPOINT_SIZE,
+	lha_pm1_checkpoint,
+	lha_pm1_restore
 };
 
@@ -29,7 +29,9 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <inttypes.h>
 
 #include "lha_decoder.h"
+#include "lha_endian.h"
 
+#define BIT_STREAM_WITH_READ_BIT
 #include "bit_stream_reader.c"
 #include "pma_common.c"
 
@@ -56,6 +58,16 @@ typedef uint8_t TreeElement;
 
 #define OFFSET_TREE_ELEMENTS  17
 
+// Size of a checkpoint: the tree state, 32-bit count until the next
+// rebuild and 32-bit ring buffer position, then the ring buffer, the
+// history list, and the two trees with their lookup tables (the
+// offset tree preceded by a flag indicating whether it is used).
+
+#define CHECKPOINT_SIZE       (RING_BUFFER_SIZE + 10 \
+                               + HISTORY_LIST_SAVE_SIZE \
+                               + CODE_TREE_ELEMENTS + OFFSET_TREE_ELEMENTS \
+                               + TREE_LOOKUP_SIZE * 4)
+
 typedef enum {
 	PM2_REBUILD_UNBUILT,          // At start of stream
 	PM2_REBUILD_BUILD1,           // After 1KiB
@@ -90,6 +102,7 @@ typedef struct {
 	// root node.
 
 	TreeElement code_tree[CODE_TREE_ELEMENTS];
+	TreeLookupEntry code_lookup[TREE_LOOKUP_SIZE];
 
 	// If zero, we don't need an offset tree:
 
@@ -99,6 +112,7 @@ typedef struct {
 	// Same format as code_tree[].
 
 	TreeElement offset_tree[OFFSET_TREE_ELEMENTS];
+	TreeLookupEntry offset_lookup[TREE_LOOKUP_SIZE];
 
 } LHAPM2Decoder;
 
@@ -158,8 +172,10 @@ static int lha_pm2_decoder_init(void *data, LHADecoderCallback callback,
 
 	// Initialize the lookup trees to a known state.
 
-	init_tree(decoder->code_tree, CODE_TREE_ELEMENTS);
-	init_tree(decoder->offset_tree, OFFSET_TREE_ELEMENTS);
+	init_tree(decoder->code_tree, CODE_TREE_ELEMENTS,
+	          decoder->code_lookup);
+	init_tree(decoder->offset_tree, OFFSET_TREE_ELEMENTS,
+	          decoder->offset_lookup);
 
 	return 1;
 }
@@ -195,7 +211,8 @@ static int read_code_tree(LHAPM2Decoder *decoder)
 	// Minimum length of zero means a tree containing a single code.
 
 	if (min_code_length == 0) {
-		set_tree_single(decoder->code_tree, num_codes - 1);
+		set_tree_single(decoder->code_tree, decoder->code_lookup,
+		                num_codes - 1);
 		return 1;
 	}
 
@@ -230,7 +247,7 @@ static int read_code_tree(LHAPM2Decoder *decoder)
 	// Build the tree.
 
 	build_tree(decoder->code_tree, sizeof(decoder->code_tree),
-	           code_lengths, (unsigned int) num_codes);
+	           decoder->code_lookup, code_lengths, (unsigned int) num_codes);
 
 	return 1;
 }
@@ -278,14 +295,15 @@ static int read_offset_tree(LHAPM2Decoder *decoder,
 	// If there was a single code, this is a single node tree.
 
 	if (num_codes == 1) {
-		set_tree_single(decoder->offset_tree, single_offset);
+		set_tree_single(decoder->offset_tree, decoder->offset_lookup,
+		                single_offset);
 		return 1;
 	}
 
 	// Build the tree.
 
 	build_tree(decoder->offset_tree, sizeof(decoder->offset_tree),
-	           offset_lengths, num_offsets);
+	           decoder->offset_lookup, offset_lengths, num_offsets);
 
 	return 1;
 }
@@ -295,6 +313,9 @@ static int read_offset_tree(LHAPM2Decoder *decoder,
 
 static void rebuild_tree(LHAPM2Decoder *decoder)
 {
+	LHA_STATS_TREE(decoder);
+	LHA_STATS_BEGIN(decoder, LHA_DECODER_STAGE_TREES);
+
 	switch (decoder->tree_state) {
 
 		// Initial tree build, from start of stream:
@@ -344,6 +365,8 @@ static void rebuild_tree(LHAPM2Decoder *decoder)
 			decoder->tree_rebuild_remaining = 4096;
 			break;
 	}
+
+	LHA_STATS_END(decoder);
 }
 
 static void output_byte(LHAPM2Decoder *decoder, uint8_t *buf,
@@ -390,6 +413,7 @@ static void read_single_byte(LHAPM2Decoder *decoder, unsigned int code,
 	}
 
 	b = find_in_history_list(&decoder->history_list, (uint8_t) offset);
+	LHA_STATS_LITERAL(decoder);
 	output_byte(decoder, buf, buf_len, b);
 }
 
@@ -403,6 +427,9 @@ static int history_get_count(LHAPM2Decoder *decoder, unsigned int code)
 
 	if (code < 15) {
 		return (int) code + 2;
+	} else if (code - 15 >= sizeof(copy_decode) / sizeof(*copy_decode)) {
+		// The code tree can hold more codes than are valid.
+		return -1;
 	} else {
 		return decode_variable_length(&decoder->bit_stream_reader,
 		                              copy_decode, code - 15);
@@ -434,7 +461,8 @@ static int history_get_offset(LHAPM2Decoder *decoder, unsigned int code)
 	else if (code < 20) {
 
 		val = read_from_tree(&decoder->bit_stream_reader,
-		                     decoder->offset_tree);
+		                     decoder->offset_tree,
+		                     decoder->offset_lookup);
 
 		if (val < 0) {
 			return -1;
@@ -494,11 +522,16 @@ static void copy_from_history(LHAPM2Decoder *decoder, unsigned int code,
 	start = decoder->ringbuf_pos + RING_BUFFER_SIZE - 1
 	      - (unsigned int) offset;
 
+	LHA_STATS_COPY(decoder, (unsigned int) to_copy);
+	LHA_STATS_BEGIN(decoder, LHA_DECODER_STAGE_COPY);
+
 	for (i = 0; i < (unsigned int) to_copy; ++i) {
 		pos = (start + i) % RING_BUFFER_SIZE;
 
 		output_byte(decoder, buf, buf_len, decoder->ringbuf[pos]);
 	}
+
+	LHA_STATS_END(decoder);
 }
 
 // Decode data and store it into buf[], returning the number of
@@ -522,7 +555,8 @@ static size_t lha_pm2_decoder_read(void *data, uint8_t *buf)
 
 	result = 0;
 
-	code = read_from_tree(&decoder->bit_stream_reader, decoder->code_tree);
+	code = read_from_tree(&decoder->bit_stream_reader,
+	                      decoder->code_tree, decoder->code_lookup);
 
 	if (code < 0) {
 		return 0;
@@ -538,12 +572,156 @@ static size_t lha_pm2_decoder_read(void *data, uint8_t *buf)
 	return result;
 }
 
+// Save a tree and its lookup table in a checkpoint.
+
+static uint8_t *save_tree(uint8_t *buf, TreeElement *tree, size_t tree_len,
+                          TreeLookupEntry *lookup)
+{
+	unsigned int i;
+
+	memcpy(buf, tree, tree_len);
+	buf += tree_len;
+
+	for (i = 0; i < TREE_LOOKUP_SIZE; ++i) {
+		buf[0] = lookup[i].node;
+		buf[1] = lookup[i].bits;
+		buf += 2;
+	}
+
+	return buf;
+}
+
+// Check that a tree element refers to a node within the tree, or is a
+// leaf for a code less than 'max_code'.
+
+static int valid_element(TreeElement element, size_t tree_len,
+                         unsigned int max_code)
+{
+	if ((element & TREE_NODE_LEAF) != 0) {
+		return (unsigned int) (element & ~TREE_NODE_LEAF) < max_code;
+	} else {
+		return (size_t) element + 1 < tree_len;
+	}
+}
+
+// Load a tree and its lookup table from a checkpoint. Returns NULL if
+// they are not valid.
+
+static uint8_t *load_tree(uint8_t *buf, TreeElement *tree, size_t tree_len,
+                          unsigned int max_code, TreeLookupEntry *lookup)
+{
+	unsigned int i;
+
+	memcpy(tree, buf, tree_len);
+	buf += tree_len;
+
+	for (i = 0; i < tree_len; ++i) {
+		if (!valid_element(tree[i], tree_len, max_code)) {
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < TREE_LOOKUP_SIZE; ++i) {
+		lookup[i].node = buf[0];
+		lookup[i].bits = buf[1];
+		buf += 2;
+
+		if (!valid_element(lookup[i].node, tree_len, max_code)
+		 || lookup[i].bits > TREE_LOOKUP_BITS) {
+			return NULL;
+		}
+	}
+
+	return buf;
+}
+
+// Save a checkpoint. Each call to read() decodes a whole command, so
+// this is possible at any point.
+
+static int lha_pm2_checkpoint(void *data, uint8_t *buf,
+                              uint64_t *input_bits)
+{
+	LHAPM2Decoder *decoder = data;
+
+	buf[0] = (uint8_t) decoder->tree_state;
+	lha_encode_uint32(buf + 1, (uint32_t) decoder->tree_rebuild_remaining);
+	lha_encode_uint32(buf + 5, decoder->ringbuf_pos);
+	buf += 9;
+
+	memcpy(buf, decoder->ringbuf, RING_BUFFER_SIZE);
+	buf += RING_BUFFER_SIZE;
+	save_history_list(&decoder->history_list, buf);
+	buf += HISTORY_LIST_SAVE_SIZE;
+
+	buf = save_tree(buf, decoder->code_tree, CODE_TREE_ELEMENTS,
+	                decoder->code_lookup);
+	buf[0] = (uint8_t) decoder->need_offset_tree;
+	save_tree(buf + 1, decoder->offset_tree, OFFSET_TREE_ELEMENTS,
+	          decoder->offset_lookup);
+
+	*input_bits = bit_stream_reader_position(&decoder->bit_stream_reader);
+
+	return 1;
+}
+
+static int lha_pm2_restore(void *data, LHADecoderCallback callback,
+                           void *callback_data, uint8_t *buf,
+                           unsigned int skip_bits)
+{
+	LHAPM2Decoder *decoder = data;
+
+	lha_pm2_decoder_init(decoder, callback, callback_data);
+
+	if (buf[0] > PM2_REBUILD_CONTINUING) {
+		return 0;
+	}
+
+	decoder->tree_state = (PM2RebuildState) buf[0];
+	decoder->tree_rebuild_remaining = lha_decode_uint32(buf + 1);
+	decoder->ringbuf_pos = lha_decode_uint32(buf + 5);
+	buf += 9;
+
+	if (decoder->ringbuf_pos >= RING_BUFFER_SIZE) {
+		return 0;
+	}
+
+	memcpy(decoder->ringbuf, buf, RING_BUFFER_SIZE);
+	buf += RING_BUFFER_SIZE;
+	load_history_list(&decoder->history_list, buf);
+	buf += HISTORY_LIST_SAVE_SIZE;
+
+	// Any code can be decoded with the code tree, but the offset tree
+	// is only built with codes for the eight offset lengths.
+
+	buf = load_tree(buf, decoder->code_tree, CODE_TREE_ELEMENTS,
+	                TREE_NODE_LEAF, decoder->code_lookup);
+
+	if (buf == NULL) {
+		return 0;
+	}
+
+	decoder->need_offset_tree = buf[0] != 0;
+
+	if (load_tree(buf + 1, decoder->offset_tree, OFFSET_TREE_ELEMENTS,
+	              8, decoder->offset_lookup) == NULL) {
+		return 0;
+	}
+
+	return skip_bits == 0
+	    || read_bits(&decoder->bit_stream_reader, skip_bits) >= 0;
+}
+
 LHADecoderType lha_pm2_decoder = {
 	lha_pm2_decoder_init,
 	NULL,
 	lha_pm2_decoder_read,
 	sizeof(LHAPM2Decoder),
 	OUTPUT_BUFFER_SIZE,
-	RING_BUFFER_SIZE
+	RING_BUFFER_SIZE,
+	NULL,
+	NULL,
+	CHECKPOINT_SIZE,
+	lha_pm2_checkpoint,
+	lha_pm2_restore
 };
 
@@ -56,6 +56,12 @@ typedef struct {
 // a character is output, it is moved to the front of the linked
 // list. The entry point index into the list is the last output
 // character, given by history_head;
+//
+// Every byte output, including those from copies, must be moved to the
+// front, but only literals look up an entry. A linked list makes the
+// move a constant time operation; a flat move-to-front array would
+// make lookups direct, but then every move has to shift the entries in
+// front of the byte, which costs more than the walk saves.
 
 typedef struct {
 	HistoryNode history[256];
@@ -160,3 +166,37 @@ static void update_history_list(HistoryLinkedList *list, uint8_t b)
 	list->history_head = b;
 }
 
+
+// Size of the history list when saved in a checkpoint: the links of
+// each node, followed by the head.
+
+#define HISTORY_LIST_SAVE_SIZE (256 * 2 + 1)
+
+// Save the history list in a checkpoint.
+
+static void save_history_list(HistoryLinkedList *list, uint8_t *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; ++i) {
+		buf[i * 2] = list->history[i].prev;
+		buf[i * 2 + 1] = list->history[i].next;
+	}
+
+	buf[256 * 2] = list->history_head;
+}
+
+// Load the history list from a checkpoint.
+
+static void load_history_list(HistoryLinkedList *list, uint8_t *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; ++i) {
+		list->history[i].prev = buf[i * 2];
+		list->history[i].next = buf[i * 2 + 1];
+	}
+
+	list->history_head = buf[256 * 2];
+}
+
@@ -0,0 +1,256 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LHASA_PUBLIC_LHA_CATALOG_H
+#define LHASA_PUBLIC_LHA_CATALOG_H
+
+#include "lha_input_stream.h"
+#include "lha_file_header.h"
+#include "lha_decoder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @file lha_catalog.h
+ *
+ * @brief LHA archive catalog.
+ *
+ * This file contains the interface functions for the @ref LHACatalog
+ * structure, an index of the files in an LZH archive. The archive is
+ * scanned once when the catalog is created; the catalog then records
+ * the location of every archived file, so that the files can be listed,
+ * looked up by name and accessed in any order without reading the
+ * headers again.
+ */
+
+/**
+ * Opaque structure containing an index of the files in an LZH archive.
+ */
+
+typedef struct _LHACatalog LHACatalog;
+
+/**
+ * An entry in a @ref LHACatalog, describing a single archived file.
+ */
+
+typedef struct {
+
+	/**
+	 * Header of the archived file. The compression method,
+	 * compressed length and CRC of the file are found here.
+	 */
+	LHAFileHeader *header;
+
+	/** Full path of the archived file (path and filename). */
+	char *path;
+
+	/** Offset within the archive of the file header. */
+	size_t header_offset;
+
+	/** Offset within the archive of the compressed data. */
+	size_t data_offset;
+
+	/**
+	 * Decoder checkpoints within the file, for use with
+	 * @ref lha_reader_seek, or NULL if there are none (see
+	 * @ref lha_catalog_add_checkpoints).
+	 */
+	LHADecoderCheckpoint *checkpoints;
+
+	/** Number of entries in the checkpoints array. */
+	unsigned int num_checkpoints;
+
+	/**
+	 * Index of the first entry in the catalog with the same
+	 * contents as this one, or the index of this entry if there is
+	 * no earlier copy (see @ref lha_catalog_find_duplicates).
+	 */
+	unsigned int duplicate_of;
+
+} LHACatalogEntry;
+
+/**
+ * Create a new @ref LHACatalog by scanning the files in an archive.
+ *
+ * The input stream is read from its current position to the end of the
+ * archive. If the archive is truncated or corrupt, the catalog contains
+ * the files found before the point where the error occurred.
+ *
+ * @param stream     The input stream to read the archive from.
+ * @return           Pointer to a new @ref LHACatalog structure, or NULL
+ *                   for error.
+ */
+
+LHACatalog *lha_catalog_new(LHAInputStream *stream);
+
+/**
+ * Free a @ref LHACatalog structure.
+ *
+ * @param catalog    The @ref LHACatalog structure.
+ */
+
+void lha_catalog_free(LHACatalog *catalog);
+
+/**
+ * Get the number of files in a catalog.
+ *
+ * @param catalog    The @ref LHACatalog structure.
+ * @return           Number of files found in the archive.
+ */
+
+unsigned int lha_catalog_num_entries(LHACatalog *catalog);
+
+/**
+ * Get an entry from a catalog. Entries are stored in the same order
+ * that the files appear in the archive.
+ *
+ * @param catalog    The @ref LHACatalog structure.
+ * @param index      Index of the entry, from zero to one less than the
+ *                   value returned by @ref lha_catalog_num_entries.
+ * @return           Pointer to the entry, or NULL if the index is out
+ *                   of range.
+ */
+
+LHACatalogEntry *lha_catalog_get(LHACatalog *catalog, unsigned int index);
+
+/**
+ * Look up an entry in a catalog by its full path.
+ *
+ * If an archive contains more than one file with the same path, the
+ * last one is returned, as it is the one that would be left after
+ * extracting the whole archive.
+ *
+ * @param catalog    The @ref LHACatalog structure.
+ * @param path       Full path of the file to find.
+ * @return           Pointer to the entry, or NULL if there is no file
+ *                   in the archive with the specified path.
+ */
+
+LHACatalogEntry *lha_catalog_find(LHACatalog *catalog, char *path);
+
+/**
+ * Record decoder checkpoints for a file in a catalog.
+ *
+ * The file is decompressed once, and the state of the decoder is saved
+ * at intervals, so that decompression can later be resumed part way
+ * through the file (see @ref lha_reader_seek). This allows random access
+ * within large files. The checkpoints are saved in the index file by
+ * @ref lha_catalog_save.
+ *
+ * For some compression methods, the distance between checkpoints may
+ * be larger than the interval requested.
+ *
+ * @param catalog    The @ref LHACatalog structure.
+ * @param stream     Input stream for the archive that the catalog
+ *                   describes. This must be a stream that supports
+ *                   @ref lha_input_stream_new_range.
+ * @param index      Index of the catalog entry.
+ * @param interval   Minimum number of bytes of decompressed data
+ *                   between checkpoints.
+ * @return           Non-zero for success, or zero if the file could not
+ *                   be decompressed.
+ */
+
+int lha_catalog_add_checkpoints(LHACatalog *catalog, LHAInputStream *stream,
+                                unsigned int index, size_t interval);
+
+/**
+ * Find files in a catalog that are copies of earlier files.
+ *
+ * Files are identified as copies if they have the same CRC, length,
+ * compression method and compressed data. The compressed data is only
+ * read for files that match an earlier file in every other respect.
+ * The duplicate_of field of each entry is set to the index of the first
+ * copy of its contents.
+ *
+ * @param catalog    The @ref LHACatalog structure.
+ * @param stream     Input stream for the archive that the catalog
+ *                   describes. This must be a stream that supports
+ *                   @ref lha_input_stream_new_range.
+ * @return           Non-zero for success, or zero for failure.
+ */
+
+int lha_catalog_find_duplicates(LHACatalog *catalog, LHAInputStream *stream);
+
+/**
+ * Prepare a remote input stream (see @ref lha_input_stream_new_remote)
+ * for reading a selection of the files in a catalog with
+ * @ref lha_reader_select. Only the compressed data of the selected
+ * files is fetched, with files that are close together fetched in one
+ * request, and large files fetched in several parts at once.
+ *
+ * This must be called before reading from the stream starts.
+ *
+ * @param catalog    The @ref LHACatalog structure.
+ * @param stream     Remote input stream for the archive that the catalog
+ *                   describes.
+ * @param entries    Indices of the catalog entries that will be read,
+ *                   in increasing order.
+ * @param num_entries  Number of entries in the array.
+ * @return           Non-zero for success, or zero if the indices are
+ *                   invalid, the stream is not a remote stream, or
+ *                   memory could not be allocated.
+ */
+
+int lha_catalog_prefetch(LHACatalog *catalog, LHAInputStream *stream,
+                         const unsigned int *entries,
+                         unsigned int num_entries);
+
+/**
+ * Save a catalog to an index file.
+ *
+ * The index file can be loaded again using @ref lha_catalog_load, which
+ * is much faster than scanning the archive again for a large archive.
+ * Any decoder checkpoints recorded for the files are saved as well.
+ * The size and modification time of the archive are recorded in the
+ * index, so that an index that is out of date can be detected.
+ *
+ * @param catalog    The @ref LHACatalog structure.
+ * @param index      FILE to write the index to.
+ * @param archive    FILE for the archive that the catalog was created
+ *                   from.
+ * @return           Non-zero for success, or zero for failure.
+ */
+
+int lha_catalog_save(LHACatalog *catalog, FILE *index, FILE *archive);
+
+/**
+ * Load a catalog from an index file written by @ref lha_catalog_save.
+ *
+ * The index is checked against the size and modification time of the
+ * archive, and the CRC of every stored file header is checked. If the
+ * index does not match the archive, NULL is returned, and the catalog
+ * should be created again using @ref lha_catalog_new.
+ *
+ * @param index      FILE to read the index from.
+ * @param archive    FILE for the archive that the index describes.
+ * @return           Pointer to a new @ref LHACatalog structure, or NULL
+ *                   if the index could not be loaded.
+ */
+
+LHACatalog *lha_catalog_load(FILE *index, FILE *archive);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef LHASA_PUBLIC_LHA_CATALOG_H */
@@ -0,0 +1,86 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LHASA_PUBLIC_LHA_DECODE_CACHE_H
+#define LHASA_PUBLIC_LHA_DECODE_CACHE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @file lha_decode_cache.h
+ *
+ * @brief Cache of decompressed files.
+ *
+ * This file contains the interface functions for the @ref LHADecodeCache
+ * structure, a cache of the decompressed contents of archived files.
+ * When the same files are read again and again, for example by a server,
+ * a reader with a cache (see @ref lha_reader_set_cache) copies the data
+ * of a file from the cache instead of decompressing it again.
+ *
+ * Files are identified by the archive that they are in, the position of
+ * their header within it and their CRC. Files that have not been used
+ * for the longest time are removed to keep the cache within a size
+ * limit. The cache can also be kept in a directory on disk, so that it
+ * is kept from one run of a program to the next; files in the directory
+ * are memory-mapped when they are used.
+ *
+ * A cache can be shared between readers on different threads.
+ */
+
+/**
+ * Opaque structure containing a cache of decompressed files.
+ */
+
+typedef struct _LHADecodeCache LHADecodeCache;
+
+/**
+ * Create a new @ref LHADecodeCache.
+ *
+ * @param max_size       Maximum total size of the files held in memory,
+ *                       in bytes. Larger files are not cached.
+ * @param directory      Directory in which to store decompressed files
+ *                       as well, or NULL to only cache them in memory.
+ *                       The directory must already exist. Files are not
+ *                       removed from the directory; it is up to the
+ *                       calling program to remove old files.
+ * @return               Pointer to the new cache, or NULL for failure.
+ */
+
+LHADecodeCache *lha_decode_cache_new(size_t max_size, const char *directory);
+
+/**
+ * Free a @ref LHADecodeCache. All readers using the cache must have
+ * been freed first.
+ *
+ * @param cache          The cache.
+ */
+
+void lha_decode_cache_free(LHADecodeCache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef LHASA_PUBLIC_LHA_DECODE_CACHE_H */
+
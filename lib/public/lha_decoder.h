@@ -91,6 +91,240 @@ typedef void (*LHADecoderProgressCallback)(unsigned int num_blocks,
                                            unsigned int total_blocks,
                                            void *callback_data);
 
+/**
+ * Progress of a decoder through its input and output streams, passed
+ * to a @ref LHADecoderByteProgressCallback.
+ */
+
+typedef struct {
+
+	/** Number of bytes of compressed data read so far. */
+
+	size_t input_pos;
+
+	/** Total length of the compressed data, as passed to
+	    @ref lha_decoder_monitor_bytes, or zero if not known. */
+
+	size_t input_length;
+
+	/** Number of bytes of decompressed data returned so far. */
+
+	size_t output_pos;
+
+	/** Total length of the decompressed data. */
+
+	size_t output_length;
+} LHADecoderProgress;
+
+/**
+ * Callback function used for monitoring decode progress in bytes.
+ * The callback is invoked at the same points as a
+ * @ref LHADecoderProgressCallback, but reports how much of the
+ * compressed data has been consumed as well as how much of the
+ * output has been produced. As compression ratios vary through a
+ * file, the input position gives more accurate throughput and
+ * time estimates.
+ *
+ * @param progress        Current position in the input and output.
+ * @param callback_data   Extra user-specified data passed to the callback.
+ */
+
+typedef void (*LHADecoderByteProgressCallback)(
+	const LHADecoderProgress *progress, void *callback_data);
+
+/**
+ * Callback function invoked by @ref lha_decoder_decode_to to output
+ * decompressed data.
+ *
+ * @param buf        Pointer to the decompressed data. This points into
+ *                   the decoder's internal buffers, and is only valid
+ *                   until the callback returns.
+ * @param buf_len    Length of the data, in bytes.
+ * @param user_data  Extra pointer passed to @ref lha_decoder_decode_to.
+ * @return           Non-zero to continue decoding, or zero to stop
+ *                   (for example, if the data could not be written).
+ */
+
+typedef int (*LHADecoderSink)(uint8_t *buf, size_t buf_len,
+                              void *user_data);
+
+/**
+ * A checkpoint saved while decoding, from which decoding can be resumed
+ * without decoding all of the data before it. See
+ * @ref lha_decoder_record_checkpoints.
+ */
+
+typedef struct {
+
+	/** Position in the decompressed data at which decoding resumes. */
+	size_t output_offset;
+
+	/** Position in the compressed data, in bits. */
+	uint64_t input_bits;
+
+	/** Saved decoder state. */
+	uint8_t *state;
+
+	/** Length of the saved decoder state, in bytes. */
+	size_t state_len;
+
+} LHADecoderCheckpoint;
+
+/**
+ * Stages of decoding, for which the time spent is measured separately
+ * in @ref LHADecoderStats.
+ */
+
+typedef enum {
+
+	/** Reading compressed data from the input callback. */
+
+	LHA_DECODER_STAGE_INPUT,
+
+	/** Reading code tables and building Huffman trees. */
+
+	LHA_DECODER_STAGE_TREES,
+
+	/** Decoding literals and copy commands. This includes reading
+	    bits from the compressed data that has already been read. */
+
+	LHA_DECODER_STAGE_DECODE,
+
+	/** Copying data from the history for copy commands. */
+
+	LHA_DECODER_STAGE_COPY,
+
+	/** Calculating the CRC of the decoded data, and copying it to
+	    the caller's buffer. */
+
+	LHA_DECODER_STAGE_CRC,
+
+	LHA_DECODER_NUM_STAGES
+
+} LHADecoderStage;
+
+/**
+ * Longest copy length counted separately in the histogram in
+ * @ref LHADecoderStats; longer copies are counted together.
+ */
+
+#define LHA_DECODER_STATS_MAX_COPY 256
+
+/**
+ * Statistics collected by a decoder, returned by
+ * @ref lha_decoder_get_stats.
+ */
+
+typedef struct {
+
+	/** Number of bytes of compressed data read. */
+	uint64_t input_bytes;
+
+	/** Number of bytes of data decoded. */
+	uint64_t output_bytes;
+
+	/** Number of blocks started, for methods that divide the
+	    compressed data into blocks. */
+	uint64_t blocks;
+
+	/** Number of Huffman trees built or rebuilt. */
+	uint64_t tree_builds;
+
+	/** Number of literal bytes decoded. */
+	uint64_t literals;
+
+	/** Number of copy commands decoded. */
+	uint64_t copies;
+
+	/** Number of copies of each length; copies longer than
+	    @ref LHA_DECODER_STATS_MAX_COPY are counted in the last
+	    entry. */
+	uint64_t copy_lengths[LHA_DECODER_STATS_MAX_COPY + 1];
+
+	/** CPU cycles spent in each stage of decoding (see
+	    @ref LHADecoderStage). Cycles are only counted on x86
+	    processors; elsewhere, these are all zero. */
+	uint64_t cycles[LHA_DECODER_NUM_STAGES];
+
+} LHADecoderStats;
+
+/**
+ * Budgets for the resources that may be used to decode a file, so that
+ * malicious or corrupt archives (such as "decompression bombs") can be
+ * stopped early. A field that is zero means no limit. See
+ * @ref lha_decoder_set_limits.
+ */
+
+typedef struct {
+
+	/** Maximum number of bytes of decompressed data. */
+	uint64_t max_output;
+
+	/** Maximum ratio of decompressed data to compressed data. The
+	    first @ref LHA_DECODER_RATIO_SLACK bytes of output are always
+	    allowed, so that small files that compress very well are not
+	    stopped. */
+	unsigned int max_ratio;
+
+	/** Maximum time spent decoding, in milliseconds. */
+	unsigned int max_time_ms;
+
+} LHADecoderLimits;
+
+/**
+ * Amount of decompressed data that is allowed regardless of the
+ * @ref LHADecoderLimits max_ratio budget.
+ */
+
+#define LHA_DECODER_RATIO_SLACK (64 * 1024)
+
+/**
+ * Budget in @ref LHADecoderLimits that was exceeded.
+ */
+
+typedef enum {
+
+	/** No budget has been exceeded. */
+
+	LHA_DECODER_LIMIT_NONE,
+
+	/** Too much data would be decompressed. */
+
+	LHA_DECODER_LIMIT_OUTPUT,
+
+	/** The data expands too much. */
+
+	LHA_DECODER_LIMIT_RATIO,
+
+	/** Decoding took too long. */
+
+	LHA_DECODER_LIMIT_TIME
+
+} LHADecoderLimit;
+
+/**
+ * Functions used to allocate the memory for decoders (see
+ * @ref lha_decoder_set_allocator). Each decoder is a single block of
+ * memory holding its state, history and output buffer; for the decoders
+ * with large history windows, this is a few megabytes.
+ */
+
+typedef struct {
+
+	/** Allocate a block of memory, returning NULL on failure. The
+	    memory must be aligned to at least 'alignment' bytes, a
+	    power of two. It need not be cleared. */
+	void *(*alloc)(size_t size, size_t alignment, void *user_data);
+
+	/** Free a block of memory returned by alloc. 'size' is the size
+	    that was requested. */
+	void (*free)(void *ptr, size_t size, void *user_data);
+
+	/** Extra pointer passed to the functions. */
+	void *user_data;
+
+} LHADecoderAllocator;
+
 /**
  * Get the decoder type for the specified name.
  *
@@ -119,6 +353,28 @@ LHADecoder *lha_decoder_new(LHADecoderType *dtype,
                             void *callback_data,
                             size_t stream_length);
 
+/**
+ * Reset a decoder so that it can be used to decompress a new stream.
+ *
+ * This is equivalent to freeing the decoder and allocating a new one
+ * of the same type, but avoids the cost of the allocation. Any progress
+ * callback previously set with @ref lha_decoder_monitor is removed.
+ *
+ * @param decoder        The decoder.
+ * @param callback       Callback function for the decoder to call to read
+ *                       more compressed data.
+ * @param callback_data  Extra data to pass to the callback function.
+ * @param stream_length  Length of the uncompressed data, in bytes.
+ * @return               Non-zero for success, or zero if the decoder
+ *                       could not be reset. If zero is returned, the
+ *                       decoder should be freed.
+ */
+
+int lha_decoder_reset(LHADecoder *decoder,
+                      LHADecoderCallback callback,
+                      void *callback_data,
+                      size_t stream_length);
+
 /**
  * Free a decoder.
  *
@@ -139,6 +395,35 @@ void lha_decoder_monitor(LHADecoder *decoder,
                          LHADecoderProgressCallback callback,
                          void *callback_data);
 
+/**
+ * Set a callback function to monitor decode progress in bytes of
+ * input and output. This can be used alongside
+ * @ref lha_decoder_monitor.
+ *
+ * @param decoder        The decoder.
+ * @param callback       Callback function to monitor decode progress,
+ *                       or NULL to stop monitoring.
+ * @param callback_data  Extra data to pass to the callback function.
+ * @param input_length   Length of the compressed data, in bytes, to
+ *                       report to the callback; zero if not known.
+ */
+
+void lha_decoder_monitor_bytes(LHADecoder *decoder,
+                               LHADecoderByteProgressCallback callback,
+                               void *callback_data,
+                               size_t input_length);
+
+/**
+ * Get the number of bytes of compressed data that a decoder has read
+ * from its input so far. This counts data read by the decoder, which
+ * may read ahead of the data it has returned.
+ *
+ * @param decoder        The decoder.
+ * @return               Number of bytes of compressed data read.
+ */
+
+size_t lha_decoder_get_compressed_length(LHADecoder *decoder);
+
 /**
  * Decode (decompress) more data.
  *
@@ -150,6 +435,28 @@ void lha_decoder_monitor(LHADecoder *decoder,
 
 size_t lha_decoder_read(LHADecoder *decoder, uint8_t *buf, size_t buf_len);
 
+/**
+ * Decode (decompress) all remaining data, passing it to a callback
+ * function.
+ *
+ * Unlike @ref lha_decoder_read, the data is not copied into a buffer
+ * supplied by the caller: the callback is passed pointers directly into
+ * the decoder's internal buffers.
+ *
+ * @param decoder        The decoder.
+ * @param sink           Callback function to invoke with the decompressed
+ *                       data, or NULL to discard it (for example, if
+ *                       only the CRC is needed).
+ * @param sink_data      Extra data to pass to the callback function.
+ * @return               Zero if the callback function returned zero to
+ *                       stop decoding, otherwise non-zero. Decoding may
+ *                       still have failed: @ref lha_decoder_get_length
+ *                       and @ref lha_decoder_get_crc should be checked.
+ */
+
+int lha_decoder_decode_to(LHADecoder *decoder, LHADecoderSink sink,
+                          void *sink_data);
+
 /**
  * Get the current 16-bit CRC of the decompressed data.
  *
@@ -175,6 +482,326 @@ uint16_t lha_decoder_get_crc(LHADecoder *decoder);
 
 size_t lha_decoder_get_length(LHADecoder *decoder);
 
+/**
+ * Start recording checkpoints while decoding.
+ *
+ * A checkpoint records the decoder state at a point in the stream, so
+ * that decoding can later be resumed from there using
+ * @ref lha_decoder_new_at. For the -lh4- to -lh7- and -lhx-
+ * algorithms, checkpoints are only possible at the start of a block of
+ * compressed data, so the spacing between checkpoints is only
+ * approximate.
+ *
+ * This should be called before any data has been decoded.
+ *
+ * @param decoder        The decoder.
+ * @param interval       Minimum number of decompressed bytes between
+ *                       checkpoints.
+ * @return               Non-zero if checkpoints will be recorded, or
+ *                       zero if not supported for this decoder type.
+ */
+
+int lha_decoder_record_checkpoints(LHADecoder *decoder, size_t interval);
+
+/**
+ * Take the checkpoints that have been recorded by a decoder.
+ *
+ * Ownership of the checkpoints passes to the caller, who must free
+ * them using @ref lha_decoder_free_checkpoints.
+ *
+ * @param decoder        The decoder.
+ * @param num            Pointer to a variable in which to store the
+ *                       number of checkpoints.
+ * @return               Pointer to an array of checkpoints in order of
+ *                       position, or NULL if there are none.
+ */
+
+LHADecoderCheckpoint *lha_decoder_take_checkpoints(LHADecoder *decoder,
+                                                   unsigned int *num);
+
+/**
+ * Free an array of checkpoints.
+ *
+ * @param checkpoints    Pointer to the array of checkpoints.
+ * @param num            Number of checkpoints in the array.
+ */
+
+void lha_decoder_free_checkpoints(LHADecoderCheckpoint *checkpoints,
+                                  unsigned int num);
+
+/**
+ * Allocate a new decoder that resumes decoding from a checkpoint.
+ *
+ * The CRC returned by @ref lha_decoder_get_crc only covers the data
+ * decoded after the checkpoint, so it can not be used to check the
+ * data.
+ *
+ * @param dtype          The decoder type. This must be the same type
+ *                       that saved the checkpoint.
+ * @param callback       Callback function for the decoder to call to
+ *                       read more compressed data. The data must start
+ *                       from byte (input_bits / 8) of the compressed
+ *                       data.
+ * @param callback_data  Extra pointer to pass to the callback.
+ * @param stream_length  Length of the uncompressed data, in bytes.
+ * @param checkpoint     The checkpoint.
+ * @return               Pointer to the new decoder, or NULL for failure.
+ */
+
+LHADecoder *lha_decoder_new_at(LHADecoderType *dtype,
+                               LHADecoderCallback callback,
+                               void *callback_data,
+                               size_t stream_length,
+                               LHADecoderCheckpoint *checkpoint);
+
+/**
+ * Save the state of a decoder, so that decoding can be resumed later
+ * using @ref lha_decoder_restore_state, for example after the program
+ * has been interrupted.
+ *
+ * The state covers everything needed to continue: the position in the
+ * compressed data, the history and other state of the algorithm, data
+ * that has been decoded but not yet returned, and the CRC of the data
+ * returned so far. It can be stored, and restored by another copy of
+ * the library, on any machine.
+ *
+ * For the -lh4- to -lh7- and -lhx- algorithms, the state can only be
+ * saved at the start of a block of compressed data. At other points,
+ * NULL is returned, and decoding stops at the start of the next block,
+ * so that trying again once more data has been read succeeds.
+ *
+ * The state can not be saved for push decoders, decoders using
+ * two-stage decoding or reading stored data in place, or once decoding
+ * has failed.
+ *
+ * @param decoder        The decoder.
+ * @param state_len      Pointer to a variable in which to store the
+ *                       length of the state, in bytes.
+ * @return               Pointer to the state, which must be freed by
+ *                       the caller using free(), or NULL if it could
+ *                       not be saved at this point.
+ */
+
+uint8_t *lha_decoder_save_state(LHADecoder *decoder, size_t *state_len);
+
+/**
+ * Get the position in the decompressed and compressed data at which
+ * decoding resumes from a saved state.
+ *
+ * @param state          The state, saved by @ref lha_decoder_save_state.
+ * @param state_len      Length of the state, in bytes.
+ * @param output_offset  Pointer to a variable in which to store the
+ *                       number of bytes of decompressed data that had
+ *                       been returned when the state was saved.
+ * @param input_offset   Pointer to a variable in which to store the
+ *                       offset within the compressed data, in bytes,
+ *                       from which the decoder must read when it is
+ *                       restored.
+ * @return               Non-zero for success, or zero if the state is
+ *                       not valid.
+ */
+
+int lha_decoder_state_position(uint8_t *state, size_t state_len,
+                               uint64_t *output_offset,
+                               uint64_t *input_offset);
+
+/**
+ * Allocate a new decoder that resumes decoding from a state saved by
+ * @ref lha_decoder_save_state.
+ *
+ * The decoder continues from the point at which the state was saved:
+ * the first byte it returns follows the last byte that had been
+ * returned, and @ref lha_decoder_get_crc and
+ * @ref lha_decoder_get_length cover the whole of the data, so they can
+ * be checked against the file header at the end as usual.
+ *
+ * @param dtype          The decoder type. This must be the same type
+ *                       that saved the state.
+ * @param callback       Callback function for the decoder to call to
+ *                       read more compressed data. The data must start
+ *                       from the input offset given by
+ *                       @ref lha_decoder_state_position.
+ * @param callback_data  Extra pointer to pass to the callback.
+ * @param stream_length  Length of the uncompressed data, in bytes.
+ * @param state          The state.
+ * @param state_len      Length of the state, in bytes.
+ * @return               Pointer to the new decoder, or NULL if the
+ *                       state is not valid for the decoder type, or
+ *                       for failure.
+ */
+
+LHADecoder *lha_decoder_restore_state(LHADecoderType *dtype,
+                                      LHADecoderCallback callback,
+                                      void *callback_data,
+                                      size_t stream_length,
+                                      uint8_t *state, size_t state_len);
+
+/**
+ * Allocate a new "push" decoder, to which compressed data is fed as
+ * it becomes available, rather than being read through a callback.
+ *
+ * This allows data to be decompressed as it arrives (for example,
+ * over a network connection), without blocking while waiting for more
+ * data. Compressed data is passed to the decoder using
+ * @ref lha_decoder_feed, and the data decompressed from it so far is
+ * collected using @ref lha_decoder_drain.
+ *
+ * If the decoder runs out of input part way through decompressing a
+ * chunk of data, it is rolled back and tries again after more data has
+ * been fed in. Push decoders can not be reset, and do not record
+ * checkpoints.
+ *
+ * @param dtype          The decoder type.
+ * @param stream_length  Length of the uncompressed data, in bytes.
+ * @return               Pointer to the new decoder, or NULL for failure.
+ */
+
+LHADecoder *lha_decoder_new_push(LHADecoderType *dtype, size_t stream_length);
+
+/**
+ * Feed more compressed data to a push decoder. The data is copied, so
+ * the buffer can be reused once this returns.
+ *
+ * @param decoder        The decoder, created with
+ *                       @ref lha_decoder_new_push.
+ * @param buf            Pointer to the compressed data.
+ * @param buf_len        Length of the data, in bytes.
+ * @return               Non-zero for success, or zero if the data could
+ *                       not be stored, or this is not a push decoder, or
+ *                       @ref lha_decoder_feed_end has been called.
+ */
+
+int lha_decoder_feed(LHADecoder *decoder, const uint8_t *buf, size_t buf_len);
+
+/**
+ * Indicate that all compressed data has been fed to a push decoder.
+ * After this, @ref lha_decoder_drain decompresses the rest of the data.
+ *
+ * @param decoder        The decoder.
+ */
+
+void lha_decoder_feed_end(LHADecoder *decoder);
+
+/**
+ * Decompress as much data as possible from the compressed data fed to a
+ * push decoder so far, passing it to a callback function (see
+ * @ref lha_decoder_decode_to).
+ *
+ * The end of the stream has been reached once
+ * @ref lha_decoder_get_length returns the length of the uncompressed
+ * data; @ref lha_decoder_get_crc should then be checked.
+ *
+ * @param decoder        The decoder.
+ * @param sink           Callback function to invoke with the decompressed
+ *                       data, or NULL to discard it.
+ * @param sink_data      Extra data to pass to the callback function.
+ * @return               Zero if the callback function returned zero to
+ *                       stop decoding, or if decoding failed; otherwise
+ *                       non-zero, even if more input is needed.
+ */
+
+int lha_decoder_drain(LHADecoder *decoder, LHADecoderSink sink,
+                      void *sink_data);
+
+/**
+ * Decode using two threads, for faster decompression on multi-core
+ * systems.
+ *
+ * The decoder's work is split into two stages that run at the same
+ * time: the calling thread reads and decodes the compressed data, while
+ * a worker thread uses the result to reconstruct the decompressed data.
+ * The output is exactly the same as without two-stage decoding. This is
+ * only possible for some decoder types (currently the -lh4- to -lh7-
+ * and -lhx- algorithms), and is only worthwhile for large files, as it
+ * needs more memory and starting the thread takes time.
+ *
+ * This must be called before any data has been decoded. It can not be
+ * used together with @ref lha_decoder_record_checkpoints, or with a
+ * push decoder. Two-stage decoding ends when the decoder is reset.
+ *
+ * @param decoder        The decoder.
+ * @return               Non-zero if two-stage decoding is enabled, or
+ *                       zero if not supported for this decoder, or
+ *                       the worker thread could not be started.
+ */
+
+int lha_decoder_enable_two_stage(LHADecoder *decoder);
+
+/**
+ * Get statistics about the work done by a decoder since it was created
+ * or last reset, for diagnosing slow decompression.
+ *
+ * Statistics are only collected if the library was built with
+ * LHA_DECODER_STATS defined (configure --enable-decoder-stats), as
+ * collecting them slows down decoding.
+ *
+ * @param decoder        The decoder.
+ * @param stats          Pointer to a structure in which to store the
+ *                       statistics. If they are not being collected,
+ *                       it is cleared.
+ * @return               Non-zero if statistics are being collected.
+ */
+
+int lha_decoder_get_stats(LHADecoder *decoder, LHADecoderStats *stats);
+
+/**
+ * Set budgets for the resources used by a decoder. The budgets are
+ * checked as data is decoded; once one is exceeded, decoding stops as
+ * if the data was corrupt, and @ref lha_decoder_limit_exceeded reports
+ * which one it was. The time budget is measured from this call, so it
+ * should be made just before decoding starts. Budgets are cleared when
+ * the decoder is reset.
+ *
+ * To keep the checks cheap, the ratio and time budgets are only checked
+ * after every few kilobytes of output, so they may be overshot slightly.
+ * The output budget is exact.
+ *
+ * @param decoder        The decoder.
+ * @param limits         The budgets, or NULL for no limits.
+ */
+
+void lha_decoder_set_limits(LHADecoder *decoder,
+                            const LHADecoderLimits *limits);
+
+/**
+ * Check whether decoding stopped because a budget set with
+ * @ref lha_decoder_set_limits was exceeded.
+ *
+ * @param decoder        The decoder.
+ * @return               The budget that was exceeded, or
+ *                       @ref LHA_DECODER_LIMIT_NONE.
+ */
+
+LHADecoderLimit lha_decoder_limit_exceeded(LHADecoder *decoder);
+
+/**
+ * Set the functions used to allocate memory for decoders created from
+ * now on. By default, decoders are allocated on the heap, aligned so
+ * that the history window and output buffer start on cache line
+ * boundaries. Each decoder is freed with the functions that allocated
+ * it, so changing the allocator does not affect existing decoders.
+ *
+ * This changes the allocator for all threads, so should be called
+ * before decoders are created by other threads.
+ *
+ * @param allocator      The allocator, or NULL to go back to the
+ *                       default. The structure is copied.
+ */
+
+void lha_decoder_set_allocator(const LHADecoderAllocator *allocator);
+
+/**
+ * Get an allocator, for @ref lha_decoder_set_allocator, that puts the
+ * decoders with large history windows (such as -lhx-) on huge pages
+ * where the system allows it. Matches that copy from far back in the
+ * history then cause fewer TLB misses. Other decoders are allocated
+ * as normal.
+ *
+ * @return               Pointer to the allocator.
+ */
+
+const LHADecoderAllocator *lha_decoder_huge_page_allocator(void);
+
 #ifdef __cplusplus
 }
 #endif
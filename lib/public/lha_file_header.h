@@ -134,6 +134,9 @@ struct _LHAFileHeader {
 
 	unsigned int _refcount;
 	LHAFileHeader *_next;
+	void *_arena;
+	void *_chunk;
+	unsigned int _lazy_offset;
 
 	/**
 	 * Stored path, with Unix-style ('/') path separators.
@@ -84,6 +84,39 @@ typedef struct {
 
 } LHAInputStreamType;
 
+/**
+ * Structure containing pointers to callback functions to fetch data from
+ * a remote file, such as a file in object storage read using HTTP range
+ * requests (see @ref lha_input_stream_new_remote).
+ */
+
+typedef struct {
+
+	/**
+	 * Fetch a range of bytes from the file. When prefetching
+	 * large files (see @ref lha_catalog_prefetch), this may be
+	 * called from more than one thread at the same time.
+	 *
+	 * @param handle       Handle pointer.
+	 * @param buf          Pointer to buffer in which to store the data.
+	 * @param offset       Offset within the file of the first byte.
+	 * @param length       Number of bytes to fetch.
+	 * @return             Number of bytes fetched, which may be less
+	 *                     than requested, or -1 for error.
+	 */
+
+	int (*fetch)(void *handle, void *buf, size_t offset, size_t length);
+
+	/**
+	 * Close the remote file. This is an optional function.
+	 *
+	 * @param handle       Handle pointer.
+	 */
+
+	void (*close)(void *handle);
+
+} LHARemoteFileType;
+
 /**
  * Create new @ref LHAInputStream structure, using a set of generic functions
  * to provide LHA data.
@@ -100,6 +133,8 @@ LHAInputStream *lha_input_stream_new(const LHAInputStreamType *type,
 /**
  * Create new @ref LHAInputStream, reading from the specified filename.
  * The file is automatically closed when the input stream is freed.
+ * Where possible, the file is memory-mapped rather than read through
+ * stdio.
  *
  * @param filename     Name of the file to read from.
  * @return             Pointer to a new @ref LHAInputStream or NULL for error.
@@ -110,7 +145,9 @@ LHAInputStream *lha_input_stream_from(char *filename);
 /**
  * Create new @ref LHAInputStream, to read from an already-open FILE pointer.
  * The FILE is not closed when the input stream is freed; the calling code
- * must close it.
+ * must close it. If the FILE refers to a regular file, it is memory-mapped
+ * and reading starts from its current position; when the input stream is
+ * freed, the FILE is left positioned after the data that was read.
  *
  * @param stream       The open FILE structure from which to read data.
  * @return             Pointer to a new @ref LHAInputStream or NULL for error.
@@ -118,6 +155,51 @@ LHAInputStream *lha_input_stream_from(char *filename);
 
 LHAInputStream *lha_input_stream_from_FILE(FILE *stream);
 
+/**
+ * Create new @ref LHAInputStream, to read from a remote file that is
+ * fetched in ranges, rather than read as a stream.
+ *
+ * Small reads are combined into larger fetches: the amount fetched
+ * ahead grows while the file is read in order, so that the headers of
+ * an archive are read using a few large requests, and shrinks again
+ * when reading skips ahead. If the files to be read are known in
+ * advance (see @ref lha_catalog_prefetch), only their compressed data
+ * is fetched, and large files are fetched in several parts at once.
+ *
+ * @param type         Pointer to a @ref LHARemoteFileType structure
+ *                     containing callback functions to fetch data.
+ * @param handle       Handle pointer to be passed to callback functions.
+ * @param length       Length of the remote file, in bytes.
+ * @return             Pointer to a new @ref LHAInputStream or NULL for error.
+ */
+
+LHAInputStream *lha_input_stream_new_remote(const LHARemoteFileType *type,
+                                            void *handle, size_t length);
+
+/**
+ * Create new @ref LHAInputStream, to read a range of the same file as an
+ * existing input stream.
+ *
+ * The new stream reads independently of the original stream: reading
+ * from one does not change the position of the other. Multiple streams
+ * created from the same stream can be read from at the same time, for
+ * example from different threads. The original stream must not be
+ * freed until all streams created from it have been freed.
+ *
+ * This is only possible for streams reading from a file; it is not
+ * possible for pipes, or for streams created using
+ * @ref lha_input_stream_new.
+ *
+ * @param stream       The existing input stream.
+ * @param offset       Offset within the file of the start of the range.
+ * @param length       Length of the range, in bytes.
+ * @return             Pointer to a new @ref LHAInputStream, or NULL if
+ *                     the range can not be read independently.
+ */
+
+LHAInputStream *lha_input_stream_new_range(LHAInputStream *stream,
+                                           size_t offset, size_t length);
+
 /**
  * Free an @ref LHAInputStream structure.
  *
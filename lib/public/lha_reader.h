@@ -24,6 +24,8 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include "lha_decoder.h"
 #include "lha_input_stream.h"
 #include "lha_file_header.h"
+#include "lha_catalog.h"
+#include "lha_decode_cache.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -108,6 +110,109 @@ typedef enum {
 
 } LHAReaderDirPolicy;
 
+/**
+ * Policy for extracting files that are copies of files already
+ * extracted (see @ref lha_reader_set_dedup).
+ */
+
+typedef enum {
+
+	/** Decompress every file, even if it is a copy. */
+
+	LHA_READER_DEDUP_NONE,
+
+	/**
+	 * Share the contents of the earlier file without copying the
+	 * data, on filesystems that support it ("reflink"); otherwise,
+	 * copy the earlier file.
+	 */
+
+	LHA_READER_DEDUP_REFLINK,
+
+	/**
+	 * Create a hard link to the earlier file. The copies share
+	 * their metadata (timestamp and permissions) as well as their
+	 * contents, so the metadata of the earlier file is kept.
+	 */
+
+	LHA_READER_DEDUP_HARDLINK,
+
+	/** Copy the earlier file, instead of decompressing it again. */
+
+	LHA_READER_DEDUP_COPY
+
+} LHAReaderDedupPolicy;
+
+/**
+ * Arrays to be filled by @ref lha_reader_next_batch with the details of
+ * a number of archived files. Each array has one element for each file,
+ * and may be NULL if that detail is not wanted. The full paths of the
+ * files are packed into a single buffer, one after another, each
+ * terminated by a NUL.
+ */
+
+typedef struct {
+
+	/** Number of elements in each of the arrays. */
+	unsigned int capacity;
+
+	/** Lengths of the uncompressed data. */
+	size_t *lengths;
+
+	/** Lengths of the compressed data. */
+	size_t *compressed_lengths;
+
+	/** 16-bit CRCs of the uncompressed data. */
+	uint16_t *crcs;
+
+	/** Compression methods (see @ref LHAFileHeader). */
+	char (*methods)[6];
+
+	/** Unix timestamps of the modification times. */
+	unsigned int *timestamps;
+
+	/**
+	 * Offsets within the archive of the file headers and compressed
+	 * data. These are zero for directories that have been returned
+	 * again for @ref LHA_READER_DIR_END_OF_DIR.
+	 */
+	size_t *header_offsets;
+
+	/** See header_offsets. */
+	size_t *data_offsets;
+
+	/** Offsets within the name buffer of the full path of each file. */
+	size_t *name_offsets;
+
+	/** Buffer for the full paths, or NULL if they are not wanted. */
+	char *names;
+
+	/** Size of the name buffer, in bytes. */
+	size_t names_size;
+
+	/** Set to the number of bytes of the name buffer that were used. */
+	size_t names_used;
+
+} LHAHeaderBatch;
+
+/**
+ * Callback function invoked when a file passed to
+ * @ref lha_reader_extract_async or @ref lha_reader_check_async has been
+ * extracted or checked.
+ *
+ * @param header         Header of the file.
+ * @param success        Non-zero if the file was extracted successfully,
+ *                       or the checksum matches; zero for failure
+ *                       (including CRC error).
+ * @param callback_data  Extra data passed to
+ *                       @ref lha_reader_extract_async or
+ *                       @ref lha_reader_check_async.
+ */
+
+typedef void (*LHAReaderExtractCallback)(LHAFileHeader *header,
+                                         int success,
+                                         void *callback_data);
+
 /**
  * Create a new @ref LHAReader to read data from an @ref LHAInputStream.
  *
@@ -147,6 +252,32 @@ void lha_reader_set_dir_policy(LHAReader *reader,
 
 LHAFileHeader *lha_reader_next_file(LHAReader *reader);
 
+/**
+ * Only read a selection of the files in the archive. A catalog of the
+ * archive is used to go straight to each selected file, so the other
+ * files are skipped over without their headers being read at all.
+ * Directories and symbolic links are still handled as described for
+ * @ref lha_reader_set_dir_policy, for the files that are selected.
+ *
+ * This must be called before the first call to
+ * @ref lha_reader_next_file.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param catalog        Catalog of the archive being read (see
+ *                       @ref lha_catalog_new and @ref lha_catalog_load).
+ *                       The catalog must not be freed until the reader
+ *                       has been freed.
+ * @param entries        Indices of the catalog entries to read, in
+ *                       increasing order. The array is copied.
+ * @param num_entries    Number of entries in the array.
+ * @return               Non-zero for success, or zero if the indices
+ *                       are invalid, reading has already started, or
+ *                       memory could not be allocated.
+ */
+
+int lha_reader_select(LHAReader *reader, LHACatalog *catalog,
+                      const unsigned int *entries, unsigned int num_entries);
+
 /**
  * Read some of the (decompresed) data for the current archived file,
  * decompressing as appropriate.
@@ -160,6 +291,98 @@ LHAFileHeader *lha_reader_next_file(LHAReader *reader);
 
 size_t lha_reader_read(LHAReader *reader, void *buf, size_t buf_len);
 
+/**
+ * Seek to a position within the decompressed data of the current file,
+ * so that the next call to @ref lha_reader_read returns the data from
+ * that position.
+ *
+ * If checkpoints for the file are provided (see
+ * @ref lha_decoder_record_checkpoints and
+ * @ref lha_catalog_add_checkpoints), decoding resumes from the nearest
+ * checkpoint before the position; otherwise, the file must be decoded
+ * from the start, or from the current position if seeking forwards.
+ * Seeking backwards or using checkpoints is only possible when the
+ * input stream is reading from a file (see
+ * @ref lha_input_stream_new_range).
+ *
+ * As not all of the file is decoded after a seek, the checksum can not be
+ * checked, so @ref lha_reader_check and @ref lha_reader_extract should
+ * not be used afterwards.
+ *
+ * @param reader           The @ref LHAReader structure.
+ * @param offset           Offset within the decompressed data.
+ * @param checkpoints      Array of checkpoints for the current file, or
+ *                         NULL if there are none.
+ * @param num_checkpoints  Number of checkpoints in the array.
+ * @return                 Non-zero for success, or zero for failure.
+ */
+
+int lha_reader_seek(LHAReader *reader, size_t offset,
+                    LHADecoderCheckpoint *checkpoints,
+                    unsigned int num_checkpoints);
+
+/**
+ * Decompress the remaining (decompressed) data for the current archived
+ * file, passing it to a callback function.
+ *
+ * This avoids an extra copy of the data compared to
+ * @ref lha_reader_read, as the callback function is passed pointers
+ * directly into the decoder's internal buffers.
+ *
+ * @param reader     The @ref LHAReader structure.
+ * @param sink       Callback function to invoke with the decompressed
+ *                   data, or NULL to discard it.
+ * @param sink_data  Extra data to pass to the callback function.
+ * @return           Non-zero if the file was decompressed successfully
+ *                   and the checksum matches, or zero if decompression
+ *                   failed or the callback function returned zero.
+ */
+
+int lha_reader_decode_to(LHAReader *reader, LHADecoderSink sink,
+                         void *sink_data);
+
+/**
+ * Decompress the whole of the current archived file into a buffer
+ * provided by the caller, and check that the checksum matches.
+ *
+ * Where the decoder allows it, the data is decompressed straight into
+ * the buffer, without being copied from the decoder's own buffers. This
+ * must be called before any of the data has been read.
+ *
+ * @param reader     The @ref LHAReader structure.
+ * @param buf        Pointer to the buffer in which to store the data.
+ * @param buf_len    Size of the buffer, in bytes. This must be at least
+ *                   the length of the file given in its header.
+ * @param length     Pointer to a variable in which to store the number
+ *                   of bytes stored in the buffer. For a file with a
+ *                   MacBinary header (see @ref lha_reader_read), this
+ *                   is less than the length in its header.
+ * @return           Non-zero if the file was decompressed successfully
+ *                   and the checksum matches, or zero for failure
+ *                   (including if the buffer is too small).
+ */
+
+int lha_reader_extract_into(LHAReader *reader, void *buf, size_t buf_len,
+                            size_t *length);
+
+/**
+ * Decompress the whole of the current archived file into a newly
+ * allocated buffer, and check that the checksum matches.
+ *
+ * The buffer is allocated once, using the length of the file given in
+ * its header, and the data is decompressed into it as for
+ * @ref lha_reader_extract_into.
+ *
+ * @param reader     The @ref LHAReader structure.
+ * @param length     Pointer to a variable in which to store the length
+ *                   of the data, in bytes.
+ * @return           Pointer to the data, which must be freed by the
+ *                   caller using free(), or NULL if the file could not
+ *                   be decompressed or the checksum does not match.
+ */
+
+void *lha_reader_extract_to_buffer(LHAReader *reader, size_t *length);
+
 /**
  * Decompress the contents of the current archived file, and check
  * that the checksum matches correctly.
@@ -209,6 +432,357 @@ int lha_reader_extract(LHAReader *reader,
 
 int lha_reader_current_is_fake(LHAReader *reader);
 
+/**
+ * Set the number of worker threads used by
+ * @ref lha_reader_extract_async and @ref lha_reader_check_async to
+ * process files in parallel.
+ *
+ * Any files still being extracted are finished first (see
+ * @ref lha_reader_flush).
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param num_workers    Number of worker threads, or zero to use one
+ *                       thread for each processor. If this is one, no
+ *                       threads are used and files are extracted
+ *                       immediately (this is the default).
+ * @return               Non-zero for success, or zero if the threads
+ *                       could not be started, in which case files are
+ *                       extracted immediately.
+ */
+
+int lha_reader_set_workers(LHAReader *reader, unsigned int num_workers);
+
+/**
+ * Enable or disable writing of sparse files. When enabled, aligned
+ * blocks of zeroes in extracted files are left as holes, where the
+ * filesystem supports them, rather than being written out. This saves
+ * disk space and time when extracting files such as disk images that
+ * contain long runs of zeroes. The files read back the same either way.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param enable         Non-zero to write sparse files.
+ */
+
+void lha_reader_set_sparse(LHAReader *reader, int enable);
+
+/**
+ * Decode large files using two-stage decoding, which splits the work of
+ * decompressing each file between two threads (see
+ * @ref lha_decoder_enable_two_stage). This only applies to files
+ * decoded by the calling thread, not to those passed to worker
+ * threads by @ref lha_reader_extract_async.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param min_length     Decompressed length of the smallest file to use
+ *                       two-stage decoding for, or zero to disable it
+ *                       (this is the default).
+ */
+
+void lha_reader_set_two_stage(LHAReader *reader, size_t min_length);
+
+/**
+ * Set a callback function to monitor progress in bytes while files are
+ * decompressed by @ref lha_reader_check and @ref lha_reader_extract.
+ * The callback is given the number of bytes of compressed data
+ * consumed, and the file's compressed length, as well as the output
+ * position. It is invoked alongside any block progress callback
+ * passed to those functions.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param callback       Callback function to invoke, or NULL to stop
+ *                       monitoring.
+ * @param callback_data  Extra data to pass to the callback function.
+ */
+
+void lha_reader_monitor_bytes(LHAReader *reader,
+                              LHADecoderByteProgressCallback callback,
+                              void *callback_data);
+
+/**
+ * Use a cache of decompressed files (see @ref lha_decode_cache_new).
+ *
+ * Files read using @ref lha_reader_read, @ref lha_reader_extract_into or
+ * @ref lha_reader_extract_to_buffer are copied from the cache if they are
+ * in it, without being decompressed; @ref lha_reader_seek can also go
+ * straight to any position in them. Files that are read from start to
+ * end and pass the CRC check are added to the cache.
+ *
+ * This must be called before the first call to
+ * @ref lha_reader_next_file.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param cache          The cache. The cache must not be freed until the
+ *                       reader has been freed.
+ * @param archive_id     Value that identifies the archive, such as a
+ *                       hash of its path, size and modification time.
+ *                       This must change if the archive changes.
+ * @return               Non-zero for success, or zero if reading has
+ *                       already started.
+ */
+
+int lha_reader_set_cache(LHAReader *reader, LHADecodeCache *cache,
+                         uint64_t archive_id);
+
+/**
+ * Set budgets for the resources used to decode each file (see
+ * @ref LHADecoderLimits), to protect against "decompression bombs" and
+ * other malicious archives. Files whose headers claim more output, or
+ * a higher expansion ratio, than is allowed are rejected without being
+ * decoded at all; the budgets are also checked as data is decoded.
+ * A file that exceeds a budget fails in the same way as a corrupt
+ * file, and @ref lha_reader_limit_exceeded says why. Files found in a
+ * cache (see @ref lha_reader_set_cache) are not decoded, and so are
+ * not checked.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param limits         The budgets, or NULL for no limits.
+ */
+
+void lha_reader_set_limits(LHAReader *reader,
+                           const LHADecoderLimits *limits);
+
+/**
+ * Check whether a file failed because it exceeded a budget set with
+ * @ref lha_reader_set_limits. A caller that is processing untrusted
+ * archives can use this to abandon the whole archive at once.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @return               The budget exceeded by the last file that was
+ *                       stopped by one, or @ref LHA_DECODER_LIMIT_NONE
+ *                       if no file has been stopped since the budgets
+ *                       were set.
+ */
+
+LHADecoderLimit lha_reader_limit_exceeded(LHAReader *reader);
+
+/**
+ * Enable or disable fast scanning of the archive's headers. When
+ * enabled, headers returned by @ref lha_reader_next_file only contain
+ * the information needed to identify each file: the path, filename,
+ * sizes, compression method, CRC, timestamp and Unix permissions and
+ * owner. Other optional fields (the Unix user and group names, Windows
+ * timestamps and OS-9 permissions) are left unset until
+ * @ref lha_reader_decode_header is called. Headers are always fully
+ * decoded before a file is extracted.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param enable         Non-zero to enable fast scanning.
+ */
+
+void lha_reader_set_fast_scan(LHAReader *reader, int enable);
+
+/**
+ * Finish decoding the header of the current file, when fast scanning
+ * is enabled (see @ref lha_reader_set_fast_scan). It is safe to call
+ * this more than once, or when fast scanning is not enabled.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @return               Non-zero for success, or zero if there is no
+ *                       current file or its header could not be
+ *                       decoded.
+ */
+
+int lha_reader_decode_header(LHAReader *reader);
+
+/**
+ * Allocate the file headers read from the archive from an arena, which
+ * is faster when an archive contains many files. Arena memory is
+ * released in large chunks once every header in a chunk has been freed,
+ * so this is best suited to reading through an archive's headers (for
+ * example, to list its contents) rather than keeping a few of them for
+ * a long time. Header lifetimes are unchanged: a header remains valid
+ * for as long as it otherwise would, even after the reader is freed.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @return               Non-zero for success, or zero if the arena
+ *                       could not be allocated, in which case headers
+ *                       are allocated individually.
+ */
+
+int lha_reader_use_header_arena(LHAReader *reader);
+
+/**
+ * Read the headers of a number of files at once, storing the details
+ * of each in the arrays of a @ref LHAHeaderBatch. This is faster than
+ * calling @ref lha_reader_next_file for each file when indexing the
+ * contents of large archives: headers are only decoded as far as is
+ * needed to fill the batch, and no memory is allocated for each file.
+ *
+ * The reader moves on as if @ref lha_reader_next_file had been called
+ * for each file in the batch, and the last of them becomes the current
+ * file. If the full path of a file does not fit in the remaining space
+ * in the name buffer, the batch ends before it; that file becomes the
+ * current file, and is the first returned by the next call to this
+ * function or to @ref lha_reader_next_file.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param batch          Arrays in which to store the details.
+ * @return               Number of files in the batch, which is less than
+ *                       its capacity only at the end of the archive or
+ *                       if the name buffer is full; zero at the end of
+ *                       the archive; or -1 if the name buffer is too
+ *                       small for the path of the next file.
+ */
+
+int lha_reader_next_batch(LHAReader *reader, LHAHeaderBatch *batch);
+
+/**
+ * Overlap reading the archive and writing extracted files with
+ * decompression. Input is read ahead on a background thread (unless
+ * the archive is memory-mapped, in which case this is not needed),
+ * and files extracted on the calling thread are written out by a
+ * writer thread while decompression continues. This helps most when
+ * reading from network filesystems or writing to slow disks.
+ *
+ * Once enabled, the pipeline stays enabled until the reader is freed.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @return               Non-zero for success, or zero if the writer
+ *                       thread could not be started.
+ */
+
+int lha_reader_enable_pipeline(LHAReader *reader);
+
+/**
+ * Write small files extracted by @ref lha_reader_extract_async through
+ * io_uring, on Linux. Each file is decompressed on the calling thread,
+ * and its data written asynchronously; several files can be in flight
+ * at once, and their writes are submitted to the kernel together. This
+ * reduces the cost of extracting archives of many small files. It only
+ * applies when worker threads are not used (see
+ * @ref lha_reader_set_workers); larger files are extracted normally.
+ *
+ * As with worker threads, the callback for a file may be invoked
+ * after @ref lha_reader_extract_async returns.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @return               Non-zero for success, or zero if io_uring is
+ *                       not available, in which case files are written
+ *                       normally.
+ */
+
+int lha_reader_enable_io_uring(LHAReader *reader);
+
+/**
+ * Avoid decompressing files that are copies of files already extracted.
+ * Copies are found using the catalog passed to @ref lha_reader_select,
+ * which must have been prepared with @ref lha_catalog_find_duplicates.
+ * When a copy is extracted, and the first file with the same contents
+ * has already been extracted successfully, the copy is made from the
+ * extracted file according to the specified policy. If this fails, the
+ * file is decompressed as usual.
+ *
+ * For files that are made from an earlier copy, the progress callback
+ * is invoked once, reporting the whole file as a single block.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param policy         How to extract copies of files.
+ * @return               Non-zero for success, or zero if no catalog has
+ *                       been selected, or memory could not be
+ *                       allocated.
+ */
+
+int lha_reader_set_dedup(LHAReader *reader, LHAReaderDedupPolicy policy);
+
+/**
+ * Extract the contents of the current archived file, possibly in the
+ * background on a worker thread (see @ref lha_reader_set_workers).
+ *
+ * Compressed files are decompressed in the background if the input
+ * stream is reading from a file, so that several files can be
+ * decompressed at once. Everything else (directories, symbolic links,
+ * and so on) is extracted immediately, in the same order as with
+ * @ref lha_reader_extract; where necessary, this waits for earlier files
+ * to finish first, so that, for example, directory metadata is set
+ * after the files in the directory have been written.
+ *
+ * The callback function is invoked exactly once for every call to this
+ * function, either before it returns or during a later call to this
+ * function, @ref lha_reader_flush or @ref lha_reader_free. Callbacks are
+ * always invoked from the calling thread, in the same order as the
+ * calls to this function.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param filename       Filename to extract the archived file to, or NULL
+ *                       to use the path and filename from the header.
+ * @param callback       Callback function to invoke when the file has
+ *                       been extracted, or NULL.
+ * @param callback_data  Extra data to pass to the callback function.
+ * @return               Zero if the file has already failed to extract,
+ *                       otherwise non-zero.
+ */
+
+int lha_reader_extract_async(LHAReader *reader,
+                             char *filename,
+                             LHAReaderExtractCallback callback,
+                             void *callback_data);
+
+/**
+ * Check the contents of the current archived file, possibly in the
+ * background on a worker thread (see @ref lha_reader_set_workers).
+ *
+ * This is the equivalent of @ref lha_reader_check, in the same way that
+ * @ref lha_reader_extract_async is for @ref lha_reader_extract. Files
+ * passed to both functions share the same ordering: callbacks are
+ * invoked in the order of the calls to either function.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param callback       Callback function to invoke when the file has
+ *                       been checked, or NULL.
+ * @param callback_data  Extra data to pass to the callback function.
+ * @return               Zero if the file has already failed the check,
+ *                       otherwise non-zero.
+ */
+
+int lha_reader_check_async(LHAReader *reader,
+                           LHAReaderExtractCallback callback,
+                           void *callback_data);
+
+/**
+ * Wait for all files passed to @ref lha_reader_extract_async and
+ * @ref lha_reader_check_async to finish, invoking the callback function
+ * for each.
+ *
+ * @param reader         The @ref LHAReader structure.
+ */
+
+void lha_reader_flush(LHAReader *reader);
+
+/**
+ * Extract all remaining files in the archive, using the path and
+ * filename from each file header. Files are extracted in parallel if
+ * worker threads have been enabled with @ref lha_reader_set_workers.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param callback       Callback function to invoke as each file is
+ *                       extracted, or NULL.
+ * @param callback_data  Extra data to pass to the callback function.
+ * @return               Non-zero if all files were extracted
+ *                       successfully, or zero if any failed.
+ */
+
+int lha_reader_extract_all(LHAReader *reader,
+                           LHAReaderExtractCallback callback,
+                           void *callback_data);
+
+/**
+ * Check all remaining files in the archive. Files are checked in
+ * parallel if worker threads have been enabled with
+ * @ref lha_reader_set_workers; the callback function is still invoked
+ * in archive order.
+ *
+ * @param reader         The @ref LHAReader structure.
+ * @param callback       Callback function to invoke as each file is
+ *                       checked, or NULL.
+ * @param callback_data  Extra data to pass to the callback function.
+ * @return               Non-zero if the checksums of all files match,
+ *                       or zero if any failed.
+ */
+
+int lha_reader_check_all(LHAReader *reader,
+                         LHAReaderExtractCallback callback,
+                         void *callback_data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,157 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LHASA_PUBLIC_LHA_WRITER_H
+#define LHASA_PUBLIC_LHA_WRITER_H
+
+#include <stdio.h>
+
+#include "lha_file_header.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @file lha_writer.h
+ *
+ * @brief LHA archive writer.
+ *
+ * This file contains the interface functions for the @ref LHAWriter
+ * structure, used to create LZH archives. Files are added one at a
+ * time and written with level 2 headers. Files can be compressed in
+ * parallel on worker threads; they are still written to the archive in
+ * the order in which they were added.
+ */
+
+/**
+ * Opaque structure used to write an LZH archive.
+ */
+
+typedef struct _LHAWriter LHAWriter;
+
+/**
+ * Create a new @ref LHAWriter to write an archive to the specified
+ * file.
+ *
+ * The archive is written starting from the current position of the
+ * file. It is written without going through the stdio buffer, so the
+ * file must not be written to with stdio functions until the writer
+ * has been freed.
+ *
+ * @param stream         FILE to write the archive to.
+ * @return               Pointer to a new @ref LHAWriter structure, or
+ *                       NULL for error.
+ */
+
+LHAWriter *lha_writer_new(FILE *stream);
+
+/**
+ * Free a @ref LHAWriter structure. Any files that have not yet been
+ * written are discarded; use @ref lha_writer_finish to complete the
+ * archive first.
+ *
+ * @param writer         The @ref LHAWriter structure.
+ */
+
+void lha_writer_free(LHAWriter *writer);
+
+/**
+ * Set the number of worker threads used to compress files in parallel.
+ * Any files still being compressed are written out first.
+ *
+ * @param writer         The @ref LHAWriter structure.
+ * @param num_workers    Number of worker threads, or zero to use one
+ *                       thread for each processor. If this is one, no
+ *                       threads are used and files are compressed
+ *                       immediately (this is the default).
+ * @return               Non-zero for success, or zero if the threads
+ *                       could not be started, in which case files are
+ *                       compressed immediately.
+ */
+
+int lha_writer_set_workers(LHAWriter *writer, unsigned int num_workers);
+
+/**
+ * Add a file to the archive.
+ *
+ * The compression method, path, filename, symbolic link target,
+ * timestamp, OS type and any Unix or Windows extra data are taken from
+ * the header; the lengths and CRC are calculated. The header and data
+ * are copied, so they do not need to be kept after this returns.
+ *
+ * The file is compressed using -lh5-, -lh6- or -lh7-, or stored
+ * uncompressed using -lh0-. If compression does not make the file
+ * smaller, it is stored uncompressed instead. Directories and symbolic
+ * links use @ref LHA_COMPRESS_TYPE_DIR, and have no data.
+ *
+ * @param writer         The @ref LHAWriter structure.
+ * @param header         Header describing the file.
+ * @param data           Pointer to the contents of the file.
+ * @param data_len       Length of the file, in bytes.
+ * @return               Non-zero for success, or zero if the
+ *                       compression method is not supported, or an
+ *                       error occurred writing this or an earlier file.
+ */
+
+int lha_writer_add(LHAWriter *writer, LHAFileHeader *header,
+                   const void *data, size_t data_len);
+
+/**
+ * Add a file to the archive, reading its contents from an open file.
+ *
+ * This works in the same way as @ref lha_writer_add, except that the
+ * data does not need to be in memory. Regular files are mapped into
+ * memory rather than read; the whole file is added, from the start.
+ * Files that are stored uncompressed using -lh0- are written
+ * immediately, and copied straight from the input file to the archive
+ * within the kernel where the platform supports it, with the CRC
+ * calculated from the mapping. The input file can be closed once this
+ * returns.
+ *
+ * @param writer         The @ref LHAWriter structure.
+ * @param header         Header describing the file.
+ * @param input          FILE to read the contents of the file from.
+ * @return               Non-zero for success, or zero if the
+ *                       compression method is not supported, or an
+ *                       error occurred writing this or an earlier file.
+ */
+
+int lha_writer_add_file(LHAWriter *writer, LHAFileHeader *header,
+                        FILE *input);
+
+/**
+ * Finish writing the archive: wait for all files to be compressed and
+ * written, and write the end of archive marker. No more files can be
+ * added afterwards.
+ *
+ * @param writer         The @ref LHAWriter structure.
+ * @return               Non-zero if all files were written
+ *                       successfully, or zero for error.
+ */
+
+int lha_writer_finish(LHAWriter *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* #ifndef LHASA_PUBLIC_LHA_WRITER_H */
+
@@ -21,10 +21,13 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #ifndef LHASA_PUBLIC_LHASA_H
 #define LHASA_PUBLIC_LHASA_H
 
+#include "lha_catalog.h"
 #include "lha_decoder.h"
+#include "lha_decode_cache.h"
 #include "lha_file_header.h"
 #include "lha_input_stream.h"
 #include "lha_reader.h"
+#include "lha_writer.h"
 
 #endif /* #ifndef LHASA_PUBLIC_LHASA_H */
 
@@ -28,12 +28,46 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 // This file is implemented as a "template" file to be #include-d by
 // other files. The typedef for TreeElement must be defined before
 // include.
+//
+// To avoid walking the tree a bit at a time for every code, a lookup
+// table is built alongside the tree. The next TREE_LOOKUP_BITS bits of
+// input are used as an index into the table, which gives the node
+// reached after descending that far down the tree. A decoder may
+// define TREE_LOOKUP_BITS before include to change the table size.
 
 
 // Upper bit is set in a node value to indicate a leaf.
 
 #define TREE_NODE_LEAF    (TreeElement) (1 << (sizeof(TreeElement) * 8 - 1))
 
+#ifndef TREE_LOOKUP_BITS
+#define TREE_LOOKUP_BITS  8
+#endif
+
+// Number of entries in a lookup table.
+
+#define TREE_LOOKUP_SIZE  (1 << TREE_LOOKUP_BITS)
+
+// Maximum number of codes that can be passed to build_tree().
+
+#ifndef TREE_MAX_CODES
+#define TREE_MAX_CODES    512
+#endif
+
+// Number of possible code lengths.
+
+#define TREE_NUM_LENGTHS  256
+
+// Entry in the lookup table for a tree. 'node' is the node value that
+// is reached after consuming 'bits' bits of input. For codes shorter
+// than TREE_LOOKUP_BITS this is a leaf; for longer codes it is an
+// internal node, and decoding continues from there a bit at a time.
+
+typedef struct {
+	TreeElement node;
+	uint8_t bits;
+} TreeLookupEntry;
+
 // Structure used to hold data needed to build the tree.
 
 typedef struct {
@@ -42,6 +76,10 @@ typedef struct {
 	TreeElement *tree;
 	unsigned int tree_len;
 
+	// Lookup table that is filled in as the tree is built.
+
+	TreeLookupEntry *lookup;
+
 	// Counter used to allocate entries from the tree.
 	// Every time a new node is allocated, this increase by 2.
 
@@ -54,24 +92,85 @@ typedef struct {
 	// end of the tree build, next_entry should = tree_allocated.
 
 	unsigned int next_entry;
+
+	// Depth within the tree of the entries waiting in the queue, and
+	// the prefix of bits that leads to the first of them. The entries
+	// in the queue always have consecutive prefixes, so the prefix of
+	// each entry is known as it is filled in. The prefix is only kept
+	// up to date while the depth is within the lookup table.
+
+	unsigned int depth;
+	unsigned int next_prefix;
 } TreeBuildData;
 
+// Set all lookup table entries that begin with the specified prefix of
+// 'depth' bits to give the tree node 'code'.
+
+static void set_lookup_range(TreeLookupEntry *lookup, TreeElement code,
+                             unsigned int depth, unsigned int prefix)
+{
+	unsigned int i, start, end;
+
+	start = prefix << (TREE_LOOKUP_BITS - depth);
+	end = (prefix + 1) << (TREE_LOOKUP_BITS - depth);
+
+	for (i = start; i < end; ++i) {
+		lookup[i].node = code;
+		lookup[i].bits = (uint8_t) depth;
+	}
+}
+
+// Fill in the range of lookup table entries that begin with the
+// specified prefix of 'depth' bits, where 'code' is the tree node
+// reached by that prefix.
+
+static void fill_lookup(TreeLookupEntry *lookup, TreeElement *tree,
+                        TreeElement code, unsigned int depth,
+                        unsigned int prefix)
+{
+	// Stop descending once we reach a leaf or have used up all the
+	// bits of the index; every index with this prefix gives the same
+	// result.
+
+	if ((code & TREE_NODE_LEAF) != 0 || depth >= TREE_LOOKUP_BITS) {
+		set_lookup_range(lookup, code, depth, prefix);
+		return;
+	}
+
+	fill_lookup(lookup, tree, tree[code], depth + 1, prefix << 1);
+	fill_lookup(lookup, tree, tree[code + 1], depth + 1,
+	            (prefix << 1) | 1);
+}
+
+// Rebuild the lookup table for a tree to match the tree's contents.
+
+static void build_lookup(TreeLookupEntry *lookup, TreeElement *tree)
+{
+	fill_lookup(lookup, tree, tree[0], 0, 0);
+}
+
 // Initialize all elements of the given tree to a good initial state.
 
-static void init_tree(TreeElement *tree, size_t tree_len)
+static void init_tree(TreeElement *tree, size_t tree_len,
+                      TreeLookupEntry *lookup)
 {
 	unsigned int i;
 
 	for (i = 0; i < tree_len; ++i) {
 		tree[i] = TREE_NODE_LEAF;
 	}
+
+	build_lookup(lookup, tree);
 }
 
 // Set tree to always decode to a single code.
 
-static void set_tree_single(TreeElement *tree, TreeElement code)
+static void set_tree_single(TreeElement *tree, TreeLookupEntry *lookup,
+                            TreeElement code)
 {
 	tree[0] = (TreeElement) code | TREE_NODE_LEAF;
+
+	build_lookup(lookup, tree);
 }
 
 // "Expand" the list of queue entries. This generates a new child
@@ -100,106 +199,162 @@ static void expand_queue(TreeBuildData *build)
 	end_offset = build->tree_allocated;
 
 	while (build->next_entry < end_offset) {
-		build->tree[build->next_entry] = build->tree_allocated;
+		build->tree[build->next_entry]
+		    = (TreeElement) build->tree_allocated;
 		build->tree_allocated += 2;
+
+		// Nodes at the depth of the lookup table are reached by
+		// a single lookup, with decoding continuing from there.
+
+		if (build->depth == TREE_LOOKUP_BITS) {
+			set_lookup_range(build->lookup,
+			                 build->tree[build->next_entry],
+			                 build->depth, build->next_prefix);
+			++build->next_prefix;
+		}
+
 		++build->next_entry;
 	}
+
+	++build->depth;
+	build->next_prefix <<= 1;
 }
 
-// Read the next entry from the queue of entries waiting to be used.
+// Add a code to the tree in the next entry from the queue.
 
-static unsigned int read_next_entry(TreeBuildData *build)
+static void add_code(TreeBuildData *build, unsigned int code)
 {
-	unsigned int result;
+	unsigned int node;
 
-	// Sanity check.
+	// Sanity check: if the queue is empty, the code lengths were
+	// invalid. The code overwrites the root, so that the tree
+	// decodes to a single code; the lookup table is then unused.
 
 	if (build->next_entry >= build->tree_allocated) {
-		return 0;
+		build->tree[0] = (TreeElement) code | TREE_NODE_LEAF;
+		return;
 	}
 
-	result = build->next_entry;
+	node = build->next_entry;
 	++build->next_entry;
 
-	return result;
+	build->tree[node] = (TreeElement) code | TREE_NODE_LEAF;
+
+	if (build->depth <= TREE_LOOKUP_BITS) {
+		set_lookup_range(build->lookup, build->tree[node],
+		                 build->depth, build->next_prefix);
+		++build->next_prefix;
+	}
 }
 
-// Add all codes to the tree that have the specified length.
-// Returns non-zero if there are any entries in code_lengths[] still
-// waiting to be added to the tree.
+// Build a tree, given the specified array of codes indicating the
+// required depth within the tree at which each code should be
+// located. The lookup table for the tree is also built.
+//
+// The codes are sorted by length (and then by value), which is the
+// order they are placed in the tree, so the tree can be built in a
+// single pass. If the code lengths do not describe a complete tree,
+// the result is the same as placing the codes one length at a time:
+// when the tree runs out of space, the remaining codes stay at the
+// depth that has been reached, and once all of the entries at that
+// depth have been used, the remaining codes replace the root.
 
-static int add_codes_with_length(TreeBuildData *build,
-                                 uint8_t *code_lengths,
-                                 unsigned int num_code_lengths,
-                                 unsigned int code_len)
+static void build_tree(TreeElement *tree, size_t tree_len,
+                       TreeLookupEntry *lookup,
+                       uint8_t *code_lengths, unsigned int num_code_lengths)
 {
-	unsigned int i;
-	unsigned int node;
-	int codes_remaining;
-
-	codes_remaining = 0;
+	TreeBuildData build;
+	unsigned int length_counts[TREE_NUM_LENGTHS];
+	unsigned int length_start[TREE_NUM_LENGTHS];
+	uint16_t sorted_codes[TREE_MAX_CODES];
+	unsigned int code_len, max_code_len;
+	unsigned int i, end;
+
+	if (num_code_lengths > TREE_MAX_CODES) {
+		num_code_lengths = TREE_MAX_CODES;
+	}
 
-	for (i = 0; i < num_code_lengths; ++i) {
+	// Sort the codes by length. Note: code_len == 0 is deliberately
+	// skipped over, as 0 indicates "not used".
 
-		// Does this code belong at this depth in the tree?
+	memset(length_counts, 0, sizeof(length_counts));
+	max_code_len = 1;
 
-		if (code_lengths[i] == code_len) {
-			node = read_next_entry(build);
+	for (i = 0; i < num_code_lengths; ++i) {
+		++length_counts[code_lengths[i]];
 
-			build->tree[node] = (TreeElement) i | TREE_NODE_LEAF;
+		if (code_lengths[i] > max_code_len) {
+			max_code_len = code_lengths[i];
 		}
+	}
 
-		// More work to be done after this pass?
+	length_start[1] = 0;
 
-		else if (code_lengths[i] > code_len) {
-			codes_remaining = 1;
-		}
+	for (code_len = 2; code_len <= max_code_len; ++code_len) {
+		length_start[code_len] = length_start[code_len - 1]
+		                       + length_counts[code_len - 1];
 	}
 
-	return codes_remaining;
-}
-
-// Build a tree, given the specified array of codes indicating the
-// required depth within the tree at which each code should be
-// located.
+	for (i = 0; i < num_code_lengths; ++i) {
+		code_len = code_lengths[i];
 
-static void build_tree(TreeElement *tree, size_t tree_len,
-                       uint8_t *code_lengths, unsigned int num_code_lengths)
-{
-	TreeBuildData build;
-	unsigned int code_len;
+		if (code_len != 0) {
+			sorted_codes[length_start[code_len]] = (uint16_t) i;
+			++length_start[code_len];
+		}
+	}
 
 	build.tree = tree;
 	build.tree_len = tree_len;
+	build.lookup = lookup;
 
 	// Start with a single entry in the queue - the root node
 	// pointer.
 
 	build.next_entry = 0;
+	build.depth = 0;
+	build.next_prefix = 0;
 
 	// We always have the root ...
 
 	build.tree_allocated = 1;
 
-	// Iterate over each possible code length.
-	// Note: code_len == 0 is deliberately skipped over, as 0
-	// indicates "not used".
+	// Iterate over each code length. length_start[] now points to
+	// the end of the codes with each length.
+
+	i = 0;
 
-	code_len = 0;
+	for (code_len = 1; code_len <= max_code_len; ++code_len) {
 
-	do {
 		// Advance to the next code length by allocating extra
 		// nodes to the tree - the slots waiting in the queue
 		// will now be one level deeper in the tree (and the
 		// codes 1 bit longer).
 
 		expand_queue(&build);
-		++code_len;
 
 		// Add all codes that have this length.
 
-	} while (add_codes_with_length(&build, code_lengths,
-	                               num_code_lengths, code_len));
+		end = length_start[code_len];
+
+		while (i < end) {
+			add_code(&build, sorted_codes[i]);
+			++i;
+		}
+	}
+
+	// Any entries left in the queue were not filled; the code
+	// lengths did not describe a complete tree. Fill in the lookup
+	// table from whatever they contain, the same as the rest of the
+	// tree was filled in.
+
+	if (build.depth <= TREE_LOOKUP_BITS) {
+		for (i = build.next_entry; i < build.tree_allocated; ++i) {
+			fill_lookup(lookup, tree, tree[i], build.depth,
+			            build.next_prefix);
+			++build.next_prefix;
+		}
+	}
 }
 
 /*
@@ -225,15 +380,32 @@ static void display_tree(TreeElement *tree, unsigned int node, int offset)
 // from the root node until we reach a leaf.  The leaf value is
 // returned.
 
-static int read_from_tree(BitStreamReader *reader, TreeElement *tree)
+static int read_from_tree(BitStreamReader *reader, TreeElement *tree,
+                          TreeLookupEntry *lookup)
 {
+	TreeLookupEntry *entry;
 	TreeElement code;
-	int bit;
+	int bit, index;
 
 	// Start from root.
 
 	code = tree[0];
 
+	// Use the lookup table to skip over the first levels of the tree
+	// in a single step. Near the end of the stream there may not be
+	// enough bits left to do this, in which case fall back to walking
+	// the tree from the root a bit at a time.
+
+	if ((code & TREE_NODE_LEAF) == 0) {
+		index = peek_bits(reader, TREE_LOOKUP_BITS);
+
+		if (index >= 0) {
+			entry = &lookup[index];
+			read_bits(reader, entry->bits);
+			code = entry->node;
+		}
+	}
+
 	while ((code & TREE_NODE_LEAF) == 0) {
 
 		bit = read_bit(reader);
@@ -250,3 +422,201 @@ static int read_from_tree(BitStreamReader *reader, TreeElement *tree)
 	return (int) (code & ~TREE_NODE_LEAF);
 }
 
+
+#ifdef TREE_MULTI_BITS
+
+// Multi-literal lookup table.
+//
+// Short codes for literal values are common, and several of them often
+// fit in the bits that are available from a single peek. A decoder may
+// define TREE_MULTI_BITS before include to get a second lookup table,
+// indexed by the next TREE_MULTI_BITS bits of input (at least
+// TREE_LOOKUP_BITS, and at most 15), which is used in place of the
+// first. Each entry gives the run of up to TREE_MULTI_MAX literals
+// that are decoded from those bits, or if there are none, the same as
+// the lookup table entry for the next code. Building the table costs
+// several passes over the lookup table, so a decoder should only build
+// it for blocks long enough to recoup the cost.
+
+#define TREE_MULTI_SIZE   (1 << TREE_MULTI_BITS)
+#define TREE_MULTI_MAX    3
+
+// Entries in the table are packed into 32 bits, to keep the table small
+// enough to stay in the cache: the literals are in the low 24 bits,
+// first literal lowest, followed by four bits giving the number of bits
+// of input that they use and two bits giving the number of literals.
+// If the number of literals is zero (the next code is not a literal, or
+// is too long to be decoded from the table), the low 16 bits are the
+// node and the four bits are the number of bits from the lookup table
+// entry.
+
+typedef uint32_t TreeMultiEntry;
+
+#define TREE_MULTI_BITS_SHIFT   24
+#define TREE_MULTI_COUNT_SHIFT  28
+
+// Added to the number of literals returned by read_from_multi for a run
+// of literals, to distinguish it from a code.
+
+#define TREE_MULTI_RUN          0x10000
+
+// Build the multi-literal table for a tree from its lookup table.
+// Codes below 'num_literals' are literals. Returns zero without building
+// the table if it should not be used: if the tree decodes to a single
+// code (the lookup table is then unused, and may not match the tree), or
+// if the literal codes are too long for the table to often decode more
+// than one at once, so that it would only slow decoding down.
+
+static int build_multi_lookup(TreeMultiEntry *multi, TreeElement *tree,
+                              TreeLookupEntry *lookup,
+                              unsigned int num_literals)
+{
+	TreeLookupEntry *next;
+	unsigned int i, index, used, count, num_short;
+	TreeMultiEntry entry;
+	TreeElement code;
+
+	if ((tree[0] & TREE_NODE_LEAF) != 0) {
+		return 0;
+	}
+
+	// Each code covers a share of the lookup table in proportion to
+	// how often it is expected to occur. Unless at least half of the
+	// codes read are literals short enough for two to fit in the
+	// table index, runs of literals will be too rare to be worth it.
+
+	num_short = 0;
+
+	for (i = 0; i < TREE_LOOKUP_SIZE; ++i) {
+		if ((lookup[i].node & TREE_NODE_LEAF) != 0
+		 && (unsigned int) (lookup[i].node & ~TREE_NODE_LEAF)
+		    < num_literals
+		 && lookup[i].bits <= TREE_MULTI_BITS / 2) {
+			++num_short;
+		}
+	}
+
+	if (num_short < TREE_LOOKUP_SIZE / 2) {
+		return 0;
+	}
+
+	for (i = 0; i < TREE_MULTI_SIZE; ++i) {
+		next = &lookup[i >> (TREE_MULTI_BITS - TREE_LOOKUP_BITS)];
+		entry = 0;
+		count = 0;
+		used = 0;
+
+		// Each lookup is indexed by the bits following the codes
+		// already decoded. The bits past the end of the index are
+		// unknown, so the code found is only usable if it does
+		// not reach them.
+
+		while (count < TREE_MULTI_MAX) {
+			code = next->node & ~TREE_NODE_LEAF;
+
+			if ((next->node & TREE_NODE_LEAF) == 0
+			 || next->bits > TREE_MULTI_BITS - used
+			 || code >= num_literals) {
+				break;
+			}
+
+			entry |= (TreeMultiEntry) code << (count * 8);
+			++count;
+			used += next->bits;
+
+			index = ((i << used) & (TREE_MULTI_SIZE - 1))
+			     >> (TREE_MULTI_BITS - TREE_LOOKUP_BITS);
+			next = &lookup[index];
+		}
+
+		if (count == 0) {
+			entry = next->node;
+			used = next->bits;
+		}
+
+		multi[i] = entry
+		         | ((TreeMultiEntry) used << TREE_MULTI_BITS_SHIFT)
+		         | ((TreeMultiEntry) count << TREE_MULTI_COUNT_SHIFT);
+	}
+
+	return 1;
+}
+
+// Read from a tree using its multi-literal table. If the next codes are
+// a run of at most 'max_literals' literals, they are stored in 'buf',
+// and TREE_MULTI_RUN plus the number of them is returned. 'buf' must
+// have room for four bytes; any after the literals are left unchanged.
+// Otherwise, a single code is read and returned, as for read_from_tree.
+
+static int read_from_multi(BitStreamReader *reader, TreeElement *tree,
+                           TreeLookupEntry *lookup, TreeMultiEntry *multi,
+                           uint8_t *buf, unsigned int max_literals)
+{
+	TreeMultiEntry entry;
+	TreeElement code;
+	uint32_t word, mask;
+	unsigned int n, used;
+	int index, bit;
+
+	// Near the end of the stream there may not be enough bits left
+	// to use the table, and a run of literals can't be used if it is
+	// too long; in either case, fall back to read_from_tree. Once the
+	// bits have been peeked at, they are known to be in the buffer,
+	// and can be consumed without checking again.
+
+	if (reader->bits >= TREE_MULTI_BITS
+	 || refill_bits(reader, TREE_MULTI_BITS)) {
+		index = (int) (reader->bit_buffer >> (64 - TREE_MULTI_BITS));
+		entry = multi[index];
+		n = entry >> TREE_MULTI_COUNT_SHIFT;
+
+		// Not a run of literals: continue from the lookup table
+		// entry for the code, as read_from_tree would.
+
+		if (n == 0) {
+			code = (TreeElement) entry;
+			used = (entry >> TREE_MULTI_BITS_SHIFT) & 0xf;
+			reader->bit_buffer <<= used;
+			reader->bits -= used;
+
+			while ((code & TREE_NODE_LEAF) == 0) {
+				bit = read_bit(reader);
+
+				if (bit < 0) {
+					return -1;
+				}
+
+				code = tree[code + (unsigned int) bit];
+			}
+
+			return (int) (code & ~TREE_NODE_LEAF);
+		}
+
+		// The number of literals is too unpredictable to store
+		// them in a loop. Instead, merge them into the existing
+		// contents of buf and write all four bytes back at once.
+
+		if (n <= max_literals) {
+			mask = (uint32_t) ((UINT64_C(1) << (n * 8)) - 1);
+			word = (uint32_t) buf[0] | ((uint32_t) buf[1] << 8)
+			     | ((uint32_t) buf[2] << 16)
+			     | ((uint32_t) buf[3] << 24);
+			word = (word & ~mask) | (entry & mask);
+
+			buf[0] = (uint8_t) word;
+			buf[1] = (uint8_t) (word >> 8);
+			buf[2] = (uint8_t) (word >> 16);
+			buf[3] = (uint8_t) (word >> 24);
+
+			used = (entry >> TREE_MULTI_BITS_SHIFT) & 0xf;
+			reader->bit_buffer <<= used;
+			reader->bits -= used;
+
+			return TREE_MULTI_RUN + (int) n;
+		}
+	}
+
+	return read_from_tree(reader, tree, lookup);
+}
+
+#endif /* #ifdef TREE_MULTI_BITS */
@@ -0,0 +1,67 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+// Common code for copying data within the history window of an LZ77
+// style decoder.
+//
+// This file is implemented as a "template" file to be #include-d by
+// other files.
+
+// Copy 'count' bytes from src to dst, where src is earlier in the
+// same buffer. If the two ranges overlap, the result is the same as
+// copying a byte at a time from start to end: the bytes between src
+// and dst are repeated, as is required for LZ matches with a distance
+// shorter than their length.
+
+static void window_copy(uint8_t *dst, uint8_t *src, size_t count)
+{
+	size_t n;
+
+	// Common case: the ranges do not overlap.
+
+	if ((size_t) (dst - src) >= count) {
+		memcpy(dst, src, count);
+		return;
+	}
+
+	// A distance of one is a run of a single repeated byte.
+
+	if (dst - src == 1) {
+		memset(dst, *src, count);
+		return;
+	}
+
+	// Otherwise, copy in chunks that do not overlap. Each chunk
+	// extends the repeated pattern, so the chunks can get larger
+	// each time.
+
+	while (count > 0) {
+		n = (size_t) (dst - src);
+
+		if (n > count) {
+			n = count;
+		}
+
+		memcpy(dst, src, n);
+		dst += n;
+		count -= n;
+	}
+}
+
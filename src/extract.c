@@ -24,6 +24,7 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <ctype.h>
 
 #include "lib/lha_arch.h"
+#include "lib/lha_work_queue.h"
 
 #include "extract.h"
 #include "safe.h"
@@ -32,14 +33,55 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #define MAX_PROGRESS_LEN 58
 
+// Minimum time between updates to the progress output, in milliseconds.
+
+#define PROGRESS_INTERVAL_MS 100
+
+// With background threads enabled, files at least this long are decoded
+// on two threads (on multi-processor systems).
+
+#define TWO_STAGE_LENGTH (1024 * 1024)
+
+// Data printed by lha -p is written to the output in blocks of this
+// size, by a writer thread, so that the next block can be decoded while
+// the last is being written. This many blocks are used in turn.
+
+#define PRINT_BLOCK_SIZE (1024 * 1024)
+#define PRINT_BLOCKS 2
+
 typedef struct {
 	int invoked;
 	LHAFileHeader *header;
 	LHAOptions *options;
 	char *filename;
 	char *operation;
+
+	// If the output is not a terminal, the output is not flushed until
+	// the file is finished. Otherwise, it is flushed at most once
+	// every PROGRESS_INTERVAL_MS; 'start_time' and 'last_update'
+	// are the clock times when the file was started and when the
+	// output was last updated.
+
+	int is_terminal;
+	unsigned int start_time, last_update;
+
+	// Amount of compressed data consumed so far, and its total
+	// length, as reported by byte_progress_callback. If input_pos is
+	// zero, the amount is estimated from the block count instead.
+
+	size_t input_pos, input_length;
 } ProgressCallbackData;
 
+// Data for the callback invoked when a file extracted or tested in
+// parallel has finished.
+
+typedef struct {
+	LHAOptions *options;
+	char *filename;
+	int is_fake;
+	int *result;
+} ExtractedCallbackData;
+
 // Given a file header structure, get the path to extract to.
 // Returns a newly allocated string that must be free()d.
 
@@ -109,17 +151,103 @@ static char *file_full_path(LHAFileHeader *header, LHAOptions *options)
 	return result;
 }
 
-static void print_filename(char *filename, char *status)
+static void print_filename(FILE *output, char *filename, char *status)
 {
-	printf("\r");
-	safe_printf("%s", filename);
-	printf("\t- %s  ", status);
+	fprintf(output, "\r");
+	safe_fprintf(output, "%s", filename);
+	fprintf(output, "\t- %s  ", status);
 }
 
-static void print_filename_brief(char *filename)
+static void print_filename_brief(FILE *output, char *filename)
 {
-	printf("\r");
-	safe_printf("%s :", filename);
+	fprintf(output, "\r");
+	safe_fprintf(output, "%s :", filename);
+}
+
+static void init_progress(ProgressCallbackData *progress,
+                          LHAFileHeader *header, LHAOptions *options,
+                          char *filename, char *operation)
+{
+	progress->invoked = 0;
+	progress->header = header;
+	progress->options = options;
+	progress->filename = filename;
+	progress->operation = operation;
+	progress->is_terminal = lha_arch_is_terminal(options->output);
+	progress->start_time = lha_arch_clock_ms();
+	progress->last_update = progress->start_time;
+	progress->input_pos = 0;
+	progress->input_length = 0;
+}
+
+// Print the throughput so far and estimated time remaining. Compression
+// ratios vary through a file, so these are based on the amount of
+// compressed data consumed, where the decoder reports it; otherwise it
+// is estimated from the number of blocks.
+
+static void print_progress_stats(ProgressCallbackData *progress,
+                                 unsigned int block,
+                                 unsigned int num_blocks,
+                                 unsigned int now)
+{
+	unsigned int elapsed, eta;
+	double bytes;
+
+	elapsed = now - progress->start_time;
+
+	if (block == 0 || elapsed == 0) {
+		return;
+	}
+
+	if (progress->input_pos > 0
+	 && progress->input_pos <= progress->input_length) {
+		bytes = (double) progress->input_pos;
+		eta = (unsigned int) ((double) elapsed
+		    * (progress->input_length - progress->input_pos)
+		    / progress->input_pos / 1000);
+	} else {
+		bytes = (double) progress->header->compressed_length
+		      * block / num_blocks;
+		eta = (unsigned int) ((double) elapsed * (num_blocks - block)
+		                      / block / 1000);
+	}
+
+	fprintf(progress->options->output, " %.1f MB/s ETA %u:%02u",
+	        bytes * 1000.0 / elapsed / (1024 * 1024), eta / 60, eta % 60);
+}
+
+// Redraw the whole progress line, for verbose mode: the dots are
+// followed by the throughput, so progress can not be shown just by
+// adding more characters to the line.
+
+static void redraw_progress(ProgressCallbackData *progress,
+                            unsigned int block, unsigned int num_blocks,
+                            unsigned int factor, unsigned int now)
+{
+	unsigned int i, done;
+
+	done = (block + factor - 1) / factor;
+
+	print_filename(progress->options->output,
+	               progress->filename, progress->operation);
+
+	for (i = 0; i < (num_blocks + factor - 1) / factor; ++i) {
+		fputc(i < done ? 'o' : '.', progress->options->output);
+	}
+
+	print_progress_stats(progress, block, num_blocks, now);
+}
+
+// Callback function invoked during decompression progress, before
+// progress_callback, to record how much compressed data has been read.
+
+static void byte_progress_callback(const LHADecoderProgress *decoder_progress,
+                                   void *data)
+{
+	ProgressCallbackData *progress = data;
+
+	progress->input_pos = decoder_progress->input_pos;
+	progress->input_length = decoder_progress->input_length;
 }
 
 // Callback function invoked during decompression progress.
@@ -130,6 +258,7 @@ static void progress_callback(unsigned int block,
 {
 	ProgressCallbackData *progress = data;
 	unsigned int factor;
+	unsigned int now;
 	unsigned int i;
 
 	progress->invoked = 1;
@@ -142,8 +271,12 @@ static void progress_callback(unsigned int block,
 		return;
 	} else if (progress->options->quiet == 1) {
 		if (block == 0) {
-			print_filename_brief(progress->filename);
-			fflush(stdout);
+			print_filename_brief(progress->options->output,
+			                     progress->filename);
+
+			if (progress->is_terminal) {
+				fflush(progress->options->output);
+			}
 		}
 
 		return;
@@ -154,41 +287,97 @@ static void progress_callback(unsigned int block,
 	// progressively larger scale factors are applied.
 
 	factor = 1 + (num_blocks / MAX_PROGRESS_LEN);
+
+	// Verbose mode on a terminal shows how fast the file is being
+	// processed, redrawing the line at each update.
+
+	if (progress->options->verbose && progress->is_terminal) {
+		now = lha_arch_clock_ms();
+
+		if (block == 0 || block == num_blocks
+		 || now - progress->last_update >= PROGRESS_INTERVAL_MS) {
+			redraw_progress(progress, block, num_blocks,
+			                factor, now);
+			progress->last_update = now;
+			fflush(progress->options->output);
+		}
+
+		return;
+	}
+
 	num_blocks = (num_blocks + factor - 1) / factor;
 
 	// First call to specify number of blocks?
 
 	if (block == 0) {
-		print_filename(progress->filename, progress->operation);
+		print_filename(progress->options->output,
+		               progress->filename, progress->operation);
 
 		for (i = 0; i < num_blocks; ++i) {
-			printf(".");
+			fputc('.', progress->options->output);
 		}
 
-		print_filename(progress->filename, progress->operation);
+		print_filename(progress->options->output,
+		               progress->filename, progress->operation);
 	} else if (((block + factor - 1) % factor) == 0) {
 		// Otherwise, signal progress:
 
-		printf("o");
+		fputc('o', progress->options->output);
+	}
+
+	// Flushing the output for every block can be slow, so only do it
+	// periodically.
+
+	if (progress->is_terminal) {
+		now = lha_arch_clock_ms();
+
+		if (block == 0
+		 || now - progress->last_update >= PROGRESS_INTERVAL_MS) {
+			progress->last_update = now;
+			fflush(progress->options->output);
+		}
 	}
+}
 
-	fflush(stdout);
+// Print a line describing a symlink.
+
+static void print_symlink_line(FILE *output, char *src, char *dest)
+{
+	safe_fprintf(output, "Symbolic Link %s -> %s", src, dest);
+	fprintf(output, "\n");
 }
 
-// Print a line to stdout describing a symlink.
+// Callback invoked when a file tested in parallel has finished.
 
-static void print_symlink_line(char *src, char *dest)
+static void tested_callback(LHAFileHeader *header, int success, void *data)
 {
-	safe_printf("Symbolic Link %s -> %s", src, dest);
-	printf("\n");
+	ExtractedCallbackData *tested = data;
+
+	if (strcmp(header->compress_method, LHA_COMPRESS_TYPE_DIR) != 0
+	 && tested->options->quiet < 2) {
+		print_filename(tested->options->output, tested->filename,
+		               success ? "Tested" : "CRC error");
+		fprintf(tested->options->output, "\n");
+		fflush(tested->options->output);
+	}
+
+	if (!success) {
+		*tested->result = 0;
+	}
+
+	free(tested->filename);
+	free(tested);
 }
 
-// Perform CRC check of an archived file.
+// Perform CRC check of an archived file. If files are being tested in
+// parallel, the result is stored to *result once the check finishes.
 
 static int test_archived_file_crc(LHAReader *reader,
                                   LHAFileHeader *header,
-                                  LHAOptions *options)
+                                  LHAOptions *options,
+                                  int *result)
 {
+	ExtractedCallbackData *tested;
 	ProgressCallbackData progress;
 	char *filename;
 	int success;
@@ -198,32 +387,47 @@ static int test_archived_file_crc(LHAReader *reader,
 	if (options->dry_run) {
 		if (strcmp(header->compress_method,
 		           LHA_COMPRESS_TYPE_DIR) != 0) {
-			safe_printf("VERIFY %s", filename);
-			printf("\n");
+			safe_fprintf(options->output, "VERIFY %s", filename);
+			fprintf(options->output, "\n");
 		}
 
 		free(filename);
 		return 1;
 	}
 
-	progress.invoked = 0;
-	progress.operation = "Testing  :";
-	progress.options = options;
-	progress.filename = filename;
-	progress.header = header;
+	if (options->num_workers != 1) {
+		tested = malloc(sizeof(ExtractedCallbackData));
+
+		if (tested == NULL) {
+			exit(-1);
+		}
+
+		tested->options = options;
+		tested->filename = filename;
+		tested->is_fake = 0;
+		tested->result = result;
+
+		lha_reader_check_async(reader, tested_callback, tested);
+
+		return 1;
+	}
+
+	init_progress(&progress, header, options, filename, "Testing  :");
 
+	lha_reader_monitor_bytes(reader, byte_progress_callback, &progress);
 	success = lha_reader_check(reader, progress_callback, &progress);
+	lha_reader_monitor_bytes(reader, NULL, NULL);
 
 	if (progress.invoked && options->quiet < 2) {
 		if (success) {
-			print_filename(filename, "Tested");
-			printf("\n");
+			print_filename(options->output, filename, "Tested");
+			fprintf(options->output, "\n");
 		} else {
-			print_filename(filename, "CRC error");
-			printf("\n");
+			print_filename(options->output, filename, "CRC error");
+			fprintf(options->output, "\n");
 		}
 
-		fflush(stdout);
+		fflush(options->output);
 	}
 
 	if (!success) {
@@ -274,6 +478,114 @@ static int check_parent_directory(char *path)
 	return 1;
 }
 
+// Set of directories that are known to exist, because they have already
+// been checked or created while extracting, so that they can be skipped
+// over when creating parent directories for later files. Directories
+// are never removed during extraction, and a symlink can not replace an
+// existing directory, so an entry can not become stale. The set is a
+// hash table using open addressing.
+
+static char **dir_cache = NULL;
+static unsigned int dir_cache_size = 0;
+static unsigned int dir_cache_count = 0;
+
+static unsigned int hash_path(char *path)
+{
+	unsigned int result;
+	unsigned char *p;
+
+	result = 2166136261U;
+
+	for (p = (unsigned char *) path; *p != '\0'; ++p) {
+		result = (result ^ *p) * 16777619U;
+	}
+
+	return result;
+}
+
+static int dir_cache_contains(char *path)
+{
+	unsigned int i;
+
+	if (dir_cache_size == 0) {
+		return 0;
+	}
+
+	for (i = hash_path(path) & (dir_cache_size - 1);
+	     dir_cache[i] != NULL;
+	     i = (i + 1) & (dir_cache_size - 1)) {
+		if (!strcmp(dir_cache[i], path)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void dir_cache_insert(char **table, unsigned int size, char *path)
+{
+	unsigned int i;
+
+	for (i = hash_path(path) & (size - 1);
+	     table[i] != NULL;
+	     i = (i + 1) & (size - 1));
+
+	table[i] = path;
+}
+
+static void dir_cache_add(char *path)
+{
+	char **new_table;
+	unsigned int new_size;
+	unsigned int i;
+	char *copy;
+
+	// Grow the table to keep it no more than half full.
+
+	if ((dir_cache_count + 1) * 2 > dir_cache_size) {
+		new_size = dir_cache_size == 0 ? 64 : dir_cache_size * 2;
+		new_table = calloc(new_size, sizeof(char *));
+
+		if (new_table == NULL) {
+			return;
+		}
+
+		for (i = 0; i < dir_cache_size; ++i) {
+			if (dir_cache[i] != NULL) {
+				dir_cache_insert(new_table, new_size,
+				                 dir_cache[i]);
+			}
+		}
+
+		free(dir_cache);
+		dir_cache = new_table;
+		dir_cache_size = new_size;
+	}
+
+	copy = strdup(path);
+
+	if (copy == NULL) {
+		return;
+	}
+
+	dir_cache_insert(dir_cache, dir_cache_size, copy);
+	++dir_cache_count;
+}
+
+static void dir_cache_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < dir_cache_size; ++i) {
+		free(dir_cache[i]);
+	}
+
+	free(dir_cache);
+	dir_cache = NULL;
+	dir_cache_size = 0;
+	dir_cache_count = 0;
+}
+
 // Given a filename, create its parent directories as necessary.
 
 static int make_parent_directories(char *orig_path)
@@ -299,6 +611,22 @@ static int make_parent_directories(char *orig_path)
 		--p;
 	}
 
+	// Usually the immediate parent directory is already known to
+	// exist, as files in the same directory are stored together.
+
+	p = strrchr(path, '/');
+
+	if (p != NULL && p > path) {
+		*p = '\0';
+
+		if (dir_cache_contains(path)) {
+			free(path);
+			return 1;
+		}
+
+		*p = '/';
+	}
+
 	// Iterate through the string, finding each path separator. At
 	// each place, temporarily chop off the end of the path to get
 	// each parent directory in turn.
@@ -316,9 +644,13 @@ static int make_parent_directories(char *orig_path)
 
 		// Check if this parent directory exists and create it:
 
-		if (!check_parent_directory(path)) {
-			result = 0;
-			break;
+		if (!dir_cache_contains(path)) {
+			if (!check_parent_directory(path)) {
+				result = 0;
+				break;
+			}
+
+			dir_cache_add(path);
 		}
 
 		// Restore path separator and advance to the next path.
@@ -421,11 +753,68 @@ static int file_exists(char *filename)
 	return file_type != LHA_FILE_NONE;
 }
 
-// Extract an archived file.
+// Callback invoked when a file extracted in parallel has finished. The
+// progress of individual files isn't shown, just the result.
+
+static void extracted_callback(LHAFileHeader *header, int success,
+                               void *data)
+{
+	ExtractedCallbackData *extracted = data;
+
+	if (!extracted->is_fake && extracted->options->quiet < 2) {
+		if (header->symlink_target != NULL) {
+			print_symlink_line(extracted->options->output,
+			                   extracted->filename,
+			                   header->symlink_target);
+		} else if (strcmp(header->compress_method,
+		                  LHA_COMPRESS_TYPE_DIR) != 0) {
+			print_filename(extracted->options->output,
+			               extracted->filename,
+			               success ? "Melted" : "Failure");
+			fprintf(extracted->options->output, "\n");
+		}
+
+		fflush(extracted->options->output);
+	}
+
+	if (!success) {
+		*extracted->result = 0;
+	}
+
+	free(extracted->filename);
+	free(extracted);
+}
+
+// Start extracting an archived file in parallel with other files. The
+// result is stored to *result when the file has been extracted.
+
+static void extract_in_parallel(LHAReader *reader, char *filename,
+                                LHAOptions *options, int *result)
+{
+	ExtractedCallbackData *extracted;
+
+	extracted = malloc(sizeof(ExtractedCallbackData));
+
+	if (extracted == NULL) {
+		exit(-1);
+	}
+
+	extracted->options = options;
+	extracted->filename = filename;
+	extracted->is_fake = lha_reader_current_is_fake(reader);
+	extracted->result = result;
+
+	lha_reader_extract_async(reader, filename,
+	                         extracted_callback, extracted);
+}
+
+// Extract an archived file. If 'async' is non-zero, the file may be
+// finished in the background (see extract_in_parallel).
 
 static int extract_archived_file(LHAReader *reader,
                                  LHAFileHeader *header,
-                                 LHAOptions *options)
+                                 LHAOptions *options,
+                                 int async, int *result)
 {
 	ProgressCallbackData progress;
 	char *filename;
@@ -438,15 +827,22 @@ static int extract_archived_file(LHAReader *reader,
 	      && !is_symlink;
 
 	// If a file already exists with this name, confirm overwrite.
-
-	if (!is_dir && !is_symlink && file_exists(filename)
-	 && !confirm_file_overwrite(filename, options)) {
-		if (options->overwrite_policy == LHA_OVERWRITE_SKIP) {
-			safe_printf("%s : Skipped...", filename);
-			printf("\n");
+	// Any files being extracted in parallel are finished first, so
+	// that their messages are printed before the prompt.
+
+	if (!is_dir && !is_symlink && file_exists(filename)) {
+		lha_reader_flush(reader);
+
+		if (!confirm_file_overwrite(filename, options)) {
+			if (options->overwrite_policy
+			    == LHA_OVERWRITE_SKIP) {
+				safe_fprintf(options->output,
+				             "%s : Skipped...", filename);
+				fprintf(options->output, "\n");
+			}
+			free(filename);
+			return 1;
 		}
-		free(filename);
-		return 1;
 	}
 
 	// No need to extract directories if use_path is disabled.
@@ -462,29 +858,35 @@ static int extract_archived_file(LHAReader *reader,
 		return 0;
 	}
 
-	progress.invoked = 0;
-	progress.operation = "Melting  :";
-	progress.options = options;
-	progress.header = header;
-	progress.filename = filename;
+	if (async) {
+		extract_in_parallel(reader, filename, options, result);
+		return 1;
+	}
+
+	init_progress(&progress, header, options, filename, "Melting  :");
 
+	lha_reader_monitor_bytes(reader, byte_progress_callback, &progress);
 	success = lha_reader_extract(reader, filename,
 	                             progress_callback, &progress);
+	lha_reader_monitor_bytes(reader, NULL, NULL);
 
 	if (!lha_reader_current_is_fake(reader) && options->quiet < 2) {
 		if (progress.invoked) {
 			if (success) {
-				print_filename(filename, "Melted");
-				printf("\n");
+				print_filename(options->output,
+				               filename, "Melted");
+				fprintf(options->output, "\n");
 			} else {
-				print_filename(filename, "Failure");
-				printf("\n");
+				print_filename(options->output,
+				               filename, "Failure");
+				fprintf(options->output, "\n");
 			}
 		} else if (is_symlink) {
-			print_symlink_line(filename, header->symlink_target);
+			print_symlink_line(options->output, filename,
+			                   header->symlink_target);
 		}
 
-		fflush(stdout);
+		fflush(options->output);
 	}
 
 	if (!success) {
@@ -496,6 +898,17 @@ static int extract_archived_file(LHAReader *reader,
 	return success;
 }
 
+// Start the background threads used by the 'b' option.
+
+static void start_pipeline(LHAReader *reader)
+{
+	lha_reader_enable_pipeline(reader);
+
+	if (lha_arch_num_cpus() > 1) {
+		lha_reader_set_two_stage(reader, TWO_STAGE_LENGTH);
+	}
+}
+
 // lha -t command.
 
 int test_file_crc(LHAFilter *filter, LHAOptions *options)
@@ -504,6 +917,14 @@ int test_file_crc(LHAFilter *filter, LHAOptions *options)
 
 	result = 1;
 
+	if (options->num_workers != 1 && !options->dry_run) {
+		lha_reader_set_workers(filter->reader, options->num_workers);
+	}
+
+	if (options->pipeline) {
+		start_pipeline(filter->reader);
+	}
+
 	for (;;) {
 		LHAFileHeader *header;
 
@@ -513,17 +934,22 @@ int test_file_crc(LHAFilter *filter, LHAOptions *options)
 			break;
 		}
 
-		if (!test_archived_file_crc(filter->reader, header, options)) {
+		if (!test_archived_file_crc(filter->reader, header, options,
+		                            &result)) {
 			result = 0;
 		}
 	}
 
+	// Wait for any files still being tested in parallel.
+
+	lha_reader_flush(filter->reader);
+
 	return result;
 }
 
 // lha -en / -xn / -pn:
 // Simulate extracting an archive file, but just print the operations
-// that would have been performed to stdout.
+// that would have been performed.
 
 static int extract_archive_dry_run(LHAFilter *filter, LHAOptions *options)
 {
@@ -545,7 +971,7 @@ static int extract_archive_dry_run(LHAFilter *filter, LHAOptions *options)
 
 		// Every line begins the same - "EXTRACT filename..."
 
-		safe_printf("EXTRACT %s", filename);
+		safe_fprintf(options->output, "EXTRACT %s", filename);
 
 		// After the filename we might print something extra.
 		// The message if we have an existing file is weird, but this
@@ -555,14 +981,15 @@ static int extract_archive_dry_run(LHAFilter *filter, LHAOptions *options)
 		// symlinks are stored).
 
 		if (header->symlink_target != NULL) {
-			safe_printf("|%s (directory)", header->symlink_target);
+			safe_fprintf(options->output, "|%s (directory)",
+			             header->symlink_target);
 		} else if (!strcmp(header->compress_method,
 		                   LHA_COMPRESS_TYPE_DIR)) {
-			safe_printf(" (directory)");
+			safe_fprintf(options->output, " (directory)");
 		} else if (file_exists(filename)) {
-			safe_printf(" but file is exist.");
+			safe_fprintf(options->output, " but file is exist.");
 		}
-		printf("\n");
+		fprintf(options->output, "\n");
 
 		free(filename);
 	}
@@ -575,6 +1002,7 @@ static int extract_archive_dry_run(LHAFilter *filter, LHAOptions *options)
 int extract_archive(LHAFilter *filter, LHAOptions *options)
 {
 	int result;
+	int async;
 
 	if (options->dry_run) {
 		return extract_archive_dry_run(filter, options);
@@ -582,6 +1010,39 @@ int extract_archive(LHAFilter *filter, LHAOptions *options)
 
 	result = 1;
 
+	// Set the metadata of all directories together once everything
+	// else has been extracted. Files later in the archive then can't
+	// change the timestamp of a directory that has already been set.
+
+	lha_reader_set_dir_policy(filter->reader, LHA_READER_DIR_END_OF_FILE);
+
+	async = options->num_workers != 1;
+
+	if (async) {
+		lha_reader_set_workers(filter->reader, options->num_workers);
+	}
+
+	if (options->pipeline) {
+		start_pipeline(filter->reader);
+	}
+
+	lha_reader_set_sparse(filter->reader, options->sparse);
+
+	// Without worker threads, small files can still be written in the
+	// background through io_uring, where it is available.
+
+	if (options->use_uring && !async
+	 && lha_reader_enable_io_uring(filter->reader)) {
+		async = 1;
+	}
+
+	// Duplicate files can only be found if a catalog of the archive
+	// was made (see select_files).
+
+	if (options->dedup != LHA_READER_DEDUP_NONE) {
+		lha_reader_set_dedup(filter->reader, options->dedup);
+	}
+
 	for (;;) {
 		LHAFileHeader *header;
 
@@ -591,42 +1052,207 @@ int extract_archive(LHAFilter *filter, LHAOptions *options)
 			break;
 		}
 
-		if (!extract_archived_file(filter->reader, header, options)) {
+		if (!extract_archived_file(filter->reader, header, options,
+		                           async, &result)) {
 			result = 0;
 		}
 	}
 
+	// Wait for any files still being extracted in parallel.
+
+	lha_reader_flush(filter->reader);
+
+	dir_cache_free();
+
 	return result;
 }
 
-// Dump contents of the current file from the specified reader to stdout.
+// A block of data to be written to the output by lha -p.
+
+typedef struct {
+	FILE *output;
+	uint8_t *data;
+	size_t len;
+	int success;
+} PrintBlock;
+
+// Blocks of data being printed, and the writer thread that writes them,
+// or NULL to write them immediately. 'curr_block' is the block being
+// filled, and 'pending' the number of blocks being written. The flag is
+// set if writing fails.
 
-static int print_archived_file(LHAReader *reader)
+typedef struct {
+	LHAWorkQueue *writer;
+	PrintBlock blocks[PRINT_BLOCKS];
+	unsigned int curr_block;
+	unsigned int pending;
+	int write_failed;
+} PrintData;
+
+// Write a block of data to the output. This runs on the writer thread.
+
+static void write_print_block(void *data)
 {
-	char buf[512];
-	size_t bytes;
+	PrintBlock *block = data;
 
-	for (;;) {
-		bytes = lha_reader_read(reader, buf, sizeof(buf));
-		if (bytes <= 0) {
-			break;
+	block->success = lha_arch_write(block->output, block->data,
+	                                block->len);
+}
+
+// Wait for the oldest block being written to finish.
+
+static void collect_print_block(PrintData *print)
+{
+	PrintBlock *block;
+
+	block = lha_work_queue_collect(print->writer, 1);
+	--print->pending;
+
+	if (!block->success) {
+		print->write_failed = 1;
+	}
+}
+
+// Pass the current block to be written, and move on to the next one,
+// once it is free.
+
+static void flush_print_block(PrintData *print)
+{
+	PrintBlock *block = &print->blocks[print->curr_block];
+
+	if (block->len == 0) {
+		return;
+	}
+
+	if (print->writer == NULL
+	 || !lha_work_queue_add(print->writer, block, 1)) {
+		write_print_block(block);
+
+		if (!block->success) {
+			print->write_failed = 1;
+		}
+	} else {
+		++print->pending;
+		print->curr_block = (print->curr_block + 1) % PRINT_BLOCKS;
+
+		if (print->pending >= PRINT_BLOCKS) {
+			collect_print_block(print);
 		}
+	}
+
+	print->blocks[print->curr_block].len = 0;
+}
+
+// Wait until all data has been written to the output.
 
-		if (fwrite(buf, 1, bytes, stdout) < bytes) {
+static void finish_printing(PrintData *print)
+{
+	flush_print_block(print);
+
+	while (print->pending > 0) {
+		collect_print_block(print);
+	}
+}
+
+static int init_printing(PrintData *print, FILE *output)
+{
+	unsigned int i;
+
+	memset(print, 0, sizeof(PrintData));
+
+	for (i = 0; i < PRINT_BLOCKS; ++i) {
+		print->blocks[i].output = output;
+		print->blocks[i].data = lha_arch_alloc_aligned(PRINT_BLOCK_SIZE,
+		                                               4096);
+
+		if (print->blocks[i].data == NULL) {
 			return 0;
 		}
 	}
 
+	// If the writer thread can't be started, blocks are written on
+	// this thread instead. A bigger pipe buffer lets the writer get
+	// further ahead of whatever is reading from the pipe.
+
+	print->writer = lha_work_queue_new(write_print_block, 1);
+	lha_arch_grow_pipe(output, PRINT_BLOCK_SIZE);
+
 	return 1;
 }
 
+static void free_printing(PrintData *print)
+{
+	unsigned int i;
+
+	if (print->writer != NULL) {
+		lha_work_queue_free(print->writer);
+	}
+
+	for (i = 0; i < PRINT_BLOCKS; ++i) {
+		lha_arch_free_aligned(print->blocks[i].data);
+	}
+}
+
+// Sink callback used to write decompressed data to the output.
+
+static int print_data(uint8_t *buf, size_t buf_len, void *user_data)
+{
+	PrintData *print = user_data;
+	PrintBlock *block;
+	size_t n;
+
+	while (buf_len > 0 && !print->write_failed) {
+		block = &print->blocks[print->curr_block];
+		n = PRINT_BLOCK_SIZE - block->len;
+
+		if (n > buf_len) {
+			n = buf_len;
+		}
+
+		memcpy(block->data + block->len, buf, n);
+		block->len += n;
+		buf += n;
+		buf_len -= n;
+
+		if (block->len == PRINT_BLOCK_SIZE) {
+			flush_print_block(print);
+		}
+	}
+
+	return !print->write_failed;
+}
+
+// Dump contents of the current file from the specified reader to the
+// output.
+
+static int print_archived_file(LHAReader *reader, PrintData *print,
+                               LHAOptions *options)
+{
+	// The data is written straight to the output file, so anything
+	// buffered by stdio (the header line) must go first.
+
+	if (fflush(options->output) != 0) {
+		return 0;
+	}
+
+	// A CRC error is not treated as a failure here; only a failure
+	// to write the output is.
+
+	lha_reader_decode_to(reader, print_data, print);
+	finish_printing(print);
+
+	return !print->write_failed;
+}
+
 // lha -p
 
 int print_archive(LHAFilter *filter, LHAOptions *options)
 {
 	LHAFileHeader *header;
+	PrintData print;
 	int is_normal_file;
 	char *full_path;
+	int result;
 
 	// As a weird quirk of Unix LHA, lha -pn is equivalent to lha -en:
 
@@ -634,6 +1260,13 @@ int print_archive(LHAFilter *filter, LHAOptions *options)
 		return extract_archive_dry_run(filter, options);
 	}
 
+	if (!init_printing(&print, options->output)) {
+		free_printing(&print);
+		return 0;
+	}
+
+	result = 1;
+
 	for (;;) {
 		header = lha_filter_next_file(filter);
 
@@ -653,24 +1286,28 @@ int print_archive(LHAFilter *filter, LHAOptions *options)
 			full_path = file_full_path(header, options);
 
 			if (header->symlink_target != NULL) {
-				print_symlink_line(full_path,
+				print_symlink_line(options->output, full_path,
 				                   header->symlink_target);
 			} else if (is_normal_file) {
-				printf("::::::::\n");
-				safe_printf("%s", full_path);
-				printf("\n::::::::\n");
+				fprintf(options->output, "::::::::\n");
+				safe_fprintf(options->output, "%s", full_path);
+				fprintf(options->output, "\n::::::::\n");
 			}
 
 			free(full_path);
 		}
 
-		// If this is a normal file, dump the contents to stdout.
+		// If this is a normal file, dump the contents to the output.
 
-		if (is_normal_file && !print_archived_file(filter->reader)) {
-			return 0;
+		if (is_normal_file
+		 && !print_archived_file(filter->reader, &print, options)) {
+			result = 0;
+			break;
 		}
 	}
 
-	return 1;
+	free_printing(&print);
+
+	return result;
 }
 
@@ -23,36 +23,247 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #include "filter.h"
 
+// Filters are compiled when the filter is initialized, so that each
+// path can be checked against a large number of filters quickly:
+//
+//  * Filters without any wildcards are exact paths, which are stored
+//    in a hash table.
+//  * All other filters are stored in a trie, keyed on the literal part
+//    of the filter before the first wildcard. Walking the trie along a
+//    path finds only the filters whose literal part is a prefix of the
+//    path. Filters of the form "prefix*" match any path that reaches
+//    their node; the rest of any other filter is matched as a glob
+//    against the rest of the path.
+
+struct _LHAFilterNode {
+	char c;
+	LHAFilterNode *children;
+	LHAFilterNode *next;
+
+	// Non-zero if a filter of the form "prefix*" ends at this node.
+
+	int match_all;
+
+	// Remaining parts of filters whose literal part ends at this node.
+
+	char **globs;
+	unsigned int num_globs;
+};
+
+// Hash function for paths (FNV-1a).
+
+static unsigned int hash_path(char *path)
+{
+	unsigned int result;
+	unsigned char *p;
+
+	result = 2166136261U;
+
+	for (p = (unsigned char *) path; *p != '\0'; ++p) {
+		result = (result ^ *p) * 16777619U;
+	}
+
+	return result;
+}
+
+// Find the slot in the hash table of exact paths for the specified path:
+// either the slot containing that path, or the empty slot where it
+// should be inserted.
+
+static char **find_exact_slot(LHAFilter *filter, char *path)
+{
+	unsigned int mask, i;
+	char **slot;
+
+	mask = filter->exact_size - 1;
+	i = hash_path(path) & mask;
+
+	for (;;) {
+		slot = &filter->exact[i];
+
+		if (*slot == NULL || !strcmp(*slot, path)) {
+			return slot;
+		}
+
+		i = (i + 1) & mask;
+	}
+}
+
+static void free_node(LHAFilterNode *node)
+{
+	LHAFilterNode *child, *next;
+
+	for (child = node->children; child != NULL; child = next) {
+		next = child->next;
+		free_node(child);
+	}
+
+	free(node->globs);
+	free(node);
+}
+
+// Find the child of a trie node for the specified character, creating
+// it if it does not exist.
+
+static LHAFilterNode *node_child(LHAFilterNode *node, char c, int create)
+{
+	LHAFilterNode *child;
+
+	for (child = node->children; child != NULL; child = child->next) {
+		if (child->c == c) {
+			return child;
+		}
+	}
+
+	if (!create) {
+		return NULL;
+	}
+
+	child = calloc(1, sizeof(LHAFilterNode));
+
+	if (child == NULL) {
+		return NULL;
+	}
+
+	child->c = c;
+	child->next = node->children;
+	node->children = child;
+
+	return child;
+}
+
+// Add a filter containing wildcards to the trie.
+
+static int add_glob(LHAFilter *filter, char *glob)
+{
+	LHAFilterNode *node;
+	char **new_globs;
+
+	node = filter->trie;
+
+	while (*glob != '*' && *glob != '?') {
+		node = node_child(node, *glob, 1);
+
+		if (node == NULL) {
+			return 0;
+		}
+
+		++glob;
+	}
+
+	// The rest of the filter is just '*'s, so anything matches.
+
+	if (glob[strspn(glob, "*")] == '\0') {
+		node->match_all = 1;
+		return 1;
+	}
+
+	new_globs = realloc(node->globs, sizeof(char *) * (node->num_globs + 1));
+
+	if (new_globs == NULL) {
+		return 0;
+	}
+
+	node->globs = new_globs;
+	node->globs[node->num_globs] = glob;
+	++node->num_globs;
+
+	return 1;
+}
+
+static int compile_filters(LHAFilter *filter)
+{
+	unsigned int i;
+	char **slot;
+
+	filter->exact_size = 16;
+
+	while (filter->exact_size < filter->num_filters * 2) {
+		filter->exact_size *= 2;
+	}
+
+	filter->exact = calloc(filter->exact_size, sizeof(char *));
+	filter->trie = calloc(1, sizeof(LHAFilterNode));
+
+	if (filter->exact == NULL || filter->trie == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < filter->num_filters; ++i) {
+		if (strpbrk(filter->filters[i], "*?") == NULL) {
+			slot = find_exact_slot(filter, filter->filters[i]);
+			*slot = filter->filters[i];
+		} else if (!add_glob(filter, filter->filters[i])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void free_compiled(LHAFilter *filter)
+{
+	free(filter->exact);
+	filter->exact = NULL;
+
+	if (filter->trie != NULL) {
+		free_node(filter->trie);
+		filter->trie = NULL;
+	}
+}
+
 void lha_filter_init(LHAFilter *filter, LHAReader *reader,
                      char **filters, unsigned int num_filters)
 {
 	filter->reader = reader;
 	filter->filters = filters;
 	filter->num_filters = num_filters;
+	filter->exact = NULL;
+	filter->trie = NULL;
+	filter->path = NULL;
+	filter->path_size = 0;
+
+	// If the filters can't be compiled, they are each checked in
+	// turn instead.
+
+	if (num_filters > 0 && !compile_filters(filter)) {
+		free_compiled(filter);
+	}
+}
+
+void lha_filter_free(LHAFilter *filter)
+{
+	free_compiled(filter);
+	free(filter->path);
 }
 
 static int match_glob(char *glob, char *str)
 {
-	// Iterate through the string, matching each character against the
-	// equivalent character from the glob.
+	char *star_glob, *star_str;
 
-	while (*str != '\0') {
+	// Iterate through the string, matching each character against the
+	// equivalent character from the glob. When a '*' is reached,
+	// remember where it was; if the match fails later, go back and
+	// let the '*' match one more character. Only the most recent '*'
+	// needs to be retried, which keeps the match quick even for
+	// filters containing many '*'s.
 
-		// When we reach a '*', cut off the remainder of the glob
-		// and shift forward through the string trying to find
-		// a point that matches it.
+	star_glob = NULL;
+	star_str = NULL;
 
+	while (*str != '\0') {
 		if (*glob == '*') {
-			if (match_glob(glob + 1, str)) {
-				return 1;
-			}
-		} else if (*glob == '?' || *glob == *str) {
+			star_glob = ++glob;
+			star_str = str;
+		} else if (*glob != '\0' && (*glob == '?' || *glob == *str)) {
 			++glob;
+			++str;
+		} else if (star_glob != NULL) {
+			glob = star_glob;
+			str = ++star_str;
 		} else {
 			return 0;
 		}
-
-		++str;
 	}
 
 	// We have reached the end of the string to match against.
@@ -69,10 +280,54 @@ static int match_glob(char *glob, char *str)
 	return *glob == '\0';
 }
 
-static int matches_filter(LHAFilter *filter, LHAFileHeader *header)
+// Check a path against the compiled filters.
+
+static int matches_compiled(LHAFilter *filter, char *path)
+{
+	LHAFilterNode *node;
+	unsigned int i;
+	char *p;
+
+	if (*find_exact_slot(filter, path) != NULL) {
+		return 1;
+	}
+
+	// Walk down the trie, checking the filters at each node passed.
+
+	node = filter->trie;
+	p = path;
+
+	for (;;) {
+		if (node->match_all) {
+			return 1;
+		}
+
+		for (i = 0; i < node->num_globs; ++i) {
+			if (match_glob(node->globs[i], p)) {
+				return 1;
+			}
+		}
+
+		if (*p == '\0') {
+			break;
+		}
+
+		node = node_child(node, *p, 0);
+
+		if (node == NULL) {
+			break;
+		}
+
+		++p;
+	}
+
+	return 0;
+}
+
+// Check a full path against the filters.
+
+static int matches_path(LHAFilter *filter, char *path)
 {
-	size_t path_len;
-	char *path;
 	unsigned int i;
 
 	// Special case: no filters means match all.
@@ -81,45 +336,97 @@ static int matches_filter(LHAFilter *filter, LHAFileHeader *header)
 		return 1;
 	}
 
-	path_len = 0;
+	if (filter->trie != NULL) {
+		return matches_compiled(filter, path);
+	}
+
+	for (i = 0; i < filter->num_filters; ++i) {
+		if (match_glob(filter->filters[i], path)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int matches_filter(LHAFilter *filter, LHAFileHeader *header)
+{
+	size_t path_len, dir_len;
+	char *new_path;
+
+	if (filter->num_filters == 0) {
+		return 1;
+	}
+
+	dir_len = 0;
 
 	if (header->path != NULL) {
-		path_len += strlen(header->path);
+		dir_len = strlen(header->path);
 	}
 
+	path_len = dir_len;
+
 	if (header->filename != NULL) {
 		path_len += strlen(header->filename);
 	}
 
-	path = malloc(path_len + 1);
+	// The buffer for the full path is reused for each file.
 
-	if (path == NULL) {
-		// TODO?
-		return 0;
-	}
+	if (path_len + 1 > filter->path_size) {
+		new_path = realloc(filter->path, path_len + 1);
+
+		if (new_path == NULL) {
+			// TODO?
+			return 0;
+		}
 
-	path[0] = '\0';
+		filter->path = new_path;
+		filter->path_size = path_len + 1;
+	}
 
 	if (header->path != NULL) {
-		strcat(path, header->path);
+		memcpy(filter->path, header->path, dir_len);
 	}
 
 	if (header->filename != NULL) {
-		strcat(path, header->filename);
+		strcpy(filter->path + dir_len, header->filename);
+	} else {
+		filter->path[dir_len] = '\0';
 	}
 
-	// Check this path with the list of filters. If one matches,
-	// we must return true.
+	return matches_path(filter, filter->path);
+}
 
-	for (i = 0; i < filter->num_filters; ++i) {
-		if (match_glob(filter->filters[i], path)) {
-			break;
+int lha_filter_select(LHAFilter *filter, LHACatalog *catalog)
+{
+	LHACatalogEntry *entry;
+	unsigned int *entries;
+	unsigned int num_entries, i;
+	int result;
+
+	entries = malloc(sizeof(unsigned int)
+	                 * (lha_catalog_num_entries(catalog) + 1));
+
+	if (entries == NULL) {
+		return 0;
+	}
+
+	num_entries = 0;
+
+	for (i = 0; i < lha_catalog_num_entries(catalog); ++i) {
+		entry = lha_catalog_get(catalog, i);
+
+		if (matches_path(filter, entry->path)) {
+			entries[num_entries] = i;
+			++num_entries;
 		}
 	}
 
-	free(path);
+	result = lha_reader_select(filter->reader, catalog,
+	                           entries, num_entries);
+	free(entries);
 
-	return i < filter->num_filters;
+	return result;
 }
 
 LHAFileHeader *lha_filter_next_file(LHAFilter *filter)
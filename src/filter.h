@@ -24,11 +24,24 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include "lha_reader.h"
 
 typedef struct _LHAFilter LHAFilter;
+typedef struct _LHAFilterNode LHAFilterNode;
 
 struct _LHAFilter {
 	LHAReader *reader;
 	char **filters;
 	unsigned int num_filters;
+
+	// Compiled filters: hash table of exact paths, and a trie of
+	// the other filters (see filter.c).
+
+	char **exact;
+	unsigned int exact_size;
+	LHAFilterNode *trie;
+
+	// Buffer holding the path of the current file.
+
+	char *path;
+	size_t path_size;
 };
 
 /**
@@ -46,6 +59,26 @@ struct _LHAFilter {
 void lha_filter_init(LHAFilter *filter, LHAReader *reader,
                      char **filters, unsigned int num_filters);
 
+/**
+ * Use a catalog of the archive to go straight to the files that match
+ * the filters, without reading the others.
+ *
+ * @param filter       The filter structure.
+ * @param catalog      Catalog of the archive. This must not be freed
+ *                     until the reader has been freed.
+ * @return             Non-zero for success.
+ */
+
+int lha_filter_select(LHAFilter *filter, LHACatalog *catalog);
+
+/**
+ * Free the resources used by a @ref LHAFilter structure.
+ *
+ * @param filter       The filter structure.
+ */
+
+void lha_filter_free(LHAFilter *filter);
+
 /**
  * Read the next file from the input stream.
  *
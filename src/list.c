@@ -19,6 +19,7 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -28,7 +29,6 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
 #include "lha_reader.h"
 #include "list.h"
-#include "safe.h"
 
 typedef struct {
 	unsigned int num_files;
@@ -44,6 +44,112 @@ typedef struct {
 	void (*footer)(FileStatistics *stats);
 } ListColumn;
 
+// List output is formatted into a large buffer, which is written out
+// when it fills up, instead of going through stdio for every column
+// of every row.
+
+#define OUTPUT_BUFFER_LEN 65536
+
+// Space to leave in the buffer for a single call to output_printf().
+// It is only used with formats that produce short output.
+
+#define OUTPUT_PRINTF_MAX 128
+
+// Length of the blocks of time for which local time conversions are
+// cached (see local_time()).
+
+#define TIME_BLOCK_LEN (15 * 60)
+
+static char output_buffer[OUTPUT_BUFFER_LEN];
+static size_t output_len = 0;
+
+// Current time, read once at the start of the listing.
+
+static time_t now_time;
+
+static void output_flush(void)
+{
+	if (output_len > 0) {
+		fwrite(output_buffer, 1, output_len, stdout);
+		output_len = 0;
+	}
+}
+
+static void output_char(char c)
+{
+	if (output_len >= OUTPUT_BUFFER_LEN) {
+		output_flush();
+	}
+
+	output_buffer[output_len] = c;
+	++output_len;
+}
+
+static unsigned int output_string(char *str)
+{
+	size_t len, n, total;
+
+	len = strlen(str);
+	total = len;
+
+	while (len > 0) {
+		if (output_len >= OUTPUT_BUFFER_LEN) {
+			output_flush();
+		}
+
+		n = OUTPUT_BUFFER_LEN - output_len;
+
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(output_buffer + output_len, str, n);
+		output_len += n;
+		str += n;
+		len -= n;
+	}
+
+	return (unsigned int) total;
+}
+
+static unsigned int output_printf(char *format, ...)
+{
+	va_list args;
+	int result;
+
+	if (output_len + OUTPUT_PRINTF_MAX > OUTPUT_BUFFER_LEN) {
+		output_flush();
+	}
+
+	va_start(args, format);
+	result = vsprintf(output_buffer + output_len, format, args);
+	va_end(args);
+
+	if (result < 0) {
+		return 0;
+	}
+
+	output_len += (size_t) result;
+
+	return (unsigned int) result;
+}
+
+// Output a string from an archive, stripping out any potentially
+// malicious characters, in the same way as safe_printf().
+
+static void output_safe(char *str)
+{
+	unsigned char *p;
+
+	for (p = (unsigned char *) str; *p != '\0'; ++p) {
+		if (*p < 0x20 || *p >= 0x7f) {
+			output_char('?');
+		} else {
+			output_char((char) *p);
+		}
+	}
+}
+
 // Display OS type:
 
 static char *os_type_to_string(uint8_t os_type)
@@ -98,18 +204,18 @@ static void unix_permissions_print(LHAFileHeader *header)
 	unsigned int i;
 
 	if (strcmp(header->compress_method, LHA_COMPRESS_TYPE_DIR) != 0) {
-		printf("-");
+		output_char('-');
 	} else if (header->symlink_target != NULL) {
-		printf("l");
+		output_char('l');
 	} else {
-		printf("d");
+		output_char('d');
 	}
 
 	for (i = 0; i < 9; ++i) {
 		if (header->unix_perms & (1U << (8 - i))) {
-			printf("%c", perms[i]);
+			output_char(perms[i]);
 		} else {
-			printf("-");
+			output_char('-');
 		}
 	}
 }
@@ -122,20 +228,20 @@ static void os9_permissions_print(LHAFileHeader *header)
 	unsigned int i;
 
 	if (strcmp(header->compress_method, LHA_COMPRESS_TYPE_DIR) != 0) {
-		printf("-");
+		output_char('-');
 	} else {
-		printf("d");
+		output_char('d');
 	}
 
 	for (i = 0; i < 7; ++i) {
 		if (header->os9_perms & (1U << (6 - i))) {
-			printf("%c", perms[i]);
+			output_char(perms[i]);
 		} else {
-			printf("-");
+			output_char('-');
 		}
 	}
 
-	printf("  ");
+	output_string("  ");
 }
 
 // File permissions
@@ -150,13 +256,13 @@ static void permission_column_print(LHAFileHeader *header)
 	} else if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_PERMS)) {
 		unix_permissions_print(header);
 	} else {
-		printf("%-10s", os_type_to_string(header->os_type));
+		output_printf("%-10s", os_type_to_string(header->os_type));
 	}
 }
 
 static void permission_column_footer(FileStatistics *stats)
 {
-	printf(" Total    ");
+	output_string(" Total    ");
 }
 
 static ListColumn permission_column = {
@@ -170,9 +276,9 @@ static ListColumn permission_column = {
 static void unix_uid_gid_column_print(LHAFileHeader *header)
 {
 	if (LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_UID_GID)) {
-		printf("%5i/%-5i", header->unix_uid, header->unix_gid);
+		output_printf("%5i/%-5i", header->unix_uid, header->unix_gid);
 	} else {
-		printf("           ");
+		output_string("           ");
 	}
 }
 
@@ -182,9 +288,9 @@ static void unix_uid_gid_column_footer(FileStatistics *stats)
 	// listed below it.
 
 	if (stats->num_files == 1) {
-		printf("%5i file ", stats->num_files);
+		output_printf("%5i file ", stats->num_files);
 	} else {
-		printf("%5i files", stats->num_files);
+		output_printf("%5i files", stats->num_files);
 	}
 }
 
@@ -198,12 +304,12 @@ static ListColumn unix_uid_gid_column = {
 
 static void packed_column_print(LHAFileHeader *header)
 {
-	printf("%7lu", (unsigned long) header->compressed_length);
+	output_printf("%7lu", (unsigned long) header->compressed_length);
 }
 
 static void packed_column_footer(FileStatistics *stats)
 {
-	printf("%7lu", (unsigned long) stats->compressed_length);
+	output_printf("%7lu", (unsigned long) stats->compressed_length);
 }
 
 static ListColumn packed_column = {
@@ -216,12 +322,12 @@ static ListColumn packed_column = {
 
 static void size_column_print(LHAFileHeader *header)
 {
-	printf("%7lu", (unsigned long) header->length);
+	output_printf("%7lu", (unsigned long) header->length);
 }
 
 static void size_column_footer(FileStatistics *stats)
 {
-	printf("%7lu", (unsigned long) stats->length);
+	output_printf("%7lu", (unsigned long) stats->length);
 }
 
 static ListColumn size_column = {
@@ -244,20 +350,22 @@ static float compression_percent(size_t compressed, size_t uncompressed)
 static void ratio_column_print(LHAFileHeader *header)
 {
 	if (!strcmp(header->compress_method, "-lhd-")) {
-		printf("******");
+		output_string("******");
 	} else {
-		printf("%5.1f%%", compression_percent(header->compressed_length,
-		                                      header->length));
+		output_printf("%5.1f%%",
+		              compression_percent(header->compressed_length,
+		                                  header->length));
 	}
 }
 
 static void ratio_column_footer(FileStatistics *stats)
 {
 	if (stats->length == 0) {
-		printf("******");
+		output_string("******");
 	} else {
-		printf("%5.1f%%", compression_percent(stats->compressed_length,
-		                                      stats->length));
+		output_printf("%5.1f%%",
+		              compression_percent(stats->compressed_length,
+		                                  stats->length));
 	}
 }
 
@@ -271,7 +379,7 @@ static ListColumn ratio_column = {
 
 static void method_crc_column_print(LHAFileHeader *header)
 {
-	printf("%-5s %04x", header->compress_method, header->crc);
+	output_printf("%-5s %04x", header->compress_method, header->crc);
 }
 
 static ListColumn method_crc_column = {
@@ -302,6 +410,39 @@ static time_t get_now_time(void)
 	return time(NULL);
 }
 
+// Convert a timestamp to local time.
+//
+// Calling localtime() for every file is comparatively expensive, and
+// the files in an archive usually have timestamps close together, so
+// the result for the last 15 minute block of time is kept and reused.
+// Time zone offsets are multiples of 15 minutes, so within a block
+// only the minutes change; the cached result is only used if the
+// block does start on a 15 minute boundary in local time.
+
+static void local_time(unsigned int timestamp, struct tm *result)
+{
+	static time_t cached_block = (time_t) -1;
+	static struct tm cached_tm;
+	struct tm *ts;
+	time_t tmp;
+
+	tmp = (time_t) (timestamp - timestamp % TIME_BLOCK_LEN);
+
+	if (tmp != cached_block) {
+		cached_tm = *localtime(&tmp);
+		cached_block = tmp;
+	}
+
+	if (cached_tm.tm_sec == 0 && (cached_tm.tm_min % 15) == 0) {
+		*result = cached_tm;
+		result->tm_min += (int) ((timestamp % TIME_BLOCK_LEN) / 60);
+	} else {
+		tmp = (time_t) timestamp;
+		ts = localtime(&tmp);
+		*result = *ts;
+	}
+}
+
 // File timestamp
 
 static void output_timestamp(unsigned int timestamp)
@@ -310,30 +451,26 @@ static void output_timestamp(unsigned int timestamp)
 		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
 		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
 	};
-	struct tm *ts;
-	time_t tmp;
+	struct tm ts;
 
 	if (timestamp == 0) {
-		printf("            ");
+		output_string("            ");
 		return;
 	}
 
-	tmp = (time_t) timestamp;
-	ts = localtime(&tmp);
+	local_time(timestamp, &ts);
 
 	// Print date:
 
-	printf("%s %2d ", months[ts->tm_mon], ts->tm_mday);
+	output_printf("%s %2d ", months[ts.tm_mon], ts.tm_mday);
 
 	// If this is an old time (more than 6 months), print the year.
 	// For recent timestamps, print the time.
 
-	tmp = get_now_time();
-
-	if ((time_t) timestamp > tmp - 6 * 30 * 24 * 60 * 60) {
-		printf("%02i:%02i", ts->tm_hour, ts->tm_min);
+	if ((time_t) timestamp > now_time - 6 * 30 * 24 * 60 * 60) {
+		output_printf("%02i:%02i", ts.tm_hour, ts.tm_min);
 	} else {
-		printf(" %04i", ts->tm_year + 1900);
+		output_printf(" %04i", ts.tm_year + 1900);
 	}
 }
 
@@ -358,13 +495,14 @@ static ListColumn timestamp_column = {
 static void name_column_print(LHAFileHeader *header)
 {
 	if (header->path != NULL) {
-		safe_printf("%s", header->path);
+		output_safe(header->path);
 	}
 	if (header->filename != NULL) {
-		safe_printf("%s", header->filename);
+		output_safe(header->filename);
 	}
 	if (header->symlink_target != NULL) {
-		safe_printf(" -> %s", header->symlink_target);
+		output_string(" -> ");
+		output_safe(header->symlink_target);
 	}
 }
 
@@ -384,10 +522,10 @@ static ListColumn short_name_column = {
 static void whole_line_name_column_print(LHAFileHeader *header)
 {
 	if (header->path != NULL) {
-		safe_printf("%s", header->path);
+		output_safe(header->path);
 	}
 	if (header->filename != NULL) {
-		safe_printf("%s", header->filename);
+		output_safe(header->filename);
 	}
 
 	// For wide filename mode (-v), | is used as the symlink separator,
@@ -396,10 +534,11 @@ static void whole_line_name_column_print(LHAFileHeader *header)
 	// does the parsing in normal list mode.
 
 	if (header->symlink_target != NULL) {
-		safe_printf("|%s", header->symlink_target);
+		output_char('|');
+		output_safe(header->symlink_target);
 	}
 
-	printf("\n");
+	output_char('\n');
 }
 
 static ListColumn whole_line_name_column = {
@@ -411,7 +550,7 @@ static ListColumn whole_line_name_column = {
 
 static void header_level_column_print(LHAFileHeader *header)
 {
-	printf(" [%i]", header->header_level);
+	output_printf(" [%i]", header->header_level);
 }
 
 static ListColumn header_level_column = {
@@ -449,16 +588,16 @@ static void print_list_headings(ListColumn **columns)
 	last = last_column(columns);
 
 	for (i = 0; columns[i] != NULL; ++i) {
-		j = (unsigned) printf("%s", columns[i]->name);
+		j = output_string(columns[i]->name);
 
 		if (columns[i]->width > 0 && columns[i] != last) {
 			for (; j < columns[i]->width + 1; ++j) {
-				printf(" ");
+				output_char(' ');
 			}
 		}
 	}
 
-	printf("\n");
+	output_char('\n');
 }
 
 // Print separator lines shown at top and bottom of file list.
@@ -472,15 +611,15 @@ static void print_list_separators(ListColumn **columns)
 
 	for (i = 0; columns[i] != NULL; ++i) {
 		for (j = 0; j < columns[i]->width; ++j) {
-			printf("-");
+			output_char('-');
 		}
 
 		if (columns[i]->width != 0 && columns[i] != last) {
-			printf(" ");
+			output_char(' ');
 		}
 	}
 
-	printf("\n");
+	output_char('\n');
 }
 
 // Print a row in the list corresponding to a file.
@@ -496,11 +635,11 @@ static void print_columns(ListColumn **columns, LHAFileHeader *header)
 		columns[i]->handler(header);
 
 		if (columns[i]->width != 0 && columns[i] != last) {
-			printf(" ");
+			output_char(' ');
 		}
 	}
 
-	printf("\n");
+	output_char('\n');
 }
 
 // Print footer information shown at end of list (overall file stats)
@@ -533,16 +672,227 @@ static void print_footers(ListColumn **columns, FileStatistics *stats)
 			len = strlen(columns[i]->name);
 
 			for (j = 0; j < len; ++j) {
-				printf(" ");
+				output_char(' ');
 			}
 		}
 
 		if (columns[i]->width != 0 && i + 1 < num_columns) {
-			printf(" ");
+			output_char(' ');
+		}
+	}
+
+	output_char('\n');
+}
+
+// Machine-readable list formats. Each file is written as a single
+// record: either a JSON object on a line of its own (JSON Lines), or a
+// line of comma-separated values. Fields that a file does not have are
+// written as null in JSON and left empty in CSV.
+
+static char *record_fields[] = {
+	"name", "symlink", "method", "packed", "size", "crc",
+	"timestamp", "level", "os", "unix_perms", "unix_uid", "unix_gid",
+	"unix_username", "unix_group", "os9_perms", NULL
+};
+
+// Output characters of a JSON string. Control characters and
+// characters outside of ASCII are escaped, so that the output is valid
+// whatever the character encoding used in the archive; bytes above
+// 0x7f are treated as ISO 8859-1.
+
+static void json_output_chars(char *str)
+{
+	static const char hex_digits[] = "0123456789abcdef";
+	unsigned char *p;
+
+	for (p = (unsigned char *) str; *p != '\0'; ++p) {
+		if (*p == '"' || *p == '\\') {
+			output_char('\\');
+			output_char((char) *p);
+		} else if (*p < 0x20 || *p >= 0x7f) {
+			output_string("\\u00");
+			output_char(hex_digits[*p >> 4]);
+			output_char(hex_digits[*p & 0xf]);
+		} else {
+			output_char((char) *p);
 		}
 	}
+}
+
+// Output characters of a (quoted) CSV field. Quotes are doubled.
+// Control characters are replaced, as for the normal list output.
+
+static void csv_output_chars(char *str)
+{
+	unsigned char *p;
+
+	for (p = (unsigned char *) str; *p != '\0'; ++p) {
+		if (*p == '"') {
+			output_string("\"\"");
+		} else if (*p < 0x20 || *p == 0x7f) {
+			output_char('?');
+		} else {
+			output_char((char) *p);
+		}
+	}
+}
+
+// Start the specified field of a record.
+
+static void record_field(LHAListFormat format, unsigned int field)
+{
+	if (format == LHA_LIST_FORMAT_JSON) {
+		output_char(field == 0 ? '{' : ',');
+		output_char('"');
+		output_string(record_fields[field]);
+		output_string("\":");
+	} else if (field > 0) {
+		output_char(',');
+	}
+}
+
+// Output a string field value; the value is the concatenation of the
+// two strings, either of which may be NULL.
+
+static void record_string(LHAListFormat format, char *str1, char *str2)
+{
+	if (str1 == NULL && str2 == NULL) {
+		if (format == LHA_LIST_FORMAT_JSON) {
+			output_string("null");
+		}
+		return;
+	}
+
+	output_char('"');
+
+	if (format == LHA_LIST_FORMAT_JSON) {
+		if (str1 != NULL) {
+			json_output_chars(str1);
+		}
+		if (str2 != NULL) {
+			json_output_chars(str2);
+		}
+	} else {
+		if (str1 != NULL) {
+			csv_output_chars(str1);
+		}
+		if (str2 != NULL) {
+			csv_output_chars(str2);
+		}
+	}
+
+	output_char('"');
+}
+
+// Output a numeric field value, if 'have_value' is non-zero.
+
+static void record_number(LHAListFormat format, int have_value,
+                          unsigned long value)
+{
+	if (have_value) {
+		output_printf("%lu", value);
+	} else if (format == LHA_LIST_FORMAT_JSON) {
+		output_string("null");
+	}
+}
+
+// Print the CSV header line naming the fields.
+
+static void print_record_headings(void)
+{
+	unsigned int i;
 
-	printf("\n");
+	for (i = 0; record_fields[i] != NULL; ++i) {
+		record_field(LHA_LIST_FORMAT_CSV, i);
+		output_string(record_fields[i]);
+	}
+
+	output_char('\n');
+}
+
+// Print the record for a file.
+
+static void print_record(LHAListFormat format, LHAFileHeader *header)
+{
+	char os_name[16];
+	int have_perms, have_ids;
+	size_t len;
+
+	have_perms = LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_PERMS);
+	have_ids = LHA_FILE_HAVE_EXTRA(header, LHA_FILE_UNIX_UID_GID);
+
+	// OS name, without the brackets used in the normal list output.
+
+	strncpy(os_name, os_type_to_string(header->os_type) + 1,
+	        sizeof(os_name) - 1);
+	os_name[sizeof(os_name) - 1] = '\0';
+	len = strlen(os_name);
+
+	if (len > 0) {
+		os_name[len - 1] = '\0';
+	}
+
+	record_field(format, 0);
+	record_string(format, header->path, header->filename);
+	record_field(format, 1);
+	record_string(format, header->symlink_target, NULL);
+	record_field(format, 2);
+	record_string(format, header->compress_method, NULL);
+	record_field(format, 3);
+	record_number(format, 1, (unsigned long) header->compressed_length);
+	record_field(format, 4);
+	record_number(format, 1, (unsigned long) header->length);
+	record_field(format, 5);
+	record_number(format, 1, header->crc);
+	record_field(format, 6);
+	record_number(format, header->timestamp != 0, header->timestamp);
+	record_field(format, 7);
+	record_number(format, 1, header->header_level);
+	record_field(format, 8);
+	record_string(format, os_name, NULL);
+	record_field(format, 9);
+	record_number(format, have_perms, header->unix_perms);
+	record_field(format, 10);
+	record_number(format, have_ids, header->unix_uid);
+	record_field(format, 11);
+	record_number(format, have_ids, header->unix_gid);
+	record_field(format, 12);
+	record_string(format, header->unix_username, NULL);
+	record_field(format, 13);
+	record_string(format, header->unix_group, NULL);
+	record_field(format, 14);
+	record_number(format,
+	              LHA_FILE_HAVE_EXTRA(header, LHA_FILE_OS9_PERMS),
+	              header->os9_perms);
+
+	if (format == LHA_LIST_FORMAT_JSON) {
+		output_char('}');
+	}
+
+	output_char('\n');
+}
+
+// List contents of file as records in a machine-readable format.
+
+static void list_file_records(LHAFilter *filter, LHAOptions *options)
+{
+	LHAFileHeader *header;
+
+	if (options->list_format == LHA_LIST_FORMAT_CSV
+	 && options->quiet < 2) {
+		print_record_headings();
+	}
+
+	for (;;) {
+		header = lha_filter_next_file(filter);
+
+		if (header == NULL) {
+			break;
+		}
+
+		lha_reader_decode_header(filter->reader);
+		print_record(options->list_format, header);
+	}
 }
 
 static unsigned int read_file_timestamp(FILE *fstream)
@@ -564,6 +914,19 @@ static void list_file_contents(LHAFilter *filter, FILE *fstream,
 {
 	FileStatistics stats;
 
+	// Listing reads through every header without keeping any, which is
+	// what the header arena is for. Headers are scanned quickly and
+	// only fully decoded if they match the filter and are listed.
+
+	lha_reader_use_header_arena(filter->reader);
+	lha_reader_set_fast_scan(filter->reader, 1);
+
+	if (options->list_format != LHA_LIST_FORMAT_TABLE) {
+		list_file_records(filter, options);
+		output_flush();
+		return;
+	}
+
 	if (options->quiet < 2) {
 		print_list_headings(columns);
 		print_list_separators(columns);
@@ -573,6 +936,7 @@ static void list_file_contents(LHAFilter *filter, FILE *fstream,
 	stats.length = 0;
 	stats.compressed_length = 0;
 	stats.timestamp = read_file_timestamp(fstream);
+	now_time = get_now_time();
 
 	for (;;) {
 		LHAFileHeader *header;
@@ -583,6 +947,7 @@ static void list_file_contents(LHAFilter *filter, FILE *fstream,
 			break;
 		}
 
+		lha_reader_decode_header(filter->reader);
 		print_columns(columns, header);
 
 		++stats.num_files;
@@ -594,6 +959,8 @@ static void list_file_contents(LHAFilter *filter, FILE *fstream,
 		print_list_separators(columns);
 		print_footers(columns, &stats);
 	}
+
+	output_flush();
 }
 
 // Used for lha -l:
@@ -24,11 +24,23 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <errno.h>
 
 #include "lib/lha_arch.h"
+#include "lib/lha_work_queue.h"
 #include "lha_reader.h"
 
 #include "config.h"
 #include "extract.h"
 #include "list.h"
+#include "safe.h"
+
+// Maximum number of archives waiting to be collected in batch mode,
+// per worker thread.
+
+#define JOBS_PER_WORKER 2
+
+// Size of the buffer used to copy the output of an archive tested on a
+// worker thread.
+
+#define COPY_BUFFER_SIZE (64 * 1024)
 
 typedef enum {
 	MODE_UNKNOWN,
@@ -39,49 +51,121 @@ typedef enum {
 	MODE_PRINT
 } ProgramMode;
 
+// An archive processed in batch mode. Each archive tested on a worker
+// thread has its own copy of the options, so that its output can be
+// written to a temporary file and copied to stdout in order.
+
+typedef struct {
+	ProgramMode mode;
+	char *filename;
+	LHAOptions options;
+	char **filters;
+	unsigned int num_filters;
+	int error;
+	int result;
+} BatchJob;
+
 static void help_page(char *progname)
 {
 	printf(
 	PACKAGE_NAME " v" PACKAGE_VERSION " command line LHA tool  "
 		"- Copyright (C) 2011,2012 Simon Howard\n"
-	"usage: %s [-]{lvtxep[q{num}][finv]}[w=<dir>] archive_file [file...]\n"
+	"usage: %s [-]{lvtxep[q{num}][j{num}][o=<fmt>][d{r|h|c}][bfinsuv]}[w=<dir>] archive_file [file...]\n"
+	"       %s [-]{lvtxep...} @list_file [file...]\n"
 	"commands:                          options:\n"
 	" l,v List / Verbose List            f  Force overwrite (no prompt)\n"
 	" t   Test file CRC in archive       i  Ignore directory path\n"
 	" x,e Extract from archive           n  Perform dry run\n"
 	" p   Print to stdout from archive   q{num}  Quiet mode\n"
 	"                                    v  Verbose\n"
+	"                                    j{num}  Use {num} threads\n"
+	"                                    b  Background reads / writes\n"
+	"                                    u  Write small files with io_uring\n"
+	"                                    s  Write sparse files\n"
+	"                                    d{r|h|c}  Share duplicate files\n"
+	"                                    o=json,o=csv List format\n"
 	"                                    w=<dir> Specify extract directory\n"
-	, progname);
+	"@list_file reads the names of archives from list_file (@- for stdin);\n"
+	"with t, j{num} then tests {num} archives at a time.\n"
+	, progname, progname);
 
 	exit(-1);
 }
 
-static int do_command(ProgramMode mode, char *filename,
-                      LHAOptions *options,
-                      char **filters, unsigned int num_filters)
+// When only some of the files in an archive are wanted, a catalog of
+// the archive is built first, so that the reader can go straight to
+// the files that match the filters. This isn't possible when reading
+// from stdin, and isn't worthwhile when listing the archive. The
+// catalog is also used to find duplicate files when extracting.
+
+static LHACatalog *select_files(ProgramMode mode, char *filename,
+                                LHAFilter *filter, LHAOptions *options)
 {
-	FILE *fstream;
 	LHAInputStream *stream;
-	LHAReader *reader;
-	LHAFilter filter;
-	int result;
+	LHACatalog *catalog;
+	int dedup;
+
+	dedup = mode == MODE_EXTRACT
+	     && options->dedup != LHA_READER_DEDUP_NONE;
+
+	if ((filter->num_filters == 0 && !dedup) || !strcmp(filename, "-")
+	 || (mode != MODE_CRC_CHECK && mode != MODE_EXTRACT
+	  && mode != MODE_PRINT)) {
+		return NULL;
+	}
+
+	stream = lha_input_stream_from(filename);
+
+	if (stream == NULL) {
+		return NULL;
+	}
+
+	catalog = lha_catalog_new(stream);
+
+	if (catalog != NULL && dedup
+	 && !lha_catalog_find_duplicates(catalog, stream)) {
+		lha_catalog_free(catalog);
+		catalog = NULL;
+	}
 
+	lha_input_stream_free(stream);
+
+	if (catalog != NULL && !lha_filter_select(filter, catalog)) {
+		lha_catalog_free(catalog);
+		catalog = NULL;
+	}
+
+	return catalog;
+}
+
+// Open an archive file, or stdin if the filename is "-".
+
+static FILE *open_archive(char *filename)
+{
 	if (!strcmp(filename, "-")) {
-		fstream = stdin;
+		return stdin;
 	} else {
-		fstream = fopen(filename, "rb");
-
-		if (fstream == NULL) {
-			fprintf(stderr, "LHa: Error: %s %s\n",
-			                filename, strerror(errno));
-			exit(-1);
-		}
+		return lha_arch_fopen_read(filename);
 	}
+}
+
+// Run a command on an archive that has been opened. The file is closed
+// afterwards.
+
+static int run_command(ProgramMode mode, char *filename, FILE *fstream,
+                       LHAOptions *options,
+                       char **filters, unsigned int num_filters)
+{
+	LHAInputStream *stream;
+	LHAReader *reader;
+	LHACatalog *catalog;
+	LHAFilter filter;
+	int result;
 
 	stream = lha_input_stream_from_FILE(fstream);
 	reader = lha_reader_new(stream);
 	lha_filter_init(&filter, reader, filters, num_filters);
+	catalog = select_files(mode, filename, &filter, options);
 
 	result = 1;
 
@@ -110,14 +194,349 @@ static int do_command(ProgramMode mode, char *filename,
 			break;
 	}
 
+	lha_filter_free(&filter);
 	lha_reader_free(reader);
 	lha_input_stream_free(stream);
 
+	if (catalog != NULL) {
+		lha_catalog_free(catalog);
+	}
+
 	fclose(fstream);
 
 	return result;
 }
 
+static int do_command(ProgramMode mode, char *filename,
+                      LHAOptions *options,
+                      char **filters, unsigned int num_filters)
+{
+	FILE *fstream;
+
+	fstream = open_archive(filename);
+
+	if (fstream == NULL) {
+		fprintf(stderr, "LHa: Error: %s %s\n",
+		                filename, strerror(errno));
+		exit(-1);
+	}
+
+	return run_command(mode, filename, fstream, options,
+	                   filters, num_filters);
+}
+
+// Read the names of the archives to process in batch mode from a list
+// file, one per line. Blank lines are ignored. Returns a NULL-terminated
+// array of names, or NULL if the file could not be read.
+
+static char **read_archive_list(char *list_filename)
+{
+	FILE *fstream;
+	char **result, **new_result;
+	unsigned int num_archives;
+	char *line, *new_line;
+	size_t line_len, line_size;
+	int c;
+
+	if (!strcmp(list_filename, "-")) {
+		fstream = stdin;
+	} else {
+		fstream = fopen(list_filename, "r");
+
+		if (fstream == NULL) {
+			return NULL;
+		}
+	}
+
+	result = calloc(1, sizeof(char *));
+	num_archives = 0;
+	line = NULL;
+	line_len = 0;
+	line_size = 0;
+
+	while (result != NULL) {
+		c = getc(fstream);
+
+		// Add characters to the line until the end of the line.
+
+		if (c != EOF && c != '\n') {
+			if (line_len + 2 > line_size) {
+				line_size = line_size * 2 + 64;
+				new_line = realloc(line, line_size);
+
+				if (new_line == NULL) {
+					break;
+				}
+
+				line = new_line;
+			}
+
+			line[line_len] = (char) c;
+			++line_len;
+			continue;
+		}
+
+		// Strip the carriage return from DOS line endings.
+
+		if (line_len > 0 && line[line_len - 1] == '\r') {
+			--line_len;
+		}
+
+		if (line_len > 0) {
+			line[line_len] = '\0';
+
+			new_result = realloc(result, (num_archives + 2)
+			                             * sizeof(char *));
+
+			if (new_result == NULL) {
+				break;
+			}
+
+			result = new_result;
+			result[num_archives] = line;
+			result[num_archives + 1] = NULL;
+			++num_archives;
+
+			line = NULL;
+			line_len = 0;
+			line_size = 0;
+		}
+
+		if (c == EOF) {
+			free(line);
+			line = NULL;
+
+			if (ferror(fstream)) {
+				break;
+			}
+
+			if (fstream != stdin) {
+				fclose(fstream);
+			}
+
+			return result;
+		}
+	}
+
+	// Out of memory, or an error reading the file.
+
+	free(line);
+
+	if (result != NULL) {
+		for (num_archives = 0; result[num_archives] != NULL;
+		     ++num_archives) {
+			free(result[num_archives]);
+		}
+
+		free(result);
+	}
+
+	if (fstream != stdin) {
+		fclose(fstream);
+	}
+
+	return NULL;
+}
+
+// Process an archive in batch mode. The archive's output begins with a
+// line naming the archive.
+
+static void run_batch_job(void *data)
+{
+	BatchJob *job = data;
+	FILE *fstream;
+
+	fstream = open_archive(job->filename);
+
+	if (fstream == NULL) {
+		job->error = errno;
+		job->result = 0;
+		return;
+	}
+
+	if (job->options.quiet < 2) {
+		safe_fprintf(job->options.output, "%s:", job->filename);
+		fprintf(job->options.output, "\n");
+	}
+
+	job->result = run_command(job->mode, job->filename, fstream,
+	                          &job->options,
+	                          job->filters, job->num_filters);
+
+	fflush(job->options.output);
+}
+
+// Finish an archive in batch mode: copy its output to stdout if it was
+// written to a temporary file, and report whether it could be opened.
+
+static int finish_batch_job(BatchJob *job)
+{
+	uint8_t *buf;
+	size_t bytes;
+	int result;
+
+	if (job->options.output != stdout) {
+		buf = malloc(COPY_BUFFER_SIZE);
+		rewind(job->options.output);
+
+		while (buf != NULL) {
+			bytes = fread(buf, 1, COPY_BUFFER_SIZE,
+			              job->options.output);
+
+			if (bytes == 0) {
+				break;
+			}
+
+			fwrite(buf, 1, bytes, stdout);
+		}
+
+		fflush(stdout);
+		free(buf);
+		fclose(job->options.output);
+	}
+
+	if (job->error != 0) {
+		fprintf(stderr, "LHa: Error: %s %s\n",
+		                job->filename, strerror(job->error));
+	}
+
+	result = job->result;
+	free(job);
+
+	return result;
+}
+
+// Collect the oldest archive from the worker pool and finish it.
+
+static int collect_batch_job(LHAWorkQueue *queue)
+{
+	return finish_batch_job(lha_work_queue_collect(queue, 1));
+}
+
+// Batch mode: process every archive named in a list file, with the same
+// options and filters. When testing archives, the 'j' option sets the
+// number of archives tested at once, each on its own worker thread;
+// the output of each archive is still printed whole and in the order
+// of the list. Other commands process the archives one at a time, as
+// listing and extracting use state that is shared across the program.
+// Returns non-zero if every archive was processed successfully.
+
+static int do_batch(ProgramMode mode, char *list_filename,
+                    LHAOptions *options,
+                    char **filters, unsigned int num_filters)
+{
+	LHAWorkQueue *queue;
+	BatchJob *job;
+	char **archives;
+	unsigned int num_workers;
+	unsigned int num_failed, num_archives;
+	unsigned int i;
+
+	archives = read_archive_list(list_filename);
+
+	if (archives == NULL) {
+		fprintf(stderr, "LHa: Error: %s %s\n",
+		                list_filename, strerror(errno));
+		exit(-1);
+	}
+
+	queue = NULL;
+	num_workers = options->num_workers;
+
+	if (mode == MODE_CRC_CHECK && num_workers != 1) {
+		if (num_workers == 0) {
+			num_workers = lha_arch_num_cpus();
+		}
+
+		queue = lha_work_queue_new(run_batch_job, num_workers);
+	}
+
+	num_failed = 0;
+
+	for (num_archives = 0; archives[num_archives] != NULL;
+	     ++num_archives) {
+		job = malloc(sizeof(BatchJob));
+
+		if (job == NULL) {
+			exit(-1);
+		}
+
+		job->mode = mode;
+		job->filename = archives[num_archives];
+		job->options = *options;
+		job->filters = filters;
+		job->num_filters = num_filters;
+		job->error = 0;
+		job->result = 1;
+
+		// Archives are run on the worker pool with their output
+		// going to a temporary file; if a temporary file can't
+		// be created, the archive is run here once everything
+		// before it has been printed.
+
+		if (queue != NULL) {
+			job->options.num_workers = 1;
+			job->options.output = tmpfile();
+
+			if (job->options.output != NULL) {
+				while (lha_work_queue_pending(queue)
+				       >= num_workers * JOBS_PER_WORKER) {
+					num_failed += !collect_batch_job(queue);
+				}
+
+				if (!lha_work_queue_add(queue, job, 1)) {
+					exit(-1);
+				}
+
+				continue;
+			}
+
+			job->options.output = stdout;
+
+			while (lha_work_queue_pending(queue) > 0) {
+				num_failed += !collect_batch_job(queue);
+			}
+		}
+
+		run_batch_job(job);
+		num_failed += !finish_batch_job(job);
+	}
+
+	if (queue != NULL) {
+		while (lha_work_queue_pending(queue) > 0) {
+			num_failed += !collect_batch_job(queue);
+		}
+
+		lha_work_queue_free(queue);
+	}
+
+	for (i = 0; i < num_archives; ++i) {
+		free(archives[i]);
+	}
+
+	free(archives);
+
+	if (num_failed > 0) {
+		fprintf(stderr, "LHa: %u of %u archives failed\n",
+		                num_failed, num_archives);
+	}
+
+	return num_failed == 0;
+}
+
+// Run a command on the archive named on the command line, or on all the
+// archives in a list file if the name begins with '@'.
+
+static int do_archive_arg(ProgramMode mode, char *arg, LHAOptions *options,
+                          char **filters, unsigned int num_filters)
+{
+	if (arg[0] == '@' && arg[1] != '\0') {
+		return do_batch(mode, arg + 1, options, filters, num_filters);
+	} else {
+		return do_command(mode, arg, options, filters, num_filters);
+	}
+}
+
 static void init_options(LHAOptions *options)
 {
 	options->overwrite_policy = LHA_OVERWRITE_PROMPT;
@@ -126,6 +545,13 @@ static void init_options(LHAOptions *options)
 	options->dry_run = 0;
 	options->extract_path = NULL;
 	options->use_path = 1;
+	options->num_workers = 1;
+	options->pipeline = 0;
+	options->use_uring = 0;
+	options->sparse = 0;
+	options->dedup = LHA_READER_DEDUP_NONE;
+	options->list_format = LHA_LIST_FORMAT_TABLE;
+	options->output = stdout;
 }
 
 // Determine the program mode from the first character of the command
@@ -185,6 +611,73 @@ static int parse_options(char *arg, LHAOptions *options)
 				options->overwrite_policy = LHA_OVERWRITE_ALL;
 				break;
 
+			// Extract or test files in parallel. The number of
+			// threads can be specified; if it is omitted, one
+			// thread per processor is used.
+			case 'j':
+				options->num_workers = 0;
+				while (arg[1] >= '0' && arg[1] <= '9') {
+					++arg;
+					options->num_workers =
+					    options->num_workers * 10
+					  + (unsigned int) (*arg - '0');
+				}
+				break;
+
+			// Read ahead and write behind on background threads,
+			// and decode large files on two threads.
+			case 'b':
+				options->pipeline = 1;
+				break;
+
+			// Write small files through io_uring.
+			case 'u':
+				options->use_uring = 1;
+				break;
+
+			// Leave blocks of zeroes as holes in extracted files.
+			case 's':
+				options->sparse = 1;
+				break;
+
+			// Make copies of files from the first copy that was
+			// extracted, instead of decompressing them again.
+			// The way to make them can be specified: reflink
+			// (the default, falling back to copying), hard link
+			// or copy.
+			case 'd':
+				if (arg[1] == 'h') {
+					++arg;
+					options->dedup = LHA_READER_DEDUP_HARDLINK;
+				} else if (arg[1] == 'c') {
+					++arg;
+					options->dedup = LHA_READER_DEDUP_COPY;
+				} else {
+					if (arg[1] == 'r') {
+						++arg;
+					}
+					options->dedup = LHA_READER_DEDUP_REFLINK;
+				}
+				break;
+
+			// Machine-readable list output format.
+			// Optional '=' separator.
+			case 'o':
+				++arg;
+				if (*arg == '=') {
+					++arg;
+				}
+				if (!strncmp(arg, "json", 4)) {
+					options->list_format = LHA_LIST_FORMAT_JSON;
+					arg += 3;
+				} else if (!strncmp(arg, "csv", 3)) {
+					options->list_format = LHA_LIST_FORMAT_CSV;
+					arg += 2;
+				} else {
+					return 0;
+				}
+				break;
+
 			// Verbose mode.
 			case 'v':
 				options->verbose = 1;
@@ -263,10 +756,10 @@ int main(int argc, char *argv[])
 	init_options(&options);
 
 	if (argc >= 3 && parse_command_line(argv[1], &mode, &options)) {
-		return !do_command(mode, argv[2], &options,
-		                   argv + 3, argc - 3);
+		return !do_archive_arg(mode, argv[2], &options,
+		                       argv + 3, argc - 3);
 	} else if (argc == 2) {
-		return !do_command(MODE_LIST, argv[1], &options, NULL, 0);
+		return !do_archive_arg(MODE_LIST, argv[1], &options, NULL, 0);
 	} else {
 		help_page(argv[0]);
 		return 0;
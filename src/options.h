@@ -21,12 +21,22 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #ifndef LHASA_OPTIONS_H
 #define LHASA_OPTIONS_H
 
+#include <stdio.h>
+
+#include "lha_reader.h"
+
 typedef enum {
 	LHA_OVERWRITE_PROMPT,
 	LHA_OVERWRITE_SKIP,
 	LHA_OVERWRITE_ALL
 } LHAOverwritePolicy;
 
+typedef enum {
+	LHA_LIST_FORMAT_TABLE,
+	LHA_LIST_FORMAT_JSON,
+	LHA_LIST_FORMAT_CSV
+} LHAListFormat;
+
 // Options structure. Populated from command line arguments.
 
 typedef struct {
@@ -58,6 +68,39 @@ typedef struct {
 
 	int use_path;
 
+	// Number of threads to use to extract or test files in
+	// parallel, or zero to use one thread per processor.
+
+	unsigned int num_workers;
+
+	// If true, read the archive ahead and write extracted files on
+	// background threads, overlapping I/O with decompression.
+
+	int pipeline;
+
+	// If true, write small extracted files through io_uring where
+	// the system supports it.
+
+	int use_uring;
+
+	// If true, leave blocks of zeroes in extracted files as holes.
+
+	int sparse;
+
+	// How to extract files that are copies of other files in the
+	// archive.
+
+	LHAReaderDedupPolicy dedup;
+
+	// Format used when listing the contents of an archive.
+
+	LHAListFormat list_format;
+
+	// Stream to which messages and printed files are written:
+	// normally stdout.
+
+	FILE *output;
+
 } LHAOptions;
 
 #endif /* #ifndef LHASA_OPTIONS_H */
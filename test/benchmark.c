@@ -0,0 +1,546 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+// Benchmark for the decompressors. Every file given on the command line
+// is decompressed a number of times and the speed of each compression
+// method is reported. Archives are decompressed either through the
+// full LHAReader stack (the default), or by reading the whole archive
+// into memory and running the decoders directly over the compressed
+// data (-m). Raw compressed streams from the test/compressed directory
+// are always decoded in memory.
+//
+// For each method, the throughput, the number of CPU cycles per byte
+// of decompressed data (on x86 only) and the number of memory
+// allocations per file (with glibc only) are shown. With -j, the
+// results are printed as JSON instead, so that they can be saved and
+// compared against later runs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "lha_reader.h"
+#include "lha_catalog.h"
+
+#define MAX_METHODS 32
+
+// Raw compressed streams in the test/compressed directory, and the
+// method used to decompress each.
+
+typedef struct {
+	char *filename;
+	char *method;
+	size_t length;
+} CompressedStream;
+
+static const CompressedStream compressed_streams[] = {
+	{ "lh0.bin", "-lh0-", 18092 },
+	{ "lh1.bin", "-lh1-", 18092 },
+	{ "lh5.bin", "-lh5-", 18092 },
+	{ "lh6.bin", "-lh6-", 18092 },
+	{ "lh7.bin", "-lh7-", 18092 },
+	{ "lz5.bin", "-lz5-", 18092 },
+	{ "lzs.bin", "-lzs-", 18092 },
+	{ "pm2.bin", "-pm2-", 18176 },
+};
+
+// Totals for all files decompressed with a particular method.
+
+typedef struct {
+	char method[6];
+	unsigned int files;
+	double bytes;
+	double seconds;
+	double cycles;
+	double allocations;
+} MethodStats;
+
+// A measurement in progress.
+
+typedef struct {
+	double start_time;
+	double start_cycles;
+	unsigned long start_allocations;
+} Measurement;
+
+// State for reading compressed data from memory.
+
+typedef struct {
+	const uint8_t *data;
+	size_t len;
+} MemoryInput;
+
+static MethodStats method_stats[MAX_METHODS];
+static unsigned int num_methods = 0;
+
+static unsigned int iterations = 5;
+static int in_memory = 0;
+static int json_output = 0;
+
+static unsigned long num_allocations = 0;
+
+// Count memory allocations by wrapping the allocation functions:
+// calls from the library resolve to these instead of the functions
+// in the C library.
+
+#if defined(__GLIBC__)
+
+#define HAVE_ALLOCATION_COUNT
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	++num_allocations;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	++num_allocations;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	++num_allocations;
+	return __libc_realloc(ptr, size);
+}
+
+#endif
+
+static double current_time(void)
+{
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#else
+	return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static double current_cycles(void)
+{
+#ifdef HAVE_RDTSC
+	return (double) __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void start_measurement(Measurement *m)
+{
+	m->start_allocations = num_allocations;
+	m->start_cycles = current_cycles();
+	m->start_time = current_time();
+}
+
+// Add a measurement to the totals for the specified method.
+
+static void end_measurement(Measurement *m, char *method, size_t bytes)
+{
+	double end_time, end_cycles;
+	MethodStats *stats;
+	unsigned int i;
+
+	end_time = current_time();
+	end_cycles = current_cycles();
+
+	for (i = 0; i < num_methods; ++i) {
+		if (!strcmp(method_stats[i].method, method)) {
+			break;
+		}
+	}
+
+	if (i >= num_methods) {
+		if (num_methods >= MAX_METHODS) {
+			return;
+		}
+
+		stats = &method_stats[num_methods];
+		++num_methods;
+		memset(stats, 0, sizeof(MethodStats));
+		strncpy(stats->method, method, sizeof(stats->method) - 1);
+	} else {
+		stats = &method_stats[i];
+	}
+
+	++stats->files;
+	stats->bytes += (double) bytes;
+	stats->seconds += end_time - m->start_time;
+	stats->cycles += end_cycles - m->start_cycles;
+	stats->allocations += (double) (num_allocations
+	                                - m->start_allocations);
+}
+
+static uint8_t *read_file(char *filename, size_t *len)
+{
+	FILE *fstream;
+	uint8_t *data;
+	long file_len;
+
+	fstream = fopen(filename, "rb");
+
+	if (fstream == NULL) {
+		return NULL;
+	}
+
+	data = NULL;
+
+	if (fseek(fstream, 0, SEEK_END) == 0
+	 && (file_len = ftell(fstream)) >= 0
+	 && fseek(fstream, 0, SEEK_SET) == 0) {
+		*len = (size_t) file_len;
+		data = malloc(*len > 0 ? *len : 1);
+
+		if (data != NULL && fread(data, 1, *len, fstream) != *len) {
+			free(data);
+			data = NULL;
+		}
+	}
+
+	fclose(fstream);
+
+	return data;
+}
+
+static size_t read_memory(void *buf, size_t buf_len, void *user_data)
+{
+	MemoryInput *input = user_data;
+
+	if (buf_len > input->len) {
+		buf_len = input->len;
+	}
+
+	memcpy(buf, input->data, buf_len);
+	input->data += buf_len;
+	input->len -= buf_len;
+
+	return buf_len;
+}
+
+// Decompress a block of compressed data in memory. Returns zero if the
+// data could not be decompressed.
+
+static int decode_memory(char *method, const uint8_t *data, size_t data_len,
+                         size_t length)
+{
+	LHADecoderType *dtype;
+	LHADecoder *decoder;
+	MemoryInput input;
+	Measurement m;
+	int result;
+
+	dtype = lha_decoder_for_name(method);
+
+	if (dtype == NULL) {
+		return 0;
+	}
+
+	input.data = data;
+	input.len = data_len;
+
+	start_measurement(&m);
+
+	decoder = lha_decoder_new(dtype, read_memory, &input, length);
+
+	if (decoder == NULL) {
+		return 0;
+	}
+
+	result = lha_decoder_decode_to(decoder, NULL, NULL)
+	      && lha_decoder_get_length(decoder) == length;
+
+	lha_decoder_free(decoder);
+
+	if (result) {
+		end_measurement(&m, method, length);
+	}
+
+	return result;
+}
+
+// Decompress a raw stream from test/compressed, if the filename is
+// one that is known.
+
+static int bench_compressed(char *filename)
+{
+	const CompressedStream *stream;
+	uint8_t *data;
+	size_t data_len;
+	char *base;
+	unsigned int i, j;
+
+	base = strrchr(filename, '/');
+	base = base != NULL ? base + 1 : filename;
+
+	for (i = 0; i < sizeof(compressed_streams) / sizeof(*compressed_streams);
+	     ++i) {
+		stream = &compressed_streams[i];
+
+		if (strcmp(base, stream->filename) != 0
+		 || strstr(filename, "compressed/") == NULL) {
+			continue;
+		}
+
+		data = read_file(filename, &data_len);
+
+		if (data == NULL) {
+			return 0;
+		}
+
+		for (j = 0; j < iterations; ++j) {
+			decode_memory(stream->method, data, data_len,
+			              stream->length);
+		}
+
+		free(data);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+// Decompress all files in an archive through the LHAReader.
+
+static void bench_reader(char *filename)
+{
+	LHAInputStream *stream;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	Measurement m;
+	unsigned int i;
+
+	for (i = 0; i < iterations; ++i) {
+		stream = lha_input_stream_from(filename);
+
+		if (stream == NULL) {
+			return;
+		}
+
+		reader = lha_reader_new(stream);
+
+		while (reader != NULL
+		    && (header = lha_reader_next_file(reader)) != NULL) {
+			if (!strcmp(header->compress_method,
+			            LHA_COMPRESS_TYPE_DIR)) {
+				continue;
+			}
+
+			start_measurement(&m);
+
+			if (lha_reader_check(reader, NULL, NULL)) {
+				end_measurement(&m, header->compress_method,
+				                (size_t) header->length);
+			}
+		}
+
+		if (reader != NULL) {
+			lha_reader_free(reader);
+		}
+
+		lha_input_stream_free(stream);
+	}
+}
+
+// Decompress all files in an archive in memory, running the decoders
+// directly over the compressed data.
+
+static void bench_memory(char *filename)
+{
+	LHAInputStream *stream;
+	LHACatalog *catalog;
+	LHACatalogEntry *entry;
+	uint8_t *data;
+	size_t data_len;
+	unsigned int i, j;
+
+	stream = lha_input_stream_from(filename);
+
+	if (stream == NULL) {
+		return;
+	}
+
+	catalog = lha_catalog_new(stream);
+	lha_input_stream_free(stream);
+
+	if (catalog == NULL) {
+		return;
+	}
+
+	data = read_file(filename, &data_len);
+
+	for (i = 0; data != NULL && i < lha_catalog_num_entries(catalog);
+	     ++i) {
+		entry = lha_catalog_get(catalog, i);
+
+		if (!strcmp(entry->header->compress_method,
+		            LHA_COMPRESS_TYPE_DIR)
+		 || entry->data_offset > data_len
+		 || entry->header->compressed_length
+		      > data_len - entry->data_offset) {
+			continue;
+		}
+
+		for (j = 0; j < iterations; ++j) {
+			decode_memory(entry->header->compress_method,
+			              data + entry->data_offset,
+			              (size_t) entry->header->compressed_length,
+			              (size_t) entry->header->length);
+		}
+	}
+
+	free(data);
+	lha_catalog_free(catalog);
+}
+
+static int compare_stats(const void *a, const void *b)
+{
+	const MethodStats *sa = a, *sb = b;
+
+	return strcmp(sa->method, sb->method);
+}
+
+static void print_results(void)
+{
+	MethodStats *stats;
+	double mb_per_sec;
+	unsigned int i;
+
+	qsort(method_stats, num_methods, sizeof(MethodStats), compare_stats);
+
+	if (json_output) {
+		printf("[\n");
+	} else {
+		printf("method  files        bytes       MB/s  "
+		       "cycles/byte  allocs/file\n");
+	}
+
+	for (i = 0; i < num_methods; ++i) {
+		stats = &method_stats[i];
+		mb_per_sec = stats->seconds > 0
+		           ? stats->bytes / stats->seconds / 1e6 : 0;
+
+		if (json_output) {
+			printf("  {\"method\": \"%s\", \"mode\": \"%s\", "
+			       "\"files\": %u, \"bytes\": %.0f, "
+			       "\"mb_per_sec\": %.2f, ",
+			       stats->method, in_memory ? "memory" : "reader",
+			       stats->files / iterations,
+			       stats->bytes / iterations, mb_per_sec);
+#ifdef HAVE_RDTSC
+			printf("\"cycles_per_byte\": %.2f, ",
+			       stats->bytes > 0
+			     ? stats->cycles / stats->bytes : 0);
+#else
+			printf("\"cycles_per_byte\": null, ");
+#endif
+#ifdef HAVE_ALLOCATION_COUNT
+			printf("\"allocs_per_file\": %.2f}",
+			       stats->allocations / stats->files);
+#else
+			printf("\"allocs_per_file\": null}");
+#endif
+			printf(i + 1 < num_methods ? ",\n" : "\n");
+		} else {
+			printf("%-6s %6u %12.0f %10.2f ",
+			       stats->method, stats->files / iterations,
+			       stats->bytes / iterations, mb_per_sec);
+#ifdef HAVE_RDTSC
+			printf("%12.2f ", stats->bytes > 0
+			                ? stats->cycles / stats->bytes : 0);
+#else
+			printf("%12s ", "-");
+#endif
+#ifdef HAVE_ALLOCATION_COUNT
+			printf("%12.2f\n", stats->allocations / stats->files);
+#else
+			printf("%12s\n", "-");
+#endif
+		}
+	}
+
+	if (json_output) {
+		printf("]\n");
+	}
+}
+
+static void usage(char *progname)
+{
+	printf("Usage: %s [-m] [-j] [-n iterations] file...\n"
+	       "  -m    Decompress archives in memory, without the reader\n"
+	       "  -j    Print the results as JSON\n"
+	       "  -n    Number of times to decompress each file\n",
+	       progname);
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+		if (!strcmp(argv[i], "-m")) {
+			in_memory = 1;
+		} else if (!strcmp(argv[i], "-j")) {
+			json_output = 1;
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			++i;
+			iterations = (unsigned int) atoi(argv[i]);
+		} else {
+			usage(argv[0]);
+		}
+	}
+
+	if (i >= argc || iterations == 0) {
+		usage(argv[0]);
+	}
+
+	for (; i < argc; ++i) {
+		if (bench_compressed(argv[i])) {
+			continue;
+		}
+
+		if (in_memory) {
+			bench_memory(argv[i]);
+		} else {
+			bench_reader(argv[i]);
+		}
+	}
+
+	print_results();
+
+	return 0;
+}
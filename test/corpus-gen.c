@@ -0,0 +1,1273 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+// Generator for large synthetic archives, for use with the benchmark.
+//
+// The test archives are all small, and are too short to give stable
+// timings for most of the decoders. This generates archives of any size
+// from a seed, so that the same archive can be regenerated whenever it
+// is needed rather than stored. Unlike ghost-tester, which feeds random
+// data to the decoders, the data is produced as a random sequence of
+// literal and copy commands, which are then encoded in the format of
+// the chosen compression method. The proportion of copies, the range of
+// literal values and the copy lengths can be controlled, to give data
+// that exercises different paths in the decoders.
+//
+// The encoders make no attempt to find matches in the data; they only
+// encode the commands that were generated. Only the methods that have
+// a simple encoding are supported: the PMarc methods are not.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "lib/crc16.h"
+
+// The -lh1- encoder works by mirroring the decoder's adaptive tree, so
+// the tree code is borrowed from the decoder. The decoder type is
+// renamed so that it does not clash with the one in the library. The
+// decoder state is not part of an LHADecoder here, so statistics can't
+// be collected.
+
+#undef LHA_DECODER_STATS
+#define lha_lh1_decoder corpus_lh1_decoder
+#include "lib/lh1_decoder.c"
+
+// Size of the history buffer holding generated data; this must be at
+// least as large as the largest window of any method.
+
+#define HISTORY_SIZE        (1 << 20)
+
+// Size of the chunks in which uncompressed data is processed.
+
+#define DATA_CHUNK_SIZE     4096
+
+// Number of commands in a block for the -lh?- methods.
+
+#define BLOCK_COMMANDS      16384
+
+// Code table sizes for the -lh?- methods.
+
+#define NEW_NUM_CODES       510
+#define NEW_NUM_TEMP_CODES  19
+#define NEW_MAX_OFFSET_CODES 20
+#define NEW_MAX_CODE_LEN    16
+
+// Timestamp written to all headers (2020-01-01 00:00:00, DOS format),
+// so that generated archives are identical from run to run.
+
+#define ARCHIVE_TIMESTAMP   0x50210000
+
+// Length of a level 0 header, not including the filename.
+
+#define HEADER_LEN          24
+
+typedef struct _Encoder Encoder;
+
+typedef struct {
+	char *name;
+
+	// Largest copy distance supported, and the range of copy lengths.
+	// A distance of zero means that the method stores data without
+	// compression, so the command stream does not need encoding.
+
+	unsigned int max_distance;
+	unsigned int min_copy, max_copy;
+
+	// Extra parameters for the -lh?- methods: the number of bits used
+	// for the size of the offset table, and the number of offset codes.
+
+	unsigned int offset_bits;
+	unsigned int offset_codes;
+
+	int (*init)(Encoder *encoder);
+	void (*literal)(Encoder *encoder, uint8_t b);
+	void (*copy)(Encoder *encoder, unsigned int len,
+	             unsigned int distance);
+	void (*finish)(Encoder *encoder);
+} Method;
+
+struct _Encoder {
+	const Method *method;
+
+	// Output file, and the pending bits for bitstream methods.
+
+	FILE *stream;
+	uint32_t bit_buffer;
+	unsigned int bits;
+
+	// Number of bytes of uncompressed data encoded so far.
+
+	uint64_t position;
+
+	// -lz5-: flag byte and commands for the current group of eight.
+
+	uint8_t group[17];
+	unsigned int group_len;
+	unsigned int group_commands;
+
+	// -lh1-: decoder state, used to track the adaptive tree.
+
+	LHALH1Decoder *lh1;
+
+	// -lh?-: buffered commands for the current block.
+
+	uint16_t *codes;
+	uint32_t *offsets;
+	unsigned int num_commands;
+	unsigned int num_offsets;
+};
+
+// Options controlling the generated data.
+
+typedef struct {
+	uint64_t seed;
+	unsigned int members;
+	uint64_t length;
+	unsigned int copy_percent;
+	unsigned int alphabet;
+	unsigned int max_copy;
+} Options;
+
+// State of the data generator.
+
+typedef struct {
+	uint64_t rng;
+	uint8_t *history;
+	uint64_t position;
+	uint8_t chunk[DATA_CHUNK_SIZE];
+	unsigned int chunk_len;
+	uint16_t crc;
+	FILE *stored;
+} Generator;
+
+// Random number generator (xorshift64*). This is used rather than the
+// C library's rand() so that the same seed gives the same archive on
+// every system.
+
+static uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * UINT64_C(2685821657736338717);
+}
+
+// Random number in the range 0..n-1.
+
+static unsigned int random_below(Generator *gen, uint64_t n)
+{
+	return (unsigned int) ((next_random(&gen->rng) >> 16) % n);
+}
+
+static void write_bits(Encoder *encoder, unsigned int value,
+                       unsigned int bits)
+{
+	while (bits > 0) {
+		unsigned int n = bits > 16 ? 16 : bits;
+
+		bits -= n;
+		encoder->bit_buffer = (encoder->bit_buffer << n)
+		                    | ((value >> bits) & ((1U << n) - 1));
+		encoder->bits += n;
+
+		while (encoder->bits >= 8) {
+			encoder->bits -= 8;
+			fputc((int) (encoder->bit_buffer >> encoder->bits) & 0xff,
+			      encoder->stream);
+		}
+	}
+}
+
+static void flush_bits(Encoder *encoder)
+{
+	if (encoder->bits > 0) {
+		write_bits(encoder, 0, 8 - encoder->bits);
+	}
+}
+
+//
+// Stored data (-lh0-, -lz4-, -pm0-): the generator writes the data
+// itself, so there is nothing to encode.
+//
+
+static int stored_init(Encoder *encoder)
+{
+	return 1;
+}
+
+static void stored_literal(Encoder *encoder, uint8_t b)
+{
+}
+
+static void stored_copy(Encoder *encoder, unsigned int len,
+                        unsigned int distance)
+{
+}
+
+static void stored_finish(Encoder *encoder)
+{
+}
+
+//
+// -lz5-: groups of eight commands, each preceded by a byte of flags
+// indicating which commands are literals. Copies give an absolute
+// position in the 4 KiB ring buffer, which starts 18 bytes from its end.
+//
+
+static int lz5_init(Encoder *encoder)
+{
+	encoder->group_len = 1;
+	encoder->group_commands = 0;
+	encoder->group[0] = 0;
+
+	return 1;
+}
+
+static void lz5_flush_group(Encoder *encoder)
+{
+	if (encoder->group_commands > 0) {
+		fwrite(encoder->group, 1, encoder->group_len, encoder->stream);
+	}
+
+	lz5_init(encoder);
+}
+
+static void lz5_literal(Encoder *encoder, uint8_t b)
+{
+	encoder->group[0] |= (uint8_t) (1 << encoder->group_commands);
+	encoder->group[encoder->group_len++] = b;
+	++encoder->position;
+
+	if (++encoder->group_commands == 8) {
+		lz5_flush_group(encoder);
+	}
+}
+
+static void lz5_copy(Encoder *encoder, unsigned int len,
+                     unsigned int distance)
+{
+	unsigned int pos;
+
+	pos = (unsigned int) (encoder->position + 4096 - 18 - distance) & 0xfff;
+
+	encoder->group[encoder->group_len++] = (uint8_t) (pos & 0xff);
+	encoder->group[encoder->group_len++] =
+	    (uint8_t) (((pos >> 4) & 0xf0) | (len - 3));
+	encoder->position += len;
+
+	if (++encoder->group_commands == 8) {
+		lz5_flush_group(encoder);
+	}
+}
+
+static void lz5_finish(Encoder *encoder)
+{
+	lz5_flush_group(encoder);
+}
+
+//
+// -lzs-: a bitstream of commands, with a flag bit before each. Copies
+// give an absolute position in the 2 KiB ring buffer, which starts 17
+// bytes from its end.
+//
+
+static int bitstream_init(Encoder *encoder)
+{
+	encoder->bit_buffer = 0;
+	encoder->bits = 0;
+
+	return 1;
+}
+
+static void lzs_literal(Encoder *encoder, uint8_t b)
+{
+	write_bits(encoder, 1, 1);
+	write_bits(encoder, b, 8);
+	++encoder->position;
+}
+
+static void lzs_copy(Encoder *encoder, unsigned int len,
+                     unsigned int distance)
+{
+	unsigned int pos;
+
+	pos = (unsigned int) (encoder->position + 2048 - 17 - distance) & 0x7ff;
+
+	write_bits(encoder, 0, 1);
+	write_bits(encoder, pos, 11);
+	write_bits(encoder, len - 2, 4);
+	encoder->position += len;
+}
+
+static void bitstream_finish(Encoder *encoder)
+{
+	flush_bits(encoder);
+}
+
+//
+// -lh1-: adaptive Huffman coding of literals and copy lengths, followed
+// by a copy offset whose top six bits use a fixed code. The code for a
+// symbol is found by walking up the tree from its leaf, and the tree is
+// then updated in the same way as the decoder updates its own.
+//
+
+static uint8_t lh1_offset_codes[NUM_OFFSETS];
+
+static int lh1_init(Encoder *encoder)
+{
+	unsigned int i;
+
+	encoder->lh1 = malloc(sizeof(LHALH1Decoder));
+
+	if (encoder->lh1 == NULL) {
+		return 0;
+	}
+
+	init_groups(encoder->lh1);
+	init_tree(encoder->lh1);
+	init_offset_table(encoder->lh1);
+
+	// The codes for the offsets are the first entries in the lookup
+	// table that decode to each offset.
+
+	for (i = 256; i > 0; --i) {
+		lh1_offset_codes[encoder->lh1->offset_lookup[i - 1]] =
+		    (uint8_t) (i - 1);
+	}
+
+	return bitstream_init(encoder);
+}
+
+static void lh1_write_code(Encoder *encoder, uint16_t code)
+{
+	LHALH1Decoder *lh1 = encoder->lh1;
+	uint8_t path[NUM_TREE_NODES];
+	unsigned int node, parent, depth;
+
+	depth = 0;
+	node = lh1->leaf_nodes[code];
+
+	while (node != 0) {
+		parent = lh1->parent[node];
+		path[depth] = (uint8_t) (lh1->child[parent] - node);
+		++depth;
+		node = parent;
+	}
+
+	while (depth > 0) {
+		--depth;
+		write_bits(encoder, path[depth], 1);
+	}
+
+	increment_for_code(lh1, code);
+}
+
+static void lh1_literal(Encoder *encoder, uint8_t b)
+{
+	lh1_write_code(encoder, b);
+	++encoder->position;
+}
+
+static void lh1_copy(Encoder *encoder, unsigned int len,
+                     unsigned int distance)
+{
+	unsigned int offset, top;
+
+	lh1_write_code(encoder, (uint16_t) (0x100 + len - COPY_THRESHOLD));
+
+	offset = distance - 1;
+	top = offset >> 6;
+	write_bits(encoder,
+	           lh1_offset_codes[top] >> (8 - encoder->lh1->offset_lengths[top]),
+	           encoder->lh1->offset_lengths[top]);
+	write_bits(encoder, offset & 0x3f, 6);
+	encoder->position += len;
+}
+
+static void lh1_finish(Encoder *encoder)
+{
+	flush_bits(encoder);
+	free(encoder->lh1);
+}
+
+//
+// -lh4- to -lh7- and -lhx-: blocks of commands, each with its own set of
+// Huffman tables, written in the same way as LHA itself writes them.
+//
+
+typedef struct {
+	unsigned int symbol;
+	unsigned int freq;
+} SymbolFreq;
+
+static int compare_freqs(const void *a, const void *b)
+{
+	const SymbolFreq *fa = a, *fb = b;
+
+	if (fa->freq != fb->freq) {
+		return fa->freq < fb->freq ? -1 : 1;
+	}
+
+	return fa->symbol < fb->symbol ? -1 : 1;
+}
+
+// Calculate Huffman code lengths for the given frequencies, limited to
+// NEW_MAX_CODE_LEN bits. Returns the number of symbols that are used;
+// if this is less than two, no lengths are set.
+
+static unsigned int make_lengths(const unsigned int *freqs, unsigned int n,
+                                 uint8_t *lengths)
+{
+	SymbolFreq leaves[NEW_NUM_CODES];
+	unsigned int weights[NEW_NUM_CODES * 2];
+	unsigned int parents[NEW_NUM_CODES * 2];
+	unsigned int depths[NEW_NUM_CODES * 2];
+	unsigned int len_count[NEW_MAX_CODE_LEN + 1];
+	unsigned int num_leaves, num_nodes, next_leaf, next_node;
+	unsigned int i, j, k, pick, cum;
+
+	memset(lengths, 0, n);
+	num_leaves = 0;
+
+	for (i = 0; i < n; ++i) {
+		if (freqs[i] > 0) {
+			leaves[num_leaves].symbol = i;
+			leaves[num_leaves].freq = freqs[i];
+			++num_leaves;
+		}
+	}
+
+	if (num_leaves < 2) {
+		return num_leaves;
+	}
+
+	qsort(leaves, num_leaves, sizeof(SymbolFreq), compare_freqs);
+
+	// Build the tree with the two-queue method: leaves are taken in
+	// sorted order, and new nodes are created in increasing weight.
+	// Nodes 0..num_leaves-1 are the leaves.
+
+	for (i = 0; i < num_leaves; ++i) {
+		weights[i] = leaves[i].freq;
+	}
+
+	num_nodes = num_leaves;
+	next_leaf = 0;
+	next_node = num_leaves;
+
+	while (num_nodes < num_leaves * 2 - 1) {
+		weights[num_nodes] = 0;
+
+		for (j = 0; j < 2; ++j) {
+			if (next_leaf < num_leaves
+			 && (next_node >= num_nodes
+			  || weights[next_leaf] <= weights[next_node])) {
+				pick = next_leaf++;
+			} else {
+				pick = next_node++;
+			}
+
+			parents[pick] = num_nodes;
+			weights[num_nodes] += weights[pick];
+		}
+
+		++num_nodes;
+	}
+
+	depths[num_nodes - 1] = 0;
+
+	for (i = num_nodes - 1; i > 0; --i) {
+		depths[i - 1] = depths[parents[i - 1]] + 1;
+	}
+
+	// Count the codes of each length, and if any are too long, adjust
+	// the counts until the code is complete again.
+
+	memset(len_count, 0, sizeof(len_count));
+
+	for (i = 0; i < num_leaves; ++i) {
+		k = depths[i];
+		++len_count[k > NEW_MAX_CODE_LEN ? NEW_MAX_CODE_LEN : k];
+	}
+
+	cum = 0;
+
+	for (i = 1; i <= NEW_MAX_CODE_LEN; ++i) {
+		cum += len_count[i] << (NEW_MAX_CODE_LEN - i);
+	}
+
+	while (cum != (1U << NEW_MAX_CODE_LEN)) {
+		--len_count[NEW_MAX_CODE_LEN];
+
+		for (i = NEW_MAX_CODE_LEN - 1; i > 0; --i) {
+			if (len_count[i] != 0) {
+				--len_count[i];
+				len_count[i + 1] += 2;
+				break;
+			}
+		}
+
+		--cum;
+	}
+
+	// The least frequent symbols get the longest codes.
+
+	k = 0;
+
+	for (i = NEW_MAX_CODE_LEN; i > 0; --i) {
+		for (j = 0; j < len_count[i]; ++j) {
+			lengths[leaves[k].symbol] = (uint8_t) i;
+			++k;
+		}
+	}
+
+	return num_leaves;
+}
+
+// Assign canonical codes for the given lengths: shorter codes come
+// first, and codes of the same length are in symbol order. This is the
+// order in which the decoder builds its trees.
+
+static void make_codes(const uint8_t *lengths, unsigned int n,
+                       uint16_t *codes)
+{
+	unsigned int len, i, code;
+
+	code = 0;
+
+	for (len = 1; len <= NEW_MAX_CODE_LEN; ++len) {
+		for (i = 0; i < n; ++i) {
+			if (lengths[i] == len) {
+				codes[i] = (uint16_t) code;
+				++code;
+			}
+		}
+
+		code <<= 1;
+	}
+}
+
+static unsigned int last_used(const uint8_t *lengths, unsigned int n)
+{
+	while (n > 0 && lengths[n - 1] == 0) {
+		--n;
+	}
+
+	return n;
+}
+
+static unsigned int first_used(const unsigned int *freqs)
+{
+	unsigned int i;
+
+	for (i = 0; freqs[i] == 0; ++i);
+
+	return i;
+}
+
+static void write_length_value(Encoder *encoder, unsigned int len)
+{
+	if (len < 7) {
+		write_bits(encoder, len, 3);
+	} else {
+		write_bits(encoder, 7, 3);
+
+		for (; len > 7; --len) {
+			write_bits(encoder, 1, 1);
+		}
+
+		write_bits(encoder, 0, 1);
+	}
+}
+
+// Go through the code table lengths in the form in which they are
+// written, calling the callback for each temp code and its extra bits.
+
+static void code_table_codes(const uint8_t *lengths, unsigned int n,
+                             void (*callback)(void *data, unsigned int code,
+                                              unsigned int extra,
+                                              unsigned int extra_bits),
+                             void *data)
+{
+	unsigned int i, run;
+
+	i = 0;
+
+	while (i < n) {
+		if (lengths[i] != 0) {
+			callback(data, lengths[i] + 2U, 0, 0);
+			++i;
+			continue;
+		}
+
+		for (run = 0; i < n && lengths[i] == 0; ++i) {
+			++run;
+		}
+
+		if (run <= 2) {
+			for (; run > 0; --run) {
+				callback(data, 0, 0, 0);
+			}
+		} else if (run <= 18) {
+			callback(data, 1, run - 3, 4);
+		} else if (run == 19) {
+			callback(data, 0, 0, 0);
+			callback(data, 1, 15, 4);
+		} else {
+			callback(data, 2, run - 20, 9);
+		}
+	}
+}
+
+static void count_temp_code(void *data, unsigned int code,
+                            unsigned int extra, unsigned int extra_bits)
+{
+	unsigned int *freqs = data;
+
+	++freqs[code];
+}
+
+typedef struct {
+	Encoder *encoder;
+	uint8_t *lengths;
+	uint16_t *codes;
+} TempTable;
+
+static void write_temp_code(void *data, unsigned int code,
+                            unsigned int extra, unsigned int extra_bits)
+{
+	TempTable *table = data;
+
+	write_bits(table->encoder, table->codes[code], table->lengths[code]);
+	write_bits(table->encoder, extra, extra_bits);
+}
+
+static void write_temp_table(Encoder *encoder, const uint8_t *lengths,
+                             unsigned int n)
+{
+	unsigned int i, skip;
+
+	write_bits(encoder, n, 5);
+
+	for (i = 0; i < n; ++i) {
+		write_length_value(encoder, lengths[i]);
+
+		// After the third length, a 2-bit count of following
+		// zero lengths.
+
+		if (i == 2) {
+			for (skip = 0; skip < 3 && i + 1 < n
+			            && lengths[i + 1] == 0; ++skip) {
+				++i;
+			}
+
+			write_bits(encoder, skip, 2);
+		}
+	}
+}
+
+static void new_write_block(Encoder *encoder)
+{
+	const Method *method = encoder->method;
+	unsigned int code_freqs[NEW_NUM_CODES];
+	unsigned int temp_freqs[NEW_NUM_TEMP_CODES];
+	unsigned int offset_freqs[NEW_MAX_OFFSET_CODES];
+	uint8_t code_lengths[NEW_NUM_CODES];
+	uint8_t temp_lengths[NEW_NUM_TEMP_CODES];
+	uint8_t offset_lengths[NEW_MAX_OFFSET_CODES];
+	uint16_t code_codes[NEW_NUM_CODES];
+	uint16_t temp_codes[NEW_NUM_TEMP_CODES];
+	uint16_t offset_codes[NEW_MAX_OFFSET_CODES];
+	uint8_t offset_bits[BLOCK_COMMANDS];
+	unsigned int i, j, n, bits;
+	uint32_t offset;
+	TempTable table;
+
+	if (encoder->num_commands == 0) {
+		return;
+	}
+
+	memset(code_freqs, 0, sizeof(code_freqs));
+	memset(temp_freqs, 0, sizeof(temp_freqs));
+	memset(offset_freqs, 0, sizeof(offset_freqs));
+
+	for (i = 0; i < encoder->num_commands; ++i) {
+		++code_freqs[encoder->codes[i]];
+	}
+
+	// Offsets are coded as their length in bits, followed by all but
+	// the top bit.
+
+	for (i = 0; i < encoder->num_offsets; ++i) {
+		for (bits = 0, offset = encoder->offsets[i]; offset != 0;
+		     offset >>= 1) {
+			++bits;
+		}
+
+		offset_bits[i] = (uint8_t) bits;
+		++offset_freqs[bits];
+	}
+
+	write_bits(encoder, encoder->num_commands, 16);
+
+	// Code table, preceded by the temp table used to encode it. When
+	// only one code is used, both are written as a single code.
+
+	if (make_lengths(code_freqs, NEW_NUM_CODES, code_lengths) < 2) {
+		write_bits(encoder, 0, 5);
+		write_bits(encoder, 0, 5);
+		write_bits(encoder, 0, 9);
+		write_bits(encoder, first_used(code_freqs), 9);
+	} else {
+		n = last_used(code_lengths, NEW_NUM_CODES);
+		make_codes(code_lengths, NEW_NUM_CODES, code_codes);
+		code_table_codes(code_lengths, n, count_temp_code, temp_freqs);
+
+		if (make_lengths(temp_freqs, NEW_NUM_TEMP_CODES,
+		                 temp_lengths) < 2) {
+			write_bits(encoder, 0, 5);
+			write_bits(encoder, first_used(temp_freqs), 5);
+			memset(temp_lengths, 0, sizeof(temp_lengths));
+			memset(temp_codes, 0, sizeof(temp_codes));
+		} else {
+			write_temp_table(encoder, temp_lengths,
+			                 last_used(temp_lengths,
+			                           NEW_NUM_TEMP_CODES));
+			make_codes(temp_lengths, NEW_NUM_TEMP_CODES,
+			           temp_codes);
+		}
+
+		write_bits(encoder, n, 9);
+		table.encoder = encoder;
+		table.lengths = temp_lengths;
+		table.codes = temp_codes;
+		code_table_codes(code_lengths, n, write_temp_code, &table);
+	}
+
+	// Offset table.
+
+	if (make_lengths(offset_freqs, method->offset_codes,
+	                 offset_lengths) < 2) {
+		write_bits(encoder, 0, method->offset_bits);
+		write_bits(encoder, encoder->num_offsets == 0 ? 0
+		                  : first_used(offset_freqs),
+		           method->offset_bits);
+	} else {
+		n = last_used(offset_lengths, method->offset_codes);
+		write_bits(encoder, n, method->offset_bits);
+
+		for (i = 0; i < n; ++i) {
+			write_length_value(encoder, offset_lengths[i]);
+		}
+
+		make_codes(offset_lengths, method->offset_codes, offset_codes);
+	}
+
+	// The commands themselves.
+
+	for (i = 0, j = 0; i < encoder->num_commands; ++i) {
+		write_bits(encoder, code_codes[encoder->codes[i]],
+		           code_lengths[encoder->codes[i]]);
+
+		if (encoder->codes[i] < 256) {
+			continue;
+		}
+
+		bits = offset_bits[j];
+		write_bits(encoder, offset_codes[bits], offset_lengths[bits]);
+
+		if (bits > 1) {
+			write_bits(encoder, encoder->offsets[j], bits - 1);
+		}
+
+		++j;
+	}
+
+	encoder->num_commands = 0;
+	encoder->num_offsets = 0;
+}
+
+static int new_init(Encoder *encoder)
+{
+	encoder->codes = malloc(BLOCK_COMMANDS * sizeof(uint16_t));
+	encoder->offsets = malloc(BLOCK_COMMANDS * sizeof(uint32_t));
+
+	if (encoder->codes == NULL || encoder->offsets == NULL) {
+		free(encoder->codes);
+		free(encoder->offsets);
+		return 0;
+	}
+
+	encoder->num_commands = 0;
+	encoder->num_offsets = 0;
+
+	return bitstream_init(encoder);
+}
+
+static void new_literal(Encoder *encoder, uint8_t b)
+{
+	encoder->codes[encoder->num_commands++] = b;
+
+	if (encoder->num_commands == BLOCK_COMMANDS) {
+		new_write_block(encoder);
+	}
+}
+
+static void new_copy(Encoder *encoder, unsigned int len,
+                     unsigned int distance)
+{
+	encoder->codes[encoder->num_commands++] =
+	    (uint16_t) (256 + len - COPY_THRESHOLD);
+	encoder->offsets[encoder->num_offsets++] = distance - 1;
+
+	if (encoder->num_commands == BLOCK_COMMANDS) {
+		new_write_block(encoder);
+	}
+}
+
+static void new_finish(Encoder *encoder)
+{
+	new_write_block(encoder);
+	flush_bits(encoder);
+	free(encoder->codes);
+	free(encoder->offsets);
+}
+
+#define STORED_METHOD(name) \
+	{ name, 0, 3, 256, 0, 0, \
+	  stored_init, stored_literal, stored_copy, stored_finish }
+
+#define NEW_METHOD(name, history_bits, offset_bits) \
+	{ name, 1 << (history_bits - 1), 3, 256, offset_bits, history_bits, \
+	  new_init, new_literal, new_copy, new_finish }
+
+static const Method methods[] = {
+	STORED_METHOD("-lh0-"),
+	STORED_METHOD("-lz4-"),
+	STORED_METHOD("-pm0-"),
+	{ "-lh1-", 4096 - 60, 3, 60, 0, 0,
+	  lh1_init, lh1_literal, lh1_copy, lh1_finish },
+	{ "-lz5-", 4096 - 18, 3, 18, 0, 0,
+	  lz5_init, lz5_literal, lz5_copy, lz5_finish },
+	{ "-lzs-", 2048 - 17, 2, 17, 0, 0,
+	  bitstream_init, lzs_literal, lzs_copy, bitstream_finish },
+	{ "-lh4-", 4096, 3, 256, 4, 14,
+	  new_init, new_literal, new_copy, new_finish },
+	NEW_METHOD("-lh5-", 14, 4),
+	NEW_METHOD("-lh6-", 16, 5),
+	NEW_METHOD("-lh7-", 17, 5),
+	NEW_METHOD("-lhx-", 20, 5),
+};
+
+static const Method *find_method(char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(methods) / sizeof(*methods); ++i) {
+		if (!strcmp(methods[i].name, name)
+		 || !strncmp(methods[i].name + 1, name, 3)) {
+			return &methods[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Process a chunk of generated data: update the CRC, and for stored
+// methods write it out directly.
+
+static void flush_chunk(Generator *gen)
+{
+	lha_crc16_buf(&gen->crc, gen->chunk, gen->chunk_len);
+
+	if (gen->stored != NULL) {
+		fwrite(gen->chunk, 1, gen->chunk_len, gen->stored);
+	}
+
+	gen->chunk_len = 0;
+}
+
+static void generate_byte(Generator *gen, uint8_t b)
+{
+	gen->history[gen->position & (HISTORY_SIZE - 1)] = b;
+	++gen->position;
+
+	gen->chunk[gen->chunk_len++] = b;
+
+	if (gen->chunk_len == DATA_CHUNK_SIZE) {
+		flush_chunk(gen);
+	}
+}
+
+// Literals are taken from the first 'alphabet' byte values, weighted
+// toward the lower values so that they are not evenly distributed.
+
+static uint8_t random_literal(Generator *gen, Options *options)
+{
+	unsigned int a, b;
+
+	a = random_below(gen, options->alphabet);
+	b = random_below(gen, options->alphabet);
+
+	return (uint8_t) (a < b ? a : b);
+}
+
+// Copy distances are chosen with a random number of bits, so that
+// short distances are more likely than long ones, as in real data.
+
+static unsigned int random_distance(Generator *gen, unsigned int limit)
+{
+	unsigned int bits, low, high;
+
+	for (bits = 0; (1U << bits) <= limit; ++bits);
+
+	bits = 1 + random_below(gen, bits);
+	low = 1U << (bits - 1);
+	high = (1U << bits) - 1;
+
+	if (high > limit) {
+		high = limit;
+	}
+
+	return low + random_below(gen, high - low + 1);
+}
+
+// Generate the data for an archived file, passing the commands that
+// produce it to the encoder.
+
+static void generate_data(Generator *gen, Encoder *encoder,
+                          Options *options)
+{
+	const Method *method = encoder->method;
+	unsigned int len, max_len, distance, limit, i;
+	uint64_t remaining;
+	uint8_t b;
+
+	gen->position = 0;
+	gen->chunk_len = 0;
+	gen->crc = 0;
+
+	for (remaining = options->length; remaining > 0; remaining -= len) {
+
+		max_len = method->max_copy;
+
+		if (options->max_copy != 0 && options->max_copy < max_len) {
+			max_len = options->max_copy;
+		}
+
+		if (max_len > remaining) {
+			max_len = (unsigned int) remaining;
+		}
+
+		limit = method->max_distance != 0 ? method->max_distance
+		                                  : HISTORY_SIZE;
+
+		if (limit > gen->position) {
+			limit = (unsigned int) gen->position;
+		}
+
+		// Copy or literal?
+
+		if (limit > 0 && max_len >= method->min_copy
+		 && random_below(gen, 100) < options->copy_percent) {
+			len = method->min_copy
+			    + random_below(gen, max_len - method->min_copy + 1);
+			distance = random_distance(gen, limit);
+
+			for (i = 0; i < len; ++i) {
+				generate_byte(gen, gen->history[(gen->position - distance)
+				                              & (HISTORY_SIZE - 1)]);
+			}
+
+			method->copy(encoder, len, distance);
+		} else {
+			len = 1;
+			b = random_literal(gen, options);
+			generate_byte(gen, b);
+			method->literal(encoder, b);
+		}
+	}
+
+	flush_chunk(gen);
+}
+
+static void write_uint32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+static void write_uint16(uint8_t *buf, uint16_t value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+}
+
+// Write a level 0 header for an archived file.
+
+static int write_header(FILE *stream, const Method *method, char *filename,
+                        uint64_t compressed_length, uint64_t length,
+                        uint16_t crc)
+{
+	uint8_t buf[HEADER_LEN + 256];
+	size_t filename_len, header_len;
+	unsigned int i;
+	uint8_t checksum;
+
+	filename_len = strlen(filename);
+	header_len = HEADER_LEN + filename_len;
+
+	buf[0] = (uint8_t) (header_len - 2);
+	memcpy(buf + 2, method->name, 5);
+	write_uint32(buf + 7, (uint32_t) compressed_length);
+	write_uint32(buf + 11, (uint32_t) length);
+	write_uint32(buf + 15, ARCHIVE_TIMESTAMP);
+	write_uint16(buf + 19, 0x0020);
+	buf[21] = (uint8_t) filename_len;
+	memcpy(buf + 22, filename, filename_len);
+	write_uint16(buf + 22 + filename_len, crc);
+
+	checksum = 0;
+
+	for (i = 2; i < header_len; ++i) {
+		checksum = (uint8_t) (checksum + buf[i]);
+	}
+
+	buf[1] = checksum;
+
+	return fwrite(buf, header_len, 1, stream) == 1;
+}
+
+// Generate an archived file and add it to the archive. The header is
+// written once the compressed length is known.
+
+static int generate_file(FILE *stream, const Method *method,
+                         Options *options, Generator *gen, char *filename)
+{
+	Encoder encoder;
+	long header_pos, data_pos, end_pos;
+
+	header_pos = ftell(stream);
+	data_pos = header_pos + HEADER_LEN + (long) strlen(filename);
+
+	if (fseek(stream, data_pos, SEEK_SET) != 0) {
+		return 0;
+	}
+
+	memset(&encoder, 0, sizeof(encoder));
+	encoder.method = method;
+	encoder.stream = stream;
+
+	if (!method->init(&encoder)) {
+		return 0;
+	}
+
+	gen->stored = method->max_distance == 0 ? stream : NULL;
+	generate_data(gen, &encoder, options);
+	method->finish(&encoder);
+
+	end_pos = ftell(stream);
+
+	return fseek(stream, header_pos, SEEK_SET) == 0
+	    && write_header(stream, method, filename,
+	                    (uint64_t) (end_pos - data_pos),
+	                    options->length, gen->crc)
+	    && fseek(stream, end_pos, SEEK_SET) == 0;
+}
+
+static int generate_archive(char *filename, const Method *method,
+                            Options *options)
+{
+	Generator gen;
+	FILE *stream;
+	char member_name[32];
+	unsigned int i;
+	int result;
+
+	stream = fopen(filename, "wb");
+
+	if (stream == NULL) {
+		perror(filename);
+		return 0;
+	}
+
+	gen.history = malloc(HISTORY_SIZE);
+
+	if (gen.history == NULL) {
+		fclose(stream);
+		return 0;
+	}
+
+	// Seed the generator; the seed is mixed so that nearby seeds
+	// give unrelated data, and must not be zero.
+
+	gen.rng = (options->seed + 1) * UINT64_C(0x9e3779b97f4a7c15);
+
+	if (gen.rng == 0) {
+		gen.rng = 1;
+	}
+
+	result = 1;
+
+	for (i = 0; result && i < options->members; ++i) {
+		sprintf(member_name, "FILE%04u.BIN", i + 1);
+		result = generate_file(stream, method, options,
+		                       &gen, member_name);
+	}
+
+	// End of archive marker.
+
+	result = result && fputc(0, stream) != EOF;
+	result = fclose(stream) == 0 && result;
+
+	if (!result) {
+		fprintf(stderr, "Error writing to %s\n", filename);
+	}
+
+	free(gen.history);
+
+	return result;
+}
+
+static int parse_size(char *str, uint64_t *result)
+{
+	char *end;
+
+	*result = strtoull(str, &end, 10);
+
+	switch (*end) {
+		case 'k': case 'K':
+			*result <<= 10;
+			++end;
+			break;
+		case 'm': case 'M':
+			*result <<= 20;
+			++end;
+			break;
+		case 'g': case 'G':
+			*result <<= 30;
+			++end;
+			break;
+		default:
+			break;
+	}
+
+	return end != str && *end == '\0';
+}
+
+static void usage(char *progname)
+{
+	unsigned int i;
+
+	printf("Usage: %s [options] <method> <archive>\n"
+	       "\n"
+	       " -s <seed>   Random number seed (default 0)\n"
+	       " -n <count>  Number of files in the archive (default 1)\n"
+	       " -l <size>   Length of each file, with optional K/M/G suffix\n"
+	       "             (default 1M)\n"
+	       " -r <pct>    Percentage of commands that are copies (default 50)\n"
+	       " -a <count>  Number of different literal values (default 256)\n"
+	       " -L <len>    Maximum copy length\n"
+	       "\n"
+	       "Methods:", progname);
+
+	for (i = 0; i < sizeof(methods) / sizeof(*methods); ++i) {
+		printf(" %s", methods[i].name);
+	}
+
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const Method *method;
+	Options options;
+	uint64_t value;
+	int i;
+	char opt;
+
+	options.seed = 0;
+	options.members = 1;
+	options.length = 1 << 20;
+	options.copy_percent = 50;
+	options.alphabet = 256;
+	options.max_copy = 0;
+
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'
+	         && argv[i][2] == '\0'; i += 2) {
+		opt = argv[i][1];
+
+		if (i + 1 >= argc || !parse_size(argv[i + 1], &value)) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		switch (opt) {
+			case 's':
+				options.seed = value;
+				break;
+			case 'n':
+				options.members = (unsigned int) value;
+				break;
+			case 'l':
+				options.length = value;
+				break;
+			case 'r':
+				options.copy_percent = (unsigned int) value;
+				break;
+			case 'a':
+				options.alphabet = (unsigned int) value;
+				break;
+			case 'L':
+				options.max_copy = (unsigned int) value;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (i + 2 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	method = find_method(argv[i]);
+
+	if (method == NULL) {
+		fprintf(stderr, "Unsupported method: %s\n", argv[i]);
+		return 1;
+	}
+
+	if (options.alphabet < 1 || options.alphabet > 256
+	 || options.copy_percent > 100
+	 || options.length > UINT32_MAX) {
+		fprintf(stderr, "Invalid option value\n");
+		return 1;
+	}
+
+	return generate_archive(argv[i + 1], method, &options) ? 0 : 1;
+}
+
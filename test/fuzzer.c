@@ -180,6 +180,7 @@ static unsigned int run_fuzz_test(LHADecoderType *dtype,
                                   uint8_t *data,
                                   size_t data_len)
 {
+	LHADecoder *decoder;
 	uint8_t *read_buf;
 	size_t result;
 	void *handle;
@@ -194,7 +195,11 @@ static unsigned int run_fuzz_test(LHADecoderType *dtype,
 	input_data_len = data_len;
 	input_pos = 0;
 
-	handle = canary_malloc(dtype->extra_size);
+	// The decoder's private data follows an LHADecoder structure, which
+	// the decoders update when statistics are enabled.
+
+	decoder = canary_malloc(sizeof(LHADecoder) + dtype->extra_size);
+	handle = decoder + 1;
 	assert(dtype->init(handle, read_more_data, NULL));
 
 	// Create a buffer into which to decompress data.
@@ -219,8 +224,8 @@ static unsigned int run_fuzz_test(LHADecoderType *dtype,
 		dtype->free(handle);
 	}
 
-	canary_check(handle);
-	canary_free(handle);
+	canary_check(decoder);
+	canary_free(decoder);
 	canary_free(read_buf);
 
 	//printf("Fuzz test complete, %i bytes read\n", cb_data.read);
@@ -121,8 +121,12 @@ static size_t read_data(void *buf, size_t buf_len, void *user_data)
 
 	to_copy = callback_data->buf_len - callback_data->buf_pos;
 
-	if (to_copy > buf_len) {
-		to_copy = buf_len;
+	// Only supply a single byte at a time. Decoders read ahead into
+	// their own buffers, so this keeps buf_pos an accurate measure of
+	// how much of the data has actually been consumed.
+
+	if (to_copy > 1) {
+		to_copy = 1;
 	}
 
 	memcpy(buf, callback_data->buf + callback_data->buf_pos, to_copy);
@@ -0,0 +1,738 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+// Persistent-mode fuzz tester for the decompressors. Unlike fuzzer.c,
+// which decodes one random stream at a time in a single process, this
+// runs a worker thread per processor, each of which keeps a decoder of
+// every type and reuses it for each input with lha_decoder_reset, so
+// that the decoders are tested at close to their real throughput.
+//
+// Inputs are made by mutating a corpus, seeded from the raw compressed
+// streams in test/compressed. Mutated inputs that make a decoder behave
+// differently from before (that stop at a new combination of input and
+// output positions) are added to the corpus, so that testing works its
+// way deeper into the decoders over time. Decoders are allocated with
+// canary blocks around them, which are checked after every input.
+//
+// The number of inputs tested per second is reported for each decoder.
+// If a decoder crashes or hangs, the inputs being tested are dumped to
+// files named input-data.<decoder>.<pid>.<worker>, which can be
+// replayed with fuzzer.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "lib/lha_arch.h"
+#include "lib/lha_decoder.h"
+
+// Largest input that is tested, in bytes.
+
+#define MAX_INPUT_LEN (256 * 1024)
+
+// Length of the decompressed stream for decoders with no seed file.
+
+#define DEFAULT_OUTPUT_LEN (64 * 1024)
+
+// Maximum number of inputs kept in the corpus for each decoder.
+
+#define MAX_CORPUS 1024
+
+// Number of bits in the map of behaviours seen for each decoder, and
+// the granularity of the positions recorded in it.
+
+#define BEHAVIOUR_BITS 16
+#define OUTPUT_BUCKET 256
+#define INPUT_BUCKET 64
+
+// Workers add their execution counts to the totals after this many
+// inputs.
+
+#define STATS_INTERVAL 256
+
+// Seconds between reports, and seconds that a worker can go without
+// finishing an input before it is treated as hung.
+
+#define REPORT_INTERVAL 5
+#define HANG_SECONDS 60
+
+// Size of the canary areas before and after each decoder; this is also
+// the largest alignment that can be given.
+
+#define CANARY_SIZE 64
+
+#define CANARY_BYTE 0xdf
+
+#define MAX_WORKERS 256
+
+typedef struct {
+	uint8_t *data;
+	size_t len;
+} CorpusEntry;
+
+// A decoder type being tested, its corpus, and its statistics. The
+// corpus and statistics are protected by the lock.
+
+typedef struct {
+	char *name;
+	LHADecoderType *dtype;
+	size_t output_len;
+	CorpusEntry corpus[MAX_CORPUS];
+	unsigned int corpus_len;
+	uint8_t behaviours[1 << (BEHAVIOUR_BITS - 3)];
+	uint64_t execs, last_execs;
+} FuzzDecoder;
+
+// Seed files in test/compressed, and the decoders they are used for.
+// Streams for similar algorithms are used to seed those with no file
+// of their own; the mutations soon make them valid enough to be useful.
+
+static const struct {
+	char *name;
+	char *filename;
+	size_t output_len;
+} seeds[] = {
+	{ "-lh0-", "lh0.bin", 18092 },
+	{ "-lz4-", "lh0.bin", 18092 },
+	{ "-pm0-", "lh0.bin", 18092 },
+	{ "-lh1-", "lh1.bin", 18092 },
+	{ "-lh4-", "lh5.bin", 18092 },
+	{ "-lh5-", "lh5.bin", 18092 },
+	{ "-lh6-", "lh6.bin", 18092 },
+	{ "-lh7-", "lh7.bin", 18092 },
+	{ "-lhx-", "lh7.bin", 18092 },
+	{ "-lz5-", "lz5.bin", 18092 },
+	{ "-lzs-", "lzs.bin", 18092 },
+	{ "-pm1-", NULL, DEFAULT_OUTPUT_LEN },
+	{ "-pm2-", "pm2.bin", 18176 },
+};
+
+#define NUM_SEEDS (sizeof(seeds) / sizeof(*seeds))
+
+// State of a worker thread. 'execs' is only written by the worker, and
+// read by the main thread to check that it is still making progress.
+// 'input' is the input currently being tested.
+
+typedef struct {
+	unsigned int id;
+	LHAArchThread *thread;
+	uint64_t rng;
+	LHADecoder *decoders[NUM_SEEDS];
+	uint8_t *input;
+	size_t input_len, input_pos;
+	FuzzDecoder *current;
+	volatile uint64_t execs;
+	uint64_t last_execs;
+	unsigned int stalled;
+	uint64_t unreported[NUM_SEEDS];
+} Worker;
+
+static FuzzDecoder decoders[NUM_SEEDS];
+static unsigned int num_decoders;
+
+static Worker workers[MAX_WORKERS];
+static unsigned int num_workers;
+
+static LHAArchMutex *lock;
+static volatile int stop;
+
+// Random number generator (xorshift64*), with separate state for each
+// worker so that they don't contend for it.
+
+static unsigned int random_int(Worker *worker, unsigned int range)
+{
+	worker->rng ^= worker->rng >> 12;
+	worker->rng ^= worker->rng << 25;
+	worker->rng ^= worker->rng >> 27;
+
+	return (unsigned int) (((worker->rng * 0x2545f4914f6cdd1dULL) >> 32)
+	                       % range);
+}
+
+// Dump the input being tested by a worker to a file.
+
+static void dump_input(Worker *worker)
+{
+	char filename[64];
+	FILE *fstream;
+
+	if (worker->current == NULL) {
+		return;
+	}
+
+	sprintf(filename, "input-data.%s.%i.%u", worker->current->name,
+	        (int) getpid(), worker->id);
+
+	fstream = fopen(filename, "wb");
+
+	if (fstream != NULL) {
+		fwrite(worker->input, 1, worker->input_len, fstream);
+		fclose(fstream);
+		fprintf(stderr, "Input data dumped to %s\n", filename);
+	}
+}
+
+// Abort function, invoked when a test fails. It isn't known which worker
+// caused a crash, so the inputs of all of them are dumped.
+
+static void error_abort(char *message, Worker *worker)
+{
+	unsigned int i;
+
+	fprintf(stderr, "\n--\nTest failed: Error: %s\n", message);
+
+	if (worker != NULL) {
+		dump_input(worker);
+	} else {
+		for (i = 0; i < num_workers; ++i) {
+			dump_input(&workers[i]);
+		}
+	}
+
+	abort();
+}
+
+static void crash_signal(int sig)
+{
+	signal(sig, SIG_DFL);
+	error_abort("Segmentation violation or other crash", NULL);
+}
+
+// Allocator for decoders, which surrounds them with canary areas.
+
+static void *canary_alloc(size_t size, size_t alignment, void *user_data)
+{
+	uint8_t *result;
+
+	assert(alignment <= CANARY_SIZE);
+
+	result = lha_arch_alloc_aligned(size + 2 * CANARY_SIZE, CANARY_SIZE);
+	assert(result != NULL);
+
+	memset(result, CANARY_BYTE, CANARY_SIZE);
+	memset(result + CANARY_SIZE + size, CANARY_BYTE, CANARY_SIZE);
+	memcpy(result, &size, sizeof(size_t));
+
+	return result + CANARY_SIZE;
+}
+
+static void canary_free(void *ptr, size_t size, void *user_data)
+{
+	lha_arch_free_aligned((uint8_t *) ptr - CANARY_SIZE);
+}
+
+static int canary_ok(LHADecoder *decoder)
+{
+	uint8_t *start = (uint8_t *) decoder - CANARY_SIZE;
+	size_t size, i;
+
+	memcpy(&size, start, sizeof(size_t));
+
+	for (i = sizeof(size_t); i < CANARY_SIZE; ++i) {
+		if (start[i] != CANARY_BYTE
+		 || start[CANARY_SIZE + size + i] != CANARY_BYTE) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static const LHADecoderAllocator canary_allocator = {
+	canary_alloc, canary_free, NULL
+};
+
+// Read a seed file into the corpus of a decoder.
+
+static void load_seed(FuzzDecoder *decoder, char *dir, char *filename)
+{
+	char path[256];
+	CorpusEntry *entry;
+	FILE *fstream;
+	long len;
+
+	entry = &decoder->corpus[decoder->corpus_len];
+
+	if (filename != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dir, filename);
+		fstream = fopen(path, "rb");
+
+		if (fstream == NULL) {
+			fprintf(stderr, "Failed to open '%s'\n", path);
+			exit(-1);
+		}
+
+		fseek(fstream, 0, SEEK_END);
+		len = ftell(fstream);
+		fseek(fstream, 0, SEEK_SET);
+
+		if (len <= 0 || len > MAX_INPUT_LEN) {
+			fprintf(stderr, "Bad seed file '%s'\n", path);
+			exit(-1);
+		}
+
+		entry->len = (size_t) len;
+		entry->data = malloc(entry->len);
+		assert(entry->data != NULL);
+		assert(fread(entry->data, 1, entry->len, fstream)
+		       == entry->len);
+		fclose(fstream);
+	} else {
+
+		// No seed; start from random data.
+
+		entry->len = 4096;
+		entry->data = malloc(entry->len);
+		assert(entry->data != NULL);
+		memset(entry->data, 0, entry->len);
+	}
+
+	++decoder->corpus_len;
+}
+
+// Make a new input by mutating one from the corpus. The input is made
+// in the worker's input buffer.
+
+static void mutate(Worker *worker, FuzzDecoder *decoder)
+{
+	CorpusEntry *entry, *other;
+	unsigned int i, n, kind, pos, pos2, len;
+
+	lha_arch_mutex_lock(lock);
+
+	entry = &decoder->corpus[random_int(worker, decoder->corpus_len)];
+	memcpy(worker->input, entry->data, entry->len);
+	worker->input_len = entry->len;
+
+	// Splice on the end of another input.
+
+	if (random_int(worker, 8) == 0) {
+		other = &decoder->corpus[random_int(worker,
+		                                    decoder->corpus_len)];
+		pos = random_int(worker, (unsigned int) worker->input_len);
+		pos2 = random_int(worker, (unsigned int) other->len);
+		len = (unsigned int) other->len - pos2;
+
+		if (pos + len > MAX_INPUT_LEN) {
+			len = MAX_INPUT_LEN - pos;
+		}
+
+		memcpy(worker->input + pos, other->data + pos2, len);
+		worker->input_len = pos + len;
+	}
+
+	lha_arch_mutex_unlock(lock);
+
+	n = 1 + random_int(worker, 4);
+
+	for (i = 0; i < n && worker->input_len > 0; ++i) {
+		kind = random_int(worker, 6);
+		pos = random_int(worker, (unsigned int) worker->input_len);
+
+		switch (kind) {
+			case 0:
+				// Flip a bit.
+				worker->input[pos] ^= 1 << random_int(worker, 8);
+				break;
+
+			case 1:
+				// Set a byte to a random or interesting value.
+				worker->input[pos] = random_int(worker, 2)
+				    ? (uint8_t) random_int(worker, 256)
+				    : (uint8_t) (random_int(worker, 2) ? 0xff : 0);
+				break;
+
+			case 2:
+				// Copy a block from elsewhere in the input.
+				pos2 = random_int(worker,
+				                  (unsigned int) worker->input_len);
+				len = 1 + random_int(worker, 64);
+
+				if (pos + len > worker->input_len) {
+					len = (unsigned int) worker->input_len - pos;
+				}
+				if (pos2 + len > worker->input_len) {
+					len = (unsigned int) worker->input_len - pos2;
+				}
+
+				memmove(worker->input + pos, worker->input + pos2,
+				        len);
+				break;
+
+			case 3:
+				// Truncate.
+				worker->input_len = pos;
+				break;
+
+			case 4:
+				// Insert random bytes.
+				len = 1 + random_int(worker, 16);
+
+				if (worker->input_len + len > MAX_INPUT_LEN) {
+					break;
+				}
+
+				memmove(worker->input + pos + len,
+				        worker->input + pos,
+				        worker->input_len - pos);
+
+				for (pos2 = 0; pos2 < len; ++pos2) {
+					worker->input[pos + pos2] =
+					    (uint8_t) random_int(worker, 256);
+				}
+
+				worker->input_len += len;
+				break;
+
+			case 5:
+				// Delete a block.
+				len = 1 + random_int(worker, 16);
+
+				if (pos + len > worker->input_len) {
+					len = (unsigned int) worker->input_len - pos;
+				}
+
+				memmove(worker->input + pos,
+				        worker->input + pos + len,
+				        worker->input_len - pos - len);
+				worker->input_len -= len;
+				break;
+		}
+	}
+}
+
+// Callback used by the decoders to read the input being tested.
+
+static size_t read_input(void *buf, size_t buf_len, void *user_data)
+{
+	Worker *worker = user_data;
+	size_t n;
+
+	n = worker->input_len - worker->input_pos;
+
+	if (n > buf_len) {
+		n = buf_len;
+	}
+
+	memcpy(buf, worker->input + worker->input_pos, n);
+	worker->input_pos += n;
+
+	return n;
+}
+
+// Decode the worker's input with the specified decoder, reusing the
+// worker's decoder of that type if possible. Returns non-zero if the
+// decoder behaved in a way not seen before.
+
+static int run_input(Worker *worker, unsigned int index)
+{
+	FuzzDecoder *decoder = &decoders[index];
+	LHADecoder **dp = &worker->decoders[index];
+	size_t output_pos, input_pos;
+	unsigned int bit;
+	int result;
+
+	worker->input_pos = 0;
+
+	if (*dp == NULL
+	 || !lha_decoder_reset(*dp, read_input, worker,
+	                       decoder->output_len)) {
+		if (*dp != NULL) {
+			lha_decoder_free(*dp);
+		}
+
+		*dp = lha_decoder_new(decoder->dtype, read_input, worker,
+		                      decoder->output_len);
+
+		if (*dp == NULL) {
+			return 0;
+		}
+	}
+
+	lha_decoder_decode_to(*dp, NULL, NULL);
+
+	if (!canary_ok(*dp)) {
+		error_abort("Canary area check failed", worker);
+	}
+
+	// The behaviour is the point at which decoding stopped: how much
+	// output was produced and how much input was consumed.
+
+	output_pos = lha_decoder_get_length(*dp) / OUTPUT_BUCKET;
+	input_pos = lha_decoder_get_compressed_length(*dp) / INPUT_BUCKET;
+	bit = (unsigned int) ((output_pos * 0x9e3779b1u) ^ input_pos)
+	    & ((1 << BEHAVIOUR_BITS) - 1);
+
+	lha_arch_mutex_lock(lock);
+	result = (decoder->behaviours[bit / 8] & (1 << (bit % 8))) == 0;
+	decoder->behaviours[bit / 8] |= (uint8_t) (1 << (bit % 8));
+	lha_arch_mutex_unlock(lock);
+
+	return result;
+}
+
+// Add the worker's input to the corpus of a decoder. Once the corpus is
+// full, a random entry is replaced. Empty inputs are never added, so
+// that every entry has a byte at which to mutate or splice.
+
+static void add_to_corpus(Worker *worker, FuzzDecoder *decoder)
+{
+	CorpusEntry *entry;
+	uint8_t *data;
+
+	data = malloc(worker->input_len + 1);
+	assert(data != NULL);
+	memcpy(data, worker->input, worker->input_len);
+
+	lha_arch_mutex_lock(lock);
+
+	if (decoder->corpus_len < MAX_CORPUS) {
+		entry = &decoder->corpus[decoder->corpus_len];
+		++decoder->corpus_len;
+	} else {
+		entry = &decoder->corpus[random_int(worker, MAX_CORPUS)];
+		free(entry->data);
+	}
+
+	entry->data = data;
+	entry->len = worker->input_len;
+
+	lha_arch_mutex_unlock(lock);
+}
+
+static void report_execs(Worker *worker)
+{
+	unsigned int i;
+
+	lha_arch_mutex_lock(lock);
+
+	for (i = 0; i < num_decoders; ++i) {
+		decoders[i].execs += worker->unreported[i];
+		worker->unreported[i] = 0;
+	}
+
+	lha_arch_mutex_unlock(lock);
+}
+
+static void run_worker(void *data)
+{
+	Worker *worker = data;
+	unsigned int index;
+
+	while (!stop) {
+		index = random_int(worker, num_decoders);
+		worker->current = &decoders[index];
+
+		mutate(worker, &decoders[index]);
+
+		if (run_input(worker, index) && worker->input_len > 0) {
+			add_to_corpus(worker, &decoders[index]);
+		}
+
+		++worker->unreported[index];
+		++worker->execs;
+
+		if ((worker->execs % STATS_INTERVAL) == 0) {
+			report_execs(worker);
+		}
+	}
+
+	report_execs(worker);
+}
+
+// Check that all workers are still making progress.
+
+static void check_hangs(unsigned int seconds)
+{
+	Worker *worker;
+	unsigned int i;
+
+	for (i = 0; i < num_workers; ++i) {
+		worker = &workers[i];
+
+		if (worker->execs != worker->last_execs) {
+			worker->last_execs = worker->execs;
+			worker->stalled = 0;
+		} else {
+			worker->stalled += seconds;
+
+			if (worker->stalled >= HANG_SECONDS) {
+				error_abort("Decoder hung", worker);
+			}
+		}
+	}
+}
+
+static void print_report(unsigned int seconds, int final)
+{
+	FuzzDecoder *decoder;
+	uint64_t total;
+	unsigned int i;
+
+	lha_arch_mutex_lock(lock);
+
+	for (i = 0; i < num_decoders; ++i) {
+		decoder = &decoders[i];
+		total = decoder->execs - (final ? 0 : decoder->last_execs);
+
+		printf("%s%s: %10.0f execs/s, %6u in corpus\n",
+		       final ? "Total " : "", decoder->name,
+		       seconds > 0 ? (double) total / seconds : 0.0,
+		       decoder->corpus_len);
+
+		decoder->last_execs = decoder->execs;
+	}
+
+	lha_arch_mutex_unlock(lock);
+
+	printf("\n");
+	fflush(stdout);
+}
+
+static void usage(char *progname)
+{
+	printf("Usage: %s [-j workers] [-t seconds] [-s seed] "
+	       "[-c corpus-dir] [lh5 lh6 ...]\n", progname);
+	exit(-1);
+}
+
+// Add a decoder type to test. As names beginning with '-' would be
+// taken as options, they can also be given without the dashes.
+
+static void add_decoder(char *name, char *dir)
+{
+	FuzzDecoder *decoder;
+	char buf[16];
+	unsigned int i;
+
+	if (name[0] != '-' && strlen(name) < sizeof(buf) - 2) {
+		sprintf(buf, "-%s-", name);
+		name = buf;
+	}
+
+	for (i = 0; i < NUM_SEEDS; ++i) {
+		if (!strcmp(seeds[i].name, name)) {
+			break;
+		}
+	}
+
+	if (i >= NUM_SEEDS || lha_decoder_for_name(name) == NULL) {
+		fprintf(stderr, "Unknown decoder type '%s'\n", name);
+		exit(-1);
+	}
+
+	decoder = &decoders[num_decoders];
+	decoder->name = seeds[i].name;
+	decoder->dtype = lha_decoder_for_name(name);
+	decoder->output_len = seeds[i].output_len;
+	load_seed(decoder, dir, seeds[i].filename);
+
+	++num_decoders;
+}
+
+int main(int argc, char *argv[])
+{
+	char *dir = "compressed";
+	unsigned int duration = 0, elapsed, seed, i;
+	int opt;
+
+	num_workers = lha_arch_num_cpus();
+	seed = (unsigned int) time(NULL);
+
+	while ((opt = getopt(argc, argv, "j:t:s:c:")) != -1) {
+		switch (opt) {
+			case 'j':
+				num_workers = (unsigned int) atoi(optarg);
+				break;
+			case 't':
+				duration = (unsigned int) atoi(optarg);
+				break;
+			case 's':
+				seed = (unsigned int) atoi(optarg);
+				break;
+			case 'c':
+				dir = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (num_workers < 1 || num_workers > MAX_WORKERS) {
+		usage(argv[0]);
+	}
+
+	if (optind < argc) {
+		for (i = (unsigned int) optind; i < (unsigned int) argc; ++i) {
+			add_decoder(argv[i], dir);
+		}
+	} else {
+		for (i = 0; i < NUM_SEEDS; ++i) {
+			add_decoder(seeds[i].name, dir);
+		}
+	}
+
+	printf("Fuzzing %u decoder types with %u workers, seed %u\n\n",
+	       num_decoders, num_workers, seed);
+
+	lha_decoder_set_allocator(&canary_allocator);
+	signal(SIGSEGV, crash_signal);
+#ifdef SIGBUS
+	signal(SIGBUS, crash_signal);
+#endif
+	signal(SIGFPE, crash_signal);
+
+	lock = lha_arch_mutex_new();
+	assert(lock != NULL);
+
+	for (i = 0; i < num_workers; ++i) {
+		workers[i].id = i;
+		workers[i].rng = ((uint64_t) seed << 16) + i + 1;
+		workers[i].input = malloc(MAX_INPUT_LEN);
+		assert(workers[i].input != NULL);
+		workers[i].thread = lha_arch_thread_new(run_worker, &workers[i]);
+		assert(workers[i].thread != NULL);
+	}
+
+	for (elapsed = 0; duration == 0 || elapsed < duration; ++elapsed) {
+		sleep(1);
+		check_hangs(1);
+
+		if (((elapsed + 1) % REPORT_INTERVAL) == 0) {
+			print_report(REPORT_INTERVAL, 0);
+		}
+	}
+
+	stop = 1;
+
+	for (i = 0; i < num_workers; ++i) {
+		lha_arch_thread_join(workers[i].thread);
+	}
+
+	print_report(duration, 1);
+
+	return 0;
+}
+
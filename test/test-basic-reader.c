@@ -189,6 +189,164 @@ static void test_read_compressed(void)
 	check_crc_for("archives/pmarc2/sfx.com",   0x3751177e, 7098);
 }
 
+// Check CRC of compressed data, reading it directly from the mapped
+// input file where possible.
+
+static void check_direct_crc_for(char *filename, uint32_t expected_crc,
+                                 size_t expected_len)
+{
+	LHAInputStream *stream;
+	LHABasicReader *reader;
+	LHAFileHeader *header;
+	uint8_t buf[16];
+	uint8_t *data;
+	uint32_t crc;
+	size_t len, direct_len;
+
+	reader = reader_for_file(filename, &stream);
+
+	header = lha_basic_reader_next_file(reader);
+	assert(header != NULL);
+
+	crc = 0; len = 0; direct_len = 0;
+
+	for (;;) {
+		size_t count;
+
+		count = lha_basic_reader_read_compressed_direct(reader,
+		                                                &data, 100);
+
+		if (count > 0) {
+			direct_len += count;
+		} else {
+			count = lha_basic_reader_read_compressed(reader, buf,
+			                                         sizeof(buf));
+			data = buf;
+		}
+
+		if (count == 0) {
+			break;
+		}
+
+		len += count;
+
+		crc32_buf(&crc, data, count);
+	}
+
+	assert(crc == expected_crc);
+	assert(len == expected_len);
+
+	// Archives read from a file are mapped, so most of the data
+	// should have been read without copying.
+
+	assert(direct_len > expected_len / 2);
+
+	lha_basic_reader_free(reader);
+	lha_input_stream_free(stream);
+}
+
+static void test_read_direct(void)
+{
+	check_direct_crc_for("archives/lha213/lh0.lzh",  0xe4690583, 6829);
+	check_direct_crc_for("archives/lha213/lh5.lzh",  0x45b943c8, 7004);
+
+	check_direct_crc_for("archives/lha213/sfx.exe",  0x45b943c8, 7004);
+	check_direct_crc_for("archives/pmarc2/sfx.com",  0x3751177e, 7098);
+}
+
+// Read the compressed data for the first file in the specified archive
+// through a separate range stream, while the original stream is used
+// to read the header again.
+
+static void check_range_for(char *filename, uint32_t expected_crc,
+                            size_t expected_len)
+{
+	LHAInputStream *stream, *range;
+	LHABasicReader *reader, *range_reader;
+	LHAFileHeader *header, *header2;
+	size_t header_offset, data_offset;
+	uint8_t buf[16];
+	uint32_t crc;
+	size_t len, count;
+
+	reader = reader_for_file(filename, &stream);
+
+	header = lha_basic_reader_next_file(reader);
+	assert(header != NULL);
+
+	header_offset = lha_basic_reader_curr_file_offset(reader);
+	data_offset = lha_basic_reader_curr_data_offset(reader);
+	assert(data_offset > header_offset);
+
+	// Read the compressed data using a range stream.
+
+	range = lha_input_stream_new_range(stream, data_offset,
+	                                   header->compressed_length);
+	assert(range != NULL);
+
+	range_reader = lha_basic_reader_new_for_file(range, header);
+	assert(range_reader != NULL);
+	assert(lha_basic_reader_curr_file(range_reader) == header);
+
+	crc = 0; len = 0;
+
+	for (;;) {
+		count = lha_basic_reader_read_compressed(range_reader, buf,
+		                                         sizeof(buf));
+
+		if (count == 0) {
+			break;
+		}
+
+		len += count;
+
+		crc32_buf(&crc, buf, count);
+	}
+
+	assert(crc == expected_crc);
+	assert(len == expected_len);
+
+	// The original stream has not moved; it is still possible to
+	// read the compressed data through it.
+
+	assert(lha_basic_reader_read_compressed(reader, buf, sizeof(buf))
+	       == sizeof(buf));
+
+	lha_basic_reader_free(range_reader);
+	lha_input_stream_free(range);
+
+	// A range stream starting at the header can be read with a
+	// new reader.
+
+	range = lha_input_stream_new_range(stream, header_offset,
+	                                   data_offset - header_offset
+	                                   + header->compressed_length);
+	assert(range != NULL);
+
+	range_reader = lha_basic_reader_new(range);
+	header2 = lha_basic_reader_next_file(range_reader);
+	assert(header2 != NULL);
+	assert(!strcmp(header2->filename, header->filename));
+	assert(lha_basic_reader_curr_data_offset(range_reader) == data_offset);
+	assert(lha_basic_reader_next_file(range_reader) == NULL);
+
+	lha_basic_reader_free(range_reader);
+	lha_input_stream_free(range);
+
+	lha_basic_reader_free(reader);
+	lha_input_stream_free(stream);
+}
+
+static void test_read_range(void)
+{
+	check_range_for("archives/larc333/lz5.lzs",  0x2c1539b5, 8480);
+	check_range_for("archives/lha213/lh0.lzh",   0xe4690583, 6829);
+	check_range_for("archives/lha213/lh5.lzh",   0x45b943c8, 7004);
+
+	check_range_for("archives/lha213/sfx.exe",   0x45b943c8, 7004);
+	check_range_for("archives/pmarc2/sfx.com",   0x3751177e, 7098);
+}
+
 static void check_decode_for(char *filename)
 {
 	LHAInputStream *stream;
@@ -241,13 +399,172 @@ static void test_decode(void)
 	check_decode_for("archives/pmarc2/pm2.pma");
 }
 
+static int strings_equal(char *a, char *b)
+{
+	if (a == NULL || b == NULL) {
+		return a == b;
+	}
+
+	return !strcmp(a, b);
+}
+
+#define MAX_HEADERS 16
+
+// Read all headers from the specified file twice, once using an arena,
+// and check that the results are the same. The arena headers are kept
+// until after the reader has been freed.
+
+static void check_arena_for(char *filename)
+{
+	LHAFileHeader *headers[MAX_HEADERS];
+	LHAInputStream *stream;
+	LHABasicReader *reader;
+	LHAFileHeader *header;
+	unsigned int num_headers, i;
+
+	reader = reader_for_file(filename, &stream);
+	assert(lha_basic_reader_use_arena(reader));
+
+	num_headers = 0;
+
+	while ((header = lha_basic_reader_next_file(reader)) != NULL) {
+		assert(num_headers < MAX_HEADERS);
+		lha_file_header_add_ref(header);
+		headers[num_headers] = header;
+		++num_headers;
+	}
+
+	assert(num_headers > 0);
+
+	lha_basic_reader_free(reader);
+	lha_input_stream_free(stream);
+
+	reader = reader_for_file(filename, &stream);
+
+	for (i = 0; i < num_headers; ++i) {
+		header = lha_basic_reader_next_file(reader);
+		assert(header != NULL);
+
+		assert(strings_equal(header->path, headers[i]->path));
+		assert(strings_equal(header->filename, headers[i]->filename));
+		assert(strings_equal(header->symlink_target,
+		                     headers[i]->symlink_target));
+		assert(strings_equal(header->unix_username,
+		                     headers[i]->unix_username));
+		assert(strings_equal(header->unix_group, headers[i]->unix_group));
+		assert(header->raw_data_len == headers[i]->raw_data_len);
+		assert(!memcmp(header->raw_data, headers[i]->raw_data,
+		               header->raw_data_len));
+		assert(header->length == headers[i]->length);
+		assert(header->crc == headers[i]->crc);
+
+		lha_file_header_free(headers[i]);
+	}
+
+	assert(lha_basic_reader_next_file(reader) == NULL);
+
+	lha_basic_reader_free(reader);
+	lha_input_stream_free(stream);
+}
+
+static void test_arena(void)
+{
+	check_arena_for("archives/lha213/lh5.lzh");
+	check_arena_for("archives/lha_os9_211c/h0_subdir.lzh");
+	check_arena_for("archives/lha_unix114i/h1_subdir.lzh");
+	check_arena_for("archives/lha_unix114i/h2_subdir.lzh");
+	check_arena_for("archives/lha_unix114i/h0_symlink.lzh");
+	check_arena_for("archives/lha_unix114i/h1_symlink2.lzh");
+	check_arena_for("archives/lha_unix114i/h2_symlink3.lzh");
+	check_arena_for("archives/lha_os2_208/h3_subdir.lzh");
+	check_arena_for("archives/pmarc2/pm2.pma");
+}
+
+static void check_headers_equal(LHAFileHeader *a, LHAFileHeader *b)
+{
+	assert(strings_equal(a->path, b->path));
+	assert(strings_equal(a->filename, b->filename));
+	assert(strings_equal(a->symlink_target, b->symlink_target));
+	assert(!strcmp(a->compress_method, b->compress_method));
+	assert(a->compressed_length == b->compressed_length);
+	assert(a->length == b->length);
+	assert(a->crc == b->crc);
+	assert(a->timestamp == b->timestamp);
+}
+
+// Read the headers from the specified file in scan mode, and check
+// that they match the fully decoded headers once the remaining fields
+// have been decoded. 'lazy_flag' is an extra_flags value that is only
+// set once the header is fully decoded.
+
+static void check_scan_for(char *filename, unsigned int lazy_flag)
+{
+	LHAInputStream *stream, *full_stream;
+	LHABasicReader *reader, *full_reader;
+	LHAFileHeader *header, *full_header;
+
+	reader = reader_for_file(filename, &stream);
+	full_reader = reader_for_file(filename, &full_stream);
+	lha_basic_reader_set_scan(reader, 1);
+
+	for (;;) {
+		header = lha_basic_reader_next_file(reader);
+		full_header = lha_basic_reader_next_file(full_reader);
+
+		if (full_header == NULL) {
+			assert(header == NULL);
+			break;
+		}
+
+		assert(header != NULL);
+		check_headers_equal(header, full_header);
+		assert(!LHA_FILE_HAVE_EXTRA(header, lazy_flag));
+		assert(LHA_FILE_HAVE_EXTRA(full_header, lazy_flag));
+
+		assert(lha_file_header_decode_lazy(header));
+		assert(lha_file_header_decode_lazy(header));
+
+		check_headers_equal(header, full_header);
+		assert(header->extra_flags == full_header->extra_flags);
+		assert(header->unix_perms == full_header->unix_perms);
+		assert(header->os9_perms == full_header->os9_perms);
+		assert(header->win_creation_time
+		       == full_header->win_creation_time);
+		assert(header->win_modification_time
+		       == full_header->win_modification_time);
+		assert(header->win_access_time
+		       == full_header->win_access_time);
+	}
+
+	lha_basic_reader_free(reader);
+	lha_basic_reader_free(full_reader);
+	lha_input_stream_free(stream);
+	lha_input_stream_free(full_stream);
+}
+
+static void test_scan(void)
+{
+	check_scan_for("archives/lhmelt_16536/h2_lh5.lzh",
+	               LHA_FILE_WINDOWS_TIMESTAMPS);
+	check_scan_for("archives/lhmelt_16536/h2_subdir.lzh",
+	               LHA_FILE_WINDOWS_TIMESTAMPS);
+	check_scan_for("archives/lha_os9_211c/h2_lh0.lzh",
+	               LHA_FILE_OS9_PERMS);
+	check_scan_for("archives/lha_os9_211c/h2_subdir.lzh",
+	               LHA_FILE_OS9_PERMS);
+}
+
 int main(int argc, char *argv[])
 {
 	test_create_free();
 	test_read_directory();
 	test_read_sfx();
 	test_read_compressed();
+	test_read_direct();
+	test_read_range();
 	test_decode();
+	test_arena();
+	test_scan();
 
 	return 0;
 }
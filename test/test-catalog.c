@@ -0,0 +1,647 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "lib/lha_arch.h"
+#include "lib/public/lha_catalog.h"
+#include "lib/public/lha_reader.h"
+#include "lib/public/lha_writer.h"
+
+static LHACatalog *catalog_for_file(char *filename, LHAInputStream **stream)
+{
+	LHACatalog *catalog;
+
+	*stream = lha_input_stream_from(filename);
+	assert(*stream != NULL);
+
+	catalog = lha_catalog_new(*stream);
+	assert(catalog != NULL);
+
+	return catalog;
+}
+
+// Check that the entries in the catalog are laid out one after another
+// in the archive.
+
+static void check_offsets(LHACatalog *catalog, size_t first_offset)
+{
+	LHACatalogEntry *entry, *next;
+	unsigned int i;
+
+	entry = lha_catalog_get(catalog, 0);
+	assert(entry != NULL);
+	assert(entry->header_offset == first_offset);
+
+	for (i = 0; i < lha_catalog_num_entries(catalog); ++i) {
+		entry = lha_catalog_get(catalog, i);
+		assert(entry->data_offset > entry->header_offset);
+
+		next = lha_catalog_get(catalog, i + 1);
+
+		if (next != NULL) {
+			assert(next->header_offset == entry->data_offset
+			       + entry->header->compressed_length);
+		}
+	}
+}
+
+static void test_subdir(void)
+{
+	static char *paths[] = {
+		"subdir/",
+		"subdir/subdir2/",
+		"subdir/subdir2/hello.txt",
+	};
+	LHAInputStream *stream;
+	LHACatalog *catalog;
+	LHACatalogEntry *entry;
+	unsigned int i;
+
+	catalog = catalog_for_file("archives/lha_unix114i/h1_subdir.lzh",
+	                           &stream);
+
+	assert(lha_catalog_num_entries(catalog) == 3);
+	assert(lha_catalog_get(catalog, 3) == NULL);
+
+	for (i = 0; i < 3; ++i) {
+		entry = lha_catalog_get(catalog, i);
+		assert(!strcmp(entry->path, paths[i]));
+		assert(lha_catalog_find(catalog, paths[i]) == entry);
+	}
+
+	entry = lha_catalog_get(catalog, 2);
+	assert(!strcmp(entry->header->compress_method, "-lh0-"));
+	assert(entry->header->compressed_length == 12);
+
+	assert(lha_catalog_find(catalog, "subdir") == NULL);
+	assert(lha_catalog_find(catalog, "hello.txt") == NULL);
+	assert(lha_catalog_find(catalog, "") == NULL);
+
+	check_offsets(catalog, 0);
+
+	lha_catalog_free(catalog);
+	lha_input_stream_free(stream);
+}
+
+static void test_sfx(void)
+{
+	LHAInputStream *stream;
+	LHACatalog *catalog;
+	LHACatalogEntry *entry;
+
+	catalog = catalog_for_file("archives/lha213/sfx.exe", &stream);
+
+	assert(lha_catalog_num_entries(catalog) == 1);
+
+	// The header follows the self-extractor code.
+
+	entry = lha_catalog_get(catalog, 0);
+	assert(entry->header_offset > 0);
+	assert(lha_catalog_find(catalog, "gpl-2") == entry);
+	check_offsets(catalog, entry->header_offset);
+
+	lha_catalog_free(catalog);
+	lha_input_stream_free(stream);
+}
+
+static void test_truncated(void)
+{
+	LHAInputStream *stream;
+	LHACatalog *catalog;
+
+	// Entries found before the truncation are still present.
+
+	catalog = catalog_for_file("archives/regression/truncated.lzh", &stream);
+
+	assert(lha_catalog_num_entries(catalog) == 1);
+	assert(lha_catalog_find(catalog, "gpl-2") != NULL);
+
+	lha_catalog_free(catalog);
+	lha_input_stream_free(stream);
+}
+
+// Save the catalog for the specified archive to an index, and check
+// that it can be loaded again.
+
+static void check_save_load(char *filename)
+{
+	LHAInputStream *stream;
+	LHACatalog *catalog, *loaded;
+	LHACatalogEntry *entry, *loaded_entry;
+	FILE *archive, *index, *other;
+	unsigned int i;
+	int c;
+
+	catalog = catalog_for_file(filename, &stream);
+
+	archive = fopen(filename, "rb");
+	assert(archive != NULL);
+	index = tmpfile();
+	assert(index != NULL);
+
+	assert(lha_catalog_save(catalog, index, archive));
+
+	rewind(index);
+	loaded = lha_catalog_load(index, archive);
+	assert(loaded != NULL);
+
+	assert(lha_catalog_num_entries(loaded)
+	       == lha_catalog_num_entries(catalog));
+
+	for (i = 0; i < lha_catalog_num_entries(catalog); ++i) {
+		entry = lha_catalog_get(catalog, i);
+		loaded_entry = lha_catalog_get(loaded, i);
+
+		assert(!strcmp(entry->path, loaded_entry->path));
+		assert(entry->header_offset == loaded_entry->header_offset);
+		assert(entry->data_offset == loaded_entry->data_offset);
+		assert(entry->header->compressed_length
+		       == loaded_entry->header->compressed_length);
+		assert(entry->header->crc == loaded_entry->header->crc);
+		assert(lha_catalog_find(loaded, entry->path) == loaded_entry);
+	}
+
+	lha_catalog_free(loaded);
+
+	// The index does not match a different archive.
+
+	other = fopen("archives/lha213/lh0.lzh", "rb");
+	assert(other != NULL);
+	rewind(index);
+	assert(lha_catalog_load(index, other) == NULL);
+	fclose(other);
+
+	// Corrupting a stored header is detected. The headers are
+	// followed by the (empty) lists of checkpoints.
+
+	fseek(index, -1 - 4 * (long) i, SEEK_END);
+	c = fgetc(index);
+	fseek(index, -1 - 4 * (long) i, SEEK_END);
+	fputc(c ^ 0xff, index);
+	rewind(index);
+	assert(lha_catalog_load(index, archive) == NULL);
+
+	fclose(index);
+	fclose(archive);
+	lha_catalog_free(catalog);
+	lha_input_stream_free(stream);
+}
+
+static void test_save_load(void)
+{
+	check_save_load("archives/lha_unix114i/h1_subdir.lzh");
+	check_save_load("archives/lha213/sfx.exe");
+	check_save_load("archives/regression/multiple.lzh");
+	check_save_load("archives/lha_amiga_122/level2.lzh");
+}
+
+// Read the whole of the first file in an archive.
+
+static uint8_t *read_file(char *filename, size_t *len)
+{
+	LHAInputStream *stream;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	uint8_t *data;
+
+	stream = lha_input_stream_from(filename);
+	assert(stream != NULL);
+	reader = lha_reader_new(stream);
+	assert(reader != NULL);
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+
+	data = malloc(header->length);
+	assert(data != NULL);
+	*len = lha_reader_read(reader, data, header->length);
+	assert(*len == header->length);
+
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+
+	return data;
+}
+
+// Seek to various positions in the first file in an archive, and check
+// that the data read matches.
+
+static void check_seeks(char *filename, LHACatalogEntry *entry,
+                        uint8_t *data, size_t data_len)
+{
+	static const size_t offsets[] = {
+		4000, 100, 200000, 200001, 0, 900000, 12345, 190000, 1241000,
+	};
+	LHAInputStream *stream;
+	LHAReader *reader;
+	uint8_t buf[1000];
+	size_t offset, len;
+	unsigned int i;
+
+	stream = lha_input_stream_from(filename);
+	assert(stream != NULL);
+	reader = lha_reader_new(stream);
+	assert(reader != NULL);
+	assert(lha_reader_next_file(reader) != NULL);
+
+	for (i = 0; i < sizeof(offsets) / sizeof(*offsets); ++i) {
+		offset = offsets[i] % data_len;
+
+		assert(lha_reader_seek(reader, offset, entry->checkpoints,
+		                       entry->num_checkpoints));
+
+		len = lha_reader_read(reader, buf, sizeof(buf));
+		assert(len == sizeof(buf) || offset + len == data_len);
+		assert(!memcmp(buf, data + offset, len));
+	}
+
+	// Seeking to the end is allowed, but not past it.
+
+	assert(lha_reader_seek(reader, data_len, entry->checkpoints,
+	                       entry->num_checkpoints));
+	assert(lha_reader_read(reader, buf, sizeof(buf)) == 0);
+	assert(!lha_reader_seek(reader, data_len + 1, entry->checkpoints,
+	                        entry->num_checkpoints));
+
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+}
+
+static void check_checkpoints(char *filename)
+{
+	LHAInputStream *stream;
+	LHACatalog *catalog, *loaded;
+	LHACatalogEntry *entry, *loaded_entry;
+	FILE *archive, *index;
+	uint8_t *data;
+	size_t data_len;
+	unsigned int i;
+
+	data = read_file(filename, &data_len);
+
+	catalog = catalog_for_file(filename, &stream);
+	entry = lha_catalog_get(catalog, 0);
+
+	// Seeking works without checkpoints, by decoding from the start.
+
+	check_seeks(filename, entry, data, data_len);
+
+	assert(lha_catalog_add_checkpoints(catalog, stream, 0, 4096));
+	assert(entry->num_checkpoints > 0);
+
+	for (i = 1; i < entry->num_checkpoints; ++i) {
+		assert(entry->checkpoints[i].output_offset
+		       >= entry->checkpoints[i - 1].output_offset + 4096);
+		assert(entry->checkpoints[i].input_bits
+		       > entry->checkpoints[i - 1].input_bits);
+	}
+
+	check_seeks(filename, entry, data, data_len);
+
+	// The checkpoints are kept when saved to an index.
+
+	archive = fopen(filename, "rb");
+	assert(archive != NULL);
+	index = tmpfile();
+	assert(index != NULL);
+
+	assert(lha_catalog_save(catalog, index, archive));
+	rewind(index);
+	loaded = lha_catalog_load(index, archive);
+	assert(loaded != NULL);
+
+	loaded_entry = lha_catalog_get(loaded, 0);
+	assert(loaded_entry->num_checkpoints == entry->num_checkpoints);
+
+	for (i = 0; i < entry->num_checkpoints; ++i) {
+		assert(loaded_entry->checkpoints[i].output_offset
+		       == entry->checkpoints[i].output_offset);
+		assert(loaded_entry->checkpoints[i].state_len
+		       == entry->checkpoints[i].state_len);
+		assert(!memcmp(loaded_entry->checkpoints[i].state,
+		               entry->checkpoints[i].state,
+		               entry->checkpoints[i].state_len));
+	}
+
+	check_seeks(filename, loaded_entry, data, data_len);
+
+	lha_catalog_free(loaded);
+	fclose(index);
+	fclose(archive);
+	lha_catalog_free(catalog);
+	lha_input_stream_free(stream);
+	free(data);
+}
+
+static void test_checkpoints(void)
+{
+	LHAInputStream *stream;
+	LHACatalog *catalog;
+
+	check_checkpoints("archives/lha213/lh5_long.lzh");
+	check_checkpoints("archives/lha_unix114i/lh6_long.lzh");
+	check_checkpoints("archives/lha_unix114i/lh7_long.lzh");
+	check_checkpoints("archives/lharc113/long.lzh");
+	check_checkpoints("archives/larc333/long.lzs");
+	check_checkpoints("archives/pmarc124/pm1_long.pma");
+	check_checkpoints("archives/pmarc2/long.pma");
+
+	// Stored files support checkpoints too, but directories have no
+	// data to decode.
+
+	catalog = catalog_for_file("archives/lha_unix114i/h1_subdir.lzh",
+	                           &stream);
+	assert(!lha_catalog_add_checkpoints(catalog, stream, 0, 4096));
+	assert(lha_catalog_add_checkpoints(catalog, stream, 2, 4096));
+	lha_catalog_free(catalog);
+	lha_input_stream_free(stream);
+}
+
+static void test_select(void)
+{
+	static const unsigned int entries[] = { 2 };
+	static const unsigned int bad_entries[] = { 2, 1 };
+	LHAInputStream *stream, *read_stream;
+	LHACatalog *catalog;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	char buf[32];
+
+	catalog = catalog_for_file("archives/lha_unix114i/h1_subdir.lzh",
+	                           &stream);
+
+	read_stream = lha_input_stream_from(
+	    "archives/lha_unix114i/h1_subdir.lzh");
+	assert(read_stream != NULL);
+	reader = lha_reader_new(read_stream);
+	assert(reader != NULL);
+
+	// Indices must be in ascending order and within range.
+
+	assert(!lha_reader_select(reader, catalog, bad_entries, 2));
+
+	// Only the selected file is returned.
+
+	assert(lha_reader_select(reader, catalog, entries, 1));
+
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+	assert(!strcmp(header->path, "subdir/subdir2/"));
+	assert(!strcmp(header->filename, "hello.txt"));
+	assert(lha_reader_read(reader, buf, sizeof(buf)) == 12);
+	assert(!memcmp(buf, "hello world\n", 12));
+
+	assert(lha_reader_next_file(reader) == NULL);
+
+	lha_reader_free(reader);
+	lha_input_stream_free(read_stream);
+	lha_catalog_free(catalog);
+	lha_input_stream_free(stream);
+}
+
+static void test_duplicates(void)
+{
+	LHAInputStream *stream;
+	LHACatalog *catalog;
+
+	// The third file is a copy of the first, with different
+	// permissions; the second file is unique.
+
+	catalog = catalog_for_file("archives/regression/duplicate.lzh",
+	                           &stream);
+
+	assert(lha_catalog_get(catalog, 2)->duplicate_of == 2);
+	assert(lha_catalog_find_duplicates(catalog, stream));
+	assert(lha_catalog_get(catalog, 0)->duplicate_of == 0);
+	assert(lha_catalog_get(catalog, 1)->duplicate_of == 1);
+	assert(lha_catalog_get(catalog, 2)->duplicate_of == 0);
+
+	lha_catalog_free(catalog);
+	lha_input_stream_free(stream);
+
+	// In an archive without copies, every file is the first copy of
+	// its contents.
+
+	catalog = catalog_for_file("archives/lha_unix114i/h1_subdir.lzh",
+	                           &stream);
+
+	assert(lha_catalog_find_duplicates(catalog, stream));
+	assert(lha_catalog_get(catalog, 0)->duplicate_of == 0);
+	assert(lha_catalog_get(catalog, 1)->duplicate_of == 1);
+	assert(lha_catalog_get(catalog, 2)->duplicate_of == 2);
+
+	lha_catalog_free(catalog);
+	lha_input_stream_free(stream);
+}
+
+// Archive in memory, read as a remote file with a count of the data
+// fetched. Fetches are made from several threads at once.
+
+typedef struct {
+	uint8_t *data;
+	size_t data_len;
+	LHAArchMutex *lock;
+	unsigned int fetches;
+	size_t fetched;
+} RemoteArchive;
+
+static int remote_fetch(void *handle, void *buf, size_t offset,
+                        size_t length)
+{
+	RemoteArchive *remote = handle;
+
+	if (offset >= remote->data_len) {
+		return 0;
+	}
+
+	if (length > remote->data_len - offset) {
+		length = remote->data_len - offset;
+	}
+
+	memcpy(buf, remote->data + offset, length);
+
+	lha_arch_mutex_lock(remote->lock);
+	++remote->fetches;
+	remote->fetched += length;
+	lha_arch_mutex_unlock(remote->lock);
+
+	return (int) length;
+}
+
+static const LHARemoteFileType remote_archive = {
+	remote_fetch,
+	NULL
+};
+
+static LHAInputStream *remote_stream(RemoteArchive *remote)
+{
+	LHAInputStream *stream;
+
+	remote->fetches = 0;
+	remote->fetched = 0;
+
+	stream = lha_input_stream_new_remote(&remote_archive, remote,
+	                                     remote->data_len);
+	assert(stream != NULL);
+
+	return stream;
+}
+
+// Write an archive containing a large file that can't be compressed
+// between small ones.
+
+static void write_remote_archive(RemoteArchive *remote, uint8_t *big,
+                                 size_t big_len)
+{
+	static const char *names[] = { "a.txt", "big.bin", "b.txt", "c.txt" };
+	static char text[] = "hello world\n";
+	LHAFileHeader header;
+	LHAWriter *writer;
+	FILE *fstream;
+	unsigned int i;
+
+	fstream = tmpfile();
+	assert(fstream != NULL);
+	writer = lha_writer_new(fstream);
+	assert(writer != NULL);
+
+	for (i = 0; i < 4; ++i) {
+		memset(&header, 0, sizeof(header));
+		strcpy(header.compress_method, "-lh5-");
+		header.filename = (char *) names[i];
+
+		if (i == 1) {
+			assert(lha_writer_add(writer, &header, big, big_len));
+		} else {
+			assert(lha_writer_add(writer, &header, (uint8_t *) text,
+			                      strlen(text)));
+		}
+	}
+
+	assert(lha_writer_finish(writer));
+	lha_writer_free(writer);
+
+	remote->data_len = (size_t) ftell(fstream);
+	remote->data = malloc(remote->data_len);
+	assert(remote->data != NULL);
+	rewind(fstream);
+	assert(fread(remote->data, 1, remote->data_len, fstream)
+	       == remote->data_len);
+	fclose(fstream);
+}
+
+static void test_remote(void)
+{
+	static const unsigned int entries[] = { 1, 3 };
+	static const unsigned int bad_entries[] = { 3, 1 };
+	RemoteArchive remote;
+	LHAInputStream *stream, *file_stream;
+	LHACatalog *catalog;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	uint8_t *big, *buf;
+	size_t big_len, i;
+	uint32_t seed;
+
+	big_len = 10 * 1024 * 1024 + 123;
+	big = malloc(big_len);
+	buf = malloc(big_len);
+	assert(big != NULL && buf != NULL);
+
+	seed = 1;
+
+	for (i = 0; i < big_len; ++i) {
+		seed = seed * 1103515245 + 12345;
+		big[i] = (uint8_t) (seed >> 24);
+	}
+
+	write_remote_archive(&remote, big, big_len);
+	remote.lock = lha_arch_mutex_new();
+	assert(remote.lock != NULL);
+
+	// Scanning the headers skips the large file, and takes only a
+	// few fetches.
+
+	stream = remote_stream(&remote);
+	catalog = lha_catalog_new(stream);
+	assert(catalog != NULL);
+	assert(lha_catalog_num_entries(catalog) == 4);
+	assert(lha_catalog_get(catalog, 1)->header->compressed_length
+	       == big_len);
+	assert(remote.fetches <= 6);
+	assert(remote.fetched < 256 * 1024);
+	lha_input_stream_free(stream);
+
+	// Only the selected files are fetched, the large one in parts.
+
+	stream = remote_stream(&remote);
+	assert(!lha_catalog_prefetch(catalog, stream, bad_entries, 2));
+	assert(lha_catalog_prefetch(catalog, stream, entries, 2));
+	reader = lha_reader_new(stream);
+	assert(reader != NULL);
+	assert(lha_reader_select(reader, catalog, entries, 2));
+
+	header = lha_reader_next_file(reader);
+	assert(header != NULL && !strcmp(header->filename, "big.bin"));
+	assert(lha_reader_read(reader, buf, big_len) == big_len);
+	assert(!memcmp(buf, big, big_len));
+
+	header = lha_reader_next_file(reader);
+	assert(header != NULL && !strcmp(header->filename, "c.txt"));
+	assert(lha_reader_read(reader, buf, 32) == 12);
+	assert(!memcmp(buf, "hello world\n", 12));
+	assert(lha_reader_next_file(reader) == NULL);
+
+	assert(remote.fetches > big_len / (1024 * 1024));
+	assert(remote.fetched < remote.data_len + 64 * 1024);
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+
+	// Prefetching is only for remote streams.
+
+	file_stream = lha_input_stream_from(
+	    "archives/lha_unix114i/h1_subdir.lzh");
+	assert(file_stream != NULL);
+	assert(!lha_catalog_prefetch(catalog, file_stream, entries, 1));
+	lha_input_stream_free(file_stream);
+
+	lha_catalog_free(catalog);
+	lha_arch_mutex_free(remote.lock);
+	free(remote.data);
+	free(big);
+	free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	test_subdir();
+	test_sfx();
+	test_truncated();
+	test_save_load();
+	test_checkpoints();
+	test_select();
+	test_duplicates();
+	test_remote();
+
+	return 0;
+}
+
@@ -157,12 +157,126 @@ static void test_crc16_empty(void)
 	assert(crc == 0);
 }
 
+// Simple bit-at-a-time CRC implementation, used as a reference.
+
+static uint16_t reference_crc16(uint16_t crc, uint8_t *buf, size_t buf_len)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < buf_len; ++i) {
+		crc ^= buf[i];
+
+		for (j = 0; j < 8; ++j) {
+			if ((crc & 1) != 0) {
+				crc = (crc >> 1) ^ 0xa001;
+			} else {
+				crc >>= 1;
+			}
+		}
+	}
+
+	return crc;
+}
+
+// Test CRC of larger blocks of data, at different lengths, alignments
+// and starting CRC values, to exercise all implementations used.
+
+static void test_crc16_large(void)
+{
+	uint8_t data[1024];
+	unsigned int len, offset;
+	uint16_t crc, start;
+
+	srand(1234);
+
+	for (len = 0; len < sizeof(data); ++len) {
+		data[len] = (uint8_t) rand();
+	}
+
+	for (offset = 0; offset < 16; ++offset) {
+		for (len = 0; len + offset <= sizeof(data); len += 7) {
+			start = (uint16_t) rand();
+
+			crc = start;
+			lha_crc16_buf(&crc, data + offset, len);
+
+			assert(crc == reference_crc16(start, data + offset,
+			                              len));
+		}
+	}
+
+	// Long runs of identical bytes.
+
+	memset(data, 0xff, sizeof(data));
+	crc = 0;
+	lha_crc16_buf(&crc, data, sizeof(data));
+	assert(crc == reference_crc16(0, data, sizeof(data)));
+}
+
+// Test copying data while calculating its CRC.
+
+static void test_crc16_copy(void)
+{
+	uint8_t data[700], copy[700];
+	unsigned int len;
+	uint16_t crc;
+
+	for (len = 0; len < sizeof(data); ++len) {
+		data[len] = (uint8_t) (len * 13 + 5);
+	}
+
+	for (len = 0; len <= sizeof(data); len += 11) {
+		memset(copy, 0, sizeof(copy));
+
+		crc = 0x5555;
+		lha_crc16_copy(&crc, copy, data, len);
+
+		assert(crc == reference_crc16(0x5555, data, len));
+		assert(!memcmp(copy, data, len));
+		assert(len == sizeof(copy) || copy[len] == 0);
+	}
+}
+
+// Test combining the CRCs of separately calculated chunks.
+
+static void test_crc16_combine(void)
+{
+	uint8_t data[300];
+	unsigned int split, len;
+	uint16_t crc_a, crc_b, expected;
+
+	for (len = 0; len < sizeof(data); ++len) {
+		data[len] = (uint8_t) (len * 37 + 11);
+	}
+
+	for (len = 0; len <= sizeof(data); len += 13) {
+		expected = reference_crc16(0, data, len);
+
+		for (split = 0; split <= len; ++split) {
+			crc_a = 0;
+			lha_crc16_buf(&crc_a, data, split);
+			crc_b = 0;
+			lha_crc16_buf(&crc_b, data + split, len - split);
+
+			assert(lha_crc16_combine(crc_a, crc_b, len - split)
+			       == expected);
+		}
+	}
+
+	// Combining with an empty block leaves the CRC unchanged.
+
+	assert(lha_crc16_combine(0x1234, 0, 0) == 0x1234);
+}
+
 int main(int argc, char *argv[])
 {
 	test_crc16_pass();
 	test_crc16_progressive();
 	test_crc16_fail();
 	test_crc16_empty();
+	test_crc16_large();
+	test_crc16_copy();
+	test_crc16_combine();
 
 	return 0;
 }
@@ -25,7 +25,9 @@ CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <inttypes.h>
 
 #include "crc32.h"
+#include "lib/lha_arch.h"
 #include "lib/lha_decoder.h"
+#include "lib/lha_encoder.h"
 
 typedef struct {
 	char *filename;
@@ -139,20 +141,14 @@ static LHADecoder *create_decoder(DecompressState *state,
 	return decoder;
 }
 
-static uint32_t decompress_and_crc(uint8_t *data, size_t data_len,
-                                   char *algorithm, size_t uncompressed_len)
+// Read all data from the specified decoder and return its CRC.
+
+static uint32_t read_all_and_crc(LHADecoder *decoder)
 {
-	LHADecoder *decoder;
-	DecompressState state;
 	uint8_t buf[16];
 	size_t len;
 	uint32_t crc;
 
-	// Create decoder and decompress:
-
-	decoder = create_decoder(&state, data, data_len, algorithm,
-	                         uncompressed_len);
-
 	crc = 0;
 
 	for (;;) {
@@ -165,6 +161,23 @@ static uint32_t decompress_and_crc(uint8_t *data, size_t data_len,
 		crc32_buf(&crc, buf, len);
 	}
 
+	return crc;
+}
+
+static uint32_t decompress_and_crc(uint8_t *data, size_t data_len,
+                                   char *algorithm, size_t uncompressed_len)
+{
+	LHADecoder *decoder;
+	DecompressState state;
+	uint32_t crc;
+
+	// Create decoder and decompress:
+
+	decoder = create_decoder(&state, data, data_len, algorithm,
+	                         uncompressed_len);
+
+	crc = read_all_and_crc(decoder);
+
 	lha_decoder_free(decoder);
 
 	// Calculated CRC:
@@ -222,6 +235,138 @@ static void test_decompress_truncated(void)
 	}
 }
 
+// Decompress each file with a single read into a buffer large enough
+// to hold the whole file, which lets the decoder write to it directly.
+
+static void test_read_whole(void)
+{
+	LHADecoder *decoder;
+	DecompressState state;
+	uint8_t *data, *buf;
+	size_t data_len;
+	uint32_t crc;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		read_file_data(files[i].filename, &data, &data_len);
+
+		decoder = create_decoder(&state, data, data_len,
+		                         files[i].algorithm, files[i].len);
+
+		buf = malloc(files[i].len);
+		assert(buf != NULL);
+		assert(lha_decoder_read(decoder, buf, files[i].len)
+		       == files[i].len);
+		assert(lha_decoder_read(decoder, buf, files[i].len) == 0);
+
+		crc = 0;
+		crc32_buf(&crc, buf, files[i].len);
+		assert(crc == files[i].crc);
+
+		lha_decoder_free(decoder);
+		free(buf);
+		free(data);
+	}
+}
+
+// Sink callback for lha_decoder_decode_to that calculates a CRC32 of
+// the data it receives.
+
+static int crc_sink(uint8_t *buf, size_t buf_len, void *user_data)
+{
+	crc32_buf(user_data, buf, buf_len);
+
+	return 1;
+}
+
+// Sink callback that stops decoding immediately.
+
+static int stop_sink(uint8_t *buf, size_t buf_len, void *user_data)
+{
+	unsigned int *calls = user_data;
+
+	++*calls;
+
+	return 0;
+}
+
+// Decompress files by passing the data to a sink callback.
+
+static void test_decode_to(void)
+{
+	LHADecoder *decoder;
+	DecompressState state;
+	uint8_t *data;
+	size_t data_len;
+	uint32_t crc;
+	unsigned int i, calls;
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		read_file_data(files[i].filename, &data, &data_len);
+
+		decoder = create_decoder(&state, data, data_len,
+		                         files[i].algorithm, files[i].len);
+
+		crc = 0;
+		assert(lha_decoder_decode_to(decoder, crc_sink, &crc));
+		assert(crc == files[i].crc);
+		assert(lha_decoder_get_length(decoder) == files[i].len);
+
+		lha_decoder_free(decoder);
+
+		// A sink can stop decoding early.
+
+		decoder = create_decoder(&state, data, data_len,
+		                         files[i].algorithm, files[i].len);
+		calls = 0;
+		assert(!lha_decoder_decode_to(decoder, stop_sink, &calls));
+		assert(calls == 1);
+		lha_decoder_free(decoder);
+
+		free(data);
+	}
+}
+
+// Check that a decoder can be reset and used to decompress the data again.
+
+static void test_decoder_reset(void)
+{
+	LHADecoder *decoder;
+	DecompressState state;
+	uint8_t *data;
+	size_t data_len;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		read_file_data(files[i].filename, &data, &data_len);
+
+		// Start by decompressing a truncated stream, so that the
+		// decoder is left in a failed state.
+
+		decoder = create_decoder(&state, data, data_len - 500,
+		                         files[i].algorithm, files[i].len);
+		assert(read_all_and_crc(decoder) != files[i].crc);
+
+		// After a reset, the full stream decompresses correctly,
+		// and it can be done again.
+
+		state.data_len = data_len;
+		state.pos = 0;
+		assert(lha_decoder_reset(decoder, read_compressed_data,
+		                         &state, files[i].len));
+		assert(read_all_and_crc(decoder) == files[i].crc);
+		assert(lha_decoder_get_length(decoder) == files[i].len);
+
+		state.pos = 0;
+		assert(lha_decoder_reset(decoder, read_compressed_data,
+		                         &state, files[i].len));
+		assert(read_all_and_crc(decoder) == files[i].crc);
+
+		lha_decoder_free(decoder);
+		free(data);
+	}
+}
+
 static void progress_callback(unsigned int blocks, unsigned int total,
                               void *user)
 {
@@ -246,8 +391,27 @@ static void progress_callback(unsigned int blocks, unsigned int total,
 	++progress->calls;
 }
 
+static void byte_progress_callback(const LHADecoderProgress *byte_progress,
+                                   void *user)
+{
+	LHADecoderProgress *last = user;
+
+	// Both positions only ever move forward, and the lengths stay
+	// the same.
+
+	assert(byte_progress->input_pos >= last->input_pos);
+	assert(byte_progress->output_pos > last->output_pos);
+	assert(byte_progress->input_pos <= byte_progress->input_length);
+	assert(byte_progress->output_pos <= byte_progress->output_length);
+	assert(byte_progress->input_length == last->input_length);
+	assert(byte_progress->output_length == last->output_length);
+
+	*last = *byte_progress;
+}
+
 static void test_progress_for_file(DecoderTestData *file)
 {
+	LHADecoderProgress byte_progress;
 	DecompressState state;
 	ProgressState progress;
 	uint8_t *data;
@@ -268,6 +432,13 @@ static void test_progress_for_file(DecoderTestData *file)
 	lha_decoder_monitor(decoder, progress_callback, &progress);
 	assert(progress.calls == 1);
 
+	byte_progress.input_pos = 0;
+	byte_progress.input_length = data_len;
+	byte_progress.output_pos = 0;
+	byte_progress.output_length = file->len;
+	lha_decoder_monitor_bytes(decoder, byte_progress_callback,
+	                          &byte_progress, data_len);
+
 	// Decompress data.
 
 	for (;;) {
@@ -282,6 +453,18 @@ static void test_progress_for_file(DecoderTestData *file)
 
 	assert(progress.last_pos == progress.total);
 	assert(progress.calls == 1 + progress.total);
+
+	// The callback is invoked as each block is started, so the last
+	// call is made some time before the end of the stream.
+
+	assert(byte_progress.output_pos > 0);
+	assert(byte_progress.input_pos > 0);
+	assert(lha_decoder_get_compressed_length(decoder)
+	       >= byte_progress.input_pos);
+	assert(lha_decoder_get_compressed_length(decoder) <= data_len);
+
+	lha_decoder_free(decoder);
+	free(data);
 }
 
 static void test_progress_feedback(void)
@@ -293,6 +476,621 @@ static void test_progress_feedback(void)
 	}
 }
 
+// Decompress files with a push decoder, feeding the compressed data in
+// chunks of the specified size.
+
+static void push_decode_file(DecoderTestData *file, uint8_t *data,
+                             size_t data_len, size_t chunk_len)
+{
+	LHADecoderType *dtype;
+	LHADecoder *decoder;
+	size_t pos, n;
+	uint32_t crc;
+
+	dtype = lha_decoder_for_name(file->algorithm);
+	decoder = lha_decoder_new_push(dtype, file->len);
+	assert(decoder != NULL);
+
+	crc = 0;
+
+	for (pos = 0; pos < data_len; pos += n) {
+		n = data_len - pos;
+
+		if (n > chunk_len) {
+			n = chunk_len;
+		}
+
+		assert(lha_decoder_feed(decoder, data + pos, n));
+		assert(lha_decoder_drain(decoder, crc_sink, &crc));
+		assert(lha_decoder_get_length(decoder) <= file->len);
+	}
+
+	lha_decoder_feed_end(decoder);
+	assert(lha_decoder_drain(decoder, crc_sink, &crc));
+
+	assert(crc == file->crc);
+	assert(lha_decoder_get_length(decoder) == file->len);
+
+	// Once the end of the data has been signalled, no more can be fed.
+
+	assert(!lha_decoder_feed(decoder, data, 1));
+
+	lha_decoder_free(decoder);
+}
+
+static void test_push_decoder(void)
+{
+	static const size_t chunk_lens[] = { 1, 7, 100, 4096, 100000 };
+	uint8_t *data;
+	size_t data_len;
+	unsigned int i, j;
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		read_file_data(files[i].filename, &data, &data_len);
+
+		for (j = 0; j < sizeof(chunk_lens) / sizeof(*chunk_lens); ++j) {
+			push_decode_file(&files[i], data, data_len,
+			                 chunk_lens[j]);
+		}
+
+		free(data);
+	}
+}
+
+// Check the statistics collected while decoding each file. The test
+// build of the library always collects them.
+
+static void test_stats(void)
+{
+	LHADecoderStats stats;
+	LHADecoder *decoder;
+	DecompressState state;
+	uint8_t *data;
+	size_t data_len;
+	uint64_t copied, copies;
+	unsigned int i, len;
+	int stored;
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		read_file_data(files[i].filename, &data, &data_len);
+
+		decoder = create_decoder(&state, data, data_len,
+		                         files[i].algorithm, files[i].len);
+		assert(read_all_and_crc(decoder) == files[i].crc);
+
+		assert(lha_decoder_get_stats(decoder, &stats));
+		assert(stats.input_bytes > 0);
+		assert(stats.input_bytes <= data_len);
+		assert(stats.output_bytes >= files[i].len);
+
+		// Every byte decoded comes from a literal or a copy,
+		// except for stored data.
+
+		copied = 0;
+		copies = 0;
+
+		for (len = 0; len <= LHA_DECODER_STATS_MAX_COPY; ++len) {
+			copied += stats.copy_lengths[len] * len;
+			copies += stats.copy_lengths[len];
+		}
+
+		assert(copies == stats.copies);
+
+		stored = !strcmp(files[i].filename, "compressed/lh0.bin");
+
+		if (stored) {
+			assert(stats.literals == 0 && stats.copies == 0);
+		} else {
+			assert(stats.literals > 0 && stats.copies > 0);
+			assert(stats.literals + copied == stats.output_bytes);
+		}
+
+		// The -lh?- methods have three trees in each block.
+
+		if (!strncmp(files[i].algorithm, "-lh", 3)
+		 && files[i].algorithm[3] >= '5') {
+			assert(stats.blocks > 0);
+			assert(stats.tree_builds == stats.blocks * 3);
+		} else {
+			assert(stats.blocks == 0);
+		}
+
+		// Statistics start again when the decoder is reset.
+
+		state.pos = 0;
+		assert(lha_decoder_reset(decoder, read_compressed_data,
+		                         &state, files[i].len));
+		assert(lha_decoder_get_stats(decoder, &stats));
+		assert(stats.input_bytes == 0 && stats.output_bytes == 0
+		    && stats.literals == 0 && stats.copies == 0);
+
+		lha_decoder_free(decoder);
+		free(data);
+	}
+}
+
+// Decoders specialized for the running processor must give the same
+// results as the portable decoders that they replace.
+
+static void test_generic_type(void)
+{
+	LHADecoderType *dtype, *generic;
+	LHADecoder *decoder;
+	DecompressState state;
+	uint8_t *data;
+	size_t data_len;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		dtype = lha_decoder_for_name(files[i].algorithm);
+		generic = lha_decoder_generic_type(dtype);
+		assert(generic != NULL);
+		assert(lha_decoder_generic_type(generic) == generic);
+
+		read_file_data(files[i].filename, &data, &data_len);
+
+		state.data = data;
+		state.data_len = data_len;
+		state.pos = 0;
+
+		decoder = lha_decoder_new(generic, read_compressed_data,
+		                          &state, files[i].len);
+		assert(decoder != NULL);
+		assert(read_all_and_crc(decoder) == files[i].crc);
+
+		lha_decoder_free(decoder);
+		free(data);
+	}
+}
+
+// Decode as much data as possible into a buffer.
+
+static size_t read_into(LHADecoder *decoder, uint8_t *buf, size_t buf_len)
+{
+	size_t total, len;
+
+	total = 0;
+
+	while (total < buf_len) {
+		len = lha_decoder_read(decoder, buf + total, buf_len - total);
+
+		if (len == 0) {
+			break;
+		}
+
+		total += len;
+	}
+
+	return total;
+}
+
+// Two-stage decoding must give exactly the same output as normal
+// decoding, even when the compressed data is truncated or corrupt.
+
+static void test_two_stage(void)
+{
+	LHADecoderType *dtype;
+	LHADecoder *decoder;
+	DecompressState state;
+	uint8_t *data, *copy, *expected, *result;
+	size_t data_len, copy_len, expected_len, result_len;
+	unsigned int i, j;
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		dtype = lha_decoder_for_name(files[i].algorithm);
+		read_file_data(files[i].filename, &data, &data_len);
+
+		decoder = create_decoder(&state, data, data_len,
+		                         files[i].algorithm, files[i].len);
+
+		if (dtype->read_tokens == NULL) {
+			assert(!lha_decoder_enable_two_stage(decoder));
+			lha_decoder_free(decoder);
+			free(data);
+			continue;
+		}
+
+		assert(lha_decoder_enable_two_stage(decoder));
+		assert(!lha_decoder_enable_two_stage(decoder));
+		assert(!lha_decoder_record_checkpoints(decoder, 4096));
+		assert(read_all_and_crc(decoder) == files[i].crc);
+
+		// Two-stage decoding stops when the decoder is reset, and
+		// can't start once data has been read.
+
+		state.pos = 0;
+		assert(lha_decoder_reset(decoder, read_compressed_data,
+		                         &state, files[i].len));
+		assert(lha_decoder_record_checkpoints(decoder, 4096));
+		assert(!lha_decoder_enable_two_stage(decoder));
+		assert(read_all_and_crc(decoder) == files[i].crc);
+		lha_decoder_free(decoder);
+
+		copy = malloc(data_len);
+		expected = malloc(files[i].len);
+		result = malloc(files[i].len);
+		assert(copy != NULL && expected != NULL && result != NULL);
+
+		for (j = 0; j < 64; ++j) {
+			memcpy(copy, data, data_len);
+			copy_len = data_len;
+
+			if ((j % 2) == 0) {
+				copy_len = data_len * j / 64;
+			} else {
+				copy[data_len * j / 64] ^= 0x5a;
+			}
+
+			decoder = create_decoder(&state, copy, copy_len,
+			                         files[i].algorithm,
+			                         files[i].len);
+			expected_len = read_into(decoder, expected,
+			                         files[i].len);
+			lha_decoder_free(decoder);
+
+			decoder = create_decoder(&state, copy, copy_len,
+			                         files[i].algorithm,
+			                         files[i].len);
+			assert(lha_decoder_enable_two_stage(decoder));
+			result_len = read_into(decoder, result, files[i].len);
+			lha_decoder_free(decoder);
+
+			assert(result_len == expected_len);
+			assert(!memcmp(result, expected, result_len));
+		}
+
+		free(copy);
+		free(expected);
+		free(result);
+		free(data);
+	}
+}
+
+// Callback that reads compressed data slowly, taking at least two
+// milliseconds for each call.
+
+static size_t read_slowly(void *buf, size_t buf_len, void *user)
+{
+	unsigned int start;
+
+	start = lha_arch_clock_ms();
+
+	while (lha_arch_clock_ms() - start < 2)
+		;
+
+	return read_compressed_data(buf, buf_len, user);
+}
+
+// Decoding stops with a distinct error once a budget is exceeded.
+
+static void test_limits(void)
+{
+	LHADecoderLimits limits;
+	LHADecoder *decoder;
+	DecompressState state;
+	uint8_t *data, *zeroes, *result;
+	size_t data_len, result_len;
+	unsigned int i;
+
+	memset(&limits, 0, sizeof(limits));
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		read_file_data(files[i].filename, &data, &data_len);
+		result = malloc(files[i].len);
+		assert(result != NULL);
+
+		// Output budget: nothing past the budget is returned.
+
+		decoder = create_decoder(&state, data, data_len,
+		                         files[i].algorithm, files[i].len);
+		limits.max_output = files[i].len / 2;
+		lha_decoder_set_limits(decoder, &limits);
+		result_len = read_into(decoder, result, files[i].len);
+		assert(result_len <= files[i].len / 2);
+		assert(lha_decoder_limit_exceeded(decoder)
+		       == LHA_DECODER_LIMIT_OUTPUT);
+		assert(lha_decoder_read(decoder, result, 1) == 0);
+
+		// The budgets are cleared by a reset.
+
+		state.pos = 0;
+		assert(lha_decoder_reset(decoder, read_compressed_data,
+		                         &state, files[i].len));
+		assert(lha_decoder_limit_exceeded(decoder)
+		       == LHA_DECODER_LIMIT_NONE);
+		assert(read_all_and_crc(decoder) == files[i].crc);
+		lha_decoder_free(decoder);
+
+		// A file exactly as long as the budget is fine.
+
+		decoder = create_decoder(&state, data, data_len,
+		                         files[i].algorithm, files[i].len);
+		limits.max_output = files[i].len;
+		lha_decoder_set_limits(decoder, &limits);
+		assert(read_all_and_crc(decoder) == files[i].crc);
+		assert(lha_decoder_limit_exceeded(decoder)
+		       == LHA_DECODER_LIMIT_NONE);
+		lha_decoder_free(decoder);
+
+		// Time budget, with compressed data that arrives slowly.
+
+		state.data = data;
+		state.data_len = data_len;
+		state.pos = 0;
+		decoder = lha_decoder_new(lha_decoder_for_name(
+		                              files[i].algorithm),
+		                          read_slowly, &state, files[i].len);
+		assert(decoder != NULL);
+		limits.max_output = 0;
+		limits.max_time_ms = 1;
+		lha_decoder_set_limits(decoder, &limits);
+		result_len = read_into(decoder, result, files[i].len);
+		assert(result_len < files[i].len);
+		assert(lha_decoder_limit_exceeded(decoder)
+		       == LHA_DECODER_LIMIT_TIME);
+		lha_decoder_free(decoder);
+		limits.max_time_ms = 0;
+
+		free(result);
+		free(data);
+	}
+
+	// Expansion ratio budget, with data that compresses very well.
+
+	zeroes = calloc(1, 1024 * 1024);
+	assert(zeroes != NULL);
+	data = lha_encode("-lh5-", zeroes, 1024 * 1024, &data_len);
+	assert(data != NULL);
+
+	decoder = create_decoder(&state, data, data_len, "-lh5-",
+	                         1024 * 1024);
+	limits.max_ratio = 100;
+	lha_decoder_set_limits(decoder, &limits);
+	result_len = read_into(decoder, zeroes, 1024 * 1024);
+	assert(result_len < 1024 * 1024);
+	assert(result_len >= LHA_DECODER_RATIO_SLACK);
+	assert(lha_decoder_limit_exceeded(decoder)
+	       == LHA_DECODER_LIMIT_RATIO);
+
+	// Setting no limits allows the whole file.
+
+	state.pos = 0;
+	assert(lha_decoder_reset(decoder, read_compressed_data, &state,
+	                         1024 * 1024));
+	lha_decoder_set_limits(decoder, &limits);
+	lha_decoder_set_limits(decoder, NULL);
+	read_all_and_crc(decoder);
+	assert(lha_decoder_get_length(decoder) == 1024 * 1024);
+	assert(lha_decoder_limit_exceeded(decoder)
+	       == LHA_DECODER_LIMIT_NONE);
+	lha_decoder_free(decoder);
+
+	// The sizes in a file's header can be checked before decoding.
+
+	limits.max_output = 1000;
+	assert(lha_decoder_check_sizes(&limits, 1000, 1)
+	       == LHA_DECODER_LIMIT_NONE);
+	assert(lha_decoder_check_sizes(&limits, 1001, 1000)
+	       == LHA_DECODER_LIMIT_OUTPUT);
+	limits.max_output = 0;
+	assert(lha_decoder_check_sizes(&limits,
+	                               LHA_DECODER_RATIO_SLACK + 100, 1)
+	       == LHA_DECODER_LIMIT_NONE);
+	assert(lha_decoder_check_sizes(&limits,
+	                               LHA_DECODER_RATIO_SLACK + 101, 1)
+	       == LHA_DECODER_LIMIT_RATIO);
+
+	free(data);
+	free(zeroes);
+}
+
+// Allocator that counts the memory allocated for decoders.
+
+typedef struct {
+	unsigned int allocs, frees;
+	size_t in_use;
+} AllocState;
+
+static void *counting_alloc(size_t size, size_t alignment, void *user_data)
+{
+	AllocState *state = user_data;
+	void *result;
+
+	assert(alignment >= 64 && (alignment & (alignment - 1)) == 0);
+
+	result = lha_arch_alloc_aligned(size, alignment);
+	assert(result != NULL);
+	assert(((uintptr_t) result % alignment) == 0);
+
+	++state->allocs;
+	state->in_use += size;
+
+	return result;
+}
+
+static void counting_free(void *ptr, size_t size, void *user_data)
+{
+	AllocState *state = user_data;
+
+	++state->frees;
+	state->in_use -= size;
+
+	lha_arch_free_aligned(ptr);
+}
+
+static void test_allocator(void)
+{
+	LHADecoderAllocator allocator;
+	AllocState state;
+	LHADecoder *decoder;
+	DecompressState decompress;
+	uint8_t *data;
+	size_t data_len;
+	unsigned int i;
+
+	memset(&state, 0, sizeof(state));
+	allocator.alloc = counting_alloc;
+	allocator.free = counting_free;
+	allocator.user_data = &state;
+
+	lha_decoder_set_allocator(&allocator);
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		read_file_data(files[i].filename, &data, &data_len);
+		assert(decompress_and_crc(data, data_len, files[i].algorithm,
+		                          files[i].len) == files[i].crc);
+		free(data);
+	}
+
+	assert(state.allocs == sizeof(files) / sizeof(DecoderTestData));
+
+	// A decoder is freed by the allocator that allocated it, even
+	// if the allocator has since changed.
+
+	decoder = create_decoder(&decompress, NULL, 0, "-lh5-", 0);
+	lha_decoder_set_allocator(NULL);
+	lha_decoder_free(decoder);
+
+	assert(state.frees == state.allocs);
+	assert(state.in_use == 0);
+
+	// Large decoders can be put on huge pages.
+
+	lha_decoder_set_allocator(lha_decoder_huge_page_allocator());
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		read_file_data(files[i].filename, &data, &data_len);
+		assert(decompress_and_crc(data, data_len, files[i].algorithm,
+		                          files[i].len) == files[i].crc);
+		free(data);
+	}
+
+	decoder = create_decoder(&decompress, NULL, 0, "-lhx-", 0);
+	lha_decoder_free(decoder);
+
+	lha_decoder_set_allocator(NULL);
+	assert(state.allocs == sizeof(files) / sizeof(DecoderTestData) + 1);
+}
+
+// Restore a decoder from a saved state, and check that it produces the
+// rest of the data, and the same CRC as decoding the whole stream.
+
+static void check_restored_state(DecoderTestData *file, uint8_t *data,
+                                 size_t data_len, uint8_t *expected,
+                                 uint16_t expected_crc,
+                                 uint8_t *state, size_t state_len)
+{
+	DecompressState decompress;
+	LHADecoder *decoder;
+	uint64_t output_offset, input_offset;
+	uint8_t *buf;
+	size_t len;
+
+	assert(lha_decoder_state_position(state, state_len, &output_offset,
+	                                  &input_offset));
+	assert(input_offset <= data_len);
+
+	decompress.data = data;
+	decompress.data_len = data_len;
+	decompress.pos = (unsigned int) input_offset;
+
+	decoder = lha_decoder_restore_state(
+	    lha_decoder_for_name(file->algorithm), read_compressed_data,
+	    &decompress, file->len, state, state_len);
+	assert(decoder != NULL);
+
+	buf = malloc(file->len + 1);
+	assert(buf != NULL);
+
+	len = lha_decoder_read(decoder, buf, file->len + 1);
+	assert(output_offset + len == file->len);
+	assert(!memcmp(buf, expected + output_offset, len));
+	assert(lha_decoder_get_length(decoder) == file->len);
+	assert(lha_decoder_get_crc(decoder) == expected_crc);
+
+	free(buf);
+	lha_decoder_free(decoder);
+}
+
+// Decode a file in pieces, saving the decoder state after each one,
+// and check that decoding can be resumed from each state.
+
+static void test_save_state_for_file(DecoderTestData *file)
+{
+	DecompressState decompress;
+	LHADecoder *decoder;
+	uint8_t *data, *expected, *state;
+	uint8_t buf[1001];
+	size_t data_len, state_len, pos, len;
+	unsigned int saved;
+	uint16_t expected_crc;
+
+	read_file_data(file->filename, &data, &data_len);
+
+	expected = malloc(file->len);
+	assert(expected != NULL);
+
+	decoder = create_decoder(&decompress, data, data_len,
+	                         file->algorithm, file->len);
+	assert(lha_decoder_read(decoder, expected, file->len) == file->len);
+	expected_crc = lha_decoder_get_crc(decoder);
+	lha_decoder_free(decoder);
+
+	decoder = create_decoder(&decompress, data, data_len,
+	                         file->algorithm, file->len);
+	saved = 0;
+	pos = 0;
+
+	for (;;) {
+		state = lha_decoder_save_state(decoder, &state_len);
+
+		if (state != NULL) {
+			check_restored_state(file, data, data_len, expected,
+			                     expected_crc, state, state_len);
+
+			// A damaged state is rejected.
+
+			state[state_len / 2] ^= 0x40;
+			assert(lha_decoder_restore_state(
+			    lha_decoder_for_name(file->algorithm),
+			    read_compressed_data, &decompress, file->len,
+			    state, state_len) == NULL);
+
+			free(state);
+			++saved;
+		}
+
+		if (pos >= file->len) {
+			break;
+		}
+
+		// Read an odd amount, so that some decoded data is left
+		// over to be saved with the state.
+
+		len = lha_decoder_read(decoder, buf, sizeof(buf));
+		assert(len > 0);
+		assert(!memcmp(buf, expected + pos, len));
+		pos += len;
+	}
+
+	// The state can be saved at least at the start and the end.
+
+	assert(saved >= 2);
+
+	lha_decoder_free(decoder);
+	free(expected);
+	free(data);
+}
+
+static void test_save_state(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(files) / sizeof(DecoderTestData); ++i) {
+		test_save_state_for_file(&files[i]);
+	}
+}
+
 static void test_invalid_type(void)
 {
 	assert(lha_decoder_for_name("-lzx-") == NULL);
@@ -305,7 +1103,17 @@ int main(int argc, char *argv[])
 {
 	test_decompress();
 	test_decompress_truncated();
+	test_read_whole();
+	test_decode_to();
+	test_decoder_reset();
 	test_progress_feedback();
+	test_push_decoder();
+	test_stats();
+	test_generic_type();
+	test_two_stage();
+	test_limits();
+	test_allocator();
+	test_save_state();
 	test_invalid_type();
 
 	return 0;
@@ -0,0 +1,571 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "lib/lha_arch.h"
+#include "lib/public/lha_reader.h"
+
+// Archives containing a single compressed file, one for each of the
+// main decoder types, including MacLHA files with and without a
+// MacBinary header.
+
+static char *archives[] = {
+	"archives/lha213/lh5.lzh",
+	"archives/lharc113/lh1.lzh",
+	"archives/larc333/lz5.lzs",
+	"archives/pmarc2/pm2.pma",
+	"archives/lha_unix114i/h1_lh0.lzh",
+	"archives/unlha32/h2_lhx.lzh",
+	"archives/maclha_224/l0_lh5.lzh",
+	"archives/maclha_224/l0_nm_lh5.lzh",
+};
+
+static LHAReader *reader_for_file(char *filename, LHAInputStream **stream)
+{
+	LHAReader *reader;
+
+	*stream = lha_input_stream_from(filename);
+	assert(*stream != NULL);
+
+	reader = lha_reader_new(*stream);
+	assert(reader != NULL);
+
+	return reader;
+}
+
+// Read all of the first file in an archive using lha_reader_read.
+
+static uint8_t *read_first_file(char *filename, size_t *len)
+{
+	LHAInputStream *stream;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	uint8_t *result;
+	size_t nbytes;
+
+	reader = reader_for_file(filename, &stream);
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+
+	result = malloc(header->length + 100);
+	assert(result != NULL);
+
+	*len = 0;
+
+	do {
+		nbytes = lha_reader_read(reader, result + *len, 100);
+		*len += nbytes;
+	} while (nbytes > 0);
+
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+
+	return result;
+}
+
+static void test_extract_to_buffer(void)
+{
+	LHAInputStream *stream;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	uint8_t *data, *expected;
+	size_t len, expected_len;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(archives) / sizeof(*archives); ++i) {
+		expected = read_first_file(archives[i], &expected_len);
+
+		reader = reader_for_file(archives[i], &stream);
+		header = lha_reader_next_file(reader);
+		assert(header != NULL);
+
+		data = lha_reader_extract_to_buffer(reader, &len);
+		assert(data != NULL);
+		assert(len == expected_len);
+		assert(len <= header->length);
+		assert(!memcmp(data, expected, len));
+
+		// The data can only be extracted once.
+
+		assert(lha_reader_extract_to_buffer(reader, &len) == NULL);
+
+		free(data);
+		free(expected);
+		lha_reader_free(reader);
+		lha_input_stream_free(stream);
+	}
+}
+
+static void test_extract_into(void)
+{
+	LHAInputStream *stream;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	uint8_t *buf;
+	size_t len;
+
+	reader = reader_for_file("archives/lha213/lh5.lzh", &stream);
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+
+	// The buffer must be large enough for the whole file.
+
+	buf = malloc(header->length);
+	assert(buf != NULL);
+	assert(!lha_reader_extract_into(reader, buf, header->length - 1,
+	                                &len));
+	assert(lha_reader_extract_into(reader, buf, header->length, &len));
+	assert(len == header->length);
+	assert(!memcmp(buf, "                    GNU GENERAL PUBLIC", 38));
+
+	free(buf);
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+
+	// Once some of the data has been read, it is too late.
+
+	reader = reader_for_file("archives/lha213/lh5.lzh", &stream);
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+
+	buf = malloc(header->length);
+	assert(buf != NULL);
+	assert(lha_reader_read(reader, buf, 10) == 10);
+	assert(!lha_reader_extract_into(reader, buf, header->length, &len));
+
+	free(buf);
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+}
+
+static void test_extract_failures(void)
+{
+	LHAInputStream *stream;
+	LHAReader *reader;
+	size_t len;
+
+	// Directories have no data.
+
+	reader = reader_for_file("archives/regression/dir.lzh", &stream);
+	assert(lha_reader_next_file(reader) != NULL);
+	assert(lha_reader_extract_to_buffer(reader, &len) == NULL);
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+
+	// Files that fail to decompress or fail the CRC check.
+
+	reader = reader_for_file("archives/regression/truncated.lzh", &stream);
+	assert(lha_reader_next_file(reader) != NULL);
+	assert(lha_reader_extract_to_buffer(reader, &len) == NULL);
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+}
+
+// Files that exceed the reader's budgets are rejected from their
+// headers, and the budget that was exceeded is reported.
+
+static void test_limits(void)
+{
+	LHADecoderLimits limits;
+	LHAInputStream *stream;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	uint8_t *data;
+	size_t len;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(archives) / sizeof(*archives); ++i) {
+		reader = reader_for_file(archives[i], &stream);
+		header = lha_reader_next_file(reader);
+		assert(header != NULL);
+		assert(lha_reader_limit_exceeded(reader)
+		       == LHA_DECODER_LIMIT_NONE);
+
+		memset(&limits, 0, sizeof(limits));
+		limits.max_output = header->length - 1;
+		lha_reader_set_limits(reader, &limits);
+		assert(lha_reader_read(reader, &len, 1) == 0);
+		assert(lha_reader_extract_to_buffer(reader, &len) == NULL);
+		assert(lha_reader_limit_exceeded(reader)
+		       == LHA_DECODER_LIMIT_OUTPUT);
+
+		// Clearing the budgets allows the file to be read.
+
+		lha_reader_set_limits(reader, NULL);
+		assert(lha_reader_limit_exceeded(reader)
+		       == LHA_DECODER_LIMIT_NONE);
+		data = lha_reader_extract_to_buffer(reader, &len);
+		assert(data != NULL);
+
+		free(data);
+		lha_reader_free(reader);
+		lha_input_stream_free(stream);
+	}
+
+	// None of the test files expand by 100 times.
+
+	reader = reader_for_file("archives/lha213/lh5.lzh", &stream);
+	memset(&limits, 0, sizeof(limits));
+	limits.max_ratio = 100;
+	lha_reader_set_limits(reader, &limits);
+	assert(lha_reader_next_file(reader) != NULL);
+	data = lha_reader_extract_to_buffer(reader, &len);
+	assert(data != NULL);
+	assert(lha_reader_limit_exceeded(reader) == LHA_DECODER_LIMIT_NONE);
+
+	free(data);
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+}
+
+// Archive read from memory, with some of the compressed data changed,
+// to tell whether a file was decompressed or copied from the cache.
+
+typedef struct {
+	uint8_t *data;
+	size_t data_len, pos;
+} MemoryArchive;
+
+static int memory_read(void *handle, void *buf, size_t buf_len)
+{
+	MemoryArchive *archive = handle;
+	size_t n;
+
+	n = archive->data_len - archive->pos;
+
+	if (buf_len < n) {
+		n = buf_len;
+	}
+
+	memcpy(buf, archive->data + archive->pos, n);
+	archive->pos += n;
+
+	return (int) n;
+}
+
+static const LHAInputStreamType memory_source = {
+	memory_read,
+	NULL,
+	NULL
+};
+
+static void load_corrupted(char *filename, MemoryArchive *archive)
+{
+	FILE *fstream;
+	size_t i;
+
+	fstream = fopen(filename, "rb");
+	assert(fstream != NULL);
+	fseek(fstream, 0, SEEK_END);
+	archive->data_len = (size_t) ftell(fstream);
+	archive->data = malloc(archive->data_len);
+	assert(archive->data != NULL);
+	rewind(fstream);
+	assert(fread(archive->data, 1, archive->data_len, fstream)
+	       == archive->data_len);
+	fclose(fstream);
+
+	// The archives are small, so the second half is compressed data.
+
+	for (i = archive->data_len / 2; i < archive->data_len - 2; ++i) {
+		archive->data[i] ^= 0x55;
+	}
+
+	archive->pos = 0;
+}
+
+// Identify an archive to the cache by its filename.
+
+static uint64_t archive_id(char *filename)
+{
+	uint64_t result;
+	char *p;
+
+	result = 0;
+
+	for (p = filename; *p != '\0'; ++p) {
+		result = result * 31 + (uint8_t) *p;
+	}
+
+	return result;
+}
+
+// Read the first file in an archive using a cache, optionally with the
+// compressed data corrupted. Returns non-zero if the data read matches
+// the expected data.
+
+static int read_cached_file(LHADecodeCache *cache, char *filename,
+                            int corrupt, uint8_t *expected,
+                            size_t expected_len)
+{
+	MemoryArchive archive;
+	LHAInputStream *stream;
+	LHAReader *reader;
+	uint8_t *buf;
+	size_t len, nbytes;
+	int result;
+
+	if (corrupt) {
+		load_corrupted(filename, &archive);
+		stream = lha_input_stream_new(&memory_source, &archive);
+		assert(stream != NULL);
+		reader = lha_reader_new(stream);
+		assert(reader != NULL);
+	} else {
+		reader = reader_for_file(filename, &stream);
+	}
+
+	assert(lha_reader_set_cache(reader, cache, archive_id(filename)));
+	assert(lha_reader_next_file(reader) != NULL);
+
+	buf = malloc(expected_len + 100);
+	assert(buf != NULL);
+	len = 0;
+
+	do {
+		nbytes = lha_reader_read(reader, buf + len, 100);
+		len += nbytes;
+	} while (nbytes > 0 && len <= expected_len);
+
+	result = len == expected_len && !memcmp(buf, expected, len);
+
+	// Too late to set a cache now.
+
+	assert(!lha_reader_set_cache(reader, cache, archive_id(filename)));
+
+	free(buf);
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+
+	if (corrupt) {
+		free(archive.data);
+	}
+
+	return result;
+}
+
+static void test_cache(void)
+{
+	LHADecodeCache *cache;
+	LHAInputStream *stream;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	uint8_t *expected, *other, *data;
+	size_t expected_len, other_len, len;
+	char path[64];
+	unsigned int i;
+
+	cache = lha_decode_cache_new(1024 * 1024, NULL);
+	assert(cache != NULL);
+
+	// Once a file has been read, it is copied from the cache rather
+	// than decompressed, so changes to the compressed data don't
+	// matter. Files that may have a MacBinary header are not cached.
+
+	for (i = 0; i < sizeof(archives) / sizeof(*archives); ++i) {
+		expected = read_first_file(archives[i], &expected_len);
+
+		assert(!read_cached_file(cache, archives[i], 1,
+		                         expected, expected_len));
+		assert(read_cached_file(cache, archives[i], 0,
+		                        expected, expected_len));
+
+		if (strstr(archives[i], "maclha") == NULL) {
+			assert(read_cached_file(cache, archives[i], 1,
+			                        expected, expected_len));
+		}
+
+		free(expected);
+	}
+
+	// Cached files can be extracted to a buffer, and seeked within.
+
+	expected = read_first_file("archives/lha213/lh5.lzh", &expected_len);
+	reader = reader_for_file("archives/lha213/lh5.lzh", &stream);
+	assert(lha_reader_set_cache(reader, cache,
+	                            archive_id("archives/lha213/lh5.lzh")));
+	assert(lha_reader_next_file(reader) != NULL);
+	data = lha_reader_extract_to_buffer(reader, &len);
+	assert(data != NULL && len == expected_len);
+	assert(!memcmp(data, expected, len));
+	assert(lha_reader_seek(reader, 1000, NULL, 0));
+	assert(lha_reader_read(reader, data, 10) == 10);
+	assert(!memcmp(data, expected + 1000, 10));
+	free(data);
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+	lha_decode_cache_free(cache);
+
+	// The least recently used files are removed to make space.
+
+	other = read_first_file("archives/lharc113/lh1.lzh", &other_len);
+	cache = lha_decode_cache_new(expected_len, NULL);
+	assert(cache != NULL);
+	assert(read_cached_file(cache, "archives/lha213/lh5.lzh", 0,
+	                        expected, expected_len));
+	assert(read_cached_file(cache, "archives/lha213/lh5.lzh", 1,
+	                        expected, expected_len));
+	assert(read_cached_file(cache, "archives/lharc113/lh1.lzh", 0,
+	                        other, other_len));
+	assert(!read_cached_file(cache, "archives/lha213/lh5.lzh", 1,
+	                         expected, expected_len));
+	lha_decode_cache_free(cache);
+	free(other);
+
+	// Files saved to a cache directory can be used by another cache.
+
+	lha_arch_mkdir("cache.tmp", 0755);
+	cache = lha_decode_cache_new(1024 * 1024, "cache.tmp");
+	assert(cache != NULL);
+	assert(read_cached_file(cache, "archives/lha213/lh5.lzh", 0,
+	                        expected, expected_len));
+	lha_decode_cache_free(cache);
+
+	cache = lha_decode_cache_new(1024 * 1024, "cache.tmp");
+	assert(cache != NULL);
+	assert(read_cached_file(cache, "archives/lha213/lh5.lzh", 1,
+	                        expected, expected_len));
+	lha_decode_cache_free(cache);
+
+	reader = reader_for_file("archives/lha213/lh5.lzh", &stream);
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+	snprintf(path, sizeof(path), "cache.tmp/%016" PRIx64 "-0-%04x.bin",
+	         archive_id("archives/lha213/lh5.lzh"), header->crc);
+	assert(remove(path) == 0);
+	assert(remove("cache.tmp") == 0);
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+	free(expected);
+}
+
+// Check the details of a file in a batch against its header.
+
+static void check_batch_entry(LHAHeaderBatch *batch, unsigned int index,
+                              LHAFileHeader *header)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "%s%s",
+	         header->path != NULL ? header->path : "",
+	         header->filename != NULL ? header->filename : "");
+	assert(!strcmp(batch->names + batch->name_offsets[index], path));
+
+	assert(batch->lengths[index] == header->length);
+	assert(batch->compressed_lengths[index] == header->compressed_length);
+	assert(batch->crcs[index] == header->crc);
+	assert(!strcmp(batch->methods[index], header->compress_method));
+	assert(batch->timestamps[index] == header->timestamp);
+}
+
+static void test_next_batch(void)
+{
+	size_t lengths[2], compressed_lengths[2], data_offsets[2];
+	size_t header_offsets[2], name_offsets[2];
+	unsigned int timestamps[2];
+	uint16_t crcs[2];
+	char methods[2][6];
+	char names[48];
+	LHAHeaderBatch batch;
+	LHAInputStream *stream, *stream2;
+	LHAReader *reader, *reader2;
+	LHAFileHeader *header;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.capacity = 2;
+	batch.lengths = lengths;
+	batch.compressed_lengths = compressed_lengths;
+	batch.crcs = crcs;
+	batch.methods = methods;
+	batch.timestamps = timestamps;
+	batch.header_offsets = header_offsets;
+	batch.data_offsets = data_offsets;
+	batch.name_offsets = name_offsets;
+	batch.names = names;
+
+	// The archive contains "subdir/", "subdir/subdir2/" and
+	// "subdir/subdir2/hello.txt". The batches are checked against
+	// the headers read by another reader.
+
+	reader = reader_for_file("archives/lha_unix114i/h2_subdir.lzh",
+	                         &stream);
+	reader2 = reader_for_file("archives/lha_unix114i/h2_subdir.lzh",
+	                          &stream2);
+
+	// The batch ends early when the name buffer is full.
+
+	batch.names_size = 20;
+	assert(lha_reader_next_batch(reader, &batch) == 1);
+	assert(batch.names_used == 8);
+	assert(header_offsets[0] == 0);
+	assert(data_offsets[0] > header_offsets[0]);
+	check_batch_entry(&batch, 0, lha_reader_next_file(reader2));
+
+	batch.names_size = sizeof(names);
+	assert(lha_reader_next_batch(reader, &batch) == 2);
+	assert(batch.names_used == 16 + 25);
+	assert(header_offsets[1] > header_offsets[0]);
+	check_batch_entry(&batch, 0, lha_reader_next_file(reader2));
+	check_batch_entry(&batch, 1, lha_reader_next_file(reader2));
+
+	assert(lha_reader_next_batch(reader, &batch) == 0);
+	assert(lha_reader_next_file(reader) == NULL);
+
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+	lha_reader_free(reader2);
+	lha_input_stream_free(stream2);
+
+	// A path that doesn't fit in the name buffer at all is an error;
+	// the file can still be read with lha_reader_next_file.
+
+	reader = reader_for_file("archives/lha_unix114i/h2_subdir.lzh",
+	                         &stream);
+
+	batch.names_size = 4;
+	assert(lha_reader_next_batch(reader, &batch) == -1);
+	assert(lha_reader_next_batch(reader, &batch) == -1);
+
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+	assert(!strcmp(header->path, "subdir/"));
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+	assert(!strcmp(header->path, "subdir/subdir2/"));
+
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+}
+
+int main(int argc, char *argv[])
+{
+	test_extract_to_buffer();
+	test_extract_into();
+	test_extract_failures();
+	test_limits();
+	test_cache();
+	test_next_batch();
+
+	return 0;
+}
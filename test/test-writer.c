@@ -0,0 +1,489 @@
+/*
+
+Copyright (c) 2011, 2012, Simon Howard
+
+Permission to use, copy, modify, and/or distribute this software
+for any purpose with or without fee is hereby granted, provided
+that the above copyright notice and this permission notice appear
+in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "lib/lha_encoder.h"
+#include "lib/public/lha_decoder.h"
+#include "lib/public/lha_reader.h"
+#include "lib/public/lha_writer.h"
+
+// Uncompressed test data, from the decoder tests.
+
+#define TEXT_FILE "compressed/lh0.bin"
+
+typedef struct {
+	const uint8_t *data;
+	size_t data_len;
+	size_t pos;
+} ReadState;
+
+static uint8_t *read_file_data(char *filename, size_t *len)
+{
+	FILE *fstream;
+	uint8_t *data;
+
+	fstream = fopen(filename, "rb");
+	assert(fstream != NULL);
+
+	fseek(fstream, 0, SEEK_END);
+	*len = (size_t) ftell(fstream);
+	fseek(fstream, 0, SEEK_SET);
+
+	data = malloc(*len);
+	assert(data != NULL);
+	assert(fread(data, 1, *len, fstream) == *len);
+
+	fclose(fstream);
+
+	return data;
+}
+
+// Fill a buffer with data that is hard to compress.
+
+static void random_data(uint8_t *buf, size_t len, uint32_t seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (uint8_t) (seed >> 16);
+	}
+}
+
+static size_t read_compressed_data(void *buf, size_t buf_len, void *user)
+{
+	ReadState *state = user;
+	size_t result;
+
+	result = state->data_len - state->pos;
+
+	if (buf_len < result) {
+		result = buf_len;
+	}
+
+	memcpy(buf, state->data + state->pos, result);
+	state->pos += result;
+
+	return result;
+}
+
+// Compress a buffer, and check that it decompresses back to the same
+// data.
+
+static size_t check_round_trip(char *method, const uint8_t *data,
+                               size_t data_len)
+{
+	LHADecoder *decoder;
+	ReadState state;
+	uint8_t *compressed, *result;
+	size_t compressed_len, len;
+
+	compressed = lha_encode(method, data, data_len, &compressed_len);
+	assert(compressed != NULL);
+
+	state.data = compressed;
+	state.data_len = compressed_len;
+	state.pos = 0;
+
+	decoder = lha_decoder_new(lha_decoder_for_name(method),
+	                          read_compressed_data, &state, data_len);
+	assert(decoder != NULL);
+
+	result = malloc(data_len + 1);
+	assert(result != NULL);
+
+	len = 0;
+
+	while (len <= data_len) {
+		size_t n = lha_decoder_read(decoder, result + len,
+		                            data_len + 1 - len);
+
+		if (n == 0) {
+			break;
+		}
+
+		len += n;
+	}
+
+	assert(len == data_len);
+	assert(!memcmp(result, data, data_len));
+
+	lha_decoder_free(decoder);
+	free(result);
+	free(compressed);
+
+	return compressed_len;
+}
+
+static void test_encode(void)
+{
+	static char *methods[] = { "-lh5-", "-lh6-", "-lh7-" };
+	uint8_t *text, *buf;
+	size_t text_len, buf_len, i;
+	unsigned int m;
+
+	assert(lha_encoder_supported("-lh5-"));
+	assert(!lha_encoder_supported("-lh1-"));
+	assert(lha_encode("-lh1-", (uint8_t *) "a", 1, &i) == NULL);
+
+	text = read_file_data(TEXT_FILE, &text_len);
+
+	// Long enough for several blocks, and to use copies at the
+	// full distance for each method.
+
+	buf_len = 512 * 1024;
+	buf = malloc(buf_len);
+	assert(buf != NULL);
+
+	for (m = 0; m < sizeof(methods) / sizeof(*methods); ++m) {
+		check_round_trip(methods[m], text, 0);
+		check_round_trip(methods[m], text, 1);
+		check_round_trip(methods[m], text, 3);
+		assert(check_round_trip(methods[m], text, text_len)
+		       < text_len / 2);
+
+		// A single repeated byte: every block uses only one
+		// code and one offset.
+
+		memset(buf, 'x', buf_len);
+		assert(check_round_trip(methods[m], buf, buf_len)
+		       < buf_len / 100);
+
+		// The text repeated, with random data in between to
+		// separate the copies.
+
+		random_data(buf, buf_len, m);
+
+		for (i = 0; i + text_len < buf_len; i += text_len + 50000) {
+			memcpy(buf + i, text, text_len);
+		}
+
+		check_round_trip(methods[m], buf, buf_len);
+
+		random_data(buf, buf_len, m);
+		check_round_trip(methods[m], buf, buf_len);
+	}
+
+	free(buf);
+	free(text);
+}
+
+// Read back the whole of a file that has been written.
+
+static uint8_t *read_stream(FILE *stream, size_t *len)
+{
+	uint8_t *result;
+
+	fseek(stream, 0, SEEK_END);
+	*len = (size_t) ftell(stream);
+	result = malloc(*len);
+	assert(result != NULL);
+	rewind(stream);
+	assert(fread(result, 1, *len, stream) == *len);
+	fclose(stream);
+
+	return result;
+}
+
+// Build an archive containing some test files, and return its contents.
+
+static uint8_t *build_archive(unsigned int num_workers, size_t *len)
+{
+	LHAFileHeader header;
+	LHAWriter *writer;
+	uint8_t *text, *noise, *result;
+	size_t text_len;
+	FILE *stream;
+	unsigned int i;
+
+	text = read_file_data(TEXT_FILE, &text_len);
+	noise = malloc(text_len);
+	assert(noise != NULL);
+	random_data(noise, text_len, 1);
+
+	stream = tmpfile();
+	assert(stream != NULL);
+
+	writer = lha_writer_new(stream);
+	assert(writer != NULL);
+	assert(lha_writer_set_workers(writer, num_workers));
+
+	memset(&header, 0, sizeof(header));
+	header.os_type = LHA_OS_TYPE_UNIX;
+	header.timestamp = 1577836800;
+
+	strcpy(header.compress_method, LHA_COMPRESS_TYPE_DIR);
+	header.path = "dir/";
+	header.extra_flags = LHA_FILE_UNIX_PERMS;
+	header.unix_perms = 040755;
+	assert(lha_writer_add(writer, &header, NULL, 0));
+
+	// Several copies of each file, so that there is work for all of
+	// the worker threads.
+
+	header.extra_flags = LHA_FILE_UNIX_PERMS | LHA_FILE_UNIX_UID_GID;
+	header.unix_perms = 0100644;
+	header.unix_uid = 1000;
+	header.unix_gid = 100;
+
+	for (i = 0; i < 4; ++i) {
+		strcpy(header.compress_method, i % 2 == 0 ? "-lh5-" : "-lh7-");
+		header.filename = "text.txt";
+		assert(lha_writer_add(writer, &header, text, text_len));
+
+		header.filename = "noise.bin";
+		assert(lha_writer_add(writer, &header, noise, text_len));
+
+		strcpy(header.compress_method, "-lh0-");
+		header.filename = "stored.txt";
+		assert(lha_writer_add(writer, &header, text, 100));
+	}
+
+	header.filename = "empty";
+	strcpy(header.compress_method, "-lh5-");
+	assert(lha_writer_add(writer, &header, NULL, 0));
+
+	strcpy(header.compress_method, LHA_COMPRESS_TYPE_DIR);
+	header.filename = "link";
+	header.symlink_target = "../dir/text.txt";
+	header.extra_flags = 0;
+	assert(lha_writer_add(writer, &header, NULL, 0));
+
+	// Unsupported methods, and data for a directory, are rejected.
+
+	header.symlink_target = NULL;
+	assert(!lha_writer_add(writer, &header, text, 1));
+	strcpy(header.compress_method, "-lh1-");
+	assert(!lha_writer_add(writer, &header, text, 1));
+
+	assert(lha_writer_finish(writer));
+	lha_writer_free(writer);
+
+	result = read_stream(stream, len);
+
+	free(noise);
+	free(text);
+
+	return result;
+}
+
+// Read back an archive written by build_archive.
+
+static void check_archive(uint8_t *archive, size_t archive_len)
+{
+	LHAInputStream *stream;
+	LHAReader *reader;
+	LHAFileHeader *header;
+	uint8_t *text, *data;
+	size_t text_len, len;
+	FILE *fstream;
+	unsigned int i;
+
+	text = read_file_data(TEXT_FILE, &text_len);
+
+	fstream = tmpfile();
+	assert(fstream != NULL);
+	assert(fwrite(archive, 1, archive_len, fstream) == archive_len);
+	rewind(fstream);
+
+	stream = lha_input_stream_from_FILE(fstream);
+	assert(stream != NULL);
+	reader = lha_reader_new(stream);
+	assert(reader != NULL);
+
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+	assert(!strcmp(header->compress_method, LHA_COMPRESS_TYPE_DIR));
+	assert(!strcmp(header->path, "dir/"));
+	assert(header->filename == NULL);
+	assert(header->header_level == 2);
+	assert(header->unix_perms == 040755);
+	assert(LHA_FILE_HAVE_EXTRA(header, LHA_FILE_COMMON_CRC));
+
+	for (i = 0; i < 4; ++i) {
+		header = lha_reader_next_file(reader);
+		assert(header != NULL);
+		assert(!strcmp(header->compress_method,
+		               i % 2 == 0 ? "-lh5-" : "-lh7-"));
+		assert(!strcmp(header->path, "dir/"));
+		assert(!strcmp(header->filename, "text.txt"));
+		assert(header->timestamp == 1577836800);
+		assert(header->os_type == LHA_OS_TYPE_UNIX);
+		assert(header->unix_perms == 0100644);
+		assert(header->unix_uid == 1000);
+		assert(header->unix_gid == 100);
+		assert(header->length == text_len);
+		assert(header->compressed_length < text_len);
+
+		data = lha_reader_extract_to_buffer(reader, &len);
+		assert(data != NULL);
+		assert(len == text_len && !memcmp(data, text, len));
+		free(data);
+
+		// Random data does not compress, so it is stored.
+
+		header = lha_reader_next_file(reader);
+		assert(header != NULL);
+		assert(!strcmp(header->filename, "noise.bin"));
+		assert(!strcmp(header->compress_method, "-lh0-"));
+		assert(header->compressed_length == text_len);
+		assert(lha_reader_check(reader, NULL, NULL));
+
+		header = lha_reader_next_file(reader);
+		assert(header != NULL);
+		assert(!strcmp(header->filename, "stored.txt"));
+		assert(!strcmp(header->compress_method, "-lh0-"));
+
+		data = lha_reader_extract_to_buffer(reader, &len);
+		assert(data != NULL);
+		assert(len == 100 && !memcmp(data, text, len));
+		free(data);
+	}
+
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+	assert(!strcmp(header->filename, "empty"));
+	assert(header->length == 0);
+	assert(lha_reader_check(reader, NULL, NULL));
+
+	header = lha_reader_next_file(reader);
+	assert(header != NULL);
+	assert(!strcmp(header->compress_method, LHA_COMPRESS_TYPE_DIR));
+	assert(!strcmp(header->path, "dir/"));
+	assert(!strcmp(header->filename, "link"));
+	assert(!strcmp(header->symlink_target, "../dir/text.txt"));
+	assert(header->unix_perms == 0120777);
+
+	assert(lha_reader_next_file(reader) == NULL);
+
+	lha_reader_free(reader);
+	lha_input_stream_free(stream);
+	fclose(fstream);
+	free(text);
+}
+
+static void test_writer(void)
+{
+	uint8_t *archive, *archive2;
+	size_t len, len2;
+
+	archive = build_archive(1, &len);
+	check_archive(archive, len);
+
+	// Compressing on worker threads gives exactly the same archive.
+
+	archive2 = build_archive(4, &len2);
+	assert(len2 == len && !memcmp(archive2, archive, len));
+
+	free(archive);
+	free(archive2);
+}
+
+// Build an archive from the test file, passing it either in memory or
+// as an open file.
+
+static uint8_t *build_from_file(int from_file, size_t *len)
+{
+	static char *methods[] = { "-lh0-", "-lh5-", "-lh0-" };
+	LHAFileHeader header;
+	LHAWriter *writer;
+	uint8_t *text;
+	size_t text_len;
+	FILE *stream, *input;
+	unsigned int i;
+
+	text = read_file_data(TEXT_FILE, &text_len);
+
+	stream = tmpfile();
+	assert(stream != NULL);
+
+	// Anything written before the writer is created comes first.
+
+	fputs("SFX", stream);
+
+	writer = lha_writer_new(stream);
+	assert(writer != NULL);
+
+	memset(&header, 0, sizeof(header));
+	header.os_type = LHA_OS_TYPE_UNIX;
+	header.filename = "text.txt";
+
+	for (i = 0; i < sizeof(methods) / sizeof(*methods); ++i) {
+		strcpy(header.compress_method, methods[i]);
+
+		if (!from_file) {
+			assert(lha_writer_add(writer, &header, text, text_len));
+			continue;
+		}
+
+		// The input file is closed straight away.
+
+		input = fopen(TEXT_FILE, "rb");
+		assert(input != NULL);
+		assert(lha_writer_add_file(writer, &header, input));
+		fclose(input);
+	}
+
+	// An empty file can't be mapped.
+
+	input = tmpfile();
+	assert(input != NULL);
+	header.filename = "empty";
+	assert(from_file ? lha_writer_add_file(writer, &header, input)
+	                 : lha_writer_add(writer, &header, NULL, 0));
+	fclose(input);
+
+	assert(lha_writer_finish(writer));
+	lha_writer_free(writer);
+
+	free(text);
+
+	return read_stream(stream, len);
+}
+
+static void test_add_file(void)
+{
+	uint8_t *archive, *archive2;
+	size_t len, len2;
+
+	archive = build_from_file(0, &len);
+	archive2 = build_from_file(1, &len2);
+
+	assert(len > 3 && !memcmp(archive, "SFX", 3));
+	assert(len2 == len && !memcmp(archive2, archive, len));
+
+	free(archive);
+	free(archive2);
+}
+
+int main(int argc, char *argv[])
+{
+	test_encode();
+	test_writer();
+	test_add_file();
+
+	return 0;
+}
+